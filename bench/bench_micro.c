@@ -0,0 +1,607 @@
+// Microbenchmarks of hot-path functions, printed as JSON so runs can be compared against a saved baseline.
+//
+// Usage: bench_micro [--torrents <dir>] [--filter <text>] [--samples <n>] [--baseline <file>] [--threshold <percent>]
+//
+// Every case is warmed up, then timed over several samples long enough to swamp clock overhead. The median of
+// the samples is reported. With --baseline, each case is compared against the same case in a previous run's
+// output, and the exit code is 1 if any of them got slower by more than the threshold.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "../src/basic_bencode.h"
+#include "../src/downloading.h"
+#include "../src/file.h"
+#include "../src/messages.h"
+#include "../src/sha1.h"
+
+/// @brief Default amount of timed samples per case
+#define MICRO_SAMPLES 11
+/// @brief Most samples per case
+#define MICRO_MAX_SAMPLES 101
+/// @brief Nanoseconds each case runs untimed before sampling
+#define MICRO_WARMUP_NS 100000000ull
+/// @brief Minimum nanoseconds per sample, iterations are scaled until a sample takes this long
+#define MICRO_SAMPLE_NS 20000000ull
+/// @brief Default percentage a case can get slower than its baseline before it's a regression
+#define MICRO_THRESHOLD 10.0
+/// @brief Pieces in the bitfield cases
+#define MICRO_PIECES (1u << 20)
+/// @brief Blocks per piece in the block tracker cases, as with 256 KiB pieces
+#define MICRO_BLOCKS_PER_PIECE 16
+/// @brief Files in the process_block() cases
+#define MICRO_FILES 10000
+/// @brief Files at the end of the list that process_block() writes to, so open files stay under the fd limit
+#define MICRO_WRITTEN_FILES 64
+/// @brief Piece size hashed by the SHA1 cases
+#define MICRO_PIECE_SIZE (256 * 1024)
+/// @brief Messages per call in the framing cases
+#define MICRO_MESSAGES 256
+
+/**
+ * Runs the code being measured once.
+ *
+ * @param ctx The case's context.
+ */
+typedef void (*micro_run_t)(void *ctx);
+
+/// @brief A baseline result, read from a previous run
+typedef struct {
+    char name[128]; /**< Name of the case */
+    double ns_per_op; /**< Median nanoseconds per operation */
+} micro_baseline_t;
+
+/// @brief Options and state shared by all cases
+typedef struct {
+    const char *filter; /**< Only cases whose name contains this run, or all if nullptr */
+    uint32_t samples; /**< Timed samples per case */
+    micro_baseline_t *baseline; /**< Results of a previous run, or nullptr */
+    uint32_t baseline_amount; /**< Amount of baseline results */
+    double threshold; /**< Percentage slower than the baseline considered a regression */
+    uint32_t printed; /**< Cases printed so far */
+    uint32_t regressions; /**< Cases slower than their baseline by more than threshold */
+} micro_suite_t;
+
+/// @brief Results are written here so the compiler can't drop the calls producing them
+static volatile uint64_t sink;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static const micro_baseline_t *find_baseline(const micro_suite_t *suite, const char *name) {
+    for (uint32_t i = 0; i < suite->baseline_amount; ++i) {
+        if (strcmp(suite->baseline[i].name, name) == 0) return &suite->baseline[i];
+    }
+    return nullptr;
+}
+
+/**
+ * Times a case and prints its JSON entry.
+ *
+ * @param suite The suite.
+ * @param name Name of the case, unique and stable across runs, since baselines are matched by it.
+ * @param run Code being measured.
+ * @param ctx Passed as is to run.
+ * @param ops_per_run Operations each call to run performs, so results are per operation.
+ * @param bytes_per_op Bytes processed by each operation, for throughput, or 0 if it doesn't apply.
+ */
+static void measure(micro_suite_t *suite, const char *name, const micro_run_t run, void *ctx,
+                    const uint64_t ops_per_run, const uint64_t bytes_per_op) {
+    if (suite->filter && !strstr(name, suite->filter)) return;
+
+    // Warming up caches, branch predictors and the allocator, while finding how many runs a sample needs
+    uint64_t runs = 0;
+    const uint64_t warmup_start = monotonic_ns();
+    uint64_t elapsed;
+    do {
+        run(ctx);
+        runs++;
+        elapsed = monotonic_ns() - warmup_start;
+    } while (elapsed < MICRO_WARMUP_NS);
+    uint64_t iterations = runs * MICRO_SAMPLE_NS / elapsed;
+    if (iterations == 0) iterations = 1;
+
+    double ns_per_op[MICRO_MAX_SAMPLES];
+    for (uint32_t i = 0; i < suite->samples; ++i) {
+        const uint64_t start = monotonic_ns();
+        for (uint64_t j = 0; j < iterations; ++j) run(ctx);
+        ns_per_op[i] = (double) (monotonic_ns() - start) / (double) (iterations * ops_per_run);
+    }
+    qsort(ns_per_op, suite->samples, sizeof(double), compare_doubles);
+    const double median = ns_per_op[suite->samples / 2];
+
+    fprintf(stdout, "%s    {\"name\": \"%s\", \"samples\": %u, \"iterations\": %lu, \"ns_per_op\": %.3f, "
+                    "\"min_ns_per_op\": %.3f, \"max_ns_per_op\": %.3f", suite->printed > 0 ? ",\n" : "", name,
+            suite->samples, (unsigned long) (iterations * ops_per_run), median, ns_per_op[0],
+            ns_per_op[suite->samples - 1]);
+    if (bytes_per_op > 0) {
+        fprintf(stdout, ", \"bytes_per_op\": %lu, \"mb_per_s\": %.1f", (unsigned long) bytes_per_op,
+                (double) bytes_per_op * 1e3 / median);
+    }
+    const micro_baseline_t *baseline = find_baseline(suite, name);
+    if (baseline && baseline->ns_per_op > 0) {
+        const double change = (median - baseline->ns_per_op) * 100.0 / baseline->ns_per_op;
+        const bool regression = change > suite->threshold;
+        if (regression) suite->regressions++;
+        fprintf(stdout, ", \"baseline_ns_per_op\": %.3f, \"change_percent\": %.1f, \"regression\": %s",
+                baseline->ns_per_op, change, regression ? "true" : "false");
+    }
+    fprintf(stdout, "}");
+    fflush(stdout);
+    suite->printed++;
+}
+
+/**
+ * Reads the cases of a previous run. Only its own output format is understood: one case per line
+ */
+static bool read_baseline(micro_suite_t *suite, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) return false;
+    char line[1024];
+    uint32_t capacity = 0;
+    while (fgets(line, sizeof(line), file)) {
+        const char *name = strstr(line, "\"name\": \"");
+        const char *value = strstr(line, "\"ns_per_op\": ");
+        if (!name || !value) continue;
+        name += 9;
+        const char *name_end = strchr(name, '"');
+        if (!name_end || (size_t) (name_end - name) >= sizeof(suite->baseline->name)) continue;
+
+        if (suite->baseline_amount == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 32;
+            micro_baseline_t *baseline = realloc(suite->baseline, capacity * sizeof(micro_baseline_t));
+            if (!baseline) break;
+            suite->baseline = baseline;
+        }
+        micro_baseline_t *entry = &suite->baseline[suite->baseline_amount++];
+        memcpy(entry->name, name, name_end - name);
+        entry->name[name_end - name] = '\0';
+        entry->ns_per_op = strtod(value + 13, nullptr);
+    }
+    fclose(file);
+    return true;
+}
+
+/*
+ * parse_metainfo()
+ */
+
+static void run_parse_metainfo(void *ctx) {
+    const mapped_file_t *file = ctx;
+    metainfo_t *metainfo = parse_metainfo(file->data, file->length, LOG_NO);
+    sink += metainfo->info->piece_number;
+    free_metainfo(metainfo);
+}
+
+static void bench_parse_metainfo(micro_suite_t *suite, const char *directory) {
+    DIR *dir = opendir(directory);
+    if (!dir) {
+        fprintf(stderr, "Couldn't open %s, skipping parse_metainfo()\n", directory);
+        return;
+    }
+    // Sorted, so cases come out in the same order on every machine
+    struct dirent **entries;
+    const int32_t amount = scandir(directory, &entries, nullptr, alphasort);
+    closedir(dir);
+    for (int32_t i = 0; i < amount; ++i) {
+        const char *file_name = entries[i]->d_name;
+        const size_t length = strlen(file_name);
+        if (length > 8 && strcmp(file_name + length - 8, ".torrent") == 0) {
+            char path[4096], name[128];
+            snprintf(path, sizeof(path), "%s/%s", directory, file_name);
+            // Cut to fit, like the names baselines are read into
+            snprintf(name, sizeof(name), "parse_metainfo/%.*s", (int) (sizeof(name) - sizeof("parse_metainfo/")),
+                     file_name);
+            // Names end up inside JSON strings
+            for (char *c = name; *c != '\0'; ++c) {
+                if (*c == '"' || *c == '\\') *c = '_';
+            }
+            mapped_file_t *file = map_torrent_file(path, LOG_NO);
+            // Files the parser rejects leak on every call, so they're left out
+            metainfo_t *metainfo = file ? parse_metainfo(file->data, file->length, LOG_NO) : nullptr;
+            if (metainfo) {
+                free_metainfo(metainfo);
+                measure(suite, name, run_parse_metainfo, file, 1, file->length);
+            } else fprintf(stderr, "Couldn't parse %s, skipping it\n", path);
+            unmap_torrent_file(file);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+/*
+ * decode_bencode_list()
+ */
+
+static void run_decode_bencode_list(void *ctx) {
+    uint32_t end = 0;
+    ll *list = decode_bencode_list(ctx, &end, LOG_NO);
+    sink += end;
+    free_bencode_list(list);
+}
+
+/**
+ * Appends a bencoded string to buffer, returning its new length
+ */
+static uint32_t append_bencode_string(char *buffer, const uint32_t length, const char *string) {
+    return length + sprintf(buffer + length, "%zu:%s", strlen(string), string);
+}
+
+static void bench_decode_bencode_list(micro_suite_t *suite) {
+    // A path list like those of multi-file torrents, and a long tracker tier
+    const char *components[] = {"Extras", "Subtitles", "English", "Director commentary", "part.srt"};
+    char path[128];
+    uint32_t length = 0;
+    path[length++] = 'l';
+    for (uint32_t i = 0; i < 5; ++i) length = append_bencode_string(path, length, components[i]);
+    path[length++] = 'e';
+    path[length] = '\0';
+    measure(suite, "decode_bencode_list/path_5", run_decode_bencode_list, path, 1, length);
+
+    char *tier = malloc(64 * 64 + 3);
+    if (!tier) return;
+    length = 0;
+    tier[length++] = 'l';
+    for (uint32_t i = 0; i < 64; ++i) {
+        char url[64];
+        snprintf(url, sizeof(url), "udp://tracker%02u.example.org:6969/announce", i);
+        length = append_bencode_string(tier, length, url);
+    }
+    tier[length++] = 'e';
+    tier[length] = '\0';
+    measure(suite, "decode_bencode_list/tier_64", run_decode_bencode_list, tier, 1, length);
+    free(tier);
+}
+
+/*
+ * piece_complete() and are_bits_set()
+ */
+
+/// @brief Context of the bitfield cases
+typedef struct {
+    unsigned char *bits; /**< Bitfield or block tracker, all set */
+    uint32_t position; /**< Next piece or range start, walked with a fixed stride */
+} micro_bits_t;
+
+static void run_piece_complete(void *ctx) {
+    micro_bits_t *bits = ctx;
+    // Jumping around so every call touches a cold part of the 2 MiB tracker, like received blocks do
+    for (uint32_t i = 0; i < 64; ++i) {
+        bits->position = (bits->position + 40503) & (MICRO_PIECES - 1);
+        sink += piece_complete(bits->bits, bits->position, MICRO_BLOCKS_PER_PIECE * BLOCK_SIZE,
+                               (int64_t) MICRO_PIECES * MICRO_BLOCKS_PER_PIECE * BLOCK_SIZE);
+    }
+}
+
+static void run_are_bits_set_range(void *ctx) {
+    micro_bits_t *bits = ctx;
+    for (uint32_t i = 0; i < 64; ++i) {
+        bits->position = (bits->position + 40503) & (MICRO_PIECES - 1);
+        const uint32_t start = bits->position > MICRO_PIECES - 64 ? MICRO_PIECES - 64 : bits->position;
+        sink += are_bits_set(bits->bits, start, start + 63);
+    }
+}
+
+static void run_are_bits_set_full(void *ctx) {
+    const micro_bits_t *bits = ctx;
+    sink += are_bits_set(bits->bits, 0, MICRO_PIECES - 1);
+}
+
+static void bench_bitfields(micro_suite_t *suite) {
+    const uint64_t tracker_size = (uint64_t) MICRO_PIECES * MICRO_BLOCKS_PER_PIECE / 8;
+    micro_bits_t bits = {malloc(tracker_size), 0};
+    if (!bits.bits) return;
+    memset(bits.bits, 0xFF, tracker_size);
+    measure(suite, "piece_complete/1M_pieces", run_piece_complete, &bits, 64, 0);
+    // The bitfield itself is the first 128 KiB
+    measure(suite, "are_bits_set/1M_pieces_range_64", run_are_bits_set_range, &bits, 64, 0);
+    measure(suite, "are_bits_set/1M_pieces_full", run_are_bits_set_full, &bits, 1, MICRO_PIECES / 8);
+    free(bits.bits);
+}
+
+/*
+ * process_block()
+ */
+
+/// @brief Context of the process_block() cases
+typedef struct {
+    files_ll *files; /**< MICRO_FILES files, all a block long but maybe the first */
+    unsigned char *block; /**< Data written */
+    uint32_t next; /**< Next of the last MICRO_WRITTEN_FILES blocks to write */
+} micro_files_t;
+
+static void run_process_block(void *ctx) {
+    micro_files_t *files = ctx;
+    // Pieces of one block, near the end of the list, where finding the file costs the most
+    const piece_t piece = {MICRO_FILES - 2 - MICRO_WRITTEN_FILES + files->next, 0, files->block};
+    files->next = (files->next + 1) % MICRO_WRITTEN_FILES;
+    sink += process_block(&piece, BLOCK_SIZE, BLOCK_SIZE, files->files, LOG_NO);
+}
+
+/**
+ * Builds MICRO_FILES files of a block each. A shorter first file makes every block straddle two files
+ */
+static files_ll *build_files(const uint32_t first_length) {
+    files_ll *head = nullptr;
+    files_ll **tail = &head;
+    int64_t byte_index = 0;
+    for (uint32_t i = 0; i < MICRO_FILES; ++i) {
+        files_ll *node = calloc(1, sizeof(files_ll));
+        node->path = calloc(1, sizeof(ll));
+        node->path->val = malloc(16);
+        snprintf(node->path->val, 16, "f%05u", i);
+        node->length = i == 0 ? first_length : BLOCK_SIZE;
+        node->byte_index = byte_index;
+        byte_index += node->length;
+        *tail = node;
+        tail = &node->next;
+    }
+    return head;
+}
+
+static void free_files(files_ll *files) {
+    while (files) {
+        files_ll *next = files->next;
+        if (files->file_ptr) fclose(files->file_ptr);
+        remove(files->path->val);
+        free(files->path->val);
+        free(files->path);
+        free(files);
+        files = next;
+    }
+}
+
+static void bench_process_block(micro_suite_t *suite) {
+    // Files are created in a scratch directory, and only the last ones are ever written
+    char directory[] = "/tmp/bench_micro.XXXXXX";
+    char previous[4096];
+    if (!getcwd(previous, sizeof(previous)) || !mkdtemp(directory) || chdir(directory) < 0) {
+        fprintf(stderr, "Couldn't create a scratch directory, skipping process_block()\n");
+        return;
+    }
+
+    micro_files_t files = {build_files(BLOCK_SIZE), calloc(BLOCK_SIZE, 1), 0};
+    if (files.block) measure(suite, "process_block/10k_files", run_process_block, &files, 1, BLOCK_SIZE);
+    free_files(files.files);
+    files.files = build_files(BLOCK_SIZE / 2);
+    files.next = 0;
+    if (files.block) measure(suite, "process_block/10k_files_straddling", run_process_block, &files, 1, BLOCK_SIZE);
+    free_files(files.files);
+
+    free(files.block);
+    if (chdir(previous) < 0) fprintf(stderr, "Couldn't go back to %s\n", previous);
+    rmdir(directory);
+}
+
+/*
+ * SHA1 of a piece: OpenSSL's one-shot SHA1() as the reference, then each engine the CPU supports, alone and over a
+ * batch of pieces. Runs are single-threaded, so MB/s are per core
+ */
+
+/// @brief A batch of pieces for the engine cases
+typedef struct {
+    const unsigned char *data[SHA1_MAX_LANES]; /**< The pieces */
+    uint64_t lengths[SHA1_MAX_LANES]; /**< MICRO_PIECE_SIZE each */
+    uint32_t amount; /**< Pieces hashed by each run */
+} micro_sha1_t;
+
+static void run_sha1(void *ctx) {
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(ctx, MICRO_PIECE_SIZE, hash);
+    sink += hash[0];
+}
+
+static void run_sha1_batch(void *ctx) {
+    const micro_sha1_t *batch = ctx;
+    unsigned char hashes[SHA1_MAX_LANES * SHA1_HASH_SIZE];
+    if (batch->amount == 1) sha1_hash(batch->data[0], batch->lengths[0], hashes);
+    else sha1_hash_batch(batch->data, batch->lengths, batch->amount, hashes);
+    sink += hashes[0];
+}
+
+static void bench_sha1(micro_suite_t *suite) {
+    micro_sha1_t batch = {.amount = SHA1_MAX_LANES};
+    unsigned char *pieces = malloc((uint64_t) SHA1_MAX_LANES * MICRO_PIECE_SIZE);
+    if (!pieces) return;
+    for (uint64_t i = 0; i < (uint64_t) SHA1_MAX_LANES * MICRO_PIECE_SIZE; ++i) {
+        pieces[i] = (unsigned char) (i * 2654435761u >> 24);
+    }
+    for (uint32_t i = 0; i < SHA1_MAX_LANES; ++i) {
+        batch.data[i] = pieces + (uint64_t) i * MICRO_PIECE_SIZE;
+        batch.lengths[i] = MICRO_PIECE_SIZE;
+    }
+    measure(suite, "sha1/256KiB_piece", run_sha1, pieces, 1, MICRO_PIECE_SIZE);
+
+    char name[128];
+    for (SHA1_ENGINE engine = SHA1_ENGINE_OPENSSL; engine < SHA1_ENGINE_COUNT; ++engine) {
+        if (!sha1_set_engine(engine)) continue;
+        batch.amount = 1;
+        snprintf(name, sizeof(name), "sha1/256KiB_piece/%s", sha1_engine_name(engine));
+        measure(suite, name, run_sha1_batch, &batch, 1, MICRO_PIECE_SIZE);
+        batch.amount = SHA1_MAX_LANES;
+        snprintf(name, sizeof(name), "sha1_batch/16x256KiB_pieces/%s", sha1_engine_name(engine));
+        measure(suite, name, run_sha1_batch, &batch, SHA1_MAX_LANES, MICRO_PIECE_SIZE);
+    }
+    // What hashing falls back to without an engine forced
+    sha1_set_engine(SHA1_ENGINE_AUTO);
+    snprintf(name, sizeof(name), "sha1_batch/16x256KiB_pieces/auto_%s",
+             sha1_engine_name(sha1_batch_engine(SHA1_MAX_LANES)));
+    measure(suite, name, run_sha1_batch, &batch, SHA1_MAX_LANES, MICRO_PIECE_SIZE);
+    free(pieces);
+}
+
+/*
+ * Message framing: length, then id and payload with a read each, against receive_messages() batching them
+ */
+
+/// @brief Context of the framing cases
+typedef struct {
+    unsigned char *stream; /**< MICRO_MESSAGES messages, back to back */
+    uint32_t stream_length; /**< Length of stream in bytes */
+    uint32_t message_length; /**< Length of each message, including its length field */
+    int32_t sockets[2]; /**< Socket pair the stream is sent through, for the socket case */
+    int32_t epoll; /**< Epoll instance, only required by read_from_socket() */
+    peer_t *peer; /**< Peer the messages are read into */
+    unsigned char *client_bitfield; /**< Bitfield HAVE messages are compared against */
+} micro_framing_t;
+
+/**
+ * Interprets the message in the peer's cache, the way torrent() does once it's complete
+ */
+static void dispatch_message(const micro_framing_t *framing) {
+    peer_t *peer = framing->peer;
+    if (!read_message_length(peer->reception_cache, &peer->last_msg)) return;
+    const bittorrent_message_t *message = (bittorrent_message_t *) peer->reception_cache;
+    if (message->id == HAVE) {
+        handle_have(peer, peer->reception_cache + MESSAGE_LENGTH_AND_ID_SIZE, framing->client_bitfield,
+                    MICRO_PIECES / 8, LOG_NO);
+    }
+    sink += message->length;
+}
+
+static void run_framing_memory(void *ctx) {
+    const micro_framing_t *framing = ctx;
+    for (uint32_t offset = 0; offset < framing->stream_length; offset += framing->message_length) {
+        memcpy(framing->peer->reception_cache, framing->stream + offset, framing->message_length);
+        dispatch_message(framing);
+    }
+}
+
+static void run_framing_socket(void *ctx) {
+    const micro_framing_t *framing = ctx;
+    peer_t *peer = framing->peer;
+    if (write(framing->sockets[1], framing->stream, framing->stream_length) != framing->stream_length) return;
+    for (uint32_t i = 0; i < MICRO_MESSAGES; ++i) {
+        // Length first, then id, then payload, each with its own recv() like in torrent()
+        peer->reception_pointer = 0;
+        peer->reception_target = MESSAGE_LENGTH_SIZE;
+        read_from_socket(peer, framing->epoll, LOG_NO);
+        peer->reception_target = MESSAGE_LENGTH_AND_ID_SIZE;
+        read_from_socket(peer, framing->epoll, LOG_NO);
+        peer->reception_target = (int32_t) framing->message_length;
+        read_from_socket(peer, framing->epoll, LOG_NO);
+        dispatch_message(framing);
+    }
+}
+
+/**
+ * Hands HAVE messages to handle_have(), the way torrent()'s handler does
+ */
+static bool on_framed_message(void *ctx, peer_t *peer, const peer_message_t *message) {
+    const micro_framing_t *framing = ctx;
+    if (message->id == HAVE) {
+        handle_have(peer, message->payload, framing->client_bitfield, MICRO_PIECES / 8, LOG_NO);
+    }
+    sink += message->payload_length;
+    return true;
+}
+
+static void run_framing_batched(void *ctx) {
+    const micro_framing_t *framing = ctx;
+    peer_t *peer = framing->peer;
+    if (write(framing->sockets[1], framing->stream, framing->stream_length) != framing->stream_length) return;
+    // As many messages per read as fit in the receive buffer
+    uint32_t received = 0;
+    while (received < MICRO_MESSAGES) {
+        const int32_t handled = receive_messages(peer, framing->epoll, on_framed_message, ctx, LOG_NO);
+        if (handled < 0) return;
+        received += handled;
+    }
+}
+
+static void bench_framing(micro_suite_t *suite) {
+    micro_framing_t framing = {0};
+    framing.message_length = MESSAGE_LENGTH_AND_ID_SIZE + 4;
+    framing.stream_length = MICRO_MESSAGES * framing.message_length;
+    framing.stream = malloc(framing.stream_length);
+    framing.peer = calloc(1, sizeof(peer_t));
+    framing.client_bitfield = calloc(MICRO_PIECES / 8, 1);
+    framing.epoll = epoll_create1(0);
+    if (!framing.stream || !framing.peer || !framing.client_bitfield || framing.epoll < 0 ||
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, framing.sockets) < 0) {
+        fprintf(stderr, "Couldn't set up the framing cases, skipping them\n");
+        return;
+    }
+    // HAVE messages, the most common ones without a block
+    for (uint32_t i = 0; i < MICRO_MESSAGES; ++i) {
+        unsigned char *message = framing.stream + i * framing.message_length;
+        const uint32_t length = htonl(5), piece = htonl(i * 4099 % MICRO_PIECES);
+        memcpy(message, &length, 4);
+        message[MESSAGE_LENGTH_SIZE] = HAVE;
+        memcpy(message + MESSAGE_LENGTH_AND_ID_SIZE, &piece, 4);
+    }
+    framing.peer->socket = framing.sockets[0];
+
+    measure(suite, "framing/have_memory", run_framing_memory, &framing, MICRO_MESSAGES, framing.message_length);
+    measure(suite, "framing/have_socket", run_framing_socket, &framing, MICRO_MESSAGES, framing.message_length);
+    framing.peer->status = PEER_HANDSHAKE_SUCCESS;
+    measure(suite, "framing/have_batched", run_framing_batched, &framing, MICRO_MESSAGES, framing.message_length);
+
+    close(framing.sockets[0]);
+    close(framing.sockets[1]);
+    close(framing.epoll);
+    free(framing.peer->bitfield);
+    free(framing.peer);
+    free(framing.client_bitfield);
+    free(framing.stream);
+}
+
+int32_t main(const int32_t argc, char *argv[]) {
+    micro_suite_t suite = {0};
+    suite.samples = MICRO_SAMPLES;
+    suite.threshold = MICRO_THRESHOLD;
+    const char *torrents = "test-files";
+    const char *baseline_path = nullptr;
+    for (int32_t i = 1; i < argc; ++i) {
+        const bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--torrents") == 0 && has_value) torrents = argv[++i];
+        else if (strcmp(argv[i], "--filter") == 0 && has_value) suite.filter = argv[++i];
+        else if (strcmp(argv[i], "--samples") == 0 && has_value) suite.samples = (uint32_t) strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--baseline") == 0 && has_value) baseline_path = argv[++i];
+        else if (strcmp(argv[i], "--threshold") == 0 && has_value) suite.threshold = strtod(argv[++i], nullptr);
+        else {
+            fprintf(stderr, "Usage: bench_micro [--torrents <dir>] [--filter <text>] [--samples <n>] "
+                            "[--baseline <file>] [--threshold <percent>]\n");
+            return 2;
+        }
+    }
+    if (suite.samples == 0 || suite.samples > MICRO_MAX_SAMPLES) {
+        fprintf(stderr, "Samples must be between 1 and %d\n", MICRO_MAX_SAMPLES);
+        return 2;
+    }
+    if (baseline_path && !read_baseline(&suite, baseline_path)) {
+        fprintf(stderr, "Couldn't read baseline %s\n", baseline_path);
+        return 2;
+    }
+
+    fprintf(stdout, "{\n  \"benchmarks\": [\n");
+    bench_parse_metainfo(&suite, torrents);
+    bench_decode_bencode_list(&suite);
+    bench_bitfields(&suite);
+    bench_process_block(&suite);
+    bench_sha1(&suite);
+    bench_framing(&suite);
+    fprintf(stdout, "\n  ]");
+    if (baseline_path) fprintf(stdout, ",\n  \"baseline\": \"%s\",\n  \"regressions\": %u", baseline_path, suite.regressions);
+    fprintf(stdout, "\n}\n");
+
+    free(suite.baseline);
+    return suite.regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,547 @@
+// Loopback swarm benchmark: downloads a synthetic torrent from in-process seeders, found through an in-process
+// UDP tracker, and reports how fast and how cheaply torrent() did it.
+//
+// Usage: bench_swarm [size in MiB] [seeders] [piece size in KiB] [trace file, or -] [out|in] [reactors]
+//
+// With "in", seeders connect to the client's listener instead, on the port it announced.
+// Peers are spread over the given amount of reactor threads, 1 by default.
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+#include <netinet/in.h>
+#include <openssl/sha.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../src/downloading.h"
+#include "../src/listener.h"
+#include "../src/messages_types.h"
+#include "../src/metrics.h"
+#include "../src/trace.h"
+
+/// @brief Default size of the synthetic torrent, in MiB
+#define BENCH_SIZE_MB 64
+/// @brief Default amount of seeders
+#define BENCH_SEEDERS 4
+/// @brief Default piece size, in KiB
+#define BENCH_PIECE_KB 256
+/// @brief Seconds after which a stalled download is killed
+#define BENCH_TIMEOUT 300
+/// @brief Milliseconds seeders and tracker wait between checks of the stop flag
+#define BENCH_POLL_MS 100
+
+/*
+ * Socket syscalls made by the client, counted by wrapping them at link time (-Wl,--wrap=...).
+ * Seeders and tracker use read()/write() and recvfrom()/sendto(), so only torrent() is counted.
+ */
+static atomic_uint_fast64_t recv_calls, send_calls, epoll_wait_calls, epoll_ctl_calls, connect_calls;
+
+ssize_t __real_recv(int fd, void *buf, size_t n, int flags);
+ssize_t __real_readv(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __real_send(int fd, const void *buf, size_t n, int flags);
+int __real_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int __real_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int __real_connect(int fd, const struct sockaddr *addr, socklen_t len);
+
+ssize_t __wrap_recv(const int fd, void *buf, const size_t n, const int flags) {
+    atomic_fetch_add_explicit(&recv_calls, 1, memory_order_relaxed);
+    return __real_recv(fd, buf, n, flags);
+}
+
+// Counted as a recv, it's what torrent() reads messages with
+ssize_t __wrap_readv(const int fd, const struct iovec *iov, const int iovcnt) {
+    atomic_fetch_add_explicit(&recv_calls, 1, memory_order_relaxed);
+    return __real_readv(fd, iov, iovcnt);
+}
+
+ssize_t __wrap_send(const int fd, const void *buf, const size_t n, const int flags) {
+    atomic_fetch_add_explicit(&send_calls, 1, memory_order_relaxed);
+    return __real_send(fd, buf, n, flags);
+}
+
+int __wrap_epoll_wait(const int epfd, struct epoll_event *events, const int maxevents, const int timeout) {
+    atomic_fetch_add_explicit(&epoll_wait_calls, 1, memory_order_relaxed);
+    return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+int __wrap_epoll_ctl(const int epfd, const int op, const int fd, struct epoll_event *event) {
+    atomic_fetch_add_explicit(&epoll_ctl_calls, 1, memory_order_relaxed);
+    return __real_epoll_ctl(epfd, op, fd, event);
+}
+
+int __wrap_connect(const int fd, const struct sockaddr *addr, const socklen_t len) {
+    atomic_fetch_add_explicit(&connect_calls, 1, memory_order_relaxed);
+    return __real_connect(fd, addr, len);
+}
+
+/// @brief Set once the download is over, so seeders and tracker exit
+static atomic_bool stopping;
+
+/// @brief Layout of the synthetic torrent, shared by seeders and the final check
+typedef struct {
+    uint64_t length; /**< Total size in bytes */
+    uint32_t piece_length; /**< Size of each piece in bytes */
+    uint32_t piece_number; /**< Amount of pieces */
+    unsigned char info_hash[20]; /**< Info hash, known once the torrent is built */
+} bench_torrent_t;
+
+/// @brief A seeder, serving every piece from its own thread
+typedef struct {
+    const bench_torrent_t *torrent; /**< Torrent being seeded */
+    int32_t listen_fd; /**< Listening socket, bound to 127.0.0.1 */
+    uint16_t port; /**< Port of listen_fd, in network byte order */
+    uint64_t served_blocks; /**< Blocks sent, read once the thread exits */
+    struct rusage usage; /**< CPU time of the thread, taken right before it exits */
+    _Atomic uint16_t *client_port; /**< Port the client announced, in network byte order, or nullptr if seeders
+                                    * wait for the client to connect */
+    pthread_t thread; /**< Thread running the seeder */
+} seeder_t;
+
+/// @brief A UDP tracker answering every announce with all the seeders
+typedef struct {
+    int32_t fd; /**< UDP socket, bound to 127.0.0.1 */
+    uint16_t port; /**< Port of fd, in host byte order */
+    const seeder_t *seeders; /**< Seeders handed out */
+    uint32_t seeder_amount; /**< Amount of seeders */
+    bool inbound; /**< Whether seeders connect to the client instead of being handed out */
+    _Atomic uint16_t client_port; /**< Port the client announced, in network byte order. 0 until it announces */
+    pthread_t thread; /**< Thread running the tracker */
+} stand_in_tracker_t;
+
+/**
+ * Torrent contents are never stored anywhere: every byte is derived from its offset, so seeders
+ * generate blocks on demand and the client's peak RSS isn't hidden behind a copy of the data
+ */
+static void fill_data(unsigned char *buffer, const uint64_t offset, const uint64_t length) {
+    for (uint64_t i = 0; i < length; ++i) {
+        const uint64_t position = offset + i;
+        // splitmix64 of the 8-byte word the position falls in
+        uint64_t word = position / 8 + 0x9E3779B97F4A7C15ull;
+        word = (word ^ (word >> 30)) * 0xBF58476D1CE4E5B9ull;
+        word = (word ^ (word >> 27)) * 0x94D049BB133111EBull;
+        word ^= word >> 31;
+        buffer[i] = (unsigned char) (word >> (8 * (position % 8)));
+    }
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Waits until fd is ready for events, or stopping is set
+ */
+static bool wait_for(const int32_t fd, const int16_t events) {
+    struct pollfd pfd = {fd, events, 0};
+    while (!atomic_load(&stopping)) {
+        const int32_t ready = poll(&pfd, 1, BENCH_POLL_MS);
+        if (ready > 0) return true;
+        if (ready < 0 && errno != EINTR) return false;
+    }
+    return false;
+}
+
+static bool read_full(const int32_t fd, unsigned char *buffer, const uint64_t length) {
+    uint64_t done = 0;
+    while (done < length) {
+        if (!wait_for(fd, POLLIN)) return false;
+        const ssize_t result = read(fd, buffer + done, length - done);
+        if (result <= 0) return false;
+        done += result;
+    }
+    return true;
+}
+
+static bool write_full(const int32_t fd, const unsigned char *buffer, const uint64_t length) {
+    uint64_t done = 0;
+    while (done < length) {
+        const ssize_t result = write(fd, buffer + done, length - done);
+        if (result <= 0) return false;
+        done += result;
+    }
+    return true;
+}
+
+/**
+ * Serves one connection: handshake, full bitfield, unchoke, then every request until the client leaves.
+ * Whoever connected sends its handshake first
+ */
+static void serve_peer(seeder_t *seeder, const int32_t fd, const bool connected) {
+    const bench_torrent_t *torrent = seeder->torrent;
+    unsigned char handshake[HANDSHAKE_LEN] = {19, 'B', 'i', 't', 'T', 'o', 'r', 'r', 'e', 'n', 't', ' ',
+                                              'p', 'r', 'o', 't', 'o', 'c', 'o', 'l'};
+    memcpy(handshake + 28, torrent->info_hash, 20);
+    memcpy(handshake + 48, "-BS0001-seeder------", 20);
+    if (connected && !write_full(fd, handshake, HANDSHAKE_LEN)) return;
+    if (!read_full(fd, handshake, HANDSHAKE_LEN) || memcmp(handshake + 28, torrent->info_hash, 20) != 0) return;
+    memcpy(handshake + 48, "-BS0001-seeder------", 20);
+    if (!connected && !write_full(fd, handshake, HANDSHAKE_LEN)) return;
+
+    const uint32_t bitfield_byte_size = (torrent->piece_number + 7) / 8;
+    // Big enough for the client's bitfield, and for any block
+    const uint32_t buffer_size = MESSAGE_LENGTH_AND_ID_SIZE + (bitfield_byte_size > BLOCK_SIZE ? bitfield_byte_size : BLOCK_SIZE);
+    unsigned char *buffer = calloc(buffer_size, 1);
+    if (!buffer) return;
+
+    uint32_t length = htonl(1 + bitfield_byte_size);
+    memcpy(buffer, &length, MESSAGE_LENGTH_SIZE);
+    buffer[MESSAGE_LENGTH_SIZE] = BITFIELD;
+    memset(buffer + MESSAGE_LENGTH_AND_ID_SIZE, 0xFF, bitfield_byte_size);
+    // Spare bits must be cleared
+    if (torrent->piece_number % 8 != 0) {
+        buffer[MESSAGE_LENGTH_AND_ID_SIZE + bitfield_byte_size - 1] = (unsigned char) (0xFF << (8 - torrent->piece_number % 8));
+    }
+    const unsigned char unchoke[MESSAGE_LENGTH_AND_ID_SIZE] = {0, 0, 0, 1, UNCHOKE};
+    if (!write_full(fd, buffer, MESSAGE_LENGTH_AND_ID_SIZE + bitfield_byte_size) ||
+        !write_full(fd, unchoke, MESSAGE_LENGTH_AND_ID_SIZE)) {
+        free(buffer);
+        return;
+    }
+
+    while (true) {
+        if (!read_full(fd, (unsigned char *) &length, MESSAGE_LENGTH_SIZE)) break;
+        length = ntohl(length);
+        // Keep-alive
+        if (length == 0) continue;
+        if (length > buffer_size || !read_full(fd, buffer, length)) break;
+        if (buffer[0] != REQUEST || length != 1 + sizeof(request_t)) continue;
+
+        request_t request;
+        memcpy(&request, buffer + 1, sizeof(request_t));
+        const uint32_t index = ntohl(request.index);
+        const uint32_t begin = ntohl(request.begin);
+        const uint32_t block_length = ntohl(request.length);
+        const uint64_t offset = (uint64_t) index * torrent->piece_length + begin;
+        if (index >= torrent->piece_number || block_length > BLOCK_SIZE || offset + block_length > torrent->length) break;
+
+        unsigned char header[MESSAGE_LENGTH_AND_ID_SIZE + 8];
+        const uint32_t message_length = htonl(9 + block_length);
+        memcpy(header, &message_length, MESSAGE_LENGTH_SIZE);
+        header[MESSAGE_LENGTH_SIZE] = PIECE;
+        memcpy(header + MESSAGE_LENGTH_AND_ID_SIZE, &request.index, 4);
+        memcpy(header + MESSAGE_LENGTH_AND_ID_SIZE + 4, &request.begin, 4);
+        fill_data(buffer, offset, block_length);
+
+        struct iovec iov[2] = {{header, sizeof(header)}, {buffer, block_length}};
+        uint64_t remaining = sizeof(header) + block_length;
+        uint32_t first = 0;
+        while (remaining > 0) {
+            const ssize_t sent = writev(fd, iov + first, 2 - first);
+            if (sent <= 0) break;
+            remaining -= sent;
+            // Skipping what was already written
+            uint64_t consumed = sent;
+            while (first < 2 && consumed >= iov[first].iov_len) consumed -= iov[first++].iov_len;
+            if (first < 2) {
+                iov[first].iov_base = (unsigned char *) iov[first].iov_base + consumed;
+                iov[first].iov_len -= consumed;
+            }
+        }
+        if (remaining > 0) break;
+        seeder->served_blocks++;
+    }
+    free(buffer);
+}
+
+/**
+ * Connects to the client once it announced its port
+ */
+static void connect_to_client(seeder_t *seeder) {
+    while (!atomic_load(&stopping) && atomic_load(seeder->client_port) == 0) usleep(BENCH_POLL_MS * 1000);
+    if (atomic_load(&stopping)) return;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = atomic_load(seeder->client_port);
+    const int32_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    // Not through connect(), which only counts the client's calls
+    if (fd >= 0 && __real_connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) serve_peer(seeder, fd, true);
+    if (fd >= 0) close(fd);
+}
+
+static void *run_seeder(void *arg) {
+    seeder_t *seeder = arg;
+    if (seeder->client_port) connect_to_client(seeder);
+    else {
+        while (wait_for(seeder->listen_fd, POLLIN)) {
+            const int32_t fd = accept(seeder->listen_fd, nullptr, nullptr);
+            if (fd < 0) continue;
+            serve_peer(seeder, fd, false);
+            close(fd);
+        }
+    }
+    // Taken out of the process' CPU time, so only the client's is reported
+    getrusage(RUSAGE_THREAD, &seeder->usage);
+    return nullptr;
+}
+
+static void *run_tracker(void *arg) {
+    stand_in_tracker_t *tracker = arg;
+    unsigned char request[128];
+    unsigned char *response = malloc(20 + tracker->seeder_amount * 6);
+    if (!response) return nullptr;
+    while (wait_for(tracker->fd, POLLIN)) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        const ssize_t length = recvfrom(tracker->fd, request, sizeof(request), 0, (struct sockaddr *) &from, &from_len);
+        if (length < 16) continue;
+        uint32_t action;
+        memcpy(&action, request + 8, 4);
+        action = ntohl(action);
+        // Action and transaction id are echoed back
+        memcpy(response, request + 8, 8);
+        if (action == 0) {
+            // Any connection id will do
+            memcpy(response + 8, "BENCHCID", 8);
+            sendto(tracker->fd, response, 16, 0, (struct sockaddr *) &from, from_len);
+        } else if (action == 1 && length >= 98) {
+            // Seeders go to the client instead
+            const uint32_t handed_out = tracker->inbound ? 0 : tracker->seeder_amount;
+            if (tracker->inbound) {
+                uint16_t port;
+                memcpy(&port, request + 96, 2);
+                atomic_store(&tracker->client_port, port);
+            }
+            const uint32_t fields[3] = {htonl(1800), htonl(0), htonl(handed_out)};
+            memcpy(response + 8, fields, sizeof(fields));
+            const uint32_t loopback = htonl(INADDR_LOOPBACK);
+            for (uint32_t i = 0; i < handed_out; ++i) {
+                memcpy(response + 20 + i * 6, &loopback, 4);
+                memcpy(response + 24 + i * 6, &tracker->seeders[i].port, 2);
+            }
+            sendto(tracker->fd, response, 20 + handed_out * 6, 0, (struct sockaddr *) &from, from_len);
+        }
+    }
+    free(response);
+    return nullptr;
+}
+
+/**
+ * Creates a socket bound to an ephemeral port of 127.0.0.1
+ */
+static int32_t bind_loopback(const int32_t type, uint16_t *port) {
+    const int32_t fd = socket(AF_INET, type, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *) &addr, addr_len) < 0 || getsockname(fd, (struct sockaddr *) &addr, &addr_len) < 0 ||
+        (type == SOCK_STREAM && listen(fd, 4) < 0)) {
+        close(fd);
+        return -1;
+    }
+    *port = addr.sin_port;
+    return fd;
+}
+
+/**
+ * Builds a single-file .torrent announcing to the stand-in tracker. The result is null-terminated
+ */
+static char *build_torrent(const bench_torrent_t *torrent, const uint16_t tracker_port, uint64_t *length) {
+    char announce[64];
+    snprintf(announce, sizeof(announce), "udp://127.0.0.1:%u/announce", tracker_port);
+    char head[256];
+    const int32_t head_length = snprintf(head, sizeof(head),
+                                         "d8:announce%zu:%s4:infod6:lengthi%lue4:name9:bench.bin12:piece lengthi%ue6:pieces%u:",
+                                         strlen(announce), announce, (unsigned long) torrent->length, torrent->piece_length,
+                                         torrent->piece_number * 20);
+    const uint64_t hashes_length = (uint64_t) torrent->piece_number * 20;
+    // Private, so only the local tracker hands out peers and the DHT stays out of the counts
+    const char tail[] = "7:privatei1eee";
+    *length = head_length + hashes_length + sizeof(tail) - 1;
+    char *bencode = malloc(*length + 1);
+    unsigned char *piece = malloc(torrent->piece_length);
+    if (!bencode || !piece) {
+        free(bencode);
+        free(piece);
+        return nullptr;
+    }
+    memcpy(bencode, head, head_length);
+    for (uint32_t i = 0; i < torrent->piece_number; ++i) {
+        const uint64_t offset = (uint64_t) i * torrent->piece_length;
+        const uint64_t piece_size = offset + torrent->piece_length > torrent->length ? torrent->length - offset : torrent->piece_length;
+        fill_data(piece, offset, piece_size);
+        SHA1(piece, piece_size, (unsigned char *) bencode + head_length + (uint64_t) i * 20);
+    }
+    free(piece);
+    memcpy(bencode + head_length + hashes_length, tail, sizeof(tail));
+    return bencode;
+}
+
+/**
+ * Checks the downloaded file byte by byte against the generated contents
+ */
+static bool check_download(const bench_torrent_t *torrent) {
+    FILE *file = fopen("bench.bin", "rb");
+    if (!file) return false;
+    unsigned char *expected = malloc(BLOCK_SIZE), *actual = malloc(BLOCK_SIZE);
+    bool valid = expected && actual;
+    for (uint64_t offset = 0; valid && offset < torrent->length; offset += BLOCK_SIZE) {
+        const uint64_t amount = torrent->length - offset < BLOCK_SIZE ? torrent->length - offset : BLOCK_SIZE;
+        fill_data(expected, offset, amount);
+        valid = fread(actual, 1, amount, file) == amount && memcmp(expected, actual, amount) == 0;
+    }
+    // Nothing past the end either
+    valid = valid && fgetc(file) == EOF;
+    free(expected);
+    free(actual);
+    fclose(file);
+    return valid;
+}
+
+static double timeval_seconds(const struct timeval tv) {
+    return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+}
+
+int32_t main(const int32_t argc, char *argv[]) {
+    const uint64_t size_mb = argc > 1 ? strtoull(argv[1], nullptr, 10) : BENCH_SIZE_MB;
+    const uint32_t seeder_amount = argc > 2 ? (uint32_t) strtoul(argv[2], nullptr, 10) : BENCH_SEEDERS;
+    const uint32_t piece_kb = argc > 3 ? (uint32_t) strtoul(argv[3], nullptr, 10) : BENCH_PIECE_KB;
+    const uint32_t reactors = argc > 6 ? (uint32_t) strtoul(argv[6], nullptr, 10) : 1;
+    // torrent_stats_t counts bytes in 32 bits
+    if (size_mb == 0 || size_mb >= 4096 || seeder_amount == 0 || piece_kb < BLOCK_SIZE / 1024 || piece_kb % 16 != 0 ||
+        reactors == 0 || reactors > TORRENT_MAX_REACTORS) {
+        fprintf(stderr, "Usage: bench_swarm [size in MiB, under 4096] [seeders] [piece size in KiB, multiple of 16] "
+                        "[trace file, or -] [out|in] [reactors, up to %u]\n", TORRENT_MAX_REACTORS);
+        return 1;
+    }
+
+    // Tracing the download, to measure its overhead or look at it in Perfetto
+    char trace_path[4096] = {0};
+    if (argc > 4 && strcmp(argv[4], "-") != 0) {
+        if (argv[4][0] != '/' && getcwd(trace_path, sizeof(trace_path) - 1)) strcat(trace_path, "/");
+        strncat(trace_path, argv[4], sizeof(trace_path) - strlen(trace_path) - 1);
+    }
+
+    bench_torrent_t synthetic = {0};
+    synthetic.length = size_mb * 1024 * 1024;
+    synthetic.piece_length = piece_kb * 1024;
+    synthetic.piece_number = (synthetic.length + synthetic.piece_length - 1) / synthetic.piece_length;
+
+    // Downloading into a scratch directory, so nothing is left behind
+    char directory[] = "/tmp/bench_swarm.XXXXXX";
+    if (!mkdtemp(directory) || chdir(directory) < 0) {
+        fprintf(stderr, "Couldn't create a scratch directory\n");
+        return 1;
+    }
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    seeder_t *seeders = calloc(seeder_amount, sizeof(seeder_t));
+    stand_in_tracker_t tracker = {0};
+    uint16_t tracker_port;
+    tracker.fd = bind_loopback(SOCK_DGRAM, &tracker_port);
+    tracker.port = ntohs(tracker_port);
+    tracker.seeders = seeders;
+    tracker.seeder_amount = seeder_amount;
+    tracker.inbound = argc > 5 && strcmp(argv[5], "in") == 0;
+    if (!seeders || tracker.fd < 0) return 1;
+    for (uint32_t i = 0; i < seeder_amount; ++i) {
+        seeders[i].torrent = &synthetic;
+        if (tracker.inbound) seeders[i].client_port = &tracker.client_port;
+        seeders[i].listen_fd = bind_loopback(SOCK_STREAM, &seeders[i].port);
+        if (seeders[i].listen_fd < 0) return 1;
+    }
+
+    uint64_t bencode_length;
+    char *bencode = build_torrent(&synthetic, tracker.port, &bencode_length);
+    metainfo_t *metainfo = bencode ? parse_metainfo(bencode, bencode_length, LOG_NO) : nullptr;
+    if (!metainfo) {
+        fprintf(stderr, "Couldn't build the synthetic torrent\n");
+        return 1;
+    }
+    memcpy(synthetic.info_hash, metainfo->info->hash, 20);
+
+    for (uint32_t i = 0; i < seeder_amount; ++i) pthread_create(&seeders[i].thread, nullptr, run_seeder, &seeders[i]);
+    pthread_create(&tracker.thread, nullptr, run_tracker, &tracker);
+
+    unsigned char peer_id[21] = {0};
+    memcpy(peer_id, CLIENT_ID, 8);
+    arc4random_buf(peer_id + 8, 12);
+
+    // A stalled download shouldn't hang whoever runs the benchmark
+    alarm(BENCH_TIMEOUT);
+    struct rusage usage_before, usage_after;
+    // Reactors run on threads of their own, so the whole process is measured and seeders are taken out afterwards.
+    // The tracker and the acceptors are left in, they barely run
+    getrusage(RUSAGE_SELF, &usage_before);
+    if (trace_path[0]) trace_start();
+    // Accepting on any free port, which the client announces
+    listener_t *listener = tracker.inbound ? listener_start(0, LISTENER_ACCEPTORS, LOG_ERR) : nullptr;
+    const uint64_t start = monotonic_ns();
+    const int32_t result = torrent(*metainfo, peer_id, listener, reactors, LOG_NO);
+    const uint64_t elapsed_ns = monotonic_ns() - start;
+    alarm(0);
+    trace_stop();
+    listener_stop(listener);
+
+    atomic_store(&stopping, true);
+    uint64_t served_blocks = 0;
+    double seeder_user = 0, seeder_system = 0;
+    for (uint32_t i = 0; i < seeder_amount; ++i) {
+        pthread_join(seeders[i].thread, nullptr);
+        close(seeders[i].listen_fd);
+        served_blocks += seeders[i].served_blocks;
+        seeder_user += timeval_seconds(seeders[i].usage.ru_utime);
+        seeder_system += timeval_seconds(seeders[i].usage.ru_stime);
+    }
+    // Once seeders are done, so all of their CPU time is in it
+    getrusage(RUSAGE_SELF, &usage_after);
+    pthread_join(tracker.thread, nullptr);
+    close(tracker.fd);
+
+    bool valid = result == 0 && check_download(&synthetic);
+    struct rusage usage_self;
+    getrusage(RUSAGE_SELF, &usage_self);
+
+    const double seconds = (double) elapsed_ns / 1e9;
+    const double user_seconds = timeval_seconds(usage_after.ru_utime) - timeval_seconds(usage_before.ru_utime) -
+                                seeder_user;
+    const double system_seconds = timeval_seconds(usage_after.ru_stime) - timeval_seconds(usage_before.ru_stime) -
+                                  seeder_system;
+    const double cpu_seconds = user_seconds + system_seconds;
+    const uint64_t blocks = (synthetic.length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const uint64_t syscalls = recv_calls + send_calls + epoll_wait_calls + epoll_ctl_calls + connect_calls;
+
+    fprintf(stdout, "Torrent: %lu MiB, %u pieces of %u KiB, %u %s seeders, %u reactors\n", (unsigned long) size_mb,
+            synthetic.piece_number, piece_kb, seeder_amount, tracker.inbound ? "inbound" : "outbound", reactors);
+    fprintf(stdout, "Download: %s in %.3f s, %lu blocks served\n", valid ? "valid" : "INVALID", seconds,
+            (unsigned long) served_blocks);
+    fprintf(stdout, "Throughput: %.1f MB/s\n", (double) synthetic.length / 1e6 / seconds);
+    fprintf(stdout, "CPU: %.3f s per GiB (%.3f s user, %.3f s system)\n",
+            cpu_seconds * (1024.0 * 1024.0 * 1024.0) / (double) synthetic.length, user_seconds, system_seconds);
+    fprintf(stdout, "Syscalls: %.2f per block (recv+readv %lu, send %lu, epoll_wait %lu, epoll_ctl %lu, connect %lu)\n",
+            (double) syscalls / (double) blocks, (unsigned long) recv_calls, (unsigned long) send_calls,
+            (unsigned long) epoll_wait_calls, (unsigned long) epoll_ctl_calls, (unsigned long) connect_calls);
+    const uint64_t useful_events = metrics_counter_value(METRIC_USEFUL_EVENTS);
+    fprintf(stdout, "Wakeups: %.2f per useful event (%lu wakeups, %lu peer events, %lu useful)\n",
+            useful_events ? (double) metrics_counter_value(METRIC_EPOLL_WAKEUPS) / (double) useful_events : 0.0,
+            (unsigned long) metrics_counter_value(METRIC_EPOLL_WAKEUPS),
+            (unsigned long) metrics_counter_value(METRIC_PEER_EVENTS), (unsigned long) useful_events);
+    fprintf(stdout, "Peak RSS: %ld KiB\n", usage_self.ru_maxrss);
+    if (trace_path[0]) {
+        fprintf(stdout, "Trace: %lu events\n", (unsigned long) trace_event_count());
+        if (!trace_export(trace_path, LOG_ERR)) valid = false;
+    }
+
+    remove("bench.bin");
+    rmdir(directory);
+    free_metainfo(metainfo);
+    free(bencode);
+    free(seeders);
+    curl_global_cleanup();
+    return valid ? 0 : 1;
+}
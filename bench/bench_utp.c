@@ -0,0 +1,402 @@
+// Transport benchmark: pushes the same data over uTP and over TCP through an emulated bottleneck link, netem
+// style: a rate limit feeding a tail-drop queue, plus a fixed one-way delay each way. Everything runs in-process
+// over loopback. Reports the throughput of each transport and the queuing delay it induces in the bottleneck,
+// which is what latency-sensitive traffic sharing the link would suffer.
+//
+// Usage: bench_utp [size in MiB] [rate in Mbit/s] [one-way delay in ms] [queue in KiB]
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "../src/utp.h"
+
+/// @brief Default amount of data sent over each transport, in MiB
+#define BENCH_SIZE_MB 8
+/// @brief Default rate of the bottleneck, in Mbit/s
+#define BENCH_RATE_MBIT 40
+/// @brief Default one-way delay of the link, in milliseconds
+#define BENCH_DELAY_MS 20
+/// @brief Default size of the bottleneck queue, in KiB. Deep enough for a second of queuing at the default rate
+#define BENCH_QUEUE_KB 4096
+/// @brief Seconds after which a stalled transfer is given up on
+#define BENCH_TIMEOUT 120
+/// @brief Largest chunk the emulated link carries at once, a datagram or a piece of the TCP stream
+#define LINK_PACKET_MAX (UTP_PACKET_MAX + 64)
+/// @brief Packets each direction of the link can hold, whatever the queue size in bytes
+#define LINK_RING 65536
+
+/// @brief A chunk of data on the emulated link
+typedef struct {
+    unsigned char data[LINK_PACKET_MAX];
+    uint32_t length;
+    uint64_t due_us; /**< When it comes out the other end */
+} link_packet_t;
+
+/// @brief One direction of the link, a FIFO whose packets come out in order of due_us
+typedef struct {
+    link_packet_t *packets;
+    uint32_t head;
+    uint32_t tail;
+} link_direction_t;
+
+/// @brief The emulated link, run by its own thread between a client and a server
+typedef struct {
+    bool tcp; /**< Relays a TCP stream instead of datagrams */
+    double rate_mbit; /**< Rate of the bottleneck, client to server only */
+    uint64_t delay_us; /**< One-way delay, both ways */
+    uint64_t queue_bytes; /**< Bytes the bottleneck queue holds before dropping, or stalling the TCP stream */
+    int32_t socket; /**< UDP socket between both ends, or TCP listener the client connects to */
+    struct sockaddr_in server; /**< Where the server is */
+    link_direction_t forward; /**< Client to server, through the bottleneck */
+    link_direction_t backward; /**< Server to client, only delayed */
+    uint64_t departure_us; /**< When the last packet queued leaves the bottleneck */
+    uint64_t *sojourns_us; /**< Time each packet spent queued in the bottleneck */
+    uint32_t sojourn_amount;
+    uint32_t sojourn_capacity;
+    uint64_t dropped; /**< Packets the full queue dropped */
+    atomic_bool stop;
+} link_t;
+
+static uint64_t now_us(void) {
+    return monotonic_us();
+}
+
+static bool link_push(link_direction_t *direction, const unsigned char *data, const uint32_t length,
+                      const uint64_t due_us) {
+    if (direction->tail - direction->head == LINK_RING) return false;
+    link_packet_t *packet = &direction->packets[direction->tail++ % LINK_RING];
+    memcpy(packet->data, data, length);
+    packet->length = length;
+    packet->due_us = due_us;
+    return true;
+}
+
+/**
+ * Bytes waiting for the bottleneck, from when the last queued packet leaves it
+ */
+static uint64_t backlog(const link_t *link, const uint64_t now) {
+    if (link->departure_us <= now) return 0;
+    return (uint64_t) ((link->departure_us - now) * link->rate_mbit / 8);
+}
+
+/**
+ * Queues a packet from the client in the bottleneck, dropping it if the queue is full
+ */
+static void link_send_forward(link_t *link, const unsigned char *data, const uint32_t length) {
+    const uint64_t now = now_us();
+    if (backlog(link, now) + length > link->queue_bytes) {
+        link->dropped++;
+        return;
+    }
+    // 1 Mbit/s carries a bit per microsecond
+    const uint64_t start = link->departure_us > now ? link->departure_us : now;
+    const uint64_t departure = start + (uint64_t) (length * 8 / link->rate_mbit);
+    if (!link_push(&link->forward, data, length, departure + link->delay_us)) {
+        link->dropped++;
+        return;
+    }
+    link->departure_us = departure;
+    if (link->sojourn_amount == link->sojourn_capacity) {
+        link->sojourn_capacity = link->sojourn_capacity > 0 ? link->sojourn_capacity * 2 : 4096;
+        link->sojourns_us = realloc(link->sojourns_us, sizeof(uint64_t) * link->sojourn_capacity);
+    }
+    link->sojourns_us[link->sojourn_amount++] = departure - now;
+}
+
+/**
+ * Milliseconds until the next packet of either direction is due, for poll()
+ */
+static int32_t next_due_ms(const link_t *link) {
+    uint64_t due = UINT64_MAX;
+    if (link->forward.head != link->forward.tail) due = link->forward.packets[link->forward.head % LINK_RING].due_us;
+    if (link->backward.head != link->backward.tail) {
+        const uint64_t backward = link->backward.packets[link->backward.head % LINK_RING].due_us;
+        if (backward < due) due = backward;
+    }
+    if (due == UINT64_MAX) return 10;
+    const uint64_t now = now_us();
+    return due <= now ? 0 : (int32_t) ((due - now + 999) / 1000);
+}
+
+/**
+ * Relays datagrams between a uTP client, whose address is learned from its first packet, and the server
+ */
+static void run_datagram_link(link_t *link) {
+    struct sockaddr_in client = {0};
+    unsigned char buffer[LINK_PACKET_MAX];
+    while (!atomic_load(&link->stop)) {
+        struct pollfd pfd = {link->socket, POLLIN, 0};
+        poll(&pfd, 1, next_due_ms(link));
+        struct sockaddr_in source;
+        socklen_t length = sizeof(source);
+        ssize_t received;
+        while ((received = recvfrom(link->socket, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *) &source,
+                                    &length)) >= 0) {
+            length = sizeof(source);
+            if (source.sin_port == link->server.sin_port) {
+                link_push(&link->backward, buffer, received, now_us() + link->delay_us);
+            } else {
+                client = source;
+                link_send_forward(link, buffer, received);
+            }
+        }
+        const uint64_t now = now_us();
+        while (link->forward.head != link->forward.tail && link->forward.packets[link->forward.head % LINK_RING].due_us <= now) {
+            const link_packet_t *packet = &link->forward.packets[link->forward.head++ % LINK_RING];
+            sendto(link->socket, packet->data, packet->length, 0, (struct sockaddr *) &link->server, sizeof(link->server));
+        }
+        while (link->backward.head != link->backward.tail && link->backward.packets[link->backward.head % LINK_RING].due_us <= now) {
+            const link_packet_t *packet = &link->backward.packets[link->backward.head++ % LINK_RING];
+            sendto(link->socket, packet->data, packet->length, 0, (struct sockaddr *) &client, sizeof(client));
+        }
+    }
+}
+
+/**
+ * Relays a TCP stream from the client to the server. The bottleneck never drops: once its queue is full the
+ * client isn't read, so TCP keeps it full, as it does on links with deep buffers
+ */
+static void run_stream_link(link_t *link) {
+    const int32_t client = accept(link->socket, nullptr, nullptr);
+    const int32_t server = socket(AF_INET, SOCK_STREAM, 0);
+    if (client < 0 || server < 0 || connect(server, (struct sockaddr *) &link->server, sizeof(link->server)) < 0) {
+        fprintf(stderr, "Couldn't relay the TCP stream: %s\n", strerror(errno));
+        return;
+    }
+    bool client_open = true;
+    unsigned char buffer[UTP_PAYLOAD_MAX];
+    while (!atomic_load(&link->stop) && (client_open || link->forward.head != link->forward.tail)) {
+        const bool room = backlog(link, now_us()) + sizeof(buffer) <= link->queue_bytes;
+        struct pollfd pfd = {client, room && client_open ? POLLIN : 0, 0};
+        poll(&pfd, 1, room ? next_due_ms(link) : 1);
+        while (client_open && backlog(link, now_us()) + sizeof(buffer) <= link->queue_bytes) {
+            const ssize_t received = recv(client, buffer, sizeof(buffer), MSG_DONTWAIT);
+            if (received == 0) client_open = false;
+            if (received <= 0) break;
+            link_send_forward(link, buffer, received);
+        }
+        const uint64_t now = now_us();
+        while (link->forward.head != link->forward.tail && link->forward.packets[link->forward.head % LINK_RING].due_us <= now) {
+            const link_packet_t *packet = &link->forward.packets[link->forward.head++ % LINK_RING];
+            if (write(server, packet->data, packet->length) < 0) break;
+        }
+    }
+    close(client);
+    close(server);
+}
+
+static void *link_thread(void *arg) {
+    link_t *link = arg;
+    if (link->tcp) run_stream_link(link);
+    else run_datagram_link(link);
+    return nullptr;
+}
+
+static struct sockaddr_in loopback_address(const uint16_t port) {
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    return address;
+}
+
+/**
+ * Opens a socket bound to an ephemeral loopback port
+ * @return The socket, whose port is stored in port
+ */
+static int32_t bound_socket(const int32_t type, uint16_t *port) {
+    const int32_t fd = socket(AF_INET, type, 0);
+    struct sockaddr_in address = loopback_address(0);
+    socklen_t length = sizeof(address);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 ||
+        getsockname(fd, (struct sockaddr *) &address, &length) < 0) {
+        fprintf(stderr, "Couldn't bind a loopback socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *) a;
+    const uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *name, const link_t *link, const uint64_t size, const uint64_t elapsed_us,
+                   const bool complete) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < link->sojourn_amount; ++i) total += link->sojourns_us[i];
+    qsort(link->sojourns_us, link->sojourn_amount, sizeof(uint64_t), compare_u64);
+    const uint64_t median = link->sojourn_amount ? link->sojourns_us[link->sojourn_amount / 2] : 0;
+    const uint64_t p99 = link->sojourn_amount ? link->sojourns_us[link->sojourn_amount * 99 / 100] : 0;
+    printf("%-4s %s %7.2f MB/s  queuing delay: %6.1f ms mean, %6.1f ms median, %6.1f ms p99  (%lu dropped)\n",
+           name, complete ? "   " : "(!)", size / (double) elapsed_us,
+           link->sojourn_amount ? total / 1000.0 / link->sojourn_amount : 0.0, median / 1000.0, p99 / 1000.0,
+           (unsigned long) link->dropped);
+}
+
+static void accept_callback(void *ctx, const int32_t socket, const struct sockaddr_in *address) {
+    (void) address;
+    *(int32_t *) ctx = socket;
+}
+
+/**
+ * Sends size bytes from one uTP context to another through the link
+ * @return Bytes that made it before BENCH_TIMEOUT
+ */
+static uint64_t transfer_utp(link_t *link, const unsigned char *data, const uint64_t size) {
+    event_loop_t *loop = loop_create();
+    timer_wheel_t *timers = timer_wheel_create(monotonic_coarse_ms());
+    int32_t accepted = -1;
+    utp_context_t *server = utp_create(loop, timers, 0, accept_callback, &accepted, LOG_NO);
+    utp_context_t *client = utp_create(loop, timers, 0, nullptr, nullptr, LOG_NO);
+    if (!loop || !timers || !server || !client) {
+        fprintf(stderr, "Couldn't create the uTP contexts\n");
+        exit(1);
+    }
+    uint16_t port;
+    link->socket = bound_socket(SOCK_DGRAM, &port);
+    link->server = loopback_address(server->port);
+    pthread_t thread;
+    pthread_create(&thread, nullptr, link_thread, link);
+
+    const struct sockaddr_in address = loopback_address(port);
+    const int32_t socket = utp_connect(client, &address);
+    uint64_t written = 0;
+    uint64_t received = 0;
+    unsigned char *buffer = malloc(1 << 16);
+    const uint64_t deadline = monotonic_coarse_ms() + BENCH_TIMEOUT * 1000;
+    struct epoll_event events[64];
+    while (received < size && monotonic_coarse_ms() < deadline) {
+        const int32_t nfds = epoll_wait(loop->epoll, events, 64, timer_wheel_timeout(timers, 1));
+        timer_wheel_advance(timers, monotonic_coarse_ms());
+        for (int32_t i = 0; i < nfds; ++i) loop_dispatch(loop, &events[i]);
+        if (written < size) {
+            const ssize_t result = write(socket, data + written, size - written);
+            if (result > 0) written += result;
+        }
+        while (accepted >= 0) {
+            const ssize_t result = read(accepted, buffer, 1 << 16);
+            if (result <= 0) break;
+            received += result;
+        }
+    }
+    atomic_store(&link->stop, true);
+    pthread_join(thread, nullptr);
+    free(buffer);
+    close(socket);
+    if (accepted >= 0) close(accepted);
+    utp_free(client);
+    utp_free(server);
+    close(link->socket);
+    timer_wheel_free(timers);
+    loop_free(loop);
+    return received;
+}
+
+/// @brief What the TCP sender thread sends
+typedef struct {
+    uint16_t port;
+    const unsigned char *data;
+    uint64_t size;
+} tcp_sender_t;
+
+static void *tcp_sender_thread(void *arg) {
+    const tcp_sender_t *sender = arg;
+    const int32_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    const struct sockaddr_in address = loopback_address(sender->port);
+    if (connect(fd, (const struct sockaddr *) &address, sizeof(address)) == 0) {
+        uint64_t written = 0;
+        while (written < sender->size) {
+            const ssize_t result = write(fd, sender->data + written, sender->size - written);
+            if (result <= 0) break;
+            written += result;
+        }
+    }
+    close(fd);
+    return nullptr;
+}
+
+/**
+ * Sends size bytes over TCP through the link
+ * @return Bytes that made it before BENCH_TIMEOUT
+ */
+static uint64_t transfer_tcp(link_t *link, const unsigned char *data, const uint64_t size) {
+    uint16_t server_port;
+    const int32_t listener = bound_socket(SOCK_STREAM, &server_port);
+    listen(listener, 1);
+    uint16_t link_port;
+    link->socket = bound_socket(SOCK_STREAM, &link_port);
+    listen(link->socket, 1);
+    link->server = loopback_address(server_port);
+    pthread_t thread;
+    pthread_create(&thread, nullptr, link_thread, link);
+    tcp_sender_t sender = {link_port, data, size};
+    pthread_t sender_thread;
+    pthread_create(&sender_thread, nullptr, tcp_sender_thread, &sender);
+
+    const int32_t server = accept(listener, nullptr, nullptr);
+    unsigned char *buffer = malloc(1 << 16);
+    uint64_t received = 0;
+    const uint64_t deadline = monotonic_coarse_ms() + BENCH_TIMEOUT * 1000;
+    while (received < size && monotonic_coarse_ms() < deadline) {
+        struct pollfd pfd = {server, POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        const ssize_t result = read(server, buffer, 1 << 16);
+        if (result <= 0) break;
+        received += result;
+    }
+    atomic_store(&link->stop, true);
+    pthread_join(sender_thread, nullptr);
+    pthread_join(thread, nullptr);
+    free(buffer);
+    close(server);
+    close(listener);
+    close(link->socket);
+    return received;
+}
+
+int main(const int argc, char **argv) {
+    const uint64_t size = (argc > 1 ? strtoull(argv[1], nullptr, 10) : BENCH_SIZE_MB) << 20;
+    const double rate = argc > 2 ? strtod(argv[2], nullptr) : BENCH_RATE_MBIT;
+    const uint64_t delay_ms = argc > 3 ? strtoull(argv[3], nullptr, 10) : BENCH_DELAY_MS;
+    const uint64_t queue_kb = argc > 4 ? strtoull(argv[4], nullptr, 10) : BENCH_QUEUE_KB;
+    if (size == 0 || rate <= 0) {
+        fprintf(stderr, "Usage: %s [size in MiB] [rate in Mbit/s] [one-way delay in ms] [queue in KiB]\n", argv[0]);
+        return 1;
+    }
+    unsigned char *data = malloc(size);
+    for (uint64_t i = 0; i < size; ++i) data[i] = (unsigned char) (i * 2654435761u >> 13);
+    printf("Link: %.1f Mbit/s, %lu ms each way, %lu KiB queue. %lu MiB over each transport, LEDBAT targets %d ms\n",
+           rate, (unsigned long) delay_ms, (unsigned long) queue_kb, (unsigned long) (size >> 20),
+           UTP_TARGET_DELAY_US / 1000);
+
+    for (uint32_t t = 0; t < 2; ++t) {
+        const bool tcp = t == 1;
+        link_t link = {0};
+        link.tcp = tcp;
+        link.rate_mbit = rate;
+        link.delay_us = delay_ms * 1000;
+        link.queue_bytes = queue_kb * 1024;
+        link.forward.packets = malloc(sizeof(link_packet_t) * LINK_RING);
+        link.backward.packets = malloc(sizeof(link_packet_t) * LINK_RING);
+        const uint64_t start = now_us();
+        const uint64_t received = tcp ? transfer_tcp(&link, data, size) : transfer_utp(&link, data, size);
+        report(tcp ? "TCP" : "uTP", &link, received, now_us() - start, received == size);
+        free(link.forward.packets);
+        free(link.backward.packets);
+        free(link.sojourns_us);
+    }
+    free(data);
+    return 0;
+}
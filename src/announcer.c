@@ -0,0 +1,500 @@
+#include "announcer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "basic_bencode.h"
+#include "http_tracker.h"
+#include "logger.h"
+#include "metrics.h"
+
+/**
+ * Seconds to wait for an answer to the request in flight, following BEP 15
+ */
+static time_t tracker_timeout(const tracker_t* tracker) {
+    return TRACKER_BASE_TIMEOUT << tracker->attempts;
+}
+
+static void free_address(address_t* address) {
+    if (address == nullptr) return;
+    free(address->host);
+    free(address->port);
+    free(address);
+}
+
+/**
+ * Name of the tracker for logging. HTTP URLs without a port aren't split into a host
+ */
+static const char* tracker_name(const tracker_t* tracker) {
+    return tracker->url ? tracker->url : tracker->address->host;
+}
+
+/**
+ * Parses an IP address into the tracker's server address. Returns false if ip isn't an IP address
+ */
+static bool set_server_addr(tracker_t* tracker, const char* ip, const uint16_t port) {
+    memset(&tracker->server_addr, 0, sizeof(tracker->server_addr));
+    struct sockaddr_in* addr = (struct sockaddr_in*) &tracker->server_addr;
+    struct sockaddr_in6* addr6 = (struct sockaddr_in6*) &tracker->server_addr;
+    if (inet_pton(AF_INET, ip, &addr->sin_addr) == 1) {
+        addr->sin_family = AF_INET;
+        addr->sin_port = port;
+        tracker->server_addr_len = sizeof(struct sockaddr_in);
+    } else if (inet_pton(AF_INET6, ip, &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = port;
+        tracker->server_addr_len = sizeof(struct sockaddr_in6);
+    } else return false;
+    return true;
+}
+
+/**
+ * Sets the tracker up, resolving it unless the resolver will. Returns false if the tracker can't be used at all
+ */
+static bool init_tracker(tracker_t* tracker, const char* url, const uint32_t tier, const announcer_t* announcer) {
+    const LOG_CODE log_code = announcer->log_code;
+    tracker->tier = tier;
+    tracker->address = split_address(url);
+    if (tracker->address == nullptr) return false;
+
+    // Curl resolves HTTP trackers itself, when announcing
+    if (tracker->address->protocol == HTTP || tracker->address->protocol == HTTPS) {
+        if (announcer->http_client == nullptr) {
+            free_address(tracker->address);
+            tracker->address = nullptr;
+            return false;
+        }
+        tracker->url = strdup(url);
+        return true;
+    }
+
+    if (announcer->client == nullptr || tracker->address->port == nullptr) {
+        free_address(tracker->address);
+        tracker->address = nullptr;
+        return false;
+    }
+
+    const uint16_t port = htons(decode_bencode_int(tracker->address->port, nullptr, log_code));
+    // IP addresses need no resolution at all
+    if (set_server_addr(tracker, tracker->address->host, port)) return true;
+    tracker->hostname = true;
+    // Resolved from the loop once the announcer is set up
+    if (announcer->resolver) return true;
+
+    char* ip = url_to_ip(tracker->address, log_code);
+    if (ip == nullptr || !set_server_addr(tracker, ip, port)) {
+        log_printf(log_code, LOG_ERR, "Couldn't resolve tracker %s\n", url);
+        free(ip);
+        free_address(tracker->address);
+        tracker->address = nullptr;
+        return false;
+    }
+    free(ip);
+    return true;
+}
+
+static void tracker_response(void* ctx, const unsigned char* response, uint32_t length);
+static void start_announce(tracker_t* tracker, time_t now);
+static void http_tracker_response(void* ctx, long status, const char* body, uint64_t length);
+
+static void send_connect(tracker_t* tracker, const time_t now) {
+    unsigned char buffer[sizeof(connect_request_t)];
+    const uint64_t protocol_id = htobe64(0x41727101980LL);
+    const uint32_t action = htobe32(ACTION_CONNECT);
+    memcpy(buffer, &protocol_id, 8);
+    memcpy(buffer+8, &action, 4);
+
+    tracker->status = TRACKER_CONNECTING;
+    tracker->deadline = now + tracker_timeout(tracker);
+    // A retransmission replaces the request in flight
+    udp_client_cancel(tracker->announcer->client, tracker->transaction_id);
+    tracker->transaction_id = udp_client_send(tracker->announcer->client, (struct sockaddr*) &tracker->server_addr,
+                                              tracker->server_addr_len, buffer, sizeof(buffer), tracker_response, tracker);
+    if (tracker->transaction_id == 0 && LOG_ENABLED(tracker->announcer->log_code, LOG_ERR)) {
+        log_write(LOG_ERR, "Can't send connect request to %s\n", tracker->address->host);
+    }
+    log_printf(tracker->announcer->log_code, LOG_FULL, "Queued connect request to %s\n", tracker->address->host);
+}
+
+static void send_announce(tracker_t* tracker, const time_t now, const ANNOUNCE_EVENT event) {
+    const announcer_t* announcer = tracker->announcer;
+
+    // Already in network endianness
+    const uint64_t connection_id = tracker->connection_id;
+    const uint32_t action = htobe32(ACTION_ANNOUNCE);
+    const uint64_t downloaded = htobe64(__atomic_load_n(&announcer->torrent_stats->downloaded, __ATOMIC_RELAXED));
+    const uint64_t left = htobe64(__atomic_load_n(&announcer->torrent_stats->left, __ATOMIC_RELAXED));
+    const uint64_t uploaded = htobe64(__atomic_load_n(&announcer->torrent_stats->uploaded, __ATOMIC_RELAXED));
+    const uint32_t event_be = htobe32(event);
+    const uint32_t ip = 0;
+    const uint32_t key = htobe32(announcer->torrent_stats->key);
+    const uint32_t num_want = htobe32(-1);
+    const uint16_t port = htons(announcer->torrent_stats->port);
+
+    unsigned char buffer[ANNOUNCE_REQUEST_SIZE];
+    memcpy(buffer, &connection_id, 8);
+    memcpy(buffer+8, &action, 4);
+    memcpy(buffer+16, announcer->info_hash, 20);
+    memcpy(buffer+36, announcer->peer_id, 20);
+    memcpy(buffer+56, &downloaded, 8);
+    memcpy(buffer+64, &left, 8);
+    memcpy(buffer+72, &uploaded, 8);
+    memcpy(buffer+80, &event_be, 4);
+    memcpy(buffer+84, &ip, 4);
+    memcpy(buffer+88, &key, 4);
+    memcpy(buffer+92, &num_want, 4);
+    memcpy(buffer+96, &port, 2);
+
+    udp_client_cancel(announcer->client, tracker->transaction_id);
+    tracker->transaction_id = 0;
+    if (event == ANNOUNCE_EVENT_STOPPED) {
+        // Nobody waits for the answer
+        udp_client_send(announcer->client, (struct sockaddr*) &tracker->server_addr, tracker->server_addr_len,
+                        buffer, ANNOUNCE_REQUEST_SIZE, nullptr, nullptr);
+    } else {
+        tracker->status = TRACKER_ANNOUNCING;
+        tracker->deadline = now + tracker_timeout(tracker);
+        tracker->transaction_id = udp_client_send(announcer->client, (struct sockaddr*) &tracker->server_addr,
+                                                  tracker->server_addr_len, buffer, ANNOUNCE_REQUEST_SIZE,
+                                                  tracker_response, tracker);
+        if (tracker->transaction_id == 0 && LOG_ENABLED(announcer->log_code, LOG_ERR)) {
+            log_write(LOG_ERR, "Can't send announce request to %s\n", tracker->address->host);
+        }
+    }
+    log_printf(announcer->log_code, LOG_FULL, "Queued announce request to %s\n", tracker->address->host);
+}
+
+static void send_http_announce(tracker_t* tracker, const time_t now, const ANNOUNCE_EVENT event) {
+    const announcer_t* announcer = tracker->announcer;
+    // HTTP trackers require a port, even from clients that don't listen
+    const uint16_t port = announcer->torrent_stats->port ? announcer->torrent_stats->port : HTTP_ANNOUNCE_PORT;
+    char* url = build_http_announce_url(tracker->url, announcer->info_hash, announcer->peer_id,
+                                        announcer->torrent_stats, port, event);
+    if (url == nullptr) return;
+
+    http_client_cancel(tracker->request);
+    tracker->request = nullptr;
+    if (event == ANNOUNCE_EVENT_STOPPED) {
+        // Nobody waits for the answer
+        http_client_get(announcer->http_client, url, nullptr, nullptr);
+    } else {
+        tracker->status = TRACKER_ANNOUNCING;
+        // Curl gives up after HTTP_TIMEOUT, this is only a safety net
+        tracker->deadline = now + HTTP_TIMEOUT + TRACKER_BASE_TIMEOUT;
+        tracker->request = http_client_get(announcer->http_client, url, http_tracker_response, tracker);
+        if (tracker->request == nullptr && LOG_ENABLED(announcer->log_code, LOG_ERR)) {
+            log_write(LOG_ERR, "Can't send announce request to %s\n", tracker->url);
+        }
+    }
+    free(url);
+}
+
+/**
+ * Marks the tracker as failed, to be retried after the longest BEP 15 timeout
+ */
+static void fail_tracker(tracker_t* tracker, const time_t now) {
+    tracker->status = TRACKER_FAILED;
+    tracker->connection_id = 0;
+    tracker->deadline = now + (TRACKER_BASE_TIMEOUT << MAX_ATTEMPTS);
+}
+
+static void tracker_resolved(void* ctx, const struct sockaddr* addr, const socklen_t addr_len) {
+    tracker_t* tracker = ctx;
+    const time_t now = time(nullptr);
+    // The resolver forgets the job before calling back
+    tracker->resolve_id = 0;
+    if (addr == nullptr) {
+        fail_tracker(tracker, now);
+        return;
+    }
+    memcpy(&tracker->server_addr, addr, addr_len);
+    tracker->server_addr_len = addr_len;
+    start_announce(tracker, now);
+    udp_client_flush(tracker->announcer->client);
+}
+
+/**
+ * Asks the resolver for the tracker's current address. The announce starts once it's found
+ */
+static void start_resolve(tracker_t* tracker, const time_t now) {
+    announcer_t* announcer = tracker->announcer;
+    tracker->status = TRACKER_RESOLVING;
+    tracker->deadline = now + (TRACKER_BASE_TIMEOUT << MAX_ATTEMPTS);
+    tracker->resolve_id = resolver_resolve(announcer->resolver, tracker->address->host, tracker->address->port,
+                                           SOCK_DGRAM, tracker_resolved, tracker);
+    if (tracker->resolve_id == 0) fail_tracker(tracker, now);
+}
+
+/**
+ * Announces straight away to HTTP trackers and UDP ones with a valid connection id, and connects otherwise
+ */
+static void start_announce(tracker_t* tracker, const time_t now) {
+    tracker->started_us = monotonic_us();
+    if (tracker->url) {
+        send_http_announce(tracker, now, tracker->announced ? ANNOUNCE_EVENT_NONE : ANNOUNCE_EVENT_STARTED);
+    } else if (udp_client_get_connection(tracker->announcer->client, (struct sockaddr*) &tracker->server_addr, now,
+                                  &tracker->connection_id)) {
+        send_announce(tracker, now, tracker->announced ? ANNOUNCE_EVENT_NONE : ANNOUNCE_EVENT_STARTED);
+    } else send_connect(tracker, now);
+}
+
+/**
+ * Schedules the next announce after a successful one
+ */
+static void announce_succeeded(tracker_t* tracker, const time_t now, const uint32_t interval) {
+    tracker->interval = interval;
+    if (tracker->interval == 0) tracker->interval = DEFAULT_ANNOUNCE_INTERVAL;
+    if (tracker->interval < MIN_ANNOUNCE_INTERVAL) tracker->interval = MIN_ANNOUNCE_INTERVAL;
+    tracker->status = TRACKER_WAITING;
+    tracker->attempts = 0;
+    tracker->announced = true;
+    tracker->deadline = now + tracker->interval;
+    tracker->announcer->responses++;
+    metrics_observe(METRIC_TRACKER_ANNOUNCE_SECONDS, monotonic_us() - tracker->started_us);
+}
+
+/**
+ * Handles a response routed to this tracker by the UDP client, and advances its state
+ */
+static void tracker_response(void* ctx, const unsigned char* response, const uint32_t length) {
+    tracker_t* tracker = ctx;
+    announcer_t* announcer = tracker->announcer;
+    const time_t now = time(nullptr);
+    // The UDP client forgets the transaction before calling back
+    tracker->transaction_id = 0;
+
+    uint32_t action;
+    memcpy(&action, response, 4);
+    action = be32toh(action);
+
+    if (action == ACTION_ERROR) {
+        if (LOG_ENABLED(announcer->log_code, LOG_ERR)) {
+            log_write(LOG_ERR, "Tracker %s returned error: %.*s\n", tracker->address->host, (int) length-8, response+8);
+        }
+        fail_tracker(tracker, now);
+        udp_client_forget_connection(announcer->client, (struct sockaddr*) &tracker->server_addr);
+        return;
+    }
+
+    if (tracker->status == TRACKER_CONNECTING && action == ACTION_CONNECT && length >= 16) {
+        memcpy(&tracker->connection_id, response+8, 8);
+        // Any other torrent announcing to this tracker in the next minute skips connecting
+        udp_client_set_connection(announcer->client, (struct sockaddr*) &tracker->server_addr, tracker->connection_id, now);
+        tracker->attempts = 0;
+        log_printf(announcer->log_code, LOG_FULL, "Tracker %s connected\n", tracker->address->host);
+        send_announce(tracker, now, tracker->announced ? ANNOUNCE_EVENT_NONE : ANNOUNCE_EVENT_STARTED);
+    } else if (tracker->status == TRACKER_ANNOUNCING && action == ACTION_ANNOUNCE && length >= 20) {
+        uint32_t interval, leechers, seeders;
+        memcpy(&interval, response+8, 4);
+        memcpy(&leechers, response+12, 4);
+        memcpy(&seeders, response+16, 4);
+        announce_succeeded(tracker, now, be32toh(interval));
+
+        // Peers of an IPv6 tracker are IPv6 too
+        const int32_t family = tracker->server_addr.ss_family;
+        const uint32_t stride = family == AF_INET6 ? COMPACT_PEER_V6_SIZE : COMPACT_PEER_V4_SIZE;
+        const uint32_t peer_amount = (length-20) / stride;
+        if (LOG_ENABLED(announcer->log_code, LOG_SUMM)) {
+            log_write(LOG_SUMM, "Tracker %s (tier %u) returned %u peers, %u seeders, %u leechers, interval %u\n",
+                    tracker->address->host, tracker->tier, peer_amount, be32toh(seeders), be32toh(leechers),
+                    tracker->interval);
+        }
+        if (peer_amount > 0 && announcer->on_peers) {
+            announcer->on_peers(announcer->ctx, response+20, peer_amount, family);
+        }
+    }
+}
+
+/**
+ * Handles the response of an HTTP tracker. Peers are handed over straight from the body, without copying
+ */
+static void http_tracker_response(void* ctx, const long status, const char* body, const uint64_t length) {
+    tracker_t* tracker = ctx;
+    const announcer_t* announcer = tracker->announcer;
+    const time_t now = time(nullptr);
+    // The HTTP client frees the request after calling back
+    tracker->request = nullptr;
+
+    http_announce_response_t response;
+    if (status != 200 || !parse_http_announce(body, length, &response)) {
+        if (LOG_ENABLED(announcer->log_code, LOG_ERR)) {
+            log_write(LOG_ERR, "Tracker %s returned an invalid response, status %ld\n", tracker->url, status);
+        }
+        fail_tracker(tracker, now);
+        return;
+    }
+    if (response.failure_reason) {
+        if (LOG_ENABLED(announcer->log_code, LOG_ERR)) {
+            log_write(LOG_ERR, "Tracker %s returned error: %.*s\n", tracker->url, (int) response.failure_reason_length,
+                    response.failure_reason);
+        }
+        fail_tracker(tracker, now);
+        return;
+    }
+
+    int64_t interval = response.interval > response.min_interval ? response.interval : response.min_interval;
+    if (interval < 0 || interval > UINT32_MAX) interval = 0;
+    announce_succeeded(tracker, now, (uint32_t) interval);
+
+    // Trackers ignoring compact=1 return dictionaries, which are compacted on the stack
+    unsigned char list_peers[HTTP_NUM_WANT * COMPACT_PEER_V4_SIZE];
+    const unsigned char* peers = response.peers;
+    uint32_t peer_amount = response.peer_amount;
+    if (peers == nullptr && response.peer_list) {
+        peer_amount = compact_peer_list(response.peer_list, response.peer_list_end, list_peers, HTTP_NUM_WANT);
+        peers = list_peers;
+    }
+    if (LOG_ENABLED(announcer->log_code, LOG_SUMM)) {
+        log_write(LOG_SUMM, "Tracker %s (tier %u) returned %u peers, %u IPv6 peers, %ld seeders, %ld leechers, interval %u\n",
+                tracker->url, tracker->tier, peer_amount, response.peer6_amount, (long) response.complete,
+                (long) response.incomplete, tracker->interval);
+    }
+    if (announcer->on_peers) {
+        if (peer_amount > 0) announcer->on_peers(announcer->ctx, peers, peer_amount, AF_INET);
+        if (response.peer6_amount > 0) {
+            announcer->on_peers(announcer->ctx, response.peers6, response.peer6_amount, AF_INET6);
+        }
+    }
+}
+
+announcer_t* announcer_start(udp_client_t* client, http_client_t* http_client, resolver_t* resolver,
+                             const metainfo_t* metainfo, const unsigned char* peer_id, const torrent_stats_t* torrent_stats,
+                             const peers_callback_t on_peers, void* ctx, const LOG_CODE log_code) {
+    if ((!client && !http_client) || !metainfo || !metainfo->info || !peer_id || !torrent_stats) return nullptr;
+
+    // Counting trackers in all tiers
+    uint32_t url_amount = 0;
+    for (const announce_list_ll* tier = metainfo->announce_list; tier != nullptr; tier = tier->next) {
+        for (const ll* url = tier->list; url != nullptr; url = url->next) {
+            url_amount++;
+        }
+    }
+    if (url_amount == 0 && metainfo->announce == nullptr) return nullptr;
+
+    announcer_t* announcer = calloc(1, sizeof(announcer_t));
+    announcer->client = client;
+    announcer->http_client = http_client;
+    announcer->resolver = resolver;
+    announcer->info_hash = metainfo->info->hash;
+    announcer->peer_id = peer_id;
+    announcer->torrent_stats = torrent_stats;
+    announcer->on_peers = on_peers;
+    announcer->ctx = ctx;
+    announcer->log_code = log_code;
+    announcer->trackers = calloc(url_amount > 0 ? url_amount : 1, sizeof(tracker_t));
+
+    if (url_amount > 0) {
+        uint32_t tier_index = 0;
+        for (const announce_list_ll* tier = metainfo->announce_list; tier != nullptr; tier = tier->next) {
+            for (const ll* url = tier->list; url != nullptr; url = url->next) {
+                tracker_t* tracker = &announcer->trackers[announcer->tracker_amount];
+                if (init_tracker(tracker, url->val, tier_index, announcer)) announcer->tracker_amount++;
+            }
+            tier_index++;
+        }
+    } else if (init_tracker(&announcer->trackers[0], metainfo->announce, 0, announcer)) {
+        announcer->tracker_amount = 1;
+    }
+
+    if (announcer->tracker_amount == 0) {
+        log_printf(log_code, LOG_ERR, "No usable tracker\n");
+        free(announcer->trackers);
+        free(announcer);
+        return nullptr;
+    }
+
+    // Contacting every tracker at once instead of tier by tier
+    const time_t now = time(nullptr);
+    for (uint32_t i = 0; i < announcer->tracker_amount; ++i) {
+        tracker_t* tracker = &announcer->trackers[i];
+        tracker->announcer = announcer;
+        if (tracker->hostname && resolver) {
+            start_resolve(tracker, now);
+        } else start_announce(tracker, now);
+    }
+    // All of them in as few syscalls as possible
+    if (client) udp_client_flush(client);
+    return announcer;
+}
+
+int32_t announcer_tick(announcer_t* announcer, const time_t now) {
+    if (announcer == nullptr) return EPOLL_TIMEOUT;
+
+    time_t next_deadline = now + EPOLL_TIMEOUT/1000;
+    for (uint32_t i = 0; i < announcer->tracker_amount; ++i) {
+        tracker_t* tracker = &announcer->trackers[i];
+        if (tracker->deadline <= now) {
+            switch (tracker->status) {
+                case TRACKER_RESOLVING:
+                    if (LOG_ENABLED(announcer->log_code, LOG_ERR)) {
+                        log_write(LOG_ERR, "Resolving tracker %s timed out\n", tracker_name(tracker));
+                    }
+                    resolver_cancel(announcer->resolver, tracker->resolve_id);
+                    tracker->resolve_id = 0;
+                    fail_tracker(tracker, now);
+                    break;
+                case TRACKER_CONNECTING:
+                case TRACKER_ANNOUNCING:
+                    // No answer in time
+                    tracker->attempts++;
+                    if (tracker->attempts >= MAX_ATTEMPTS || tracker->url) {
+                        if (LOG_ENABLED(announcer->log_code, LOG_ERR)) {
+                            log_write(LOG_ERR, "Tracker %s timed out %d times\n", tracker_name(tracker), tracker->attempts);
+                        }
+                        // Curl already retried HTTP trackers for as long as it makes sense
+                        http_client_cancel(tracker->request);
+                        tracker->request = nullptr;
+                        fail_tracker(tracker, now);
+                        break;
+                    }
+                    // The connection id may have expired while waiting for the announce
+                    if (tracker->status == TRACKER_CONNECTING) {
+                        send_connect(tracker, now);
+                    } else start_announce(tracker, now);
+                    break;
+                case TRACKER_WAITING:
+                case TRACKER_FAILED:
+                    // Time to re-announce, or to give a failed tracker another chance
+                    tracker->attempts = 0;
+                    if (tracker->hostname && announcer->resolver) {
+                        start_resolve(tracker, now);
+                    } else start_announce(tracker, now);
+                    break;
+            }
+        }
+        if (tracker->deadline < next_deadline) next_deadline = tracker->deadline;
+    }
+    if (announcer->client) udp_client_flush(announcer->client);
+    return next_deadline > now ? (int32_t)(next_deadline - now) * 1000 : 0;
+}
+
+void announcer_stop(announcer_t* announcer) {
+    if (announcer == nullptr) return;
+
+    const time_t now = time(nullptr);
+    for (uint32_t i = 0; i < announcer->tracker_amount; ++i) {
+        tracker_t* tracker = &announcer->trackers[i];
+        // Letting trackers know, without waiting for the answer
+        if (tracker->url) {
+            http_client_cancel(tracker->request);
+            tracker->request = nullptr;
+            if (tracker->announced) send_http_announce(tracker, now, ANNOUNCE_EVENT_STOPPED);
+            free(tracker->url);
+        } else {
+            resolver_cancel(announcer->resolver, tracker->resolve_id);
+            udp_client_cancel(announcer->client, tracker->transaction_id);
+            if (tracker->announced && udp_client_get_connection(announcer->client,
+                                                                (struct sockaddr*) &tracker->server_addr, now,
+                                                                &tracker->connection_id)) {
+                send_announce(tracker, now, ANNOUNCE_EVENT_STOPPED);
+            }
+        }
+        free_address(tracker->address);
+    }
+    if (announcer->client) udp_client_flush(announcer->client);
+    free(announcer->trackers);
+    free(announcer);
+}
@@ -0,0 +1,138 @@
+#ifndef BITTORRENT_CLIENT_ANNOUNCER_H
+#define BITTORRENT_CLIENT_ANNOUNCER_H
+
+#include <time.h>
+#include <sys/socket.h>
+
+#include "file.h"
+#include "http_client.h"
+#include "predownload_udp.h"
+#include "resolver.h"
+#include "udp_client.h"
+
+/// @brief Size of a compact IPv4 peer: 4 bytes of address and 2 of port
+#define COMPACT_PEER_V4_SIZE 6
+/// @brief Size of a compact IPv6 peer: 16 bytes of address and 2 of port
+#define COMPACT_PEER_V6_SIZE 18
+/// @brief Base of the BEP 15 retransmission timeout, which is 15*2^n seconds
+#define TRACKER_BASE_TIMEOUT 15
+/// @brief Interval used when a tracker returns none, in seconds
+#define DEFAULT_ANNOUNCE_INTERVAL 1800
+/// @brief Smallest re-announce interval accepted from a tracker, in seconds
+#define MIN_ANNOUNCE_INTERVAL 60
+
+/// @brief UDP tracker protocol actions
+typedef enum {
+    ACTION_CONNECT = 0,
+    ACTION_ANNOUNCE = 1,
+    ACTION_SCRAPE = 2,
+    ACTION_ERROR = 3
+} TRACKER_ACTION;
+
+/// @brief Enum for tracker statuses
+typedef enum {
+    TRACKER_RESOLVING, /**< Waiting for the resolver to find the tracker's address */
+    TRACKER_CONNECTING, /**< Connect request sent, waiting for the connection id */
+    TRACKER_ANNOUNCING, /**< Announce request sent, waiting for peers */
+    TRACKER_WAITING, /**< Announced successfully, waiting for the interval to pass */
+    TRACKER_FAILED, /**< Out of attempts, waiting before starting over */
+} TRACKER_STATUS;
+
+/**
+ * Function called every time a tracker returns peers.
+ *
+ * @param ctx The context pointer given to announcer_start().
+ * @param compact_peers Peers in compact format, straight from the tracker response. Only valid during the call.
+ * @param peer_amount Amount of peers in compact_peers.
+ * @param family AF_INET if each peer takes COMPACT_PEER_V4_SIZE bytes, AF_INET6 if COMPACT_PEER_V6_SIZE.
+ */
+typedef void (*peers_callback_t)(void *ctx, const unsigned char *compact_peers, uint32_t peer_amount, int32_t family);
+
+struct announcer_t;
+
+/// @brief State of a single tracker taken from announce or announce-list
+typedef struct {
+    struct announcer_t *announcer; /**< Announcer this tracker belongs to */
+    address_t *address; /**< Split tracker URL */
+    char *url; /**< Full announce URL of HTTP and HTTPS trackers, nullptr for UDP ones */
+    http_request_t *request; /**< HTTP announce in flight, or nullptr if there's none */
+    struct sockaddr_storage server_addr; /**< Resolved tracker address, for UDP trackers */
+    socklen_t server_addr_len; /**< Length of server_addr */
+    bool hostname; /**< Whether the UDP tracker is known by name, so it's resolved again before each announce */
+    uint32_t resolve_id; /**< Id of the resolution in progress, or 0 if there's none */
+    uint32_t tier; /**< Index of the announce-list tier this tracker belongs to */
+    TRACKER_STATUS status; /**< Current status */
+    uint64_t connection_id; /**< Connection id returned by the tracker, in network endianness */
+    uint32_t transaction_id; /**< Transaction id of the request in flight, or 0 if there's none */
+    uint32_t attempts; /**< Retransmissions of the request in flight, n in 15*2^n */
+    uint32_t interval; /**< Re-announce interval returned by the tracker, in seconds */
+    time_t deadline; /**< When to retransmit, re-announce or retry, depending on status */
+    uint64_t started_us; /**< Monotonic time the announce in flight started at, for its latency */
+    bool announced; /**< Whether the started event was already sent */
+} tracker_t;
+
+/// @brief Announces a torrent to all of its trackers at once, from the torrent's event loop
+typedef struct announcer_t {
+    udp_client_t *client; /**< Shared UDP socket requests go through */
+    http_client_t *http_client; /**< Shared HTTP client announces to HTTP trackers go through */
+    resolver_t *resolver; /**< Resolves UDP tracker hostnames, or nullptr to resolve them blocking */
+    tracker_t *trackers; /**< All trackers from every tier */
+    uint32_t tracker_amount; /**< Amount of trackers */
+    const unsigned char *info_hash; /**< 20-byte info hash of the torrent */
+    const unsigned char *peer_id; /**< 20-byte peer id of this client */
+    const torrent_stats_t *torrent_stats; /**< Statistics sent on each announce */
+    peers_callback_t on_peers; /**< Called whenever any tracker returns peers */
+    void *ctx; /**< Passed as is to on_peers */
+    uint32_t responses; /**< Amount of successful announces so far */
+    LOG_CODE log_code; /**< Logging level */
+} announcer_t;
+
+/**
+ * Creates an announcer for every UDP, HTTP and HTTPS tracker in the announce-list (or announce, if there's
+ * no list) and sends the first requests to all of them at once, regardless of their tier. UDP trackers with
+ * a cached connection id are announced to straight away. Nothing blocks waiting for answers: responses are
+ * handled by the event loop, and on_peers is called for each one, so peers can be contacted as soon as the
+ * fastest tracker answers.
+ *
+ * @param client The UDP client requests are sent through, or nullptr to skip UDP trackers.
+ *               Can be shared by many announcers.
+ * @param http_client The HTTP client announces to HTTP trackers go through, or nullptr to skip them.
+ * @param resolver Resolves UDP tracker hostnames from the event loop. If nullptr, they're resolved
+ *                 here, blocking, with url_to_ip().
+ * @param metainfo The torrent's metainfo, for trackers and info hash.
+ * @param peer_id 20-byte peer id of this client.
+ * @param torrent_stats Statistics sent on each announce. Must outlive the announcer.
+ * @param on_peers Called with the peers of every successful announce.
+ * @param ctx Passed as is to on_peers.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to the announcer, or nullptr if there's not a single usable tracker.
+ */
+announcer_t *announcer_start(udp_client_t *client, http_client_t *http_client, resolver_t *resolver,
+                             const metainfo_t *metainfo, const unsigned char *peer_id,
+                             const torrent_stats_t *torrent_stats, peers_callback_t on_peers, void *ctx,
+                             LOG_CODE log_code);
+
+/**
+ * Handles everything that depends on time: retransmissions after 15*2^n seconds, re-announces
+ * once the interval returned by a tracker has passed, and retries of failed trackers. Trackers known
+ * by hostname are resolved again first, which the resolver's cache usually answers straight away.
+ * Must be called on every iteration of the event loop.
+ *
+ * @param announcer The announcer.
+ * @param now Current time.
+ * @return Milliseconds until the next deadline, to be used as the epoll_wait() timeout.
+ */
+int32_t announcer_tick(announcer_t *announcer, time_t now);
+
+/**
+ * Sends a best-effort stopped event to every UDP tracker with a valid connection id and every HTTP tracker
+ * already announced to, cancels requests in flight and frees the announcer. HTTP stopped events only
+ * reach the tracker if the event loop keeps running for a while.
+ *
+ * @param announcer The announcer to stop. If nullptr, nothing is done.
+ */
+void announcer_stop(announcer_t *announcer);
+
+#endif //BITTORRENT_CLIENT_ANNOUNCER_H
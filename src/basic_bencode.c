@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "logger.h"
+
 // Cannot handle lists of lists
 ll* decode_bencode_list(const char* bencoded_list, uint32_t *length, const LOG_CODE log_code) {
     // Checking if the beginning is valid
@@ -64,7 +66,7 @@ char* decode_bencode_string(const char* bencoded_value, const LOG_CODE log_code)
         char *endptr;
         const int32_t length = (int32_t)strtol(bencoded_value, &endptr, 10);
         if (endptr == bencoded_value) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "No valid number found\n");
+            log_printf(log_code, LOG_ERR, "No valid number found\n");
             exit(1);
         }
         const char* colon_index = strchr(bencoded_value, ':');
@@ -77,10 +79,10 @@ char* decode_bencode_string(const char* bencoded_value, const LOG_CODE log_code)
             decoded_str[length+2] = '\0';
             return decoded_str;
         }
-        if (log_code >= LOG_ERR) fprintf(stderr, "Invalid encoded value: %s\n", bencoded_value);
+        log_printf(log_code, LOG_ERR, "Invalid encoded value: %s\n", bencoded_value);
         exit(1);
     }
-    if (log_code >= LOG_ERR) fprintf(stderr, "Unsupported formatting\n");
+    log_printf(log_code, LOG_ERR, "Unsupported formatting\n");
     exit(1);
 }
 
@@ -88,10 +90,94 @@ uint64_t decode_bencode_int(const char *bencoded_value, char **endptr, const LOG
     if (is_digit(bencoded_value[0])) {
         const uint64_t num = strtol(bencoded_value, endptr, 10);
         if (endptr != nullptr && *endptr == bencoded_value) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "Invalid number\n");
+            log_printf(log_code, LOG_ERR, "Invalid number\n");
             return 0;
         }
         return num;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+const char* skip_bencode_value(const char *bencoded_value, const char *limit) {
+    if (!bencoded_value || !limit) return nullptr;
+    const char* current = bencoded_value;
+    // Amount of lists and dictionaries still open
+    uint32_t depth = 0;
+    do {
+        if (current >= limit) return nullptr;
+        if (*current == 'l' || *current == 'd') {
+            depth++;
+            current++;
+        } else if (*current == 'e') {
+            if (depth == 0) return nullptr;
+            depth--;
+            current++;
+        } else if (*current == 'i') {
+            current++;
+            if (current < limit && *current == '-') current++;
+            const char* digits = current;
+            while (current < limit && is_digit(*current)) current++;
+            if (current == digits || current >= limit || *current != 'e') return nullptr;
+            current++;
+        } else if (is_digit(*current)) {
+            uint64_t string_length = 0;
+            while (current < limit && is_digit(*current)) {
+                string_length = string_length*10 + (*current - '0');
+                // Longer than anything that could fit before limit
+                if (string_length > (uint64_t)(limit - bencoded_value)) return nullptr;
+                current++;
+            }
+            if (current >= limit || *current != ':') return nullptr;
+            current++;
+            if (string_length > (uint64_t)(limit - current)) return nullptr;
+            current += string_length;
+        } else return nullptr;
+    } while (depth > 0);
+    return current;
+}
+
+bool read_bencode_string(const char *bencoded_value, const char *limit, const char **string, uint64_t *length) {
+    if (!bencoded_value || !limit || bencoded_value >= limit || !is_digit(*bencoded_value)) return false;
+    const char* end = skip_bencode_value(bencoded_value, limit);
+    if (!end) return false;
+    const char* colon = bencoded_value;
+    while (*colon != ':') colon++;
+    if (string) *string = colon+1;
+    if (length) *length = end - (colon+1);
+    return true;
+}
+
+bool read_bencode_int(const char *bencoded_value, const char *limit, int64_t *number) {
+    if (!bencoded_value || !limit || bencoded_value >= limit || *bencoded_value != 'i') return false;
+    const char* end = skip_bencode_value(bencoded_value, limit);
+    if (!end) return false;
+    const char* current = bencoded_value+1;
+    const bool negative = *current == '-';
+    if (negative) current++;
+    int64_t value = 0;
+    // end-1 is the closing 'e'
+    while (current < end-1) {
+        value = value*10 + (*current - '0');
+        current++;
+    }
+    if (number) *number = negative ? -value : value;
+    return true;
+}
+
+const char* find_bencode_key(const char *bencoded_dict, const char *limit, const char *key) {
+    if (!bencoded_dict || !limit || !key || bencoded_dict >= limit || *bencoded_dict != 'd') return nullptr;
+    const size_t key_length = strlen(key);
+    const char* current = bencoded_dict+1;
+    while (current < limit && *current != 'e') {
+        const char* current_key;
+        uint64_t current_key_length;
+        if (!read_bencode_string(current, limit, &current_key, &current_key_length)) return nullptr;
+        const char* value = current_key + current_key_length;
+        if (current_key_length == key_length && memcmp(current_key, key, key_length) == 0) {
+            return value < limit ? value : nullptr;
+        }
+        current = skip_bencode_value(value, limit);
+        if (!current) return nullptr;
+    }
+    return nullptr;
+}
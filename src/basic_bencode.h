@@ -59,4 +59,47 @@ char* decode_bencode_string(const char* bencoded_value, LOG_CODE log_code);
  */
 uint64_t decode_bencode_int(const char *bencoded_value, char **endptr, LOG_CODE log_code);
 
+/**
+ * Finds the end of any bencoded value (integer, string, list or dictionary), without copying anything.
+ *
+ * @param bencoded_value A pointer to the first character of the bencoded value.
+ * @param limit A pointer to one past the last byte that may be read.
+ * @return A pointer to the character right after the value, or nullptr if the value is malformed
+ *         or doesn't end before limit.
+ */
+const char* skip_bencode_value(const char *bencoded_value, const char *limit);
+
+/**
+ * Reads a bencoded string in place. Nothing is allocated: string points into the bencoded data.
+ *
+ * @param bencoded_value A pointer to the first character of the bencoded string (its length).
+ * @param limit A pointer to one past the last byte that may be read.
+ * @param string Where to store a pointer to the first byte of the string. Not null terminated.
+ * @param length Where to store the length of the string.
+ * @return true on success, false if the value isn't a string or doesn't end before limit.
+ */
+bool read_bencode_string(const char *bencoded_value, const char *limit, const char **string, uint64_t *length);
+
+/**
+ * Reads a bencoded integer, which may be negative.
+ *
+ * @param bencoded_value A pointer to the 'i' starting the integer.
+ * @param limit A pointer to one past the last byte that may be read.
+ * @param number Where to store the integer.
+ * @return true on success, false if the value isn't an integer or doesn't end before limit.
+ */
+bool read_bencode_int(const char *bencoded_value, const char *limit, int64_t *number);
+
+/**
+ * Finds the value of a key in a bencoded dictionary, without decoding or copying anything.
+ * Only the keys of this dictionary are compared, not those of nested ones.
+ *
+ * @param bencoded_dict A pointer to the 'd' starting the dictionary.
+ * @param limit A pointer to one past the last byte that may be read.
+ * @param key The key to look for, null terminated.
+ * @return A pointer to the first character of the value, or nullptr if the key isn't there
+ *         or the dictionary is malformed.
+ */
+const char* find_bencode_key(const char *bencoded_dict, const char *limit, const char *key);
+
 #endif //BITTORRENT_CLIENT_BASIC_BENCODE_H
\ No newline at end of file
@@ -0,0 +1,878 @@
+#include "dht.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/sha.h>
+
+#include "basic_bencode.h"
+#include "logger.h"
+#include "metrics.h"
+#include "sha1.h"
+
+/// @brief A KRPC message being built
+typedef struct {
+    unsigned char data[DHT_MESSAGE_MAX]; /**< Message so far */
+    uint32_t length; /**< Bytes of data used */
+    bool overflow; /**< Set if something didn't fit, so the message isn't sent */
+} krpc_buffer_t;
+
+/// @brief Method names of DHT_QUERY, as sent in "q"
+static const char* query_names[] = {
+    [DHT_PING] = "ping",
+    [DHT_FIND_NODE] = "find_node",
+    [DHT_GET_PEERS] = "get_peers",
+    [DHT_ANNOUNCE_PEER] = "announce_peer"
+};
+
+static void put_bytes(krpc_buffer_t* buffer, const void* bytes, const uint32_t length) {
+    if (buffer->length + length > DHT_MESSAGE_MAX) {
+        buffer->overflow = true;
+        return;
+    }
+    memcpy(buffer->data + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+static void put_raw(krpc_buffer_t* buffer, const char* text) {
+    put_bytes(buffer, text, strlen(text));
+}
+
+static void put_string(krpc_buffer_t* buffer, const void* bytes, const uint32_t length) {
+    char prefix[16];
+    put_bytes(buffer, prefix, sprintf(prefix, "%" PRIu32 ":", length));
+    put_bytes(buffer, bytes, length);
+}
+
+static void put_int(krpc_buffer_t* buffer, const int64_t number) {
+    char text[24];
+    put_bytes(buffer, text, sprintf(text, "i%" PRId64 "e", number));
+}
+
+/**
+ * Compares how far a and b are from target, by XOR distance
+ * @return Negative if a is closer, positive if b is, 0 if they're the same id
+ */
+static int32_t compare_distance(const unsigned char* target, const unsigned char* a, const unsigned char* b) {
+    for (int32_t i = 0; i < 20; ++i) {
+        const uint8_t distance_a = a[i] ^ target[i];
+        const uint8_t distance_b = b[i] ^ target[i];
+        if (distance_a != distance_b) return distance_a < distance_b ? -1 : 1;
+    }
+    return 0;
+}
+
+uint32_t dht_common_prefix(const unsigned char* a, const unsigned char* b) {
+    for (uint32_t i = 0; i < 20; ++i) {
+        const uint8_t difference = a[i] ^ b[i];
+        if (difference != 0) return i * 8 + __builtin_clz(difference) - 24;
+    }
+    return 160;
+}
+
+static void send_message(const dht_t* dht, const uint32_t address, const uint16_t port, const krpc_buffer_t* buffer) {
+    if (buffer->overflow) return;
+    struct sockaddr_in destination = {0};
+    destination.sin_family = AF_INET;
+    destination.sin_addr.s_addr = address;
+    destination.sin_port = port;
+    // Nothing is queued: a datagram that doesn't fit in the socket buffer is as good as lost on the way
+    if (sendto(dht->sockfd, buffer->data, buffer->length, MSG_DONTWAIT | MSG_NOSIGNAL, (struct sockaddr*) &destination,
+               sizeof(destination)) < 0) {
+        log_printf(dht->log_code, LOG_FULL, "Couldn't send DHT message: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Sends a query, remembering it until its response or timeout
+ * @return true if it was sent, false if DHT_MAX_QUERIES are in flight
+ */
+static bool send_query(dht_t* dht, const DHT_QUERY query, const uint32_t address, const uint16_t port,
+                       const unsigned char* target, const int32_t lookup, const unsigned char* token,
+                       const uint8_t token_length, const uint16_t announce_port) {
+    if (dht->query_amount == DHT_MAX_QUERIES) return false;
+    uint32_t slot = 0;
+    while (dht->queries[slot].used) slot++;
+    dht_query_t* entry = &dht->queries[slot];
+    entry->used = true;
+    entry->check = (uint16_t) arc4random();
+    entry->query = query;
+    entry->address = address;
+    entry->port = port;
+    entry->lookup = lookup;
+    entry->sent_ms = dht->timers->now_ms;
+    dht->query_amount++;
+
+    const unsigned char transaction[DHT_TRANSACTION_SIZE] = {
+        (unsigned char) (slot >> 8), (unsigned char) slot, (unsigned char) (entry->check >> 8),
+        (unsigned char) entry->check
+    };
+    krpc_buffer_t buffer;
+    buffer.length = 0;
+    buffer.overflow = false;
+    // Keys of every dictionary go in sorted order
+    put_raw(&buffer, "d1:ad2:id");
+    put_string(&buffer, dht->id, 20);
+    switch (query) {
+        case DHT_FIND_NODE:
+            put_raw(&buffer, "6:target");
+            put_string(&buffer, target, 20);
+            break;
+        case DHT_GET_PEERS:
+            put_raw(&buffer, "9:info_hash");
+            put_string(&buffer, target, 20);
+            break;
+        case DHT_ANNOUNCE_PEER:
+            put_raw(&buffer, "12:implied_porti0e9:info_hash");
+            put_string(&buffer, target, 20);
+            put_raw(&buffer, "4:port");
+            put_int(&buffer, announce_port);
+            put_raw(&buffer, "5:token");
+            put_string(&buffer, token, token_length);
+            break;
+        default: ;
+    }
+    put_raw(&buffer, "e1:q");
+    put_string(&buffer, query_names[query], strlen(query_names[query]));
+    put_raw(&buffer, "1:t");
+    put_string(&buffer, transaction, DHT_TRANSACTION_SIZE);
+    put_raw(&buffer, "1:y1:qe");
+    send_message(dht, address, port, &buffer);
+    metrics_add(METRIC_DHT_QUERIES, 1);
+    return true;
+}
+
+/**
+ * Takes the query a response is for, checking it came from the node queried
+ */
+static bool take_query(dht_t* dht, const char* transaction, const uint64_t transaction_length,
+                       const struct sockaddr_in* from, dht_query_t* query) {
+    if (transaction_length != DHT_TRANSACTION_SIZE) return false;
+    const unsigned char* bytes = (const unsigned char*) transaction;
+    const uint32_t slot = (uint32_t) bytes[0] << 8 | bytes[1];
+    const uint16_t check = (uint16_t) (bytes[2] << 8 | bytes[3]);
+    if (slot >= DHT_MAX_QUERIES) return false;
+    dht_query_t* entry = &dht->queries[slot];
+    if (!entry->used || entry->check != check || entry->address != from->sin_addr.s_addr ||
+        entry->port != from->sin_port) {
+        return false;
+    }
+    *query = *entry;
+    entry->used = false;
+    dht->query_amount--;
+    return true;
+}
+
+static bool query_in_flight(const dht_t* dht, const uint32_t address, const uint16_t port) {
+    for (uint32_t i = 0; i < DHT_MAX_QUERIES; ++i) {
+        if (dht->queries[i].used && dht->queries[i].address == address && dht->queries[i].port == port) return true;
+    }
+    return false;
+}
+
+/**
+ * Adds or refreshes a node. seen_ms is 0 for nodes read from the state file, which are never pinged from here
+ */
+static bool insert_node(dht_t* dht, const unsigned char* id, const uint32_t address, const uint16_t port,
+                        const uint64_t seen_ms) {
+    if (address == 0 || port == 0) return false;
+    const uint32_t bucket_index = dht_common_prefix(dht->id, id);
+    // Ourselves
+    if (bucket_index >= DHT_BUCKETS) return false;
+    dht_node_t* bucket = dht->nodes[bucket_index];
+    uint8_t* amount = &dht->bucket_amount[bucket_index];
+
+    dht_node_t* node = nullptr;
+    for (uint32_t i = 0; i < *amount && !node; ++i) {
+        if (memcmp(bucket[i].id, id, 20) == 0) node = &bucket[i];
+    }
+    if (!node && *amount < DHT_K) {
+        node = &bucket[(*amount)++];
+        dht->node_amount++;
+        metrics_set_gauge(METRIC_DHT_NODES, dht->node_amount);
+    }
+    if (!node) {
+        // Only nodes that stopped answering make room. The least recently seen one is asked if it still does
+        dht_node_t* oldest = &bucket[0];
+        for (uint32_t i = 0; i < DHT_K && !node; ++i) {
+            if (bucket[i].fails >= DHT_MAX_FAILS) node = &bucket[i];
+            else if (bucket[i].seen_ms < oldest->seen_ms) oldest = &bucket[i];
+        }
+        if (!node) {
+            if (seen_ms != 0 && (oldest->seen_ms == 0 || oldest->seen_ms + DHT_QUESTIONABLE_MS <= seen_ms) &&
+                !query_in_flight(dht, oldest->address, oldest->port)) {
+                send_query(dht, DHT_PING, oldest->address, oldest->port, nullptr, -1, nullptr, 0, 0);
+            }
+            return false;
+        }
+    }
+    memcpy(node->id, id, 20);
+    node->address = address;
+    node->port = port;
+    node->fails = 0;
+    if (seen_ms != 0) node->seen_ms = seen_ms;
+    return true;
+}
+
+bool dht_insert(dht_t* dht, const unsigned char* id, const uint32_t address, const uint16_t port) {
+    if (!dht || !id) return false;
+    return insert_node(dht, id, address, port, dht->timers->now_ms);
+}
+
+/**
+ * Counts a query a node didn't answer, so it can be replaced once it fails DHT_MAX_FAILS times
+ */
+static void node_failed(dht_t* dht, const uint32_t address, const uint16_t port) {
+    for (uint32_t b = 0; b < DHT_BUCKETS; ++b) {
+        for (uint32_t i = 0; i < dht->bucket_amount[b]; ++i) {
+            dht_node_t* node = &dht->nodes[b][i];
+            if (node->address == address && node->port == port && node->fails < UINT8_MAX) node->fails++;
+        }
+    }
+}
+
+uint32_t dht_closest(const dht_t* dht, const unsigned char* target, dht_node_t* closest, const uint32_t max) {
+    if (!dht || !target || !closest || max == 0) return 0;
+    uint32_t amount = 0;
+    // The whole table is a few contiguous kilobytes, scanning it beats walking buckets outwards
+    for (uint32_t b = 0; b < DHT_BUCKETS; ++b) {
+        for (uint32_t i = 0; i < dht->bucket_amount[b]; ++i) {
+            const dht_node_t* node = &dht->nodes[b][i];
+            if (node->fails >= DHT_MAX_FAILS) continue;
+            if (amount == max && compare_distance(target, node->id, closest[max - 1].id) >= 0) continue;
+            uint32_t position = amount < max ? amount : max - 1;
+            while (position > 0 && compare_distance(target, node->id, closest[position - 1].id) < 0) {
+                closest[position] = closest[position - 1];
+                position--;
+            }
+            closest[position] = *node;
+            if (amount < max) amount++;
+        }
+    }
+    return amount;
+}
+
+/**
+ * Writes the DHT_K closest nodes to target in compact form
+ * @return Bytes written
+ */
+static uint32_t compact_closest(const dht_t* dht, const unsigned char* target, unsigned char* compact) {
+    dht_node_t closest[DHT_K];
+    const uint32_t amount = dht_closest(dht, target, closest, DHT_K);
+    for (uint32_t i = 0; i < amount; ++i) {
+        memcpy(compact + i * DHT_COMPACT_NODE_SIZE, closest[i].id, 20);
+        memcpy(compact + i * DHT_COMPACT_NODE_SIZE + 20, &closest[i].address, 4);
+        memcpy(compact + i * DHT_COMPACT_NODE_SIZE + 24, &closest[i].port, 2);
+    }
+    return amount * DHT_COMPACT_NODE_SIZE;
+}
+
+/**
+ * Adds a node to a lookup in distance order, dropping the farthest one if it's full
+ */
+static void add_candidate(const dht_t* dht, dht_lookup_t* lookup, const unsigned char* id, const uint32_t address,
+                          const uint16_t port) {
+    if (address == 0 || port == 0 || memcmp(id, dht->id, 20) == 0) return;
+    for (uint32_t i = 0; i < lookup->candidate_amount; ++i) {
+        if (memcmp(lookup->candidates[i].id, id, 20) == 0) return;
+    }
+    uint32_t position = lookup->candidate_amount;
+    while (position > 0 && compare_distance(lookup->target, id, lookup->candidates[position - 1].id) < 0) position--;
+    if (position >= DHT_LOOKUP_SIZE) return;
+    uint32_t last = lookup->candidate_amount;
+    if (last == DHT_LOOKUP_SIZE) {
+        last--;
+        // Its response won't find it any more
+        if (lookup->candidates[last].state == DHT_CANDIDATE_QUERIED) lookup->in_flight--;
+    } else lookup->candidate_amount++;
+    memmove(&lookup->candidates[position + 1], &lookup->candidates[position],
+            (last - position) * sizeof(dht_candidate_t));
+    dht_candidate_t* candidate = &lookup->candidates[position];
+    memcpy(candidate->id, id, 20);
+    candidate->address = address;
+    candidate->port = port;
+    candidate->state = DHT_CANDIDATE_NEW;
+    candidate->token_length = 0;
+}
+
+static dht_candidate_t* find_candidate(dht_lookup_t* lookup, const uint32_t address, const uint16_t port) {
+    for (uint32_t i = 0; i < lookup->candidate_amount; ++i) {
+        if (lookup->candidates[i].address == address && lookup->candidates[i].port == port) {
+            return &lookup->candidates[i];
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Announces to the closest nodes that gave a token, and schedules the next round
+ */
+static void finish_lookup(dht_t* dht, dht_lookup_t* lookup) {
+    lookup->done = true;
+    lookup->next_ms = dht->timers->now_ms + DHT_LOOKUP_INTERVAL_MS;
+    uint32_t responded = 0;
+    uint32_t announced = 0;
+    for (uint32_t i = 0; i < lookup->candidate_amount && responded < DHT_K; ++i) {
+        const dht_candidate_t* candidate = &lookup->candidates[i];
+        if (candidate->state != DHT_CANDIDATE_RESPONDED) continue;
+        responded++;
+        if (lookup->query != DHT_GET_PEERS || lookup->port == 0 || candidate->token_length == 0) continue;
+        if (send_query(dht, DHT_ANNOUNCE_PEER, candidate->address, candidate->port, lookup->target, -1,
+                       candidate->token, candidate->token_length, lookup->port)) {
+            announced++;
+        }
+    }
+    log_printf(dht->log_code, LOG_FULL, "DHT lookup done: %u closest nodes responded, announced to %u, %u in table\n",
+               responded, announced, dht->node_amount);
+}
+
+/**
+ * Queries the closest candidates not queried yet, keeping DHT_ALPHA queries in flight, and finishes the round
+ * once the DHT_K closest that didn't fail responded
+ */
+static void step_lookup(dht_t* dht, const int32_t index) {
+    dht_lookup_t* lookup = &dht->lookups[index];
+    if (!lookup->active || lookup->done) return;
+    uint32_t responded = 0;
+    bool pending = false;
+    for (uint32_t i = 0; i < lookup->candidate_amount && responded < DHT_K; ++i) {
+        dht_candidate_t* candidate = &lookup->candidates[i];
+        if (candidate->state == DHT_CANDIDATE_RESPONDED) responded++;
+        else if (candidate->state == DHT_CANDIDATE_QUERIED) pending = true;
+        else if (candidate->state == DHT_CANDIDATE_NEW) {
+            pending = true;
+            if (lookup->in_flight >= DHT_ALPHA) continue;
+            if (!send_query(dht, lookup->query, candidate->address, candidate->port, lookup->target, index,
+                            nullptr, 0, 0)) {
+                break;
+            }
+            candidate->state = DHT_CANDIDATE_QUERIED;
+            lookup->in_flight++;
+        }
+    }
+    // Without a single response the round isn't over: it starts over from the routing table on the next tick
+    if (pending || lookup->in_flight > 0 || responded == 0) return;
+    finish_lookup(dht, lookup);
+}
+
+/**
+ * Starts a round of a lookup from the closest nodes of the routing table
+ */
+static void restart_lookup(dht_t* dht, const int32_t index) {
+    dht_lookup_t* lookup = &dht->lookups[index];
+    lookup->candidate_amount = 0;
+    lookup->in_flight = 0;
+    lookup->done = false;
+    dht_node_t closest[DHT_K * 2];
+    const uint32_t amount = dht_closest(dht, lookup->target, closest, DHT_K * 2);
+    for (uint32_t i = 0; i < amount; ++i) add_candidate(dht, lookup, closest[i].id, closest[i].address, closest[i].port);
+    step_lookup(dht, index);
+}
+
+static void make_token(const dht_t* dht, const uint32_t address, const uint32_t secret, unsigned char* token) {
+    unsigned char input[sizeof(dht->secrets[0]) + 4];
+    memcpy(input, dht->secrets[secret], sizeof(dht->secrets[0]));
+    memcpy(input + sizeof(dht->secrets[0]), &address, 4);
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    sha1_hash(input, sizeof(input), hash);
+    memcpy(token, hash, DHT_TOKEN_SIZE);
+}
+
+static bool valid_token(const dht_t* dht, const uint32_t address, const char* token, const uint64_t token_length) {
+    if (token_length != DHT_TOKEN_SIZE) return false;
+    for (uint32_t secret = 0; secret < 2; ++secret) {
+        unsigned char expected[DHT_TOKEN_SIZE];
+        make_token(dht, address, secret, expected);
+        if (memcmp(expected, token, DHT_TOKEN_SIZE) == 0) return true;
+    }
+    return false;
+}
+
+static void store_peer(dht_t* dht, const unsigned char* info_hash, const uint32_t address, const uint16_t port) {
+    unsigned char peer[COMPACT_PEER_V4_SIZE];
+    memcpy(peer, &address, 4);
+    memcpy(peer + 4, &port, 2);
+    dht_stored_peer_t* entry = &dht->store[0];
+    for (uint32_t i = 0; i < DHT_STORE_SIZE; ++i) {
+        dht_stored_peer_t* stored = &dht->store[i];
+        if (stored->announced_ms != 0 && memcmp(stored->info_hash, info_hash, 20) == 0 &&
+            memcmp(stored->peer, peer, COMPACT_PEER_V4_SIZE) == 0) {
+            entry = stored;
+            break;
+        }
+        // Free entries have the oldest time of all
+        if (stored->announced_ms < entry->announced_ms) entry = stored;
+    }
+    memcpy(entry->info_hash, info_hash, 20);
+    memcpy(entry->peer, peer, COMPACT_PEER_V4_SIZE);
+    entry->announced_ms = dht->timers->now_ms;
+}
+
+static void start_response(krpc_buffer_t* buffer, const dht_t* dht) {
+    buffer->length = 0;
+    buffer->overflow = false;
+    put_raw(buffer, "d1:rd2:id");
+    put_string(buffer, dht->id, 20);
+}
+
+static void end_message(krpc_buffer_t* buffer, const char* transaction, const uint64_t transaction_length,
+                        const char* type) {
+    put_raw(buffer, "e1:t");
+    put_string(buffer, transaction, transaction_length);
+    put_raw(buffer, "1:y1:");
+    put_raw(buffer, type);
+    put_raw(buffer, "e");
+}
+
+static void send_error(const dht_t* dht, const struct sockaddr_in* to, const char* transaction,
+                       const uint64_t transaction_length, const int64_t code, const char* message) {
+    krpc_buffer_t buffer;
+    buffer.length = 0;
+    buffer.overflow = false;
+    put_raw(&buffer, "d1:eli");
+    char text[24];
+    put_bytes(&buffer, text, sprintf(text, "%" PRId64 "e", code));
+    put_string(&buffer, message, strlen(message));
+    end_message(&buffer, transaction, transaction_length, "e");
+    send_message(dht, to->sin_addr.s_addr, to->sin_port, &buffer);
+}
+
+/**
+ * Reads a 20-byte string from a dictionary
+ */
+static const unsigned char* read_id(const char* dict, const char* limit, const char* key) {
+    const char* value = find_bencode_key(dict, limit, key);
+    const char* string;
+    uint64_t length;
+    if (!value || !read_bencode_string(value, limit, &string, &length) || length != 20) return nullptr;
+    return (const unsigned char*) string;
+}
+
+/**
+ * Answers a query from another node
+ */
+static void handle_query(dht_t* dht, const char* message, const char* limit, const struct sockaddr_in* from,
+                         const char* transaction, const uint64_t transaction_length) {
+    const char* method_value = find_bencode_key(message, limit, "q");
+    const char* arguments = find_bencode_key(message, limit, "a");
+    const char* method;
+    uint64_t method_length;
+    const char* arguments_end = arguments && *arguments == 'd' ? skip_bencode_value(arguments, limit) : nullptr;
+    const unsigned char* id = arguments_end ? read_id(arguments, arguments_end, "id") : nullptr;
+    if (!method_value || !read_bencode_string(method_value, limit, &method, &method_length) || !id) {
+        send_error(dht, from, transaction, transaction_length, 203, "Protocol Error");
+        return;
+    }
+
+    krpc_buffer_t buffer;
+    start_response(&buffer, dht);
+    if (method_length == 4 && memcmp(method, "ping", 4) == 0) {
+        // Nothing but our id
+    } else if (method_length == 9 && memcmp(method, "find_node", 9) == 0) {
+        const unsigned char* target = read_id(arguments, arguments_end, "target");
+        if (!target) {
+            send_error(dht, from, transaction, transaction_length, 203, "Protocol Error");
+            return;
+        }
+        unsigned char nodes[DHT_K * DHT_COMPACT_NODE_SIZE];
+        put_raw(&buffer, "5:nodes");
+        put_string(&buffer, nodes, compact_closest(dht, target, nodes));
+    } else if (method_length == 9 && memcmp(method, "get_peers", 9) == 0) {
+        const unsigned char* info_hash = read_id(arguments, arguments_end, "info_hash");
+        if (!info_hash) {
+            send_error(dht, from, transaction, transaction_length, 203, "Protocol Error");
+            return;
+        }
+        unsigned char nodes[DHT_K * DHT_COMPACT_NODE_SIZE];
+        put_raw(&buffer, "5:nodes");
+        put_string(&buffer, nodes, compact_closest(dht, info_hash, nodes));
+        unsigned char token[DHT_TOKEN_SIZE];
+        make_token(dht, from->sin_addr.s_addr, 0, token);
+        put_raw(&buffer, "5:token");
+        put_string(&buffer, token, DHT_TOKEN_SIZE);
+        uint32_t values = 0;
+        for (uint32_t i = 0; i < DHT_STORE_SIZE && values < DHT_MAX_VALUES; ++i) {
+            const dht_stored_peer_t* stored = &dht->store[i];
+            if (stored->announced_ms == 0 || stored->announced_ms + DHT_STORE_TTL_MS <= dht->timers->now_ms ||
+                memcmp(stored->info_hash, info_hash, 20) != 0) {
+                continue;
+            }
+            if (values++ == 0) put_raw(&buffer, "6:valuesl");
+            put_string(&buffer, stored->peer, COMPACT_PEER_V4_SIZE);
+        }
+        if (values > 0) put_raw(&buffer, "e");
+    } else if (method_length == 13 && memcmp(method, "announce_peer", 13) == 0) {
+        const unsigned char* info_hash = read_id(arguments, arguments_end, "info_hash");
+        const char* token_value = find_bencode_key(arguments, arguments_end, "token");
+        const char* port_value = find_bencode_key(arguments, arguments_end, "port");
+        const char* implied_value = find_bencode_key(arguments, arguments_end, "implied_port");
+        const char* token;
+        uint64_t token_length;
+        int64_t port = 0;
+        int64_t implied = 0;
+        if (!info_hash || !token_value || !read_bencode_string(token_value, arguments_end, &token, &token_length) ||
+            (implied_value && !read_bencode_int(implied_value, arguments_end, &implied)) ||
+            (!implied && (!port_value || !read_bencode_int(port_value, arguments_end, &port) || port <= 0 ||
+                          port > UINT16_MAX))) {
+            send_error(dht, from, transaction, transaction_length, 203, "Protocol Error");
+            return;
+        }
+        if (!valid_token(dht, from->sin_addr.s_addr, token, token_length)) {
+            send_error(dht, from, transaction, transaction_length, 203, "Bad Token");
+            return;
+        }
+        store_peer(dht, info_hash, from->sin_addr.s_addr, implied ? from->sin_port : htons((uint16_t) port));
+    } else {
+        send_error(dht, from, transaction, transaction_length, 204, "Method Unknown");
+        return;
+    }
+    end_message(&buffer, transaction, transaction_length, "r");
+    send_message(dht, from->sin_addr.s_addr, from->sin_port, &buffer);
+    // Nodes querying us are alive too
+    dht_insert(dht, id, from->sin_addr.s_addr, from->sin_port);
+}
+
+/**
+ * Marks the candidate a failed or erroneous query went to, so its lookup moves on
+ */
+static void candidate_failed(dht_t* dht, const dht_query_t* query) {
+    if (query->lookup < 0) return;
+    dht_lookup_t* lookup = &dht->lookups[query->lookup];
+    dht_candidate_t* candidate = lookup->active ? find_candidate(lookup, query->address, query->port) : nullptr;
+    if (!candidate || candidate->state != DHT_CANDIDATE_QUERIED) return;
+    candidate->state = DHT_CANDIDATE_FAILED;
+    lookup->in_flight--;
+}
+
+/**
+ * Handles the response to one of our queries: the responder goes into the routing table, and the nodes and
+ * peers it returned into its lookup
+ */
+static void handle_response(dht_t* dht, const char* message, const char* limit, const struct sockaddr_in* from,
+                            const dht_query_t* query) {
+    const char* response = find_bencode_key(message, limit, "r");
+    const char* response_end = response && *response == 'd' ? skip_bencode_value(response, limit) : nullptr;
+    const unsigned char* id = response_end ? read_id(response, response_end, "id") : nullptr;
+    if (!id) {
+        candidate_failed(dht, query);
+        return;
+    }
+    dht_insert(dht, id, from->sin_addr.s_addr, from->sin_port);
+    if (query->lookup < 0 || !dht->lookups[query->lookup].active) return;
+    dht_lookup_t* lookup = &dht->lookups[query->lookup];
+
+    dht_candidate_t* candidate = find_candidate(lookup, from->sin_addr.s_addr, from->sin_port);
+    if (candidate && candidate->state == DHT_CANDIDATE_QUERIED) {
+        candidate->state = DHT_CANDIDATE_RESPONDED;
+        lookup->in_flight--;
+        const char* token_value = find_bencode_key(response, response_end, "token");
+        const char* token;
+        uint64_t token_length;
+        if (token_value && read_bencode_string(token_value, response_end, &token, &token_length) &&
+            token_length <= DHT_TOKEN_MAX) {
+            memcpy(candidate->token, token, token_length);
+            candidate->token_length = (uint8_t) token_length;
+        }
+    }
+
+    const char* nodes_value = find_bencode_key(response, response_end, "nodes");
+    const char* nodes;
+    uint64_t nodes_length;
+    if (nodes_value && read_bencode_string(nodes_value, response_end, &nodes, &nodes_length)) {
+        for (uint64_t offset = 0; offset + DHT_COMPACT_NODE_SIZE <= nodes_length; offset += DHT_COMPACT_NODE_SIZE) {
+            const unsigned char* node = (const unsigned char*) nodes + offset;
+            uint32_t address;
+            uint16_t port;
+            memcpy(&address, node + 20, 4);
+            memcpy(&port, node + 24, 2);
+            add_candidate(dht, lookup, node, address, port);
+        }
+    }
+
+    const char* values = query->query == DHT_GET_PEERS ? find_bencode_key(response, response_end, "values") : nullptr;
+    if (values && *values == 'l' && lookup->on_peers) {
+        unsigned char peers[DHT_MAX_VALUES * COMPACT_PEER_V4_SIZE];
+        uint32_t peer_amount = 0;
+        const char* value = values + 1;
+        while (value < response_end && *value != 'e' && peer_amount < DHT_MAX_VALUES) {
+            const char* peer;
+            uint64_t peer_length;
+            if (!read_bencode_string(value, response_end, &peer, &peer_length)) break;
+            // IPv6 peers don't fit the rest of the client
+            if (peer_length == COMPACT_PEER_V4_SIZE) {
+                memcpy(peers + peer_amount++ * COMPACT_PEER_V4_SIZE, peer, COMPACT_PEER_V4_SIZE);
+            }
+            value = peer + peer_length;
+        }
+        if (peer_amount > 0) {
+            metrics_add(METRIC_DHT_PEERS, peer_amount);
+            log_printf(dht->log_code, LOG_FULL, "DHT node returned %u peers\n", peer_amount);
+            lookup->on_peers(lookup->ctx, peers, peer_amount, AF_INET);
+        }
+    }
+    step_lookup(dht, query->lookup);
+}
+
+static void handle_message(dht_t* dht, const char* message, const uint32_t length, const struct sockaddr_in* from) {
+    const char* limit = message + length;
+    if (length < 2 || message[0] != 'd' || skip_bencode_value(message, limit) == nullptr) return;
+    const char* type_value = find_bencode_key(message, limit, "y");
+    const char* transaction_value = find_bencode_key(message, limit, "t");
+    const char* type;
+    uint64_t type_length;
+    const char* transaction;
+    uint64_t transaction_length;
+    if (!type_value || !read_bencode_string(type_value, limit, &type, &type_length) || type_length != 1 ||
+        !transaction_value || !read_bencode_string(transaction_value, limit, &transaction, &transaction_length) ||
+        transaction_length > DHT_TOKEN_MAX) {
+        return;
+    }
+    if (type[0] == 'q') {
+        handle_query(dht, message, limit, from, transaction, transaction_length);
+        return;
+    }
+    dht_query_t query;
+    if ((type[0] != 'r' && type[0] != 'e') || !take_query(dht, transaction, transaction_length, from, &query)) {
+        log_printf(dht->log_code, LOG_FULL, "Dropped DHT message with unknown transaction id\n");
+        return;
+    }
+    if (type[0] == 'r') handle_response(dht, message, limit, from, &query);
+    else {
+        // The node is alive, it just won't help this lookup
+        candidate_failed(dht, &query);
+        if (query.lookup >= 0) step_lookup(dht, query.lookup);
+    }
+}
+
+static void on_readable(void* ctx, const uint32_t events) {
+    (void) events;
+    dht_t* dht = ctx;
+    char buffers[UDP_BATCH_SIZE][DHT_MESSAGE_MAX];
+    struct sockaddr_in sources[UDP_BATCH_SIZE];
+    struct iovec iovecs[UDP_BATCH_SIZE];
+    struct mmsghdr messages[UDP_BATCH_SIZE];
+
+    int32_t received;
+    do {
+        memset(messages, 0, sizeof(messages));
+        for (int32_t i = 0; i < UDP_BATCH_SIZE; ++i) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = DHT_MESSAGE_MAX;
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &sources[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        received = recvmmsg(dht->sockfd, messages, UDP_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && LOG_ENABLED(dht->log_code, LOG_ERR)) {
+                log_write(LOG_ERR, "Error while receiving DHT messages: %s (errno: %d)\n", strerror(errno), errno);
+            }
+            break;
+        }
+        for (int32_t i = 0; i < received; ++i) {
+            // Truncated datagrams aren't valid bencode anyway
+            if (sources[i].sin_family != AF_INET || messages[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+            handle_message(dht, buffers[i], messages[i].msg_len, &sources[i]);
+        }
+    } while (received == UDP_BATCH_SIZE);
+}
+
+/**
+ * Expires queries, rotates the token secret, starts lookup rounds and saves the routing table. Rearms itself
+ */
+static void on_tick(void* ctx, const uint32_t data) {
+    (void) data;
+    dht_t* dht = ctx;
+    const uint64_t now = dht->timers->now_ms;
+    if (now >= dht->secret_ms + DHT_SECRET_MS) {
+        memcpy(dht->secrets[1], dht->secrets[0], sizeof(dht->secrets[0]));
+        arc4random_buf(dht->secrets[0], sizeof(dht->secrets[0]));
+        dht->secret_ms = now;
+    }
+    if (dht->state_path && now >= dht->saved_ms + DHT_SAVE_MS) {
+        dht->saved_ms = now;
+        if (!dht_save(dht, dht->state_path)) {
+            log_printf(dht->log_code, LOG_ERR, "Couldn't save the DHT routing table to %s\n", dht->state_path);
+        }
+    }
+    for (uint32_t i = 0; i < DHT_MAX_QUERIES && dht->query_amount > 0; ++i) {
+        dht_query_t* query = &dht->queries[i];
+        if (!query->used || now < query->sent_ms + DHT_QUERY_TIMEOUT_MS) continue;
+        query->used = false;
+        dht->query_amount--;
+        node_failed(dht, query->address, query->port);
+        candidate_failed(dht, query);
+    }
+    for (int32_t i = 0; i < DHT_MAX_LOOKUPS; ++i) {
+        dht_lookup_t* lookup = &dht->lookups[i];
+        if (!lookup->active) continue;
+        if (lookup->done) {
+            if (now >= lookup->next_ms) restart_lookup(dht, i);
+            continue;
+        }
+        step_lookup(dht, i);
+        // Stuck without anyone to ask, most likely because the routing table was empty when the round started
+        if (!lookup->done && lookup->in_flight == 0) restart_lookup(dht, i);
+    }
+    wheel_timer_arm(dht->timers, dht->tick_timer, DHT_TICK_MS);
+}
+
+/**
+ * Reads our id and routing table from a file written by dht_save()
+ */
+static bool load_state(dht_t* dht, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+    uint32_t magic = 0;
+    uint32_t amount = 0;
+    unsigned char id[20];
+    if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != DHT_STATE_MAGIC || fread(id, 20, 1, file) != 1 ||
+        fread(&amount, sizeof(amount), 1, file) != 1) {
+        fclose(file);
+        return false;
+    }
+    memcpy(dht->id, id, 20);
+    for (uint32_t i = 0; i < amount; ++i) {
+        unsigned char node[DHT_COMPACT_NODE_SIZE];
+        if (fread(node, DHT_COMPACT_NODE_SIZE, 1, file) != 1) break;
+        uint32_t address;
+        uint16_t port;
+        memcpy(&address, node + 20, 4);
+        memcpy(&port, node + 24, 2);
+        insert_node(dht, node, address, port, 0);
+    }
+    fclose(file);
+    return true;
+}
+
+bool dht_save(const dht_t* dht, const char* path) {
+    if (!dht || !path) return false;
+    FILE* file = fopen(path, "wb");
+    if (!file) return false;
+    const uint32_t magic = DHT_STATE_MAGIC;
+    uint32_t amount = 0;
+    for (uint32_t b = 0; b < DHT_BUCKETS; ++b) {
+        for (uint32_t i = 0; i < dht->bucket_amount[b]; ++i) amount += dht->nodes[b][i].fails < DHT_MAX_FAILS;
+    }
+    bool written = fwrite(&magic, sizeof(magic), 1, file) == 1 && fwrite(dht->id, 20, 1, file) == 1 &&
+                   fwrite(&amount, sizeof(amount), 1, file) == 1;
+    for (uint32_t b = 0; b < DHT_BUCKETS && written; ++b) {
+        for (uint32_t i = 0; i < dht->bucket_amount[b] && written; ++i) {
+            const dht_node_t* node = &dht->nodes[b][i];
+            if (node->fails >= DHT_MAX_FAILS) continue;
+            unsigned char compact[DHT_COMPACT_NODE_SIZE];
+            memcpy(compact, node->id, 20);
+            memcpy(compact + 20, &node->address, 4);
+            memcpy(compact + 24, &node->port, 2);
+            written = fwrite(compact, DHT_COMPACT_NODE_SIZE, 1, file) == 1;
+        }
+    }
+    return fclose(file) == 0 && written;
+}
+
+dht_t* dht_create(event_loop_t* loop, timer_wheel_t* timers, const uint16_t port, const char* state_path,
+                  const LOG_CODE log_code) {
+    if (!loop || !timers) return nullptr;
+    dht_t* dht = calloc(1, sizeof(dht_t));
+    if (!dht) return nullptr;
+    dht->loop = loop;
+    dht->timers = timers;
+    dht->slot = -1;
+    dht->tick_timer = TIMER_NONE;
+    dht->log_code = log_code;
+    dht->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    socklen_t address_length = sizeof(address);
+    if (dht->sockfd < 0 || bind(dht->sockfd, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+        getsockname(dht->sockfd, (struct sockaddr*) &address, &address_length) < 0) {
+        log_printf(log_code, LOG_ERR, "Couldn't open DHT socket on port %u: %s\n", port, strerror(errno));
+        dht_free(dht);
+        return nullptr;
+    }
+    dht->port = ntohs(address.sin_port);
+
+    // Keeping the same id across restarts, so the nodes that know us keep doing so
+    if (!state_path || !load_state(dht, state_path)) arc4random_buf(dht->id, 20);
+    arc4random_buf(dht->secrets, sizeof(dht->secrets));
+    dht->secret_ms = timers->now_ms;
+    dht->slot = loop_add_source(loop, dht->sockfd, EPOLLIN, on_readable, dht);
+    dht->tick_timer = wheel_timer_new(timers, on_tick, dht, 0);
+    if (dht->slot < 0 || dht->tick_timer == TIMER_NONE) {
+        dht_free(dht);
+        return nullptr;
+    }
+    wheel_timer_arm(timers, dht->tick_timer, DHT_TICK_MS);
+    if (state_path) dht->state_path = strdup(state_path);
+    dht->saved_ms = timers->now_ms;
+
+    // Filling the buckets around our own id, which is what other nodes ask us about the most
+    dht->lookups[0].active = true;
+    dht->lookups[0].query = DHT_FIND_NODE;
+    memcpy(dht->lookups[0].target, dht->id, 20);
+    restart_lookup(dht, 0);
+    log_printf(log_code, LOG_SUMM, "DHT node listening on UDP port %u, %u nodes known\n", dht->port, dht->node_amount);
+    return dht;
+}
+
+void dht_free(dht_t* dht) {
+    if (dht == nullptr) return;
+    if (dht->state_path && !dht_save(dht, dht->state_path)) {
+        log_printf(dht->log_code, LOG_ERR, "Couldn't save the DHT routing table to %s\n", dht->state_path);
+    }
+    for (uint32_t i = 0; i < DHT_BOOTSTRAP_AMOUNT; ++i) resolver_cancel(dht->resolver, dht->bootstrap_ids[i]);
+    wheel_timer_delete(dht->timers, dht->tick_timer);
+    loop_remove_source(dht->loop, dht->slot);
+    if (dht->sockfd >= 0) close(dht->sockfd);
+    free(dht->state_path);
+    free(dht);
+}
+
+bool dht_contact(dht_t* dht, const struct sockaddr_in* address) {
+    if (!dht || !address || address->sin_family != AF_INET) return false;
+    // Its answer feeds the lookup of our own id
+    return send_query(dht, DHT_FIND_NODE, address->sin_addr.s_addr, address->sin_port, dht->id, 0, nullptr, 0, 0);
+}
+
+static void on_bootstrap_resolved(void* ctx, const struct sockaddr* addr, const socklen_t addr_len) {
+    (void) addr_len;
+    dht_t* dht = ctx;
+    if (addr && addr->sa_family == AF_INET) dht_contact(dht, (const struct sockaddr_in*) addr);
+}
+
+void dht_bootstrap(dht_t* dht, resolver_t* resolver) {
+    if (!dht || !resolver || dht->node_amount >= DHT_K) return;
+    static const char* nodes[DHT_BOOTSTRAP_AMOUNT] = DHT_BOOTSTRAP_NODES;
+    dht->resolver = resolver;
+    for (uint32_t i = 0; i < DHT_BOOTSTRAP_AMOUNT; ++i) {
+        dht->bootstrap_ids[i] = resolver_resolve(resolver, nodes[i], DHT_BOOTSTRAP_PORT, SOCK_DGRAM,
+                                                 on_bootstrap_resolved, dht);
+    }
+}
+
+bool dht_get_peers(dht_t* dht, const unsigned char* info_hash, const uint16_t port, const peers_callback_t on_peers,
+                   void* ctx) {
+    if (!dht || !info_hash) return false;
+    // The first lookup is our own id's
+    for (int32_t i = 1; i < DHT_MAX_LOOKUPS; ++i) {
+        dht_lookup_t* lookup = &dht->lookups[i];
+        if (lookup->active) continue;
+        lookup->active = true;
+        lookup->query = DHT_GET_PEERS;
+        memcpy(lookup->target, info_hash, 20);
+        lookup->port = port;
+        lookup->on_peers = on_peers;
+        lookup->ctx = ctx;
+        restart_lookup(dht, i);
+        return true;
+    }
+    return false;
+}
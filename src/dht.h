@@ -0,0 +1,265 @@
+#ifndef BITTORRENT_CLIENT_DHT_H
+#define BITTORRENT_CLIENT_DHT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "announcer.h"
+#include "event_loop.h"
+#include "resolver.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+/// @brief Nodes per bucket of the routing table (BEP 5)
+#define DHT_K 8
+/// @brief Buckets of the routing table, one per length of the prefix shared with our own id
+#define DHT_BUCKETS 160
+/// @brief Queries each lookup keeps in flight at once
+#define DHT_ALPHA 3
+/// @brief Closest nodes each lookup keeps track of. Farther ones are forgotten
+#define DHT_LOOKUP_SIZE 32
+/// @brief Lookups running at once, the refresh of our own neighbourhood included
+#define DHT_MAX_LOOKUPS 8
+/// @brief Queries waiting for a response at once. New ones aren't sent beyond it
+#define DHT_MAX_QUERIES 128
+/// @brief Milliseconds a node gets to answer a query
+#define DHT_QUERY_TIMEOUT_MS 2000
+/// @brief Unanswered queries in a row after which a node can be replaced by any other
+#define DHT_MAX_FAILS 2
+/// @brief Milliseconds without hearing from a node after which it's pinged before a new node is turned down (BEP 5)
+#define DHT_QUESTIONABLE_MS (15 * 60 * 1000)
+/// @brief Milliseconds between each lookup of an info hash, which announces again
+#define DHT_LOOKUP_INTERVAL_MS (15 * 60 * 1000)
+/// @brief Milliseconds between checks of query timeouts and lookup deadlines
+#define DHT_TICK_MS 500
+/// @brief Milliseconds before the secret tokens are made from is replaced. Tokens of the previous one are accepted too
+#define DHT_SECRET_MS (5 * 60 * 1000)
+/// @brief Bytes of the tokens given to other nodes
+#define DHT_TOKEN_SIZE 8
+/// @brief Longest token taken from other nodes
+#define DHT_TOKEN_MAX 32
+/// @brief Peers announced to us by other nodes that are kept, the oldest is replaced beyond it
+#define DHT_STORE_SIZE 1024
+/// @brief Milliseconds a peer announced to us is given to others
+#define DHT_STORE_TTL_MS (30 * 60 * 1000)
+/// @brief Most peers returned for a single get_peers
+#define DHT_MAX_VALUES 50
+/// @brief Largest KRPC message sent or received
+#define DHT_MESSAGE_MAX 1500
+/// @brief Size of a compact node: 20 bytes of id, 4 of address and 2 of port
+#define DHT_COMPACT_NODE_SIZE 26
+/// @brief Bytes of every transaction id we send: the query's slot and a random check
+#define DHT_TRANSACTION_SIZE 4
+/// @brief Milliseconds between saves of the routing table, besides the one when the node is freed
+#define DHT_SAVE_MS (5 * 60 * 1000)
+/// @brief File the routing table is kept in across restarts
+#define DHT_STATE_FILE "dht.dat"
+/// @brief Identifies routing table files, "DHT1"
+#define DHT_STATE_MAGIC 0x31544844u
+/// @brief Nodes the routing table is bootstrapped from while it has fewer than DHT_K nodes
+#define DHT_BOOTSTRAP_NODES {"router.bittorrent.com", "dht.transmissionbt.com", "router.utorrent.com"}
+/// @brief Amount of DHT_BOOTSTRAP_NODES
+#define DHT_BOOTSTRAP_AMOUNT 3
+/// @brief Port of every bootstrap node
+#define DHT_BOOTSTRAP_PORT "6881"
+
+/// @brief Queries of the KRPC protocol
+typedef enum {
+    DHT_PING,
+    DHT_FIND_NODE,
+    DHT_GET_PEERS,
+    DHT_ANNOUNCE_PEER
+} DHT_QUERY;
+
+/// @brief Where a node of a lookup is at
+typedef enum {
+    DHT_CANDIDATE_NEW, /**< Not queried yet */
+    DHT_CANDIDATE_QUERIED, /**< Queried, waiting for its response */
+    DHT_CANDIDATE_RESPONDED, /**< Responded, with a token for get_peers */
+    DHT_CANDIDATE_FAILED /**< Didn't respond in time */
+} DHT_CANDIDATE_STATE;
+
+/// @brief A node of the routing table. Address and port are kept in network endianness, as sent in compact form
+typedef struct {
+    unsigned char id[20]; /**< Node id */
+    uint32_t address; /**< IPv4 address */
+    uint16_t port; /**< UDP port */
+    uint8_t fails; /**< Queries in a row it didn't answer */
+    uint64_t seen_ms; /**< Last time it answered or queried us, 0 if it's only known from the state file */
+} dht_node_t;
+
+/// @brief A node a lookup learnt of, closer to its target than those it dropped
+typedef struct {
+    unsigned char id[20]; /**< Node id */
+    uint32_t address; /**< IPv4 address, in network endianness */
+    uint16_t port; /**< UDP port, in network endianness */
+    DHT_CANDIDATE_STATE state; /**< Whether it was queried and how it went */
+    uint8_t token_length; /**< Bytes of token */
+    unsigned char token[DHT_TOKEN_MAX]; /**< Token to announce to it with */
+} dht_candidate_t;
+
+/**
+ * An iterative lookup of the nodes closest to an info hash, or to our own id to fill the routing table.
+ * Candidates stay sorted by distance to target, and the lookup ends once the DHT_K closest that didn't fail
+ * have responded. It's then started over every DHT_LOOKUP_INTERVAL_MS.
+ */
+typedef struct {
+    bool active; /**< Whether the slot is used */
+    DHT_QUERY query; /**< DHT_GET_PEERS for info hashes, DHT_FIND_NODE for our own id */
+    unsigned char target[20]; /**< Info hash or node id looked up */
+    uint16_t port; /**< TCP port announced to the closest nodes, in host endianness. 0 to not announce */
+    peers_callback_t on_peers; /**< Called with the peers each node returns */
+    void *ctx; /**< Passed as is to on_peers */
+    dht_candidate_t candidates[DHT_LOOKUP_SIZE]; /**< Closest nodes known, closest first */
+    uint32_t candidate_amount; /**< Entries in candidates */
+    uint32_t in_flight; /**< Candidates queried and not answered yet */
+    bool done; /**< Whether the current round ended */
+    uint64_t next_ms; /**< When the next round starts, once done */
+} dht_lookup_t;
+
+/// @brief A query waiting for its response. Its slot is part of the transaction id
+typedef struct {
+    bool used; /**< Whether the slot is used */
+    uint16_t check; /**< Random half of the transaction id, so stale responses don't match a reused slot */
+    DHT_QUERY query; /**< What was asked */
+    uint32_t address; /**< Node queried, in network endianness */
+    uint16_t port; /**< Its port, in network endianness */
+    int32_t lookup; /**< Lookup the query belongs to, or -1 */
+    uint64_t sent_ms; /**< When it was sent */
+} dht_query_t;
+
+/// @brief A peer another node announced for an info hash
+typedef struct {
+    unsigned char info_hash[20]; /**< Torrent the peer announced */
+    unsigned char peer[COMPACT_PEER_V4_SIZE]; /**< Address and port of the peer, in compact form */
+    uint64_t announced_ms; /**< When it was announced, 0 for free entries */
+} dht_stored_peer_t;
+
+/**
+ * A node of the mainline DHT (BEP 5) on a single non-blocking UDP socket, registered in an event loop and driven
+ * by its timer wheel. The routing table is a flat array of DHT_BUCKETS buckets of DHT_K nodes each, nothing is
+ * allocated per node, and it's kept in a file across restarts together with our node id.
+ */
+typedef struct {
+    event_loop_t *loop; /**< Loop the socket is registered in */
+    timer_wheel_t *timers; /**< Timers of the loop, and the clock cached for each iteration */
+    int32_t sockfd; /**< UDP socket */
+    int32_t slot; /**< Source slot of sockfd in loop */
+    uint16_t port; /**< Port sockfd is bound to, in host endianness */
+    uint32_t tick_timer; /**< Checks timeouts and restarts lookups every DHT_TICK_MS */
+    unsigned char id[20]; /**< Our node id */
+    dht_node_t nodes[DHT_BUCKETS][DHT_K]; /**< Routing table: the nodes sharing i bits of prefix with id are in nodes[i] */
+    uint8_t bucket_amount[DHT_BUCKETS]; /**< Nodes in each bucket */
+    uint32_t node_amount; /**< Nodes in the whole routing table */
+    dht_query_t queries[DHT_MAX_QUERIES]; /**< Queries waiting for their response */
+    uint32_t query_amount; /**< Used entries of queries */
+    dht_lookup_t lookups[DHT_MAX_LOOKUPS]; /**< Lookups, the first one refreshes our own neighbourhood */
+    dht_stored_peer_t store[DHT_STORE_SIZE]; /**< Peers other nodes announced to us */
+    unsigned char secrets[2][16]; /**< Current and previous secret tokens are made from */
+    uint64_t secret_ms; /**< When the current secret was made */
+    resolver_t *resolver; /**< Resolves bootstrap nodes, nullptr if bootstrapping wasn't asked for */
+    uint32_t bootstrap_ids[DHT_BOOTSTRAP_AMOUNT]; /**< Resolutions of bootstrap nodes in progress, 0 if there's none */
+    char *state_path; /**< File the routing table is saved to, nullptr to not save it */
+    uint64_t saved_ms; /**< When the routing table was last saved */
+    LOG_CODE log_code; /**< Logging level */
+} dht_t;
+
+/**
+ * Length of the prefix two ids share, which is the bucket of b in the routing table of a.
+ *
+ * @param a 20-byte id.
+ * @param b 20-byte id.
+ * @return Bits shared, from 0 to 160 if both are the same.
+ */
+uint32_t dht_common_prefix(const unsigned char *a, const unsigned char *b);
+
+/**
+ * Creates a DHT node listening on a UDP port. Our node id and routing table are read from state_path if it
+ * holds them, a random id is made otherwise. A lookup of our own id starts right away, and goes on as nodes
+ * are added with dht_contact() or dht_bootstrap().
+ *
+ * @param loop The event loop the socket is registered in.
+ * @param timers The timer wheel advanced by whoever runs loop.
+ * @param port UDP port to listen on, in host endianness, or 0 for any free one.
+ * @param state_path File the routing table is read from now, and saved to every DHT_SAVE_MS and by dht_free(),
+ *                   or nullptr to not keep it.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to the node, or nullptr if the socket couldn't be created or bound.
+ */
+dht_t *dht_create(event_loop_t *loop, timer_wheel_t *timers, uint16_t port, const char *state_path,
+                  LOG_CODE log_code);
+
+/**
+ * Saves the routing table if a state file was given, closes the socket and frees the node.
+ *
+ * @param dht The node to free. If nullptr, nothing is done.
+ */
+void dht_free(dht_t *dht);
+
+/**
+ * Writes our node id and routing table to a file.
+ *
+ * @param dht The node.
+ * @param path File to write, replaced if it exists.
+ * @return true on success, false if it couldn't be written.
+ */
+bool dht_save(const dht_t *dht, const char *path);
+
+/**
+ * Adds a node to the routing table, or refreshes it if it's there already. A full bucket only takes it
+ * in place of a node that failed DHT_MAX_FAILS times; otherwise its least recently seen node is pinged if it's
+ * questionable, so it's replaced next time if it doesn't answer.
+ *
+ * @param dht The node.
+ * @param id 20-byte id of the node to add.
+ * @param address IPv4 address, in network endianness.
+ * @param port UDP port, in network endianness.
+ * @return true if the node is in the routing table, false if it was turned down.
+ */
+bool dht_insert(dht_t *dht, const unsigned char *id, uint32_t address, uint16_t port);
+
+/**
+ * Finds the nodes of the routing table closest to a target.
+ *
+ * @param dht The node.
+ * @param target 20-byte id or info hash.
+ * @param closest Where the nodes are stored, closest first.
+ * @param max Most nodes stored.
+ * @return The amount of nodes stored.
+ */
+uint32_t dht_closest(const dht_t *dht, const unsigned char *target, dht_node_t *closest, uint32_t max);
+
+/**
+ * Asks a node whose id isn't known for the nodes closest to our own id. It's added to the routing table if it
+ * answers, and so are the nodes it returns, through the lookup of our own id.
+ *
+ * @param dht The node.
+ * @param address Address of the node.
+ * @return true if the query was sent, false otherwise.
+ */
+bool dht_contact(dht_t *dht, const struct sockaddr_in *address);
+
+/**
+ * Contacts every DHT_BOOTSTRAP_NODES once resolved, if the routing table has fewer than DHT_K nodes.
+ *
+ * @param dht The node.
+ * @param resolver Resolves the bootstrap nodes from the event loop. Must outlive the node.
+ */
+void dht_bootstrap(dht_t *dht, resolver_t *resolver);
+
+/**
+ * Starts looking up peers of a torrent, announcing it to the closest nodes at the end of each round if port
+ * isn't 0. Rounds go on every DHT_LOOKUP_INTERVAL_MS until the node is freed.
+ *
+ * @param dht The node.
+ * @param info_hash 20-byte info hash of the torrent.
+ * @param port TCP port peers can connect to, in host endianness, or 0 to not announce.
+ * @param on_peers Called with the peers nodes return, always IPv4.
+ * @param ctx Passed as is to on_peers.
+ * @return true if the lookup started, false if DHT_MAX_LOOKUPS are running already.
+ */
+bool dht_get_peers(dht_t *dht, const unsigned char *info_hash, uint16_t port, peers_callback_t on_peers, void *ctx);
+
+#endif //BITTORRENT_CLIENT_DHT_H
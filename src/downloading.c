@@ -6,16 +6,39 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <math.h>
 #include <time.h>
+#include <openssl/sha.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
 
 #include "downloading.h"
 
+#include "announcer.h"
 #include "basic_bencode.h"
+#include "dht.h"
+#include "event_loop.h"
+#include "http_client.h"
+#include "listener.h"
+#include "lsd.h"
+#include "merkle.h"
 #include "predownload_udp.h"
 #include "parsing.h"
+#include "logger.h"
 #include "messages.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "pex.h"
+#include "resolver.h"
+#include "sha1.h"
+#include "timer_wheel.h"
+#include "trace.h"
+#include "udp_client.h"
+#include "utp.h"
+#include "webseed.h"
 
 int64_t calc_block_size(const uint32_t piece_size, const uint32_t byte_offset) {
     int64_t asked_bytes;
@@ -57,9 +80,9 @@ char* get_path(const ll* filepath, const LOG_CODE log_code) {
         if (filepath_ptr->next != nullptr && stat(return_charpath, &st) == -1) {
             // Doesn't exist, create it
             if (mkdir(return_charpath, 0755) == 0) {
-                if (log_code == LOG_FULL) fprintf(stdout, "Created directory: %s", return_charpath);
+                log_printf(log_code, LOG_FULL, "Created directory: %s", return_charpath);
             } else {
-                if (log_code >= LOG_ERR) fprintf(stderr, "Couldn't create directory: %s", return_charpath);
+                log_printf(log_code, LOG_ERR, "Couldn't create directory: %s", return_charpath);
                 exit(1);
             }
         }
@@ -128,7 +151,7 @@ bool are_bits_set(const unsigned char *bitfield, const uint32_t start, const uin
     return true;
 }
 
-void closing_files(const files_ll *files, const unsigned char *bitfield, const uint32_t piece_index,
+void closing_files(files_ll *files, const unsigned char *bitfield, const uint32_t piece_index,
                    const uint32_t piece_size, const uint32_t this_piece_size) {
     const uint32_t byte_index = piece_index / 8;
     const uint32_t bit_offset = 7 - piece_index % 8;
@@ -140,13 +163,12 @@ void closing_files(const files_ll *files, const unsigned char *bitfield, const u
     int64_t piece_offset;
     if (piece_size != this_piece_size) {
         last = true;
-        piece_offset = piece_index*(piece_size-1) + this_piece_size;
     } else {
         last = false;
-        piece_offset = piece_index*piece_size;
     }
+    piece_offset = (int64_t)piece_index*piece_size;
 
-    const files_ll* current = files;
+    files_ll* current = files;
     while (current != nullptr) {
         // If the file ends after the piece starts and if it starts before the piece ends
         if (current->byte_index+current->length > piece_offset && current->byte_index < piece_offset+this_piece_size) {
@@ -163,14 +185,106 @@ void closing_files(const files_ll *files, const unsigned char *bitfield, const u
                 left = ceil((double)(current->length - overlap) / (double)piece_size);
             }
 
-            if (are_bits_set(bitfield, piece_index-left, piece_index+right)) {
+            if (current->file_ptr && are_bits_set(bitfield, piece_index-left, piece_index+right)) {
                 fclose(current->file_ptr);
+                current->file_ptr = nullptr;
             }
         }
         current = current->next;
     }
 }
 
+bool read_piece(files_ll *files, unsigned char *buffer, const uint32_t piece_index, const uint32_t piece_size,
+                const uint32_t this_piece_size, const LOG_CODE log_code) {
+    if (!files || !buffer || this_piece_size == 0) return false;
+
+    const int64_t piece_offset = (int64_t)piece_index*piece_size;
+    int64_t read_bytes = 0;
+    for (files_ll* current = files; current != nullptr && read_bytes < this_piece_size; current = current->next) {
+        const int64_t position = piece_offset + read_bytes;
+        // Files before the piece, or after it
+        if (current->byte_index + current->length <= position || current->byte_index > position) continue;
+
+        int64_t amount = current->byte_index + current->length - position;
+        if (amount > this_piece_size - read_bytes) amount = this_piece_size - read_bytes;
+        // Padding is never written, it reads as zeros
+        if (current->padding) {
+            memset(buffer + read_bytes, 0, amount);
+            read_bytes += amount;
+            continue;
+        }
+        // Files already closed by closing_files() are opened just for this
+        FILE* file = current->file_ptr;
+        if (!file) {
+            char* filepath = get_path(current->path, log_code);
+            file = fopen(filepath, "rb");
+            free(filepath);
+        } else fflush(file);
+        const bool ok = file && fseeko(file, position - current->byte_index, SEEK_SET) == 0 &&
+                        fread(buffer + read_bytes, 1, amount, file) == (size_t)amount;
+        if (file && file != current->file_ptr) fclose(file);
+        if (!ok) {
+            log_printf(log_code, LOG_ERR, "Couldn't read piece %u back for its hash check\n", piece_index);
+            return false;
+        }
+        read_bytes += amount;
+    }
+    return read_bytes == this_piece_size;
+}
+
+bool verify_piece(files_ll *files, const unsigned char *expected_hash, const uint32_t piece_index,
+                  const uint32_t piece_size, const uint32_t this_piece_size, const LOG_CODE log_code) {
+    if (!files || !expected_hash || this_piece_size == 0) return false;
+    unsigned char* buffer = malloc(this_piece_size);
+    if (!buffer) return false;
+    const bool read = read_piece(files, buffer, piece_index, piece_size, this_piece_size, log_code);
+
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    if (read) sha1_hash(buffer, this_piece_size, hash);
+    free(buffer);
+    return read && memcmp(hash, expected_hash, SHA_DIGEST_LENGTH) == 0;
+}
+
+uint32_t verify_pieces(files_ll *files, const unsigned char *pieces, const uint32_t first_piece, const uint32_t amount,
+                       const uint32_t piece_size, const uint64_t torrent_size, bool *valid, const LOG_CODE log_code) {
+    if (!files || !pieces || !valid || piece_size == 0) return 0;
+    uint32_t batch_pieces = VERIFY_BATCH_BYTES / piece_size;
+    if (batch_pieces > SHA1_MAX_LANES) batch_pieces = SHA1_MAX_LANES;
+    if (batch_pieces == 0) batch_pieces = 1;
+    unsigned char* buffer = malloc((uint64_t)batch_pieces*piece_size);
+    if (!buffer) return 0;
+
+    uint32_t matched = 0;
+    for (uint32_t start = 0; start < amount; start += batch_pieces) {
+        const unsigned char* data[SHA1_MAX_LANES];
+        uint64_t lengths[SHA1_MAX_LANES];
+        uint32_t checked[SHA1_MAX_LANES];
+        uint32_t read = 0;
+        for (uint32_t i = start; i < amount && i < start + batch_pieces; ++i) {
+            valid[i] = false;
+            const uint64_t offset = (uint64_t)(first_piece + i)*piece_size;
+            if (offset >= torrent_size) continue;
+            const uint32_t this_piece_size = torrent_size - offset < piece_size ? torrent_size - offset : piece_size;
+            // Pieces that can't be read are left out of the batch
+            unsigned char* slot = buffer + (uint64_t)read*piece_size;
+            if (!read_piece(files, slot, first_piece + i, piece_size, this_piece_size, log_code)) continue;
+            data[read] = slot;
+            lengths[read] = this_piece_size;
+            checked[read++] = i;
+        }
+        unsigned char hashes[SHA1_MAX_LANES*SHA_DIGEST_LENGTH];
+        sha1_hash_batch(data, lengths, read, hashes);
+        for (uint32_t i = 0; i < read; ++i) {
+            const uint32_t index = checked[i];
+            valid[index] = memcmp(hashes + i*SHA_DIGEST_LENGTH, pieces + (uint64_t)(first_piece + index)*SHA_DIGEST_LENGTH,
+                                  SHA_DIGEST_LENGTH) == 0;
+            matched += valid[index];
+        }
+    }
+    free(buffer);
+    return matched;
+}
+
 announce_response_t *handle_predownload_udp(const metainfo_t metainfo, const unsigned char *peer_id, const torrent_stats_t* torrent_stats, const LOG_CODE log_code) {
     // For storing socket that successfully connected
     int32_t successful_index = 0;
@@ -223,7 +337,7 @@ bool read_from_socket(peer_t* peer, const int32_t epoll, const LOG_CODE log_code
         errno = 0;
         const ssize_t bytes_received = recv(peer->socket, peer->reception_cache+peer->reception_pointer, peer->reception_target-peer->reception_pointer, 0);
         if (bytes_received < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "Error when reading message in socket: %d\n", peer->socket);
+            log_printf(log_code, LOG_ERR, "Error when reading message in socket: %d\n", peer->socket);
         }
         // Peer shutdown the connection. Shutting down my side too
         if (bytes_received == 0 || errno == ECONNRESET) {
@@ -244,51 +358,993 @@ bool read_from_socket(peer_t* peer, const int32_t epoll, const LOG_CODE log_code
     return true;
 }
 
+void close_peer(peer_t* peer, const int32_t epoll) {
+    epoll_ctl(epoll, EPOLL_CTL_DEL, peer->socket, nullptr);
+    close(peer->socket);
+    peer->status = PEER_CLOSED;
+    peer->socket = -1;
+    peer->send_length = 0;
+    peer->epoll_events = 0;
+}
+
+/**
+ * Takes the next complete message out of the peer's buffers.
+ * @return 1 if message was filled, 0 if more bytes are needed, -1 if the peer announced a message too long
+ */
+static int32_t next_message(peer_t* peer, peer_message_t* message) {
+    // A long message gathered in reception_cache
+    if (peer->reception_target > 0) {
+        if (peer->reception_pointer < peer->reception_target) return 0;
+        message->handshake = false;
+        message->id = peer->reception_cache[MESSAGE_LENGTH_SIZE];
+        message->payload = peer->reception_cache + MESSAGE_LENGTH_AND_ID_SIZE;
+        message->payload_length = peer->reception_target - MESSAGE_LENGTH_AND_ID_SIZE;
+        peer->reception_target = 0;
+        peer->reception_pointer = 0;
+        return 1;
+    }
+
+    if (peer->status == PEER_HANDSHAKE_SENT) {
+        if (peer->recv_end - peer->recv_start < HANDSHAKE_LEN) return 0;
+        message->handshake = true;
+        message->id = 0;
+        message->payload = peer->recv_buffer + peer->recv_start;
+        message->payload_length = HANDSHAKE_LEN;
+        peer->recv_start += HANDSHAKE_LEN;
+        return 1;
+    }
+
+    while (peer->recv_end - peer->recv_start >= MESSAGE_LENGTH_SIZE) {
+        unsigned char* start = peer->recv_buffer + peer->recv_start;
+        const uint32_t available = peer->recv_end - peer->recv_start;
+        uint32_t length;
+        memcpy(&length, start, MESSAGE_LENGTH_SIZE);
+        length = ntohl(length);
+        // Keep-alive, receiving it already counts as activity
+        if (length == 0) {
+            peer->recv_start += MESSAGE_LENGTH_SIZE;
+            continue;
+        }
+        if (length > MAX_TRANS_SIZE - MESSAGE_LENGTH_SIZE) return -1;
+
+        const uint32_t total = MESSAGE_LENGTH_SIZE + length;
+        if (total > INLINE_MESSAGE_MAX) {
+            // Its remainder is read straight into reception_cache
+            const uint32_t buffered = available < total ? available : total;
+            memcpy(peer->reception_cache, start, buffered);
+            peer->recv_start += buffered;
+            peer->reception_pointer = (int32_t) buffered;
+            peer->reception_target = (int32_t) total;
+            return next_message(peer, message);
+        }
+        if (available < total) return 0;
+        message->handshake = false;
+        message->id = start[MESSAGE_LENGTH_SIZE];
+        message->payload = start + MESSAGE_LENGTH_AND_ID_SIZE;
+        message->payload_length = length - 1;
+        peer->recv_start += total;
+        return 1;
+    }
+    return 0;
+}
+
+int32_t receive_messages(peer_t* peer, const int32_t epoll, const message_callback_t callback, void* ctx,
+                         const LOG_CODE log_code) {
+    if (!peer || !callback || epoll < 0 || peer->socket < 0) return -1;
+
+    int32_t handled = 0;
+    bool drained = false;
+    while (true) {
+        peer_message_t message;
+        int32_t result;
+        while ((result = next_message(peer, &message)) > 0) {
+            handled++;
+            if (!callback(ctx, peer, &message)) return handled;
+        }
+        if (result < 0) {
+            log_printf(log_code, LOG_ERR, "Message too big in socket %d\n", peer->socket);
+            close_peer(peer, epoll);
+            return -1;
+        }
+        if (drained) return handled;
+
+        // Whatever is left is shorter than a message, moving it to the front makes room for the next read
+        if (peer->recv_start > 0) {
+            memmove(peer->recv_buffer, peer->recv_buffer + peer->recv_start, peer->recv_end - peer->recv_start);
+            peer->recv_end -= peer->recv_start;
+            peer->recv_start = 0;
+        }
+        struct iovec iov[2];
+        int32_t iov_amount = 0;
+        if (peer->reception_target > 0) {
+            iov[iov_amount].iov_base = peer->reception_cache + peer->reception_pointer;
+            iov[iov_amount++].iov_len = peer->reception_target - peer->reception_pointer;
+        }
+        iov[iov_amount].iov_base = peer->recv_buffer + peer->recv_end;
+        iov[iov_amount++].iov_len = RECV_BUFFER_SIZE - peer->recv_end;
+        const size_t wanted = iov[0].iov_len + (iov_amount > 1 ? iov[1].iov_len : 0);
+
+        const ssize_t received = readv(peer->socket, iov, iov_amount);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return handled;
+            log_printf(log_code, LOG_ERR, "Error when reading message in socket: %d\n", peer->socket);
+            close_peer(peer, epoll);
+            return -1;
+        }
+        // Peer shutdown the connection
+        if (received == 0) {
+            shutdown(peer->socket, SHUT_RDWR);
+            close_peer(peer, epoll);
+            return -1;
+        }
+        peer->bytes_received += received;
+
+        size_t rest = received;
+        if (peer->reception_target > 0) {
+            const size_t missing = peer->reception_target - peer->reception_pointer;
+            const size_t taken = rest < missing ? rest : missing;
+            peer->reception_pointer += (int32_t) taken;
+            rest -= taken;
+        }
+        peer->recv_end += rest;
+        // A short read means the socket is empty, so there's no need for another one just to see EAGAIN
+        drained = (size_t) received < wanted;
+    }
+}
+
+bool update_interest(peer_t* peer, const int32_t epoll, const uint32_t index) {
+    if (!peer || epoll < 0 || peer->socket < 0 || peer->status == PEER_CLOSED) return false;
+    // Writability only matters while connecting and while there's something to send
+    const bool writing = peer->status == PEER_NOTHING || peer->status == PEER_CONNECTION_SUCCESS ||
+                         peer->send_length > 0;
+    const uint32_t events = EPOLLIN | (writing ? EPOLLOUT : 0) | PEER_EVENT_TRIGGER;
+    if (events == peer->epoll_events) return true;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u32 = index;
+    if (epoll_ctl(epoll, EPOLL_CTL_MOD, peer->socket, &ev) < 0) return false;
+    peer->epoll_events = events;
+    return true;
+}
+
+/**
+ * Creates the socket of a peer about to be connected to, our end of a uTP connection unless uTP already failed
+ * for it or the peer is local, in which case it's a TCP socket still to be connected
+ * @return The socket, or -1 if it couldn't be created
+ */
+static int32_t open_peer_socket(peer_t* peer, utp_context_t* utp) {
+    // LEDBAT has no bottleneck to keep clear on the local network, and would only cap it
+    peer->utp = utp && !peer->utp_failed && !peer->local;
+    if (peer->utp) {
+        const int32_t socket = utp_connect(utp, peer->address);
+        // Until the handshake proves otherwise
+        peer->utp_failed = true;
+        if (socket >= 0) return socket;
+        peer->utp = false;
+    }
+    const int32_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    // Requests are tiny, Nagle would hold them back until the blocks before them are acknowledged
+    const int32_t on = 1;
+    if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+/**
+ * Resets a closed peer and starts connecting to it again
+ * @return Whether the connection attempt is in progress. If not, the peer is left closed
+ */
+static bool reconnect_peer(peer_t* peer, const uint32_t index, const int32_t epoll, utp_context_t* utp,
+                           const LOG_CODE log_code) {
+    // Resetting peer
+    peer->socket = open_peer_socket(peer, utp);
+    peer->reception_target = 0;
+    peer->reception_pointer = 0;
+    peer->recv_start = 0;
+    peer->recv_end = 0;
+    peer->send_length = 0;
+    peer->am_choking = true;
+    peer->am_interested = false;
+    peer->peer_choking = true;
+    peer->peer_interested = false;
+    free(peer->bitfield);
+    peer->bitfield = nullptr;
+    peer->interest_sent = false;
+    peer->pending_amount = 0;
+    peer->status = PEER_CLOSED;
+    if (peer->socket < 0) {
+        log_printf(log_code, LOG_ERR, "TCP socket creation failed\n");
+        return false;
+    }
+
+    // Try connecting. uTP sockets are connected to the uTP context already
+    const int32_t connect_result = peer->utp ? 0 : connect(peer->socket, (struct sockaddr*) peer->address,
+                                                            sizeof(struct sockaddr));
+    if (connect_result < 0 && errno != EINPROGRESS) {
+        log_printf(log_code, LOG_ERR, "Error #%d in connect for socket: %d\n", errno, peer->socket);
+        close(peer->socket);
+        peer->socket = -1;
+        return false;
+    }
+    // If connection is in progress, add socket to epoll
+    struct epoll_event ev;
+    // EPOLLOUT means the connection attempt has finished, for good or ill
+    ev.events = EPOLLIN | EPOLLOUT | PEER_EVENT_TRIGGER;
+    ev.data.u32 = index;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, peer->socket, &ev);
+    peer->epoll_events = ev.events;
+    peer->status = PEER_NOTHING;
+    return true;
+}
+
 uint32_t reconnect(peer_t* peer_list, const uint32_t peer_amount, uint32_t last_peer, const int32_t epoll, const LOG_CODE log_code) {
     if (!peer_list || epoll < 0) return 0;
 
     for (int i = 0; i < peer_amount; ++i) {
         peer_t* peer = &peer_list[i];
-        if (peer->status == PEER_CLOSED) {
+        // Inbound peers connected from a port nobody listens on
+        if (peer->status == PEER_CLOSED && !peer->inbound) {
             last_peer++;
-            // Resetting peer
-            peer->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-            // This could really be skipped. Here just in case
-            memset(peer->reception_cache, 0, MAX_TRANS_SIZE);
-            peer->reception_target = 0;
-            peer->reception_pointer = 0;
-            peer->am_choking = true;
-            peer->am_interested = false;
+            reconnect_peer(peer, i, epoll, nullptr, log_code);
+        }
+    }
+    return last_peer;
+}
+
+/**
+ * Appends a closed peer with the given address to the swarm
+ * @return Index of the new peer, or -1 if peer_array couldn't grow
+ */
+static int32_t append_peer(swarm_t* swarm, const struct sockaddr_in* address) {
+    if (swarm->peer_amount == swarm->peer_capacity) {
+        const uint32_t new_capacity = swarm->peer_capacity > 0 ? swarm->peer_capacity * 2 : 16;
+        peer_t* peer_array = realloc(swarm->peer_array, sizeof(peer_t) * new_capacity);
+        if (!peer_array) return -1;
+        swarm->peer_array = peer_array;
+        swarm->peer_capacity = new_capacity;
+    }
+
+    const uint32_t index = swarm->peer_amount;
+    peer_t* peer = &swarm->peer_array[index];
+    memset(peer, 0, sizeof(peer_t));
+    peer->am_choking = true;
+    peer->peer_choking = true;
+    peer->status = PEER_NOTHING;
+    peer->last_msg = time(nullptr);
+    peer->address = malloc(sizeof(struct sockaddr_in));
+    memcpy(peer->address, address, sizeof(struct sockaddr_in));
+    peer->local = is_local_address(swarm->local_networks, swarm->local_network_amount, address->sin_addr.s_addr);
+    // Only torrent() gives peers timers
+    for (uint32_t j = 0; j < PEER_TIMER_COUNT; ++j) peer->timers[j] = TIMER_NONE;
+    swarm->peer_amount++;
+    return (int32_t) index;
+}
+
+uint32_t add_peers(swarm_t* swarm, const unsigned char* compact_peers, const uint32_t peer_amount, const int32_t family) {
+    if (!swarm || !compact_peers || swarm->epoll < 0) return 0;
+    // This only supports IPv4 for now
+    if (family != AF_INET) return 0;
+
+    uint32_t added = 0;
+    for (uint32_t i = 0; i < peer_amount; ++i) {
+        const unsigned char* compact_peer = compact_peers + i*6;
+        struct sockaddr_in peer_addr;
+        memset(&peer_addr, 0, sizeof(peer_addr));
+        peer_addr.sin_family = AF_INET;
+        // Both are already in network endianness
+        memcpy(&peer_addr.sin_addr, compact_peer, 4);
+        memcpy(&peer_addr.sin_port, compact_peer+4, 2);
+        if (peer_addr.sin_port == 0) continue;
+
+        // Skipping peers returned by more than one tracker
+        bool known = false;
+        for (uint32_t j = 0; j < swarm->peer_amount && !known; ++j) {
+            const struct sockaddr_in* address = swarm->peer_array[j].address;
+            known = address->sin_addr.s_addr == peer_addr.sin_addr.s_addr && address->sin_port == peer_addr.sin_port;
+        }
+        if (known) continue;
+
+        const int32_t index = append_peer(swarm, &peer_addr);
+        if (index < 0) return added;
+        peer_t* peer = &swarm->peer_array[index];
+        added++;
+
+        // Creating non-blocking socket
+        peer->socket = open_peer_socket(peer, swarm->utp);
+        if (peer->socket < 0) {
+            log_printf(swarm->log_code, LOG_ERR, "TCP socket creation failed\n");
+            peer->status = PEER_CLOSED;
+            continue;
+        }
+        // Try connecting. uTP sockets are connected to the uTP context already
+        const int32_t connect_result = peer->utp ? 0 : connect(peer->socket, (struct sockaddr*) peer->address,
+                                                                sizeof(struct sockaddr_in));
+        if (connect_result < 0 && errno != EINPROGRESS) {
+            log_printf(swarm->log_code, LOG_ERR, "Error #%d in connect for socket: %d\n", errno, peer->socket);
+            close(peer->socket);
+            peer->socket = -1;
+            peer->status = PEER_CLOSED;
+        } else {
+            struct epoll_event ev;
+            // EPOLLOUT means the connection attempt has finished, for good or ill
+            ev.events = EPOLLIN | EPOLLOUT | PEER_EVENT_TRIGGER;
+            ev.data.u32 = index;
+            epoll_ctl(swarm->epoll, EPOLL_CTL_ADD, peer->socket, &ev);
+            peer->epoll_events = ev.events;
+        }
+    }
+    if (LOG_ENABLED(swarm->log_code, LOG_SUMM) && added > 0) {
+        log_write(LOG_SUMM, "Added %u new peers, %u in total\n", added, swarm->peer_amount);
+    }
+    return added;
+}
+
+int32_t add_inbound_peer(swarm_t* swarm, const int32_t socket, const struct sockaddr_in* address) {
+    if (!swarm || socket < 0 || !address || swarm->epoll < 0) return -1;
+    const int32_t index = append_peer(swarm, address);
+    if (index < 0) return -1;
+    peer_t* peer = &swarm->peer_array[index];
+    peer->socket = socket;
+    peer->inbound = true;
+    // Fails for uTP peers, which don't need it
+    const int32_t on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    // Already connected, and its handshake was read by the listener
+    peer->status = PEER_CONNECTION_SUCCESS;
+    struct epoll_event ev;
+    ev.events = EPOLLIN | PEER_EVENT_TRIGGER;
+    ev.data.u32 = index;
+    if (epoll_ctl(swarm->epoll, EPOLL_CTL_ADD, socket, &ev) < 0) {
+        log_printf(swarm->log_code, LOG_ERR, "Couldn't watch inbound socket %d\n", socket);
+        close(socket);
+        peer->socket = -1;
+        peer->status = PEER_CLOSED;
+        return index;
+    }
+    peer->epoll_events = ev.events;
+    return index;
+}
+
+struct torrent_shared_t;
+
+/**
+ * A reactor of a torrent: its own thread, event loop, timers and shard of the peers. Shared with the handlers
+ * of its peers' events, messages and timers
+ */
+typedef struct {
+    struct torrent_shared_t* shared; /**< What every reactor of the torrent shares */
+    uint32_t reactor; /**< Index of the reactor */
+    event_loop_t* loop; /**< Peer sockets of swarm, wake_fd, and for the first reactor trackers and listener */
+    int32_t wake_fd; /**< Eventfd written when there are new peers or verified pieces, or the download is over */
+    uint32_t have_cursor; /**< Pieces of shared->completed whose HAVE was already sent to swarm */
+    pthread_t thread; /**< Thread running the reactor, but for the first one, which runs on torrent()'s */
+    bool thread_started; /**< Whether thread was created, so it's joined */
+    uint32_t peer_counts[PEER_STATUS_COUNT]; /**< Peers of swarm by status as of the last stats timer, read atomically */
+    int64_t requests_in_flight; /**< Requests pending in swarm as of the last stats timer, read atomically */
+    const metainfo_t* metainfo;
+    const unsigned char* peer_id; /**< This client's id */
+    swarm_t* swarm; /**< Peers of this reactor only */
+    timer_wheel_t* timers; /**< Timers of every peer, and the clock cached for each loop iteration */
+    uint32_t stats_timer; /**< Refreshes the peer metrics */
+    uint32_t pex_timer; /**< Sends ut_pex messages, TIMER_NONE for private torrents */
+    unsigned char* pex_peers; /**< Compact peers of swarm as of the last ut_pex messages */
+    uint32_t pex_amount; /**< Peers in pex_peers */
+    torrent_stats_t* torrent_stats; /**< Shared, downloaded and left are changed atomically */
+    state_t* state;
+    unsigned char* bitfield; /**< Pieces downloaded and verified, shared */
+    uint32_t bitfield_byte_size;
+    unsigned char* block_tracker; /**< Blocks downloaded, shared */
+    unsigned char* requested_blocks; /**< Blocks requested and not received yet, shared */
+    uint32_t blocks_per_piece;
+    LOG_CODE log_code;
+} session_t;
+
+/// @brief A peer waiting for some reactor to take it
+typedef struct {
+    struct sockaddr_in address; /**< Address of the peer */
+    int32_t socket; /**< Connected socket of a peer that connected to us, or -1 for a peer to connect to */
+    unsigned char handshake[HANDSHAKE_LEN]; /**< Handshake of a peer that connected to us, already read */
+    bool utp; /**< Whether socket is a uTP connection, whose handshake wasn't read yet */
+} peer_handoff_t;
+
+/**
+ * What every reactor of a torrent shares. Bitfields and stats are changed atomically, in place, and peers
+ * are handed over through a queue every reactor takes from until it has its share of them
+ */
+typedef struct torrent_shared_t {
+    session_t* reactors; /**< Every reactor, the first one running on torrent()'s thread */
+    uint32_t reactor_amount; /**< Reactors running */
+    pthread_mutex_t disk_mutex; /**< Held while the files or the state file are used */
+    pthread_mutex_t peers_mutex; /**< Protects handoffs, known, and the peer amount of every reactor's swarm */
+    peer_handoff_t* handoffs; /**< Peers no reactor took yet */
+    uint32_t handoff_amount; /**< Peers in handoffs */
+    uint32_t handoff_capacity; /**< Peers allocated in handoffs */
+    uint64_t* known; /**< Open addressing set of every peer trackers, the DHT and other peers returned, keyed by
+                       * peer_key(), so they're only handed over once. 0 marks an empty slot */
+    uint32_t known_amount; /**< Peers in known, at most TORRENT_MAX_KNOWN_PEERS */
+    uint32_t known_capacity; /**< Slots allocated in known, a power of two at least twice known_amount */
+    uint32_t* completed; /**< Verified pieces in the order they were verified, for each reactor to send their HAVE */
+    uint32_t completed_amount; /**< Pieces in completed, read atomically */
+    bool done; /**< Set atomically once the whole torrent is downloaded */
+    local_network_t local_networks[LSD_MAX_NETWORKS]; /**< Networks of our interfaces, whose peers are local */
+    uint32_t local_network_amount; /**< Networks in local_networks */
+    webseed_t** webseeds; /**< Web seeds of the torrent, run on the first reactor */
+    uint32_t webseed_amount; /**< Web seeds in webseeds */
+    uint32_t webseed_timer; /**< Asks web seeds for more pieces, in the first reactor's timers */
+    merkle_t* merkle; /**< Leaf hashes of v2 and hybrid torrents, nullptr for v1 ones */
+} torrent_shared_t;
+
+/**
+ * Closes the peer if it isn't already, gives back its requests and schedules its reconnection, unless it was inbound
+ * or sent corrupt data
+ */
+static void drop_peer(session_t* session, const uint32_t index) {
+    peer_t* peer = &session->swarm->peer_array[index];
+    if (peer->status != PEER_CLOSED) close_peer(peer, session->swarm->epoll);
+    // Blocks asked from closed peers go back to the pool
+    release_requests(peer, session->requested_blocks);
+    wheel_timer_disarm(session->timers, peer->timers[PEER_TIMER_REQUEST]);
+    wheel_timer_disarm(session->timers, peer->timers[PEER_TIMER_KEEP_ALIVE]);
+    wheel_timer_disarm(session->timers, peer->timers[PEER_TIMER_IDLE]);
+    // Inbound peers connected from a port nobody listens on, they have to come back by themselves
+    if (peer->inbound || peer->corrupt) wheel_timer_disarm(session->timers, peer->timers[PEER_TIMER_STATE]);
+    // Peers that don't speak uTP are tried over TCP right away
+    else if (peer->utp && peer->utp_failed) wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_STATE], 0);
+    else wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_STATE], PEER_RECONNECT_DELAY_MS);
+}
+
+/**
+ * Connect or handshake timeout while connecting, reconnect delay once closed
+ */
+static void on_state_timer(void* ctx, const uint32_t index) {
+    session_t* session = ctx;
+    peer_t* peer = &session->swarm->peer_array[index];
+    switch (peer->status) {
+        case PEER_CLOSED:
+            log_printf(session->log_code, LOG_SUMM, "Attempting to reconnect peer #%u\n", index);
+            if (reconnect_peer(peer, index, session->swarm->epoll, session->swarm->utp, session->log_code)) {
+                wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_STATE], PEER_CONNECT_TIMEOUT_MS);
+            } else wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_STATE], PEER_RECONNECT_DELAY_MS);
+            break;
+        case PEER_NOTHING:
+        case PEER_CONNECTION_FAILURE:
+        case PEER_CONNECTION_SUCCESS:
+        case PEER_HANDSHAKE_SENT:
+            log_printf(session->log_code, LOG_ERR, "Connection to socket %d timed out\n", peer->socket);
+            drop_peer(session, index);
+            break;
+        default: ;
+    }
+}
+
+/**
+ * Closes peers that keep requests pending without sending blocks
+ */
+static void on_request_timer(void* ctx, const uint32_t index) {
+    session_t* session = ctx;
+    peer_t* peer = &session->swarm->peer_array[index];
+    if (peer->status < PEER_HANDSHAKE_SUCCESS || peer->pending_amount == 0) return;
+    // Checked lazily, receiving a block only updates last_block_ms
+    const uint64_t waiting = session->timers->now_ms - peer->last_block_ms;
+    if (waiting < PEER_REQUEST_TIMEOUT_MS) {
+        wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_REQUEST], PEER_REQUEST_TIMEOUT_MS - waiting);
+        return;
+    }
+    log_printf(session->log_code, LOG_ERR, "Requests timed out in socket %d\n", peer->socket);
+    drop_peer(session, index);
+}
+
+static void on_keep_alive_timer(void* ctx, const uint32_t index) {
+    session_t* session = ctx;
+    peer_t* peer = &session->swarm->peer_array[index];
+    if (peer->status < PEER_HANDSHAKE_SUCCESS) return;
+    static const unsigned char keep_alive[MESSAGE_LENGTH_SIZE] = {0};
+    if (!peer_send(peer, keep_alive, sizeof(keep_alive), session->log_code)) {
+        drop_peer(session, index);
+        return;
+    }
+    update_interest(peer, session->swarm->epoll, index);
+    wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_KEEP_ALIVE], PEER_KEEP_ALIVE_MS);
+}
+
+/**
+ * Closes peers that stopped sending anything, keep-alives included
+ */
+static void on_idle_timer(void* ctx, const uint32_t index) {
+    session_t* session = ctx;
+    peer_t* peer = &session->swarm->peer_array[index];
+    if (peer->status < PEER_HANDSHAKE_SUCCESS) return;
+    const uint64_t idle = session->timers->now_ms - peer->last_activity_ms;
+    if (idle < PEER_IDLE_TIMEOUT_MS) {
+        wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_IDLE], PEER_IDLE_TIMEOUT_MS - idle);
+        return;
+    }
+    log_printf(session->log_code, LOG_ERR, "Socket %d idle for too long\n", peer->socket);
+    drop_peer(session, index);
+}
+
+/**
+ * Updates the peer metrics with the peers of every reactor. Runs on a timer so counting peers doesn't cost every wakeup
+ */
+static void on_stats_timer(void* ctx, const uint32_t data) {
+    (void) data;
+    session_t* session = ctx;
+    uint32_t peer_counts[PEER_STATUS_COUNT] = {0};
+    int64_t requests_in_flight = 0;
+    for (uint32_t i = 0; i < session->swarm->peer_amount; ++i) {
+        peer_counts[session->swarm->peer_array[i].status]++;
+        requests_in_flight += session->swarm->peer_array[i].pending_amount;
+    }
+    for (uint32_t i = 0; i < PEER_STATUS_COUNT; ++i) {
+        __atomic_store_n(&session->peer_counts[i], peer_counts[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&session->requests_in_flight, requests_in_flight, __ATOMIC_RELAXED);
+    // Other reactors' counts are as of their own last update
+    const torrent_shared_t* shared = session->shared;
+    for (uint32_t r = 0; r < shared->reactor_amount; ++r) {
+        if (r == session->reactor) continue;
+        for (uint32_t i = 0; i < PEER_STATUS_COUNT; ++i) {
+            peer_counts[i] += __atomic_load_n(&shared->reactors[r].peer_counts[i], __ATOMIC_RELAXED);
+        }
+        requests_in_flight += __atomic_load_n(&shared->reactors[r].requests_in_flight, __ATOMIC_RELAXED);
+    }
+    metrics_set_peers(peer_counts);
+    metrics_set_gauge(METRIC_REQUESTS_IN_FLIGHT, requests_in_flight);
+    wheel_timer_arm(session->timers, session->stats_timer, PEER_STATS_INTERVAL_MS);
+}
+
+/**
+ * Gives a new peer its timers, all disarmed
+ */
+static void create_peer_timers(session_t* session, const uint32_t index) {
+    static const timer_callback_t callbacks[PEER_TIMER_COUNT] = {
+        [PEER_TIMER_STATE] = on_state_timer,
+        [PEER_TIMER_REQUEST] = on_request_timer,
+        [PEER_TIMER_KEEP_ALIVE] = on_keep_alive_timer,
+        [PEER_TIMER_IDLE] = on_idle_timer,
+    };
+    peer_t* peer = &session->swarm->peer_array[index];
+    for (uint32_t j = 0; j < PEER_TIMER_COUNT; ++j) {
+        peer->timers[j] = wheel_timer_new(session->timers, callbacks[j], session, index);
+    }
+}
+
+/**
+ * Wakes every reactor but the given one up, so they look at the handoffs, the verified pieces and whether the
+ * download is over. A null except wakes every reactor up
+ */
+static void wake_reactors(const torrent_shared_t* shared, const session_t* except) {
+    const uint64_t one = 1;
+    for (uint32_t r = 0; r < shared->reactor_amount; ++r) {
+        if (&shared->reactors[r] == except) continue;
+        if (write(shared->reactors[r].wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            log_printf(shared->reactors[r].log_code, LOG_ERR, "Couldn't wake reactor %u up\n", r);
+        }
+    }
+}
+
+/**
+ * Queues a peer for some reactor to take. Called with peers_mutex held
+ * @return false if the queue couldn't grow
+ */
+static bool push_handoff(torrent_shared_t* shared, const peer_handoff_t* handoff) {
+    if (shared->handoff_amount == shared->handoff_capacity) {
+        const uint32_t capacity = shared->handoff_capacity > 0 ? shared->handoff_capacity * 2 : 16;
+        peer_handoff_t* handoffs = realloc(shared->handoffs, sizeof(peer_handoff_t) * capacity);
+        if (!handoffs) return false;
+        shared->handoffs = handoffs;
+        shared->handoff_capacity = capacity;
+    }
+    shared->handoffs[shared->handoff_amount++] = *handoff;
+    return true;
+}
+
+/**
+ * Key of a peer in the known set: its address and port, never 0 since the port isn't
+ */
+static uint64_t peer_key(const struct sockaddr_in* address) {
+    return (uint64_t) address->sin_addr.s_addr << 16 | address->sin_port;
+}
+
+/**
+ * First slot to probe for a key. Fibonacci hashing spreads consecutive addresses and ports
+ */
+static uint32_t known_slot(const uint64_t key, const uint32_t capacity) {
+    return (uint32_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+/**
+ * Adds a peer to the known set, growing it as needed. peers_mutex must be held
+ * @return true if the peer is new, false if it was already known, the set is full or out of memory
+ */
+static bool remember_peer(torrent_shared_t* shared, const struct sockaddr_in* address) {
+    const uint64_t key = peer_key(address);
+    uint32_t slot = shared->known_capacity > 0 ? known_slot(key, shared->known_capacity) : 0;
+    while (shared->known_capacity > 0 && shared->known[slot] != 0) {
+        if (shared->known[slot] == key) return false;
+        slot = (slot + 1) & (shared->known_capacity - 1);
+    }
+    if (shared->known_amount == TORRENT_MAX_KNOWN_PEERS) return false;
+
+    // Kept at most half full, so probes stay short
+    if (2 * (shared->known_amount + 1) > shared->known_capacity) {
+        const uint32_t capacity = shared->known_capacity > 0 ? shared->known_capacity * 2 : 64;
+        uint64_t* known = calloc(capacity, sizeof(uint64_t));
+        if (!known) return false;
+        for (uint32_t i = 0; i < shared->known_capacity; ++i) {
+            if (shared->known[i] == 0) continue;
+            uint32_t moved = known_slot(shared->known[i], capacity);
+            while (known[moved] != 0) moved = (moved + 1) & (capacity - 1);
+            known[moved] = shared->known[i];
+        }
+        free(shared->known);
+        shared->known = known;
+        shared->known_capacity = capacity;
+        slot = known_slot(key, capacity);
+        while (known[slot] != 0) slot = (slot + 1) & (capacity - 1);
+    }
+    shared->known[slot] = key;
+    shared->known_amount++;
+    return true;
+}
+
+/**
+ * Queues the IPv4 peers no one returned before for the reactors to take. Any reactor may call it
+ * @return Peers queued
+ */
+static uint32_t hand_over_peers(torrent_shared_t* shared, const unsigned char* compact_peers, const uint32_t peer_amount) {
+    uint32_t handed = 0;
+    pthread_mutex_lock(&shared->peers_mutex);
+    for (uint32_t i = 0; i < peer_amount; ++i) {
+        peer_handoff_t handoff = {0};
+        handoff.socket = -1;
+        handoff.address.sin_family = AF_INET;
+        // Both are already in network endianness
+        memcpy(&handoff.address.sin_addr, compact_peers + i*6, 4);
+        memcpy(&handoff.address.sin_port, compact_peers + i*6 + 4, 2);
+        if (handoff.address.sin_port == 0) continue;
+
+        // Skipping peers returned by more than one source, or in an earlier announce
+        if (!remember_peer(shared, &handoff.address)) continue;
+        if (!push_handoff(shared, &handoff)) break;
+        handed++;
+    }
+    pthread_mutex_unlock(&shared->peers_mutex);
+    return handed;
+}
+
+/**
+ * Sends HAVE to this reactor's peers for every piece verified since the last call, by any reactor
+ */
+static void send_haves(session_t* session) {
+    const torrent_shared_t* shared = session->shared;
+    const uint32_t completed_amount = __atomic_load_n(&shared->completed_amount, __ATOMIC_ACQUIRE);
+    if (session->have_cursor == completed_amount) return;
+    for (; session->have_cursor < completed_amount; ++session->have_cursor) {
+        broadcast_have(session->swarm->peer_array, session->swarm->peer_amount,
+                       shared->completed[session->have_cursor], session->log_code);
+    }
+    // Peers whose socket was full have the HAVE queued
+    for (uint32_t i = 0; i < session->swarm->peer_amount; ++i) {
+        if (session->swarm->peer_array[i].send_length > 0) {
+            update_interest(&session->swarm->peer_array[i], session->swarm->epoll, i);
+        }
+    }
+}
+
+/**
+ * Records a piece this reactor verified, so every reactor sends its HAVE, and saves the state
+ */
+static void piece_verified(session_t* session, const uint32_t piece_index, const uint32_t left) {
+    torrent_shared_t* shared = session->shared;
+    pthread_mutex_lock(&shared->disk_mutex);
+    // Each piece is verified once, so completed never outgrows piece_number
+    shared->completed[shared->completed_amount] = piece_index;
+    __atomic_store_n(&shared->completed_amount, shared->completed_amount + 1, __ATOMIC_RELEASE);
+    write_state("state/state.txt", session->state);
+    pthread_mutex_unlock(&shared->disk_mutex);
+    if (left == 0) __atomic_store_n(&shared->done, true, __ATOMIC_RELEASE);
+    send_haves(session);
+    wake_reactors(shared, session);
+}
+
+/**
+ * Sends the client's pieces, right after the handshake. Peers supporting the Fast Extension get HAVE_ALL or HAVE_NONE
+ * when either says it all, the rest don't get a BITFIELD at all until there's some piece to tell them about
+ */
+static void send_bitfield(peer_t* peer, const session_t* session) {
+    // Other reactors may be verifying pieces meanwhile
+    bool none = true;
+    for (uint32_t i = 0; i < session->bitfield_byte_size && none; ++i) {
+        none = __atomic_load_n(&session->bitfield[i], __ATOMIC_RELAXED) == 0;
+    }
+    const bool all = __atomic_load_n(&session->torrent_stats->left, __ATOMIC_RELAXED) == 0;
+    if (peer->fast && (all || none)) {
+        send_message(peer, all ? HAVE_ALL : HAVE_NONE, nullptr, 0, session->log_code);
+        return;
+    }
+    if (none) return;
+
+    // Queued a chunk at a time, so no buffer as big as the bitfield is needed
+    unsigned char buffer[BITFIELD_CHUNK_SIZE];
+    const uint32_t length = htonl(1 + session->bitfield_byte_size);
+    memcpy(buffer, &length, MESSAGE_LENGTH_SIZE);
+    buffer[MESSAGE_LENGTH_SIZE] = BITFIELD;
+    uint32_t filled = MESSAGE_LENGTH_AND_ID_SIZE;
+    for (uint32_t i = 0; i < session->bitfield_byte_size; ++i) {
+        buffer[filled++] = __atomic_load_n(&session->bitfield[i], __ATOMIC_RELAXED);
+        if (filled < sizeof(buffer) && i + 1 < session->bitfield_byte_size) continue;
+        if (!peer_send(peer, buffer, filled, session->log_code)) return;
+        filled = 0;
+    }
+}
+
+/**
+ * Sends the peers of the last ut_pex messages to a peer that just said it exchanges peers, so it doesn't wait for the
+ * next ones. These only carry what changed since
+ */
+static void send_pex_peers(peer_t* peer, const session_t* session) {
+    if (session->pex_amount == 0) return;
+    unsigned char buffer[PEX_MESSAGE_MAX];
+    const uint32_t amount = session->pex_amount < PEX_MAX_PEERS ? session->pex_amount : PEX_MAX_PEERS;
+    const uint32_t length = build_pex_message(buffer, peer->ut_pex, session->pex_peers, amount, nullptr, 0);
+    peer_send(peer, buffer, length, session->log_code);
+}
+
+/**
+ * Sends every peer that exchanges peers the ones this reactor connected to or lost since the last time
+ */
+static void on_pex_timer(void* ctx, const uint32_t data) {
+    (void) data;
+    session_t* session = ctx;
+    swarm_t* swarm = session->swarm;
+    wheel_timer_arm(session->timers, session->pex_timer, PEX_INTERVAL_MS);
+    unsigned char* current = malloc(swarm->peer_amount * COMPACT_PEER_V4_SIZE + 1);
+    unsigned char* pex_peers = realloc(session->pex_peers, (session->pex_amount + PEX_MAX_PEERS) * COMPACT_PEER_V4_SIZE);
+    if (pex_peers) session->pex_peers = pex_peers;
+    if (!current || !pex_peers) {
+        free(current);
+        return;
+    }
+    // Inbound peers connected from ports nobody listens on, so only the ones we connected to are shared
+    uint32_t current_amount = 0;
+    for (uint32_t i = 0; i < swarm->peer_amount; ++i) {
+        const peer_t* peer = &swarm->peer_array[i];
+        if (peer->inbound || peer->status < PEER_HANDSHAKE_SUCCESS) continue;
+        memcpy(current + current_amount * COMPACT_PEER_V4_SIZE, &peer->address->sin_addr, 4);
+        memcpy(current + current_amount * COMPACT_PEER_V4_SIZE + 4, &peer->address->sin_port, 2);
+        current_amount++;
+    }
+    unsigned char added[PEX_MAX_PEERS * COMPACT_PEER_V4_SIZE];
+    unsigned char dropped[PEX_MAX_PEERS * COMPACT_PEER_V4_SIZE];
+    uint32_t added_amount, dropped_amount;
+    pex_diff(session->pex_peers, session->pex_amount, current, current_amount, added, &added_amount, dropped,
+             &dropped_amount);
+    free(current);
+    if (added_amount == 0 && dropped_amount == 0) return;
+    // Whatever didn't fit is left out of pex_peers, so it goes in the next message
+    session->pex_amount = pex_apply(session->pex_peers, session->pex_amount, added, added_amount, dropped,
+                                    dropped_amount);
+
+    unsigned char buffer[PEX_MESSAGE_MAX];
+    const uint32_t length = build_pex_message(buffer, 0, added, added_amount, dropped, dropped_amount);
+    for (uint32_t i = 0; i < swarm->peer_amount; ++i) {
+        peer_t* peer = &swarm->peer_array[i];
+        if (peer->ut_pex == 0 || peer->status < PEER_HANDSHAKE_SUCCESS) continue;
+        // The same message for everyone, but for the id each peer asked for
+        buffer[MESSAGE_LENGTH_AND_ID_SIZE] = peer->ut_pex;
+        if (!peer_send(peer, buffer, length, session->log_code)) {
+            drop_peer(session, i);
+            continue;
+        }
+        update_interest(peer, swarm->epoll, i);
+    }
+}
+
+/**
+ * Reacts to an EXTENDED message, either the peer's extension handshake or the peers it exchanges with us
+ */
+static void handle_extended(session_t* session, peer_t* peer, const unsigned char* payload,
+                            const uint32_t payload_length) {
+    // Private torrents only get peers from their trackers
+    if (payload_length < 1 || session->metainfo->info->priv) return;
+    if (payload[0] == EXTENSION_HANDSHAKE_ID) {
+        if (parse_pex_handshake(payload + 1, payload_length - 1, &peer->ut_pex) && peer->ut_pex > 0) {
+            send_pex_peers(peer, session);
+        }
+        return;
+    }
+    if (payload[0] != UT_PEX_ID) return;
+
+    // Peers sending more often than BEP 11 allows don't get to flood the handoffs
+    const uint64_t now_ms = session->timers->now_ms;
+    if (peer->pex_received_ms != 0 && now_ms - peer->pex_received_ms < PEX_MIN_INTERVAL_MS) return;
+    const unsigned char *added, *dropped;
+    uint32_t added_amount, dropped_amount;
+    if (!parse_pex_message(payload + 1, payload_length - 1, &added, &added_amount, &dropped, &dropped_amount)) return;
+    peer->pex_received_ms = now_ms;
+    if (added_amount > PEX_MAX_PEERS) added_amount = PEX_MAX_PEERS;
+    metrics_add(METRIC_PEX_PEERS, added_amount);
+    // Peers it dropped may still be fine for us, so they're left alone
+    const uint32_t handed = hand_over_peers(session->shared, added, added_amount);
+    if (handed == 0) return;
+    log_printf(session->log_code, LOG_SUMM, "Peer in socket %d told us about %u new peers\n", peer->socket, handed);
+    // Taking them here could move the peer whose messages are being read, so this reactor takes its share once woken
+    wake_reactors(session->shared, nullptr);
+}
+
+/**
+ * Reacts to a message received from a peer. Handed to receive_messages()
+ */
+static bool handle_message(void* ctx, peer_t* peer, const peer_message_t* message) {
+    session_t* session = ctx;
+    const LOG_CODE log_code = session->log_code;
+    if (message->handshake) {
+        if (!check_handshake(session->metainfo->info->hash, message->payload)) {
+            close_peer(peer, session->swarm->epoll);
+            return false;
+        }
+        peer->status = PEER_HANDSHAKE_SUCCESS;
+        wheel_timer_disarm(session->timers, peer->timers[PEER_TIMER_STATE]);
+        wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_KEEP_ALIVE], PEER_KEEP_ALIVE_MS);
+        wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_IDLE], PEER_IDLE_TIMEOUT_MS);
+        if (!peer->id) peer->id = malloc(20);
+        if (peer->id) memcpy(peer->id, message->payload + 48, 20);
+        log_printf(log_code, LOG_FULL, "Handshake successful in socket %d%s\n", peer->socket,
+                   peer->utp ? " over uTP" : "");
+        // Connecting over uTP works for this peer
+        if (peer->utp) peer->utp_failed = false;
+        // Our handshake always has the bit set
+        peer->fast = message->payload[HANDSHAKE_RESERVED_OFFSET + FAST_EXTENSION_BYTE] & FAST_EXTENSION_BIT;
+        peer->v2 = session->shared->merkle && message->payload[HANDSHAKE_RESERVED_OFFSET + V2_BYTE] & V2_BIT;
+        peer->allowed_fast_amount = 0;
+        peer->suggested_amount = 0;
+        send_bitfield(peer, session);
+        peer->ut_pex = 0;
+        peer->pex_received_ms = 0;
+        // Peers that understand EXTENDED messages are offered ut_pex
+        if (!session->metainfo->info->priv &&
+            message->payload[HANDSHAKE_RESERVED_OFFSET + EXTENSION_PROTOCOL_BYTE] & EXTENSION_PROTOCOL_BIT) {
+            unsigned char buffer[PEX_MESSAGE_MAX];
+            peer_send(peer, buffer, build_pex_handshake(buffer, session->torrent_stats->port), log_code);
+        }
+        return true;
+    }
+
+    unsigned char *payload = message->payload;
+    const uint32_t payload_length = message->payload_length;
+    log_printf(log_code, LOG_FULL, "Peer %d received id of %d with length of %u\n", peer->socket, message->id,
+               payload_length + 1);
+    // Rate limited, blocks would flood the log otherwise
+    log_hex(log_code, LOG_FULL, "Payload received", payload, payload_length);
+
+    switch (message->id) {
+        case CHOKE:
             peer->peer_choking = true;
+            // Choked peers drop pending requests, unless they reject each of them by themselves
+            if (!peer->fast) release_requests(peer, session->requested_blocks);
+            break;
+        case UNCHOKE:
+            peer->peer_choking = false;
+            break;
+        case INTERESTED:
+            peer->peer_interested = true;
+            break;
+        case NOT_INTERESTED:
             peer->peer_interested = false;
-            peer->bitfield = nullptr;
-            peer->status = PEER_NOTHING;
-
-
-
-            // Try connecting
-            const int32_t connect_result = connect(peer->socket, (struct sockaddr*) peer->address, sizeof(struct sockaddr));
-            if (connect_result < 0 && errno != EINPROGRESS) {
-                if (log_code >= LOG_ERR) fprintf(stderr, "Error #%d in connect for socket: %d\n", errno, peer->socket);
-                epoll_ctl(epoll, EPOLL_CTL_DEL, peer->socket, nullptr);
-                close(peer->socket);
-            } else if (errno == EINPROGRESS) {
-                // If connection is in progress, add socket to epoll
-                struct epoll_event ev;
-                // EPOLLOUT means the connection attempt has finished, for good or ill
-                ev.events = EPOLLIN | EPOLLOUT;
-                ev.data.u32 = last_peer;
-                epoll_ctl(epoll, EPOLL_CTL_ADD, peer->socket, &ev);
+            break;
+        case HAVE:
+            if (payload_length >= 4) {
+                handle_have(peer, payload, session->bitfield, session->bitfield_byte_size, log_code);
+            }
+            break;
+        case BITFIELD:
+            if (payload_length >= session->bitfield_byte_size) {
+                handle_bitfield(peer, payload, session->bitfield, session->bitfield_byte_size, log_code);
+            }
+            break;
+        case REQUEST:
+            if (payload_length < sizeof(request_t)) break;
+            // Peers supporting the Fast Extension are told right away they won't get it
+            if (peer->fast && peer->am_choking) {
+                send_message(peer, REJECT_REQUEST, payload, sizeof(request_t), log_code);
+                break;
             }
+            handle_request(peer, payload, log_code);
+            break;
+        case PIECE: {
+            if (payload_length <= 8) break;
+            uint32_t piece_index, begin;
+            memcpy(&piece_index, payload, 4);
+            memcpy(&begin, payload + 4, 4);
+            piece_index = ntohl(piece_index);
+            begin = ntohl(begin);
+            peer->last_block_ms = session->timers->now_ms;
+            // Blocks whose leaf hash is known are checked before being written, so the peer sending a corrupt one
+            // is told apart from the others
+            if (merkle_check_block(session->shared->merkle, piece_index, begin, payload + 8, payload_length - 8) ==
+                MERKLE_BLOCK_CORRUPT) {
+                log_printf(log_code, LOG_ERR, "Corrupt block at %u of piece %u in socket %d, banning the peer\n",
+                           begin, piece_index, peer->socket);
+                metrics_add(METRIC_BLOCKS_CORRUPT, 1);
+                peer->corrupt = true;
+                close_peer(peer, session->swarm->epoll);
+                return false;
+            }
+            const uint64_t download_size = handle_piece(payload, payload_length, peer->socket, *session->metainfo,
+                                                        session->bitfield, session->block_tracker,
+                                                        session->blocks_per_piece, session->shared->merkle,
+                                                        &session->shared->disk_mutex, log_code);
+            // Only once it's in the block tracker, or another reactor could request it again meanwhile
+            block_received(peer, session->requested_blocks,
+                           piece_index * session->blocks_per_piece + begin / BLOCK_SIZE);
+            // Only whole, verified pieces count
+            if (download_size > 0) {
+                __atomic_fetch_add(&session->torrent_stats->downloaded, download_size, __ATOMIC_RELAXED);
+                const uint32_t left = __atomic_sub_fetch(&session->torrent_stats->left, download_size,
+                                                         __ATOMIC_RELAXED);
+                piece_verified(session, piece_index, left);
+            }
+            break;
         }
+        case HAVE_ALL:
+        case HAVE_NONE:
+            if (peer->fast) {
+                handle_have_all(peer, message->id == HAVE_ALL, session->bitfield, session->metainfo->info->piece_number,
+                                log_code);
+            }
+            break;
+        case SUGGEST_PIECE:
+            if (peer->fast && payload_length >= 4) {
+                handle_suggest_piece(peer, payload, session->metainfo->info->piece_number);
+            }
+            break;
+        case ALLOWED_FAST:
+            if (peer->fast && payload_length >= 4) {
+                handle_allowed_fast(peer, payload, session->metainfo->info->piece_number);
+            }
+            break;
+        case REJECT_REQUEST:
+            if (peer->fast && payload_length >= sizeof(request_t) &&
+                handle_reject(peer, payload, session->requested_blocks, session->blocks_per_piece,
+                              session->metainfo->info->piece_number)) {
+                log_printf(log_code, LOG_FULL, "Request rejected in socket %d\n", peer->socket);
+            }
+            break;
+        case EXTENDED:
+            handle_extended(session, peer, payload, payload_length);
+            break;
+        case HASHES:
+            if (session->shared->merkle &&
+                merkle_add_hashes(session->shared->merkle, payload, payload_length) == MERKLE_HASHES_INVALID) {
+                log_printf(log_code, LOG_ERR, "Invalid hashes in socket %d, banning the peer\n", peer->socket);
+                peer->corrupt = true;
+                close_peer(peer, session->swarm->epoll);
+                return false;
+            }
+            break;
+        case HASH_REQUEST:
+            // Only leaf hashes of pieces being downloaded are kept, so none are served
+            if (payload_length >= HASH_REQUEST_SIZE) {
+                send_message(peer, HASH_REJECT, payload, HASH_REQUEST_SIZE, log_code);
+            }
+            break;
+        case HASH_REJECT:
+            merkle_hashes_rejected(session->shared->merkle, payload, payload_length);
+            break;
+        case CANCEL:
+        case PORT:
+            break;
+        default: ;
     }
-    return last_peer;
+    return peer->status != PEER_CLOSED;
 }
 
 uint8_t write_state(const char* filename, const state_t* state) {
     if (!filename || !state) return 1;
 
     FILE* file = fopen(filename, "wb");
+    if (!file) return 1;
     uint32_t bytes_written;
     do {
         bytes_written = fwrite(&state->magic, 1, sizeof(uint32_t), file);
@@ -354,359 +1410,700 @@ state_t* init_state(const char* filename, const uint32_t piece_count, const uint
     return state;
 }
 
-int32_t torrent(const metainfo_t metainfo, const unsigned char *peer_id, const LOG_CODE log_code) {
-    torrent_stats_t* torrent_stats = malloc(sizeof(torrent_stats_t));
-    torrent_stats->downloaded = 0;
-    torrent_stats->left = metainfo.info->length;
-    torrent_stats->uploaded = 0;
-    torrent_stats->event = 0;
-    torrent_stats->key = arc4random();
-    announce_response_t* announce_response = handle_predownload_udp(metainfo, peer_id, torrent_stats, log_code);
-    if (announce_response == nullptr) return -1;
-    // Creating TCP sockets for all peers
-    /*
-        This only supports IPv4 for now
-    */
-    peer_ll *current_peer = announce_response->peer_list;
-    // Getting amount of peers
-    uint32_t peer_amount = 0;
-    while (current_peer != nullptr) {
-        peer_amount++;
-        current_peer = current_peer->next;
-    }
-    current_peer = announce_response->peer_list;
-
-    int32_t *peer_socket_array = malloc(sizeof(int32_t) * peer_amount);
-    struct sockaddr_in *peer_addr_array = malloc(sizeof(struct sockaddr_in) * peer_amount);
-    memset(peer_addr_array, 0, sizeof(struct sockaddr_in) * peer_amount);
-    int32_t counter2 = 0;
-    // Creating epoll for controlling sockets
-    const int32_t epoll = epoll_create1(0);
-    while (current_peer != nullptr) {
-        // Creating non-blocking socket
-        peer_socket_array[counter2] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-        if (peer_socket_array[counter2] <= 0) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "TCP socket creation failed");
-            exit(1);
-        }
-        struct sockaddr_in *peer_addr = &peer_addr_array[counter2];
-        peer_addr->sin_family = AF_INET;
-        peer_addr->sin_port = htons(current_peer->port);
-
-        // Converting IP from string to binary
-        if (inet_pton(AF_INET, current_peer->ip, &peer_addr->sin_addr) <= 0) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "inet_pton failed while creating peer socket");
-            close(peer_socket_array[counter2]);
-            exit(1);
-        }
-        // Try connecting
-        int32_t connect_result = connect(peer_socket_array[counter2], (struct sockaddr*) peer_addr, sizeof(struct sockaddr));
-        if (connect_result < 0 && errno != EINPROGRESS) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "Error #%d in connect for socket: %d\n", errno, peer_socket_array[counter2]);
-            close(peer_socket_array[counter2]);
-        } else if (errno == EINPROGRESS) {
-            // If connection is in progress, add socket to epoll
-            struct epoll_event ev;
-            // EPOLLOUT means the connection attempt has finished, for good or ill
-            ev.events = EPOLLIN | EPOLLOUT;
-            ev.data.u32 = counter2;
-            epoll_ctl(epoll, EPOLL_CTL_ADD, peer_socket_array[counter2], &ev);
+/**
+ * Takes a peer that connected to us, whose handshake the listener already read, or a uTP one whose handshake
+ * comes after ours
+ */
+static void adopt_inbound_peer(session_t* session, const int32_t socket, const struct sockaddr_in* address,
+                               const unsigned char* handshake) {
+    const int32_t index = add_inbound_peer(session->swarm, socket, address);
+    if (index < 0) {
+        close(socket);
+        return;
+    }
+    create_peer_timers(session, index);
+    peer_t* peer = &session->swarm->peer_array[index];
+    log_printf(session->log_code, LOG_SUMM, "Peer #%d connected from port %u%s\n", index, ntohs(address->sin_port),
+               handshake ? "" : " over uTP");
+    peer->last_activity_ms = session->timers->now_ms;
+    if (!handshake) {
+        // Sent once the socket is writable, as if we had connected
+        peer->utp = true;
+        wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_STATE], PEER_HANDSHAKE_TIMEOUT_MS);
+        if (peer->status == PEER_CLOSED || !update_interest(peer, session->swarm->epoll, index)) {
+            drop_peer(session, index);
         }
-        counter2++;
-        current_peer = current_peer->next;
+        return;
+    }
+    // Answering with ours, then the handshake is done as if it had just been received
+    if (peer->status == PEER_CLOSED || send_handshake(peer, session->metainfo->info->hash, session->peer_id,
+                                                      session->log_code) < 0) {
+        drop_peer(session, index);
+        return;
     }
+    const peer_message_t message = {true, 0, (unsigned char*) handshake, HANDSHAKE_LEN};
+    if (!handle_message(session, peer, &message) || !update_interest(peer, session->swarm->epoll, index)) {
+        drop_peer(session, index);
+    }
+}
 
-    current_peer = announce_response->peer_list;
-    // Checking connections with epoll
-    struct epoll_event epoll_events[MAX_EVENTS];
-    // General bitfield. Each piece takes up 1 bit
-    const uint32_t bitfield_byte_size = ceil(metainfo.info->piece_number / 8.0);
+/**
+ * Adds a handed over peer to the reactor's swarm, and starts its timers
+ */
+static void adopt_peer(session_t* session, const peer_handoff_t* handoff) {
+    if (handoff->socket >= 0) {
+        adopt_inbound_peer(session, handoff->socket, &handoff->address, handoff->utp ? nullptr : handoff->handshake);
+        return;
+    }
+    unsigned char compact_peer[6];
+    memcpy(compact_peer, &handoff->address.sin_addr, 4);
+    memcpy(compact_peer + 4, &handoff->address.sin_port, 2);
+    const uint32_t index = session->swarm->peer_amount;
+    if (add_peers(session->swarm, compact_peer, 1, AF_INET) == 0) return;
+    peer_t* peer = &session->swarm->peer_array[index];
+    create_peer_timers(session, index);
+    // Peers whose socket couldn't even be created are tried again later
+    wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_STATE],
+              peer->status == PEER_CLOSED ? PEER_RECONNECT_DELAY_MS : PEER_CONNECT_TIMEOUT_MS);
+}
 
-    unsigned char *bitfield = malloc(bitfield_byte_size);
-    state_t* state = init_state("state/state.txt", metainfo.info->piece_number, metainfo.info->piece_length, bitfield);
-    if (!bitfield) return -1;
-    memset(bitfield, 0, bitfield_byte_size);
-    // Size in bytes of the block tracker
-    uint32_t block_tracker_bytesize = ceil(
-        ceil(
-            metainfo.info->piece_number * metainfo.info->piece_length / (double) BLOCK_SIZE
-        ) / 8.0
-    );
-    // Actual amount of blocks per piece (not bytes)
-    uint32_t blocks_per_piece = ceil(metainfo.info->piece_length / (double) BLOCK_SIZE);
-    // Downloaded index for each block in a piece
-    unsigned char *block_tracker = malloc(block_tracker_bytesize);
-    if (!block_tracker) return -1;
-    memset(block_tracker, 0, block_tracker_bytesize);
-    // Peer struct
-    peer_t *peer_array = malloc(sizeof(peer_t) * peer_amount);
-    if (!peer_array) return -1;
-    memset(peer_array, 0, sizeof(peer_t) * peer_amount);
-    for (int32_t i = 0; i < peer_amount; ++i) {
-        peer_array[i].socket = peer_socket_array[i];
-        // This could really be skipped. Here just in case
-        memset(peer_array[i].reception_cache, 0, MAX_TRANS_SIZE);
-        peer_array[i].reception_target = 0;
-        peer_array[i].reception_pointer = 0;
-        peer_array[i].am_choking = true;
-        peer_array[i].am_interested = false;
-        peer_array[i].peer_choking = true;
-        peer_array[i].peer_interested = false;
-        peer_array[i].bitfield = nullptr;
-        peer_array[i].status = PEER_NOTHING;
+/**
+ * Takes handed over peers until this reactor has its share of every peer of the torrent, so the least busy
+ * reactors end up with the new ones
+ */
+static void take_peers(session_t* session) {
+    torrent_shared_t* shared = session->shared;
+    pthread_mutex_lock(&shared->peers_mutex);
+    uint32_t total = shared->handoff_amount;
+    for (uint32_t r = 0; r < shared->reactor_amount; ++r) total += shared->reactors[r].swarm->peer_amount;
+    const uint32_t share = (total + shared->reactor_amount - 1) / shared->reactor_amount;
+    while (shared->handoff_amount > 0 && session->swarm->peer_amount < share) {
+        const peer_handoff_t handoff = shared->handoffs[--shared->handoff_amount];
+        const uint32_t peer_amount = session->swarm->peer_amount;
+        adopt_peer(session, &handoff);
+        // Not even added, it would be taken again and again otherwise
+        if (session->swarm->peer_amount == peer_amount) total--;
     }
+    pthread_mutex_unlock(&shared->peers_mutex);
+}
 
-    /*
-     *
-     *  MAIN PEER INTERACTION LOOP
-     *
-     */
-    while (torrent_stats->left > 0) {
-        const int32_t nfds = epoll_wait(epoll, epoll_events, MAX_EVENTS, EPOLL_TIMEOUT);
-        if (nfds == -1) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "Error in epoll_wait\n");
+/**
+ * Hands peers returned by the announcer or the DHT over to the reactors. Runs on the first reactor
+ */
+static void on_tracker_peers(void* ctx, const unsigned char* compact_peers, const uint32_t peer_amount, const int32_t family) {
+    session_t* session = ctx;
+    torrent_shared_t* shared = session->shared;
+    // This only supports IPv4 for now
+    if (family != AF_INET) return;
+
+    const uint32_t handed = hand_over_peers(shared, compact_peers, peer_amount);
+    if (handed == 0) return;
+    log_printf(session->log_code, LOG_SUMM, "Handing %u new peers over to %u reactors\n", handed, shared->reactor_amount);
+    take_peers(session);
+    wake_reactors(shared, session);
+}
+
+/**
+ * Gives back the claim on every block of a piece, once a web seed is done with it
+ */
+static void release_piece_claim(const session_t* session, const uint32_t piece_index, const uint32_t blocks) {
+    for (uint32_t i = 0; i < blocks; ++i) {
+        const uint32_t block = piece_index * session->blocks_per_piece + i;
+        __atomic_fetch_and(&session->requested_blocks[block / 8], (unsigned char) ~(1u << (7 - block % 8)),
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Blocks of a piece, the last one being shorter, and in v2 only torrents those ending a file
+ */
+static uint32_t piece_blocks(const session_t* session, const uint32_t piece_index) {
+    return (piece_size(session->metainfo->info, piece_index) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * Claims every block of a piece no peer has started, so it's downloaded whole from a web seed. The first and last
+ * pieces go first, as players and archive tools need them, then the rest from the end, away from where peers are
+ * @return Index of the piece, or UINT32_MAX if there's none left
+ */
+static uint32_t claim_webseed_piece(const session_t* session) {
+    const uint32_t piece_number = session->metainfo->info->piece_number;
+    for (uint32_t i = 0; i < piece_number; ++i) {
+        const uint32_t piece_index = i == 0 ? 0 : piece_number - i;
+        if (__atomic_load_n(&session->bitfield[piece_index / 8], __ATOMIC_RELAXED) & 1u << (7 - piece_index % 8)) {
             continue;
         }
-        // No socket returned
-        if (nfds == 0) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "Epoll timeout\n");
-            continue;
+        const uint32_t blocks = piece_blocks(session, piece_index);
+        uint32_t claimed = 0;
+        for (; claimed < blocks; ++claimed) {
+            const uint32_t block = piece_index * session->blocks_per_piece + claimed;
+            const unsigned char mask = 1u << (7 - block % 8);
+            if (__atomic_load_n(&session->block_tracker[block / 8], __ATOMIC_RELAXED) & mask) break;
+            if (__atomic_fetch_or(&session->requested_blocks[block / 8], mask, __ATOMIC_RELAXED) & mask) break;
         }
+        if (claimed == blocks) return piece_index;
+        // Some peer got there first, only what this claimed is given back
+        release_piece_claim(session, piece_index, claimed);
+    }
+    return UINT32_MAX;
+}
 
-        for (int32_t i = 0; i < nfds; ++i) {
-            const int32_t index = (int32_t) epoll_events[i].data.u32;
-            peer_t *peer = &peer_array[index];
-
-            // Fatal error in socket
-            if (epoll_events[i].events == EPOLLERR) {
-                int32_t err = 0;
-                socklen_t len = sizeof(err);
-                if (getsockopt(peer->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
-                    if (log_code >= LOG_ERR) fprintf(stderr, "Getsockopt error %d in socket %d\n", errno, peer->socket);
-                } else if (err != 0) {
-                    errno = err;
-                    if (log_code >= LOG_ERR) fprintf(stderr, "Socket error %d in socket %d\n", errno, peer->socket);
-                }
-                epoll_ctl(epoll, EPOLL_CTL_DEL, peer->socket, nullptr);
-                close(peer->socket);
-                peer->status = PEER_CLOSED;
-                peer->socket = -1;
-                continue;
+/**
+ * Asks every web seed with room for as many pieces as it takes
+ */
+static void fill_webseeds(const session_t* session) {
+    const torrent_shared_t* shared = session->shared;
+    for (uint32_t i = 0; i < shared->webseed_amount; ++i) {
+        webseed_t* seed = shared->webseeds[i];
+        while (webseed_ready(seed, session->timers->now_ms)) {
+            const uint32_t piece_index = claim_webseed_piece(session);
+            if (piece_index == UINT32_MAX) return;
+            if (!webseed_fetch(seed, piece_index)) {
+                release_piece_claim(session, piece_index, piece_blocks(session, piece_index));
+                break;
             }
+        }
+    }
+}
 
+/**
+ * Writes a piece a web seed sent block by block, through the same path as blocks from peers, so it's verified
+ * and saved the same way. Web seeds that send corrupt pieces aren't asked again. Runs on the first reactor
+ */
+static void on_webseed_piece(void* ctx, webseed_t* seed, const uint32_t piece_index, const unsigned char* data,
+                             const uint32_t length) {
+    session_t* session = ctx;
+    const uint32_t blocks = piece_blocks(session, piece_index);
+    uint64_t download_size = 0;
+    unsigned char* payload = data ? malloc(8 + BLOCK_SIZE) : nullptr;
+    for (uint32_t i = 0; i < blocks && payload; ++i) {
+        const uint32_t begin = i * BLOCK_SIZE;
+        const uint32_t block_length = length - begin < BLOCK_SIZE ? length - begin : BLOCK_SIZE;
+        const uint32_t network_index = htonl(piece_index);
+        const uint32_t network_begin = htonl(begin);
+        memcpy(payload, &network_index, 4);
+        memcpy(payload + 4, &network_begin, 4);
+        memcpy(payload + 8, data + begin, block_length);
+        download_size = handle_piece(payload, 8 + block_length, UINT32_MAX, *session->metainfo, session->bitfield,
+                                     session->block_tracker, session->blocks_per_piece, session->shared->merkle,
+                                     &session->shared->disk_mutex, session->log_code);
+    }
+    free(payload);
+    // Only once it's in the block tracker, or the piece could be claimed again meanwhile
+    release_piece_claim(session, piece_index, blocks);
+    if (download_size > 0) {
+        metrics_add(METRIC_WEBSEED_PIECES, 1);
+        __atomic_fetch_add(&session->torrent_stats->downloaded, download_size, __ATOMIC_RELAXED);
+        const uint32_t left = __atomic_sub_fetch(&session->torrent_stats->left, download_size, __ATOMIC_RELAXED);
+        piece_verified(session, piece_index, left);
+    } else if (data) {
+        seed->disabled = true;
+        log_printf(session->log_code, LOG_ERR, "Web seed %s sent a corrupt piece %u, giving up on it\n", seed->url,
+                   piece_index);
+    }
+    fill_webseeds(session);
+}
 
-            // DEALING WITH CONNECTING
-            // After calling connect()
-            if (peer->status == PEER_NOTHING) {
-                peer->status = PEER_CONNECTION_FAILURE;
-                if (epoll_events[i].events & EPOLLOUT) {
-                    int32_t err = 0;
-                    socklen_t len = sizeof(err);
-                    // Check whether connect() was successful
-                    if (getsockopt(peer->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
-                        if (log_code >= LOG_ERR) fprintf(stderr, "Error in getspckopt() in socket %d\n", peer->socket);
-                    } else if (err != 0) {
-                        if (log_code >= LOG_ERR) fprintf(stderr, "Connection failed in socket %d\n", peer->socket);
-                    } else {
-                        if (log_code == LOG_FULL) fprintf(stdout, "Connection successful in socket %d\n", peer->socket);
-                        peer->status = PEER_CONNECTION_SUCCESS;
-                    }
-                } else {
-                    if (log_code >= LOG_ERR) fprintf(stderr, "Connection in socket %d failed, EPOLLERR or EPOLLHUP\n",
-                                                     peer->socket);
-                }
-            }
-            // Retry connection if connect() failed
-            if (peer->status == PEER_CONNECTION_FAILURE) {
-                if (try_connect(peer->socket, &peer_addr_array[index], log_code)) {
-                    if (errno != EINPROGRESS) {
-                        epoll_ctl(epoll, EPOLL_CTL_DEL, peer->socket, nullptr);
-                        close(peer->socket);
-                        peer->status = PEER_CLOSED;
-                        peer->socket = -1;
-                    } else peer->status = PEER_NOTHING;
-                }
-                continue;
-            }
+static void on_webseed_timer(void* ctx, const uint32_t data) {
+    (void) data;
+    const session_t* session = ctx;
+    wheel_timer_arm(session->timers, session->shared->webseed_timer, WEBSEED_TICK_MS);
+    fill_webseeds(session);
+}
 
-            // Reading from socket
-            read_from_socket(peer, epoll, log_code);
-
-            // Send handshake
-            if (peer->status == PEER_CONNECTION_SUCCESS && epoll_events[i].events & EPOLLOUT) {
-                const int32_t result = send_handshake(peer->socket, metainfo.info->hash, peer_id, log_code);
-                peer->last_msg = time(nullptr);
-                if (result > 0) {
-                    peer->status = PEER_HANDSHAKE_SENT;
-                    if (log_code == LOG_FULL) fprintf(stdout, "Handshake sent through socket %d\n", peer->socket);
-                    peer->reception_pointer = 0;
-                    peer->reception_target = HANDSHAKE_LEN;
-                } else {
-                    if (log_code >= LOG_ERR) fprintf(stderr, "Error when sending handshake sent through socket %d\n",
-                                                     peer->socket);
-                    epoll_ctl(epoll, EPOLL_CTL_DEL, peer->socket, nullptr);
-                    close(peer->socket);
-                    peer->status = PEER_CLOSED;
-                    peer->socket = -1;
-                }
-                continue;
-            }
-            // Check if handshake was received in full, and process it
-            if (peer->status == PEER_HANDSHAKE_SENT && peer->reception_target == peer->reception_pointer) {
-                const bool result = check_handshake(metainfo.info->hash, peer->reception_cache);
-                if (result) {
-                    peer->status = PEER_HANDSHAKE_SUCCESS;
-                    peer->id = malloc(20);
-                    memcpy(peer->id, peer->reception_cache + 48, 20);
-                    peer->reception_pointer = 0;
-                    peer->reception_target = MESSAGE_LENGTH_SIZE;
-                    if (log_code == LOG_FULL) fprintf(stdout, "Handshake successful in socket %d\n", peer->socket);
-                } else {
-                    epoll_ctl(epoll, EPOLL_CTL_DEL, peer->socket, nullptr);
-                    close(peer->socket);
-                    peer->status = PEER_CLOSED;
-                    peer->socket = -1;
-                }
-                memset(peer->reception_cache, 0, MAX_TRANS_SIZE);
-            }
+/**
+ * Hands a peer that connected to us over to the reactors, with the handshake the listener read, or nullptr for
+ * uTP peers. Runs on the first reactor, the one registered in the listener
+ */
+static void on_inbound_peer(void* ctx, const int32_t socket, const struct sockaddr_in* address,
+                            const unsigned char* handshake) {
+    session_t* session = ctx;
+    torrent_shared_t* shared = session->shared;
+    peer_handoff_t handoff = {0};
+    handoff.address = *address;
+    handoff.socket = socket;
+    if (handshake) memcpy(handoff.handshake, handshake, HANDSHAKE_LEN);
+    else handoff.utp = true;
+    pthread_mutex_lock(&shared->peers_mutex);
+    const bool pushed = push_handoff(shared, &handoff);
+    pthread_mutex_unlock(&shared->peers_mutex);
+    if (!pushed) {
+        close(socket);
+        return;
+    }
+    take_peers(session);
+    wake_reactors(shared, session);
+}
 
-            // Send bitfield
-            if ( (peer->status == PEER_HANDSHAKE_SUCCESS || peer->status == PEER_BITFIELD_RECEIVED)  && epoll_events[i].events & EPOLLOUT) {
-                char *buffer = malloc(MESSAGE_LENGTH_AND_ID_SIZE + bitfield_byte_size);
-                uint32_t length = 1 + bitfield_byte_size;
-                length = htonl(length);
-                memcpy(buffer, &length, MESSAGE_LENGTH_SIZE);
-                buffer[MESSAGE_LENGTH_SIZE] = BITFIELD;
-                memcpy(buffer + 5, bitfield, bitfield_byte_size);
-                int64_t sent_bytes = 0;
-                while (sent_bytes < MESSAGE_LENGTH_AND_ID_SIZE + bitfield_byte_size) {
-                    int64_t sent = send(peer->socket, buffer + sent_bytes,
-                                        MESSAGE_LENGTH_AND_ID_SIZE + bitfield_byte_size - sent_bytes, 0);
-                    if (sent > 0) sent_bytes += sent;
-                }
-
-                free(buffer);
-            }
+/**
+ * Hands a peer that connected to us over uTP over to the reactors. Runs on the first reactor, the one the uTP
+ * context is registered in
+ */
+static void on_inbound_utp_peer(void* ctx, const int32_t socket, const struct sockaddr_in* address) {
+    on_inbound_peer(ctx, socket, address, nullptr);
+}
 
-            /*
-             * Message reception
-             */
-
-            // Message length
-            if (peer->status >= PEER_HANDSHAKE_SUCCESS && peer->reception_target == peer->reception_pointer && peer->reception_target == MESSAGE_LENGTH_SIZE) {
-                if (read_message_length(peer->reception_cache, &peer->last_msg)) {
-                    peer->reception_target = MESSAGE_LENGTH_AND_ID_SIZE;
-                    peer->status = PEER_AWAITING_ID;
-                } else {
-                    // If message ended, be ready to receive or send the next message
-                    peer->reception_target = MESSAGE_LENGTH_SIZE;
-                    peer->reception_pointer = 0;
-                }
-                if (log_code == LOG_FULL) fprintf(stdout, "Peer %d received length\n", peer->socket);
-            }
+/**
+ * Takes new peers and sends HAVE for pieces other reactors verified. Runs whenever wake_fd is written
+ */
+static void on_wake(void* ctx, const uint32_t events) {
+    (void) events;
+    session_t* session = ctx;
+    uint64_t count;
+    // Non-blocking, and a single read resets the counter
+    if (read(session->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_printf(session->log_code, LOG_ERR, "Couldn't read wakeup of reactor %u\n", session->reactor);
+    }
+    take_peers(session);
+    send_haves(session);
+}
+
+/**
+ * Asks a peer understanding v2 for the leaf hashes of the pieces whose blocks it was asked for, so they're checked
+ * as they arrive. The hashes of each piece are only asked of one peer at a time
+ */
+static void request_hashes(const session_t* session, peer_t* peer) {
+    merkle_t* merkle = session->shared->merkle;
+    if (!merkle || !peer->v2) return;
+    unsigned char payloads[MERKLE_MAX_REQUESTS * HASH_REQUEST_SIZE];
+    uint32_t last_piece = UINT32_MAX;
+    for (uint32_t i = 0; i < peer->pending_amount && peer->status != PEER_CLOSED; ++i) {
+        const uint32_t piece = peer->pending_blocks[i] / session->blocks_per_piece;
+        // Blocks of a piece are requested together
+        if (piece == last_piece) continue;
+        last_piece = piece;
+        const uint32_t amount = merkle_hash_requests(merkle, piece, payloads);
+        for (uint32_t j = 0; j < amount; ++j) {
+            send_message(peer, HASH_REQUEST, payloads + j * HASH_REQUEST_SIZE, HASH_REQUEST_SIZE, session->log_code);
+        }
+    }
+}
+
+/**
+ * Handles an epoll event of a peer socket: connection, handshake, output and messages.
+ * Leaves the peer as PEER_CLOSED if it had to be closed
+ */
+static void handle_peer_event(session_t* session, const uint32_t index, const uint32_t events) {
+    peer_t *peer = &session->swarm->peer_array[index];
+    const int32_t epoll = session->swarm->epoll;
+    const LOG_CODE log_code = session->log_code;
+
+    // Fatal error in socket
+    if (events == EPOLLERR) {
+        int32_t err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(peer->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            log_printf(log_code, LOG_ERR, "Getsockopt error %d in socket %d\n", errno, peer->socket);
+        } else if (err != 0) {
+            errno = err;
+            log_printf(log_code, LOG_ERR, "Socket error %d in socket %d\n", errno, peer->socket);
+        }
+        close_peer(peer, epoll);
+        return;
+    }
 
-            // Message id
-            if (peer->status >= PEER_AWAITING_ID && peer->reception_target == peer->reception_pointer && peer->reception_target == MESSAGE_LENGTH_AND_ID_SIZE) {
-                bittorrent_message_t *message = (bittorrent_message_t *) peer->reception_cache;
-                if (message->length > 1) {
-                    // message has payload
-                    peer->reception_target += (int32_t) message->length - 1;
-                    peer->status = PEER_AWAITING_PAYLOAD;
-                } else {
-                    // message without payload
-                    // If message ended, be ready to receive or send the next message
-                    peer->reception_target = MESSAGE_LENGTH_SIZE;
-                    peer->reception_pointer = 0;
-                }
-                if (log_code == LOG_FULL) fprintf(stdout, "Peer %d received id of %d with length of %d\n", peer->socket,
-                                                  message->id, message->length);
-            }
 
-            // Message payload (if exists)
-            if (peer->status >= PEER_AWAITING_PAYLOAD && peer->reception_target == peer->reception_pointer) {
-                bittorrent_message_t *message = (bittorrent_message_t *) peer->reception_cache;
-                message->payload = peer->reception_cache + MESSAGE_LENGTH_AND_ID_SIZE;
-                if (log_code == LOG_FULL) {
-                    fprintf(stdout, "Peer %d received payload\n", peer->socket);
-                    for (int k = 0; k < message->length - 1; ++k) {
-                        fprintf(stdout, "%d|", message->payload[k]);
-                    }
-                    fprintf(stdout, "\n");
-                }
-
-                switch (message->id) {
-                    case CHOKE:
-                        peer->peer_choking = true;
-                        break;
-                    case UNCHOKE:
-                        peer->peer_choking = false;
-                        break;
-                    case INTERESTED:
-                        peer->peer_interested = true;
-                        break;
-                    case NOT_INTERESTED:
-                        peer->peer_interested = false;
-                        break;
-                    case HAVE:
-                        handle_have(peer, message->payload, bitfield, bitfield_byte_size, log_code);
-                        break;
-                    case BITFIELD:
-                        handle_bitfield(peer, message->payload, bitfield, bitfield_byte_size, log_code);
-                        break;
-                    case REQUEST:
-                        handle_request(peer, message->payload, log_code);
-                        break;
-                    case PIECE:
-                        const uint64_t download_size = handle_piece((piece_t*)message->payload, peer->socket, metainfo, bitfield, block_tracker,
-                                                                    blocks_per_piece, log_code);
-                        torrent_stats->downloaded += download_size;
-                        torrent_stats->left -= download_size;
-                        const uint32_t piece_index = ntohl(( (piece_t*)message->payload )->index);
-                        broadcast_have(peer_array, peer_amount, piece_index, log_code);
-                        break;
-                    case CANCEL:
-                    case PORT:
-                        break;
-                    default: ;
-                }
-
-                peer->reception_target = MESSAGE_LENGTH_SIZE;
-                peer->reception_pointer = 0;
-                memset(peer->reception_cache, 0, bitfield_byte_size);
-                peer->status = PEER_HANDSHAKE_SUCCESS;
+    // DEALING WITH CONNECTING
+    // After calling connect()
+    if (peer->status == PEER_NOTHING) {
+        peer->status = PEER_CONNECTION_FAILURE;
+        if (events & EPOLLOUT) {
+            int32_t err = 0;
+            socklen_t len = sizeof(err);
+            // Check whether connect() was successful
+            if (getsockopt(peer->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+                log_printf(log_code, LOG_ERR, "Error in getspckopt() in socket %d\n", peer->socket);
+            } else if (err != 0) {
+                log_printf(log_code, LOG_ERR, "Connection failed in socket %d\n", peer->socket);
+            } else {
+                log_printf(log_code, LOG_FULL, "Connection successful in socket %d\n", peer->socket);
+                peer->status = PEER_CONNECTION_SUCCESS;
+                metrics_add(METRIC_USEFUL_EVENTS, 1);
+                wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_STATE], PEER_HANDSHAKE_TIMEOUT_MS);
             }
+        } else {
+            log_printf(log_code, LOG_ERR, "Connection in socket %d failed, EPOLLERR or EPOLLHUP\n",
+                                             peer->socket);
+        }
+    }
+    // Retry connection if connect() failed
+    if (peer->status == PEER_CONNECTION_FAILURE) {
+        if (try_connect(peer->socket, peer->address, log_code)) {
+            if (errno != EINPROGRESS) {
+                close_peer(peer, epoll);
+            } else peer->status = PEER_NOTHING;
         }
+        return;
+    }
 
-        write_state("state/state.txt", state);
+    // Send handshake
+    if (peer->status == PEER_CONNECTION_SUCCESS) {
+        if (!(events & EPOLLOUT)) return;
+        const int32_t result = send_handshake(peer, session->metainfo->info->hash, session->peer_id, log_code);
+        if (result > 0) {
+            peer->status = PEER_HANDSHAKE_SENT;
+            log_printf(log_code, LOG_FULL, "Handshake sent through socket %d\n", peer->socket);
+            // Writability stops being watched unless part of the handshake is still queued
+            update_interest(peer, epoll, index);
+        } else {
+            log_printf(log_code, LOG_ERR, "Error when sending handshake sent through socket %d\n",
+                                             peer->socket);
+            close_peer(peer, epoll);
+        }
+        return;
+    }
 
-        for (int i = 0; i < peer_amount; ++i) {
-            if (peer_array[i].status == PEER_CLOSED && difftime(time(nullptr), peer_array[i].last_msg) >= 10) {
-                fprintf(stdout, "Attempting to reconnect socket #%d\n", peer_array[i].socket);
-                reconnect(peer_array, peer_amount, counter2, epoll, log_code);
+    // Sending what was queued while the socket was full
+    bool useful = false;
+    if (events & EPOLLOUT) {
+        const int64_t flushed = flush_output(peer, log_code);
+        if (flushed < 0) {
+            close_peer(peer, epoll);
+            return;
+        }
+        useful = flushed > 0;
+    }
+
+    /*
+     * Message reception, every complete message in the socket at once
+     */
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        const uint64_t bytes_received = peer->bytes_received;
+        const int32_t handled = receive_messages(peer, epoll, handle_message, session, log_code);
+        if (peer->bytes_received != bytes_received) {
+            peer->last_activity_ms = session->timers->now_ms;
+            useful = true;
+        }
+        useful = useful || handled != 0;
+        // Asking for blocks once the peer has something worth it
+        if (handled > 0 && peer->status >= PEER_HANDSHAKE_SUCCESS) {
+            if (peer->am_interested && !peer->interest_sent) {
+                peer->interest_sent = send_message(peer, INTERESTED, nullptr, 0, log_code);
+            }
+            request_blocks(peer, session->metainfo->info, session->bitfield, session->block_tracker,
+                           session->requested_blocks, session->blocks_per_piece, log_code);
+            request_hashes(session, peer);
+            // The timeout counts from the first request left unanswered
+            if (peer->pending_amount > 0 && !wheel_timer_armed(session->timers, peer->timers[PEER_TIMER_REQUEST])) {
+                peer->last_block_ms = session->timers->now_ms;
+                wheel_timer_arm(session->timers, peer->timers[PEER_TIMER_REQUEST], PEER_REQUEST_TIMEOUT_MS);
             }
         }
     }
+    if (useful) metrics_add(METRIC_USEFUL_EVENTS, 1);
+    update_interest(peer, epoll, index);
+}
+
+/**
+ * Creates a reactor's event loop, timers, swarm and wakeup eventfd. Fields shared by every reactor must be set already
+ * @return false if any of them couldn't be created, what was is freed by free_reactor()
+ */
+static bool create_reactor(session_t* session) {
+    session->wake_fd = -1;
+    session->loop = loop_create();
+    session->swarm = calloc(1, sizeof(swarm_t));
+    session->timers = timer_wheel_create(monotonic_coarse_ms());
+    if (!session->loop || !session->swarm || !session->timers) return false;
+    session->swarm->epoll = session->loop->epoll;
+    session->swarm->log_code = session->log_code;
+    session->swarm->local_networks = session->shared->local_networks;
+    session->swarm->local_network_amount = session->shared->local_network_amount;
+    session->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (session->wake_fd < 0 || loop_add_source(session->loop, session->wake_fd, EPOLLIN, on_wake, session) < 0) {
+        return false;
+    }
+    session->stats_timer = wheel_timer_new(session->timers, on_stats_timer, session, 0);
+    wheel_timer_arm(session->timers, session->stats_timer, PEER_STATS_INTERVAL_MS);
+    // Private torrents only get peers from their trackers
+    session->pex_timer = TIMER_NONE;
+    if (!session->metainfo->info->priv) {
+        session->pex_timer = wheel_timer_new(session->timers, on_pex_timer, session, 0);
+        wheel_timer_arm(session->timers, session->pex_timer, PEX_INTERVAL_MS);
+    }
+    return true;
+}
 
+/**
+ * Closes the sockets of a reactor's peers and frees everything create_reactor() created
+ */
+static void free_reactor(session_t* session) {
+    timer_wheel_free(session->timers);
+    free(session->pex_peers);
+    if (session->wake_fd >= 0) close(session->wake_fd);
     // Closing sockets
-    close(epoll);
-    for (int32_t i = 0; i < peer_amount; ++i) {
-        close(peer_socket_array[i]);
+    loop_free(session->loop);
+    if (!session->swarm) return;
+    swarm_t* swarm = session->swarm;
+    for (uint32_t i = 0; i < swarm->peer_amount; ++i) {
+        if (swarm->peer_array[i].socket >= 0) close(swarm->peer_array[i].socket);
+        free(swarm->peer_array[i].address);
+        free(swarm->peer_array[i].bitfield);
+        free(swarm->peer_array[i].id);
+        free(swarm->peer_array[i].send_buffer);
+    }
+    // Freeing peer array
+    free(swarm->peer_array);
+    free(swarm);
+}
+
+/**
+ * Runs a reactor's loop until the whole torrent is downloaded. The first reactor also drives the announcer
+ */
+static void run_reactor(session_t* session, announcer_t* announcer) {
+    event_loop_t* loop = session->loop;
+    const swarm_t* swarm = session->swarm;
+    // Checking connections with epoll
+    struct epoll_event epoll_events[MAX_EVENTS];
+    // Peers handed over before the reactor started
+    take_peers(session);
+    /*
+     *
+     *  MAIN PEER INTERACTION LOOP
+     *
+     */
+    while (!__atomic_load_n(&session->shared->done, __ATOMIC_ACQUIRE)) {
+        // Waking up in time for the next tracker deadline or peer timer
+        int32_t timeout = announcer ? announcer_tick(announcer, time(nullptr)) : EPOLL_TIMEOUT;
+        if (timeout > EPOLL_TIMEOUT) timeout = EPOLL_TIMEOUT;
+        timeout = timer_wheel_timeout(session->timers, timeout);
+        const uint64_t wait_start = trace_now();
+        const int32_t nfds = epoll_wait(loop->epoll, epoll_events, MAX_EVENTS, timeout);
+        metrics_add(METRIC_EPOLL_WAKEUPS, 1);
+        const uint64_t wait_end = trace_now();
+        // The only clock read of the iteration, every timer and timestamp below uses it
+        timer_wheel_advance(session->timers, monotonic_coarse_ms());
+        if (nfds == -1) {
+            log_printf(session->log_code, LOG_ERR, "Error in epoll_wait\n");
+            continue;
+        }
+
+        for (int32_t i = 0; i < nfds; ++i) {
+            // Tracker sockets and wakeups
+            if (loop_dispatch(loop, &epoll_events[i])) continue;
+            const uint32_t index = epoll_events[i].data.u32;
+            metrics_add(METRIC_PEER_EVENTS, 1);
+            // Closed earlier in this same batch
+            if (swarm->peer_array[index].status == PEER_CLOSED) continue;
+            handle_peer_event(session, index, epoll_events[i].events);
+            if (swarm->peer_array[index].status == PEER_CLOSED) drop_peer(session, index);
+        }
+        trace_event(TRACE_LOOP_ITERATION, nfds, wait_end - wait_start, -1, wait_start);
     }
+}
+
+static void* reactor_thread(void* arg) {
+    run_reactor(arg, nullptr);
+    return nullptr;
+}
+
+int32_t torrent(const metainfo_t metainfo, const unsigned char *peer_id, listener_t* listener, uint32_t reactors,
+                const LOG_CODE log_code) {
+    if (reactors == 0) reactors = 1;
+    if (reactors > TORRENT_MAX_REACTORS) reactors = TORRENT_MAX_REACTORS;
+    torrent_stats_t* torrent_stats = malloc(sizeof(torrent_stats_t));
+    if (!torrent_stats) return -1;
+    torrent_stats->downloaded = 0;
+    torrent_stats->left = download_length(metainfo.info);
+    torrent_stats->uploaded = 0;
+    torrent_stats->event = 0;
+    torrent_stats->key = arc4random();
+    torrent_stats->port = listener ? listener->port : 0;
+
+    // General bitfield. Each piece takes up 1 bit
+    const uint32_t bitfield_byte_size = ceil(metainfo.info->piece_number / 8.0);
+    // Size in bytes of the block tracker
+    const uint32_t block_tracker_bytesize = ceil(
+        ceil(
+            metainfo.info->piece_number * metainfo.info->piece_length / (double) BLOCK_SIZE
+        ) / 8.0
+    );
+    // Shared by every reactor, which only change them atomically
+    unsigned char *bitfield = calloc(bitfield_byte_size, 1);
+    // Downloaded index for each block in a piece
+    unsigned char *block_tracker = calloc(block_tracker_bytesize, 1);
+    // Blocks requested from some peer and not received yet, so no block is asked for twice
+    unsigned char *requested_blocks = calloc(block_tracker_bytesize, 1);
+    torrent_shared_t shared = {0};
+    shared.completed = malloc(sizeof(uint32_t) * metainfo.info->piece_number);
+    shared.reactors = calloc(reactors, sizeof(session_t));
+    if (!bitfield || !block_tracker || !requested_blocks || !shared.completed || !shared.reactors) {
+        free(bitfield);
+        free(block_tracker);
+        free(requested_blocks);
+        free(shared.completed);
+        free(shared.reactors);
+        free(torrent_stats);
+        return -1;
+    }
+    state_t* state = init_state("state/state.txt", metainfo.info->piece_number, metainfo.info->piece_length, bitfield);
+    pthread_mutex_init(&shared.disk_mutex, nullptr);
+    pthread_mutex_init(&shared.peers_mutex, nullptr);
+    shared.reactor_amount = reactors;
+    shared.done = torrent_stats->left == 0;
+    shared.local_network_amount = find_local_networks(shared.local_networks, LSD_MAX_NETWORKS);
+    // Blocks of v2 and hybrid torrents are checked one by one once their leaf hashes are known
+    if (metainfo.info->meta_version == 2) {
+        shared.merkle = merkle_create(metainfo.info, ceil(metainfo.info->piece_length / (double) BLOCK_SIZE));
+    }
+
+    bool created = true;
+    for (uint32_t r = 0; r < reactors; ++r) {
+        session_t* session = &shared.reactors[r];
+        session->shared = &shared;
+        session->reactor = r;
+        session->metainfo = &metainfo;
+        session->peer_id = peer_id;
+        session->torrent_stats = torrent_stats;
+        session->state = state;
+        session->bitfield = bitfield;
+        session->bitfield_byte_size = bitfield_byte_size;
+        session->block_tracker = block_tracker;
+        session->requested_blocks = requested_blocks;
+        // Actual amount of blocks per piece (not bytes)
+        session->blocks_per_piece = ceil(metainfo.info->piece_length / (double) BLOCK_SIZE);
+        session->log_code = log_code;
+        // Reactors left uncreated after a failure are still freed, without closing fd 0
+        session->wake_fd = -1;
+        created = created && create_reactor(session);
+    }
+
+    // Trackers answer through the first reactor's loop, so peers are handed over as soon as the first one responds
+    session_t* first = &shared.reactors[0];
+    udp_client_t* udp_client = nullptr;
+    http_client_t* http_client = nullptr;
+    resolver_t* resolver = nullptr;
+    announcer_t* announcer = nullptr;
+    dht_t* dht = nullptr;
+    lsd_t* lsd = nullptr;
+    if (created) {
+        udp_client = udp_client_create(first->loop, log_code);
+        http_client = http_client_create(first->loop, log_code);
+        resolver = resolver_create(first->loop, log_code);
+        announcer = announcer_start(udp_client, http_client, resolver, &metainfo, peer_id, torrent_stats,
+                                    on_tracker_peers, first, log_code);
+        // Peers keep coming while trackers are down. Private torrents only get them from their trackers
+        if (!metainfo.info->priv) {
+            dht = dht_create(first->loop, first->timers, torrent_stats->port, DHT_STATE_FILE, log_code);
+            dht_bootstrap(dht, resolver);
+            if (dht) dht_get_peers(dht, metainfo.info->hash, torrent_stats->port, on_tracker_peers, first);
+            // Neighbours with the same torrent are found right away, whatever the trackers return
+            lsd = lsd_create(first->loop, first->timers, metainfo.info->hash, torrent_stats->port, on_tracker_peers,
+                             first, log_code);
+        }
+    }
+    utp_context_t* utp = nullptr;
+    // Web seeds share the trackers' client, requests of both run concurrently
+    for (const ll* url = created ? metainfo.url_list : nullptr; url; url = url->next) {
+        webseed_t** grown = realloc(shared.webseeds, sizeof(webseed_t*) * (shared.webseed_amount + 1));
+        if (!grown) break;
+        shared.webseeds = grown;
+        shared.webseeds[shared.webseed_amount] = webseed_create(http_client, url->val, metainfo.info,
+                                                                on_webseed_piece, first, log_code);
+        if (shared.webseeds[shared.webseed_amount]) shared.webseed_amount++;
+    }
+    if (shared.webseed_amount > 0) {
+        log_printf(log_code, LOG_SUMM, "Downloading from %u web seeds\n", shared.webseed_amount);
+        shared.webseed_timer = wheel_timer_new(first->timers, on_webseed_timer, first, 0);
+        wheel_timer_arm(first->timers, shared.webseed_timer, WEBSEED_TICK_MS);
+        fill_webseeds(first);
+    }
+    if (announcer || dht || lsd) {
+        // The DHT owns our announced UDP port, uTP only gets it when there's no DHT
+        const uint16_t utp_port = dht ? 0 : torrent_stats->port;
+        utp = utp_create(first->loop, first->timers, utp_port, on_inbound_utp_peer, first, log_code);
+        if (!utp && utp_port != 0) utp = utp_create(first->loop, first->timers, 0, on_inbound_utp_peer, first, log_code);
+        // Connections are asked for from every reactor, and run on the first one
+        for (uint32_t r = 0; r < reactors; ++r) shared.reactors[r].swarm->utp = utp;
+    }
+    if (announcer == nullptr && dht == nullptr && lsd == nullptr && shared.webseed_amount == 0) {
+        free(shared.webseeds);
+        resolver_free(resolver);
+        http_client_free(http_client);
+        udp_client_free(udp_client);
+        for (uint32_t r = 0; r < reactors; ++r) free_reactor(&shared.reactors[r]);
+        pthread_mutex_destroy(&shared.disk_mutex);
+        pthread_mutex_destroy(&shared.peers_mutex);
+        merkle_free(shared.merkle);
+        free(shared.reactors);
+        free(shared.completed);
+        free(bitfield);
+        free(block_tracker);
+        free(requested_blocks);
+        free(state);
+        free(torrent_stats);
+        return -1;
+    }
+
+    // Peers connecting to us are handed over through the loop, once everything they need exists
+    listener_torrent_t* registration = nullptr;
+    if (listener) {
+        registration = listener_register(listener, metainfo.info->hash, first->loop, on_inbound_peer, first);
+        if (!registration) log_printf(log_code, LOG_ERR, "Couldn't accept peers for this torrent\n");
+    }
+    // Nothing is handed over before the first reactor runs, so reactors that don't start are just left out
+    for (uint32_t r = 1; r < reactors; ++r) {
+        session_t* session = &shared.reactors[r];
+        session->thread_started = pthread_create(&session->thread, nullptr, reactor_thread, session) == 0;
+        if (!session->thread_started) {
+            log_printf(log_code, LOG_ERR, "Couldn't start reactor %u, going on with %u\n", r, r);
+            shared.reactor_amount = r;
+            break;
+        }
+    }
+    run_reactor(first, announcer);
+    // Whichever reactor verified the last piece woke the rest up
+    for (uint32_t r = 1; r < reactors; ++r) {
+        if (shared.reactors[r].thread_started) pthread_join(shared.reactors[r].thread, nullptr);
+    }
+
+    // Letting trackers know we're done
+    announcer_stop(announcer);
+    // Its routing table is saved for the next run
+    dht_free(dht);
+    lsd_free(lsd);
+    // Pieces they were still sending are dropped
+    for (uint32_t i = 0; i < shared.webseed_amount; ++i) webseed_free(shared.webseeds[i]);
+    free(shared.webseeds);
+    // Resets the connections of peers still open, whose sockets are closed with their reactors below
+    utp_free(utp);
+    // HTTP stopped events need the loop to run a little longer to reach their trackers
+    const time_t stop_deadline = time(nullptr) + HTTP_STOP_TIMEOUT;
+    struct epoll_event epoll_events[MAX_EVENTS];
+    while (http_client && http_client->requests && time(nullptr) < stop_deadline) {
+        const int32_t ready = epoll_wait(first->loop->epoll, epoll_events, MAX_EVENTS, 100);
+        for (int32_t i = 0; i < ready; ++i) loop_dispatch(first->loop, &epoll_events[i]);
+    }
+    if (resolver && LOG_ENABLED(log_code, LOG_SUMM)) {
+        log_write(LOG_SUMM, "Resolver: %lu lookups, %lu cache hits, %lu negative hits, %lu resolutions (%lu failed), "
+                        "%lu us average, %lu us max\n", (unsigned long) resolver->stats.lookups,
+                (unsigned long) resolver->stats.cache_hits, (unsigned long) resolver->stats.negative_hits,
+                (unsigned long) resolver->stats.resolutions, (unsigned long) resolver->stats.failures,
+                (unsigned long) (resolver->stats.resolutions ? resolver->stats.total_latency_us / resolver->stats.resolutions : 0),
+                (unsigned long) resolver->stats.max_latency_us);
+    }
+    resolver_free(resolver);
+    http_client_free(http_client);
+    udp_client_free(udp_client);
+    listener_unregister(registration);
+    // Inbound peers no reactor took
+    for (uint32_t i = 0; i < shared.handoff_amount; ++i) {
+        if (shared.handoffs[i].socket >= 0) close(shared.handoffs[i].socket);
+    }
+    for (uint32_t r = 0; r < reactors; ++r) free_reactor(&shared.reactors[r]);
+    pthread_mutex_destroy(&shared.disk_mutex);
+    pthread_mutex_destroy(&shared.peers_mutex);
+    merkle_free(shared.merkle);
+    free(shared.reactors);
+    free(shared.handoffs);
+    free(shared.known);
+    free(shared.completed);
     // Freeing bitfield
     free(bitfield);
     free(block_tracker);
-    // Freeing peer array
-    free(peer_array);
-    free(peer_socket_array);
-    free(peer_addr_array);
-    // Freeing announce response
-    while (announce_response->peer_list != nullptr) {
-        peer_ll *aux = announce_response->peer_list->next;
-        free(announce_response->peer_list->ip);
-        free(announce_response->peer_list);
-        announce_response->peer_list = aux;
-    }
-    free(announce_response);
+    free(requested_blocks);
+    // Its bitfield is the one freed above
+    free(state);
+    free(torrent_stats);
 
     return 0;
 }
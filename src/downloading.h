@@ -3,6 +3,7 @@
 
 #include "downloading_types.h"
 #include "file.h"
+#include "listener.h"
 #include "predownload_udp.h"
 
 /**
@@ -67,7 +68,7 @@ bool are_bits_set(const unsigned char *bitfield, uint32_t start, uint32_t end);
  *
  * This function checks for pieces of a file that intersect with the given
  * piece and determines whether all corresponding pieces are downloaded or not.
- * If all overlapping pieces for a file are downloaded, the file pointer is closed.
+ * If all overlapping pieces for a file are downloaded, the file pointer is closed and set to nullptr.
  *
  * @param files Pointer to the linked list of files (each file containing metadata and a file pointer).
  * @param bitfield A bitfield indicating which pieces are downloaded (1 indicates downloaded, 0 indicates not).
@@ -75,9 +76,54 @@ bool are_bits_set(const unsigned char *bitfield, uint32_t start, uint32_t end);
  * @param piece_size The size of a piece in bytes.
  * @param this_piece_size The size of the current piece being evaluated (useful for the last piece which can be smaller).
  */
-void closing_files(const files_ll* files, const unsigned char* bitfield, uint32_t piece_index, uint32_t piece_size, uint32_t
+void closing_files(files_ll* files, const unsigned char* bitfield, uint32_t piece_index, uint32_t piece_size, uint32_t
                    this_piece_size);
 
+/**
+ * Reads a downloaded piece back from the files it's spread across.
+ *
+ * @param files Linked list of the torrent's files. Open file pointers are flushed and reused.
+ * @param buffer Where the piece is read into, at least this_piece_size bytes.
+ * @param piece_index The index of the piece.
+ * @param piece_size The size of a piece in bytes.
+ * @param this_piece_size The size of this piece, smaller for the last one.
+ * @param log_code Controls the verbosity of logging output.
+ * @return true if the whole piece was read, false otherwise.
+ */
+bool read_piece(files_ll *files, unsigned char *buffer, uint32_t piece_index, uint32_t piece_size,
+                uint32_t this_piece_size, LOG_CODE log_code);
+
+/**
+ * Checks a downloaded piece against its SHA1 hash, reading it back from the files it's spread across.
+ *
+ * @param files Linked list of the torrent's files. Open file pointers are flushed and reused.
+ * @param expected_hash The 20-byte SHA1 hash of the piece, from the metainfo.
+ * @param piece_index The index of the piece.
+ * @param piece_size The size of a piece in bytes.
+ * @param this_piece_size The size of this piece, smaller for the last one.
+ * @param log_code Controls the verbosity of logging output.
+ * @return true if the piece is complete on disk and its hash matches, false otherwise.
+ */
+bool verify_piece(files_ll *files, const unsigned char *expected_hash, uint32_t piece_index, uint32_t piece_size,
+                  uint32_t this_piece_size, LOG_CODE log_code);
+
+/**
+ * Checks a run of downloaded pieces against their SHA1 hashes, as a recheck does. Pieces are read back up to
+ * SHA1_MAX_LANES or VERIFY_BATCH_BYTES at a time, whichever comes first, and hashed together with sha1_hash_batch().
+ *
+ * @param files Linked list of the torrent's files. Open file pointers are flushed and reused.
+ * @param pieces The 20-byte SHA1 hashes of every piece, from the metainfo.
+ * @param first_piece The index of the first piece to check.
+ * @param amount The amount of pieces to check.
+ * @param piece_size The size of a piece in bytes.
+ * @param torrent_size The size of the whole torrent in bytes, which tells how long the last piece is.
+ * @param valid Set for each piece checked, true if it's complete on disk and its hash matches.
+ * @param log_code Controls the verbosity of logging output.
+ * @return The amount of pieces that matched their hash.
+ */
+uint32_t verify_pieces(files_ll *files, const unsigned char *pieces, uint32_t first_piece, uint32_t amount,
+                       uint32_t piece_size, uint64_t torrent_size, bool *valid, LOG_CODE log_code);
+
 /**
  * Handles the pre-download procedure over UDP by connecting to a tracker and sending an announce request.
  *
@@ -115,6 +161,52 @@ announce_response_t* handle_predownload_udp(metainfo_t metainfo, const unsigned
  */
 bool read_from_socket(peer_t* peer, int32_t epoll, LOG_CODE log_code);
 
+/**
+ * Reads everything available in a peer's socket and hands each complete message to callback.
+ *
+ * Reads fill the peer's recv_buffer with as many bytes as fit, so a single call usually
+ * brings several messages, which are taken out of it without further copies. Messages longer than
+ * INLINE_MESSAGE_MAX, blocks mostly, are instead gathered in reception_cache, reading their remainder
+ * straight into it. Keep-alives are skipped, bytes_received shows they arrived. While the peer's status is
+ * PEER_HANDSHAKE_SENT, the next HANDSHAKE_LEN bytes are handed over as its handshake.
+ *
+ * Reading stops once the socket would block, and what's left of an incomplete message is kept for the next call.
+ * If the peer closed the connection, or announced a message longer than MAX_TRANS_SIZE,
+ * the socket is closed and the peer marked as PEER_CLOSED.
+ *
+ * @param peer The peer whose socket is read from.
+ * @param epoll Epoll instance the socket is registered in.
+ * @param callback Called for each message, in order. Returning false stops reception right away.
+ * @param ctx Passed to callback.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return The amount of messages handed to callback, or -1 if the peer was closed
+ *         or the arguments are invalid.
+ */
+int32_t receive_messages(peer_t* peer, int32_t epoll, message_callback_t callback, void* ctx, LOG_CODE log_code);
+
+/**
+ * Closes the peer's socket and takes it out of epoll, so it can be reconnected later. Whatever was queued
+ * for it is dropped and it's left as PEER_CLOSED.
+ *
+ * @param peer The peer to close.
+ * @param epoll Epoll instance the socket is registered in.
+ */
+void close_peer(peer_t* peer, int32_t epoll);
+
+/**
+ * Registers the peer's socket for the events it currently needs: EPOLLIN always, EPOLLOUT only while connecting
+ * or while peer_send() has output queued, so idle peers never wake epoll_wait() up. Nothing is done when
+ * the registration already matches, which is tracked in the peer's epoll_events.
+ *
+ * @param peer The peer whose registration is updated.
+ * @param epoll Epoll instance the socket is registered in.
+ * @param index Index of the peer in the swarm, used as the event's data.
+ * @return true if the socket is registered for the events it needs, false if it couldn't be or the peer is closed.
+ */
+bool update_interest(peer_t* peer, int32_t epoll, uint32_t index);
+
 /**
  * Attempts to reconnect to peers in the provided peer list that are marked with a status of PEER_CLOSED.
  * For each peer marked as PEER_CLOSED, the function attempts to reset its state, create a new non-blocking
@@ -131,6 +223,31 @@ bool read_from_socket(peer_t* peer, int32_t epoll, LOG_CODE log_code);
  */
 uint32_t reconnect(peer_t* peer_list, uint32_t peer_amount, uint32_t last_peer, int32_t epoll, LOG_CODE log_code);
 
+/**
+ * Adds peers in compact format to the swarm and starts connecting to them, over uTP if the swarm has a uTP
+ * context. Peers already in the swarm are skipped, so responses from several trackers can be merged. peer_array grows as needed, so pointers into it must not be
+ * kept across calls.
+ *
+ * @param swarm The swarm to add peers to.
+ * @param compact_peers Peers in compact format, as returned by trackers.
+ * @param peer_amount Amount of peers in compact_peers.
+ * @param family AF_INET for 6-byte peers, AF_INET6 for 18-byte peers. Only IPv4 peers are connected to for now.
+ * @return The amount of peers actually added.
+ */
+uint32_t add_peers(swarm_t *swarm, const unsigned char *compact_peers, uint32_t peer_amount, int32_t family);
+
+/**
+ * Adds a peer that connected to us to the swarm and watches its socket for input. Inbound peers are
+ * never connected to again once closed.
+ *
+ * @param swarm The swarm to add the peer to.
+ * @param socket Connected non-blocking socket of the peer. Owned by the swarm from now on, even on failure.
+ * @param address Address the peer connected from.
+ * @return Index of the peer, left as PEER_CLOSED if its socket couldn't be watched,
+ *         or -1 if it couldn't be added at all.
+ */
+int32_t add_inbound_peer(swarm_t *swarm, int32_t socket, const struct sockaddr_in *address);
+
 /**
  * @brief Writes and serializes the torrent download state to a file.
  *
@@ -177,11 +294,16 @@ state_t* init_state(const char* filename, uint32_t piece_count, uint32_t piece_s
  * @brief Downloads & uploads torrent
  * @param metainfo The torrent metainfo extracted from the .torrent file
  * @param peer_id The chosen peer_id
+ * @param listener Accepts peers for every torrent, or nullptr to only connect to peers from trackers.
+ *                 Its port is announced to trackers
+ * @param reactors Threads peers are spread over, each with its own event loop. The first one is the calling
+ *                 thread, which also talks to trackers. Clamped to 1..TORRENT_MAX_REACTORS
  * @param log_code An enumeration value specifying the desired logging level.
  *                    It can be one of the following:
  *                    LOG_NO (no logging), LOG_ERR (error logging),
  *                    LOG_SUMM (summary logging), or LOG_FULL (detailed logging).
  * @return 0 for success, !0 for failure
  */
-int32_t torrent(metainfo_t metainfo, const unsigned char *peer_id, LOG_CODE log_code);
+int32_t torrent(metainfo_t metainfo, const unsigned char *peer_id, listener_t *listener, uint32_t reactors,
+                LOG_CODE log_code);
 #endif //DOWNLOADING_H
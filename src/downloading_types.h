@@ -5,20 +5,89 @@
 #ifndef BITTORRENT_CLIENT_DOWNLOADING_TYPES_H
 #define BITTORRENT_CLIENT_DOWNLOADING_TYPES_H
 
+#include <sys/epoll.h>
 #include <sys/time.h>
 
+#include "util.h"
+
 /// @brief Maximum events cached by epoll
 #define MAX_EVENTS 128
 /// @brief Maximum amount of time epoll will wait for sockets to be ready (in milliseconds)
 #define EPOLL_TIMEOUT 5000
 /// @brief Download block size in bytes (16KB)
 #define BLOCK_SIZE 16384
-/// @brief Maximum amount of bytes to be transmited in any request or response
-#define MAX_TRANS_SIZE (BLOCK_SIZE+9)
+/// @brief Maximum amount of bytes to be transmited in any request or response: a PIECE message, with its length,
+/// id, index and begin, or a ut_metadata piece, whose dictionary takes a little more room
+#define MAX_TRANS_SIZE (BLOCK_SIZE+128)
 // TODO Temporal solution, this should be changed to be adjusted dynamically
 
+/// @brief Bytes of each peer's receive buffer. Reads take as much as fits, so short messages are batched
+#define RECV_BUFFER_SIZE 2048
+/// @brief Messages longer than this, blocks mostly, are gathered straight into reception_cache instead.
+/// Must fit in RECV_BUFFER_SIZE, as must a handshake
+#define INLINE_MESSAGE_MAX 256
+
+/// @brief Most bytes queued for a peer whose socket isn't writable. Sends beyond it fail
+#define SEND_QUEUE_MAX (256 * 1024)
+
+/// @brief Most bytes of pieces verify_pieces() reads before hashing them as a batch
+#define VERIFY_BATCH_BYTES (32 * 1024 * 1024)
+
+/**
+ * Whether peer sockets are registered edge-triggered. Reads and writes go on until the socket would block
+ * either way, so both modes behave the same, edge-triggered just skips reporting sockets that stay ready.
+ */
+#ifndef PEER_EDGE_TRIGGERED
+#define PEER_EDGE_TRIGGERED 0
+#endif
+/// @brief Flag added to the events of every peer socket
+#define PEER_EVENT_TRIGGER (PEER_EDGE_TRIGGERED ? EPOLLET : 0)
+
+/// @brief Milliseconds a connection attempt may take
+#define PEER_CONNECT_TIMEOUT_MS 10000
+/// @brief Milliseconds from connecting to receiving the peer's handshake
+#define PEER_HANDSHAKE_TIMEOUT_MS 20000
+/// @brief Milliseconds a peer may keep requests pending without sending any block
+#define PEER_REQUEST_TIMEOUT_MS 60000
+/// @brief Milliseconds between keep-alives. Peers drop connections silent for two minutes
+#define PEER_KEEP_ALIVE_MS 90000
+/// @brief Milliseconds without receiving anything before a peer is closed
+#define PEER_IDLE_TIMEOUT_MS 180000
+/// @brief Milliseconds before a closed peer is connected to again
+#define PEER_RECONNECT_DELAY_MS 10000
+/// @brief Milliseconds between updates of the peer metrics
+#define PEER_STATS_INTERVAL_MS 1000
+
+/// @brief Timers each peer has in the torrent's timer wheel
+typedef enum {
+    PEER_TIMER_STATE, /**< Connect or handshake timeout while connecting, reconnect delay once closed */
+    PEER_TIMER_REQUEST, /**< Closes the peer if its requests go unanswered */
+    PEER_TIMER_KEEP_ALIVE, /**< Sends a keep-alive */
+    PEER_TIMER_IDLE, /**< Closes the peer if it stops sending anything */
+    PEER_TIMER_COUNT
+} PEER_TIMER;
+
+/// @brief Most reactor threads the peers of a torrent are spread over
+#define TORRENT_MAX_REACTORS 8
+/// @brief Most distinct peers handed over to a torrent's reactors. Later ones are ignored
+#define TORRENT_MAX_KNOWN_PEERS 4096
+
 /// @brief Amount of block requests to queue for each peer
 #define QUEUE_SIZE 5
+/// @brief Amount of block requests to queue for peers on the local network. QUEUE_SIZE blocks are drained faster
+/// than the next requests reach them at 10 Gbit/s, 32 cover round trips of up to 400 microseconds
+#define LOCAL_QUEUE_SIZE 32
+/// @brief Amount of block requests to queue for a given peer
+#define PEER_QUEUE_SIZE(peer) ((peer)->local ? LOCAL_QUEUE_SIZE : QUEUE_SIZE)
+
+/// @brief Bytes of the BITFIELD queued at a time, so sending it needs no buffer as big as it
+#define BITFIELD_CHUNK_SIZE 512
+
+/// @brief Pieces kept of the Allowed Fast set each peer sends, the rest are ignored
+#define ALLOWED_FAST_MAX 16
+
+/// @brief Pieces kept of the latest ones each peer suggests
+#define SUGGESTED_MAX 4
 
 /// @brief Size of state_t minus padding, and bitfield pointer
 #define STATE_T_CORE_SIZE 13
@@ -46,18 +115,21 @@ typedef struct {
 } state_t;
 
 
+/// @brief Announced to trackers. Reactors change downloaded and left atomically, so they're read atomically too
 typedef struct {
     uint32_t downloaded;
     uint32_t left;
     uint32_t uploaded;
     uint32_t event;
     uint32_t key;
+    uint16_t port; /**< Port peers can connect to, announced to trackers. 0 if not listening */
 } torrent_stats_t;
 
 /// @brief Represents peer data and state in a BitTorrent connection
 typedef struct {
     int socket; /**< Socket file descriptor for this peer connection */
-    int reception_target; /**< The amount of bytes this peer is expecting to receive */
+    int reception_target; /**< The amount of bytes this peer is expecting to receive into reception_cache.
+                           * While receiving messages, it's only set for one longer than INLINE_MESSAGE_MAX */
     int reception_pointer; /**< How many bytes were already red into reception_cache for this reception_target */
     bool am_choking; /**< Whether we are choking the peer */
     bool am_interested; /**< Whether we are interested in peer's pieces */
@@ -68,9 +140,62 @@ typedef struct {
     unsigned char reception_cache[MAX_TRANS_SIZE]; /**< Cache for storing read bytes before interpreting them
                                                     * TODO Maybe make this dynamic, to save on RAM
                                                     */
+    unsigned char recv_buffer[RECV_BUFFER_SIZE]; /**< Bytes read from the socket and not interpreted yet */
+    uint32_t recv_start; /**< Offset of the first byte in recv_buffer not interpreted yet */
+    uint32_t recv_end; /**< Offset right after the last byte read into recv_buffer */
+    uint64_t bytes_received; /**< Bytes ever read from the socket */
+    unsigned char *send_buffer; /**< Bytes waiting for the socket to be writable, in order */
+    uint32_t send_length; /**< Bytes waiting in send_buffer */
+    uint32_t send_capacity; /**< Bytes allocated for send_buffer */
+    uint32_t epoll_events; /**< Events the socket is registered for, so they're only changed when needed */
+    uint32_t timers[PEER_TIMER_COUNT]; /**< Ids of the peer's timers in the torrent's timer wheel, by PEER_TIMER */
+    uint64_t last_activity_ms; /**< Last time anything was received, from the timer wheel's cached clock */
+    uint64_t last_block_ms; /**< Last time a block was received, or requests started waiting for one */
     PEER_STATUS status; /**< Current status of the peer connection */
     time_t last_msg; /**< Timestamp of last message received from peer */
     struct sockaddr_in* address;
+    bool interest_sent; /**< Whether INTERESTED was already sent to the peer */
+    bool inbound; /**< Whether the peer connected to us, so it's never connected to again */
+    bool local; /**< Whether the peer is on the local network, so it's asked for more blocks and never over uTP */
+    bool utp; /**< Whether the connection runs over uTP, socket being our end of it in the uTP context */
+    bool utp_failed; /**< Whether the last uTP connection never got to the handshake, so TCP is used instead */
+    uint8_t ut_pex; /**< Id the peer wants for ut_pex messages, 0 if it doesn't exchange peers */
+    uint64_t pex_received_ms; /**< Last time a ut_pex message of the peer was taken into account, 0 if never */
+    uint32_t pending_amount; /**< Amount of requests sent to the peer and not answered yet */
+    uint32_t pending_blocks[LOCAL_QUEUE_SIZE]; /**< Global indices of the blocks requested from the peer */
+    bool fast; /**< Whether both sides support the Fast Extension */
+    bool v2; /**< Whether the peer understands HASH_REQUEST, so leaf hashes of v2 torrents are asked of it */
+    bool corrupt; /**< Whether the peer sent a block or hashes proven corrupt, so it's never connected to again */
+    uint32_t allowed_fast[ALLOWED_FAST_MAX]; /**< Pieces the peer lets us request while it chokes us */
+    uint8_t allowed_fast_amount; /**< Pieces in allowed_fast */
+    uint32_t suggested[SUGGESTED_MAX]; /**< Pieces the peer would rather be asked for, the oldest replaced first */
+    uint8_t suggested_amount; /**< Pieces in suggested */
 } peer_t;
 
+/// @brief A complete message taken out of a peer's receive buffers
+typedef struct {
+    bool handshake; /**< Whether this is the peer's handshake, whose HANDSHAKE_LEN bytes are the payload */
+    uint8_t id; /**< MESSAGE_ID, for anything but the handshake */
+    unsigned char *payload; /**< What follows the id. Only valid until the callback it's passed to returns */
+    uint32_t payload_length; /**< Bytes in payload */
+} peer_message_t;
+
+/**
+ * Called for each message received by receive_messages()
+ * @return false to stop receiving, which is required if the peer was closed
+ */
+typedef bool (*message_callback_t)(void *ctx, peer_t *peer, const peer_message_t *message);
+
+/// @brief All peers of a torrent. Grows as trackers return new peers
+typedef struct {
+    peer_t *peer_array; /**< Peers, indexed by the epoll_event.data.u32 of their socket */
+    uint32_t peer_amount; /**< Amount of peers in peer_array */
+    uint32_t peer_capacity; /**< Amount of allocated peers in peer_array */
+    int32_t epoll; /**< Epoll instance peer sockets are registered in */
+    struct utp_context_t *utp; /**< Connects to peers over uTP before trying TCP, nullptr to only use TCP */
+    const struct local_network_t *local_networks; /**< Networks of our interfaces, whose peers are local */
+    uint32_t local_network_amount; /**< Networks in local_networks */
+    LOG_CODE log_code; /**< Logging level */
+} swarm_t;
+
 #endif //BITTORRENT_CLIENT_DOWNLOADING_TYPES_H
\ No newline at end of file
@@ -0,0 +1,82 @@
+#include "event_loop.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+event_loop_t* loop_create(void) {
+    event_loop_t* loop = malloc(sizeof(event_loop_t));
+    if (!loop) return nullptr;
+    loop->epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll < 0) {
+        free(loop);
+        return nullptr;
+    }
+    loop->source_capacity = LOOP_INITIAL_SOURCES;
+    loop->sources = malloc(sizeof(loop_source_t) * loop->source_capacity);
+    for (uint32_t i = 0; i < loop->source_capacity; ++i) {
+        loop->sources[i].fd = -1;
+    }
+    return loop;
+}
+
+void loop_free(event_loop_t* loop) {
+    if (loop == nullptr) return;
+    close(loop->epoll);
+    free(loop->sources);
+    free(loop);
+}
+
+int32_t loop_add_source(event_loop_t* loop, const int32_t fd, const uint32_t events, const loop_callback_t callback, void* ctx) {
+    if (!loop || fd < 0 || !callback) return -1;
+
+    // Finding a free slot
+    uint32_t slot = 0;
+    while (slot < loop->source_capacity && loop->sources[slot].fd != -1) {
+        slot++;
+    }
+    // All slots taken, doubling them
+    if (slot == loop->source_capacity) {
+        loop_source_t* sources = realloc(loop->sources, sizeof(loop_source_t) * loop->source_capacity * 2);
+        if (!sources) return -1;
+        loop->sources = sources;
+        for (uint32_t i = loop->source_capacity; i < loop->source_capacity * 2; ++i) {
+            loop->sources[i].fd = -1;
+        }
+        loop->source_capacity *= 2;
+    }
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u32 = LOOP_SOURCE_TAG | slot;
+    if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, fd, &ev) < 0) return -1;
+
+    loop->sources[slot].fd = fd;
+    loop->sources[slot].callback = callback;
+    loop->sources[slot].ctx = ctx;
+    return (int32_t) slot;
+}
+
+int32_t loop_modify_source(const event_loop_t* loop, const int32_t slot, const uint32_t events) {
+    if (!loop || slot < 0 || (uint32_t) slot >= loop->source_capacity || loop->sources[slot].fd == -1) return -1;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u32 = LOOP_SOURCE_TAG | slot;
+    return epoll_ctl(loop->epoll, EPOLL_CTL_MOD, loop->sources[slot].fd, &ev);
+}
+
+void loop_remove_source(event_loop_t* loop, const int32_t slot) {
+    if (!loop || slot < 0 || (uint32_t) slot >= loop->source_capacity || loop->sources[slot].fd == -1) return;
+    epoll_ctl(loop->epoll, EPOLL_CTL_DEL, loop->sources[slot].fd, nullptr);
+    loop->sources[slot].fd = -1;
+}
+
+bool loop_dispatch(const event_loop_t* loop, const struct epoll_event* event) {
+    if ((event->data.u32 & LOOP_SOURCE_TAG) == 0) return false;
+
+    const uint32_t slot = event->data.u32 & ~LOOP_SOURCE_TAG;
+    // The source may have been removed by a callback earlier in the same batch of events
+    if (slot < loop->source_capacity && loop->sources[slot].fd != -1) {
+        loop->sources[slot].callback(loop->sources[slot].ctx, event->events);
+    }
+    return true;
+}
@@ -0,0 +1,87 @@
+#ifndef BITTORRENT_CLIENT_EVENT_LOOP_H
+#define BITTORRENT_CLIENT_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/// @brief Bit set in epoll_event.data.u32 for everything that isn't a peer socket. Peers use their plain index
+#define LOOP_SOURCE_TAG 0x80000000u
+/// @brief Initial amount of slots for non-peer sources
+#define LOOP_INITIAL_SOURCES 16
+
+/**
+ * Function called when a registered file descriptor is ready.
+ *
+ * @param ctx The context pointer given when the source was added.
+ * @param events The epoll events that fired (EPOLLIN, EPOLLOUT, EPOLLERR...).
+ */
+typedef void (*loop_callback_t)(void *ctx, uint32_t events);
+
+/// @brief A non-peer file descriptor watched by the event loop
+typedef struct {
+    int32_t fd; /**< Watched file descriptor, or -1 if the slot is free */
+    loop_callback_t callback; /**< Function called when fd is ready */
+    void *ctx; /**< Passed as is to callback */
+} loop_source_t;
+
+/// @brief The epoll instance of a torrent, shared by peer sockets and every other component (trackers, timers...)
+typedef struct {
+    int32_t epoll; /**< Epoll instance */
+    loop_source_t *sources; /**< Slots of non-peer sources, indexed by the lower bits of epoll_event.data.u32 */
+    uint32_t source_capacity; /**< Amount of allocated slots in sources */
+} event_loop_t;
+
+/**
+ * Creates an event loop with its own epoll instance.
+ *
+ * @return A pointer to the new loop, or nullptr if epoll couldn't be created.
+ */
+event_loop_t *loop_create(void);
+
+/**
+ * Closes the epoll instance and frees the loop. Registered file descriptors are not closed.
+ *
+ * @param loop The loop to free. If nullptr, nothing is done.
+ */
+void loop_free(event_loop_t *loop);
+
+/**
+ * Registers a file descriptor whose readiness is handled by a callback instead of the peer state machine.
+ *
+ * @param loop The event loop.
+ * @param fd The file descriptor to watch.
+ * @param events The epoll events to watch for.
+ * @param callback Function called with ctx when any of the events fire.
+ * @param ctx Context passed to callback.
+ * @return The slot of the source, needed to modify or remove it, or -1 on failure.
+ */
+int32_t loop_add_source(event_loop_t *loop, int32_t fd, uint32_t events, loop_callback_t callback, void *ctx);
+
+/**
+ * Changes the events watched for an already registered source.
+ *
+ * @param loop The event loop.
+ * @param slot The slot returned by loop_add_source().
+ * @param events The new set of epoll events.
+ * @return 0 on success, -1 on failure.
+ */
+int32_t loop_modify_source(const event_loop_t *loop, int32_t slot, uint32_t events);
+
+/**
+ * Stops watching a source and frees its slot. The file descriptor is not closed.
+ *
+ * @param loop The event loop.
+ * @param slot The slot returned by loop_add_source(). Negative slots are ignored.
+ */
+void loop_remove_source(event_loop_t *loop, int32_t slot);
+
+/**
+ * Runs the callback of the source an epoll event belongs to, if it belongs to one.
+ *
+ * @param loop The event loop.
+ * @param event An event returned by epoll_wait() on loop->epoll.
+ * @return true if the event was a non-peer source and has been handled, false if it belongs to a peer.
+ */
+bool loop_dispatch(const event_loop_t *loop, const struct epoll_event *event);
+
+#endif //BITTORRENT_CLIENT_EVENT_LOOP_H
@@ -2,11 +2,21 @@
 #include <string.h>
 #include <openssl/sha.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "file.h"
 
 #include "basic_bencode.h"
+#include "logger.h"
+#include "merkle.h"
 #include "parsing.h"
+#include "sha1.h"
+
+/// @brief Most nested directories of a v2 file tree
+#define FILE_TREE_MAX_DEPTH 64
 
 void free_announce_list(announce_list_ll* list) {
     while (list != nullptr) {
@@ -24,10 +34,307 @@ void sha1_to_hex(const unsigned char *sha1_bytes, char *hex_output) {
     hex_output[40] = '\0';  // Null-terminate the string
 }
 
+mapped_file_t* map_torrent_file(const char* path, const LOG_CODE log_code) {
+    if (!path) return nullptr;
+
+    const int32_t fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_printf(log_code, LOG_ERR, "Torrent file not found: %s\n", path);
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        log_printf(log_code, LOG_ERR, "Torrent file is empty or can't be read: %s\n", path);
+        close(fd);
+        return nullptr;
+    }
+
+    // One extra anonymous page is reserved after the file, so there's always a zero byte right after it,
+    // even when the file size is an exact multiple of the page size
+    const uint64_t length = st.st_size;
+    const uint64_t map_length = length + sysconf(_SC_PAGESIZE);
+    char* reserved = mmap(nullptr, map_length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) {
+        log_printf(log_code, LOG_ERR, "Couldn't reserve memory for torrent file: %s\n", path);
+        close(fd);
+        return nullptr;
+    }
+    // Replacing the beginning of the reservation with the file itself
+    const char* data = mmap(reserved, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_printf(log_code, LOG_ERR, "Couldn't map torrent file: %s\n", path);
+        munmap(reserved, map_length);
+        return nullptr;
+    }
+    // Pieces are hashed against in random order during the download
+    madvise(reserved, length, MADV_WILLNEED);
+
+    mapped_file_t* file = malloc(sizeof(mapped_file_t));
+    file->data = data;
+    file->length = length;
+    file->map_length = map_length;
+    log_printf(log_code, LOG_FULL, "Mapped %lu bytes from %s\n", length, path);
+    return file;
+}
+
+/**
+ * Reads the web seeds of a torrent out of its url-list, which may be a single URL or a list of them
+ * @return The URLs, nullptr if there are none
+ */
+static ll* read_url_list(const char* torrent, const char* limit) {
+    const char* value = find_bencode_key(torrent, limit, "url-list");
+    if (!value) return nullptr;
+    const bool list = *value == 'l';
+    if (list) value++;
+    ll* head = nullptr;
+    ll** tail = &head;
+    const char* url;
+    uint64_t length;
+    while (value < limit && *value != 'e' && read_bencode_string(value, limit, &url, &length)) {
+        // Empty entries, which some creators write for no web seed, are left out
+        if (length > 0) {
+            ll* node = calloc(1, sizeof(ll));
+            if (!node) break;
+            node->val = strndup(url, length);
+            *tail = node;
+            tail = &node->next;
+        }
+        if (!list || (value = skip_bencode_value(value, limit)) == nullptr) break;
+    }
+    return head;
+}
+
+/// @brief Path of the directory of a v2 file tree being read
+typedef struct {
+    const char* components[FILE_TREE_MAX_DEPTH]; /**< Names, not null terminated */
+    uint64_t lengths[FILE_TREE_MAX_DEPTH]; /**< Bytes of each name */
+    uint32_t depth; /**< Components in use */
+} tree_path_t;
+
+/**
+ * Appends a file of a v2 file tree to the layout, after a padding file if it doesn't start at a piece boundary
+ * @return false if it's malformed or memory ran out
+ */
+static bool add_tree_file(info_t* info, const tree_path_t* path, const char* entry, const char* limit,
+                          files_ll*** tail) {
+    int64_t length;
+    const char* value = find_bencode_key(entry, limit, "length");
+    if (!value || !read_bencode_int(value, limit, &length) || length < 0) return false;
+    const char* root = nullptr;
+    uint64_t root_length = 0;
+    // Empty files have no tree
+    if (length > 0 && (!(value = find_bencode_key(entry, limit, "pieces root")) ||
+                       !read_bencode_string(value, limit, &root, &root_length) || root_length != MERKLE_HASH_SIZE)) {
+        return false;
+    }
+
+    // Every file with data starts a piece of its own
+    const uint64_t misalignment = info->length % info->piece_length;
+    if (length > 0 && misalignment != 0) {
+        files_ll* padding = calloc(1, sizeof(files_ll));
+        if (!padding) return false;
+        padding->padding = true;
+        padding->length = info->piece_length - misalignment;
+        padding->byte_index = info->length;
+        padding->first_piece = info->length / info->piece_length;
+        info->length += padding->length;
+        **tail = padding;
+        *tail = &padding->next;
+    }
+    files_ll* file = calloc(1, sizeof(files_ll));
+    if (!file) return false;
+    **tail = file;
+    *tail = &file->next;
+    file->length = length;
+    file->byte_index = info->length;
+    file->first_piece = info->length / info->piece_length;
+    if (root) memcpy(file->pieces_root, root, MERKLE_HASH_SIZE);
+    info->length += length;
+    ll** component_tail = &file->path;
+    for (uint32_t i = 0; i < path->depth; ++i) {
+        ll* component = calloc(1, sizeof(ll));
+        if (!component) return false;
+        component->val = strndup(path->components[i], path->lengths[i]);
+        *component_tail = component;
+        component_tail = &component->next;
+        if (!component->val) return false;
+    }
+    return true;
+}
+
+/**
+ * Reads a directory of a v2 file tree, whose keys are names and whose values are directories, or files when they
+ * hold an empty key. Files are laid out in key order, which is the tree's
+ * @return false if it's malformed or memory ran out
+ */
+static bool read_file_tree(info_t* info, tree_path_t* path, const char* directory, const char* limit,
+                           files_ll*** tail) {
+    if (directory >= limit || *directory != 'd' || path->depth >= FILE_TREE_MAX_DEPTH) return false;
+    const char* current = directory + 1;
+    while (current < limit && *current != 'e') {
+        const char* name;
+        uint64_t name_length;
+        if (!read_bencode_string(current, limit, &name, &name_length)) return false;
+        const char* value = name + name_length;
+        if (value >= limit || *value != 'd') return false;
+        // Names that could escape the download directory are refused
+        if ((name_length == 1 && name[0] == '.') || (name_length == 2 && name[0] == '.' && name[1] == '.') ||
+            memchr(name, '/', name_length)) return false;
+        path->components[path->depth] = name;
+        path->lengths[path->depth] = name_length;
+        path->depth++;
+        const char* entry = name_length > 0 ? find_bencode_key(value, limit, "") : nullptr;
+        const bool read = entry ? add_tree_file(info, path, entry, limit, tail)
+                                : name_length > 0 && read_file_tree(info, path, value, limit, tail);
+        path->depth--;
+        if (!read) return false;
+        current = skip_bencode_value(value, limit);
+        if (!current) return false;
+    }
+    return current < limit;
+}
+
+/**
+ * Finds the piece layer of every file spanning more than a piece in the torrent's "piece layers", and checks that
+ * it leads to the file's root. Torrents built from magnet links have none, their hashes are asked of peers
+ * @return false if a piece layer is there but wrong
+ */
+static bool read_piece_layers(info_t* info, const char* torrent, const char* limit, const LOG_CODE log_code) {
+    const char* layers = find_bencode_key(torrent, limit, "piece layers");
+    const uint32_t piece_height = merkle_height(info->piece_length / MERKLE_BLOCK_SIZE);
+    for (files_ll* file = info->files; file && layers; file = file->next) {
+        if (file->padding || (uint64_t) file->length <= info->piece_length) continue;
+        // Keys are the roots themselves, which may hold any byte
+        const char* current = layers + 1;
+        const char* layer = nullptr;
+        uint64_t layer_length = 0;
+        while (current < limit && *current != 'e' && !layer) {
+            const char* key;
+            uint64_t key_length;
+            if (!read_bencode_string(current, limit, &key, &key_length)) return false;
+            const char* value = key + key_length;
+            if (key_length == MERKLE_HASH_SIZE && memcmp(key, file->pieces_root, MERKLE_HASH_SIZE) == 0) {
+                if (!read_bencode_string(value, limit, &layer, &layer_length)) return false;
+            } else if ((current = skip_bencode_value(value, limit)) == nullptr) return false;
+        }
+        if (!layer) continue;
+        const uint64_t pieces = ((uint64_t) file->length + info->piece_length - 1) / info->piece_length;
+        const uint32_t height = merkle_height(((uint64_t) file->length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE);
+        unsigned char root[MERKLE_HASH_SIZE];
+        if (layer_length != pieces * MERKLE_HASH_SIZE ||
+            !merkle_root((const unsigned char*) layer, pieces, piece_height, 1u << (height - piece_height), root) ||
+            memcmp(root, file->pieces_root, MERKLE_HASH_SIZE) != 0) {
+            log_printf(log_code, LOG_ERR, "Piece layer of a file doesn't match its root\n");
+            return false;
+        }
+        file->piece_layer = (const unsigned char*) layer;
+    }
+    return true;
+}
+
+/**
+ * Reads the info dictionary of a v2 or hybrid torrent (BEP 52) structurally: its file tree, with files aligned to
+ * pieces by padding, and the piece layers found in the rest of the torrent. Hybrid torrents keep their SHA1 pieces
+ * and lay out their v1 files the same way, but for padding after the last file, which is added back
+ * @return false if it's malformed
+ */
+static bool parse_info_v2(info_t* info, const char* info_start, const char* info_end, const char* torrent,
+                          const char* limit, const LOG_CODE log_code) {
+    const char* value;
+    const char* name;
+    uint64_t name_length;
+    if (!(value = find_bencode_key(info_start, info_end, "name")) ||
+        !read_bencode_string(value, info_end, &name, &name_length)) return false;
+    info->name = strndup(name, name_length);
+    int64_t piece_length;
+    // Pieces are whole subtrees of leaves
+    if (!(value = find_bencode_key(info_start, info_end, "piece length")) ||
+        !read_bencode_int(value, info_end, &piece_length) || piece_length < MERKLE_BLOCK_SIZE ||
+        piece_length > UINT32_MAX / 2 || (piece_length & (piece_length - 1)) != 0) {
+        log_printf(log_code, LOG_ERR, "Invalid piece length in v2 torrent\n");
+        return false;
+    }
+    info->piece_length = piece_length;
+    int64_t priv;
+    if ((value = find_bencode_key(info_start, info_end, "private")) && read_bencode_int(value, info_end, &priv)) {
+        info->priv = priv == 1;
+    }
+
+    tree_path_t path = {0};
+    files_ll** tail = &info->files;
+    if (!(value = find_bencode_key(info_start, info_end, "file tree")) ||
+        !read_file_tree(info, &path, value, info_end, &tail) || !info->files) {
+        log_printf(log_code, LOG_ERR, "Invalid file tree in v2 torrent\n");
+        return false;
+    }
+    // A single file is at the root of the tree, named after the torrent
+    const bool single = !info->files->next && !info->files->path->next;
+
+    // Hybrid torrents list their v1 files too, padding included
+    const char* pieces;
+    uint64_t pieces_length;
+    if ((value = find_bencode_key(info_start, info_end, "pieces")) != nullptr) {
+        if (!read_bencode_string(value, info_end, &pieces, &pieces_length) || pieces_length % 20 != 0) return false;
+        int64_t v1_length = 0;
+        const char* files = find_bencode_key(info_start, info_end, "files");
+        if (files && *files == 'l') {
+            for (const char* entry = files + 1; entry && entry < info_end && *entry != 'e';
+                 entry = skip_bencode_value(entry, info_end)) {
+                int64_t file_length;
+                if (*entry != 'd' || !(value = find_bencode_key(entry, info_end, "length")) ||
+                    !read_bencode_int(value, info_end, &file_length)) return false;
+                v1_length += file_length;
+            }
+        } else if (!(value = find_bencode_key(info_start, info_end, "length")) ||
+                   !read_bencode_int(value, info_end, &v1_length)) return false;
+        if (v1_length < info->length || (single && v1_length != info->length)) {
+            log_printf(log_code, LOG_ERR, "v1 and v2 files of hybrid torrent differ\n");
+            return false;
+        }
+        if (v1_length > info->length) {
+            files_ll* padding = calloc(1, sizeof(files_ll));
+            if (!padding) return false;
+            padding->padding = true;
+            padding->length = v1_length - info->length;
+            padding->byte_index = info->length;
+            padding->first_piece = info->length / info->piece_length;
+            info->length = v1_length;
+            *tail = padding;
+        }
+        info->pieces = (const unsigned char*) pieces;
+        info->piece_number = pieces_length / 20;
+        if (info->piece_number != (info->length + info->piece_length - 1) / info->piece_length) {
+            log_printf(log_code, LOG_ERR, "Wrong amount of pieces in hybrid torrent\n");
+            return false;
+        }
+    } else info->piece_number = (info->length + info->piece_length - 1) / info->piece_length;
+    if (info->piece_number == 0) return false;
+
+    info->piece_files = calloc(info->piece_number, sizeof(files_ll*));
+    if (!info->piece_files) return false;
+    for (files_ll* file = info->files; file; file = file->next) {
+        if (file->padding || file->length == 0) continue;
+        const uint64_t last = (file->byte_index + file->length - 1) / info->piece_length;
+        for (uint64_t piece = file->first_piece; piece <= last; ++piece) info->piece_files[piece] = file;
+    }
+    // Trailing empty files or padding don't leave pieces without a file
+    for (uint32_t piece = 0; piece < info->piece_number; ++piece) {
+        if (!info->piece_files[piece]) return false;
+    }
+    return read_piece_layers(info, torrent, limit, log_code);
+}
+
+void unmap_torrent_file(mapped_file_t* file) {
+    if (file == nullptr) return;
+    munmap((void*)file->data, file->map_length);
+    free(file);
+}
+
 metainfo_t* parse_metainfo(const char* bencoded_value, const uint64_t length, const LOG_CODE log_code) {
     // It MUST begin with 'd' and end with 'e'
     if (bencoded_value[0] == 'd' && bencoded_value[length-1] == 'e') {
-        metainfo_t* metainfo = malloc(sizeof(metainfo_t));
+        metainfo_t* metainfo = calloc(1, sizeof(metainfo_t));
         uint64_t start = 0;
         uint64_t* start_ptr = &start;
         // Reading announce
@@ -94,15 +401,27 @@ metainfo_t* parse_metainfo(const char* bencoded_value, const uint64_t length, co
         if (info_index != nullptr) {
             bool multiple;
             // Allocating space for info
-            metainfo->info = malloc(sizeof(info_t));
-            metainfo->info->length = 0;
+            metainfo->info = calloc(1, sizeof(info_t));
             // Position of "d"
             start = info_index-bencoded_value+4;
 
             const char* info_start = bencoded_value+start;
             metainfo->info->hash[20] = '\0';
-
-            if (bencoded_value[start+1] == '5') { // If multiple files
+            metainfo->info->meta_version = 1;
+            // Finding where the info dictionary ends, whatever keys it has
+            const char* info_end = skip_bencode_value(info_start, bencoded_value+length);
+            // Invalid file
+            if (info_end == nullptr) return nullptr;
+            const char* meta_version = find_bencode_key(info_start, info_end, "meta version");
+            int64_t version = 1;
+            if (meta_version && read_bencode_int(meta_version, info_end, &version) && version == 2) {
+                metainfo->info->meta_version = 2;
+                if (!parse_info_v2(metainfo->info, info_start, info_end, bencoded_value, bencoded_value+length,
+                                   log_code)) {
+                    free_metainfo(metainfo);
+                    return nullptr;
+                }
+            } else if (bencoded_value[start+1] == '5') { // If multiple files
                 multiple = true;
                 metainfo->info->files = read_info_files(bencoded_value+start, multiple, start_ptr, log_code);
                 // Adding up total torrent size
@@ -124,49 +443,54 @@ metainfo_t* parse_metainfo(const char* bencoded_value, const uint64_t length, co
             } else { // If single file
                 multiple = false;
                 metainfo->info->files = read_info_files(bencoded_value+start, multiple, start_ptr, log_code);
+                if (metainfo->info->files == nullptr) return nullptr;
                 metainfo->info->length = metainfo->info->files->length;
                 // Skipping md5sum
             }
 
-            // Reading piece length
-            info_index = strstr(bencoded_value+start, "piece length");
-            if ( info_index != nullptr) {
-                start = info_index-bencoded_value + 12 + 1;
-                metainfo->info->piece_length = decode_bencode_int(bencoded_value+start, nullptr, log_code);
-            } else return nullptr;
-
-            // Reading pieces
-            if ( (info_index = strstr(bencoded_value+start, "pieces")) != nullptr ) {
-                start = info_index-bencoded_value + 6;
-                const int32_t amount = (int32_t) decode_bencode_int(bencoded_value+start, nullptr, log_code);
-                start = strchr(bencoded_value+start, ':') - bencoded_value + 1;
-                // 20 is the size of each piece's SHA1 hash
-                metainfo->info->piece_number = amount / 20;
-                metainfo->info->pieces = malloc(sizeof(char)*(amount+1));
-                memcpy(metainfo->info->pieces, bencoded_value+start, amount);
-                metainfo->info->pieces[amount] = '\0';
-                start+=amount;
-            } else return nullptr;
-
-            // Skipping private
-            if ( (info_index = strstr(bencoded_value+start, "7:private")) != nullptr) {
-                info_index = strchr(bencoded_value+start+9, 'e');
-                // Invalid file
-                if (info_index == nullptr) return nullptr;
+            if (metainfo->info->meta_version == 1) {
+                // Reading piece length
+                info_index = strstr(bencoded_value+start, "piece length");
+                if ( info_index != nullptr) {
+                    start = info_index-bencoded_value + 12 + 1;
+                    metainfo->info->piece_length = decode_bencode_int(bencoded_value+start, nullptr, log_code);
+                } else return nullptr;
+
+                // Reading pieces
+                if ( (info_index = strstr(bencoded_value+start, "pieces")) != nullptr ) {
+                    start = info_index-bencoded_value + 6;
+                    const int32_t amount = (int32_t) decode_bencode_int(bencoded_value+start, nullptr, log_code);
+                    start = strchr(bencoded_value+start, ':') - bencoded_value + 1;
+                    // 20 is the size of each piece's SHA1 hash
+                    metainfo->info->piece_number = amount / 20;
+                    // Pointing into the buffer instead of copying, hashes are never modified
+                    metainfo->info->pieces = (const unsigned char*) bencoded_value+start;
+                    start+=amount;
+                } else return nullptr;
+
+                // Skipping private
+                if ( (info_index = strstr(bencoded_value+start, "7:private")) != nullptr) {
+                    metainfo->info->priv = decode_bencode_int(info_index+10, nullptr, log_code) == 1;
+                }
             }
-            // The character that info_index points to is the end of the integer of private, next character must be the
-            // 'e' of the end of the info dictionary
-            info_index++;
 
-            // Creates the SHA1 hash from info data and then copies it into metainfo.info.hash
-            memcpy(metainfo->info->hash,
-                SHA1( (unsigned char*)info_start,info_index-info_start+1, nullptr ),
-                20);
+            metainfo->info->info_dict = info_start;
+            metainfo->info->info_dict_length = info_end-info_start;
+
+            // Creates the SHA1 hash from info data straight into metainfo.info.hash
+            sha1_hash((const unsigned char*)info_start, metainfo->info->info_dict_length, metainfo->info->hash);
+            if (metainfo->info->meta_version == 2) {
+                SHA256((const unsigned char*)info_start, metainfo->info->info_dict_length, metainfo->info->hash_v2);
+                // v2 only torrents are known by their SHA-256 hash, truncated wherever 20 bytes are expected
+                if (!metainfo->info->pieces) memcpy(metainfo->info->hash, metainfo->info->hash_v2, 20);
+            }
 
             //Creating human-readable hash
             sha1_to_hex(metainfo->info->hash, metainfo->info->human_hash);
         } else return nullptr;
 
+        metainfo->url_list = read_url_list(bencoded_value, bencoded_value+length);
+
         return metainfo;
     }
     return nullptr;
@@ -188,12 +512,34 @@ void free_metainfo(metainfo_t* metainfo) {
         if (metainfo->comment != nullptr) free(metainfo->comment);
         if (metainfo->created_by != nullptr) free(metainfo->created_by);
         if (metainfo->encoding != nullptr) free(metainfo->encoding);
+        free_bencode_list(metainfo->url_list);
         if (metainfo->info != nullptr) {
             free_info_files_list(metainfo->info->files);
+            free(metainfo->info->piece_files);
             if (metainfo->info->name != nullptr) free(metainfo->info->name);
-            if (metainfo->info->pieces != nullptr) free(metainfo->info->pieces);
             free(metainfo->info);
         }
         free(metainfo);
     }
-}
\ No newline at end of file
+}
+
+uint32_t piece_size(const info_t* info, const uint32_t piece_index) {
+    if (!info || piece_index >= info->piece_number) return 0;
+    const uint64_t offset = (uint64_t) piece_index * info->piece_length;
+    uint64_t end = info->length;
+    // Pieces of v2 only torrents don't cover the padding after a file
+    if (!info->pieces && info->piece_files) {
+        end = info->piece_files[piece_index]->byte_index + info->piece_files[piece_index]->length;
+    }
+    return end - offset < info->piece_length ? end - offset : info->piece_length;
+}
+
+uint64_t download_length(const info_t* info) {
+    if (!info) return 0;
+    if (info->pieces || !info->piece_files) return info->length;
+    uint64_t length = 0;
+    for (const files_ll* file = info->files; file; file = file->next) {
+        if (!file->padding) length += file->length;
+    }
+    return length;
+}
@@ -17,6 +17,12 @@ typedef struct files_ll {
     ll *path; /**< Linked list containing the file path components. Does not contain the slash */
     int64_t byte_index; /**< Byte index of the file in the entire torrent */
     FILE* file_ptr; /**< Pointer to file if it's open */
+    bool padding; /**< Whether it's padding aligning the next file to a piece, never written nor read from disk */
+    uint32_t first_piece; /**< Index of the piece the file starts in */
+    unsigned char pieces_root[32]; /**< Root of the file's SHA-256 merkle tree, in v2 torrents (BEP 52) */
+    const unsigned char *piece_layer; /**< Hashes of the merkle tree layer whose nodes cover a piece each, 32 bytes
+                                       * each. A view into the torrent's "piece layers", nullptr if the file fits in
+                                       * a piece or they aren't known, as in torrents built from magnet links */
 } files_ll;
 
 /**
@@ -42,10 +48,18 @@ typedef struct {
     char *name; /**< Name of the torrent (single file) or directory name (multiple files) */
     uint32_t piece_length; /**< Size of each piece in bytes */
     uint32_t piece_number; /**< Total number of pieces */
-    unsigned char *pieces; /**< String containing SHA1 hashes of all pieces concatenated */
+    const unsigned char *pieces; /**< SHA1 hashes of all pieces concatenated. View into the buffer given to
+                                  * parse_metainfo(), not a copy, so it's only valid while that buffer is.
+                                  * nullptr in v2 only torrents, whose pieces are checked with merkle trees */
+    const char *info_dict; /**< Raw bencoded info dictionary, exactly the bytes hashed into hash. Also a view */
+    uint64_t info_dict_length; /**< Length in bytes of info_dict */
     bool priv; /**< Whether the torrent is private (true) or public (false) */
-    unsigned char hash[21]; /**< 20-byte SHA1 hash of the info dictionary */
+    unsigned char hash[21]; /**< 20-byte SHA1 hash of the info dictionary, the SHA-256 one truncated in v2 only
+                             * torrents, as used in handshakes, trackers and the DHT */
     char human_hash[41]; /**< 40-character hex string representation of info hash */
+    uint8_t meta_version; /**< 2 for v2 and hybrid torrents (BEP 52), 1 otherwise */
+    unsigned char hash_v2[32]; /**< SHA-256 hash of the info dictionary, in v2 and hybrid torrents */
+    files_ll **piece_files; /**< File each piece starts in, in v2 and hybrid torrents. nullptr otherwise */
 } info_t;
 
 /**
@@ -62,8 +76,46 @@ typedef struct {
     uint32_t creation_date; /**< Unix timestamp when the torrent was created */
     char *encoding; /**< Optional string specifying character encoding of strings in the torrent */
     info_t *info; /**< Pointer to structure containing core torrent content information */
+    ll *url_list; /**< Web seeds (BEP 19) serving the torrent's files over HTTP or FTP, nullptr if there are none */
 } metainfo_t;
 
+/**
+ * @brief Read-only memory mapping of a .torrent file.
+ * The mapping is always followed by at least one zero byte, so the contents can be
+ * handed to the parser as if they were a null-terminated string.
+ *
+ * @struct mapped_file_t
+ */
+typedef struct {
+    const char *data; /**< Start of the file contents */
+    uint64_t length; /**< Length of the file in bytes */
+    uint64_t map_length; /**< Length of the whole mapping, including the zeroed trailing page */
+} mapped_file_t;
+
+/**
+ * @brief Maps a .torrent file into memory, read-only.
+ *
+ * The pages are backed by the page cache, so nothing is copied into the process and
+ * several clients loading the same file share the same physical memory.
+ *
+ * @param path Path to the .torrent file.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to a dynamically allocated `mapped_file_t`, or nullptr if the file can't be
+ *         opened, is empty or can't be mapped. Must be released with unmap_torrent_file().
+ */
+mapped_file_t *map_torrent_file(const char *path, LOG_CODE log_code);
+
+/**
+ * @brief Releases a mapping created by map_torrent_file().
+ *
+ * Any `metainfo_t` parsed from the mapping holds views into it, so it must be freed first.
+ *
+ * @param file The mapping to release. If `nullptr`, nothing is done.
+ */
+void unmap_torrent_file(mapped_file_t *file);
+
 /**
  * @brief Frees the memory associated with the given announce list.
  *
@@ -89,6 +141,8 @@ void sha1_to_hex(const unsigned char *sha1_bytes, char *hex_output);
  * @param bencoded_value A pointer to the bencoded string containing the torrent metainfo.
  *                       The string must adhere to the bencode format and represent
  *                       the metainfo structure of a torrent file.
+ *                       info.pieces and info.info_dict point into this buffer, so it must
+ *                       outlive the returned structure.
  * @param length The length of the bencoded string in bytes.
  *               Must be accurate to avoid memory violations.
  * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
@@ -118,4 +172,23 @@ void free_info_files_list(files_ll *list);
  *                 If `metainfo` or its members are `nullptr`, they will be safely ignored.
  */
 void free_metainfo(metainfo_t *metainfo);
+
+/**
+ * @brief Size in bytes of a piece. Every piece has piece_length bytes but the last one, and in v2 only torrents
+ * those ending a file, which stop at its end.
+ *
+ * @param info Info of the torrent.
+ * @param piece_index Index of the piece.
+ * @return The size, 0 if there's no such piece.
+ */
+uint32_t piece_size(const info_t *info, uint32_t piece_index);
+
+/**
+ * @brief Bytes of the torrent that are downloaded: the total length, less the padding between files of v2 only
+ * torrents, which no piece covers.
+ *
+ * @param info Info of the torrent.
+ * @return The amount of bytes.
+ */
+uint64_t download_length(const info_t *info);
 #endif //FILE_H
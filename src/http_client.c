@@ -0,0 +1,274 @@
+#include "http_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "logger.h"
+
+/// @brief A socket curl asked to watch
+typedef struct {
+    http_client_t *client;
+    curl_socket_t fd;
+    int32_t slot;
+} http_socket_t;
+
+static size_t write_body(const char* data, const size_t size, const size_t nmemb, void* userp) {
+    http_request_t* request = userp;
+    const size_t bytes = size * nmemb;
+    if (request->length + bytes > request->max_length) return 0;
+    if (request->length + bytes > request->capacity) {
+        uint64_t capacity = request->capacity > 0 ? request->capacity : 1024;
+        while (capacity < request->length + bytes) capacity *= 2;
+        char* body = realloc(request->body, capacity);
+        // Returning less than bytes aborts the transfer
+        if (!body) return 0;
+        request->body = body;
+        request->capacity = capacity;
+    }
+    memcpy(request->body + request->length, data, bytes);
+    request->length += bytes;
+    return bytes;
+}
+
+static void unlink_request(http_request_t* request) {
+    if (request->prev) request->prev->next = request->next;
+    else request->client->requests = request->next;
+    if (request->next) request->next->prev = request->prev;
+}
+
+static void free_request(http_request_t* request) {
+    curl_multi_remove_handle(request->client->multi, request->easy);
+    curl_easy_cleanup(request->easy);
+    if (!request->borrowed) free(request->body);
+    free(request);
+}
+
+/**
+ * Hands every finished transfer to its callback
+ */
+static void check_finished(http_client_t* client) {
+    CURLMsg* message;
+    int32_t pending;
+    while ((message = curl_multi_info_read(client->multi, &pending)) != nullptr) {
+        if (message->msg != CURLMSG_DONE) continue;
+        http_request_t* request;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char**) &request);
+        long status = 0;
+        if (message->data.result == CURLE_OK) {
+            curl_easy_getinfo(request->easy, CURLINFO_RESPONSE_CODE, &status);
+        } else if (LOG_ENABLED(client->log_code, LOG_ERR)) {
+            log_write(LOG_ERR, "HTTP request failed: %s\n", curl_easy_strerror(message->data.result));
+        }
+        unlink_request(request);
+        if (request->callback) {
+            // body stays null until curl writes something, as with an empty 200
+            const bool has_body = status != 0 && request->body != nullptr;
+            request->callback(request->ctx, status, has_body ? request->body : "", has_body ? request->length : 0);
+        }
+        free_request(request);
+    }
+}
+
+static void socket_ready(void* ctx, const uint32_t events) {
+    const http_socket_t* http_socket = ctx;
+    // Copied, since curl may ask to stop watching this socket, freeing http_socket
+    http_client_t* client = http_socket->client;
+    const curl_socket_t fd = http_socket->fd;
+    int32_t action = 0;
+    if (events & EPOLLIN) action |= CURL_CSELECT_IN;
+    if (events & EPOLLOUT) action |= CURL_CSELECT_OUT;
+    if (events & (EPOLLERR | EPOLLHUP)) action |= CURL_CSELECT_ERR;
+    curl_multi_socket_action(client->multi, fd, action, &client->running);
+    check_finished(client);
+}
+
+static void timer_expired(void* ctx, const uint32_t events) {
+    (void) events;
+    http_client_t* client = ctx;
+    uint64_t expirations;
+    if (read(client->timer_fd, &expirations, sizeof(expirations)) < 0) {
+        // Already read, or disarmed in between
+    }
+    curl_multi_socket_action(client->multi, CURL_SOCKET_TIMEOUT, 0, &client->running);
+    check_finished(client);
+}
+
+/**
+ * Called by curl whenever the events it wants from a socket change
+ */
+static int socket_callback(CURL* easy, const curl_socket_t fd, const int what, void* userp, void* socketp) {
+    (void) easy;
+    http_client_t* client = userp;
+    http_socket_t* http_socket = socketp;
+
+    if (what == CURL_POLL_REMOVE) {
+        if (http_socket) {
+            loop_remove_source(client->loop, http_socket->slot);
+            free(http_socket);
+            curl_multi_assign(client->multi, fd, nullptr);
+        }
+        return 0;
+    }
+
+    uint32_t events = 0;
+    if (what == CURL_POLL_IN || what == CURL_POLL_INOUT) events |= EPOLLIN;
+    if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT) events |= EPOLLOUT;
+    if (http_socket) {
+        loop_modify_source(client->loop, http_socket->slot, events);
+        return 0;
+    }
+    http_socket = malloc(sizeof(http_socket_t));
+    if (!http_socket) return -1;
+    http_socket->client = client;
+    http_socket->fd = fd;
+    http_socket->slot = loop_add_source(client->loop, fd, events, socket_ready, http_socket);
+    if (http_socket->slot < 0) {
+        free(http_socket);
+        return -1;
+    }
+    curl_multi_assign(client->multi, fd, http_socket);
+    return 0;
+}
+
+/**
+ * Called by curl whenever it wants to be woken up after some time
+ */
+static int timer_callback(CURLM* multi, const long timeout_ms, void* userp) {
+    (void) multi;
+    const http_client_t* client = userp;
+    struct itimerspec spec = {0};
+    if (timeout_ms == 0) {
+        // As soon as possible, but not from inside this callback
+        spec.it_value.tv_nsec = 1;
+    } else if (timeout_ms > 0) {
+        spec.it_value.tv_sec = timeout_ms / 1000;
+        spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+    }
+    // A timeout of -1 disarms the timer
+    return timerfd_settime(client->timer_fd, 0, &spec, nullptr) < 0 ? -1 : 0;
+}
+
+http_client_t* http_client_create(event_loop_t* loop, const LOG_CODE log_code) {
+    if (!loop) return nullptr;
+    http_client_t* client = calloc(1, sizeof(http_client_t));
+    if (!client) return nullptr;
+    client->loop = loop;
+    client->log_code = log_code;
+    client->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    client->multi = curl_multi_init();
+    if (client->timer_fd < 0 || !client->multi) {
+        if (client->timer_fd >= 0) close(client->timer_fd);
+        if (client->multi) curl_multi_cleanup(client->multi);
+        free(client);
+        return nullptr;
+    }
+    client->timer_slot = loop_add_source(loop, client->timer_fd, EPOLLIN, timer_expired, client);
+
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(client->multi, CURLMOPT_SOCKETDATA, client);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(client->multi, CURLMOPT_TIMERDATA, client);
+    return client;
+}
+
+void http_client_free(http_client_t* client) {
+    if (client == nullptr) return;
+    // Failed like a transfer error, so callbacks get to free their context
+    while (client->requests != nullptr) {
+        http_request_t* request = client->requests;
+        unlink_request(request);
+        if (request->callback) request->callback(request->ctx, 0, "", 0);
+        free_request(request);
+    }
+    // Removing the last handles already made curl release its sockets
+    curl_multi_cleanup(client->multi);
+    loop_remove_source(client->loop, client->timer_slot);
+    close(client->timer_fd);
+    free(client);
+}
+
+/**
+ * Creates a GET request with the options every request shares, not started yet
+ * @return The request, or nullptr if it couldn't be allocated
+ */
+static http_request_t* create_request(http_client_t* client, const char* url, const http_callback_t callback,
+                                      void* ctx) {
+    http_request_t* request = calloc(1, sizeof(http_request_t));
+    if (!request) return nullptr;
+    request->easy = curl_easy_init();
+    if (!request->easy) {
+        free(request);
+        return nullptr;
+    }
+    request->client = client;
+    request->callback = callback;
+    request->ctx = ctx;
+    request->max_length = HTTP_MAX_BODY;
+
+    curl_easy_setopt(request->easy, CURLOPT_URL, url);
+    curl_easy_setopt(request->easy, CURLOPT_WRITEFUNCTION, write_body);
+    curl_easy_setopt(request->easy, CURLOPT_WRITEDATA, request);
+    curl_easy_setopt(request->easy, CURLOPT_PRIVATE, request);
+    curl_easy_setopt(request->easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(request->easy, CURLOPT_MAXREDIRS, 5L);
+    curl_easy_setopt(request->easy, CURLOPT_TIMEOUT, (long) HTTP_TIMEOUT);
+    curl_easy_setopt(request->easy, CURLOPT_CONNECTTIMEOUT, (long) HTTP_CONNECT_TIMEOUT);
+    curl_easy_setopt(request->easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(request->easy, CURLOPT_USERAGENT, CLIENT_ID);
+    return request;
+}
+
+/**
+ * Starts running a request created by create_request(), freeing it if it can't
+ * @return The request, or nullptr if it couldn't be started
+ */
+static http_request_t* start_request(http_client_t* client, http_request_t* request, const char* url) {
+    if (curl_multi_add_handle(client->multi, request->easy) != CURLM_OK) {
+        curl_easy_cleanup(request->easy);
+        free(request);
+        return nullptr;
+    }
+    request->next = client->requests;
+    if (client->requests) client->requests->prev = request;
+    client->requests = request;
+    log_printf(client->log_code, LOG_FULL, "Started HTTP request to %s\n", url);
+    return request;
+}
+
+http_request_t* http_client_get(http_client_t* client, const char* url, const http_callback_t callback, void* ctx) {
+    if (!client || !url) return nullptr;
+    http_request_t* request = create_request(client, url, callback, ctx);
+    if (!request) return nullptr;
+    // Any encoding curl supports
+    curl_easy_setopt(request->easy, CURLOPT_ACCEPT_ENCODING, "");
+    return start_request(client, request, url);
+}
+
+http_request_t* http_client_get_range(http_client_t* client, const char* url, const uint64_t offset,
+                                      const uint64_t length, char* buffer, const http_callback_t callback, void* ctx) {
+    if (!client || !url || !buffer || length == 0) return nullptr;
+    http_request_t* request = create_request(client, url, callback, ctx);
+    if (!request) return nullptr;
+    request->body = buffer;
+    request->capacity = length;
+    request->max_length = length;
+    request->borrowed = true;
+    char range[48];
+    snprintf(range, sizeof(range), "%lu-%lu", (unsigned long) offset, (unsigned long) (offset + length - 1));
+    // Copied by curl. No Accept-Encoding, ranges of a compressed body wouldn't be the bytes asked for
+    curl_easy_setopt(request->easy, CURLOPT_RANGE, range);
+    // Big ranges take as long as they take, as long as they keep moving
+    curl_easy_setopt(request->easy, CURLOPT_TIMEOUT, 0L);
+    curl_easy_setopt(request->easy, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+    curl_easy_setopt(request->easy, CURLOPT_LOW_SPEED_TIME, (long) HTTP_TIMEOUT);
+    return start_request(client, request, url);
+}
+
+void http_client_cancel(http_request_t* request) {
+    if (request == nullptr) return;
+    unlink_request(request);
+    free_request(request);
+}
@@ -0,0 +1,111 @@
+#ifndef BITTORRENT_CLIENT_HTTP_CLIENT_H
+#define BITTORRENT_CLIENT_HTTP_CLIENT_H
+
+#include <curl/curl.h>
+
+#include "event_loop.h"
+#include "util.h"
+
+/// @brief Seconds a whole HTTP request may take, including redirects
+#define HTTP_TIMEOUT 30
+/// @brief Seconds connecting to an HTTP server may take
+#define HTTP_CONNECT_TIMEOUT 15
+/// @brief Seconds requests still in flight get to finish when a torrent stops
+#define HTTP_STOP_TIMEOUT 2
+/// @brief Largest response body accepted, in bytes. Longer transfers are aborted
+#define HTTP_MAX_BODY (4 * 1024 * 1024)
+
+/**
+ * Function called once an HTTP request is over, successfully or not.
+ *
+ * @param ctx The context pointer given to http_client_get().
+ * @param status The HTTP status code, or 0 if the transfer itself failed (timeout, DNS, connection...).
+ * @param body The response body. Only valid during the call. Never null, empty if status is 0.
+ * @param length Length of body in bytes.
+ */
+typedef void (*http_callback_t)(void *ctx, long status, const char *body, uint64_t length);
+
+struct http_client_t;
+
+/// @brief An HTTP request in flight
+typedef struct http_request_t {
+    struct http_client_t *client; /**< Client the request belongs to */
+    CURL *easy; /**< Curl handle of the transfer */
+    char *body; /**< Response body received so far */
+    uint64_t length; /**< Length of body in bytes */
+    uint64_t capacity; /**< Allocated bytes in body */
+    uint64_t max_length; /**< Longest body accepted. Longer transfers are aborted */
+    bool borrowed; /**< Whether body is the caller's buffer, written in place and never grown or freed */
+    http_callback_t callback; /**< Function called when the transfer is over, or nullptr */
+    void *ctx; /**< Passed as is to callback */
+    struct http_request_t *prev; /**< Previous request in flight */
+    struct http_request_t *next; /**< Next request in flight */
+} http_request_t;
+
+/// @brief Runs HTTP transfers with curl_multi, driven by the event loop instead of blocking in curl_multi_perform()
+typedef struct http_client_t {
+    event_loop_t *loop; /**< Loop curl's sockets and the timer are registered in */
+    CURLM *multi; /**< Curl multi handle */
+    int32_t timer_fd; /**< Timerfd armed with the timeout curl asks for */
+    int32_t timer_slot; /**< Slot of timer_fd in the loop */
+    int32_t running; /**< Transfers still running, as reported by curl */
+    http_request_t *requests; /**< Requests in flight */
+    LOG_CODE log_code; /**< Logging level */
+} http_client_t;
+
+/**
+ * Creates an HTTP client whose transfers run from the event loop.
+ * curl_global_init() must have been called before.
+ *
+ * @param loop The event loop.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to the client, or nullptr on failure.
+ */
+http_client_t *http_client_create(event_loop_t *loop, LOG_CODE log_code);
+
+/**
+ * Aborts every request in flight and frees the client. Their callbacks are called with status 0,
+ * and must not start new requests.
+ *
+ * @param client The client to free. If nullptr, nothing is done.
+ */
+void http_client_free(http_client_t *client);
+
+/**
+ * Starts a GET request. Nothing blocks: the transfer advances as its socket becomes ready.
+ *
+ * @param client The client.
+ * @param url The URL to get.
+ * @param callback Called once when the request is over, or nullptr to ignore the response.
+ * @param ctx Passed as is to callback.
+ * @return The request, needed only to cancel it, or nullptr if it couldn't be started.
+ */
+http_request_t *http_client_get(http_client_t *client, const char *url, http_callback_t callback, void *ctx);
+
+/**
+ * Starts a GET request for a byte range, written straight into the caller's buffer. Nothing blocks, and there is no
+ * limit on how long the whole transfer takes, only on how long it may stall. Servers that ignore the range and send
+ * more than length bytes fail the request.
+ *
+ * @param client The client.
+ * @param url The URL to get, over HTTP(S) or FTP.
+ * @param offset First byte of the range.
+ * @param length Bytes of the range, at least 1.
+ * @param buffer Where the body is written, at least length bytes. Must outlive the request.
+ * @param callback Called once when the request is over, with buffer as body, or nullptr to ignore the response.
+ * @param ctx Passed as is to callback.
+ * @return The request, needed only to cancel it, or nullptr if it couldn't be started.
+ */
+http_request_t *http_client_get_range(http_client_t *client, const char *url, uint64_t offset, uint64_t length,
+                                      char *buffer, http_callback_t callback, void *ctx);
+
+/**
+ * Aborts a request in flight. Its callback won't be called.
+ *
+ * @param request The request returned by http_client_get(). If nullptr, nothing is done.
+ */
+void http_client_cancel(http_request_t *request);
+
+#endif //BITTORRENT_CLIENT_HTTP_CLIENT_H
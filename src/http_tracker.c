@@ -0,0 +1,268 @@
+#include "http_tracker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "announcer.h"
+#include "basic_bencode.h"
+
+/// @brief An asynchronous scrape waiting for its response
+typedef struct {
+    unsigned char *info_hashes; /**< Copy of the info hashes asked about */
+    uint32_t torrent_amount; /**< Amount of info hashes */
+    http_scrape_callback_t callback; /**< Function called with the result */
+    void *ctx; /**< Passed as is to callback */
+} http_scrape_t;
+
+static bool is_unreserved(const unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+uint32_t url_encode_bytes(const unsigned char* data, const uint32_t length, char* out) {
+    static const char hex[] = "0123456789ABCDEF";
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < length; ++i) {
+        if (is_unreserved(data[i])) {
+            out[written++] = (char) data[i];
+        } else {
+            out[written++] = '%';
+            out[written++] = hex[data[i] >> 4];
+            out[written++] = hex[data[i] & 0x0F];
+        }
+    }
+    out[written] = '\0';
+    return written;
+}
+
+static const char* event_name(const ANNOUNCE_EVENT event) {
+    switch (event) {
+        case ANNOUNCE_EVENT_STARTED: return "started";
+        case ANNOUNCE_EVENT_STOPPED: return "stopped";
+        case ANNOUNCE_EVENT_COMPLETED: return "completed";
+        default: return nullptr;
+    }
+}
+
+char* build_http_announce_url(const char* announce_url, const unsigned char* info_hash, const unsigned char* peer_id,
+                              const torrent_stats_t* torrent_stats, const uint16_t port, const ANNOUNCE_EVENT event) {
+    if (!announce_url || !info_hash || !peer_id || !torrent_stats) return nullptr;
+
+    char encoded_hash[20*3+1];
+    char encoded_id[20*3+1];
+    url_encode_bytes(info_hash, 20, encoded_hash);
+    url_encode_bytes(peer_id, 20, encoded_id);
+    const char* event_string = event_name(event);
+    // Trackers with a passkey already have a query
+    const char separator = strchr(announce_url, '?') ? '&' : '?';
+
+    // Reactors may be updating them meanwhile
+    const uint32_t downloaded = __atomic_load_n(&torrent_stats->downloaded, __ATOMIC_RELAXED);
+    const uint32_t left = __atomic_load_n(&torrent_stats->left, __ATOMIC_RELAXED);
+    const uint32_t uploaded = __atomic_load_n(&torrent_stats->uploaded, __ATOMIC_RELAXED);
+    const char* format = "%s%cinfo_hash=%s&peer_id=%s&port=%u&uploaded=%u&downloaded=%u&left=%u"
+                         "&compact=1&numwant=%u&key=%08x%s%s";
+    const int length = snprintf(nullptr, 0, format, announce_url, separator, encoded_hash, encoded_id, port,
+                                uploaded, downloaded, left, HTTP_NUM_WANT,
+                                torrent_stats->key, event_string ? "&event=" : "", event_string ? event_string : "");
+    char* url = malloc(length+1);
+    if (!url) return nullptr;
+    snprintf(url, length+1, format, announce_url, separator, encoded_hash, encoded_id, port,
+             uploaded, downloaded, left, HTTP_NUM_WANT,
+             torrent_stats->key, event_string ? "&event=" : "", event_string ? event_string : "");
+    return url;
+}
+
+bool parse_http_announce(const char* body, const uint64_t length, http_announce_response_t* response) {
+    if (!body || !response) return false;
+    const char* limit = body + length;
+    memset(response, 0, sizeof(http_announce_response_t));
+    response->complete = -1;
+    response->incomplete = -1;
+    if (skip_bencode_value(body, limit) == nullptr || *body != 'd') return false;
+
+    const char* value = find_bencode_key(body, limit, "failure reason");
+    if (value) {
+        return read_bencode_string(value, limit, &response->failure_reason, &response->failure_reason_length);
+    }
+
+    value = find_bencode_key(body, limit, "interval");
+    if (value) read_bencode_int(value, limit, &response->interval);
+    value = find_bencode_key(body, limit, "min interval");
+    if (value) read_bencode_int(value, limit, &response->min_interval);
+    value = find_bencode_key(body, limit, "complete");
+    if (value) read_bencode_int(value, limit, &response->complete);
+    value = find_bencode_key(body, limit, "incomplete");
+    if (value) read_bencode_int(value, limit, &response->incomplete);
+
+    value = find_bencode_key(body, limit, "peers");
+    if (value) {
+        const char* string;
+        uint64_t string_length;
+        if (read_bencode_string(value, limit, &string, &string_length)) {
+            response->peers = (const unsigned char*) string;
+            response->peer_amount = string_length / COMPACT_PEER_V4_SIZE;
+        } else if (*value == 'l') {
+            // Non-compact answer, converted only if the caller wants it
+            response->peer_list = value;
+            response->peer_list_end = skip_bencode_value(value, limit);
+        }
+    }
+    value = find_bencode_key(body, limit, "peers6");
+    if (value) {
+        const char* string;
+        uint64_t string_length;
+        if (read_bencode_string(value, limit, &string, &string_length)) {
+            response->peers6 = (const unsigned char*) string;
+            response->peer6_amount = string_length / COMPACT_PEER_V6_SIZE;
+        }
+    }
+    return true;
+}
+
+uint32_t compact_peer_list(const char* peer_list, const char* limit, unsigned char* compact_peers,
+                           const uint32_t max_peers) {
+    if (!peer_list || !limit || !compact_peers || peer_list >= limit || *peer_list != 'l') return 0;
+    uint32_t written = 0;
+    const char* current = peer_list+1;
+    while (current < limit && *current != 'e' && written < max_peers) {
+        const char* next = skip_bencode_value(current, limit);
+        if (!next) break;
+        if (*current == 'd') {
+            const char* ip;
+            uint64_t ip_length;
+            int64_t port;
+            const char* ip_value = find_bencode_key(current, next, "ip");
+            const char* port_value = find_bencode_key(current, next, "port");
+            // Long enough for any dotted IPv4 address
+            char ip_string[16];
+            struct in_addr addr;
+            if (read_bencode_string(ip_value, next, &ip, &ip_length) && ip_length < sizeof(ip_string) &&
+                read_bencode_int(port_value, next, &port) && port > 0 && port <= UINT16_MAX) {
+                memcpy(ip_string, ip, ip_length);
+                ip_string[ip_length] = '\0';
+                if (inet_pton(AF_INET, ip_string, &addr) == 1) {
+                    const uint16_t port_be = htons((uint16_t) port);
+                    unsigned char* peer = compact_peers + written*COMPACT_PEER_V4_SIZE;
+                    memcpy(peer, &addr.s_addr, 4);
+                    memcpy(peer+4, &port_be, 2);
+                    written++;
+                }
+            }
+        }
+        current = next;
+    }
+    return written;
+}
+
+char* build_http_scrape_url(const char* announce_url, const unsigned char* info_hashes, const uint32_t torrent_amount) {
+    if (!announce_url || !info_hashes || torrent_amount == 0) return nullptr;
+
+    const char* query = strchr(announce_url, '?');
+    const size_t path_length = query ? (size_t)(query - announce_url) : strlen(announce_url);
+    const char* last_slash = memrchr(announce_url, '/', path_length);
+    // BEP 48: only trackers whose last path component starts with "announce" support scraping
+    if (!last_slash || strncmp(last_slash+1, "announce", 8) != 0) return nullptr;
+
+    const size_t prefix_length = last_slash+1 - announce_url;
+    const char* rest = last_slash+1 + 8;
+    const size_t rest_length = strlen(rest);
+    // Each parameter is "&info_hash=" followed by up to 60 encoded bytes
+    const size_t max_length = prefix_length + 6 + rest_length + torrent_amount * (11 + 20*3) + 1;
+    char* url = malloc(max_length);
+    if (!url) return nullptr;
+
+    memcpy(url, announce_url, prefix_length);
+    size_t written = prefix_length;
+    memcpy(url+written, "scrape", 6);
+    written += 6;
+    memcpy(url+written, rest, rest_length);
+    written += rest_length;
+    char separator = query ? '&' : '?';
+    for (uint32_t i = 0; i < torrent_amount; ++i) {
+        written += sprintf(url+written, "%cinfo_hash=", separator);
+        written += url_encode_bytes(info_hashes + i*20, 20, url+written);
+        separator = '&';
+    }
+    url[written] = '\0';
+    return url;
+}
+
+bool parse_http_scrape(const char* body, const uint64_t length, const unsigned char* info_hashes,
+                       const uint32_t torrent_amount, scraped_data_t* scraped_data) {
+    if (!body || !info_hashes || !scraped_data) return false;
+    const char* limit = body + length;
+    memset(scraped_data, 0, torrent_amount * sizeof(scraped_data_t));
+    if (skip_bencode_value(body, limit) == nullptr || *body != 'd') return false;
+
+    const char* files = find_bencode_key(body, limit, "files");
+    if (!files || *files != 'd') return false;
+    const char* files_end = skip_bencode_value(files, limit);
+
+    // Keys of "files" are the raw 20-byte info hashes
+    const char* current = files+1;
+    while (current < files_end && *current != 'e') {
+        const char* hash;
+        uint64_t hash_length;
+        if (!read_bencode_string(current, files_end, &hash, &hash_length)) return false;
+        const char* value = hash + hash_length;
+        const char* next = skip_bencode_value(value, files_end);
+        if (!next) return false;
+        for (uint32_t i = 0; hash_length == 20 && i < torrent_amount; ++i) {
+            if (memcmp(hash, info_hashes + i*20, 20) != 0) continue;
+            int64_t number;
+            const char* field = find_bencode_key(value, next, "complete");
+            if (read_bencode_int(field, next, &number) && number >= 0) scraped_data[i].seeders = number;
+            field = find_bencode_key(value, next, "downloaded");
+            if (read_bencode_int(field, next, &number) && number >= 0) scraped_data[i].completed = number;
+            field = find_bencode_key(value, next, "incomplete");
+            if (read_bencode_int(field, next, &number) && number >= 0) scraped_data[i].leechers = number;
+        }
+        current = next;
+    }
+    return true;
+}
+
+static void scrape_finished(void* ctx, const long status, const char* body, const uint64_t length) {
+    http_scrape_t* scrape = ctx;
+    scraped_data_t* scraped_data = calloc(scrape->torrent_amount, sizeof(scraped_data_t));
+    if (scraped_data && status == 200 &&
+        parse_http_scrape(body, length, scrape->info_hashes, scrape->torrent_amount, scraped_data)) {
+        scrape->callback(scrape->ctx, scraped_data, scrape->torrent_amount);
+    } else scrape->callback(scrape->ctx, nullptr, scrape->torrent_amount);
+    free(scraped_data);
+    free(scrape->info_hashes);
+    free(scrape);
+}
+
+bool http_tracker_scrape(http_client_t* client, const char* announce_url, const unsigned char* info_hashes,
+                         const uint32_t torrent_amount, const http_scrape_callback_t callback, void* ctx) {
+    if (!client || !callback) return false;
+    char* url = build_http_scrape_url(announce_url, info_hashes, torrent_amount);
+    if (!url) return false;
+
+    http_scrape_t* scrape = malloc(sizeof(http_scrape_t));
+    unsigned char* hashes = malloc(torrent_amount * 20);
+    if (!scrape || !hashes) {
+        free(scrape);
+        free(hashes);
+        free(url);
+        return false;
+    }
+    memcpy(hashes, info_hashes, torrent_amount * 20);
+    scrape->info_hashes = hashes;
+    scrape->torrent_amount = torrent_amount;
+    scrape->callback = callback;
+    scrape->ctx = ctx;
+
+    const http_request_t* request = http_client_get(client, url, scrape_finished, scrape);
+    free(url);
+    if (!request) {
+        free(hashes);
+        free(scrape);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,122 @@
+#ifndef BITTORRENT_CLIENT_HTTP_TRACKER_H
+#define BITTORRENT_CLIENT_HTTP_TRACKER_H
+
+#include "downloading_types.h"
+#include "http_client.h"
+#include "predownload_udp.h"
+
+/// @brief Port reported to HTTP trackers, which require one
+#define HTTP_ANNOUNCE_PORT 6881
+/// @brief Peers asked for on each HTTP announce
+#define HTTP_NUM_WANT 200
+
+/// @brief An HTTP tracker's announce response. Every pointer is a view into the response body, nothing is allocated
+typedef struct {
+    const char *failure_reason; /**< Human readable error, or nullptr if the announce succeeded */
+    uint64_t failure_reason_length; /**< Length of failure_reason */
+    int64_t interval; /**< Seconds to wait before re-announcing, or 0 if missing */
+    int64_t min_interval; /**< Minimum seconds between announces, or 0 if missing */
+    int64_t complete; /**< Amount of seeders, or -1 if missing */
+    int64_t incomplete; /**< Amount of leechers, or -1 if missing */
+    const unsigned char *peers; /**< IPv4 peers in compact format, COMPACT_PEER_V4_SIZE bytes each */
+    uint32_t peer_amount; /**< Amount of peers in peers */
+    const unsigned char *peers6; /**< IPv6 peers in compact format (BEP 7), COMPACT_PEER_V6_SIZE bytes each */
+    uint32_t peer6_amount; /**< Amount of peers in peers6 */
+    const char *peer_list; /**< Bencoded list of peer dictionaries, for trackers that ignore compact=1 */
+    const char *peer_list_end; /**< One past the end of peer_list */
+} http_announce_response_t;
+
+/**
+ * Function called with the result of http_tracker_scrape().
+ *
+ * @param ctx The context pointer given to http_tracker_scrape().
+ * @param scraped_data One entry per info hash, in the order they were asked, or nullptr if the scrape failed.
+ *                     Torrents the tracker doesn't know about are all zeros. Only valid during the call.
+ * @param torrent_amount Amount of entries in scraped_data.
+ */
+typedef void (*http_scrape_callback_t)(void *ctx, const scraped_data_t *scraped_data, uint32_t torrent_amount);
+
+/**
+ * Percent-encodes binary data for a URL query, leaving only unreserved characters as they are.
+ *
+ * @param data The data to encode.
+ * @param length Length of data in bytes.
+ * @param out Where to write the encoded data, null terminated. Must have room for 3*length+1 bytes.
+ * @return The length of the encoded data, without the null terminator.
+ */
+uint32_t url_encode_bytes(const unsigned char *data, uint32_t length, char *out);
+
+/**
+ * Builds the URL of an HTTP announce, adding the query to whatever the tracker URL already has.
+ *
+ * @param announce_url The tracker's announce URL.
+ * @param info_hash 20-byte info hash of the torrent.
+ * @param peer_id 20-byte peer id of this client.
+ * @param torrent_stats Statistics to report.
+ * @param port Port this client accepts connections on.
+ * @param event The announce event. ANNOUNCE_EVENT_NONE adds no event parameter.
+ * @return The full URL, to be freed by the caller, or nullptr if any argument is missing.
+ */
+char *build_http_announce_url(const char *announce_url, const unsigned char *info_hash, const unsigned char *peer_id,
+                              const torrent_stats_t *torrent_stats, uint16_t port, ANNOUNCE_EVENT event);
+
+/**
+ * Parses an HTTP announce response in place. Nothing is allocated: peers point into body.
+ *
+ * @param body The bencoded response body.
+ * @param length Length of body in bytes.
+ * @param response Where to store the parsed response.
+ * @return true if body is a valid response (which may still carry a failure reason), false otherwise.
+ */
+bool parse_http_announce(const char *body, uint64_t length, http_announce_response_t *response);
+
+/**
+ * Converts IPv4 peers from a non-compact peer list into compact format.
+ *
+ * @param peer_list A pointer to the 'l' starting the list of peer dictionaries.
+ * @param limit One past the last byte of the list.
+ * @param compact_peers Where to write the peers, COMPACT_PEER_V4_SIZE bytes each.
+ * @param max_peers Room in compact_peers, in peers.
+ * @return The amount of peers written. Peers with IPv6 or hostname addresses are skipped.
+ */
+uint32_t compact_peer_list(const char *peer_list, const char *limit, unsigned char *compact_peers, uint32_t max_peers);
+
+/**
+ * Derives the scrape URL from an announce URL, as described in BEP 48: "announce" in the last path
+ * component is replaced by "scrape". Info hashes are added as info_hash parameters.
+ *
+ * @param announce_url The tracker's announce URL.
+ * @param info_hashes Info hashes to scrape, 20 bytes each, one after the other.
+ * @param torrent_amount Amount of info hashes.
+ * @return The scrape URL, to be freed by the caller, or nullptr if the tracker doesn't support scraping.
+ */
+char *build_http_scrape_url(const char *announce_url, const unsigned char *info_hashes, uint32_t torrent_amount);
+
+/**
+ * Parses an HTTP scrape response in place.
+ *
+ * @param body The bencoded response body.
+ * @param length Length of body in bytes.
+ * @param info_hashes The info hashes that were asked about, 20 bytes each.
+ * @param torrent_amount Amount of info hashes.
+ * @param scraped_data Where to store one entry per info hash, in the same order. Missing ones are zeroed.
+ * @return true if body is a valid scrape response, false otherwise.
+ */
+bool parse_http_scrape(const char *body, uint64_t length, const unsigned char *info_hashes, uint32_t torrent_amount,
+                       scraped_data_t *scraped_data);
+
+/**
+ * Scrapes many torrents from an HTTP tracker with a single request, without blocking.
+ *
+ * @param client The HTTP client the request runs on.
+ * @param announce_url The tracker's announce URL.
+ * @param info_hashes Info hashes to scrape, 20 bytes each. Copied, so it may be freed right after the call.
+ * @param torrent_amount Amount of info hashes.
+ * @param callback Called once with the result.
+ * @param ctx Passed as is to callback.
+ * @return true if the request was started, false if the tracker doesn't support scraping or it couldn't start.
+ */
+bool http_tracker_scrape(http_client_t *client, const char *announce_url, const unsigned char *info_hashes,
+                         uint32_t torrent_amount, http_scrape_callback_t callback, void *ctx);
+
+#endif //BITTORRENT_CLIENT_HTTP_TRACKER_H
@@ -0,0 +1,435 @@
+#include "listener.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "downloading_types.h"
+#include "logger.h"
+#include "metrics.h"
+
+/**
+ * Bucket of an info hash. Info hashes are SHA1 digests, so any 4 bytes of them are already well spread
+ */
+static uint32_t torrent_bucket(const unsigned char* info_hash) {
+    uint32_t hash;
+    memcpy(&hash, info_hash, sizeof(hash));
+    return hash % LISTENER_TORRENT_BUCKETS;
+}
+
+/**
+ * Finds a registered torrent. The listener's mutex must be held
+ */
+static listener_torrent_t* find_torrent(const listener_t* listener, const unsigned char* info_hash) {
+    listener_torrent_t* torrent = listener->torrents[torrent_bucket(info_hash)];
+    while (torrent && memcmp(torrent->info_hash, info_hash, 20) != 0) torrent = torrent->next;
+    return torrent;
+}
+
+/**
+ * Hands the peers in a torrent's inbox to its callback. Runs on the torrent's thread
+ */
+static void on_inbox(void* ctx, const uint32_t events) {
+    (void) events;
+    listener_torrent_t* torrent = ctx;
+    uint64_t count;
+    if (read(torrent->wake_fd, &count, sizeof(count)) < 0) {
+        // Already drained, nothing new
+    }
+    // Taken as a whole, so callbacks run without the lock
+    pthread_mutex_lock(&torrent->listener->mutex);
+    inbound_peer_t* inbox = torrent->inbox;
+    const uint32_t amount = torrent->inbox_amount;
+    torrent->inbox = nullptr;
+    torrent->inbox_amount = 0;
+    torrent->inbox_capacity = 0;
+    pthread_mutex_unlock(&torrent->listener->mutex);
+
+    for (uint32_t i = 0; i < amount; ++i) {
+        torrent->callback(torrent->ctx, inbox[i].socket, &inbox[i].address, inbox[i].handshake);
+    }
+    free(inbox);
+}
+
+/**
+ * Frees a pending entry, closing its socket unless it was handed over
+ */
+static void release_pending(acceptor_t* acceptor, pending_inbound_t* pending, const bool close_socket) {
+    loop_remove_source(acceptor->loop, pending->slot);
+    wheel_timer_disarm(acceptor->timers, pending->timer);
+    if (close_socket) close(pending->socket);
+    pending->socket = -1;
+    acceptor->free_pending[acceptor->free_amount++] = pending - acceptor->pending;
+}
+
+/**
+ * Hands a connection whose handshake is complete over to the torrent it names
+ */
+static void route_pending(acceptor_t* acceptor, pending_inbound_t* pending) {
+    listener_t* listener = acceptor->listener;
+    if (pending->handshake[0] != 19 || memcmp(pending->handshake + 1, "BitTorrent protocol", 19) != 0) {
+        log_printf(listener->log_code, LOG_FULL, "Invalid handshake from inbound socket %d\n", pending->socket);
+        metrics_add(METRIC_INBOUND_REJECTED, 1);
+        release_pending(acceptor, pending, true);
+        return;
+    }
+
+    // Out of the acceptor's loop before the torrent can get it, since it may close it and reuse its number
+    // The entry keeps its contents until the next accept on this same thread
+    const int32_t socket = pending->socket;
+    const unsigned char* handshake = pending->handshake;
+    release_pending(acceptor, pending, false);
+    bool routed = false;
+    bool wake = false;
+    int32_t wake_fd = -1;
+    pthread_mutex_lock(&listener->mutex);
+    listener_torrent_t* torrent = find_torrent(listener, handshake + 28);
+    if (torrent) {
+        if (torrent->inbox_amount == torrent->inbox_capacity) {
+            const uint32_t capacity = torrent->inbox_capacity ? torrent->inbox_capacity * 2 : 8;
+            inbound_peer_t* inbox = realloc(torrent->inbox, sizeof(inbound_peer_t) * capacity);
+            if (inbox) {
+                torrent->inbox = inbox;
+                torrent->inbox_capacity = capacity;
+            }
+        }
+        if (torrent->inbox_amount < torrent->inbox_capacity) {
+            inbound_peer_t* inbound = &torrent->inbox[torrent->inbox_amount++];
+            inbound->socket = socket;
+            inbound->address = pending->address;
+            memcpy(inbound->handshake, handshake, HANDSHAKE_LEN);
+            routed = true;
+            // The torrent is only woken once per batch of peers
+            wake = torrent->inbox_amount == 1;
+            wake_fd = torrent->wake_fd;
+        }
+    }
+    if (wake) {
+        const uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            // Only fails if the counter is about to overflow, and then it's readable anyway
+        }
+    }
+    pthread_mutex_unlock(&listener->mutex);
+
+    if (routed) {
+        log_printf(listener->log_code, LOG_FULL, "Inbound socket %d handed over to its torrent\n", socket);
+        metrics_add(METRIC_INBOUND_PEERS, 1);
+    } else {
+        log_printf(listener->log_code, LOG_FULL, "Inbound socket %d asked for an unknown torrent\n", socket);
+        metrics_add(METRIC_INBOUND_REJECTED, 1);
+        close(socket);
+    }
+}
+
+/**
+ * Reads what's there of a pending connection's handshake, and nothing past it
+ */
+static void on_pending_readable(void* ctx, const uint32_t events) {
+    (void) events;
+    pending_inbound_t* pending = ctx;
+    acceptor_t* acceptor = pending->acceptor;
+    while (pending->length < HANDSHAKE_LEN) {
+        const ssize_t received = recv(pending->socket, pending->handshake + pending->length,
+                                      HANDSHAKE_LEN - pending->length, 0);
+        if (received > 0) {
+            pending->length += received;
+            continue;
+        }
+        if (received < 0 && errno == EINTR) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        // Closed or failed before finishing its handshake
+        metrics_add(METRIC_INBOUND_REJECTED, 1);
+        release_pending(acceptor, pending, true);
+        return;
+    }
+    route_pending(acceptor, pending);
+}
+
+static void on_handshake_timeout(void* ctx, const uint32_t index) {
+    acceptor_t* acceptor = ctx;
+    pending_inbound_t* pending = &acceptor->pending[index];
+    if (pending->socket < 0) return;
+    log_printf(acceptor->listener->log_code, LOG_FULL, "Inbound socket %d never finished its handshake\n",
+               pending->socket);
+    metrics_add(METRIC_INBOUND_REJECTED, 1);
+    release_pending(acceptor, pending, true);
+}
+
+/**
+ * Decides which of a batch of accepted connections are let in, by the global and per address rate limits.
+ * Takes the lock once per batch
+ */
+static void admit(listener_t* listener, const struct sockaddr_in* addresses, const uint32_t amount, bool* admitted,
+                  const uint64_t now_ms) {
+    pthread_mutex_lock(&listener->mutex);
+    if (now_ms > listener->refill_ms) {
+        listener->tokens += (now_ms - listener->refill_ms) * LISTENER_ACCEPT_RATE;
+        if (listener->tokens > LISTENER_ACCEPT_BURST * 1000ull) listener->tokens = LISTENER_ACCEPT_BURST * 1000ull;
+        listener->refill_ms = now_ms;
+    }
+    for (uint32_t i = 0; i < amount; ++i) {
+        const uint32_t address = addresses[i].sin_addr.s_addr;
+        // Multiplicative hashing, whose high bits are the well mixed ones
+        listener_ip_t* ip = &listener->ips[((address * 2654435761u) >> 16) % LISTENER_IP_SLOTS];
+        if (ip->address != address || now_ms - ip->window_ms >= LISTENER_IP_WINDOW_MS) {
+            ip->address = address;
+            ip->count = 0;
+            ip->window_ms = now_ms;
+        }
+        admitted[i] = ip->count < LISTENER_IP_MAX && listener->tokens >= 1000;
+        if (admitted[i]) {
+            ip->count++;
+            listener->tokens -= 1000;
+        }
+    }
+    pthread_mutex_unlock(&listener->mutex);
+}
+
+/**
+ * Accepts up to LISTENER_ACCEPT_BATCH connections and starts reading the handshake of those let in.
+ * Whatever is left stays in the backlog, and the socket is reported again on the next wakeup
+ */
+static void on_accept(void* ctx, const uint32_t events) {
+    (void) events;
+    acceptor_t* acceptor = ctx;
+    listener_t* listener = acceptor->listener;
+    int32_t sockets[LISTENER_ACCEPT_BATCH];
+    struct sockaddr_in addresses[LISTENER_ACCEPT_BATCH];
+    bool admitted[LISTENER_ACCEPT_BATCH];
+    uint32_t accepted = 0;
+    while (accepted < LISTENER_ACCEPT_BATCH) {
+        socklen_t length = sizeof(struct sockaddr_in);
+        const int32_t socket = accept4(acceptor->listen_fd, (struct sockaddr*) &addresses[accepted], &length,
+                                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_printf(listener->log_code, LOG_ERR, "Error %d accepting peer connections\n", errno);
+            }
+            break;
+        }
+        sockets[accepted++] = socket;
+    }
+    if (accepted == 0) return;
+
+    admit(listener, addresses, accepted, admitted, acceptor->timers->now_ms);
+    for (uint32_t i = 0; i < accepted; ++i) {
+        if (!admitted[i] || acceptor->free_amount == 0) {
+            close(sockets[i]);
+            metrics_add(METRIC_INBOUND_REJECTED, 1);
+            continue;
+        }
+        pending_inbound_t* pending = &acceptor->pending[acceptor->free_pending[--acceptor->free_amount]];
+        pending->socket = sockets[i];
+        pending->address = addresses[i];
+        pending->length = 0;
+        pending->slot = loop_add_source(acceptor->loop, sockets[i], EPOLLIN, on_pending_readable, pending);
+        if (pending->slot < 0) {
+            release_pending(acceptor, pending, true);
+            continue;
+        }
+        wheel_timer_arm(acceptor->timers, pending->timer, LISTENER_HANDSHAKE_TIMEOUT_MS);
+    }
+}
+
+static void on_stop(void* ctx, const uint32_t events) {
+    (void) events;
+    acceptor_t* acceptor = ctx;
+    acceptor->stopping = true;
+}
+
+static void* run_acceptor(void* arg) {
+    acceptor_t* acceptor = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (!acceptor->stopping) {
+        const int32_t timeout = timer_wheel_timeout(acceptor->timers, EPOLL_TIMEOUT);
+        const int32_t nfds = epoll_wait(acceptor->loop->epoll, events, MAX_EVENTS, timeout);
+        timer_wheel_advance(acceptor->timers, monotonic_coarse_ms());
+        for (int32_t i = 0; i < nfds; ++i) loop_dispatch(acceptor->loop, &events[i]);
+    }
+    return nullptr;
+}
+
+/**
+ * Creates a listening socket on port that other sockets of this process can share
+ */
+static int32_t listen_reuseport(const uint16_t port) {
+    const int32_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    const int32_t enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0 ||
+        bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(fd, LISTENER_BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sets up an acceptor whose listening socket is already open. Its thread isn't started
+ */
+static bool init_acceptor(listener_t* listener, acceptor_t* acceptor) {
+    acceptor->listener = listener;
+    acceptor->loop = loop_create();
+    acceptor->timers = timer_wheel_create(monotonic_coarse_ms());
+    if (!acceptor->loop || !acceptor->timers) return false;
+    for (uint32_t i = 0; i < LISTENER_MAX_PENDING; ++i) {
+        acceptor->pending[i].acceptor = acceptor;
+        acceptor->pending[i].socket = -1;
+        acceptor->pending[i].timer = wheel_timer_new(acceptor->timers, on_handshake_timeout, acceptor, i);
+        if (acceptor->pending[i].timer == TIMER_NONE) return false;
+        // Lowest indices handed out first
+        acceptor->free_pending[i] = LISTENER_MAX_PENDING - 1 - i;
+    }
+    acceptor->free_amount = LISTENER_MAX_PENDING;
+    return loop_add_source(acceptor->loop, acceptor->listen_fd, EPOLLIN, on_accept, acceptor) >= 0 &&
+           loop_add_source(acceptor->loop, listener->stop_fd, EPOLLIN, on_stop, acceptor) >= 0;
+}
+
+/**
+ * Frees an acceptor whose thread isn't running, closing its sockets
+ */
+static void free_acceptor(acceptor_t* acceptor) {
+    // Entries are only valid once initialized
+    for (uint32_t i = 0; i < LISTENER_MAX_PENDING && acceptor->pending[i].acceptor; ++i) {
+        if (acceptor->pending[i].socket >= 0) close(acceptor->pending[i].socket);
+    }
+    if (acceptor->listen_fd >= 0) close(acceptor->listen_fd);
+    timer_wheel_free(acceptor->timers);
+    loop_free(acceptor->loop);
+}
+
+listener_t* listener_start(const uint16_t port, const uint32_t acceptors, const LOG_CODE log_code) {
+    if (acceptors == 0) return nullptr;
+    listener_t* listener = calloc(1, sizeof(listener_t));
+    if (!listener) return nullptr;
+    listener->acceptors = calloc(acceptors, sizeof(acceptor_t));
+    listener->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    listener->log_code = log_code;
+    listener->tokens = LISTENER_ACCEPT_BURST * 1000ull;
+    listener->refill_ms = monotonic_coarse_ms();
+    pthread_mutex_init(&listener->mutex, nullptr);
+    if (!listener->acceptors || listener->stop_fd < 0) {
+        listener_stop(listener);
+        return nullptr;
+    }
+
+    listener->port = port;
+    for (uint32_t i = 0; i < acceptors; ++i) {
+        acceptor_t* acceptor = &listener->acceptors[i];
+        acceptor->listen_fd = listen_reuseport(listener->port);
+        listener->acceptor_amount++;
+        if (acceptor->listen_fd < 0 || !init_acceptor(listener, acceptor)) {
+            log_printf(log_code, LOG_ERR, "Can't listen for peers on port %u\n", port);
+            listener_stop(listener);
+            return nullptr;
+        }
+        // With port 0, the rest share whichever one the first got
+        if (listener->port == 0) {
+            struct sockaddr_in address;
+            socklen_t length = sizeof(address);
+            getsockname(acceptor->listen_fd, (struct sockaddr*) &address, &length);
+            listener->port = ntohs(address.sin_port);
+        }
+    }
+    // Threads start once every socket is bound, so a failure never leaves half of them running
+    for (uint32_t i = 0; i < acceptors; ++i) {
+        acceptor_t* acceptor = &listener->acceptors[i];
+        if (pthread_create(&acceptor->thread, nullptr, run_acceptor, acceptor) != 0) {
+            listener_stop(listener);
+            return nullptr;
+        }
+        acceptor->thread_started = true;
+    }
+    log_printf(log_code, LOG_SUMM, "Listening for peers on port %u\n", listener->port);
+    return listener;
+}
+
+void listener_stop(listener_t* listener) {
+    if (listener == nullptr) return;
+    if (listener->stop_fd >= 0) {
+        const uint64_t one = 1;
+        if (write(listener->stop_fd, &one, sizeof(one)) < 0) {
+            // Can't fail, the counter was never written before
+        }
+    }
+    for (uint32_t i = 0; i < listener->acceptor_amount; ++i) {
+        if (listener->acceptors[i].thread_started) pthread_join(listener->acceptors[i].thread, nullptr);
+        free_acceptor(&listener->acceptors[i]);
+    }
+    // Registrations left behind, whose loops may be gone already
+    for (uint32_t i = 0; i < LISTENER_TORRENT_BUCKETS; ++i) {
+        while (listener->torrents[i]) {
+            listener_torrent_t* torrent = listener->torrents[i];
+            listener->torrents[i] = torrent->next;
+            for (uint32_t j = 0; j < torrent->inbox_amount; ++j) close(torrent->inbox[j].socket);
+            close(torrent->wake_fd);
+            free(torrent->inbox);
+            free(torrent);
+        }
+    }
+    if (listener->stop_fd >= 0) close(listener->stop_fd);
+    pthread_mutex_destroy(&listener->mutex);
+    free(listener->acceptors);
+    free(listener);
+}
+
+listener_torrent_t* listener_register(listener_t* listener, const unsigned char* info_hash, event_loop_t* loop,
+                                      const inbound_callback_t callback, void* ctx) {
+    if (!listener || !info_hash || !loop || !callback) return nullptr;
+    listener_torrent_t* torrent = calloc(1, sizeof(listener_torrent_t));
+    if (!torrent) return nullptr;
+    memcpy(torrent->info_hash, info_hash, 20);
+    torrent->loop = loop;
+    torrent->callback = callback;
+    torrent->ctx = ctx;
+    torrent->listener = listener;
+    torrent->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    torrent->slot = loop_add_source(loop, torrent->wake_fd, EPOLLIN, on_inbox, torrent);
+    if (torrent->wake_fd < 0 || torrent->slot < 0) {
+        if (torrent->wake_fd >= 0) close(torrent->wake_fd);
+        free(torrent);
+        return nullptr;
+    }
+
+    pthread_mutex_lock(&listener->mutex);
+    const bool registered = find_torrent(listener, info_hash) != nullptr;
+    if (!registered) {
+        const uint32_t bucket = torrent_bucket(info_hash);
+        torrent->next = listener->torrents[bucket];
+        listener->torrents[bucket] = torrent;
+    }
+    pthread_mutex_unlock(&listener->mutex);
+    if (registered) {
+        loop_remove_source(loop, torrent->slot);
+        close(torrent->wake_fd);
+        free(torrent);
+        return nullptr;
+    }
+    return torrent;
+}
+
+void listener_unregister(listener_torrent_t* torrent) {
+    if (torrent == nullptr) return;
+    listener_t* listener = torrent->listener;
+    pthread_mutex_lock(&listener->mutex);
+    listener_torrent_t** link = &listener->torrents[torrent_bucket(torrent->info_hash)];
+    while (*link && *link != torrent) link = &(*link)->next;
+    if (*link) *link = torrent->next;
+    pthread_mutex_unlock(&listener->mutex);
+
+    // Acceptors can't reach it anymore
+    for (uint32_t i = 0; i < torrent->inbox_amount; ++i) close(torrent->inbox[i].socket);
+    loop_remove_source(torrent->loop, torrent->slot);
+    close(torrent->wake_fd);
+    free(torrent->inbox);
+    free(torrent);
+}
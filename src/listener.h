@@ -0,0 +1,163 @@
+#ifndef BITTORRENT_CLIENT_LISTENER_H
+#define BITTORRENT_CLIENT_LISTENER_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "event_loop.h"
+#include "messages_types.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+/// @brief Port peers connect to when none is given
+#define LISTENER_DEFAULT_PORT 6881
+/// @brief Acceptor threads, each with its own SO_REUSEPORT socket the kernel spreads connections over
+#define LISTENER_ACCEPTORS 2
+/// @brief Connections the kernel queues for each acceptor socket
+#define LISTENER_BACKLOG 128
+/// @brief Most connections accepted per wakeup, so a flood can't starve handshakes in progress
+#define LISTENER_ACCEPT_BATCH 32
+/// @brief Connections each acceptor may keep waiting for their handshake. New ones are closed beyond it
+#define LISTENER_MAX_PENDING 256
+/// @brief Milliseconds an accepted connection gets to send its whole handshake
+#define LISTENER_HANDSHAKE_TIMEOUT_MS 10000
+/// @brief Connections accepted per second across every acceptor, on average
+#define LISTENER_ACCEPT_RATE 100
+/// @brief Connections that may be accepted at once after a quiet period
+#define LISTENER_ACCEPT_BURST 200
+/// @brief Most connections a single address may open per LISTENER_IP_WINDOW_MS
+#define LISTENER_IP_MAX 8
+/// @brief Milliseconds connections of each address are counted over
+#define LISTENER_IP_WINDOW_MS 10000
+/// @brief Addresses tracked for their rate. Colliding addresses replace each other, which only forgets counts
+#define LISTENER_IP_SLOTS 1024
+/// @brief Buckets of the table of registered torrents
+#define LISTENER_TORRENT_BUCKETS 64
+
+/**
+ * Function called from a torrent's own event loop for every peer that connected to it.
+ *
+ * @param ctx The context pointer given to listener_register().
+ * @param socket Non-blocking socket of the peer, now owned by the callback.
+ * @param address Address the peer connected from.
+ * @param handshake The HANDSHAKE_LEN bytes of the peer's handshake, already read from the socket.
+ */
+typedef void (*inbound_callback_t)(void *ctx, int32_t socket, const struct sockaddr_in *address,
+                                   const unsigned char *handshake);
+
+/// @brief A peer whose handshake named a registered torrent, waiting to be handed over to it
+typedef struct {
+    int32_t socket; /**< Socket of the peer */
+    struct sockaddr_in address; /**< Address the peer connected from */
+    unsigned char handshake[HANDSHAKE_LEN]; /**< The peer's handshake */
+} inbound_peer_t;
+
+/// @brief A torrent peers can connect to, found by its info hash
+typedef struct listener_torrent_t {
+    unsigned char info_hash[20]; /**< Info hash peers must name in their handshake */
+    event_loop_t *loop; /**< Event loop of the torrent, callback runs on its thread */
+    int32_t wake_fd; /**< Eventfd in loop, written when inbox stops being empty */
+    int32_t slot; /**< Source slot of wake_fd in loop */
+    inbound_callback_t callback; /**< Called for each peer handed over */
+    void *ctx; /**< Passed as is to callback */
+    inbound_peer_t *inbox; /**< Peers handed over and not taken by the torrent yet */
+    uint32_t inbox_amount; /**< Peers in inbox */
+    uint32_t inbox_capacity; /**< Peers allocated in inbox */
+    struct listener_t *listener; /**< Listener the torrent is registered in */
+    struct listener_torrent_t *next; /**< Next torrent in the same bucket */
+} listener_torrent_t;
+
+/// @brief Accepted connection whose handshake is still being read
+typedef struct {
+    struct acceptor_t *acceptor; /**< Acceptor the connection belongs to */
+    int32_t socket; /**< Socket of the peer, or -1 if the entry is free */
+    int32_t slot; /**< Source slot of socket in the acceptor's loop */
+    uint32_t timer; /**< Handshake timeout in the acceptor's wheel */
+    uint32_t length; /**< Bytes of handshake read so far */
+    struct sockaddr_in address; /**< Address the peer connected from */
+    unsigned char handshake[HANDSHAKE_LEN]; /**< Handshake read so far */
+} pending_inbound_t;
+
+/// @brief A thread accepting connections from its own SO_REUSEPORT socket
+typedef struct acceptor_t {
+    struct listener_t *listener; /**< Listener the acceptor belongs to */
+    int32_t listen_fd; /**< Listening socket, bound to the listener's port */
+    event_loop_t *loop; /**< Watches listen_fd, stop_fd and pending sockets */
+    timer_wheel_t *timers; /**< Handshake timeouts, and the clock cached for each iteration */
+    pending_inbound_t pending[LISTENER_MAX_PENDING]; /**< Connections whose handshake is being read */
+    uint32_t free_pending[LISTENER_MAX_PENDING]; /**< Indices of free entries of pending, used as a stack */
+    uint32_t free_amount; /**< Entries in free_pending */
+    bool stopping; /**< Set once stop_fd is readable */
+    pthread_t thread; /**< Thread running the acceptor's loop */
+    bool thread_started; /**< Whether thread was created, so it's joined */
+} acceptor_t;
+
+/// @brief Addresses seen recently, for the rate limit of each one
+typedef struct {
+    uint32_t address; /**< IPv4 address, in network endianness */
+    uint32_t count; /**< Connections since window_ms */
+    uint64_t window_ms; /**< When counting started */
+} listener_ip_t;
+
+/**
+ * Accepts incoming peer connections on a port shared by every torrent. Each acceptor thread reads the
+ * handshake of its connections, and peers naming a registered torrent are handed over to that torrent's
+ * event loop, the rest are closed.
+ */
+typedef struct listener_t {
+    uint16_t port; /**< Port accepted on, in host endianness */
+    acceptor_t *acceptors; /**< Acceptor threads */
+    uint32_t acceptor_amount; /**< Amount of acceptors */
+    int32_t stop_fd; /**< Eventfd written to stop every acceptor */
+    pthread_mutex_t mutex; /**< Protects torrents, their inboxes and the rate limits */
+    listener_torrent_t *torrents[LISTENER_TORRENT_BUCKETS]; /**< Registered torrents, by info hash */
+    uint64_t tokens; /**< Connections that may be accepted right now, in thousandths */
+    uint64_t refill_ms; /**< Last time tokens was refilled */
+    listener_ip_t ips[LISTENER_IP_SLOTS]; /**< Recent addresses, by hash */
+    LOG_CODE log_code; /**< Logging level */
+} listener_t;
+
+/**
+ * Starts listening on a TCP port from every interface, with one SO_REUSEPORT socket and thread per acceptor.
+ *
+ * @param port Port to listen on, or 0 for any free one.
+ * @param acceptors Amount of acceptor threads, at least 1.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to the listener, or nullptr if the port couldn't be listened on.
+ */
+listener_t *listener_start(uint16_t port, uint32_t acceptors, LOG_CODE log_code);
+
+/**
+ * Stops every acceptor and frees the listener. Connections not handed over yet are closed.
+ * Torrents must be unregistered first.
+ *
+ * @param listener The listener to stop. If nullptr, nothing is done.
+ */
+void listener_stop(listener_t *listener);
+
+/**
+ * Makes a torrent reachable: peers whose handshake names its info hash are handed over to callback,
+ * which runs on the thread of loop.
+ *
+ * @param listener The listener.
+ * @param info_hash 20-byte info hash of the torrent.
+ * @param loop Event loop of the torrent.
+ * @param callback Called for each peer that connects to the torrent.
+ * @param ctx Passed as is to callback.
+ * @return The registration, needed to unregister, or nullptr on failure or if the info hash is already registered.
+ */
+listener_torrent_t *listener_register(listener_t *listener, const unsigned char *info_hash, event_loop_t *loop,
+                                      inbound_callback_t callback, void *ctx);
+
+/**
+ * Stops handing peers over to a torrent, closing those it didn't take yet. Must be called from the
+ * torrent's thread.
+ *
+ * @param torrent The registration. If nullptr, nothing is done.
+ */
+void listener_unregister(listener_torrent_t *torrent);
+
+#endif //BITTORRENT_CLIENT_LISTENER_H
@@ -0,0 +1,290 @@
+#include "logger.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/// @brief Bytes before each record's text: 2 for its length, 1 for its level
+#define LOG_RECORD_HEADER 3
+
+/// @brief Rings of threads that logged since the drain thread started, and of exited ones not drained yet
+static log_ring_t* rings = nullptr;
+/// @brief Guards rings. Taken on registration, thread exit and by each drain pass, never by log_write()
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local log_ring_t* local_ring = nullptr;
+/// @brief Calls release_ring() with a thread's ring when it exits
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static atomic_bool running = false;
+static atomic_bool stopping = false;
+/// @brief Set by the drain thread before blocking on wake_fd, so producers only write to it when needed
+static atomic_bool sleeping = false;
+/// @brief Eventfd the drain thread blocks on
+static int32_t wake_fd = -1;
+static pthread_t drain_thread;
+
+static bool drain_ring(log_ring_t* ring);
+
+/**
+ * Unlinks a ring and frees it. Must hold rings_mutex
+ */
+static void free_ring(log_ring_t* ring) {
+    log_ring_t** link = &rings;
+    while (*link != ring) link = &(*link)->next;
+    *link = ring->next;
+    free(ring);
+}
+
+/**
+ * Called when a thread that logged exits. The drain thread frees the ring once it printed what's left in it
+ */
+static void release_ring(void* ctx) {
+    log_ring_t* ring = ctx;
+    pthread_mutex_lock(&rings_mutex);
+    if (atomic_load_explicit(&running, memory_order_acquire)) ring->exited = true;
+    else {
+        drain_ring(ring);
+        free_ring(ring);
+    }
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/**
+ * Returns the calling thread's ring, registering it the first time
+ */
+static log_ring_t* get_ring(void) {
+    if (local_ring) return local_ring;
+    pthread_once(&ring_key_once, create_ring_key);
+    log_ring_t* ring = calloc(1, sizeof(log_ring_t));
+    if (!ring) return nullptr;
+    pthread_mutex_lock(&rings_mutex);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_mutex);
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+/**
+ * Copies into the ring starting at position, wrapping around its end
+ */
+static void ring_copy_in(log_ring_t* ring, const uint32_t position, const void* source, const uint32_t length) {
+    const uint32_t offset = position & (LOG_RING_SIZE - 1);
+    const uint32_t first = length < LOG_RING_SIZE - offset ? length : LOG_RING_SIZE - offset;
+    memcpy(ring->data + offset, source, first);
+    memcpy(ring->data, (const unsigned char*) source + first, length - first);
+}
+
+static void ring_copy_out(const log_ring_t* ring, const uint32_t position, void* destination, const uint32_t length) {
+    const uint32_t offset = position & (LOG_RING_SIZE - 1);
+    const uint32_t first = length < LOG_RING_SIZE - offset ? length : LOG_RING_SIZE - offset;
+    memcpy(destination, ring->data + offset, first);
+    memcpy((unsigned char*) destination + first, ring->data, length - first);
+}
+
+/**
+ * Queues an already formatted message, or prints it right away if the drain thread isn't running
+ */
+static void submit(const LOG_CODE level, const char* text, uint32_t length) {
+    if (length > LOG_LINE_SIZE) length = LOG_LINE_SIZE;
+    log_ring_t* ring = atomic_load_explicit(&running, memory_order_acquire) ? get_ring() : nullptr;
+    if (!ring) {
+        fwrite(text, 1, length, level == LOG_ERR ? stderr : stdout);
+        return;
+    }
+
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < LOG_RECORD_HEADER + length) {
+        atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return;
+    }
+    const unsigned char header[LOG_RECORD_HEADER] = {length & 0xFF, length >> 8, level};
+    ring_copy_in(ring, head, header, LOG_RECORD_HEADER);
+    ring_copy_in(ring, head + LOG_RECORD_HEADER, text, length);
+    // Publishing the record to the drain thread
+    atomic_store_explicit(&ring->head, head + LOG_RECORD_HEADER + length, memory_order_release);
+    // Pairs with the fence in drainer(): either it sees the record, or this sees it going to sleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&sleeping, memory_order_relaxed) &&
+        atomic_exchange_explicit(&sleeping, false, memory_order_relaxed)) {
+        const uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            // Only fails if the counter overflows, and the drain thread is awake then
+        }
+    }
+}
+
+void log_write(const LOG_CODE level, const char* format, ...) {
+    char text[LOG_LINE_SIZE];
+    va_list args;
+    va_start(args, format);
+    const int32_t length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length <= 0) return;
+    submit(level, text, (uint32_t) length < sizeof(text) ? (uint32_t) length : sizeof(text) - 1);
+}
+
+void log_write_hex(const LOG_CODE level, const char* label, const unsigned char* data, const uint32_t length) {
+    if (!label || (!data && length > 0)) return;
+    // Only the hex dumps are rate limited, they're by far the largest messages
+    uint64_t suppressed = 0;
+    log_ring_t* ring = atomic_load_explicit(&running, memory_order_acquire) ? get_ring() : nullptr;
+    if (ring) {
+        const uint64_t second = monotonic_us() / 1000000;
+        if (second != ring->hex_window) {
+            ring->hex_window = second;
+            ring->hex_in_window = 0;
+        }
+        if (ring->hex_in_window >= LOG_HEX_PER_SECOND) {
+            ring->hex_suppressed++;
+            return;
+        }
+        ring->hex_in_window++;
+        suppressed = ring->hex_suppressed;
+        ring->hex_suppressed = 0;
+    }
+
+    char text[LOG_LINE_SIZE];
+    int32_t used = snprintf(text, sizeof(text), "%s (%u bytes):", label, length);
+    if (used < 0) return;
+    // Leaving room for the newline
+    const int32_t limit = sizeof(text) - 2;
+    if (used > limit) used = limit;
+    const uint32_t shown = length < LOG_HEX_MAX_BYTES ? length : LOG_HEX_MAX_BYTES;
+    static const char digits[] = "0123456789abcdef";
+    for (uint32_t i = 0; i < shown && used + 3 <= limit; ++i) {
+        // Grouped by 4 bytes
+        if (i % 4 == 0) text[used++] = ' ';
+        text[used++] = digits[data[i] >> 4];
+        text[used++] = digits[data[i] & 0xF];
+    }
+    if (shown < length) used += snprintf(text + used, limit + 1 - used, " ...");
+    if (used > limit) used = limit;
+    if (suppressed > 0) {
+        used += snprintf(text + used, limit + 1 - used, " (%lu dumps skipped)", (unsigned long) suppressed);
+        if (used > limit) used = limit;
+    }
+    text[used++] = '\n';
+    submit(level, text, used);
+}
+
+/**
+ * Prints every record waiting in a ring. Must hold rings_mutex
+ * @return Whether anything was printed
+ */
+static bool drain_ring(log_ring_t* ring) {
+    bool printed = false;
+    char text[LOG_LINE_SIZE];
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail != head) {
+        unsigned char header[LOG_RECORD_HEADER];
+        ring_copy_out(ring, tail, header, LOG_RECORD_HEADER);
+        const uint32_t length = header[0] | header[1] << 8;
+        ring_copy_out(ring, tail + LOG_RECORD_HEADER, text, length);
+        fwrite(text, 1, length, header[2] == LOG_ERR ? stderr : stdout);
+        tail += LOG_RECORD_HEADER + length;
+        printed = true;
+    }
+    // Handing the space back to the producer
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    const uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        fprintf(stderr, "Logger dropped %lu messages\n", (unsigned long) dropped);
+        printed = true;
+    }
+    if (printed) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return printed;
+}
+
+/**
+ * Prints every record waiting in every ring, and frees the rings of exited threads
+ * @return Whether anything was printed
+ */
+static bool drain(void) {
+    bool printed = false;
+    pthread_mutex_lock(&rings_mutex);
+    log_ring_t* ring = rings;
+    while (ring) {
+        log_ring_t* next = ring->next;
+        printed = drain_ring(ring) || printed;
+        // An exited thread can't write anymore
+        if (ring->exited) free_ring(ring);
+        ring = next;
+    }
+    pthread_mutex_unlock(&rings_mutex);
+    return printed;
+}
+
+static void* drainer(void* arg) {
+    (void) arg;
+    while (!atomic_load_explicit(&stopping, memory_order_acquire)) {
+        if (drain()) continue;
+        atomic_store_explicit(&sleeping, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        // A record published before the flag was set wouldn't wake this thread
+        if (drain()) {
+            atomic_store_explicit(&sleeping, false, memory_order_relaxed);
+            continue;
+        }
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0) {
+            // Interrupted, the loop checks again
+        }
+    }
+    return nullptr;
+}
+
+bool logger_start(void) {
+    if (atomic_load(&running)) return true;
+    atomic_store(&stopping, false);
+    atomic_store(&sleeping, false);
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd < 0) return false;
+    if (pthread_create(&drain_thread, nullptr, drainer, nullptr) != 0) {
+        close(wake_fd);
+        wake_fd = -1;
+        return false;
+    }
+    atomic_store_explicit(&running, true, memory_order_release);
+    return true;
+}
+
+void logger_stop(void) {
+    if (!atomic_load(&running)) return;
+    // New messages are printed right away from now on
+    atomic_store_explicit(&running, false, memory_order_release);
+    atomic_store_explicit(&stopping, true, memory_order_release);
+    const uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // Can't overflow, the drain thread resets the counter each time it wakes up
+    }
+    pthread_join(drain_thread, nullptr);
+    close(wake_fd);
+    wake_fd = -1;
+    drain();
+    // Other threads free theirs when exiting
+    if (local_ring) {
+        pthread_setspecific(ring_key, nullptr);
+        pthread_mutex_lock(&rings_mutex);
+        drain_ring(local_ring);
+        free_ring(local_ring);
+        pthread_mutex_unlock(&rings_mutex);
+        local_ring = nullptr;
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef BITTORRENT_CLIENT_LOGGER_H
+#define BITTORRENT_CLIENT_LOGGER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "util.h"
+
+/**
+ * Most verbose level compiled in, from 0 (LOG_NO) to 3 (LOG_FULL). Calls to more verbose levels are constant
+ * false conditions, so the compiler drops them along with their arguments and format strings.
+ */
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL 3
+#endif
+
+/// @brief Bytes of each thread's ring buffer. Must be a power of two
+#define LOG_RING_SIZE (64 * 1024)
+/// @brief Longest formatted message, longer ones are truncated
+#define LOG_LINE_SIZE 512
+/// @brief Most payload bytes shown by a hex dump
+#define LOG_HEX_MAX_BYTES 64
+/// @brief Most hex dumps a thread logs per second. The rest are counted and reported with the next one
+#define LOG_HEX_PER_SECOND 20
+
+/**
+ * Whether a message of the given level is logged with the current logging level.
+ *
+ * @param log_code The logging level in use.
+ * @param level The level of the message.
+ */
+#define LOG_ENABLED(log_code, level) ((level) <= LOG_MAX_LEVEL && (log_code) >= (level))
+
+/**
+ * Logs a printf-style message if its level is enabled. Errors go to stderr, everything else to stdout.
+ *
+ * @param log_code The logging level in use.
+ * @param level The level of the message: LOG_ERR, LOG_SUMM or LOG_FULL.
+ */
+#define log_printf(log_code, level, ...) do { \
+        if (LOG_ENABLED(log_code, level)) log_write(level, __VA_ARGS__); \
+    } while (0)
+
+/**
+ * Logs a hex dump of a payload if its level is enabled, rate limited to LOG_HEX_PER_SECOND per thread.
+ *
+ * @param log_code The logging level in use.
+ * @param level The level of the message.
+ * @param label Text printed before the dump.
+ * @param data The bytes to dump. Only the first LOG_HEX_MAX_BYTES are shown.
+ * @param length Amount of bytes in data.
+ */
+#define log_hex(log_code, level, label, data, length) do { \
+        if (LOG_ENABLED(log_code, level)) log_write_hex(level, label, data, length); \
+    } while (0)
+
+/**
+ * Messages of a single thread, waiting to be printed. Only its thread writes records and moves head,
+ * only the drain thread moves tail, so neither side takes a lock.
+ * Threads can exit with messages still in their ring: the drain thread frees it once it's empty.
+ */
+typedef struct log_ring_t {
+    _Atomic uint32_t head; /**< Bytes ever written, wrapping around */
+    _Atomic uint32_t tail; /**< Bytes ever drained, wrapping around */
+    _Atomic uint64_t dropped; /**< Messages that didn't fit, since the drain thread last reported them */
+    uint64_t hex_window; /**< Second the hex dump limit applies to */
+    uint32_t hex_in_window; /**< Hex dumps logged in hex_window */
+    uint32_t hex_suppressed; /**< Hex dumps skipped since the last one logged */
+    bool exited; /**< Set when its thread exits, under the rings lock */
+    struct log_ring_t *next; /**< Next registered ring */
+    unsigned char data[LOG_RING_SIZE]; /**< Records: 2 byte length, 1 byte level, then the text */
+} log_ring_t;
+
+/**
+ * Starts the drain thread. Until it's called, and after logger_stop(), messages are printed right away.
+ *
+ * @return true on success, false if the thread couldn't be created.
+ */
+bool logger_start(void);
+
+/**
+ * Prints every message still waiting, stops the drain thread and frees the calling thread's ring.
+ * Meant to be called once other threads stopped logging, messages queued during the call may be lost.
+ */
+void logger_stop(void);
+
+/**
+ * Formats a message into the calling thread's ring, waking the drain thread if it sleeps. Never blocks: if the
+ * ring is full the message is dropped and counted. Use log_printf() instead, so the call is skipped for disabled levels.
+ *
+ * @param level The level of the message, LOG_ERR goes to stderr.
+ * @param format printf-style format.
+ */
+void log_write(LOG_CODE level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Logs a hex dump of a payload. Use log_hex() instead, so the call is skipped for disabled levels.
+ *
+ * @param level The level of the message.
+ * @param label Text printed before the dump.
+ * @param data The bytes to dump. Only the first LOG_HEX_MAX_BYTES are shown.
+ * @param length Amount of bytes in data.
+ */
+void log_write_hex(LOG_CODE level, const char *label, const unsigned char *data, uint32_t length);
+
+#endif //BITTORRENT_CLIENT_LOGGER_H
@@ -0,0 +1,237 @@
+#include "lsd.h"
+
+#include <errno.h>
+#include <ifaddrs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#include "file.h"
+#include "logger.h"
+#include "metrics.h"
+
+/// @brief First line of every announce
+static const char announce_line[] = "BT-SEARCH * HTTP/1.1";
+
+uint32_t lsd_build_announce(char* buffer, const unsigned char* info_hash, const uint16_t port, const char* cookie) {
+    char hex[41];
+    sha1_to_hex(info_hash, hex);
+    const int32_t written = snprintf(buffer, LSD_MESSAGE_MAX,
+                                     "%s\r\nHost: %s:%u\r\nPort: %u\r\nInfohash: %s\r\ncookie: %s\r\n\r\n\r\n",
+                                     announce_line, LSD_ADDRESS, LSD_PORT, port, hex, cookie);
+    return written > 0 && written < LSD_MESSAGE_MAX ? written : 0;
+}
+
+/**
+ * Value of a hex digit
+ * @return The value, or -1 if it isn't one
+ */
+static int32_t hex_value(const char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Whether a 40 digit hex string, in either case, is the given info hash
+ */
+static bool hex_matches(const char* hex, const uint32_t length, const unsigned char* info_hash) {
+    if (length != 40) return false;
+    for (uint32_t i = 0; i < 20; ++i) {
+        const int32_t high = hex_value(hex[2 * i]);
+        const int32_t low = hex_value(hex[2 * i + 1]);
+        if (high < 0 || low < 0 || (high << 4 | low) != info_hash[i]) return false;
+    }
+    return true;
+}
+
+bool lsd_parse_announce(const char* message, const uint32_t length, const unsigned char* info_hash, uint16_t* port,
+                        const char** cookie, uint32_t* cookie_length) {
+    if (!message || !info_hash || !port || !cookie || !cookie_length) return false;
+    const uint32_t line_length = sizeof(announce_line) - 1;
+    if (length < line_length + 2 || memcmp(message, announce_line, line_length) != 0) return false;
+
+    *port = 0;
+    *cookie = nullptr;
+    *cookie_length = 0;
+    bool announced = false;
+    const char* limit = message + length;
+    const char* line = message;
+    while (line < limit) {
+        const char* end = memchr(line, '\n', limit - line);
+        if (!end) end = limit;
+        // Some clients end lines with \n alone
+        uint32_t size = end - line;
+        if (size > 0 && line[size - 1] == '\r') size--;
+        const char* colon = memchr(line, ':', size);
+        if (colon) {
+            const uint32_t name_length = colon - line;
+            const char* value = colon + 1;
+            while (value < line + size && *value == ' ') value++;
+            const uint32_t value_length = line + size - value;
+            if (name_length == 4 && strncasecmp(line, "Port", 4) == 0) {
+                char digits[6] = {0};
+                if (value_length == 0 || value_length >= sizeof(digits)) return false;
+                memcpy(digits, value, value_length);
+                char* digits_end;
+                const unsigned long value_port = strtoul(digits, &digits_end, 10);
+                if (*digits_end != '\0' || value_port == 0 || value_port > UINT16_MAX) return false;
+                *port = value_port;
+            } else if (name_length == 8 && strncasecmp(line, "Infohash", 8) == 0) {
+                announced = announced || hex_matches(value, value_length, info_hash);
+            } else if (name_length == 6 && strncasecmp(line, "cookie", 6) == 0) {
+                *cookie = value;
+                *cookie_length = value_length;
+            }
+        }
+        line = end + 1;
+    }
+    return announced && *port != 0;
+}
+
+uint32_t find_local_networks(local_network_t* networks, const uint32_t max) {
+    struct ifaddrs* interfaces;
+    if (!networks || getifaddrs(&interfaces) < 0) return 0;
+    uint32_t amount = 0;
+    for (const struct ifaddrs* i = interfaces; i && amount < max; i = i->ifa_next) {
+        if (!i->ifa_addr || !i->ifa_netmask || i->ifa_addr->sa_family != AF_INET) continue;
+        // Loopback is always local anyway
+        if (!(i->ifa_flags & IFF_UP) || i->ifa_flags & IFF_LOOPBACK) continue;
+        networks[amount].address = ((const struct sockaddr_in*) i->ifa_addr)->sin_addr.s_addr;
+        networks[amount].mask = ((const struct sockaddr_in*) i->ifa_netmask)->sin_addr.s_addr;
+        amount++;
+    }
+    freeifaddrs(interfaces);
+    return amount;
+}
+
+bool is_local_address(const local_network_t* networks, const uint32_t network_amount, const uint32_t address) {
+    if ((ntohl(address) >> 24) == 127) return true;
+    for (uint32_t i = 0; i < network_amount && networks; ++i) {
+        if ((address & networks[i].mask) == (networks[i].address & networks[i].mask)) return true;
+    }
+    return false;
+}
+
+static void announce(lsd_t* lsd) {
+    char buffer[LSD_MESSAGE_MAX];
+    const uint32_t length = lsd_build_announce(buffer, lsd->info_hash, lsd->port, lsd->cookie);
+    struct sockaddr_in group = {0};
+    group.sin_family = AF_INET;
+    group.sin_port = htons(LSD_PORT);
+    inet_pton(AF_INET, LSD_ADDRESS, &group.sin_addr);
+    if (sendto(lsd->sockfd, buffer, length, 0, (struct sockaddr*) &group, sizeof(group)) < 0) {
+        log_printf(lsd->log_code, LOG_ERR, "Couldn't send LSD announce: %s\n", strerror(errno));
+    }
+}
+
+static void on_announce_timer(void* ctx, const uint32_t data) {
+    (void) data;
+    lsd_t* lsd = ctx;
+    wheel_timer_arm(lsd->timers, lsd->announce_timer, LSD_INTERVAL_MS);
+    announce(lsd);
+}
+
+static void on_readable(void* ctx, const uint32_t events) {
+    (void) events;
+    lsd_t* lsd = ctx;
+    char buffer[LSD_MESSAGE_MAX];
+    struct sockaddr_in source;
+    socklen_t source_length = sizeof(source);
+    ssize_t received;
+    while ((received = recvfrom(lsd->sockfd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*) &source,
+                                &source_length)) >= 0) {
+        source_length = sizeof(source);
+        uint16_t port;
+        const char* cookie;
+        uint32_t cookie_length;
+        if (source.sin_family != AF_INET ||
+            !lsd_parse_announce(buffer, received, lsd->info_hash, &port, &cookie, &cookie_length)) continue;
+        // Our own announce, looped back
+        if (cookie && cookie_length == strlen(lsd->cookie) && memcmp(cookie, lsd->cookie, cookie_length) == 0) continue;
+
+        unsigned char peer[COMPACT_PEER_V4_SIZE];
+        memcpy(peer, &source.sin_addr, 4);
+        const uint16_t network_port = htons(port);
+        memcpy(peer + 4, &network_port, 2);
+        if (LOG_ENABLED(lsd->log_code, LOG_FULL)) {
+            char address[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &source.sin_addr, address, sizeof(address));
+            log_write(LOG_FULL, "LSD peer %s:%u\n", address, port);
+        }
+        metrics_add(METRIC_LSD_PEERS, 1);
+        lsd->on_peers(lsd->ctx, peer, 1, AF_INET);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_printf(lsd->log_code, LOG_ERR, "Error while receiving LSD announces: %s\n", strerror(errno));
+    }
+}
+
+lsd_t* lsd_create(event_loop_t* loop, timer_wheel_t* timers, const unsigned char* info_hash, const uint16_t port,
+                  const peers_callback_t on_peers, void* ctx, const LOG_CODE log_code) {
+    if (!loop || !timers || !info_hash || !on_peers) return nullptr;
+    lsd_t* lsd = calloc(1, sizeof(lsd_t));
+    if (!lsd) return nullptr;
+    lsd->loop = loop;
+    lsd->timers = timers;
+    lsd->slot = -1;
+    lsd->announce_timer = TIMER_NONE;
+    memcpy(lsd->info_hash, info_hash, 20);
+    lsd->port = port;
+    lsd->on_peers = on_peers;
+    lsd->ctx = ctx;
+    lsd->log_code = log_code;
+    unsigned char cookie[LSD_COOKIE_SIZE];
+    arc4random_buf(cookie, sizeof(cookie));
+    for (uint32_t i = 0; i < LSD_COOKIE_SIZE; ++i) sprintf(lsd->cookie + 2 * i, "%02x", cookie[i]);
+
+    lsd->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    // Every client on this host listens on the same port
+    const int32_t on = 1;
+    const unsigned char ttl = LSD_TTL;
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(LSD_PORT);
+    struct ip_mreq membership = {0};
+    inet_pton(AF_INET, LSD_ADDRESS, &membership.imr_multiaddr);
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (lsd->sockfd < 0 || setsockopt(lsd->sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(lsd->sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+        bind(lsd->sockfd, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+        setsockopt(lsd->sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0 ||
+        setsockopt(lsd->sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        log_printf(log_code, LOG_ERR, "Couldn't join the LSD multicast group: %s\n", strerror(errno));
+        lsd_free(lsd);
+        return nullptr;
+    }
+
+    lsd->slot = loop_add_source(loop, lsd->sockfd, EPOLLIN, on_readable, lsd);
+    lsd->announce_timer = wheel_timer_new(timers, on_announce_timer, lsd, 0);
+    if (lsd->slot < 0 || lsd->announce_timer == TIMER_NONE) {
+        lsd_free(lsd);
+        return nullptr;
+    }
+    // Without a port there's nothing to announce, peers on the network are still listened to
+    if (port != 0) {
+        wheel_timer_arm(timers, lsd->announce_timer, LSD_INTERVAL_MS);
+        announce(lsd);
+    }
+    log_printf(log_code, LOG_SUMM, "Local Service Discovery on %s:%u\n", LSD_ADDRESS, LSD_PORT);
+    return lsd;
+}
+
+void lsd_free(lsd_t* lsd) {
+    if (lsd == nullptr) return;
+    wheel_timer_delete(lsd->timers, lsd->announce_timer);
+    loop_remove_source(lsd->loop, lsd->slot);
+    // Closing it leaves the group
+    if (lsd->sockfd >= 0) close(lsd->sockfd);
+    free(lsd);
+}
@@ -0,0 +1,117 @@
+#ifndef BITTORRENT_CLIENT_LSD_H
+#define BITTORRENT_CLIENT_LSD_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "announcer.h"
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+/// @brief Multicast group announces are sent to (BEP 14)
+#define LSD_ADDRESS "239.192.152.143"
+/// @brief Port of LSD_ADDRESS
+#define LSD_PORT 6771
+/// @brief Milliseconds between announces. BEP 14 asks for no more than one a minute per torrent
+#define LSD_INTERVAL_MS (5 * 60 * 1000)
+/// @brief Hops announces may take, so they stay on the local segment
+#define LSD_TTL 1
+/// @brief Random bytes of the cookie telling our own announces apart, sent in hex
+#define LSD_COOKIE_SIZE 8
+/// @brief Largest announce sent or received
+#define LSD_MESSAGE_MAX 1024
+/// @brief Networks of local interfaces kept, the rest aren't taken as local
+#define LSD_MAX_NETWORKS 16
+
+/// @brief Network of a local interface. Both are kept in network endianness
+typedef struct local_network_t {
+    uint32_t address; /**< IPv4 address of the interface */
+    uint32_t mask; /**< Its netmask */
+} local_network_t;
+
+/**
+ * Local Service Discovery (BEP 14) of a torrent: announces it to the multicast group of the local segment, and
+ * gives out the peers that announce it there. Runs on a single UDP socket registered in an event loop.
+ */
+typedef struct {
+    event_loop_t *loop; /**< Loop the socket is registered in */
+    timer_wheel_t *timers; /**< Timers of the loop */
+    int32_t sockfd; /**< UDP socket, member of LSD_ADDRESS */
+    int32_t slot; /**< Source slot of sockfd in loop */
+    uint32_t announce_timer; /**< Announces every LSD_INTERVAL_MS */
+    unsigned char info_hash[20]; /**< Torrent announced */
+    uint16_t port; /**< TCP port announced, in host endianness. 0 to only listen */
+    char cookie[2 * LSD_COOKIE_SIZE + 1]; /**< Sent with our announces, which come back to us */
+    peers_callback_t on_peers; /**< Called with each peer announcing info_hash */
+    void *ctx; /**< Passed as is to on_peers */
+    LOG_CODE log_code; /**< Logging level */
+} lsd_t;
+
+/**
+ * Builds an announce of a torrent.
+ *
+ * @param buffer Where the announce is written, at least LSD_MESSAGE_MAX bytes.
+ * @param info_hash 20 bytes of the torrent's info hash.
+ * @param port TCP port peers can connect to, in host endianness.
+ * @param cookie Null-terminated cookie, telling our announces apart once they come back.
+ * @return Bytes written, without a terminator.
+ */
+uint32_t lsd_build_announce(char *buffer, const unsigned char *info_hash, uint16_t port, const char *cookie);
+
+/**
+ * Reads an announce, which may carry more than one info hash.
+ *
+ * @param message The announce, not null-terminated.
+ * @param length Bytes in message.
+ * @param info_hash 20 bytes of the info hash looked for.
+ * @param port Where the announced port is stored, in host endianness.
+ * @param cookie Where the start of the announce's cookie is stored, nullptr if it has none.
+ * @param cookie_length Where the cookie's length is stored.
+ * @return true if it's a valid announce of info_hash, false otherwise.
+ */
+bool lsd_parse_announce(const char *message, uint32_t length, const unsigned char *info_hash, uint16_t *port,
+                        const char **cookie, uint32_t *cookie_length);
+
+/**
+ * Finds the IPv4 networks of the interfaces that are up.
+ *
+ * @param networks Where the networks are stored.
+ * @param max Networks networks has room for.
+ * @return Networks found.
+ */
+uint32_t find_local_networks(local_network_t *networks, uint32_t max);
+
+/**
+ * Whether an address is on the same network as one of ours, or on loopback.
+ *
+ * @param networks Networks of our interfaces.
+ * @param network_amount Networks in networks.
+ * @param address IPv4 address, in network endianness.
+ * @return true if the address is local.
+ */
+bool is_local_address(const local_network_t *networks, uint32_t network_amount, uint32_t address);
+
+/**
+ * Joins the LSD multicast group and announces a torrent right away, then every LSD_INTERVAL_MS.
+ *
+ * @param loop Loop the socket is registered in.
+ * @param timers Timers of loop.
+ * @param info_hash 20 bytes of the torrent's info hash.
+ * @param port TCP port peers can connect to, in host endianness. 0 to only listen for other peers.
+ * @param on_peers Called with each peer announcing the torrent, in compact form.
+ * @param ctx Passed as is to on_peers.
+ * @param log_code Logging level.
+ * @return The LSD context, or nullptr if its socket couldn't join the group.
+ */
+lsd_t *lsd_create(event_loop_t *loop, timer_wheel_t *timers, const unsigned char *info_hash, uint16_t port,
+                  peers_callback_t on_peers, void *ctx, LOG_CODE log_code);
+
+/**
+ * Leaves the group and frees the LSD context.
+ *
+ * @param lsd LSD context, may be nullptr.
+ */
+void lsd_free(lsd_t *lsd);
+
+#endif //BITTORRENT_CLIENT_LSD_H
@@ -7,6 +7,7 @@
 #include "magnet.h"
 
 #include "basic_bencode.h"
+#include "logger.h"
 
 magnet_data* process_magnet(const char* magnet, const LOG_CODE log_code) {
     const int32_t length = (int32_t) strlen(magnet);
@@ -16,6 +17,7 @@ magnet_data* process_magnet(const char* magnet, const LOG_CODE log_code) {
     // Initializing pointers to null
     data->xt=nullptr;
     data->dn=nullptr;
+    data->xl=0;
     data->tr=nullptr;
     data->ws=nullptr;
     data->as=nullptr;
@@ -30,7 +32,7 @@ magnet_data* process_magnet(const char* magnet, const LOG_CODE log_code) {
     head->val = nullptr;
     ll* current = head;
     int32_t tracker_count = 0;
-    if (log_code >= LOG_SUMM) fprintf(stdout, "magnet data:\n");
+    log_printf(log_code, LOG_SUMM, "magnet data:\n");
     for (int32_t i = 0; i <= length; ++i) {
         if (magnet[i] == '&' || magnet[i] == '?' || magnet[i] == '\0') {
             //Processing previous attribute
@@ -42,10 +44,12 @@ magnet_data* process_magnet(const char* magnet, const LOG_CODE log_code) {
                             strncpy(data->xt, magnet+start+9, i-start-9);
                             data->xt[i-start-9] = '\0';
                         } else {
-                            if (log_code >= LOG_ERR) fprintf(stderr, "Invalid URN");
-                            exit(1);
+                            log_printf(log_code, LOG_ERR, "Invalid URN\n");
+                            data->tr = head;
+                            free_magnet_data(data);
+                            return nullptr;
                         }
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "xt:\n%s\n", data->xt);
+                        log_printf(log_code, LOG_SUMM, "xt:\n%s\n", data->xt);
                         break;
                     case dn:
                         data->dn = malloc(sizeof(char)*(i-start+1));
@@ -55,11 +59,11 @@ magnet_data* process_magnet(const char* magnet, const LOG_CODE log_code) {
                             } else data->dn[j] = magnet[start+j];
                         }
                         data->dn[i-start] = '\0';
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "dn:\n%s\n", data->dn);
+                        log_printf(log_code, LOG_SUMM, "dn:\n%s\n", data->dn);
                         break;
                     case xl:
-                        data->xl = (int32_t) decode_bencode_int(magnet+start, nullptr, log_code);
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "xl:\n%ld\n", data->xl);
+                        data->xl = (int64_t) decode_bencode_int(magnet+start, nullptr, log_code);
+                        log_printf(log_code, LOG_SUMM, "xl:\n%ld\n", data->xl);
                         break;
                     case tr:
                         if (tracker_count > 0) {
@@ -69,19 +73,19 @@ magnet_data* process_magnet(const char* magnet, const LOG_CODE log_code) {
                         }
                         current->val = curl_easy_unescape(nullptr, magnet+start, i-start, nullptr);
                         tracker_count++;
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "tr:\n%s\n", current->val);
+                        log_printf(log_code, LOG_SUMM, "tr:\n%s\n", current->val);
                         break;
                     case ws:
                         data->ws = curl_easy_unescape(nullptr, magnet+start, i-start, nullptr);
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "ws:\n%s\n", data->ws);
+                        log_printf(log_code, LOG_SUMM, "ws:\n%s\n", data->ws);
                         break;
                     case as:
                         data->as = curl_easy_unescape(nullptr, magnet+start, i-start, nullptr);
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "as:\n%s\n", data->as);
+                        log_printf(log_code, LOG_SUMM, "as:\n%s\n", data->as);
                         break;
                     case xs:
                         data->xs = curl_easy_unescape(nullptr, magnet+start, i-start, nullptr);
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "xs:\n%s\n", data->xs);
+                        log_printf(log_code, LOG_SUMM, "xs:\n%s\n", data->xs);
                         break;
                     case kt:
                         data->kt = malloc(sizeof(char)*(i-start+1));
@@ -91,11 +95,11 @@ magnet_data* process_magnet(const char* magnet, const LOG_CODE log_code) {
                             } else data->kt[j] = magnet[start+j];
                         }
                         data->kt[i-start] = '\0';
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "kt:\n%s\n", data->kt);
+                        log_printf(log_code, LOG_SUMM, "kt:\n%s\n", data->kt);
                         break;
                     case mt:
                         data->mt = curl_easy_unescape(nullptr, magnet+start, i-start, nullptr);
-                        if (log_code >= LOG_SUMM) fprintf(stdout, "mt:\n%s\n", data->mt);
+                        log_printf(log_code, LOG_SUMM, "mt:\n%s\n", data->mt);
                         break;
                     case so:
                         data->so = malloc(sizeof(char)*(i-start+1));
@@ -137,6 +141,62 @@ magnet_data* process_magnet(const char* magnet, const LOG_CODE log_code) {
     return data;
 }
 
+/**
+ * Decodes hexadecimal characters, two per byte, in any case
+ * @return false if any character isn't hexadecimal
+ */
+static bool decode_hex(const char* hex, unsigned char* bytes, const uint32_t amount) {
+    for (uint32_t i = 0; i < amount; ++i) {
+        uint8_t byte = 0;
+        for (int32_t j = 0; j < 2; ++j) {
+            const char c = hex[i*2 + j];
+            uint8_t nibble;
+            if (c >= '0' && c <= '9') nibble = c - '0';
+            else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+            else return false;
+            byte = byte << 4 | nibble;
+        }
+        bytes[i] = byte;
+    }
+    return true;
+}
+
+bool magnet_info_hash(const char* xt, unsigned char* info_hash) {
+    if (!xt || !info_hash) return false;
+    const size_t length = strlen(xt);
+    if (length == 40) return decode_hex(xt, info_hash, 20);
+    // Multihash of a v2 torrent: 0x12 for SHA-256 and 0x20 for its 32 bytes, truncated like v2 peers do
+    if (length == 68 && strncmp(xt, "1220", 4) == 0) {
+        unsigned char digest[32];
+        if (!decode_hex(xt + 4, digest, 32)) return false;
+        memcpy(info_hash, digest, 20);
+        return true;
+    }
+    if (length == 32) {
+        // RFC 4648 alphabet, 5 bits per character, 160 bits in total
+        uint64_t bits = 0;
+        int32_t bit_amount = 0;
+        int32_t written = 0;
+        for (int32_t i = 0; i < 32; ++i) {
+            const char c = xt[i];
+            uint8_t value;
+            if (c >= 'A' && c <= 'Z') value = c - 'A';
+            else if (c >= 'a' && c <= 'z') value = c - 'a';
+            else if (c >= '2' && c <= '7') value = c - '2' + 26;
+            else return false;
+            bits = bits << 5 | value;
+            bit_amount += 5;
+            if (bit_amount >= 8) {
+                bit_amount -= 8;
+                info_hash[written++] = (unsigned char) (bits >> bit_amount);
+            }
+        }
+        return written == 20;
+    }
+    return false;
+}
+
 void free_magnet_data(magnet_data* magnet_data) {
     if (magnet_data->xt != nullptr) free(magnet_data->xt);
     if (magnet_data->dn != nullptr) free(magnet_data->dn);
@@ -50,11 +50,22 @@ typedef struct {
  *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
  *                 LOG_FULL (detailed logging).
  * @return A pointer to a dynamically allocated magnet_data structure containing the extracted
- *         attributes. The caller is responsible for freeing the returned structure using an
- *         appropriate function.
+ *         attributes, or nullptr if its URN isn't a BitTorrent info hash. The caller is responsible
+ *         for freeing the returned structure using an appropriate function.
  */
 magnet_data* process_magnet(const char* magnet, LOG_CODE log_code);
 
+/**
+ * Decodes the info hash of a magnet link's exact topic, given either as 40 hexadecimal characters
+ * or as 32 base32 characters, in any case. The SHA-256 multihash of a v2 torrent ("urn:btmh:1220...")
+ * is truncated to 20 bytes, as v2 peers use it in handshakes, trackers and the DHT.
+ *
+ * @param xt The exact topic, without its "urn:btih:" or "urn:btmh:" prefix.
+ * @param info_hash Where the 20-byte info hash is written.
+ * @return true on success, false if xt is none of them.
+ */
+bool magnet_info_hash(const char* xt, unsigned char* info_hash);
+
 /**
  * Frees the memory allocated for the `magnet_data` structure, including its dynamically allocated members.
  *
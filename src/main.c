@@ -8,11 +8,49 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <curl/curl.h>
 
 #include "predownload_udp.h"
+#include "listener.h"
+#include "logger.h"
 #include "magnet.h"
+#include "metadata.h"
+#include "metrics.h"
 #include "thread_runners.h"
+#include "trace.h"
+
+/**
+ * Downloads a torrent into download-folder, spreading its peers over reactors
+ * @return 0 on success, !0 on failure
+ */
+static int32_t download(metainfo_t* metainfo, const unsigned char* peer_id, listener_t* listener,
+                        const uint32_t reactors, const LOG_CODE log_code) {
+    errno = 0;
+    const int32_t mk_res = mkdir("download-folder", 0755);
+    if (mk_res == -1 && errno != 0 && errno != 17) {
+        log_printf(log_code, LOG_ERR, "Error when creating torrent directory. Errno: %d", errno);
+        return 2;
+    }
+    pthread_t disk_thread;
+    pthread_create(&disk_thread, nullptr, disk_runner, nullptr);
+
+    torrent_args_t* torrent_args = calloc(sizeof(torrent_args_t), 1);
+    torrent_args->metainfo = metainfo;
+    torrent_args->peer_id = peer_id;
+    torrent_args->listener = listener;
+    torrent_args->reactors = reactors;
+    torrent_args->log_code = log_code;
+    pthread_t torrent_thread;
+    pthread_create(&torrent_thread, nullptr, torrent_runner, torrent_args);
+
+
+    pthread_join(torrent_thread, nullptr);
+    pthread_join(disk_thread, nullptr);
+    free(torrent_args);
+    return 0;
+}
 
 int32_t main(const int32_t argc, char* argv[]) {
     // Generating peer id
@@ -21,9 +59,6 @@ int32_t main(const int32_t argc, char* argv[]) {
     peer_id[20] = '\0';
     arc4random_buf(peer_id+8, 12);
 
-    // Disable output buffering
-    setbuf(stdout, nullptr);
-    setbuf(stderr, nullptr);
     // Redirecting console output to output.log
     //freopen("output.log", "w", stdout);
 
@@ -44,72 +79,107 @@ int32_t main(const int32_t argc, char* argv[]) {
         } else log_code = LOG_NO;
     }
 
+    // Metrics, served only when an address other than "-" is given
+    const char* metrics_address = argc > 4 && strcmp(argv[4], "-") != 0 ? argv[4] : nullptr;
+    // Piece lifecycle trace, recorded only when a file to write it to is given
+    const char* trace_path = argc > 5 && strcmp(argv[5], "-") != 0 ? argv[5] : nullptr;
+    // Port peers can connect to, not listening at all with "-"
+    const bool listening = argc <= 6 || strcmp(argv[6], "-") != 0;
+    const uint16_t listen_port = argc > 6 && listening ? (uint16_t) strtoul(argv[6], nullptr, 10) : LISTENER_DEFAULT_PORT;
+    // Reactor threads peers are spread over, one per core by default
+    const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    const uint32_t reactors = argc > 7 ? (uint32_t) strtoul(argv[7], nullptr, 10) : cores > 0 ? (uint32_t) cores : 1;
+
+    // Logging from the network thread must never block on the terminal, so messages are printed by another thread
+    if (logger_start()) atexit(logger_stop);
+
     const char* command = argv[1];
-    if (log_code >= LOG_ERR) fprintf(stderr, "Logging will appear here.\n");
+    log_printf(log_code, LOG_ERR, "Logging will appear here.\n");
 
-    if (strcmp(command, "magnet") == 0) {
-        const char* magnet_link = argv[2];
-        //Check if the link begins correctly
-        if (strncmp(magnet_link, "magnet:", 7) == 0) {
-            magnet_data* data = process_magnet(magnet_link+7, 0);
+    if (strcmp(command, "magnet") != 0 && strcmp(command, "file") != 0 && strcmp(command, "resolve") != 0) {
+        log_printf(log_code, LOG_ERR, "Unknown command: %s\n", command);
+        free(peer_id);
+        return 1;
+    }
+    if (strcmp(command, "magnet") == 0 && strncmp(argv[2], "magnet:", 7) != 0) {
+        log_printf(log_code, LOG_ERR, "Invalid link: %s\n", argv[2]);
+        free(peer_id);
+        return 1;
+    }
 
+    // Before any thread starts, since it isn't thread safe
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    metrics_server_t* metrics_server = nullptr;
+    if (metrics_address) metrics_server = metrics_server_start(metrics_address, log_code);
+    if (trace_path) trace_start();
+    // Downloading goes on without it if the port is taken. Resolving doesn't upload, so it doesn't listen
+    listener_t* listener = nullptr;
+    if (listening && strcmp(command, "resolve") != 0) listener = listener_start(listen_port, LISTENER_ACCEPTORS, log_code);
 
-            //Freeing magnet data
-            free_magnet_data(data);
+    int32_t result = 0;
+    if (strcmp(command, "magnet") == 0) {
+        magnet_data* data = process_magnet(argv[2]+7, 0);
+        unsigned char info_hash[20];
+        if (data && magnet_info_hash(data->xt, info_hash)) {
+            // Peers send the info dictionary, which is wrapped into what a .torrent file would have held
+            uint64_t info_length = 0;
+            char* info = fetch_metadata(info_hash, data->tr, data->xl, peer_id, &info_length, log_code);
+            uint64_t torrent_length = 0;
+            char* torrent_buffer = info ? build_magnet_torrent(info, info_length, data->tr, data->ws, &torrent_length)
+                                        : nullptr;
+            free(info);
+            metainfo_t* metainfo = torrent_buffer ? parse_metainfo(torrent_buffer, torrent_length, log_code) : nullptr;
+            if (metainfo != nullptr) {
+                result = download(metainfo, peer_id, listener, reactors, log_code);
+                free_metainfo(metainfo);
+            } else result = 2;
+            // metainfo points into it, so it goes last
+            free(torrent_buffer);
         } else {
-            if (log_code >= LOG_ERR) fprintf(stderr, "Invalid link: %s\n", command);
-            free(peer_id);
-            return 1;
+            log_printf(log_code, LOG_ERR, "Unsupported info hash: %s\n", data && data->xt ? data->xt : "");
+            result = 1;
         }
-    } else if (strcmp(command, "file") == 0) {
-        char* buffer = nullptr;
-        uint64_t length = 0;
-        FILE* f = fopen(argv[2], "r");
-        if (f) {
-            fseek (f, 0, SEEK_END);
-            length = ftell (f);
-            fseek (f, 0, SEEK_SET);
-            buffer = malloc(length);
-            if (buffer) {
-                fread (buffer, 1, length, f);
-            }
-            fclose (f);
-        } else if (log_code >= LOG_ERR) fprintf(stderr, "Torrent file not found\n");
-
-        if (buffer && length != 0) {
-            errno = 0;
-            const int32_t mk_res = mkdir("download-folder", 0755);
-            if (mk_res == -1 && errno != 0 && errno != 17) {
-                if (log_code >= LOG_ERR) fprintf(stderr, "Error when creating torrent directory. Errno: %d", errno);
-                free(peer_id);
-                return 2;
-            }
-            metainfo_t* metainfo = parse_metainfo(buffer, length, log_code);
-            if (metainfo != nullptr) {
-                pthread_t disk_thread;
-                pthread_create(&disk_thread, nullptr, disk_runner, nullptr);
-
-                torrent_args_t* torrent_args = calloc(sizeof(torrent_args_t), 1);
-                torrent_args->metainfo = metainfo;
-                torrent_args->peer_id = peer_id;
-                torrent_args->log_code = log_code;
-                pthread_t torrent_thread;
-                pthread_create(&torrent_thread, nullptr, torrent_runner, torrent_args);
 
+        //Freeing magnet data
+        if (data) free_magnet_data(data);
+    } else if (strcmp(command, "resolve") == 0) {
+        // One magnet link per line, from a file or from stdin with "-"
+        FILE* links = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+        if (links) {
+            resolve_stats_t stats;
+            // Links that couldn't be resolved are counted, they don't fail the batch
+            if (!resolve_magnets(links, RESOLVE_DIRECTORY, RESOLVE_MAX_ACTIVE, peer_id, &stats, log_code)) result = 2;
+            if (links != stdin) fclose(links);
+        } else {
+            log_printf(log_code, LOG_ERR, "Couldn't open %s\n", argv[2]);
+            result = 2;
+        }
+    } else {
+        // Mapping instead of reading, so piece hashes are used in place
+        mapped_file_t* torrent_file = map_torrent_file(argv[2], log_code);
 
-                pthread_join(torrent_thread, nullptr);
-                pthread_join(disk_thread, nullptr);
-                free(torrent_args);
+        if (torrent_file) {
+            metainfo_t* metainfo = parse_metainfo(torrent_file->data, torrent_file->length, log_code);
+            if (metainfo != nullptr) {
+                result = download(metainfo, peer_id, listener, reactors, log_code);
                 free_metainfo(metainfo);
             }
-            free(buffer);
-        } else if (log_code >= LOG_ERR) fprintf(stderr, "File reading buffer error");
-    } else {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Unknown command: %s\n", command);
-        free(peer_id);
-        return 1;
+            // metainfo points into the mapping, so it goes last
+            unmap_torrent_file(torrent_file);
+        } else {
+            log_printf(log_code, LOG_ERR, "File reading buffer error");
+            result = 2;
+        }
+    }
+
+    listener_stop(listener);
+    metrics_server_stop(metrics_server);
+    if (trace_path) {
+        trace_stop();
+        trace_export(trace_path, log_code);
     }
+    curl_global_cleanup();
     free(peer_id);
-    return 0;
+    return result;
 }
 
@@ -0,0 +1,357 @@
+#include "merkle.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+
+#include "messages_types.h"
+
+void merkle_hash_leaf(const unsigned char* data, const uint32_t length, unsigned char* hash) {
+    SHA256(data, length, hash);
+}
+
+/**
+ * Hashes two sibling nodes into their parent, which may be one of them
+ */
+static void hash_pair(const unsigned char* left, const unsigned char* right, unsigned char* parent) {
+    unsigned char pair[2 * MERKLE_HASH_SIZE];
+    memcpy(pair, left, MERKLE_HASH_SIZE);
+    memcpy(pair + MERKLE_HASH_SIZE, right, MERKLE_HASH_SIZE);
+    SHA256(pair, sizeof(pair), parent);
+}
+
+void merkle_pad_hash(const uint32_t height, unsigned char* hash) {
+    // Leaves past the end of a file are all zeros, not the hash of anything
+    memset(hash, 0, MERKLE_HASH_SIZE);
+    for (uint32_t i = 0; i < height; ++i) hash_pair(hash, hash, hash);
+}
+
+uint32_t merkle_height(const uint64_t leaves) {
+    uint32_t height = 0;
+    while (height < 63 && (1ull << height) < leaves) height++;
+    return height;
+}
+
+bool merkle_root(const unsigned char* hashes, const uint32_t amount, const uint32_t height, uint32_t width,
+                 unsigned char* root) {
+    if (!hashes || !root || amount == 0 || amount > width) return false;
+    unsigned char* layer = malloc((uint64_t) amount * MERKLE_HASH_SIZE);
+    if (!layer) return false;
+    memcpy(layer, hashes, (uint64_t) amount * MERKLE_HASH_SIZE);
+    unsigned char pad[MERKLE_HASH_SIZE];
+    merkle_pad_hash(height, pad);
+    // Nodes past amount are padding, so only the real ones are hashed up each layer
+    uint32_t nodes = amount;
+    while (width > 1) {
+        for (uint32_t i = 0; i < (nodes + 1) / 2; ++i) {
+            const unsigned char* right = 2 * i + 1 < nodes ? layer + (2 * i + 1) * MERKLE_HASH_SIZE : pad;
+            hash_pair(layer + 2 * i * MERKLE_HASH_SIZE, right, layer + i * MERKLE_HASH_SIZE);
+        }
+        nodes = (nodes + 1) / 2;
+        width /= 2;
+        hash_pair(pad, pad, pad);
+    }
+    memcpy(root, layer, MERKLE_HASH_SIZE);
+    free(layer);
+    return true;
+}
+
+void merkle_climb(unsigned char* hash, uint64_t index, const unsigned char* uncles, const uint32_t uncle_amount) {
+    for (uint32_t i = 0; i < uncle_amount; ++i) {
+        const unsigned char* uncle = uncles + i * MERKLE_HASH_SIZE;
+        if (index % 2 == 0) hash_pair(hash, uncle, hash);
+        else hash_pair(uncle, hash, hash);
+        index /= 2;
+    }
+}
+
+/**
+ * Leaves of a file, one per MERKLE_BLOCK_SIZE bytes
+ */
+static uint64_t file_leaves(const files_ll* file) {
+    return ((uint64_t) file->length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+}
+
+/**
+ * Blocks of a piece holding bytes of its file. Those past it, in hybrid torrents, only hold padding
+ */
+static uint32_t piece_file_blocks(const merkle_t* merkle, const uint32_t piece) {
+    const files_ll* file = merkle->info->piece_files[piece];
+    const uint64_t offset = (uint64_t) piece * merkle->info->piece_length - file->byte_index;
+    uint64_t length = file->length - offset;
+    if (length > merkle->info->piece_length) length = merkle->info->piece_length;
+    return (length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+}
+
+static bool is_known(const merkle_t* merkle, const uint64_t block) {
+    return (__atomic_load_n(&merkle->known[block / 8], __ATOMIC_ACQUIRE) & (1u << (7 - block % 8))) != 0;
+}
+
+/**
+ * Where the leaves of a piece go, allocated the first time any is stored. Only called under mutex
+ */
+static unsigned char* piece_leaves(merkle_t* merkle, const uint32_t piece) {
+    unsigned char* leaves = merkle->leaves[piece];
+    if (!leaves) {
+        leaves = malloc((uint64_t) merkle->blocks_per_piece * MERKLE_HASH_SIZE);
+        // Published before any known bit, so readers that see the bit see the pointer
+        if (leaves) __atomic_store_n(&merkle->leaves[piece], leaves, __ATOMIC_RELEASE);
+    }
+    return leaves;
+}
+
+/**
+ * Stores consecutive leaves of a piece, then marks them known
+ */
+static void store_leaves(merkle_t* merkle, const uint32_t piece, const uint32_t first, const unsigned char* hashes,
+                         const uint32_t amount) {
+    pthread_mutex_lock(&merkle->mutex);
+    unsigned char* leaves = piece_leaves(merkle, piece);
+    for (uint32_t i = 0; leaves && i < amount; ++i) {
+        const uint64_t block = (uint64_t) piece * merkle->blocks_per_piece + first + i;
+        if (is_known(merkle, block)) continue;
+        memcpy(leaves + (uint64_t) (first + i) * MERKLE_HASH_SIZE, hashes + (uint64_t) i * MERKLE_HASH_SIZE,
+               MERKLE_HASH_SIZE);
+        __atomic_fetch_or(&merkle->known[block / 8], (unsigned char) (1u << (7 - block % 8)), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&merkle->mutex);
+}
+
+merkle_t* merkle_create(const info_t* info, const uint32_t blocks_per_piece) {
+    if (!info || !info->piece_files || info->piece_number == 0 || blocks_per_piece == 0) return nullptr;
+    merkle_t* merkle = calloc(1, sizeof(merkle_t));
+    if (!merkle) return nullptr;
+    merkle->info = info;
+    merkle->blocks_per_piece = blocks_per_piece;
+    pthread_mutex_init(&merkle->mutex, nullptr);
+    const uint64_t blocks = (uint64_t) info->piece_number * blocks_per_piece;
+    merkle->leaves = calloc(info->piece_number, sizeof(unsigned char*));
+    merkle->known = calloc((blocks + 7) / 8, 1);
+    merkle->requested = calloc((info->piece_number + 7) / 8, 1);
+    if (!merkle->leaves || !merkle->known || !merkle->requested) {
+        merkle_free(merkle);
+        return nullptr;
+    }
+
+    // A file of a single block has it as root, and a piece of a single block has it as its piece layer hash
+    for (const files_ll* file = info->files; file; file = file->next) {
+        if (file->padding || file->length == 0) continue;
+        if (file_leaves(file) == 1) {
+            store_leaves(merkle, file->first_piece, 0, file->pieces_root, 1);
+        } else if (blocks_per_piece == 1 && file->piece_layer) {
+            for (uint64_t i = 0; i < file_leaves(file); ++i) {
+                store_leaves(merkle, file->first_piece + i, 0, file->piece_layer + i * MERKLE_HASH_SIZE, 1);
+            }
+        }
+    }
+    return merkle;
+}
+
+void merkle_free(merkle_t* merkle) {
+    if (merkle == nullptr) return;
+    for (uint32_t i = 0; merkle->leaves && i < merkle->info->piece_number; ++i) free(merkle->leaves[i]);
+    pthread_mutex_destroy(&merkle->mutex);
+    free(merkle->leaves);
+    free(merkle->known);
+    free(merkle->requested);
+    free(merkle);
+}
+
+uint32_t merkle_hash_requests(merkle_t* merkle, const uint32_t piece, unsigned char* payloads) {
+    if (!merkle || !payloads || piece >= merkle->info->piece_number) return 0;
+    const files_ll* file = merkle->info->piece_files[piece];
+    const uint32_t height = merkle_height(file_leaves(file));
+    const uint32_t blocks = piece_file_blocks(merkle, piece);
+    if (height == 0 || blocks == 0) return 0;
+    bool all_known = true;
+    for (uint32_t i = 0; i < blocks && all_known; ++i) {
+        all_known = is_known(merkle, (uint64_t) piece * merkle->blocks_per_piece + i);
+    }
+    if (all_known) return 0;
+
+    // Each request asks for an aligned subtree of leaves, as large as fits in the piece and in a message
+    uint32_t width = merkle->blocks_per_piece < MERKLE_REQUEST_HASHES ? merkle->blocks_per_piece
+                                                                        : MERKLE_REQUEST_HASHES;
+    if (width > 1ull << height) width = 1u << height;
+    if (width < 2) width = 2;
+    const uint32_t amount = (blocks + width - 1) / width;
+    if (amount > MERKLE_MAX_REQUESTS) return 0;
+    const unsigned char mask = 1u << (7 - piece % 8);
+    // Claimed, a reactor that set the bit first asks for them
+    if ((__atomic_fetch_or(&merkle->requested[piece / 8], mask, __ATOMIC_RELAXED) & mask) != 0) return 0;
+
+    const uint32_t first_leaf = (piece - file->first_piece) * merkle->blocks_per_piece;
+    const uint32_t base = htonl(0);
+    const uint32_t length = htonl(width);
+    const uint32_t proof_layers = htonl(height - __builtin_ctz(width));
+    for (uint32_t i = 0; i < amount; ++i) {
+        unsigned char* payload = payloads + i * HASH_REQUEST_SIZE;
+        const uint32_t index = htonl(first_leaf + i * width);
+        memcpy(payload, file->pieces_root, MERKLE_HASH_SIZE);
+        memcpy(payload + 32, &base, 4);
+        memcpy(payload + 36, &index, 4);
+        memcpy(payload + 40, &length, 4);
+        memcpy(payload + 44, &proof_layers, 4);
+    }
+    return amount;
+}
+
+/**
+ * Finds the file whose tree has some root
+ * @return The file, nullptr if no file of the torrent has it
+ */
+static const files_ll* find_file(const merkle_t* merkle, const unsigned char* root) {
+    for (const files_ll* file = merkle->info->files; file; file = file->next) {
+        if (!file->padding && file->length > 0 && memcmp(file->pieces_root, root, MERKLE_HASH_SIZE) == 0) return file;
+    }
+    return nullptr;
+}
+
+void merkle_hashes_rejected(merkle_t* merkle, const unsigned char* payload, const uint32_t length) {
+    if (!merkle || !payload || length < HASH_REQUEST_SIZE) return;
+    const files_ll* file = find_file(merkle, payload);
+    uint32_t base, index;
+    memcpy(&base, payload + 32, 4);
+    memcpy(&index, payload + 36, 4);
+    if (!file || ntohl(base) != 0) return;
+    const uint64_t piece = file->first_piece + ntohl(index) / merkle->blocks_per_piece;
+    if (piece >= merkle->info->piece_number) return;
+    __atomic_fetch_and(&merkle->requested[piece / 8], (unsigned char) ~(1u << (7 - piece % 8)), __ATOMIC_RELAXED);
+}
+
+MERKLE_HASHES merkle_add_hashes(merkle_t* merkle, const unsigned char* payload, const uint32_t length) {
+    if (!merkle || !payload || length < HASH_REQUEST_SIZE || (length - HASH_REQUEST_SIZE) % MERKLE_HASH_SIZE != 0) {
+        return MERKLE_HASHES_INVALID;
+    }
+    const files_ll* file = find_file(merkle, payload);
+    if (!file) return MERKLE_HASHES_IGNORED;
+    uint32_t base, index, amount;
+    memcpy(&base, payload + 32, 4);
+    memcpy(&index, payload + 36, 4);
+    memcpy(&amount, payload + 40, 4);
+    base = ntohl(base);
+    index = ntohl(index);
+    amount = ntohl(amount);
+    // Only leaves are asked for
+    if (base != 0) return MERKLE_HASHES_IGNORED;
+    const uint32_t height = merkle_height(file_leaves(file));
+    const uint32_t hashes = (length - HASH_REQUEST_SIZE) / MERKLE_HASH_SIZE;
+    if (amount < 2 || amount > MERKLE_REQUEST_HASHES || (amount & (amount - 1)) != 0 || index % amount != 0 ||
+        hashes < amount || (uint64_t) index + amount > 1ull << height) return MERKLE_HASHES_INVALID;
+    const uint32_t subtree_height = __builtin_ctz(amount);
+    const uint32_t uncles = hashes - amount;
+    // Without every uncle up to the root they can't be proven, as when the peer counts proof layers otherwise
+    if (subtree_height + uncles != height) return MERKLE_HASHES_IGNORED;
+
+    const unsigned char* leaves = payload + HASH_REQUEST_SIZE;
+    unsigned char root[MERKLE_HASH_SIZE];
+    if (!merkle_root(leaves, amount, 0, amount, root)) return MERKLE_HASHES_IGNORED;
+    merkle_climb(root, index / amount, leaves + (uint64_t) amount * MERKLE_HASH_SIZE, uncles);
+    if (memcmp(root, file->pieces_root, MERKLE_HASH_SIZE) != 0) return MERKLE_HASHES_INVALID;
+
+    // Leaves past the end of the file are padding, not blocks
+    const uint64_t file_end = file_leaves(file);
+    for (uint64_t leaf = index; leaf < index + amount && leaf < file_end;) {
+        const uint32_t piece = file->first_piece + leaf / merkle->blocks_per_piece;
+        const uint32_t first = leaf % merkle->blocks_per_piece;
+        uint64_t run = merkle->blocks_per_piece - first;
+        if (run > index + amount - leaf) run = index + amount - leaf;
+        if (run > file_end - leaf) run = file_end - leaf;
+        store_leaves(merkle, piece, first, leaves + (leaf - index) * MERKLE_HASH_SIZE, run);
+        leaf += run;
+    }
+    return MERKLE_HASHES_STORED;
+}
+
+/**
+ * Bytes of a block within its file, 0 if it only holds padding
+ */
+static uint32_t block_file_bytes(const merkle_t* merkle, const uint32_t piece, const uint32_t begin,
+                                 const uint32_t length) {
+    const files_ll* file = merkle->info->piece_files[piece];
+    const uint64_t offset = (uint64_t) piece * merkle->info->piece_length + begin - file->byte_index;
+    if (offset >= (uint64_t) file->length) return 0;
+    return file->length - offset < length ? file->length - offset : length;
+}
+
+MERKLE_BLOCK merkle_check_block(const merkle_t* merkle, const uint32_t piece, const uint32_t begin,
+                                const unsigned char* data, const uint32_t length) {
+    if (!merkle || !data || piece >= merkle->info->piece_number || begin % MERKLE_BLOCK_SIZE != 0) {
+        return MERKLE_BLOCK_UNKNOWN;
+    }
+    const uint64_t block = (uint64_t) piece * merkle->blocks_per_piece + begin / MERKLE_BLOCK_SIZE;
+    const uint32_t bytes = block_file_bytes(merkle, piece, begin, length);
+    if (bytes == 0 || !is_known(merkle, block)) return MERKLE_BLOCK_UNKNOWN;
+    const unsigned char* leaves = __atomic_load_n(&merkle->leaves[piece], __ATOMIC_ACQUIRE);
+    unsigned char hash[MERKLE_HASH_SIZE];
+    merkle_hash_leaf(data, bytes, hash);
+    return memcmp(hash, leaves + (uint64_t) begin / MERKLE_BLOCK_SIZE * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE) == 0
+               ? MERKLE_BLOCK_VALID : MERKLE_BLOCK_CORRUPT;
+}
+
+int32_t merkle_check_piece(merkle_t* merkle, const uint32_t piece, const unsigned char* data, const uint32_t length,
+                           bool* corrupt) {
+    if (!merkle || !data || !corrupt || piece >= merkle->info->piece_number) return -1;
+    const files_ll* file = merkle->info->piece_files[piece];
+    const uint32_t blocks = piece_file_blocks(merkle, piece);
+    if (blocks == 0 || blocks > merkle->blocks_per_piece || (uint64_t) (blocks - 1) * MERKLE_BLOCK_SIZE >= length) {
+        return -1;
+    }
+    unsigned char* hashes = malloc((uint64_t) blocks * MERKLE_HASH_SIZE);
+    if (!hashes) return -1;
+    bool all_known = true;
+    for (uint32_t i = 0; i < blocks; ++i) {
+        const uint32_t begin = i * MERKLE_BLOCK_SIZE;
+        const uint32_t block_length = length - begin < MERKLE_BLOCK_SIZE ? length - begin : MERKLE_BLOCK_SIZE;
+        merkle_hash_leaf(data + begin, block_file_bytes(merkle, piece, begin, block_length),
+                         hashes + i * MERKLE_HASH_SIZE);
+        all_known = all_known && is_known(merkle, (uint64_t) piece * merkle->blocks_per_piece + i);
+    }
+
+    int32_t corrupt_amount = 0;
+    if (all_known) {
+        // Every block is told apart, so only the corrupt ones are downloaded again
+        const unsigned char* leaves = __atomic_load_n(&merkle->leaves[piece], __ATOMIC_ACQUIRE);
+        for (uint32_t i = 0; i < blocks; ++i) {
+            corrupt[i] = memcmp(hashes + i * MERKLE_HASH_SIZE, leaves + i * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE) != 0;
+            corrupt_amount += corrupt[i];
+        }
+        free(hashes);
+        return corrupt_amount;
+    }
+
+    // Otherwise the piece is checked whole, against its piece layer hash, or its file's root when it's all of it
+    unsigned char root[MERKLE_HASH_SIZE];
+    const unsigned char* expected = nullptr;
+    bool built;
+    if ((uint64_t) file->length <= merkle->info->piece_length) {
+        built = merkle_root(hashes, blocks, 0, 1u << merkle_height(file_leaves(file)), root);
+        expected = file->pieces_root;
+    } else {
+        built = merkle_root(hashes, blocks, 0, merkle->blocks_per_piece, root);
+        if (file->piece_layer) expected = file->piece_layer + (uint64_t) (piece - file->first_piece) * MERKLE_HASH_SIZE;
+    }
+    if (!built || !expected) {
+        free(hashes);
+        // Asked again, the peer asked before may be gone
+        __atomic_fetch_and(&merkle->requested[piece / 8], (unsigned char) ~(1u << (7 - piece % 8)),
+                           __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (memcmp(root, expected, MERKLE_HASH_SIZE) == 0) {
+        store_leaves(merkle, piece, 0, hashes, blocks);
+        free(hashes);
+        return 0;
+    }
+    // Blocks whose leaf is known are told apart, the rest can't be
+    const unsigned char* leaves = __atomic_load_n(&merkle->leaves[piece], __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < blocks; ++i) {
+        const bool known = is_known(merkle, (uint64_t) piece * merkle->blocks_per_piece + i);
+        corrupt[i] = !known || memcmp(hashes + i * MERKLE_HASH_SIZE, leaves + i * MERKLE_HASH_SIZE,
+                                      MERKLE_HASH_SIZE) != 0;
+        corrupt_amount += corrupt[i];
+    }
+    free(hashes);
+    return corrupt_amount;
+}
@@ -0,0 +1,169 @@
+#ifndef BITTORRENT_CLIENT_MERKLE_H
+#define BITTORRENT_CLIENT_MERKLE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "file.h"
+
+/// @brief Bytes of a SHA-256 hash, the hash of every node of v2 merkle trees (BEP 52)
+#define MERKLE_HASH_SIZE 32
+/// @brief Bytes of file data each leaf of a merkle tree hashes, the last one of a file may have less
+#define MERKLE_BLOCK_SIZE 16384
+/// @brief Most base layer hashes asked for in a single HASH_REQUEST, so HASHES fit in a peer's reception cache
+#define MERKLE_REQUEST_HASHES 256
+/// @brief Most HASH_REQUEST messages a piece's leaf hashes are asked in. Larger pieces aren't asked for
+#define MERKLE_MAX_REQUESTS 32
+
+/// @brief What merkle_add_hashes() made of a HASHES message
+typedef enum {
+    MERKLE_HASHES_STORED, /**< The hashes proved to be part of their file's tree and were kept */
+    MERKLE_HASHES_IGNORED, /**< Hashes of an unknown file, or of a layer that was never asked for */
+    MERKLE_HASHES_INVALID, /**< Hashes that don't lead to their file's root, so the peer sent garbage */
+} MERKLE_HASHES;
+
+/// @brief What merkle_check_block() made of a block
+typedef enum {
+    MERKLE_BLOCK_UNKNOWN, /**< Its leaf hash isn't known yet, or it only holds padding */
+    MERKLE_BLOCK_VALID, /**< It matches its leaf hash */
+    MERKLE_BLOCK_CORRUPT, /**< It doesn't match its leaf hash */
+} MERKLE_BLOCK;
+
+/**
+ * Leaf hashes of a v2 or hybrid torrent, one per block, learned from HASHES messages or from verified pieces. Blocks
+ * whose leaf hash is known are verified on their own as they arrive. Shared by every reactor: hashes are only
+ * written under mutex, and read once their bit in known is set.
+ */
+typedef struct merkle_t {
+    const info_t *info; /**< Info of the torrent */
+    uint32_t blocks_per_piece; /**< Blocks in a piece, indexing leaves the same way as the block tracker */
+    unsigned char **leaves; /**< Leaf hashes of each piece, MERKLE_HASH_SIZE bytes per block. Allocated the first
+                             * time one of them is stored, so only pieces being downloaded take memory */
+    unsigned char *known; /**< Bitfield of the blocks whose leaf hash is in leaves, read and set atomically */
+    unsigned char *requested; /**< Bitfield of the pieces whose leaf hashes were asked for, changed atomically */
+    pthread_mutex_t mutex; /**< Held while leaves are written */
+} merkle_t;
+
+/**
+ * Hashes a leaf: up to MERKLE_BLOCK_SIZE bytes of a file.
+ *
+ * @param data The bytes.
+ * @param length Bytes in data.
+ * @param hash Where the MERKLE_HASH_SIZE bytes of the hash are written.
+ */
+void merkle_hash_leaf(const unsigned char *data, uint32_t length, unsigned char *hash);
+
+/**
+ * Root of a subtree of 2^height leaves, every one of them zero, which pads layers out to a power of two.
+ *
+ * @param height Layers above the leaves, 0 for a leaf.
+ * @param hash Where the MERKLE_HASH_SIZE bytes of the hash are written.
+ */
+void merkle_pad_hash(uint32_t height, unsigned char *hash);
+
+/**
+ * Layers between a tree's leaves and its root.
+ *
+ * @param leaves Leaves of the tree, before padding.
+ * @return The smallest height whose power of two holds every leaf, 0 for a single leaf.
+ */
+uint32_t merkle_height(uint64_t leaves);
+
+/**
+ * Root of a subtree whose base is a run of nodes of some layer, padded with merkle_pad_hash() out to its width.
+ *
+ * @param hashes The nodes, MERKLE_HASH_SIZE bytes each.
+ * @param amount Nodes in hashes, at most width.
+ * @param height Layer of the nodes, 0 for leaves.
+ * @param width Nodes of the subtree's base, a power of two.
+ * @param root Where the MERKLE_HASH_SIZE bytes of the root are written.
+ * @return false if amount is 0 or more than width, or memory ran out.
+ */
+bool merkle_root(const unsigned char *hashes, uint32_t amount, uint32_t height, uint32_t width, unsigned char *root);
+
+/**
+ * Climbs from a node to an ancestor, hashing it with each of its uncles in turn.
+ *
+ * @param hash The node, where its ancestor is written.
+ * @param index Index of the node in its layer.
+ * @param uncles Sibling of the node, then of its parent and so on, MERKLE_HASH_SIZE bytes each.
+ * @param uncle_amount Layers to climb.
+ */
+void merkle_climb(unsigned char *hash, uint64_t index, const unsigned char *uncles, uint32_t uncle_amount);
+
+/**
+ * Creates the leaf store of a v2 or hybrid torrent. Leaves known from the torrent itself, those of files with a
+ * single block and of files whose piece layer has one block per piece, are known right away.
+ *
+ * @param info Info of the torrent, with meta_version 2. Must outlive the store.
+ * @param blocks_per_piece Blocks in a piece.
+ * @return The store, or nullptr on failure.
+ */
+merkle_t *merkle_create(const info_t *info, uint32_t blocks_per_piece);
+
+/**
+ * Frees a leaf store.
+ *
+ * @param merkle The store, may be nullptr.
+ */
+void merkle_free(merkle_t *merkle);
+
+/**
+ * Builds the HASH_REQUEST payloads asking for a piece's leaf hashes, with the uncles proving them up to the file's
+ * root, unless they're known or already asked for. The piece is then taken as asked for.
+ *
+ * @param merkle The store.
+ * @param piece Index of the piece.
+ * @param payloads Where the payloads are written, HASH_REQUEST_SIZE bytes each, room for MERKLE_MAX_REQUESTS.
+ * @return Payloads written, 0 if nothing needs to be asked.
+ */
+uint32_t merkle_hash_requests(merkle_t *merkle, uint32_t piece, unsigned char *payloads);
+
+/**
+ * Takes the pieces a HASH_REJECT covers as not asked for, so their hashes are asked of other peers.
+ *
+ * @param merkle The store.
+ * @param payload The HASH_REJECT payload.
+ * @param length Bytes in payload.
+ */
+void merkle_hashes_rejected(merkle_t *merkle, const unsigned char *payload, uint32_t length);
+
+/**
+ * Verifies the leaf hashes of a HASHES message against their file's root and keeps them.
+ *
+ * @param merkle The store.
+ * @param payload The HASHES payload: the request's fields, the base layer hashes and their uncles, bottom to top.
+ * @param length Bytes in payload.
+ * @return What was made of them.
+ */
+MERKLE_HASHES merkle_add_hashes(merkle_t *merkle, const unsigned char *payload, uint32_t length);
+
+/**
+ * Checks a block against its leaf hash. Only the bytes of the block in the file are hashed, hybrid torrents pad
+ * the last block of a file with zeros.
+ *
+ * @param merkle The store.
+ * @param piece Index of the piece.
+ * @param begin Offset of the block in the piece.
+ * @param data The block.
+ * @param length Bytes in data.
+ * @return Whether the block is known to be valid or corrupt.
+ */
+MERKLE_BLOCK merkle_check_block(const merkle_t *merkle, uint32_t piece, uint32_t begin, const unsigned char *data,
+                                uint32_t length);
+
+/**
+ * Checks a whole piece. With every leaf hash known, each block is told apart. Otherwise the leaves are hashed up to
+ * the piece layer, or to the file's root for files within a piece, and kept once they match.
+ *
+ * @param merkle The store.
+ * @param piece Index of the piece.
+ * @param data The piece.
+ * @param length Bytes in data.
+ * @param corrupt Set for each block of the piece found corrupt, an entry per block. Others are left as they are.
+ * @return Corrupt blocks, 0 if the piece is valid, or -1 if there's nothing to check it against yet.
+ */
+int32_t merkle_check_piece(merkle_t *merkle, uint32_t piece, const unsigned char *data, uint32_t length,
+                           bool *corrupt);
+
+#endif //BITTORRENT_CLIENT_MERKLE_H
@@ -8,8 +8,13 @@
 #include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <openssl/sha.h>
 
 #include "downloading.h"
+#include "logger.h"
+#include "metrics.h"
+#include "sha1.h"
+#include "trace.h"
 #include "util.h"
 
 void bitfield_to_hex(const unsigned char *bitfield, const uint32_t byte_amount, char *hex_output) {
@@ -24,30 +29,30 @@ int32_t try_connect(const int32_t sockfd, const struct sockaddr_in* peer_addr, c
     errno = 0;
     const int32_t connect_result = connect(sockfd, (struct sockaddr*) peer_addr, sizeof(struct sockaddr));
     if (connect_result < 0 && errno != EINPROGRESS) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error #%d in connect for socket: %d\n", errno, sockfd);
+        log_printf(log_code, LOG_ERR, "Error #%d in connect for socket: %d\n", errno, sockfd);
         close(sockfd);
         return 0;
     }
     return 1;
 }
 
-int32_t send_handshake(const int32_t sockfd, const unsigned char *info_hash, const unsigned char *peer_id, const LOG_CODE log_code) {
+int32_t send_handshake(peer_t *peer, const unsigned char *info_hash, const unsigned char *peer_id, const LOG_CODE log_code) {
     char buffer[HANDSHAKE_LEN] = {0};
     buffer[0] = 19;
     memcpy(buffer+1, "BitTorrent protocol", 19);
+    // Magnet links can only be downloaded from peers sending the metadata over the extension protocol
+    buffer[HANDSHAKE_RESERVED_OFFSET + EXTENSION_PROTOCOL_BYTE] |= EXTENSION_PROTOCOL_BIT;
+    buffer[HANDSHAKE_RESERVED_OFFSET + FAST_EXTENSION_BYTE] |= FAST_EXTENSION_BIT;
+    buffer[HANDSHAKE_RESERVED_OFFSET + V2_BYTE] |= V2_BIT;
     memcpy(buffer+28, info_hash, 20);
     memcpy(buffer+48, peer_id, 20);
 
     // Send handshake request
-    ssize_t total_sent = 0;
-    errno = 0;
-    while (total_sent < HANDSHAKE_LEN) {
-        const ssize_t sent = send(sockfd, buffer+total_sent, HANDSHAKE_LEN-total_sent, MSG_NOSIGNAL);
-        if (sent < 0) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "Error when sending handshake for socket: %d\n", sockfd);
-        } else total_sent+=sent;
+    if (!peer_send(peer, buffer, HANDSHAKE_LEN, log_code)) {
+        log_printf(log_code, LOG_ERR, "Error when sending handshake for socket: %d\n", peer->socket);
+        return -1;
     }
-    return (int32_t) total_sent;
+    return HANDSHAKE_LEN;
 }
 
 bool check_handshake(const unsigned char* info_hash, const unsigned char* buffer) {
@@ -72,10 +77,7 @@ bool read_message_length(const unsigned char buffer[], time_t* peer_timestamp) {
     bittorrent_message_t* message = (bittorrent_message_t*)buffer;
     message->length = ntohl(message->length);
     // keep-alive message, just update timestamp
-    if (message->length == 0) {
-        free(message);
-        return false;
-    }
+    if (message->length == 0) return false;
     // rest of messages
     return true;
 }
@@ -91,13 +93,13 @@ void handle_have(peer_t *peer, const unsigned char *payload, const unsigned char
     uint32_t p_num = 0;
     memcpy(&p_num, payload, 4);
     p_num = ntohl(p_num);
-    if (log_code == LOG_FULL) fprintf(stdout, "Received HAVE for piece %u in socket %d\n", p_num, peer->socket);
+    log_printf(log_code, LOG_FULL, "Received HAVE for piece %u in socket %d\n", p_num, peer->socket);
     // Adding the new piece to the peer's bitfield
     const uint32_t byte_index = p_num / 8;
     const uint32_t bit_offset = 7 - (p_num % 8);
     peer->bitfield[byte_index] |= (1u << bit_offset);
     // Checking my interest for peer's newly-downloaded piece
-    if ( (~client_bitfield[byte_index] & peer->bitfield[byte_index]) != 0 ) {
+    if ( (~__atomic_load_n(&client_bitfield[byte_index], __ATOMIC_RELAXED) & peer->bitfield[byte_index]) != 0 ) {
         peer->am_interested = true;
     }
 }
@@ -112,24 +114,97 @@ void handle_bitfield(peer_t *peer, const unsigned char *payload, const unsigned
     }
 
     if (payload != nullptr) {
-        if (memcmp(peer->bitfield, client_bitfield, bitfield_byte_size) != 0) {
-            memcpy(peer->bitfield, payload, bitfield_byte_size);
-            int32_t j = 0;
-            // Checking whether peer has any piece of interest
-            while (!peer->am_interested && j < (int32_t)bitfield_byte_size) {
-                if ((~client_bitfield[j] & peer->bitfield[j]) != 0) {
-                    peer->am_interested = true;
-                }
-                j++;
+        memcpy(peer->bitfield, payload, bitfield_byte_size);
+        int32_t j = 0;
+        // Checking whether peer has any piece of interest
+        while (!peer->am_interested && j < (int32_t)bitfield_byte_size) {
+            if ((~__atomic_load_n(&client_bitfield[j], __ATOMIC_RELAXED) & peer->bitfield[j]) != 0) {
+                peer->am_interested = true;
             }
+            j++;
         }
-        if (log_code == LOG_FULL) fprintf(stdout, "BITFIELD received successfully for socket %d\n", peer->socket);
+        log_printf(log_code, LOG_FULL, "BITFIELD received successfully for socket %d\n", peer->socket);
     } else {
         memset(peer->bitfield, 0, bitfield_byte_size);
-        if (log_code == LOG_FULL) fprintf(stdout, "Error receiving BITFIELD for socket %d\n", peer->socket);
+        log_printf(log_code, LOG_FULL, "Error receiving BITFIELD for socket %d\n", peer->socket);
+    }
+}
+
+void handle_have_all(peer_t* peer, const bool all, const unsigned char* client_bitfield, const uint32_t piece_number,
+                     const LOG_CODE log_code) {
+    const uint32_t bitfield_byte_size = (piece_number + 7) / 8;
+    peer->status = PEER_BITFIELD_RECEIVED;
+    if (peer->bitfield == nullptr) peer->bitfield = malloc(bitfield_byte_size);
+    if (peer->bitfield == nullptr) return;
+    memset(peer->bitfield, all ? 0xFF : 0, bitfield_byte_size);
+    log_printf(log_code, LOG_FULL, "Received %s in socket %d\n", all ? "HAVE_ALL" : "HAVE_NONE", peer->socket);
+    if (!all) return;
+    // Spare bits of the last byte stay clear, like in a BITFIELD
+    if (piece_number % 8 != 0) peer->bitfield[bitfield_byte_size - 1] = 0xFF << (8 - piece_number % 8);
+    for (uint32_t i = 0; i < bitfield_byte_size && !peer->am_interested; ++i) {
+        if ((~__atomic_load_n(&client_bitfield[i], __ATOMIC_RELAXED) & peer->bitfield[i]) != 0) {
+            peer->am_interested = true;
+        }
     }
 }
 
+/**
+ * Reads the piece index a BEP 6 message starts with
+ * @return false if it's past the last piece
+ */
+static bool read_fast_piece(const unsigned char* payload, const uint32_t piece_number, uint32_t* piece) {
+    memcpy(piece, payload, 4);
+    *piece = ntohl(*piece);
+    return *piece < piece_number;
+}
+
+void handle_allowed_fast(peer_t* peer, const unsigned char* payload, const uint32_t piece_number) {
+    uint32_t piece;
+    if (!read_fast_piece(payload, piece_number, &piece) || peer->allowed_fast_amount == ALLOWED_FAST_MAX) return;
+    for (uint32_t i = 0; i < peer->allowed_fast_amount; ++i) {
+        if (peer->allowed_fast[i] == piece) return;
+    }
+    peer->allowed_fast[peer->allowed_fast_amount++] = piece;
+}
+
+void handle_suggest_piece(peer_t* peer, const unsigned char* payload, const uint32_t piece_number) {
+    uint32_t piece;
+    if (!read_fast_piece(payload, piece_number, &piece)) return;
+    for (uint32_t i = 0; i < peer->suggested_amount; ++i) {
+        if (peer->suggested[i] == piece) return;
+    }
+    if (peer->suggested_amount == SUGGESTED_MAX) {
+        memmove(peer->suggested, peer->suggested + 1, sizeof(uint32_t) * (SUGGESTED_MAX - 1));
+        peer->suggested_amount--;
+    }
+    peer->suggested[peer->suggested_amount++] = piece;
+}
+
+bool handle_reject(peer_t* peer, const unsigned char* payload, unsigned char* requested_blocks,
+                   const uint32_t blocks_per_piece, const uint32_t piece_number) {
+    uint32_t index, begin;
+    if (!read_fast_piece(payload, piece_number, &index)) return false;
+    memcpy(&begin, payload + 4, 4);
+    begin = ntohl(begin);
+    if (begin / BLOCK_SIZE >= blocks_per_piece) return false;
+    const uint64_t block = (uint64_t) index * blocks_per_piece + begin / BLOCK_SIZE;
+    const uint32_t pending_amount = peer->pending_amount;
+    block_received(peer, requested_blocks, block);
+    if (peer->pending_amount == pending_amount) return false;
+    // The piece isn't asked of this peer again, or it would be requested and rejected over and over
+    if (!peer->peer_choking) {
+        // Until a HAVE says it can be served after all
+        if (peer->bitfield) peer->bitfield[index / 8] &= ~(1u << (7 - index % 8));
+        return true;
+    }
+    for (uint32_t i = 0; i < peer->allowed_fast_amount; ++i) {
+        if (peer->allowed_fast[i] != index) continue;
+        peer->allowed_fast[i] = peer->allowed_fast[--peer->allowed_fast_amount];
+        break;
+    }
+    return true;
+}
+
 void handle_request(const peer_t* peer, unsigned char* payload, const LOG_CODE log_code) {
     if (peer->am_choking) return;
 
@@ -161,52 +236,40 @@ void handle_request(const peer_t* peer, unsigned char* payload, const LOG_CODE l
         while (sent_bytes < buffer_size) {
             const int32_t sent = (int32_t)send(peer->socket, buffer + sent_bytes, buffer_size - sent_bytes, 0);
             if (sent < 0) {
-                if (log_code >= LOG_ERR) fprintf(stderr, "Error while sending piece in socket %d", peer->socket);
+                log_printf(log_code, LOG_ERR, "Error while sending piece in socket %d", peer->socket);
                 break;
             }
             sent_bytes += sent;
         }
+        if (sent_bytes == buffer_size) metrics_add(METRIC_BYTES_UPLOADED, request->length);
         free(buffer);
     }
 }
 
-void broadcast_have(const peer_t* peer_array, const uint32_t peer_count, const uint32_t piece_index, const LOG_CODE log_code) {
-    char* buffer = malloc(9);
-    if (!buffer) return;
+void broadcast_have(peer_t* peer_array, const uint32_t peer_count, const uint32_t piece_index, const LOG_CODE log_code) {
+    unsigned char buffer[MESSAGE_LENGTH_AND_ID_SIZE + 4];
+    // The five is the size of the id + index
+    uint32_t l = htonl(5);
+    memcpy(buffer, &l, MESSAGE_LENGTH_SIZE);
+    buffer[MESSAGE_LENGTH_SIZE] = HAVE;
+    l = htonl(piece_index);
+    memcpy(buffer + MESSAGE_LENGTH_AND_ID_SIZE, &l, MESSAGE_LENGTH_SIZE);
 
     for (int32_t j = 0; j < peer_count; ++j) {
-        if (peer_array[j].status >= PEER_HANDSHAKE_SUCCESS) {
-            // The five is the size of the id + index
-            uint32_t l = htonl(5);
-            memcpy(buffer, &l, MESSAGE_LENGTH_SIZE);
-            buffer[MESSAGE_LENGTH_SIZE] = MESSAGE_LENGTH_SIZE;
-            l = htonl(piece_index);
-            memcpy(buffer + MESSAGE_LENGTH_AND_ID_SIZE, &l, MESSAGE_LENGTH_SIZE);
-
-            int32_t sent_bytes = 0;
-            while (sent_bytes < MESSAGE_LENGTH_AND_ID_SIZE + 4) {
-                const int32_t res = (int32_t)send(peer_array[j].socket,
-                                                  buffer + sent_bytes,
-                                                  MESSAGE_LENGTH_AND_ID_SIZE + 4 - sent_bytes,
-                                                  0);
-                if (res == -1) {
-                    if (log_code >= LOG_ERR) fprintf(stderr, "Error while sending have in socket %d", peer_array[j].socket);
-                    break;
-                }
-                sent_bytes += res;
-            }
+        if (peer_array[j].status >= PEER_HANDSHAKE_SUCCESS &&
+            !peer_send(&peer_array[j], buffer, sizeof(buffer), LOG_NO)) {
+            log_printf(log_code, LOG_ERR, "Error while sending have in socket %d\n", peer_array[j].socket);
         }
     }
-    free(buffer);
 }
 
 int64_t write_block(const unsigned char* buffer, const uint64_t amount, FILE* file, const LOG_CODE log_code) {
     const uint32_t bytes_written = fwrite(buffer, 1, amount, file);
     if (bytes_written != amount) {
-        if (log_code >= LOG_ERR) if (log_code == LOG_FULL) fprintf(stdout, "Failed to write to file %p\n", file);
+        log_printf(log_code, LOG_ERR, "Failed to write to file %p\n", file);
         return -1;
     }
-    if (log_code >= LOG_ERR) fprintf(stderr, "Wrote %d bytes to file %p\n", bytes_written, file);
+    log_printf(log_code, LOG_FULL, "Wrote %d bytes to file %p\n", bytes_written, file);
     return bytes_written;
 }
 
@@ -250,13 +313,13 @@ int32_t process_block(const piece_t *piece, const uint32_t standard_piece_size,
     while (current != nullptr && !done) {
         // If the block starts before the file ends
         if (byte_counter - current->byte_index < current->length) {
-            first_touched_file = current;
+            if (file_count == 0) first_touched_file = current;
             // To know how many bytes remain in this file
             const int64_t remaining_in_file = current->length - (byte_counter-current->byte_index);
 
-            char* filepath_char = get_path(current->path, log_code);
-            // If file not open yet
-            {
+            char* filepath_char = current->padding ? nullptr : get_path(current->path, log_code);
+            // If file not open yet. Padding is never written, it's all zeros
+            if (!current->padding) {
                 uint32_t count = 0;
                 while (!current->file_ptr && count < MAX_FILE_ATTEMPTS) {
                     current->file_ptr = fopen(filepath_char, "rb+");
@@ -288,7 +351,7 @@ int32_t process_block(const piece_t *piece, const uint32_t standard_piece_size,
                 done = true;
             } else bytes_for_this_file = remaining_in_file;
             // Advancing file pointer to proper position
-            fseeko(current->file_ptr, byte_counter - current->byte_index, SEEK_SET);
+            if (!current->padding) fseeko(current->file_ptr, byte_counter - current->byte_index, SEEK_SET);
 
             // Storing data for writing
             if (file_count != 0) {
@@ -333,7 +396,10 @@ int32_t process_block(const piece_t *piece, const uint32_t standard_piece_size,
     // TODO THIS SHOULD BE ON A DIFFERENT THREAD FROM torrent()
 
     for (uint32_t i = 0; i < file_count; ++i) {
-        const int64_t bytes_written = write_block(piece->block+block_offset, pending_bytes_current->val, current->file_ptr, log_code);
+        // Empty files between those the block touches weren't counted
+        while (current->length == 0) current = current->next;
+        const int64_t bytes_written = current->padding ? (int64_t) pending_bytes_current->val :
+                                      write_block(piece->block+block_offset, pending_bytes_current->val, current->file_ptr, log_code);
         if (bytes_written < 0) {
             // Error when writing
             free_ll_uint64_t(pending_bytes_head);
@@ -348,52 +414,273 @@ int32_t process_block(const piece_t *piece, const uint32_t standard_piece_size,
     return 0;
 }
 
-uint64_t handle_piece(const piece_t* piece, const uint32_t socket, const metainfo_t metainfo,
-                      unsigned char* client_bitfield, unsigned char* block_tracker, const uint32_t blocks_per_piece,
+uint64_t handle_piece(const unsigned char* payload, const uint32_t payload_length, const uint32_t socket,
+                      const metainfo_t metainfo, unsigned char* client_bitfield, unsigned char* block_tracker,
+                      const uint32_t blocks_per_piece, merkle_t* merkle, pthread_mutex_t* disk_mutex,
                       const LOG_CODE log_code) {
+    // Index and begin come before the block
+    if (!payload || payload_length <= 8) return 0;
     // Initializing variables and converting endianness
-    const uint32_t p_begin = ntohl(piece->begin);
-    const uint32_t p_index = ntohl(piece->index);
-    
-    uint32_t byte_index = p_index / 8;
-    uint32_t bit_offset = 7 - (p_index % 8);
+    uint32_t p_index, p_begin;
+    memcpy(&p_index, payload, 4);
+    memcpy(&p_begin, payload+4, 4);
+    p_index = ntohl(p_index);
+    p_begin = ntohl(p_begin);
+    if (p_index >= metainfo.info->piece_number || p_begin % BLOCK_SIZE != 0) return 0;
+
+    // Other reactors may be changing both bitfields, so they're read atomically
+    const uint32_t p_byte_index = p_index / 8;
+    const unsigned char p_mask = 1u << (7 - p_index % 8);
     // If this client already has the piece received
-    if ((client_bitfield[byte_index] & (1u << bit_offset)) != 0) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Piece received in socket %d already extant", socket);
+    if ((__atomic_load_n(&client_bitfield[p_byte_index], __ATOMIC_RELAXED) & p_mask) != 0) {
+        log_printf(log_code, LOG_ERR, "Piece received in socket %d already extant\n", socket);
         return 0;
     }
     // If this client already has the block received
-    const uint32_t global_block_index = p_index * blocks_per_piece + p_begin;
-    byte_index = global_block_index / 8;
-    bit_offset = 7 - (global_block_index % 8);
-    if ((block_tracker[byte_index] & (1u << bit_offset)) != 0) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Block received in socket %d belonging to piece %d already extant", socket, p_index);
+    const uint32_t global_block_index = p_index * blocks_per_piece + p_begin / BLOCK_SIZE;
+    const uint32_t byte_index = global_block_index / 8;
+    const unsigned char mask = 1u << (7 - global_block_index % 8);
+    if ((__atomic_load_n(&block_tracker[byte_index], __ATOMIC_RELAXED) & mask) != 0) {
+        log_printf(log_code, LOG_ERR, "Block received in socket %d belonging to piece %d already extant\n", socket, p_index);
         return 0;
     }
 
-    // If last piece, it's smaller
-    int64_t this_piece_length;
-    if (p_index == metainfo.info->piece_number - 1) {
-        this_piece_length = metainfo.info->length - (int64_t)p_index * (int64_t)metainfo.info->piece_length;
-    } else this_piece_length = metainfo.info->piece_length;
-
+    // The last piece is smaller, and so are those ending a file in v2 only torrents
+    const int64_t this_piece_length = piece_size(metainfo.info, p_index);
+    if (p_begin >= this_piece_length || payload_length - 8 != calc_block_size(this_piece_length, p_begin)) {
+        log_printf(log_code, LOG_ERR, "Block of wrong size received in socket %d\n", socket);
+        return 0;
+    }
 
     // DOWNLOAD
-    const int32_t block_result = process_block(piece, metainfo.info->piece_length, this_piece_length, metainfo.info->files, log_code);
-    if (block_result != 0) return 0;
+    const piece_t piece = {p_index, p_begin, (unsigned char*) payload+8};
+    if (disk_mutex) pthread_mutex_lock(disk_mutex);
+    const uint64_t write_start = monotonic_us();
+    const int32_t block_result = process_block(&piece, metainfo.info->piece_length, this_piece_length, metainfo.info->files, log_code);
+    metrics_observe(METRIC_DISK_WRITE_SECONDS, monotonic_us() - write_start);
+    // Update block tracker. Setting it and checking the piece under the lock means only the reactor whose block
+    // completed the piece sees it complete, and a block that was already there doesn't complete it again
+    const bool added = block_result == 0 &&
+                       (__atomic_fetch_or(&block_tracker[byte_index], mask, __ATOMIC_RELAXED) & mask) == 0;
+    // The piece is the last one as far as piece_complete() is concerned, so it only looks at its own blocks
+    const bool complete = added && piece_complete(block_tracker, p_index, metainfo.info->piece_length,
+                                                  (int64_t) p_index * metainfo.info->piece_length + this_piece_length);
+    unsigned char* data = complete ? malloc(this_piece_length) : nullptr;
+    const uint64_t hash_start = trace_now();
+    const bool read = data && read_piece(metainfo.info->files, data, p_index, metainfo.info->piece_length,
+                                         (uint32_t)this_piece_length, log_code);
+    if (disk_mutex) pthread_mutex_unlock(disk_mutex);
+    if (!added) return 0;
+    trace_event(TRACE_BLOCK_RECEIVED, p_index, p_begin / BLOCK_SIZE, (int32_t) socket, write_start);
+    metrics_add(METRIC_BYTES_DOWNLOADED, payload_length - 8);
+    if (!complete) return 0;
+    trace_event(TRACE_PIECE_COMPLETE, p_index, 0, (int32_t) socket, 0);
+
+
+    // All the blocks are there, but the piece only counts once its hash matches. Hashed outside the lock,
+    // so reactors keep writing blocks meanwhile
+    const uint32_t blocks_amount = (this_piece_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    bool* corrupt = calloc(blocks_amount, sizeof(bool));
+    // Blocks that failed their merkle check, or -1 when there's nothing to check the piece against
+    int32_t corrupt_amount = -1;
+    if (read && corrupt && merkle) corrupt_amount = merkle_check_piece(merkle, p_index, data, this_piece_length, corrupt);
+    if (read && corrupt_amount < 0 && metainfo.info->pieces) {
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        sha1_hash(data, this_piece_length, hash);
+        corrupt_amount = memcmp(hash, metainfo.info->pieces + (uint64_t) p_index * 20, SHA_DIGEST_LENGTH) != 0;
+        if (corrupt_amount && corrupt) memset(corrupt, true, blocks_amount * sizeof(bool));
+    }
+    free(data);
+    const bool matched = read && corrupt_amount == 0;
+    trace_event(TRACE_PIECE_HASHED, p_index, matched, (int32_t) socket, hash_start);
+    if (disk_mutex) pthread_mutex_lock(disk_mutex);
+    if (!matched) {
+        if (corrupt_amount < 0) {
+            log_printf(log_code, LOG_ERR, "No hashes to check piece %u against yet, downloading it again\n", p_index);
+        } else log_printf(log_code, LOG_ERR, "Piece %u failed its hash check, downloading it again\n", p_index);
+        metrics_add(METRIC_PIECES_FAILED, 1);
+        for (uint32_t i = 0; i < blocks_amount; ++i) {
+            // Blocks the merkle tree vouches for are kept
+            if (corrupt && corrupt_amount > 0 && !corrupt[i]) continue;
+            const uint32_t block = p_index * blocks_per_piece + i;
+            __atomic_fetch_and(&block_tracker[block / 8], (unsigned char) ~(1u << (7 - block % 8)), __ATOMIC_RELAXED);
+        }
+        if (disk_mutex) pthread_mutex_unlock(disk_mutex);
+        free(corrupt);
+        return 0;
+    }
+    free(corrupt);
+    // Mark it in the bitfield, so "have" can be sent to all peers
+    __atomic_fetch_or(&client_bitfield[p_byte_index], p_mask, __ATOMIC_RELAXED);
+    metrics_add(METRIC_PIECES_VERIFIED, 1);
+    const uint64_t flush_start = trace_now();
+    closing_files(metainfo.info->files, client_bitfield, p_index, metainfo.info->piece_length, (uint32_t)this_piece_length);
+    if (disk_mutex) pthread_mutex_unlock(disk_mutex);
+    trace_event(TRACE_PIECE_FLUSHED, p_index, 0, (int32_t) socket, flush_start);
+
+    return this_piece_length;
+}
 
-    const uint64_t this_block = calc_block_size(this_piece_length, p_begin);
-    // Update block tracker
-    block_tracker[byte_index] |= (1u << bit_offset);
-    // If all the blocks in a piece are downloaded, mark it in the bitfield and prepare
-    // to send "have" message to all peer_array
-    if (piece_complete(block_tracker, p_index, metainfo.info->piece_length, metainfo.info->length)) {
-        const uint32_t p_byte_index = p_index / 8;
-        const uint32_t p_bit_offset = 7 - (p_index % 8);
-        client_bitfield[p_byte_index] |= (1u << p_bit_offset);
+bool peer_send(peer_t* peer, const void* data, const uint32_t length, const LOG_CODE log_code) {
+    if (!peer || peer->socket < 0 || (!data && length > 0)) return false;
 
-        closing_files(metainfo.info->files, client_bitfield, p_index, metainfo.info->piece_length, (uint32_t)this_piece_length);
+    uint32_t sent_bytes = 0;
+    // Anything already queued goes first, so nothing is sent out of order
+    while (peer->send_length == 0 && sent_bytes < length) {
+        const ssize_t sent = send(peer->socket, (const unsigned char*) data + sent_bytes, length - sent_bytes,
+                                  MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_printf(log_code, LOG_ERR, "Error #%d while sending in socket %d\n", errno, peer->socket);
+            return false;
+        }
+        sent_bytes += sent;
+    }
+    if (sent_bytes == length) return true;
+
+    const uint32_t rest = length - sent_bytes;
+    if (peer->send_length + rest > SEND_QUEUE_MAX) {
+        log_printf(log_code, LOG_ERR, "Send queue full in socket %d\n", peer->socket);
+        return false;
+    }
+    if (peer->send_length + rest > peer->send_capacity) {
+        uint32_t capacity = peer->send_capacity ? peer->send_capacity * 2 : 1024;
+        while (capacity < peer->send_length + rest) capacity *= 2;
+        unsigned char* send_buffer = realloc(peer->send_buffer, capacity);
+        if (!send_buffer) return false;
+        peer->send_buffer = send_buffer;
+        peer->send_capacity = capacity;
+    }
+    memcpy(peer->send_buffer + peer->send_length, (const unsigned char*) data + sent_bytes, rest);
+    peer->send_length += rest;
+    return true;
+}
+
+int64_t flush_output(peer_t* peer, const LOG_CODE log_code) {
+    if (!peer || peer->socket < 0) return -1;
+
+    uint32_t sent_bytes = 0;
+    while (sent_bytes < peer->send_length) {
+        const ssize_t sent = send(peer->socket, peer->send_buffer + sent_bytes, peer->send_length - sent_bytes,
+                                  MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_printf(log_code, LOG_ERR, "Error #%d while flushing socket %d\n", errno, peer->socket);
+            return -1;
+        }
+        sent_bytes += sent;
     }
+    peer->send_length -= sent_bytes;
+    if (peer->send_length > 0) memmove(peer->send_buffer, peer->send_buffer + sent_bytes, peer->send_length);
+    return sent_bytes;
+}
 
-    return this_block;
+bool send_message(peer_t* peer, const MESSAGE_ID id, const unsigned char* payload, const uint32_t payload_length,
+                  const LOG_CODE log_code) {
+    // Only small messages are built this way, blocks are sent by handle_request()
+    unsigned char buffer[MESSAGE_LENGTH_AND_ID_SIZE + HASH_REQUEST_SIZE];
+    if (!peer || payload_length > HASH_REQUEST_SIZE || (payload_length > 0 && !payload)) return false;
+    const uint32_t length = htonl(1 + payload_length);
+    memcpy(buffer, &length, MESSAGE_LENGTH_SIZE);
+    buffer[MESSAGE_LENGTH_SIZE] = (unsigned char) id;
+    if (payload_length > 0) memcpy(buffer + MESSAGE_LENGTH_AND_ID_SIZE, payload, payload_length);
+
+    if (!peer_send(peer, buffer, MESSAGE_LENGTH_AND_ID_SIZE + payload_length, log_code)) {
+        log_printf(log_code, LOG_ERR, "Error while sending message %d in socket %d\n", id, peer->socket);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Requests the blocks of a piece nobody asked for yet, until PEER_QUEUE_SIZE requests are in flight. Only if the
+ * client lacks the piece and the peer has it
+ * @return false if a request couldn't be sent
+ */
+static bool request_piece(peer_t* peer, const info_t* info, const unsigned char* client_bitfield,
+                          const unsigned char* block_tracker, unsigned char* requested_blocks,
+                          const uint32_t blocks_per_piece, const uint32_t p_index, uint32_t* sent,
+                          const LOG_CODE log_code) {
+    const unsigned char mask = 1u << (7 - p_index % 8);
+    // Other reactors may be changing the client's bitfields
+    if ((__atomic_load_n(&client_bitfield[p_index / 8], __ATOMIC_RELAXED) & mask) != 0 ||
+        (peer->bitfield[p_index / 8] & mask) == 0) return true;
+
+    const int64_t this_piece_length = piece_size(info, p_index);
+    const uint32_t blocks_amount = (this_piece_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    const uint32_t queue_size = PEER_QUEUE_SIZE(peer);
+    for (uint32_t i = 0; i < blocks_amount && peer->pending_amount < queue_size; ++i) {
+        const uint32_t block = p_index * blocks_per_piece + i;
+        const unsigned char block_mask = 1u << (7 - block % 8);
+        if ((__atomic_load_n(&block_tracker[block / 8], __ATOMIC_RELAXED) & block_mask) != 0) continue;
+        // Claimed before asking for it, a reactor that set the bit first keeps it
+        if ((__atomic_fetch_or(&requested_blocks[block / 8], block_mask, __ATOMIC_RELAXED) & block_mask) != 0) continue;
+
+        request_t request;
+        request.index = htonl(p_index);
+        request.begin = htonl(i * BLOCK_SIZE);
+        request.length = htonl(calc_block_size(this_piece_length, i * BLOCK_SIZE));
+        if (!send_message(peer, REQUEST, (unsigned char*) &request, sizeof(request_t), log_code)) {
+            __atomic_fetch_and(&requested_blocks[block / 8], (unsigned char) ~block_mask, __ATOMIC_RELAXED);
+            return false;
+        }
+        peer->pending_blocks[peer->pending_amount++] = block;
+        (*sent)++;
+        trace_event(TRACE_BLOCK_REQUESTED, p_index, i, peer->socket, 0);
+    }
+    return true;
+}
+
+uint32_t request_blocks(peer_t* peer, const info_t* info, const unsigned char* client_bitfield,
+                        const unsigned char* block_tracker, unsigned char* requested_blocks,
+                        const uint32_t blocks_per_piece, const LOG_CODE log_code) {
+    if (!peer || !info || !client_bitfield || !block_tracker || !requested_blocks || !peer->bitfield) return 0;
+    if (!peer->interest_sent) return 0;
+
+    uint32_t sent = 0;
+    bool sending = true;
+    const uint32_t queue_size = PEER_QUEUE_SIZE(peer);
+    // Choking peers only answer for their Allowed Fast set
+    if (peer->peer_choking) {
+        if (!peer->fast) return 0;
+        for (uint32_t i = 0; i < peer->allowed_fast_amount && sending && peer->pending_amount < queue_size; ++i) {
+            sending = request_piece(peer, info, client_bitfield, block_tracker, requested_blocks, blocks_per_piece,
+                                    peer->allowed_fast[i], &sent, log_code);
+        }
+    } else {
+        // Pieces the peer suggested go first, it probably has them cached
+        for (uint32_t i = 0; i < peer->suggested_amount && sending && peer->pending_amount < queue_size; ++i) {
+            sending = request_piece(peer, info, client_bitfield, block_tracker, requested_blocks, blocks_per_piece,
+                                    peer->suggested[i], &sent, log_code);
+        }
+        for (uint32_t p_index = 0; p_index < info->piece_number && sending && peer->pending_amount < queue_size;
+             ++p_index) {
+            sending = request_piece(peer, info, client_bitfield, block_tracker, requested_blocks, blocks_per_piece,
+                                    p_index, &sent, log_code);
+        }
+    }
+    if (sent > 0) log_printf(log_code, LOG_FULL, "Requested %u blocks in socket %d\n", sent, peer->socket);
+    return sent;
+}
+
+void block_received(peer_t* peer, unsigned char* requested_blocks, const uint32_t block) {
+    if (!peer || !requested_blocks) return;
+    for (uint32_t i = 0; i < peer->pending_amount; ++i) {
+        if (peer->pending_blocks[i] != block) continue;
+        // Order doesn't matter, so the last one takes its place
+        peer->pending_blocks[i] = peer->pending_blocks[--peer->pending_amount];
+        __atomic_fetch_and(&requested_blocks[block / 8], (unsigned char) ~(1u << (7 - block % 8)), __ATOMIC_RELAXED);
+        return;
+    }
+}
+
+void release_requests(peer_t* peer, unsigned char* requested_blocks) {
+    if (!peer || !requested_blocks) return;
+    for (uint32_t i = 0; i < peer->pending_amount; ++i) {
+        const uint32_t block = peer->pending_blocks[i];
+        __atomic_fetch_and(&requested_blocks[block / 8], (unsigned char) ~(1u << (7 - block % 8)), __ATOMIC_RELAXED);
+    }
+    peer->pending_amount = 0;
 }
@@ -2,7 +2,9 @@
 #define MESSAGES_H
 
 #include <netinet/in.h>
+#include <pthread.h>
 #include "downloading.h"
+#include "merkle.h"
 #include "messages_types.h"
 
 #define MAX_FILE_ATTEMPTS 5
@@ -31,19 +33,19 @@ void bitfield_to_hex(const unsigned char *bitfield, uint32_t byte_amount, char *
 int32_t try_connect(int32_t sockfd, const struct sockaddr_in* peer_addr, LOG_CODE log_code);
 
 /**
- * Sends a BitTorrent handshake message through the specified socket.
+ * Sends a BitTorrent handshake message to the peer, queueing whatever the socket doesn't take right away.
  * A handshake is required to identify and establish communication with the peer.
  *
- * @param sockfd The file descriptor of the socket used to communicate with the peer.
+ * @param peer The peer to send the handshake to.
  * @param info_hash A 20-byte string representing the SHA1 hash of the torrent's info dictionary.
  * @param peer_id A 20-byte unique identifier for the peer initiating the handshake.
  * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
  *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
  *                 LOG_FULL (detailed logging).
- * @return Returns the number of bytes successfully sent (68 bytes for a complete handshake);
+ * @return Returns the number of bytes sent or queued (68 bytes for a complete handshake);
  *         returns a negative value if an error occurs while sending the handshake.
  */
-int32_t send_handshake(int32_t sockfd, const unsigned char *info_hash, const unsigned char *peer_id, LOG_CODE log_code);
+int32_t send_handshake(peer_t *peer, const unsigned char *info_hash, const unsigned char *peer_id, LOG_CODE log_code);
 
 /**
  * Validates the handshake response from a peer to ensure it complies with the expected
@@ -75,7 +77,7 @@ unsigned char* process_bitfield(const unsigned char* client_bitfield, const unsi
  *
  * This function reads the `length` field from the provided buffer and interprets it in network byte order. It updates
  * the `peer_timestamp` to the current system time. If the message length is `0`, which signifies a keep-alive message,
- * the function cleans up allocated memory for the message and returns `false`. For other messages, the function
+ * the function returns `false`. For other messages, the function
  * returns `true`, indicating further processing is required.
  *
  * Preconditions:
@@ -135,6 +137,53 @@ void handle_have(peer_t *peer, const unsigned char *payload, const unsigned char
 void handle_bitfield(peer_t *peer, const unsigned char *payload, const unsigned char *client_bitfield,
                      uint32_t bitfield_byte_size, LOG_CODE log_code);
 
+/**
+ * Processes a HAVE_ALL or HAVE_NONE message, which peers supporting the Fast Extension send instead of a BITFIELD.
+ *
+ * @param peer The peer that sent it.
+ * @param all true for HAVE_ALL, false for HAVE_NONE.
+ * @param client_bitfield Pieces this client already has, to decide whether it's interested in the peer.
+ * @param piece_number Pieces of the torrent.
+ * @param log_code Controls the verbosity of logging output.
+ */
+void handle_have_all(peer_t *peer, bool all, const unsigned char *client_bitfield, uint32_t piece_number,
+                     LOG_CODE log_code);
+
+/**
+ * Adds a piece of an ALLOWED_FAST message to the pieces the peer lets us request while it chokes us.
+ * Pieces past the last one, or beyond ALLOWED_FAST_MAX, are ignored.
+ *
+ * @param peer The peer that sent it.
+ * @param payload The message's payload, a 4-byte piece index in network byte order.
+ * @param piece_number Pieces of the torrent.
+ */
+void handle_allowed_fast(peer_t *peer, const unsigned char *payload, uint32_t piece_number);
+
+/**
+ * Adds a piece of a SUGGEST_PIECE message to the ones requested first from the peer, replacing the oldest
+ * suggestion once there are SUGGESTED_MAX.
+ *
+ * @param peer The peer that sent it.
+ * @param payload The message's payload, a 4-byte piece index in network byte order.
+ * @param piece_number Pieces of the torrent.
+ */
+void handle_suggest_piece(peer_t *peer, const unsigned char *payload, uint32_t piece_number);
+
+/**
+ * Processes a REJECT_REQUEST message, giving the block back so it can be requested again right away, from other
+ * peers. A piece rejected while the peer chokes us is taken out of its Allowed Fast set, otherwise out of its bitfield.
+ *
+ * @param peer The peer that sent it.
+ * @param payload The message's payload, laid out as a request_t in network byte order.
+ * @param requested_blocks Blocks requested from any peer and not received yet.
+ * @param blocks_per_piece Number of blocks in each piece.
+ * @param piece_number Pieces of the torrent.
+ * @return true if the block was requested from the peer, false if the rejection is for nothing pending, or for a
+ * block past the end of its piece or of the torrent.
+ */
+bool handle_reject(peer_t *peer, const unsigned char *payload, unsigned char *requested_blocks,
+                   uint32_t blocks_per_piece, uint32_t piece_number);
+
 /**
  * Handles an incoming request message from a peer. The request asks for a specific block of data
  * and, if the requested block is available, this function sends it back to the requesting peer.
@@ -153,7 +202,7 @@ void handle_request(const peer_t* peer, unsigned char* payload, LOG_CODE log_cod
  * @param piece_index The index of the piece that has been acquired.
  * @param log_code The level of logging to perform during the broadcast operation.
  */
-void broadcast_have(const peer_t* peer_array, uint32_t peer_count, uint32_t piece_index, LOG_CODE log_code);
+void broadcast_have(peer_t* peer_array, uint32_t peer_count, uint32_t piece_index, LOG_CODE log_code);
 
 /**
  * @brief Writes a specified number of bytes from a buffer to a given file.
@@ -195,20 +244,104 @@ int32_t process_block(const piece_t *piece, uint32_t standard_piece_size,
  * This function handles an incoming PIECE message by:
  * - Validating the received piece data
  * - Updating the block tracker to mark the received block
- * - Checking if the entire piece is complete
- * - Updating the client's bitfield when a piece is fully received
+ * - Checking if the entire piece is complete, and verifying it if so: against its merkle tree in v2 and hybrid
+ *   torrents, falling back to its SHA1 hash
+ * - Updating the client's bitfield when a piece is fully received and valid
  *
- * @param piece Pointer to the piece_t structure containing the piece index, byte offset, and block data
+ * A piece that fails its check has its blocks cleared from the block tracker, so they're requested again. Only the
+ * corrupt ones when the merkle tree tells them apart.
+ *
+ * Several reactors may handle blocks of the same torrent at once. The bitfield and block tracker are only changed
+ * with atomic operations, and the files, whose pointers are shared, only touched while holding disk_mutex. Only the
+ * reactor whose block completes a piece checks its hash, which happens outside of the lock.
+ *
+ * @param payload Payload of the PIECE message: index and byte offset in network byte order, followed by the block
+ * @param payload_length Length of payload in bytes
  * @param socket The socket file descriptor for the peer connection
  * @param metainfo The metainfo_t structure containing torrent file information
  * @param client_bitfield Pointer to the client's bitfield tracking downloaded pieces
  * @param block_tracker Pointer to the array tracking received blocks within pieces
  * @param blocks_per_piece Number of blocks in each piece
+ * @param merkle Leaf hashes of v2 and hybrid torrents, nullptr for v1 ones
+ * @param disk_mutex Held while the torrent's files are used, or nullptr if a single thread handles blocks
  * @param log_code Controls the verbosity of logging output
  *
- * @return The number of bytes successfully processed from the piece message
+ * @return The size in bytes of the piece, if this block completed a piece that passed its hash check. 0 otherwise
+ */
+uint64_t handle_piece(const unsigned char *payload, uint32_t payload_length, uint32_t socket, metainfo_t metainfo,
+                      unsigned char *client_bitfield, unsigned char *block_tracker, uint32_t blocks_per_piece,
+                      merkle_t *merkle, pthread_mutex_t *disk_mutex, LOG_CODE log_code);
+
+/**
+ * Sends bytes to a peer without blocking. Whatever the socket doesn't take right away is appended to the peer's
+ * send_buffer, after anything already waiting there, and sent by flush_output() once the socket is writable.
+ *
+ * @param peer The peer to send to.
+ * @param data Bytes to send.
+ * @param length Amount of bytes in data.
+ * @param log_code Controls the verbosity of logging output.
+ * @return true if the bytes were sent or queued, false if the socket failed or the queue would exceed SEND_QUEUE_MAX.
+ */
+bool peer_send(peer_t *peer, const void *data, uint32_t length, LOG_CODE log_code);
+
+/**
+ * Sends bytes queued by peer_send() until they're all sent or the socket would block.
+ *
+ * @param peer The peer whose queue is flushed.
+ * @param log_code Controls the verbosity of logging output.
+ * @return The amount of bytes sent, or -1 if the socket failed.
+ */
+int64_t flush_output(peer_t *peer, LOG_CODE log_code);
+
+/**
+ * Sends a message with a small payload, such as INTERESTED or REQUEST, through peer_send().
+ *
+ * @param peer The peer to send the message to.
+ * @param id Id of the message.
+ * @param payload Payload of the message, in network byte order. Can be nullptr if payload_length is 0.
+ * @param payload_length Length of payload in bytes. At most HASH_REQUEST_SIZE.
+ * @param log_code Controls the verbosity of logging output.
+ * @return true if the message was sent or queued, false otherwise.
+ */
+bool send_message(peer_t *peer, MESSAGE_ID id, const unsigned char *payload, uint32_t payload_length,
+                  LOG_CODE log_code);
+
+/**
+ * Requests blocks from an unchoked peer until PEER_QUEUE_SIZE requests are in flight, more for local peers. Only
+ * blocks not downloaded yet, and not requested from another peer, of pieces the peer has are asked for. Pieces
+ * the peer suggested go first.
+ * Blocks are claimed in requested_blocks atomically before being asked for, so reactors sharing it never request
+ * the same block. Choking peers supporting the Fast Extension are only asked for pieces of their Allowed Fast set.
+ *
+ * @param peer The peer to request blocks from.
+ * @param info Info of the torrent.
+ * @param client_bitfield Pieces this client already has.
+ * @param block_tracker Blocks this client already has.
+ * @param requested_blocks Blocks requested from any peer and not received yet. Updated with the new requests.
+ * @param blocks_per_piece Number of blocks in each piece.
+ * @param log_code Controls the verbosity of logging output.
+ * @return The amount of requests sent.
+ */
+uint32_t request_blocks(peer_t *peer, const info_t *info, const unsigned char *client_bitfield,
+                        const unsigned char *block_tracker, unsigned char *requested_blocks, uint32_t blocks_per_piece,
+                        LOG_CODE log_code);
+
+/**
+ * Marks a block requested from the peer as answered.
+ *
+ * @param peer The peer the block was received from.
+ * @param requested_blocks Blocks requested from any peer and not received yet.
+ * @param block Global index of the block.
+ */
+void block_received(peer_t *peer, unsigned char *requested_blocks, uint32_t block);
+
+/**
+ * Forgets every request sent to the peer, so the blocks can be requested from others.
+ * Needed when the peer chokes this client or its connection is closed.
+ *
+ * @param peer The peer.
+ * @param requested_blocks Blocks requested from any peer and not received yet.
  */
-uint64_t handle_piece(const piece_t *piece, uint32_t socket, metainfo_t metainfo, unsigned char *client_bitfield,
-                      unsigned char *block_tracker, uint32_t blocks_per_piece, LOG_CODE log_code);
+void release_requests(peer_t *peer, unsigned char *requested_blocks);
 
 #endif //MESSAGES_H
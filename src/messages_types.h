@@ -12,6 +12,22 @@
 #define MESSAGE_LENGTH_SIZE 4
 // Bittorrent message size without payload (only length and id).
 #define MESSAGE_LENGTH_AND_ID_SIZE 5
+// Byte of the handshake, counting from its first reserved one, holding the extension protocol bit (BEP 10)
+#define EXTENSION_PROTOCOL_BYTE 5
+// Set in EXTENSION_PROTOCOL_BYTE by peers that understand EXTENDED messages
+#define EXTENSION_PROTOCOL_BIT 0x10
+// Offset of the reserved bytes in a handshake
+#define HANDSHAKE_RESERVED_OFFSET 20
+// Byte of the handshake, counting from its first reserved one, holding the Fast Extension bit (BEP 6)
+#define FAST_EXTENSION_BYTE 7
+// Set in FAST_EXTENSION_BYTE by peers that understand HAVE_ALL, HAVE_NONE, SUGGEST_PIECE, REJECT_REQUEST and ALLOWED_FAST
+#define FAST_EXTENSION_BIT 0x04
+// Byte of the handshake, counting from its first reserved one, holding the v2 protocol bit (BEP 52)
+#define V2_BYTE 7
+// Set in V2_BYTE by peers that understand HASH_REQUEST, HASHES and HASH_REJECT
+#define V2_BIT 0x10
+// Payload size of HASH_REQUEST and HASH_REJECT: pieces root, base layer, index, length and proof layers
+#define HASH_REQUEST_SIZE 48
 
 /**
  * Enumeration of BitTorrent protocol message types.
@@ -26,6 +42,15 @@
  * PIECE (7): Contains the actual piece data being transferred
  * CANCEL (8): Cancels a previously requested piece
  * PORT (9): DHT port number the peer is listening on
+ * SUGGEST_PIECE (13): Piece the peer would rather be asked for (BEP 6)
+ * HAVE_ALL (14): Replaces BITFIELD for peers having every piece (BEP 6)
+ * HAVE_NONE (15): Replaces BITFIELD for peers having no piece yet (BEP 6)
+ * REJECT_REQUEST (16): Request the peer won't answer, so it can be asked of others (BEP 6)
+ * ALLOWED_FAST (17): Piece the peer lets us request even while choking us (BEP 6)
+ * EXTENDED (20): Extension protocol message, whose first payload byte is the extension's id (BEP 10)
+ * HASH_REQUEST (21): Asks for hashes of a file's merkle tree, with the uncles proving them (BEP 52)
+ * HASHES (22): Answers HASH_REQUEST with the hashes asked for (BEP 52)
+ * HASH_REJECT (23): HASH_REQUEST the peer won't answer (BEP 52)
  */
 typedef enum {
     MSG_ERROR = -1,
@@ -38,7 +63,16 @@ typedef enum {
     REQUEST,
     PIECE,
     CANCEL,
-    PORT
+    PORT,
+    SUGGEST_PIECE = 13,
+    HAVE_ALL,
+    HAVE_NONE,
+    REJECT_REQUEST,
+    ALLOWED_FAST,
+    EXTENDED = 20,
+    HASH_REQUEST,
+    HASHES,
+    HASH_REJECT
 } MESSAGE_ID;
 
 typedef int8_t MESSAGE_ID_t;
@@ -0,0 +1,852 @@
+#include "metadata.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#include "announcer.h"
+#include "basic_bencode.h"
+#include "downloading.h"
+#include "event_loop.h"
+#include "http_client.h"
+#include "logger.h"
+#include "magnet.h"
+#include "messages.h"
+#include "metrics.h"
+#include "resolver.h"
+#include "sha1.h"
+#include "timer_wheel.h"
+#include "udp_client.h"
+
+metadata_t* metadata_create(const unsigned char* info_hash) {
+    if (!info_hash) return nullptr;
+    metadata_t* metadata = calloc(1, sizeof(metadata_t));
+    if (!metadata) return nullptr;
+    memcpy(metadata->info_hash, info_hash, 20);
+    return metadata;
+}
+
+void metadata_free(metadata_t* metadata) {
+    if (metadata == nullptr) return;
+    free(metadata->data);
+    free(metadata->received);
+    free(metadata->requested_ms);
+    free(metadata);
+}
+
+bool metadata_set_size(metadata_t* metadata, const int64_t size) {
+    if (!metadata || size <= 0 || size > METADATA_MAX_SIZE) return false;
+    if (metadata->size > 0) return metadata->size == size;
+
+    const uint32_t piece_amount = (size + METADATA_PIECE_SIZE - 1) / METADATA_PIECE_SIZE;
+    metadata->data = malloc(size);
+    metadata->received = calloc(piece_amount, sizeof(bool));
+    metadata->requested_ms = calloc(piece_amount, sizeof(uint64_t));
+    if (!metadata->data || !metadata->received || !metadata->requested_ms) {
+        free(metadata->data);
+        free(metadata->received);
+        free(metadata->requested_ms);
+        metadata->data = nullptr;
+        metadata->received = nullptr;
+        metadata->requested_ms = nullptr;
+        return false;
+    }
+    metadata->size = size;
+    metadata->piece_amount = piece_amount;
+    metadata->received_amount = 0;
+    return true;
+}
+
+int32_t metadata_next_piece(metadata_t* metadata, const uint64_t now_ms) {
+    if (!metadata || metadata->size == 0) return -1;
+    for (uint32_t i = 0; i < metadata->piece_amount; ++i) {
+        if (metadata->received[i]) continue;
+        // Requests that went unanswered for too long are fair game again
+        if (metadata->requested_ms[i] != 0 && now_ms - metadata->requested_ms[i] < METADATA_REQUEST_TIMEOUT_MS) {
+            continue;
+        }
+        metadata->requested_ms[i] = now_ms;
+        return (int32_t) i;
+    }
+    return -1;
+}
+
+void metadata_release_piece(metadata_t* metadata, const uint32_t piece) {
+    if (!metadata || piece >= metadata->piece_amount) return;
+    metadata->requested_ms[piece] = 0;
+}
+
+METADATA_RESULT metadata_add_piece(metadata_t* metadata, const uint32_t piece, const unsigned char* data,
+                                   const uint32_t length) {
+    if (!metadata || !data || piece >= metadata->piece_amount || metadata->received[piece]) {
+        return METADATA_PIECE_INVALID;
+    }
+    const uint32_t offset = piece * METADATA_PIECE_SIZE;
+    const uint32_t expected = metadata->size - offset < METADATA_PIECE_SIZE ? metadata->size - offset
+                                                                            : METADATA_PIECE_SIZE;
+    if (length != expected) return METADATA_PIECE_INVALID;
+
+    memcpy(metadata->data + offset, data, length);
+    metadata->received[piece] = true;
+    metadata->requested_ms[piece] = 0;
+    if (++metadata->received_amount < metadata->piece_amount) return METADATA_PIECE_STORED;
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    sha1_hash(metadata->data, metadata->size, hash);
+    if (memcmp(hash, metadata->info_hash, SHA_DIGEST_LENGTH) == 0) return METADATA_COMPLETE;
+    // v2 torrents are known by their SHA-256 hash, truncated
+    SHA256(metadata->data, metadata->size, hash);
+    if (memcmp(hash, metadata->info_hash, SHA_DIGEST_LENGTH) == 0) return METADATA_COMPLETE;
+    // There's no telling which peer sent garbage, so everything is fetched again
+    memset(metadata->received, 0, metadata->piece_amount * sizeof(bool));
+    metadata->received_amount = 0;
+    return METADATA_HASH_MISMATCH;
+}
+
+uint32_t frame_extended(unsigned char* buffer, const uint8_t extension_id, const uint32_t payload_length) {
+    const uint32_t length = htonl(payload_length + 2);
+    memcpy(buffer, &length, MESSAGE_LENGTH_SIZE);
+    buffer[MESSAGE_LENGTH_SIZE] = EXTENDED;
+    buffer[MESSAGE_LENGTH_AND_ID_SIZE] = extension_id;
+    return payload_length + MESSAGE_LENGTH_AND_ID_SIZE + 1;
+}
+
+uint32_t build_extension_handshake(unsigned char* buffer) {
+    char* payload = (char*) buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1;
+    const int32_t written = snprintf(payload, METADATA_MESSAGE_MAX - MESSAGE_LENGTH_AND_ID_SIZE - 1,
+                                     "d1:md11:ut_metadatai%dee1:v%zu:%se", UT_METADATA_ID, strlen(CLIENT_ID),
+                                     CLIENT_ID);
+    return frame_extended(buffer, EXTENSION_HANDSHAKE_ID, written);
+}
+
+bool parse_extension_handshake(const unsigned char* payload, const uint32_t length, uint8_t* ut_metadata,
+                               int64_t* metadata_size) {
+    if (!payload || !ut_metadata || !metadata_size || length == 0 || payload[0] != 'd') return false;
+    const char* dict = (const char*) payload;
+    const char* limit = dict + length;
+    if (skip_bencode_value(dict, limit) == nullptr) return false;
+
+    *ut_metadata = 0;
+    *metadata_size = -1;
+    const char* m = find_bencode_key(dict, limit, "m");
+    if (m && *m == 'd') {
+        const char* id = find_bencode_key(m, limit, "ut_metadata");
+        int64_t value;
+        // 0 means the peer disabled it
+        if (id && read_bencode_int(id, limit, &value) && value > 0 && value <= UINT8_MAX) *ut_metadata = value;
+    }
+    const char* size = find_bencode_key(dict, limit, "metadata_size");
+    int64_t value;
+    if (size && read_bencode_int(size, limit, &value) && value > 0) *metadata_size = value;
+    return true;
+}
+
+uint32_t build_metadata_message(unsigned char* buffer, const uint8_t ut_metadata, const METADATA_MSG_TYPE type,
+                                const uint32_t piece) {
+    char* payload = (char*) buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1;
+    const int32_t written = snprintf(payload, METADATA_MESSAGE_MAX - MESSAGE_LENGTH_AND_ID_SIZE - 1,
+                                     "d8:msg_typei%de5:piecei%uee", (int32_t) type, piece);
+    return frame_extended(buffer, ut_metadata, written);
+}
+
+bool parse_metadata_message(const unsigned char* payload, const uint32_t length, int64_t* type, int64_t* piece,
+                            const unsigned char** data, uint32_t* data_length) {
+    if (!payload || !type || !piece || !data || !data_length || length == 0 || payload[0] != 'd') return false;
+    const char* dict = (const char*) payload;
+    const char* limit = dict + length;
+    // The piece follows the dictionary, outside of it
+    const char* end = skip_bencode_value(dict, limit);
+    if (end == nullptr) return false;
+
+    const char* type_value = find_bencode_key(dict, end, "msg_type");
+    const char* piece_value = find_bencode_key(dict, end, "piece");
+    if (!type_value || !piece_value || !read_bencode_int(type_value, end, type) ||
+        !read_bencode_int(piece_value, end, piece) || *piece < 0) {
+        return false;
+    }
+    *data = nullptr;
+    *data_length = 0;
+    if (*type == METADATA_DATA) {
+        *data = (const unsigned char*) end;
+        *data_length = limit - end;
+    }
+    return true;
+}
+
+char* build_magnet_torrent(const char* info, const uint64_t info_length, const ll* trackers, const char* web_seed,
+                           uint64_t* length) {
+    if (!info || !length) return nullptr;
+    // Every URL written twice, with its length and the list delimiters
+    uint64_t capacity = info_length + 64;
+    for (const ll* tracker = trackers; tracker; tracker = tracker->next) {
+        if (tracker->val) capacity += 2 * (strlen(tracker->val) + 24);
+    }
+    if (web_seed) capacity += strlen(web_seed) + 32;
+    char* torrent = malloc(capacity);
+    if (!torrent) return nullptr;
+
+    uint64_t written = 0;
+    torrent[written++] = 'd';
+    const ll* first = trackers;
+    while (first && !first->val) first = first->next;
+    if (first) {
+        written += sprintf(torrent + written, "8:announce%zu:%s13:announce-listl", strlen(first->val), first->val);
+        for (const ll* tracker = first; tracker; tracker = tracker->next) {
+            if (!tracker->val) continue;
+            written += sprintf(torrent + written, "l%zu:%se", strlen(tracker->val), tracker->val);
+        }
+        torrent[written++] = 'e';
+    }
+    written += sprintf(torrent + written, "4:info");
+    memcpy(torrent + written, info, info_length);
+    written += info_length;
+    // Keys are sorted, url-list goes after info
+    if (web_seed) written += sprintf(torrent + written, "8:url-list%zu:%s", strlen(web_seed), web_seed);
+    torrent[written++] = 'e';
+    torrent[written] = '\0';
+    *length = written;
+    return torrent;
+}
+
+/**
+ * Marks the job as finished, freeing nothing, so whoever drives the loop frees it
+ */
+static void finish_job(metadata_job_t* job, const METADATA_JOB_STATE state) {
+    job->state = state;
+    if (state == METADATA_JOB_COMPLETE) {
+        const uint64_t elapsed_us = monotonic_us() - job->start_us;
+        metrics_observe(METRIC_METADATA_SECONDS, elapsed_us);
+        log_printf(job->log_code, LOG_SUMM, "Metadata of %s fetched: %u bytes in %u pieces, in %lu ms\n",
+                   job->info.human_hash, job->metadata->size, job->metadata->piece_amount,
+                   (unsigned long) (elapsed_us / 1000));
+    } else log_printf(job->log_code, LOG_ERR, "Couldn't fetch the metadata of %s in time\n", job->info.human_hash);
+}
+
+/**
+ * Forgets the pieces requested from a closed peer, so they're asked of others right away
+ */
+static void drop_metadata_peer(metadata_job_t* job, const uint32_t index) {
+    metadata_peer_t* state = &job->peers[index];
+    for (uint32_t i = 0; i < state->pending_amount; ++i) metadata_release_piece(job->metadata, state->pending[i]);
+    state->pending_amount = 0;
+    state->ut_metadata = 0;
+}
+
+/**
+ * Asks a peer for missing pieces until METADATA_QUEUE requests are in flight. Closes the peer if sending fails
+ */
+static void request_metadata(metadata_job_t* job, const uint32_t index) {
+    peer_t* peer = &job->swarm->peer_array[index];
+    metadata_peer_t* state = &job->peers[index];
+    if (peer->status != PEER_HANDSHAKE_SUCCESS || state->ut_metadata == 0) return;
+    while (state->pending_amount < METADATA_QUEUE) {
+        const int32_t piece = metadata_next_piece(job->metadata, job->timers->now_ms);
+        if (piece < 0) return;
+        unsigned char buffer[METADATA_MESSAGE_MAX];
+        const uint32_t length = build_metadata_message(buffer, state->ut_metadata, METADATA_REQUEST, piece);
+        if (!peer_send(peer, buffer, length, job->log_code)) {
+            metadata_release_piece(job->metadata, piece);
+            close_peer(peer, job->swarm->epoll);
+            return;
+        }
+        // The timeout counts from the first request left unanswered
+        if (state->pending_amount == 0) state->since_ms = job->timers->now_ms;
+        state->pending[state->pending_amount++] = piece;
+    }
+}
+
+/**
+ * Handles a message of a peer while fetching metadata. Everything but the handshakes and ut_metadata is ignored
+ */
+static bool handle_metadata_message(void* ctx, peer_t* peer, const peer_message_t* message) {
+    metadata_job_t* job = ctx;
+    const uint32_t index = peer - job->swarm->peer_array;
+    metadata_peer_t* state = &job->peers[index];
+    const int32_t epoll = job->swarm->epoll;
+    const LOG_CODE log_code = job->log_code;
+
+    if (message->handshake) {
+        // Peers without the extension protocol can't send metadata
+        if (!check_handshake(job->metadata->info_hash, message->payload) ||
+            !(message->payload[HANDSHAKE_RESERVED_OFFSET + EXTENSION_PROTOCOL_BYTE] & EXTENSION_PROTOCOL_BIT)) {
+            close_peer(peer, epoll);
+            return false;
+        }
+        peer->status = PEER_HANDSHAKE_SUCCESS;
+        state->since_ms = job->timers->now_ms;
+        unsigned char buffer[METADATA_MESSAGE_MAX];
+        const uint32_t length = build_extension_handshake(buffer);
+        // The Fast Extension requires telling the peer which pieces we have, none without the metadata
+        const bool fast = message->payload[HANDSHAKE_RESERVED_OFFSET + FAST_EXTENSION_BYTE] & FAST_EXTENSION_BIT;
+        if (!peer_send(peer, buffer, length, log_code) ||
+            (fast && !send_message(peer, HAVE_NONE, nullptr, 0, log_code))) {
+            close_peer(peer, epoll);
+            return false;
+        }
+        return true;
+    }
+    if (message->id != EXTENDED || message->payload_length < 1) return true;
+
+    const unsigned char* payload = message->payload + 1;
+    const uint32_t payload_length = message->payload_length - 1;
+    if (message->payload[0] == EXTENSION_HANDSHAKE_ID) {
+        uint8_t ut_metadata;
+        int64_t metadata_size;
+        if (!parse_extension_handshake(payload, payload_length, &ut_metadata, &metadata_size) || ut_metadata == 0 ||
+            !metadata_set_size(job->metadata, metadata_size)) {
+            log_printf(log_code, LOG_FULL, "Peer in socket %d can't send the metadata\n", peer->socket);
+            close_peer(peer, epoll);
+            return false;
+        }
+        state->ut_metadata = ut_metadata;
+        return true;
+    }
+    if (message->payload[0] != UT_METADATA_ID) return true;
+
+    int64_t type, piece;
+    const unsigned char* data;
+    uint32_t data_length;
+    if (!parse_metadata_message(payload, payload_length, &type, &piece, &data, &data_length)) {
+        close_peer(peer, epoll);
+        return false;
+    }
+    if (type == METADATA_REQUEST) {
+        // Nothing to give until the metadata is complete
+        if (state->ut_metadata == 0) return true;
+        unsigned char buffer[METADATA_MESSAGE_MAX];
+        const uint32_t length = build_metadata_message(buffer, state->ut_metadata, METADATA_REJECT, piece);
+        if (!peer_send(peer, buffer, length, log_code)) {
+            close_peer(peer, epoll);
+            return false;
+        }
+        return true;
+    }
+
+    // Answers to requests this peer doesn't have, late ones mostly, are ignored
+    uint32_t slot = 0;
+    while (slot < state->pending_amount && state->pending[slot] != piece) slot++;
+    if (slot == state->pending_amount) return true;
+    state->pending[slot] = state->pending[--state->pending_amount];
+    state->since_ms = job->timers->now_ms;
+
+    if (type != METADATA_DATA) {
+        metadata_release_piece(job->metadata, piece);
+        close_peer(peer, epoll);
+        return false;
+    }
+    switch (metadata_add_piece(job->metadata, piece, data, data_length)) {
+        case METADATA_PIECE_INVALID:
+            metadata_release_piece(job->metadata, piece);
+            close_peer(peer, epoll);
+            return false;
+        case METADATA_HASH_MISMATCH:
+            log_printf(log_code, LOG_ERR, "Metadata doesn't match the info hash, fetching it again\n");
+            break;
+        case METADATA_COMPLETE:
+            finish_job(job, METADATA_JOB_COMPLETE);
+            return false;
+        default: ;
+    }
+    return true;
+}
+
+/**
+ * Handles an epoll event of a peer socket while fetching metadata: connection, handshake, output and messages
+ */
+static void handle_metadata_event(metadata_job_t* job, const uint32_t index, const uint32_t events) {
+    peer_t* peer = &job->swarm->peer_array[index];
+    const int32_t epoll = job->swarm->epoll;
+    const LOG_CODE log_code = job->log_code;
+
+    if (peer->status == PEER_NOTHING) {
+        int32_t err = 0;
+        socklen_t len = sizeof(err);
+        if (!(events & EPOLLOUT) || getsockopt(peer->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            log_printf(log_code, LOG_FULL, "Connection failed in socket %d\n", peer->socket);
+            close_peer(peer, epoll);
+            return;
+        }
+        peer->status = PEER_CONNECTION_SUCCESS;
+    }
+    if (peer->status == PEER_CONNECTION_SUCCESS) {
+        if (send_handshake(peer, job->metadata->info_hash, job->peer_id, log_code) < 0) {
+            close_peer(peer, epoll);
+            return;
+        }
+        peer->status = PEER_HANDSHAKE_SENT;
+        job->peers[index].since_ms = job->timers->now_ms;
+        update_interest(peer, epoll, index);
+        return;
+    }
+
+    if (events & EPOLLOUT && flush_output(peer, log_code) < 0) {
+        close_peer(peer, epoll);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        receive_messages(peer, epoll, handle_metadata_message, job, log_code);
+        if (peer->status == PEER_CLOSED || job->state != METADATA_JOB_RUNNING) return;
+        request_metadata(job, index);
+    }
+    if (peer->status != PEER_CLOSED) update_interest(peer, epoll, index);
+}
+
+/**
+ * Connects to a peer from trackers, in the first closed slot of the swarm, so it never grows past max_peers
+ * @return false if every slot is busy or the connection couldn't even be started
+ */
+static bool connect_candidate(metadata_job_t* job, const unsigned char* compact_peer) {
+    swarm_t* swarm = job->swarm;
+    uint32_t index = 0;
+    while (index < swarm->peer_amount && swarm->peer_array[index].status != PEER_CLOSED) index++;
+    if (index == swarm->peer_capacity) return false;
+    if (index == swarm->peer_amount) swarm->peer_amount++;
+
+    peer_t* peer = &swarm->peer_array[index];
+    free(peer->address);
+    free(peer->bitfield);
+    free(peer->id);
+    free(peer->send_buffer);
+    memset(peer, 0, sizeof(peer_t));
+    memset(&job->peers[index], 0, sizeof(metadata_peer_t));
+    job->peers[index].since_ms = job->timers->now_ms;
+    for (uint32_t j = 0; j < PEER_TIMER_COUNT; ++j) peer->timers[j] = TIMER_NONE;
+    peer->am_choking = true;
+    peer->peer_choking = true;
+    peer->status = PEER_CLOSED;
+    peer->socket = -1;
+    peer->address = calloc(1, sizeof(struct sockaddr_in));
+    if (!peer->address) return false;
+    peer->address->sin_family = AF_INET;
+    // Both are already in network endianness
+    memcpy(&peer->address->sin_addr, compact_peer, 4);
+    memcpy(&peer->address->sin_port, compact_peer + 4, 2);
+
+    peer->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (peer->socket < 0) return false;
+    if (connect(peer->socket, (struct sockaddr*) peer->address, sizeof(struct sockaddr_in)) < 0 &&
+        errno != EINPROGRESS) {
+        close(peer->socket);
+        peer->socket = -1;
+        return false;
+    }
+    struct epoll_event ev;
+    // EPOLLOUT means the connection attempt has finished, for good or ill
+    ev.events = EPOLLIN | EPOLLOUT | PEER_EVENT_TRIGGER;
+    ev.data.u32 = index;
+    if (epoll_ctl(swarm->epoll, EPOLL_CTL_ADD, peer->socket, &ev) < 0) {
+        close(peer->socket);
+        peer->socket = -1;
+        return false;
+    }
+    peer->epoll_events = ev.events;
+    peer->status = PEER_NOTHING;
+    return true;
+}
+
+/**
+ * Connects to waiting candidates while the swarm has free slots
+ */
+static void connect_candidates(metadata_job_t* job) {
+    while (job->candidate_amount > 0) {
+        uint32_t open = 0;
+        for (uint32_t i = 0; i < job->swarm->peer_amount; ++i) open += job->swarm->peer_array[i].status != PEER_CLOSED;
+        if (open >= job->swarm->peer_capacity) return;
+        // Last in, first out, so a candidate is taken without moving the rest
+        job->candidate_amount--;
+        connect_candidate(job, job->candidates + job->candidate_amount * COMPACT_PEER_V4_SIZE);
+    }
+}
+
+/**
+ * Queues the peers of a tracker response, skipping those already known, and connects to as many as there's room for
+ */
+static void on_job_tracker_peers(void* ctx, const unsigned char* compact_peers, const uint32_t peer_amount,
+                                 const int32_t family) {
+    metadata_job_t* job = ctx;
+    // This only supports IPv4 for now
+    if (family != AF_INET || job->state != METADATA_JOB_RUNNING) return;
+    for (uint32_t i = 0; i < peer_amount && job->candidate_amount < METADATA_MAX_CANDIDATES; ++i) {
+        const unsigned char* compact_peer = compact_peers + i * COMPACT_PEER_V4_SIZE;
+        if (compact_peer[4] == 0 && compact_peer[5] == 0) continue;
+        bool known = false;
+        for (uint32_t j = 0; j < job->candidate_amount && !known; ++j) {
+            known = memcmp(job->candidates + j * COMPACT_PEER_V4_SIZE, compact_peer, COMPACT_PEER_V4_SIZE) == 0;
+        }
+        for (uint32_t j = 0; j < job->swarm->peer_amount && !known; ++j) {
+            const peer_t* peer = &job->swarm->peer_array[j];
+            known = peer->status != PEER_CLOSED && memcmp(&peer->address->sin_addr, compact_peer, 4) == 0 &&
+                    memcmp(&peer->address->sin_port, compact_peer + 4, 2) == 0;
+        }
+        if (known) continue;
+        memcpy(job->candidates + job->candidate_amount * COMPACT_PEER_V4_SIZE, compact_peer, COMPACT_PEER_V4_SIZE);
+        job->candidate_amount++;
+    }
+    connect_candidates(job);
+}
+
+/**
+ * Handles every ready peer socket of a job, once its nested epoll instance is readable in the shared loop
+ */
+static void on_job_peers(void* ctx, const uint32_t events) {
+    (void) events;
+    metadata_job_t* job = ctx;
+    struct epoll_event peer_events[MAX_EVENTS];
+    const int32_t nfds = epoll_wait(job->swarm->epoll, peer_events, MAX_EVENTS, 0);
+    for (int32_t i = 0; i < nfds && job->state == METADATA_JOB_RUNNING; ++i) {
+        const uint32_t index = peer_events[i].data.u32;
+        // Closed earlier in this same batch
+        if (index >= job->swarm->peer_amount || job->swarm->peer_array[index].status == PEER_CLOSED) continue;
+        handle_metadata_event(job, index, peer_events[i].events);
+        if (job->swarm->peer_array[index].status == PEER_CLOSED) drop_metadata_peer(job, index);
+    }
+}
+
+/**
+ * Closes peers that are too slow to connect, handshake or answer, replaces them with candidates,
+ * and hands the pieces freed that way to the rest. Gives up once the job's deadline passes
+ */
+static void on_sweep_timer(void* ctx, const uint32_t data) {
+    (void) data;
+    metadata_job_t* job = ctx;
+    const uint64_t now_ms = job->timers->now_ms;
+    if (now_ms >= job->deadline_ms) {
+        finish_job(job, METADATA_JOB_FAILED);
+        return;
+    }
+    for (uint32_t i = 0; i < job->swarm->peer_amount; ++i) {
+        peer_t* peer = &job->swarm->peer_array[i];
+        const metadata_peer_t* state = &job->peers[i];
+        if (peer->status == PEER_CLOSED) continue;
+        uint64_t timeout_ms = PEER_HANDSHAKE_TIMEOUT_MS;
+        if (peer->status == PEER_NOTHING) timeout_ms = PEER_CONNECT_TIMEOUT_MS;
+        else if (state->pending_amount > 0) timeout_ms = METADATA_REQUEST_TIMEOUT_MS;
+        // Handshaken peers that never offered ut_metadata are of no use either
+        else if (peer->status == PEER_HANDSHAKE_SUCCESS && state->ut_metadata != 0) continue;
+        if (now_ms - state->since_ms < timeout_ms) continue;
+        close_peer(peer, job->swarm->epoll);
+        drop_metadata_peer(job, i);
+    }
+    connect_candidates(job);
+    for (uint32_t i = 0; i < job->swarm->peer_amount; ++i) {
+        request_metadata(job, i);
+        if (job->swarm->peer_array[i].status == PEER_CLOSED) drop_metadata_peer(job, i);
+        else update_interest(&job->swarm->peer_array[i], job->swarm->epoll, i);
+    }
+    wheel_timer_arm(job->timers, job->sweep_timer, METADATA_SWEEP_MS);
+}
+
+metadata_job_t* metadata_job_start(event_loop_t* loop, timer_wheel_t* timers, udp_client_t* udp_client,
+                                   http_client_t* http_client, resolver_t* resolver, const unsigned char* info_hash,
+                                   ll* trackers, const int64_t length_hint, const unsigned char* peer_id,
+                                   const uint32_t max_peers, const uint64_t timeout_ms, const LOG_CODE log_code) {
+    if (!loop || !timers || !info_hash || !peer_id || max_peers == 0) return nullptr;
+    metadata_job_t* job = calloc(1, sizeof(metadata_job_t));
+    if (!job) return nullptr;
+    job->loop = loop;
+    job->timers = timers;
+    job->slot = -1;
+    job->sweep_timer = TIMER_NONE;
+    job->peer_id = peer_id;
+    job->log_code = log_code;
+    job->start_us = monotonic_us();
+    job->deadline_ms = timers->now_ms + timeout_ms;
+    job->state = METADATA_JOB_RUNNING;
+
+    // Just enough of a metainfo for the announcer: every tracker in a single tier, and the info hash
+    memcpy(job->info.hash, info_hash, 20);
+    for (int32_t i = 0; i < 20; ++i) sprintf(job->info.human_hash + i * 2, "%02x", info_hash[i]);
+    job->tier.list = trackers;
+    job->metainfo.announce = trackers ? trackers->val : nullptr;
+    job->metainfo.announce_list = trackers && trackers->val ? &job->tier : nullptr;
+    job->metainfo.info = &job->info;
+    // Trackers may not return peers to clients with nothing left to download
+    job->torrent_stats.left = length_hint > 0 && length_hint < UINT32_MAX ? (uint32_t) length_hint : 1;
+    job->torrent_stats.key = arc4random();
+
+    job->metadata = metadata_create(info_hash);
+    job->swarm = calloc(1, sizeof(swarm_t));
+    job->peers = calloc(max_peers, sizeof(metadata_peer_t));
+    job->candidates = malloc(METADATA_MAX_CANDIDATES * COMPACT_PEER_V4_SIZE);
+    if (!job->metadata || !job->swarm || !job->peers || !job->candidates) {
+        metadata_job_free(job);
+        return nullptr;
+    }
+    job->swarm->log_code = log_code;
+    // Peers get an epoll instance of their own, so their events keep the plain swarm indices
+    job->swarm->epoll = epoll_create1(EPOLL_CLOEXEC);
+    job->swarm->peer_array = calloc(max_peers, sizeof(peer_t));
+    if (job->swarm->epoll < 0 || !job->swarm->peer_array) {
+        metadata_job_free(job);
+        return nullptr;
+    }
+    job->swarm->peer_capacity = max_peers;
+    job->slot = loop_add_source(loop, job->swarm->epoll, EPOLLIN, on_job_peers, job);
+    job->sweep_timer = wheel_timer_new(timers, on_sweep_timer, job, 0);
+    if (job->slot < 0 || job->sweep_timer == TIMER_NONE) {
+        metadata_job_free(job);
+        return nullptr;
+    }
+    wheel_timer_arm(timers, job->sweep_timer, METADATA_SWEEP_MS);
+
+    job->announcer = announcer_start(udp_client, http_client, resolver, &job->metainfo, peer_id, &job->torrent_stats,
+                                     on_job_tracker_peers, job, log_code);
+    if (job->announcer == nullptr) {
+        log_printf(log_code, LOG_ERR, "No usable tracker to find peers of %s with\n", job->info.human_hash);
+        metadata_job_free(job);
+        return nullptr;
+    }
+    return job;
+}
+
+int32_t metadata_job_tick(metadata_job_t* job, const time_t now) {
+    if (!job || job->state != METADATA_JOB_RUNNING) return EPOLL_TIMEOUT;
+    const int32_t timeout = announcer_tick(job->announcer, now);
+    return timeout < EPOLL_TIMEOUT ? timeout : EPOLL_TIMEOUT;
+}
+
+char* metadata_job_take(metadata_job_t* job, uint64_t* length) {
+    if (!job || !length || job->state != METADATA_JOB_COMPLETE || !job->metadata->data) return nullptr;
+    char* info = (char*) job->metadata->data;
+    *length = job->metadata->size;
+    job->metadata->data = nullptr;
+    return info;
+}
+
+void metadata_job_free(metadata_job_t* job) {
+    if (job == nullptr) return;
+    announcer_stop(job->announcer);
+    wheel_timer_delete(job->timers, job->sweep_timer);
+    loop_remove_source(job->loop, job->slot);
+    if (job->swarm) {
+        for (uint32_t i = 0; i < job->swarm->peer_amount; ++i) {
+            peer_t* peer = &job->swarm->peer_array[i];
+            if (peer->socket >= 0) close(peer->socket);
+            free(peer->address);
+            free(peer->bitfield);
+            free(peer->id);
+            free(peer->send_buffer);
+        }
+        if (job->swarm->epoll >= 0) close(job->swarm->epoll);
+        free(job->swarm->peer_array);
+        free(job->swarm);
+    }
+    free(job->peers);
+    free(job->candidates);
+    metadata_free(job->metadata);
+    free(job);
+}
+
+char* fetch_metadata(const unsigned char* info_hash, ll* trackers, const int64_t length_hint,
+                     const unsigned char* peer_id, uint64_t* info_length, const LOG_CODE log_code) {
+    if (!info_hash || !peer_id || !info_length) return nullptr;
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    udp_client_t* udp_client = nullptr;
+    http_client_t* http_client = nullptr;
+    resolver_t* resolver = nullptr;
+    metadata_job_t* job = nullptr;
+    if (loop && timers) {
+        udp_client = udp_client_create(loop, log_code);
+        http_client = http_client_create(loop, log_code);
+        resolver = resolver_create(loop, log_code);
+        job = metadata_job_start(loop, timers, udp_client, http_client, resolver, info_hash, trackers, length_hint,
+                                 peer_id, METADATA_MAX_PEERS, METADATA_TIMEOUT_MS, log_code);
+    }
+
+    struct epoll_event epoll_events[MAX_EVENTS];
+    while (job && job->state == METADATA_JOB_RUNNING) {
+        const int32_t timeout = timer_wheel_timeout(timers, metadata_job_tick(job, time(nullptr)));
+        const int32_t nfds = epoll_wait(loop->epoll, epoll_events, MAX_EVENTS, timeout);
+        timer_wheel_advance(timers, monotonic_coarse_ms());
+        // Tracker sockets, and the job's own epoll instance for its peers
+        for (int32_t i = 0; i < nfds; ++i) loop_dispatch(loop, &epoll_events[i]);
+    }
+
+    char* info = metadata_job_take(job, info_length);
+    // The download announces itself again right after, with the same info hash
+    metadata_job_free(job);
+    resolver_free(resolver);
+    http_client_free(http_client);
+    udp_client_free(udp_client);
+    timer_wheel_free(timers);
+    loop_free(loop);
+    return info;
+}
+
+/// @brief What every link resolved by resolve_magnets() shares
+typedef struct {
+    event_loop_t* loop; /**< Loop every job runs on */
+    timer_wheel_t* timers; /**< Timers of every job */
+    udp_client_t* udp_client; /**< Shared UDP tracker socket */
+    http_client_t* http_client; /**< Shared HTTP tracker connections */
+    resolver_t* resolver; /**< Shared tracker hostname cache */
+    const unsigned char* peer_id; /**< This client's peer id */
+    LOG_CODE log_code; /**< Logging level */
+} resolve_context_t;
+
+/// @brief A magnet link being resolved by resolve_magnets()
+typedef struct {
+    magnet_data* magnet; /**< The parsed link, whose trackers the job uses */
+    metadata_job_t* job; /**< Fetches its metadata, nullptr if the slot is free */
+} resolve_slot_t;
+
+/**
+ * Writes a resolved torrent to directory, named after its info hash
+ * @return true if the whole file was written
+ */
+static bool write_torrent_file(const char* directory, const metadata_job_t* job, const char* web_seed,
+                               const char* info, const uint64_t info_length, LOG_CODE log_code) {
+    uint64_t length = 0;
+    char* torrent = build_magnet_torrent(info, info_length, job->tier.list, web_seed, &length);
+    if (!torrent) return false;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s.torrent", directory, job->info.human_hash);
+    FILE* file = fopen(path, "wb");
+    bool written = false;
+    if (file) {
+        written = fwrite(torrent, 1, length, file) == length;
+        written = fclose(file) == 0 && written;
+    }
+    if (!written) log_printf(log_code, LOG_ERR, "Couldn't write %s\n", path);
+    free(torrent);
+    return written;
+}
+
+/**
+ * Reads links until one of them starts resolving in slot, or there are no more
+ * @return false once links is exhausted
+ */
+static bool start_next_link(resolve_slot_t* slot, FILE* links, char** line, size_t* line_capacity,
+                            const resolve_context_t* context, resolve_stats_t* stats) {
+    ssize_t read;
+    while ((read = getline(line, line_capacity, links)) >= 0) {
+        char* link = *line;
+        while (read > 0 && (link[read - 1] == '\n' || link[read - 1] == '\r' || link[read - 1] == ' ')) {
+            link[--read] = '\0';
+        }
+        if (read == 0) continue;
+        stats->links++;
+        unsigned char info_hash[20];
+        magnet_data* magnet = strncmp(link, "magnet:", 7) == 0 ? process_magnet(link + 7, LOG_NO) : nullptr;
+        metadata_job_t* job = nullptr;
+        if (magnet && magnet_info_hash(magnet->xt, info_hash)) {
+            job = metadata_job_start(context->loop, context->timers, context->udp_client, context->http_client,
+                                     context->resolver, info_hash, magnet->tr, magnet->xl, context->peer_id,
+                                     RESOLVE_PEERS_PER_LINK, RESOLVE_TIMEOUT_MS, context->log_code);
+        }
+        if (!job) {
+            log_printf(context->log_code, LOG_ERR, "Can't resolve %s\n", link);
+            if (magnet) free_magnet_data(magnet);
+            stats->failed++;
+            metrics_add(METRIC_MAGNETS_FAILED, 1);
+            continue;
+        }
+        slot->magnet = magnet;
+        slot->job = job;
+        return true;
+    }
+    return false;
+}
+
+bool resolve_magnets(FILE* links, const char* directory, uint32_t max_active, const unsigned char* peer_id,
+                     resolve_stats_t* stats, const LOG_CODE log_code) {
+    if (!links || !directory || !peer_id || !stats) return false;
+    if (max_active == 0) max_active = 1;
+    memset(stats, 0, sizeof(resolve_stats_t));
+    errno = 0;
+    if (mkdir(directory, 0755) < 0 && errno != EEXIST) {
+        log_printf(log_code, LOG_ERR, "Couldn't create %s. Errno: %d\n", directory, errno);
+        return false;
+    }
+
+    resolve_context_t context = {0};
+    context.peer_id = peer_id;
+    context.log_code = log_code;
+    context.loop = loop_create();
+    context.timers = timer_wheel_create(monotonic_coarse_ms());
+    resolve_slot_t* slots = calloc(max_active, sizeof(resolve_slot_t));
+    bool created = context.loop && context.timers && slots;
+    if (created) {
+        // Every link goes through the same tracker sockets and DNS cache
+        context.udp_client = udp_client_create(context.loop, log_code);
+        context.http_client = http_client_create(context.loop, log_code);
+        context.resolver = resolver_create(context.loop, log_code);
+        created = context.udp_client || context.http_client;
+    }
+    const uint64_t start_us = monotonic_us();
+
+    char* line = nullptr;
+    size_t line_capacity = 0;
+    bool exhausted = false;
+    struct epoll_event epoll_events[MAX_EVENTS];
+    while (created) {
+        // Links are only read as slots free up, so memory doesn't depend on how many there are
+        uint32_t active = 0;
+        for (uint32_t i = 0; i < max_active; ++i) {
+            if (!slots[i].job && !exhausted) exhausted = !start_next_link(&slots[i], links, &line, &line_capacity,
+                                                                           &context, stats);
+            active += slots[i].job != nullptr;
+        }
+        if (active == 0) break;
+
+        const time_t now = time(nullptr);
+        int32_t timeout = EPOLL_TIMEOUT;
+        for (uint32_t i = 0; i < max_active; ++i) {
+            const int32_t job_timeout = metadata_job_tick(slots[i].job, now);
+            if (job_timeout < timeout) timeout = job_timeout;
+        }
+        timeout = timer_wheel_timeout(context.timers, timeout);
+        const int32_t nfds = epoll_wait(context.loop->epoll, epoll_events, MAX_EVENTS, timeout);
+        timer_wheel_advance(context.timers, monotonic_coarse_ms());
+        for (int32_t i = 0; i < nfds; ++i) loop_dispatch(context.loop, &epoll_events[i]);
+
+        for (uint32_t i = 0; i < max_active; ++i) {
+            metadata_job_t* job = slots[i].job;
+            if (!job || job->state == METADATA_JOB_RUNNING) continue;
+            uint64_t info_length = 0;
+            char* info = metadata_job_take(job, &info_length);
+            if (info && write_torrent_file(directory, job, slots[i].magnet->ws, info, info_length, log_code)) {
+                stats->resolved++;
+                metrics_add(METRIC_MAGNETS_RESOLVED, 1);
+            } else {
+                stats->failed++;
+                metrics_add(METRIC_MAGNETS_FAILED, 1);
+            }
+            free(info);
+            metadata_job_free(job);
+            free_magnet_data(slots[i].magnet);
+            slots[i].job = nullptr;
+            slots[i].magnet = nullptr;
+        }
+    }
+    stats->elapsed_us = monotonic_us() - start_us;
+
+    // Stopped events to HTTP trackers need the loop to run a little longer
+    const time_t stop_deadline = time(nullptr) + HTTP_STOP_TIMEOUT;
+    while (context.http_client && context.http_client->requests && time(nullptr) < stop_deadline) {
+        const int32_t ready = epoll_wait(context.loop->epoll, epoll_events, MAX_EVENTS, 100);
+        for (int32_t i = 0; i < ready; ++i) loop_dispatch(context.loop, &epoll_events[i]);
+    }
+    if (LOG_ENABLED(log_code, LOG_SUMM)) {
+        const double seconds = stats->elapsed_us / 1e6;
+        log_write(LOG_SUMM, "Resolved %u of %u magnet links in %.1f s, %.2f magnets/s\n", stats->resolved,
+                  stats->links, seconds, seconds > 0 ? stats->resolved / seconds : 0.0);
+    }
+    free(line);
+    free(slots);
+    resolver_free(context.resolver);
+    http_client_free(context.http_client);
+    udp_client_free(context.udp_client);
+    timer_wheel_free(context.timers);
+    loop_free(context.loop);
+    return created;
+}
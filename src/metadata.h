@@ -0,0 +1,340 @@
+#ifndef BITTORRENT_CLIENT_METADATA_H
+#define BITTORRENT_CLIENT_METADATA_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "announcer.h"
+#include "downloading_types.h"
+#include "event_loop.h"
+#include "file.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+/// @brief Id of the extension handshake, the first payload byte of EXTENDED messages carrying it
+#define EXTENSION_HANDSHAKE_ID 0
+/// @brief Id this client asks peers to use for ut_metadata messages sent to it, in its extension handshake
+#define UT_METADATA_ID 1
+/// @brief Bytes of every metadata piece but the last one (BEP 9)
+#define METADATA_PIECE_SIZE 16384
+/// @brief Largest info dictionary accepted, so a peer can't make us allocate whatever it claims
+#define METADATA_MAX_SIZE (8 * 1024 * 1024)
+/// @brief Metadata pieces requested from each peer at once
+#define METADATA_QUEUE 4
+/// @brief Milliseconds a peer gets to answer a metadata request before it's dropped and its pieces asked of others
+#define METADATA_REQUEST_TIMEOUT_MS 15000
+/// @brief Milliseconds between checks of every peer's timeouts while fetching metadata
+#define METADATA_SWEEP_MS 1000
+/// @brief Milliseconds fetching the metadata may take before giving up
+#define METADATA_TIMEOUT_MS 300000
+/// @brief Peers connected to at once while fetching the metadata of a single magnet link
+#define METADATA_MAX_PEERS 32
+/// @brief Peers from trackers kept waiting for a free connection, the rest are dropped
+#define METADATA_MAX_CANDIDATES 200
+/// @brief Magnet links resolve_magnets() works on at once, which bounds its memory
+#define RESOLVE_MAX_ACTIVE 64
+/// @brief Peers connected to at once for each link resolve_magnets() works on
+#define RESOLVE_PEERS_PER_LINK 8
+/// @brief Milliseconds resolve_magnets() gives each link before moving on
+#define RESOLVE_TIMEOUT_MS 60000
+/// @brief Directory resolved torrents are written to
+#define RESOLVE_DIRECTORY "resolved-torrents"
+/// @brief Bytes of the longest message built here: the extension handshake or a request
+#define METADATA_MESSAGE_MAX 96
+
+/// @brief msg_type of ut_metadata messages
+typedef enum {
+    METADATA_REQUEST = 0, /**< Asks for a piece */
+    METADATA_DATA = 1, /**< Carries a piece, right after its dictionary */
+    METADATA_REJECT = 2 /**< The peer won't send a piece */
+} METADATA_MSG_TYPE;
+
+/// @brief What adding a piece of metadata did
+typedef enum {
+    METADATA_PIECE_INVALID, /**< Unknown index, wrong length or already received, nothing changed */
+    METADATA_PIECE_STORED, /**< Stored, more pieces are missing */
+    METADATA_HASH_MISMATCH, /**< It was the last piece, but the whole didn't match the info hash. Every piece is
+                                 * missing again */
+    METADATA_COMPLETE /**< It was the last piece and the info dictionary matches the info hash */
+} METADATA_RESULT;
+
+/// @brief Whether a metadata job is still going
+typedef enum {
+    METADATA_JOB_RUNNING, /**< Still fetching */
+    METADATA_JOB_COMPLETE, /**< The metadata matched the info hash and can be taken */
+    METADATA_JOB_FAILED /**< Its deadline passed first */
+} METADATA_JOB_STATE;
+
+/**
+ * The info dictionary of a magnet link being assembled from pieces, which may come from different peers
+ * in any order. The size is learnt from the first extension handshake that gives it.
+ */
+typedef struct {
+    unsigned char info_hash[20]; /**< SHA1 hash the info dictionary must match */
+    unsigned char *data; /**< Info dictionary, nullptr until its size is known */
+    uint32_t size; /**< Bytes of the info dictionary, 0 until known */
+    uint32_t piece_amount; /**< Pieces of METADATA_PIECE_SIZE bytes, the last one shorter */
+    uint32_t received_amount; /**< Pieces received since the last hash mismatch */
+    bool *received; /**< Whether each piece was received */
+    uint64_t *requested_ms; /**< When each piece was last requested, 0 if it isn't */
+} metadata_t;
+
+/// @brief What a metadata job needs to know of each peer, next to its peer_t and with the same index
+typedef struct {
+    uint8_t ut_metadata; /**< Id the peer wants for ut_metadata messages, 0 until its extension handshake gives one */
+    uint32_t pending[METADATA_QUEUE]; /**< Pieces requested from the peer and not received yet */
+    uint32_t pending_amount; /**< Entries in pending */
+    uint64_t since_ms; /**< When the peer started connecting, handshaking, or waiting for its oldest request */
+} metadata_peer_t;
+
+/**
+ * Fetches the metadata of a single magnet link on an event loop that may be shared with other jobs, as are its
+ * tracker clients. Its peers are watched by an epoll instance of their own, nested in the shared loop, so their
+ * events keep the plain swarm indices. The swarm never holds more than max_peers peers: slots of closed peers
+ * are reused for candidates returned by trackers.
+ */
+typedef struct {
+    METADATA_JOB_STATE state; /**< Whether the job is still going */
+    metadata_t *metadata; /**< Info dictionary being assembled */
+    swarm_t *swarm; /**< Peers metadata is asked of, at most max_peers */
+    metadata_peer_t *peers; /**< State of each peer of swarm */
+    unsigned char *candidates; /**< Compact IPv4 peers from trackers, waiting for a free slot */
+    uint32_t candidate_amount; /**< Peers in candidates, at most METADATA_MAX_CANDIDATES */
+    event_loop_t *loop; /**< Shared loop the swarm's epoll instance is nested in */
+    int32_t slot; /**< Source slot of the swarm's epoll instance in loop */
+    timer_wheel_t *timers; /**< Shared timers, and the clock cached for each iteration */
+    uint32_t sweep_timer; /**< Checks every peer's timeouts, and the job's deadline */
+    announcer_t *announcer; /**< Finds peers through the magnet's trackers */
+    metainfo_t metainfo; /**< Just the trackers and info hash, for the announcer */
+    info_t info; /**< Info hash of metainfo */
+    announce_list_ll tier; /**< Every tracker of the magnet link, as a single tier */
+    torrent_stats_t torrent_stats; /**< Announced to trackers */
+    const unsigned char *peer_id; /**< This client's peer id */
+    uint64_t start_us; /**< When the job started, for the time to metadata */
+    uint64_t deadline_ms; /**< When the job gives up, on the timer wheel's clock */
+    LOG_CODE log_code; /**< Logging level */
+} metadata_job_t;
+
+/// @brief Outcome of resolve_magnets()
+typedef struct {
+    uint32_t links; /**< Links read */
+    uint32_t resolved; /**< Links whose torrent was written */
+    uint32_t failed; /**< Invalid links, and those that couldn't be resolved in time */
+    uint64_t elapsed_us; /**< Time from the first link read to the last one finished */
+} resolve_stats_t;
+
+/**
+ * Creates an empty metadata assembly.
+ *
+ * @param info_hash 20-byte info hash of the torrent.
+ * @return A pointer to the assembly, or nullptr if it couldn't be allocated.
+ */
+metadata_t *metadata_create(const unsigned char *info_hash);
+
+/**
+ * Frees an assembly and the info dictionary in it.
+ *
+ * @param metadata The assembly. If nullptr, nothing is done.
+ */
+void metadata_free(metadata_t *metadata);
+
+/**
+ * Sets the size of the info dictionary, as given by a peer's extension handshake. Only the first size is taken,
+ * peers giving another one are of no use.
+ *
+ * @param metadata The assembly.
+ * @param size Size given by the peer.
+ * @return true if size is now the size of the assembly, false if it's invalid or differs from the known one.
+ */
+bool metadata_set_size(metadata_t *metadata, int64_t size);
+
+/**
+ * Picks a piece to request: one neither received nor requested within the last METADATA_REQUEST_TIMEOUT_MS,
+ * and marks it as requested.
+ *
+ * @param metadata The assembly.
+ * @param now_ms Current time, from monotonic_coarse_ms(). Never 0.
+ * @return Index of the piece, or -1 if there's none to request.
+ */
+int32_t metadata_next_piece(metadata_t *metadata, uint64_t now_ms);
+
+/**
+ * Forgets a request, so the piece can be asked of another peer right away.
+ *
+ * @param metadata The assembly.
+ * @param piece Index of the piece.
+ */
+void metadata_release_piece(metadata_t *metadata, uint32_t piece);
+
+/**
+ * Stores a piece sent by a peer. Once every piece is there, the whole is checked against the info hash.
+ *
+ * @param metadata The assembly.
+ * @param piece Index of the piece.
+ * @param data Bytes of the piece.
+ * @param length Bytes in data, which must be the piece's exact size.
+ * @return What was done with the piece.
+ */
+METADATA_RESULT metadata_add_piece(metadata_t *metadata, uint32_t piece, const unsigned char *data, uint32_t length);
+
+/**
+ * Writes the length and ids of an EXTENDED message in front of its payload, already in buffer.
+ *
+ * @param buffer Holds the payload right after the message length, the EXTENDED id and the extension id.
+ * @param extension_id Id of the extension, as the receiving peer asked for it.
+ * @param payload_length Bytes of the payload.
+ * @return Bytes of the whole message.
+ */
+uint32_t frame_extended(unsigned char *buffer, uint8_t extension_id, uint32_t payload_length);
+
+/**
+ * Builds the EXTENDED message carrying this client's extension handshake, which only offers ut_metadata.
+ *
+ * @param buffer Where the message, length included, is written. At least METADATA_MESSAGE_MAX bytes.
+ * @return Bytes written.
+ */
+uint32_t build_extension_handshake(unsigned char *buffer);
+
+/**
+ * Reads what a peer's extension handshake says about ut_metadata.
+ *
+ * @param payload The bencoded dictionary, right after the extension id.
+ * @param length Bytes in payload.
+ * @param ut_metadata Where the id the peer wants for ut_metadata messages is stored, 0 if it doesn't support them.
+ * @param metadata_size Where the size of the info dictionary is stored, -1 if the peer didn't give it.
+ * @return true on success, false if payload isn't a dictionary.
+ */
+bool parse_extension_handshake(const unsigned char *payload, uint32_t length, uint8_t *ut_metadata,
+                               int64_t *metadata_size);
+
+/**
+ * Builds a ut_metadata request or reject for a piece.
+ *
+ * @param buffer Where the message, length included, is written. At least METADATA_MESSAGE_MAX bytes.
+ * @param ut_metadata Id the peer gave for ut_metadata in its extension handshake.
+ * @param type METADATA_REQUEST or METADATA_REJECT.
+ * @param piece Index of the piece.
+ * @return Bytes written.
+ */
+uint32_t build_metadata_message(unsigned char *buffer, uint8_t ut_metadata, METADATA_MSG_TYPE type, uint32_t piece);
+
+/**
+ * Reads a ut_metadata message.
+ *
+ * @param payload The message, right after the extension id.
+ * @param length Bytes in payload.
+ * @param type Where msg_type is stored.
+ * @param piece Where the index of the piece is stored.
+ * @param data Where a pointer to the piece's bytes, following the dictionary, is stored. Only for METADATA_DATA.
+ * @param data_length Where the amount of bytes of the piece is stored, 0 for anything but METADATA_DATA.
+ * @return true on success, false if the dictionary is malformed or lacks msg_type or piece.
+ */
+bool parse_metadata_message(const unsigned char *payload, uint32_t length, int64_t *type, int64_t *piece,
+                            const unsigned char **data, uint32_t *data_length);
+
+/**
+ * Wraps an info dictionary into the contents of a .torrent file, so it can be handed to parse_metainfo().
+ * Every tracker gets its own tier of announce-list, and the first one is also the announce URL.
+ *
+ * @param info The bencoded info dictionary.
+ * @param info_length Bytes of info.
+ * @param trackers Tracker URLs of the magnet link. Nodes whose value is nullptr are skipped.
+ * @param web_seed Web seed of the magnet link (ws), written as url-list. nullptr if it has none.
+ * @param length Where the length of the result is stored.
+ * @return The bencoded torrent, followed by a zero byte that isn't counted in length. Freed by the caller.
+ *         nullptr if it couldn't be allocated.
+ */
+char *build_magnet_torrent(const char *info, uint64_t info_length, const ll *trackers, const char *web_seed,
+                           uint64_t *length);
+
+/**
+ * Starts fetching the metadata of a magnet link, announcing to its trackers right away. The job makes progress
+ * while loop is dispatched, metadata_job_tick() called and timers advanced, until its state stops being
+ * METADATA_JOB_RUNNING.
+ *
+ * @param loop Event loop the job runs on.
+ * @param timers Timer wheel advanced by whoever runs loop.
+ * @param udp_client Sends announces to UDP trackers. May be shared by several jobs.
+ * @param http_client Sends announces to HTTP trackers. May be shared by several jobs.
+ * @param resolver Resolves tracker hostnames. May be shared by several jobs.
+ * @param info_hash 20-byte info hash of the torrent.
+ * @param trackers Tracker URLs of the magnet link. Must outlive the job.
+ * @param length_hint Size of the torrent's content if the magnet link gave it, 0 otherwise. Announced as left.
+ * @param peer_id 20-byte peer id of this client. Must outlive the job.
+ * @param max_peers Most peers connected to at once.
+ * @param timeout_ms Milliseconds before the job gives up.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return The job, or nullptr if there's not a single usable tracker or it couldn't be allocated.
+ */
+metadata_job_t *metadata_job_start(event_loop_t *loop, timer_wheel_t *timers, udp_client_t *udp_client,
+                                   http_client_t *http_client, resolver_t *resolver, const unsigned char *info_hash,
+                                   ll *trackers, int64_t length_hint, const unsigned char *peer_id, uint32_t max_peers,
+                                   uint64_t timeout_ms, LOG_CODE log_code);
+
+/**
+ * Handles the job's trackers deadlines. Must be called on every iteration of the loop.
+ *
+ * @param job The job. Finished jobs and nullptr are ignored.
+ * @param now Current time.
+ * @return Milliseconds until the next deadline, at most EPOLL_TIMEOUT.
+ */
+int32_t metadata_job_tick(metadata_job_t *job, time_t now);
+
+/**
+ * Takes the info dictionary out of a complete job.
+ *
+ * @param job The job.
+ * @param length Where the length of the info dictionary is stored.
+ * @return The info dictionary, freed by the caller, or nullptr if the job isn't complete or it was already taken.
+ */
+char *metadata_job_take(metadata_job_t *job, uint64_t *length);
+
+/**
+ * Stops announcing, closes the job's peers and frees it.
+ *
+ * @param job The job. If nullptr, nothing is done.
+ */
+void metadata_job_free(metadata_job_t *job);
+
+/**
+ * Fetches the info dictionary of a magnet link from the swarm, using the extension protocol (BEP 10) and
+ * ut_metadata (BEP 9). Peers come from the magnet's trackers, and every peer that has the metadata is asked
+ * for different pieces at once.
+ *
+ * @param info_hash 20-byte info hash of the torrent.
+ * @param trackers Tracker URLs of the magnet link.
+ * @param length_hint Size of the torrent's content if the magnet link gave it, 0 otherwise. Announced as left.
+ * @param peer_id 20-byte peer id of this client.
+ * @param info_length Where the length of the info dictionary is stored.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return The info dictionary, checked against info_hash, or nullptr if it couldn't be fetched within
+ *         METADATA_TIMEOUT_MS. Freed by the caller.
+ */
+char *fetch_metadata(const unsigned char *info_hash, ll *trackers, int64_t length_hint,
+                     const unsigned char *peer_id, uint64_t *info_length, LOG_CODE log_code);
+
+/**
+ * Resolves magnet links into .torrent files, without downloading them. Links are read one per line and resolved
+ * concurrently on a single event loop, sharing tracker sockets and the DNS cache. At most max_active links are
+ * worked on at once, each with at most RESOLVE_PEERS_PER_LINK peers and RESOLVE_TIMEOUT_MS, and links are only
+ * read as earlier ones finish, so memory doesn't grow with the amount of links.
+ *
+ * @param links Magnet links, one per line. Blank lines are skipped.
+ * @param directory Where torrents are written, as <info hash>.torrent. Created if it doesn't exist.
+ * @param max_active Links worked on at once, at least 1.
+ * @param peer_id 20-byte peer id of this client.
+ * @param stats Where the outcome is stored.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return true if every link was read and tried, false if directory or the loop couldn't be created.
+ */
+bool resolve_magnets(FILE *links, const char *directory, uint32_t max_active, const unsigned char *peer_id,
+                     resolve_stats_t *stats, LOG_CODE log_code);
+
+#endif //BITTORRENT_CLIENT_METADATA_H
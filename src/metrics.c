@@ -0,0 +1,431 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+
+#include "logger.h"
+
+/// @brief Upper bounds of the finite histogram buckets, in microseconds
+static const uint64_t bucket_bounds_us[METRIC_BUCKET_COUNT] = {
+    10, 50, 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000
+};
+
+static const char* counter_names[METRIC_COUNTER_COUNT] = {
+    [METRIC_BYTES_DOWNLOADED] = "bittorrent_downloaded_bytes_total",
+    [METRIC_BYTES_UPLOADED] = "bittorrent_uploaded_bytes_total",
+    [METRIC_PIECES_VERIFIED] = "bittorrent_pieces_verified_total",
+    [METRIC_PIECES_FAILED] = "bittorrent_pieces_failed_total",
+    [METRIC_EPOLL_WAKEUPS] = "bittorrent_epoll_wakeups_total",
+    [METRIC_PEER_EVENTS] = "bittorrent_peer_events_total",
+    [METRIC_USEFUL_EVENTS] = "bittorrent_useful_peer_events_total",
+    [METRIC_INBOUND_PEERS] = "bittorrent_inbound_peers_total",
+    [METRIC_INBOUND_REJECTED] = "bittorrent_inbound_rejected_total",
+    [METRIC_MAGNETS_RESOLVED] = "bittorrent_magnets_resolved_total",
+    [METRIC_MAGNETS_FAILED] = "bittorrent_magnets_failed_total",
+    [METRIC_DHT_QUERIES] = "bittorrent_dht_queries_total",
+    [METRIC_DHT_PEERS] = "bittorrent_dht_peers_total",
+    [METRIC_PEX_PEERS] = "bittorrent_pex_peers_total",
+    [METRIC_UTP_RETRANSMITS] = "bittorrent_utp_retransmits_total",
+    [METRIC_LSD_PEERS] = "bittorrent_lsd_peers_total",
+    [METRIC_WEBSEED_PIECES] = "bittorrent_webseed_pieces_total",
+    [METRIC_BLOCKS_CORRUPT] = "bittorrent_blocks_corrupt_total",
+};
+static const char* counter_help[METRIC_COUNTER_COUNT] = {
+    [METRIC_BYTES_DOWNLOADED] = "Block bytes received and written to disk.",
+    [METRIC_BYTES_UPLOADED] = "Block bytes sent to peers.",
+    [METRIC_PIECES_VERIFIED] = "Pieces whose hash matched.",
+    [METRIC_PIECES_FAILED] = "Pieces whose hash didn't match.",
+    [METRIC_EPOLL_WAKEUPS] = "Returns from epoll_wait() in the peer loop.",
+    [METRIC_PEER_EVENTS] = "Events returned for peer sockets.",
+    [METRIC_USEFUL_EVENTS] = "Peer events that moved bytes or finished a connection attempt.",
+    [METRIC_INBOUND_PEERS] = "Incoming peer connections handed over to their torrent.",
+    [METRIC_INBOUND_REJECTED] = "Incoming peer connections closed before reaching a torrent.",
+    [METRIC_MAGNETS_RESOLVED] = "Magnet links resolved into a .torrent file.",
+    [METRIC_MAGNETS_FAILED] = "Magnet links that couldn't be resolved.",
+    [METRIC_DHT_QUERIES] = "KRPC queries sent to other DHT nodes.",
+    [METRIC_DHT_PEERS] = "Peers returned by DHT nodes.",
+    [METRIC_PEX_PEERS] = "Peers received through peer exchange.",
+    [METRIC_UTP_RETRANSMITS] = "uTP packets sent again after being taken as lost.",
+    [METRIC_LSD_PEERS] = "Peers found through Local Service Discovery.",
+    [METRIC_WEBSEED_PIECES] = "Pieces downloaded from web seeds and verified.",
+    [METRIC_BLOCKS_CORRUPT] = "Blocks of v2 torrents that failed their merkle check as they arrived.",
+};
+static const char* histogram_names[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_DISK_WRITE_SECONDS] = "bittorrent_disk_write_seconds",
+    [METRIC_TRACKER_ANNOUNCE_SECONDS] = "bittorrent_tracker_announce_seconds",
+    [METRIC_METADATA_SECONDS] = "bittorrent_metadata_seconds",
+};
+static const char* histogram_help[METRIC_HISTOGRAM_COUNT] = {
+    [METRIC_DISK_WRITE_SECONDS] = "Time taken to write a block to its files.",
+    [METRIC_TRACKER_ANNOUNCE_SECONDS] = "Time from starting an announce to its successful response.",
+    [METRIC_METADATA_SECONDS] = "Time from starting a magnet link to having its verified metadata.",
+};
+static const char* gauge_names[METRIC_GAUGE_COUNT] = {
+    [METRIC_REQUESTS_IN_FLIGHT] = "bittorrent_requests_in_flight",
+    [METRIC_DISK_QUEUE_DEPTH] = "bittorrent_disk_queue_depth",
+    [METRIC_DHT_NODES] = "bittorrent_dht_nodes",
+};
+static const char* gauge_help[METRIC_GAUGE_COUNT] = {
+    [METRIC_REQUESTS_IN_FLIGHT] = "Blocks requested from peers and not received yet.",
+    [METRIC_DISK_QUEUE_DEPTH] = "Blocks waiting to be written to disk.",
+    [METRIC_DHT_NODES] = "Nodes in the DHT routing table.",
+};
+static const char* peer_status_names[PEER_STATUS_COUNT] = {
+    [PEER_CLOSED] = "closed",
+    [PEER_NOTHING] = "connecting",
+    [PEER_CONNECTION_SUCCESS] = "connected",
+    [PEER_CONNECTION_FAILURE] = "connection_failed",
+    [PEER_HANDSHAKE_SENT] = "handshake_sent",
+    [PEER_HANDSHAKE_SUCCESS] = "handshake_success",
+    [PEER_AWAITING_ID] = "awaiting_id",
+    [PEER_AWAITING_PAYLOAD] = "awaiting_payload",
+    [PEER_BITFIELD_RECEIVED] = "bitfield_received",
+};
+
+/// @brief What threads that exited had counted, so their shards can be freed. Always the head of shards
+static metrics_shard_t retired = {0};
+/// @brief retired, followed by the shards of running threads
+static metrics_shard_t* const shards = &retired;
+/// @brief Guards shards and retired. Only taken on registration, thread exit and scrapes
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local metrics_shard_t* local_shard = nullptr;
+/// @brief Calls retire_shard() with a thread's shard when it exits
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static _Atomic int64_t gauges[METRIC_GAUGE_COUNT];
+static _Atomic uint32_t peer_counts[PEER_STATUS_COUNT];
+
+static void fold(_Atomic uint64_t* into, const _Atomic uint64_t* value) {
+    atomic_fetch_add_explicit(into, atomic_load_explicit(value, memory_order_relaxed), memory_order_relaxed);
+}
+
+/**
+ * Adds a shard's counts to retired, unregisters it and frees it
+ */
+static void retire_shard(void* ctx) {
+    metrics_shard_t* shard = ctx;
+    pthread_mutex_lock(&shards_mutex);
+    for (uint32_t i = 0; i < METRIC_COUNTER_COUNT; ++i) fold(&retired.counters[i], &shard->counters[i]);
+    for (uint32_t i = 0; i < METRIC_HISTOGRAM_COUNT; ++i) {
+        for (uint32_t j = 0; j <= METRIC_BUCKET_COUNT; ++j) fold(&retired.buckets[i][j], &shard->buckets[i][j]);
+        fold(&retired.sums_us[i], &shard->sums_us[i]);
+    }
+    metrics_shard_t** link = &retired.next;
+    while (*link != shard) link = &(*link)->next;
+    *link = shard->next;
+    pthread_mutex_unlock(&shards_mutex);
+    free(shard);
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, retire_shard);
+}
+
+/**
+ * Returns the calling thread's shard, registering it the first time
+ */
+static metrics_shard_t* get_shard(void) {
+    if (local_shard) return local_shard;
+    pthread_once(&shard_key_once, create_shard_key);
+    metrics_shard_t* shard = calloc(1, sizeof(metrics_shard_t));
+    if (!shard) return nullptr;
+    pthread_mutex_lock(&shards_mutex);
+    shard->next = retired.next;
+    retired.next = shard;
+    pthread_mutex_unlock(&shards_mutex);
+    pthread_setspecific(shard_key, shard);
+    local_shard = shard;
+    return shard;
+}
+
+/**
+ * Adds to a value only written by the calling thread. A plain load and store avoids a locked instruction
+ */
+static void shard_add(_Atomic uint64_t* value, const uint64_t amount) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+void metrics_add(const METRIC_COUNTER counter, const uint64_t amount) {
+    if (counter >= METRIC_COUNTER_COUNT) return;
+    metrics_shard_t* shard = get_shard();
+    if (shard) shard_add(&shard->counters[counter], amount);
+}
+
+void metrics_observe(const METRIC_HISTOGRAM histogram, const uint64_t microseconds) {
+    if (histogram >= METRIC_HISTOGRAM_COUNT) return;
+    metrics_shard_t* shard = get_shard();
+    if (!shard) return;
+    uint32_t bucket = 0;
+    while (bucket < METRIC_BUCKET_COUNT && microseconds > bucket_bounds_us[bucket]) bucket++;
+    shard_add(&shard->buckets[histogram][bucket], 1);
+    shard_add(&shard->sums_us[histogram], microseconds);
+}
+
+void metrics_set_gauge(const METRIC_GAUGE gauge, const int64_t value) {
+    if (gauge >= METRIC_GAUGE_COUNT) return;
+    atomic_store_explicit(&gauges[gauge], value, memory_order_relaxed);
+}
+
+void metrics_set_peers(const uint32_t counts[PEER_STATUS_COUNT]) {
+    for (uint32_t i = 0; i < PEER_STATUS_COUNT; ++i) {
+        atomic_store_explicit(&peer_counts[i], counts[i], memory_order_relaxed);
+    }
+}
+
+uint64_t metrics_counter_value(const METRIC_COUNTER counter) {
+    if (counter >= METRIC_COUNTER_COUNT) return 0;
+    uint64_t total = 0;
+    pthread_mutex_lock(&shards_mutex);
+    for (const metrics_shard_t* shard = shards; shard; shard = shard->next) {
+        total += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&shards_mutex);
+    return total;
+}
+
+uint64_t metrics_histogram_count(const METRIC_HISTOGRAM histogram) {
+    if (histogram >= METRIC_HISTOGRAM_COUNT) return 0;
+    uint64_t total = 0;
+    pthread_mutex_lock(&shards_mutex);
+    for (const metrics_shard_t* shard = shards; shard; shard = shard->next) {
+        for (uint32_t i = 0; i <= METRIC_BUCKET_COUNT; ++i) {
+            total += atomic_load_explicit(&shard->buckets[histogram][i], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&shards_mutex);
+    return total;
+}
+
+char* metrics_render(void) {
+    char* text = nullptr;
+    size_t length = 0;
+    FILE* stream = open_memstream(&text, &length);
+    if (!stream) return nullptr;
+
+    for (uint32_t i = 0; i < METRIC_COUNTER_COUNT; ++i) {
+        fprintf(stream, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counter_names[i], counter_help[i],
+                counter_names[i], counter_names[i], (unsigned long) metrics_counter_value(i));
+    }
+
+    for (uint32_t i = 0; i < METRIC_GAUGE_COUNT; ++i) {
+        fprintf(stream, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n", gauge_names[i], gauge_help[i], gauge_names[i],
+                gauge_names[i], (long) atomic_load_explicit(&gauges[i], memory_order_relaxed));
+    }
+    fprintf(stream, "# HELP bittorrent_peers Peers in the swarm, by connection status.\n"
+                    "# TYPE bittorrent_peers gauge\n");
+    for (uint32_t i = 0; i < PEER_STATUS_COUNT; ++i) {
+        fprintf(stream, "bittorrent_peers{status=\"%s\"} %u\n", peer_status_names[i],
+                atomic_load_explicit(&peer_counts[i], memory_order_relaxed));
+    }
+
+    for (uint32_t i = 0; i < METRIC_HISTOGRAM_COUNT; ++i) {
+        uint64_t buckets[METRIC_BUCKET_COUNT + 1] = {0};
+        uint64_t sum_us = 0;
+        pthread_mutex_lock(&shards_mutex);
+        for (const metrics_shard_t* shard = shards; shard; shard = shard->next) {
+            for (uint32_t j = 0; j <= METRIC_BUCKET_COUNT; ++j) {
+                buckets[j] += atomic_load_explicit(&shard->buckets[i][j], memory_order_relaxed);
+            }
+            sum_us += atomic_load_explicit(&shard->sums_us[i], memory_order_relaxed);
+        }
+        pthread_mutex_unlock(&shards_mutex);
+        fprintf(stream, "# HELP %s %s\n# TYPE %s histogram\n", histogram_names[i], histogram_help[i],
+                histogram_names[i]);
+        // Prometheus buckets are cumulative
+        uint64_t cumulative = 0;
+        for (uint32_t j = 0; j < METRIC_BUCKET_COUNT; ++j) {
+            cumulative += buckets[j];
+            fprintf(stream, "%s_bucket{le=\"%g\"} %lu\n", histogram_names[i], bucket_bounds_us[j] / 1e6,
+                    (unsigned long) cumulative);
+        }
+        cumulative += buckets[METRIC_BUCKET_COUNT];
+        fprintf(stream, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.6f\n%s_count %lu\n", histogram_names[i],
+                (unsigned long) cumulative, histogram_names[i], sum_us / 1e6, histogram_names[i],
+                (unsigned long) cumulative);
+    }
+
+    if (fclose(stream) != 0) {
+        free(text);
+        return nullptr;
+    }
+    return text;
+}
+
+/**
+ * Writes the whole buffer to a blocking socket
+ */
+static bool write_all(const int32_t fd, const char* buffer, size_t length) {
+    while (length > 0) {
+        const ssize_t written = send(fd, buffer, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return true;
+}
+
+/**
+ * Reads the request until its headers end, then answers with the metrics
+ */
+static void serve_client(const metrics_server_t* server, const int32_t client) {
+    char request[METRICS_REQUEST_SIZE + 1];
+    size_t received = 0;
+    while (received < METRICS_REQUEST_SIZE) {
+        struct pollfd pfd = {client, POLLIN, 0};
+        if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT) <= 0) return;
+        const ssize_t got = recv(client, request + received, METRICS_REQUEST_SIZE - received, 0);
+        if (got <= 0) return;
+        received += got;
+        request[received] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+
+    char* body = metrics_render();
+    if (!body) return;
+    char header[128];
+    const int32_t header_length = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                                           "Content-Type: text/plain; version=0.0.4\r\n"
+                                           "Content-Length: %zu\r\n\r\n", strlen(body));
+    if (!write_all(client, header, header_length) || !write_all(client, body, strlen(body))) {
+        log_printf(server->log_code, LOG_ERR, "Couldn't send metrics, errno %d\n", errno);
+    }
+    free(body);
+}
+
+static void* serve(void* arg) {
+    const metrics_server_t* server = arg;
+    struct pollfd fds[2] = {{server->listen_fd, POLLIN, 0}, {server->stop_fd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+        if (!(fds[0].revents & POLLIN)) continue;
+        const int32_t client = accept4(server->listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) continue;
+        serve_client(server, client);
+        close(client);
+    }
+    return nullptr;
+}
+
+/**
+ * Creates a listening unix socket at path, replacing any stale one
+ */
+static int32_t listen_unix(const char* path) {
+    struct sockaddr_un addr = {0};
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    const int32_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Creates a listening TCP socket from "host:port"
+ */
+static int32_t listen_tcp(const char* address) {
+    const char* colon = strrchr(address, ':');
+    if (!colon) return -1;
+    char host[256];
+    const size_t host_length = colon - address;
+    if (host_length >= sizeof(host)) return -1;
+    memcpy(host, address, host_length);
+    host[host_length] = '\0';
+    // Brackets around IPv6 addresses
+    char* host_start = host;
+    if (host_length >= 2 && host[0] == '[' && host[host_length-1] == ']') {
+        host[host_length-1] = '\0';
+        host_start++;
+    }
+    if (*host_start == '\0') host_start = "127.0.0.1";
+
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host_start, colon + 1, &hints, &res) != 0) return -1;
+    int32_t fd = -1;
+    for (const struct addrinfo* rp = res; rp != nullptr && fd < 0; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+        if (fd < 0) continue;
+        const int32_t reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, rp->ai_addr, rp->ai_addrlen) < 0 || listen(fd, 8) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+metrics_server_t* metrics_server_start(const char* address, const LOG_CODE log_code) {
+    if (!address) return nullptr;
+    metrics_server_t* server = calloc(1, sizeof(metrics_server_t));
+    if (!server) return nullptr;
+    server->log_code = log_code;
+
+    const char* path = nullptr;
+    if (strncmp(address, "unix:", 5) == 0) path = address + 5;
+    else if (address[0] == '/') path = address;
+    if (path) {
+        server->unix_path = strdup(path);
+        server->listen_fd = listen_unix(path);
+    } else server->listen_fd = listen_tcp(address);
+    if (server->listen_fd < 0) {
+        log_printf(log_code, LOG_ERR, "Can't listen for metrics on %s\n", address);
+        free(server->unix_path);
+        free(server);
+        return nullptr;
+    }
+
+    server->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (server->stop_fd < 0 || pthread_create(&server->thread, nullptr, serve, server) != 0) {
+        if (server->stop_fd >= 0) close(server->stop_fd);
+        close(server->listen_fd);
+        if (server->unix_path) unlink(server->unix_path);
+        free(server->unix_path);
+        free(server);
+        return nullptr;
+    }
+    log_printf(log_code, LOG_SUMM, "Serving metrics on %s\n", address);
+    return server;
+}
+
+void metrics_server_stop(metrics_server_t* server) {
+    if (server == nullptr) return;
+    const uint64_t one = 1;
+    if (write(server->stop_fd, &one, sizeof(one)) < 0) {
+        // Can't fail, the counter was never written before
+    }
+    pthread_join(server->thread, nullptr);
+    close(server->stop_fd);
+    close(server->listen_fd);
+    if (server->unix_path) unlink(server->unix_path);
+    free(server->unix_path);
+    free(server);
+    // Other threads free theirs when exiting, the stopping one usually won't count anything else
+    if (local_shard) {
+        pthread_setspecific(shard_key, nullptr);
+        retire_shard(local_shard);
+        local_shard = nullptr;
+    }
+}
@@ -0,0 +1,155 @@
+#ifndef BITTORRENT_CLIENT_METRICS_H
+#define BITTORRENT_CLIENT_METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "downloading_types.h"
+#include "util.h"
+
+/// @brief Amount of PEER_STATUS values, so peers can be counted by status
+#define PEER_STATUS_COUNT (PEER_BITFIELD_RECEIVED + 1)
+/// @brief Amount of finite histogram buckets. One more, +Inf, holds everything above the last bound
+#define METRIC_BUCKET_COUNT 12
+/// @brief Most bytes of a scrape request that are read. The rest is ignored
+#define METRICS_REQUEST_SIZE 1024
+/// @brief Milliseconds a scraper gets to send its request before being dropped
+#define METRICS_REQUEST_TIMEOUT 1000
+
+/// @brief Monotonically increasing counters
+typedef enum {
+    METRIC_BYTES_DOWNLOADED, /**< Block bytes received and written to disk */
+    METRIC_BYTES_UPLOADED, /**< Block bytes sent to peers */
+    METRIC_PIECES_VERIFIED, /**< Pieces whose hash matched */
+    METRIC_PIECES_FAILED, /**< Pieces whose hash didn't match, so they were downloaded again */
+    METRIC_EPOLL_WAKEUPS, /**< Returns from epoll_wait() in the peer loop, timeouts included */
+    METRIC_PEER_EVENTS, /**< Events epoll_wait() returned for peer sockets */
+    METRIC_USEFUL_EVENTS, /**< Peer events that moved bytes or finished a connection attempt */
+    METRIC_INBOUND_PEERS, /**< Incoming connections handed over to their torrent */
+    METRIC_INBOUND_REJECTED, /**< Incoming connections closed by rate limits, bad handshakes or unknown torrents */
+    METRIC_MAGNETS_RESOLVED, /**< Magnet links resolved into a .torrent file */
+    METRIC_MAGNETS_FAILED, /**< Magnet links that were invalid or couldn't be resolved in time */
+    METRIC_DHT_QUERIES, /**< KRPC queries sent to DHT nodes */
+    METRIC_DHT_PEERS, /**< Peers returned by DHT nodes */
+    METRIC_PEX_PEERS, /**< Peers other peers told us about through ut_pex */
+    METRIC_UTP_RETRANSMITS, /**< uTP packets sent again after being taken as lost */
+    METRIC_LSD_PEERS, /**< Peers found announcing our torrents on the local network */
+    METRIC_WEBSEED_PIECES, /**< Pieces downloaded from web seeds and verified */
+    METRIC_BLOCKS_CORRUPT, /**< Blocks of v2 torrents that failed their merkle check as they arrived */
+    METRIC_COUNTER_COUNT
+} METRIC_COUNTER;
+
+/// @brief Latency histograms, observed in microseconds and exposed in seconds
+typedef enum {
+    METRIC_DISK_WRITE_SECONDS, /**< Time process_block() takes to write a block to its files */
+    METRIC_TRACKER_ANNOUNCE_SECONDS, /**< Time from starting an announce to its successful response */
+    METRIC_METADATA_SECONDS, /**< Time from starting a magnet link to having its verified metadata */
+    METRIC_HISTOGRAM_COUNT
+} METRIC_HISTOGRAM;
+
+/// @brief Values that go up and down, set by whoever owns them
+typedef enum {
+    METRIC_REQUESTS_IN_FLIGHT, /**< Blocks requested from peers and not received yet */
+    METRIC_DISK_QUEUE_DEPTH, /**< Blocks waiting to be written. Always 0 while writes are synchronous */
+    METRIC_DHT_NODES, /**< Nodes in the DHT routing table */
+    METRIC_GAUGE_COUNT
+} METRIC_GAUGE;
+
+/**
+ * Counters of a single thread. Only its own thread writes to it, so updates need no atomic read-modify-write,
+ * while scrapes read it from another thread.
+ * A shard is freed when its thread exits, after adding its counts to those of finished threads.
+ */
+typedef struct metrics_shard_t {
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT]; /**< Values of each METRIC_COUNTER */
+    _Atomic uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRIC_BUCKET_COUNT + 1]; /**< Observations per bucket,
+                                                                               * not cumulative */
+    _Atomic uint64_t sums_us[METRIC_HISTOGRAM_COUNT]; /**< Sum of observations, in microseconds */
+    struct metrics_shard_t *next; /**< Shard of the next running thread */
+} metrics_shard_t;
+
+/// @brief Serves metrics over HTTP on its own thread
+typedef struct {
+    int32_t listen_fd; /**< Listening socket */
+    int32_t stop_fd; /**< Eventfd written to stop the thread */
+    pthread_t thread; /**< Serving thread */
+    char *unix_path; /**< Path of the unix socket, removed when stopping, or nullptr for TCP */
+    LOG_CODE log_code; /**< Logging level */
+} metrics_server_t;
+
+/**
+ * Adds to a counter of the calling thread's shard, registering the shard on first use.
+ *
+ * @param counter The counter.
+ * @param amount How much to add.
+ */
+void metrics_add(METRIC_COUNTER counter, uint64_t amount);
+
+/**
+ * Records an observation in a histogram of the calling thread's shard.
+ *
+ * @param histogram The histogram.
+ * @param microseconds The observed value, in microseconds.
+ */
+void metrics_observe(METRIC_HISTOGRAM histogram, uint64_t microseconds);
+
+/**
+ * Sets a gauge. Each gauge is meant to be set by a single thread.
+ *
+ * @param gauge The gauge.
+ * @param value The new value.
+ */
+void metrics_set_gauge(METRIC_GAUGE gauge, int64_t value);
+
+/**
+ * Sets the amount of peers in each status.
+ *
+ * @param counts Amount of peers, indexed by PEER_STATUS.
+ */
+void metrics_set_peers(const uint32_t counts[PEER_STATUS_COUNT]);
+
+/**
+ * Adds up a counter across every thread.
+ *
+ * @param counter The counter.
+ * @return Its current value.
+ */
+uint64_t metrics_counter_value(METRIC_COUNTER counter);
+
+/**
+ * Adds up the observations of a histogram across every thread.
+ *
+ * @param histogram The histogram.
+ * @return How many values were observed.
+ */
+uint64_t metrics_histogram_count(METRIC_HISTOGRAM histogram);
+
+/**
+ * Renders every metric in the Prometheus text exposition format.
+ *
+ * @return A null-terminated string to be freed by the caller, or nullptr on failure.
+ */
+char *metrics_render(void);
+
+/**
+ * Starts serving metrics on a new thread. Any path is answered with metrics_render().
+ *
+ * @param address Where to listen: "host:port" for TCP, like "127.0.0.1:9100" (host defaults to 127.0.0.1 if
+ *                empty, and port 0 picks a free one), or "unix:/path" or "/path" for a unix socket.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to the server, or nullptr on failure.
+ */
+metrics_server_t *metrics_server_start(const char *address, LOG_CODE log_code);
+
+/**
+ * Stops the serving thread, closes the socket and frees the server, along with the calling thread's shard.
+ *
+ * @param server The server to stop. If nullptr, nothing is done.
+ */
+void metrics_server_stop(metrics_server_t *server);
+
+#endif //BITTORRENT_CLIENT_METRICS_H
@@ -40,16 +40,13 @@ announce_list_ll* decode_announce_list(const char* announce_list, uint64_t *inde
 
 files_ll* read_info_files(const char* bencode, const bool multiple, uint64_t *index, const LOG_CODE log_code) {
     // Defensive programming
-    // Checking whether "length", "path", and "name" exist at all
-    if (!(strstr(bencode, "length") && strstr(bencode, "path") && strstr(bencode, "name"))) {
+    // Checking whether "length", "path" (only with multiple files), and "name" exist at all
+    if (!(strstr(bencode, "length") && (!multiple || strstr(bencode, "path")) && strstr(bencode, "name"))) {
         return nullptr;
     }
 
 
-    files_ll *head = malloc(sizeof(files_ll));
-    head->path = nullptr;
-    head->next = nullptr;
-    head->file_ptr = nullptr;
+    files_ll *head = calloc(1, sizeof(files_ll));
     files_ll *current = head;
     uint32_t start = 1;
     uint32_t* start_ptr = &start;
@@ -58,11 +55,8 @@ files_ll* read_info_files(const char* bencode, const bool multiple, uint64_t *in
 
     while (bencode[start] != 'e') {
         if (element_num > 0) {
-            current->next = malloc(sizeof(files_ll));
+            current->next = calloc(1, sizeof(files_ll));
             current = current->next;
-            current->next = nullptr;
-            current->path = nullptr;
-            head->file_ptr = nullptr;
         }
 
         char* parse_index;
@@ -0,0 +1,133 @@
+#include "pex.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "basic_bencode.h"
+#include "metadata.h"
+#include "util.h"
+
+uint32_t build_pex_handshake(unsigned char* buffer, const uint16_t port) {
+    char* payload = (char*) buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1;
+    const uint32_t room = PEX_MESSAGE_MAX - MESSAGE_LENGTH_AND_ID_SIZE - 1;
+    int32_t written = snprintf(payload, room, "d1:md6:ut_pexi%dee", UT_PEX_ID);
+    // Inbound connections come from an ephemeral port, this is the one peers can share
+    if (port > 0) written += snprintf(payload + written, room - written, "1:pi%ue", port);
+    written += snprintf(payload + written, room - written, "1:v%zu:%se", strlen(CLIENT_ID), CLIENT_ID);
+    return frame_extended(buffer, EXTENSION_HANDSHAKE_ID, written);
+}
+
+bool parse_pex_handshake(const unsigned char* payload, const uint32_t length, uint8_t* ut_pex) {
+    if (!payload || !ut_pex || length == 0 || payload[0] != 'd') return false;
+    const char* dict = (const char*) payload;
+    const char* limit = dict + length;
+    if (skip_bencode_value(dict, limit) == nullptr) return false;
+
+    *ut_pex = 0;
+    const char* m = find_bencode_key(dict, limit, "m");
+    if (m && *m == 'd') {
+        const char* id = find_bencode_key(m, limit, "ut_pex");
+        int64_t value;
+        // 0 means the peer disabled it
+        if (id && read_bencode_int(id, limit, &value) && value > 0 && value <= UINT8_MAX) *ut_pex = value;
+    }
+    return true;
+}
+
+/**
+ * Writes a bencoded string out of raw bytes
+ * @return Bytes written
+ */
+static uint32_t put_bytes(char* out, const char* key, const unsigned char* bytes, const uint32_t length) {
+    const int32_t written = sprintf(out, "%zu:%s%u:", strlen(key), key, length);
+    if (length > 0) memcpy(out + written, bytes, length);
+    return written + length;
+}
+
+uint32_t build_pex_message(unsigned char* buffer, const uint8_t ut_pex, const unsigned char* added,
+                           const uint32_t added_amount, const unsigned char* dropped, const uint32_t dropped_amount) {
+    if (added_amount > PEX_MAX_PEERS || dropped_amount > PEX_MAX_PEERS) return 0;
+    unsigned char flags[PEX_MAX_PEERS];
+    memset(flags, PEX_FLAG_REACHABLE, added_amount);
+    char* payload = (char*) buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1;
+    // Keys in lexicographic order
+    uint32_t written = 0;
+    payload[written++] = 'd';
+    written += put_bytes(payload + written, "added", added, added_amount * COMPACT_PEER_V4_SIZE);
+    written += put_bytes(payload + written, "added.f", flags, added_amount);
+    written += put_bytes(payload + written, "dropped", dropped, dropped_amount * COMPACT_PEER_V4_SIZE);
+    payload[written++] = 'e';
+    return frame_extended(buffer, ut_pex, written);
+}
+
+/**
+ * Reads one of the peer lists of a ut_pex message, a missing one being empty
+ * @return false if it isn't a string
+ */
+static bool read_peer_list(const char* dict, const char* limit, const char* key, const unsigned char** peers,
+                           uint32_t* peer_amount) {
+    *peers = nullptr;
+    *peer_amount = 0;
+    const char* value = find_bencode_key(dict, limit, key);
+    if (!value) return true;
+    const char* string;
+    uint64_t length;
+    if (!read_bencode_string(value, limit, &string, &length)) return false;
+    *peers = (const unsigned char*) string;
+    // Trailing bytes of a truncated peer are left out
+    *peer_amount = length / COMPACT_PEER_V4_SIZE;
+    return true;
+}
+
+bool parse_pex_message(const unsigned char* payload, const uint32_t length, const unsigned char** added,
+                       uint32_t* added_amount, const unsigned char** dropped, uint32_t* dropped_amount) {
+    if (!payload || !added || !added_amount || !dropped || !dropped_amount || length == 0 || payload[0] != 'd') {
+        return false;
+    }
+    const char* dict = (const char*) payload;
+    const char* limit = skip_bencode_value(dict, dict + length);
+    if (limit == nullptr) return false;
+    return read_peer_list(dict, limit, "added", added, added_amount) &&
+           read_peer_list(dict, limit, "dropped", dropped, dropped_amount);
+}
+
+/**
+ * Whether a compact peer is in a list of them
+ */
+static bool contains_peer(const unsigned char* peers, const uint32_t peer_amount, const unsigned char* peer) {
+    for (uint32_t i = 0; i < peer_amount; ++i) {
+        if (memcmp(peers + i * COMPACT_PEER_V4_SIZE, peer, COMPACT_PEER_V4_SIZE) == 0) return true;
+    }
+    return false;
+}
+
+void pex_diff(const unsigned char* previous, const uint32_t previous_amount, const unsigned char* current,
+              const uint32_t current_amount, unsigned char* added, uint32_t* added_amount, unsigned char* dropped,
+              uint32_t* dropped_amount) {
+    *added_amount = 0;
+    *dropped_amount = 0;
+    for (uint32_t i = 0; i < current_amount && *added_amount < PEX_MAX_PEERS; ++i) {
+        const unsigned char* peer = current + i * COMPACT_PEER_V4_SIZE;
+        if (contains_peer(previous, previous_amount, peer)) continue;
+        memcpy(added + (*added_amount)++ * COMPACT_PEER_V4_SIZE, peer, COMPACT_PEER_V4_SIZE);
+    }
+    for (uint32_t i = 0; i < previous_amount && *dropped_amount < PEX_MAX_PEERS; ++i) {
+        const unsigned char* peer = previous + i * COMPACT_PEER_V4_SIZE;
+        if (contains_peer(current, current_amount, peer)) continue;
+        memcpy(dropped + (*dropped_amount)++ * COMPACT_PEER_V4_SIZE, peer, COMPACT_PEER_V4_SIZE);
+    }
+}
+
+uint32_t pex_apply(unsigned char* peers, uint32_t peer_amount, const unsigned char* added, const uint32_t added_amount,
+                   const unsigned char* dropped, const uint32_t dropped_amount) {
+    for (uint32_t i = 0; i < peer_amount;) {
+        unsigned char* peer = peers + i * COMPACT_PEER_V4_SIZE;
+        if (!contains_peer(dropped, dropped_amount, peer)) {
+            i++;
+            continue;
+        }
+        memcpy(peer, peers + --peer_amount * COMPACT_PEER_V4_SIZE, COMPACT_PEER_V4_SIZE);
+    }
+    if (added_amount > 0) memcpy(peers + peer_amount * COMPACT_PEER_V4_SIZE, added, added_amount * COMPACT_PEER_V4_SIZE);
+    return peer_amount + added_amount;
+}
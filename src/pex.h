@@ -0,0 +1,99 @@
+#ifndef BITTORRENT_CLIENT_PEX_H
+#define BITTORRENT_CLIENT_PEX_H
+
+#include <stdint.h>
+
+#include "announcer.h"
+#include "messages_types.h"
+
+/// @brief Id this client asks peers to use for ut_pex messages sent to it, in its extension handshake
+#define UT_PEX_ID 2
+/// @brief Milliseconds between ut_pex messages to each peer. BEP 11 asks for no more than one a minute
+#define PEX_INTERVAL_MS 60000
+/// @brief Milliseconds a peer has to wait between ut_pex messages before they're taken into account again
+#define PEX_MIN_INTERVAL_MS (PEX_INTERVAL_MS / 2)
+/// @brief Peers in each of the added and dropped lists of a single message, the rest wait for the next one
+#define PEX_MAX_PEERS 50
+/// @brief Set in added.f for peers reachable from outside, the ones this client connected to itself
+#define PEX_FLAG_REACHABLE 0x10
+/// @brief Largest ut_pex message built, length included
+#define PEX_MESSAGE_MAX (MESSAGE_LENGTH_AND_ID_SIZE + 1 + 64 + PEX_MAX_PEERS * (2 * COMPACT_PEER_V4_SIZE + 1))
+
+/**
+ * Builds the EXTENDED message carrying the extension handshake of a torrent being downloaded, which offers ut_pex.
+ *
+ * @param buffer Where the message, length included, is written. At least PEX_MESSAGE_MAX bytes.
+ * @param port Port this client accepts peers on, in host endianness. 0 if it doesn't listen.
+ * @return Bytes written.
+ */
+uint32_t build_pex_handshake(unsigned char *buffer, uint16_t port);
+
+/**
+ * Reads the id a peer wants for ut_pex messages out of its extension handshake.
+ *
+ * @param payload The bencoded dictionary, right after the extension id.
+ * @param length Bytes in payload.
+ * @param ut_pex Where the id is stored, 0 if the peer doesn't support ut_pex.
+ * @return true on success, false if payload isn't a dictionary.
+ */
+bool parse_pex_handshake(const unsigned char *payload, uint32_t length, uint8_t *ut_pex);
+
+/**
+ * Builds a ut_pex message. Every added peer is flagged as reachable.
+ *
+ * @param buffer Where the message, length included, is written. At least PEX_MESSAGE_MAX bytes.
+ * @param ut_pex Id the receiving peer asked for in its extension handshake.
+ * @param added Compact IPv4 peers connected to since the last message.
+ * @param added_amount Peers in added, at most PEX_MAX_PEERS.
+ * @param dropped Compact IPv4 peers disconnected from since the last message.
+ * @param dropped_amount Peers in dropped, at most PEX_MAX_PEERS.
+ * @return Bytes written, 0 if there are too many peers.
+ */
+uint32_t build_pex_message(unsigned char *buffer, uint8_t ut_pex, const unsigned char *added, uint32_t added_amount,
+                           const unsigned char *dropped, uint32_t dropped_amount);
+
+/**
+ * Reads the IPv4 peers of a ut_pex message, in place. Lists missing from the message are left empty.
+ *
+ * @param payload The bencoded dictionary, right after the extension id.
+ * @param length Bytes in payload.
+ * @param added Where a pointer to the compact added peers is stored.
+ * @param added_amount Where the amount of added peers is stored.
+ * @param dropped Where a pointer to the compact dropped peers is stored.
+ * @param dropped_amount Where the amount of dropped peers is stored.
+ * @return true on success, false if payload isn't a dictionary.
+ */
+bool parse_pex_message(const unsigned char *payload, uint32_t length, const unsigned char **added,
+                       uint32_t *added_amount, const unsigned char **dropped, uint32_t *dropped_amount);
+
+/**
+ * Compares the peers connected to as of the last message with the current ones.
+ *
+ * @param previous Compact IPv4 peers the last message left the receivers with.
+ * @param previous_amount Peers in previous.
+ * @param current Compact IPv4 peers connected to now.
+ * @param current_amount Peers in current.
+ * @param added Where peers in current but not in previous are written. Room for PEX_MAX_PEERS.
+ * @param added_amount Where the amount of added peers is stored, at most PEX_MAX_PEERS.
+ * @param dropped Where peers in previous but not in current are written. Room for PEX_MAX_PEERS.
+ * @param dropped_amount Where the amount of dropped peers is stored, at most PEX_MAX_PEERS.
+ */
+void pex_diff(const unsigned char *previous, uint32_t previous_amount, const unsigned char *current,
+              uint32_t current_amount, unsigned char *added, uint32_t *added_amount, unsigned char *dropped,
+              uint32_t *dropped_amount);
+
+/**
+ * Applies what pex_diff() found to the peers the last message left the receivers with.
+ *
+ * @param peers Compact IPv4 peers, with room for added_amount more.
+ * @param peer_amount Peers in peers.
+ * @param added Peers to append.
+ * @param added_amount Peers in added.
+ * @param dropped Peers to remove. The last peer takes the place of each removed one.
+ * @param dropped_amount Peers in dropped.
+ * @return Peers left in peers.
+ */
+uint32_t pex_apply(unsigned char *peers, uint32_t peer_amount, const unsigned char *added, uint32_t added_amount,
+                   const unsigned char *dropped, uint32_t dropped_amount);
+
+#endif //BITTORRENT_CLIENT_PEX_H
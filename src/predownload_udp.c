@@ -17,6 +17,7 @@
 #include "basic_bencode.h"
 #include "downloading_types.h"
 #include "file.h"
+#include "logger.h"
 
 address_t* split_address(const char* address) {
     if (!address) return nullptr;
@@ -159,7 +160,7 @@ char* url_to_ip(address_t* address, const LOG_CODE log_code) {
     } else hints.ai_socktype = SOCK_STREAM;
     const int err = getaddrinfo(address->host, address->port, &hints, &res);
     if (err != 0) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        log_printf(log_code, LOG_ERR, "getaddrinfo: %s\n", gai_strerror(err));
         return nullptr;
     }
 
@@ -175,7 +176,7 @@ char* url_to_ip(address_t* address, const LOG_CODE log_code) {
             inet_ntop(rp->ai_family, addr_ptr, buf, sizeof(buf));
             ip = malloc(INET6_ADDRSTRLEN);
             if (ip) strcpy(ip, buf);
-            if (log_code == LOG_FULL) fprintf(stdout, "Resolved IPv6: %s\n", ip);
+            log_printf(log_code, LOG_FULL, "Resolved IPv6: %s\n", ip);
         }
 
         //IPv4
@@ -185,7 +186,7 @@ char* url_to_ip(address_t* address, const LOG_CODE log_code) {
             inet_ntop(rp->ai_family, addr_ptr, buf, sizeof(buf));
             ip = malloc(INET_ADDRSTRLEN);
             if (ip) strcpy(ip, buf);
-            if (log_code == LOG_FULL) fprintf(stdout, "Resolved IPv4: %s\n", ip);
+            log_printf(log_code, LOG_FULL, "Resolved IPv4: %s\n", ip);
             break;
         }
     }
@@ -210,13 +211,13 @@ int32_t *try_request_udp(const int32_t amount, int32_t sockfd[], const void *req
         for (int i = 0; i < amount; ++i) {
             const ssize_t sent = sendto(sockfd[i], req[i], req_size, 0, server_addr[i], sizeof(struct sockaddr));
             if (sent < 0) {
-                if (log_code >= LOG_ERR) fprintf(stderr, "Can't send request: %s (errno: %d)\n", strerror(errno), errno);
+                log_printf(log_code, LOG_ERR, "Can't send request: %s (errno: %d)\n", strerror(errno), errno);
                 for (int j = 0; j < amount; ++j) {
                     close(sockfd[j]);
                 }
                 return nullptr;
             }
-            if (log_code == LOG_FULL) fprintf(stdout, "Sent %zd bytes\n", sent);
+            log_printf(log_code, LOG_FULL, "Sent %zd bytes\n", sent);
         }
 
         // Wait for response
@@ -236,13 +237,13 @@ int32_t *try_request_udp(const int32_t amount, int32_t sockfd[], const void *req
             return sockfd_ret;
         }
         if (ret == 0) {
-            if (log_code >= LOG_ERR) fprintf(stderr, "Timeout #%d, waited for %d seconds\n", counter+1, timeoutDuration/1000);
+            log_printf(log_code, LOG_ERR, "Timeout #%d, waited for %d seconds\n", counter+1, timeoutDuration/1000);
         } else {
-            if (log_code >= LOG_ERR) fprintf(stderr, "poll() error #%d\n", counter);
+            log_printf(log_code, LOG_ERR, "poll() error #%d\n", counter);
         }
         counter++;
     }
-    if (log_code >= LOG_ERR) fprintf(stderr, "Final timeout");
+    log_printf(log_code, LOG_ERR, "Final timeout");
     return nullptr;
 }
 
@@ -255,10 +256,10 @@ uint64_t connect_request_udp(const struct sockaddr *server_addr[], int32_t sockf
         req_array[i]->protocol_id = htobe64(0x41727101980LL);
         req_array[i]->action = htobe32(0);
         req_array[i]->transaction_id = htobe32(arc4random());
-        if (log_code >= LOG_SUMM) fprintf(stdout, "Connection request:\n");
-        if (log_code >= LOG_SUMM) fprintf(stdout, "action: %u\n", req_array[i]->action);
-        if (log_code >= LOG_SUMM) fprintf(stdout, "transaction_id: %u\n", req_array[i]->transaction_id);
-        if (log_code >= LOG_SUMM) fprintf(stdout, "protocol_id: %lu\n", req_array[i]->protocol_id);
+        log_printf(log_code, LOG_SUMM, "Connection request:\n");
+        log_printf(log_code, LOG_SUMM, "action: %u\n", req_array[i]->action);
+        log_printf(log_code, LOG_SUMM, "transaction_id: %u\n", req_array[i]->transaction_id);
+        log_printf(log_code, LOG_SUMM, "protocol_id: %lu\n", req_array[i]->protocol_id);
     }
 
     int* available_connections = try_request_udp(amount, sockfd, (const void**)req_array, sizeof(connect_request_t), server_addr, log_code);
@@ -279,26 +280,26 @@ uint64_t connect_request_udp(const struct sockaddr *server_addr[], int32_t sockf
     connect_response_t* res = malloc(sizeof(connect_response_t));
     const ssize_t received = recvfrom(sockfd[i], res, sizeof(connect_response_t), 0, nullptr, &socklen);
     if (received < 0) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error while receiving connect response: %s (errno: %d)\n", strerror(errno), errno);
+        log_printf(log_code, LOG_ERR, "Error while receiving connect response: %s (errno: %d)\n", strerror(errno), errno);
         free(res);
         return 0;
     }
 
     if (((error_response*) res)->action == 3) {
         // 3 means error
-        if (log_code >= LOG_ERR) fprintf(stderr, "Server returned error:\n");
-        if (log_code >= LOG_ERR) fprintf(stderr, "Transaction id: %d\n", ((error_response*) res)->transaction_id);
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error message from the server: %s\n", ((error_response*) res)->message);
+        log_printf(log_code, LOG_ERR, "Server returned error:\n");
+        log_printf(log_code, LOG_ERR, "Transaction id: %d\n", ((error_response*) res)->transaction_id);
+        log_printf(log_code, LOG_ERR, "Error message from the server: %s\n", ((error_response*) res)->message);
         free(res);
         return 0;
     }
 
-    if (log_code == LOG_FULL) fprintf(stdout, "Received %ld bytes\n", received);
+    log_printf(log_code, LOG_FULL, "Received %ld bytes\n", received);
 
-    if (log_code >= LOG_SUMM) fprintf(stdout, "Server response:\n");
-    if (log_code >= LOG_SUMM) fprintf(stdout, "action: %u\n", res->action);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "transaction_id: %u\n", res->transaction_id);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "connection_id: %lu\n", res->connection_id);
+    log_printf(log_code, LOG_SUMM, "Server response:\n");
+    log_printf(log_code, LOG_SUMM, "action: %u\n", res->action);
+    log_printf(log_code, LOG_SUMM, "transaction_id: %u\n", res->transaction_id);
+    log_printf(log_code, LOG_SUMM, "connection_id: %lu\n", res->connection_id);
     if (req_array[i]->transaction_id == res->transaction_id && req_array[i]->action == res->action) {
         // Convert back to host endianness
         res->connection_id = htobe64(res->connection_id);
@@ -457,25 +458,25 @@ announce_response_t *announce_request_udp(const struct sockaddr *server_addr, in
     req.num_want = htobe32(-1);
     req.port = htobe16(port);
 
-    if (log_code >= LOG_SUMM) fprintf(stdout, "Announce request:\n");
-    if (log_code >= LOG_SUMM) fprintf(stdout, "action: %d\n", req.action);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "transaction_id: %d\n", req.transaction_id);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "connection_id: %lu\n", req.connection_id);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "info_hash: ");
+    log_printf(log_code, LOG_SUMM, "Announce request:\n");
+    log_printf(log_code, LOG_SUMM, "action: %d\n", req.action);
+    log_printf(log_code, LOG_SUMM, "transaction_id: %d\n", req.transaction_id);
+    log_printf(log_code, LOG_SUMM, "connection_id: %lu\n", req.connection_id);
+    log_printf(log_code, LOG_SUMM, "info_hash: ");
     char human_hash[41];
     sha1_to_hex(req.info_hash, human_hash);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "%s", human_hash);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "\n");
-    if (log_code >= LOG_SUMM) fprintf(stdout, "peer_id: ");
+    log_printf(log_code, LOG_SUMM, "%s", human_hash);
+    log_printf(log_code, LOG_SUMM, "\n");
+    log_printf(log_code, LOG_SUMM, "peer_id: ");
     for (int j = 0; j < 20; ++j) {
-        if (log_code >= LOG_SUMM) fprintf(stdout, "%d",req.peer_id[j]);
+        log_printf(log_code, LOG_SUMM, "%d",req.peer_id[j]);
     }
-    if (log_code >= LOG_SUMM) fprintf(stdout, "\n");
-    if (log_code >= LOG_SUMM) fprintf(stdout, "downloaded: %lu\n", req.downloaded);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "left: %lu\n", req.left);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "uploaded: %lu\n", req.uploaded);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "key: %u\n", req.key);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "port: %hu\n", req.port);
+    log_printf(log_code, LOG_SUMM, "\n");
+    log_printf(log_code, LOG_SUMM, "downloaded: %lu\n", req.downloaded);
+    log_printf(log_code, LOG_SUMM, "left: %lu\n", req.left);
+    log_printf(log_code, LOG_SUMM, "uploaded: %lu\n", req.uploaded);
+    log_printf(log_code, LOG_SUMM, "key: %u\n", req.key);
+    log_printf(log_code, LOG_SUMM, "port: %hu\n", req.port);
     // Explicit malloc to avoid sendto() error
     char* req_buffer = malloc(ANNOUNCE_REQUEST_SIZE);
     memcpy(req_buffer, &req.connection_id, 8);
@@ -496,7 +497,7 @@ announce_response_t *announce_request_udp(const struct sockaddr *server_addr, in
     int* announce_res_socket = try_request_udp(1, &sockfd, (const void**)&req_buffer, ANNOUNCE_REQUEST_SIZE, &server_addr, log_code);
     free(req_buffer);
     if (announce_res_socket == nullptr) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error while receiving announce response\n");
+        log_printf(log_code, LOG_ERR, "Error while receiving announce response\n");
         free(announce_res_socket);
         return nullptr;
     }
@@ -506,18 +507,18 @@ announce_response_t *announce_request_udp(const struct sockaddr *server_addr, in
     const ssize_t recv_bytes = recvfrom(sockfd, buffer, MAX_RESPONSE_SIZE, 0, nullptr, nullptr);
     if (((error_response*) buffer)->action == 3) {
         // 3 means error
-        if (log_code >= LOG_ERR) fprintf(stderr, "Server returned error:\n");
-        if (log_code >= LOG_ERR) fprintf(stderr, "Transaction id: %d\n", ((error_response*) buffer)->transaction_id);
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error message from the server: %s\n", ((error_response*) buffer)->message);
+        log_printf(log_code, LOG_ERR, "Server returned error:\n");
+        log_printf(log_code, LOG_ERR, "Transaction id: %d\n", ((error_response*) buffer)->transaction_id);
+        log_printf(log_code, LOG_ERR, "Error message from the server: %s\n", ((error_response*) buffer)->message);
         return nullptr;
     }
 
     if (recv_bytes < 0) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error while receiving announce response: %s (errno: %d)\n", strerror(errno), errno);
+        log_printf(log_code, LOG_ERR, "Error while receiving announce response: %s (errno: %d)\n", strerror(errno), errno);
         return nullptr;
     }
     if (recv_bytes < 20) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Invalid announce response\n");
+        log_printf(log_code, LOG_ERR, "Invalid announce response\n");
         return nullptr;
     }
     announce_response_t *res = malloc(sizeof(announce_response_t));
@@ -576,16 +577,16 @@ announce_response_t *announce_request_udp(const struct sockaddr *server_addr, in
         return nullptr;
     }
 
-    if (log_code >= LOG_SUMM) fprintf(stdout, "Server response:\n");
-    if (log_code >= LOG_SUMM) fprintf(stdout, "action: %u\n", res->action);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "transaction_id: %u\n", res->transaction_id);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "interval: %u\n", res->interval);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "leechers: %u\n", res->leechers);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "seeders: %u\n", res->seeders);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "peer_list: \n");
+    log_printf(log_code, LOG_SUMM, "Server response:\n");
+    log_printf(log_code, LOG_SUMM, "action: %u\n", res->action);
+    log_printf(log_code, LOG_SUMM, "transaction_id: %u\n", res->transaction_id);
+    log_printf(log_code, LOG_SUMM, "interval: %u\n", res->interval);
+    log_printf(log_code, LOG_SUMM, "leechers: %u\n", res->leechers);
+    log_printf(log_code, LOG_SUMM, "seeders: %u\n", res->seeders);
+    log_printf(log_code, LOG_SUMM, "peer_list: \n");
     int counter = 0;
     while (res->peer_list != nullptr) {
-        if (log_code >= LOG_SUMM) fprintf(stdout, "peer #%d: %s:%d\n", counter+1, res->peer_list->ip, res->peer_list->port);
+        log_printf(log_code, LOG_SUMM, "peer #%d: %s:%d\n", counter+1, res->peer_list->ip, res->peer_list->port);
         counter++;
         res->peer_list = res->peer_list->next;
     }
@@ -593,88 +594,151 @@ announce_response_t *announce_request_udp(const struct sockaddr *server_addr, in
     return res;
 }
 
+/**
+ * Milliseconds from an arbitrary point, for timeouts
+ */
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 scrape_response_t* scrape_request_udp(const struct sockaddr *server_addr, int32_t sockfd, const uint64_t connection_id, const char info_hash[], uint32_t
                                       torrent_amount, const LOG_CODE log_code) {
-    if (!server_addr || !info_hash || torrent_amount == 0) return nullptr;
-
-    scrape_request_t req;
-    req.connection_id = htobe64(connection_id);
-    req.action = htobe32(2);
-    req.transaction_id = htobe32(arc4random());
-    req.info_hash_list = info_hash;
-
-    if (log_code >= LOG_SUMM) fprintf(stdout, "Scrape request:\n");
-    if (log_code >= LOG_SUMM) fprintf(stdout, "action: %d\n", req.action);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "transaction_id: %d\n", req.transaction_id);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "connection_id: %lu\n", req.connection_id);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "info_hash: \n");
-    for (int i = 0; i < torrent_amount; ++i) {
-        if (log_code >= LOG_SUMM) fprintf(stdout, "#%d: ", i+1);
-        for (int j = 0; j < 20; ++j) {
-            if (log_code >= LOG_SUMM) fprintf(stdout, "%c",req.info_hash_list[j+20*i]);
-        }
-        if (log_code >= LOG_SUMM) fprintf(stdout, "\n");
-    }
-    char* buffer = malloc(SCRAPE_REQUEST_SIZE+20*torrent_amount);
-    memcpy(buffer, &req, SCRAPE_REQUEST_SIZE);
-    memcpy(buffer+SCRAPE_REQUEST_SIZE, req.info_hash_list, torrent_amount*20);
-    socklen_t socklen = sizeof(struct sockaddr);
-    int* scrape_res_socket = try_request_udp(1, &sockfd, (const void**)&buffer, SCRAPE_REQUEST_SIZE +20*torrent_amount, &server_addr, log_code);
-    if (scrape_res_socket == nullptr) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error while receiving scrape response\n");
-        free(scrape_res_socket);
-        return nullptr;
+    if (!server_addr || !info_hash || torrent_amount == 0 || sockfd < 0) return nullptr;
+
+    // Splitting into as few requests as possible, all sent with a single sendmmsg() per attempt
+    const uint32_t request_amount = (torrent_amount + MAX_SCRAPE_TORRENTS - 1) / MAX_SCRAPE_TORRENTS;
+    const socklen_t addr_len = server_addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    char* buffers = malloc((size_t) request_amount * (SCRAPE_REQUEST_SIZE + 20*MAX_SCRAPE_TORRENTS));
+    uint32_t* transaction_ids = malloc(sizeof(uint32_t) * request_amount);
+    bool* answered = calloc(request_amount, sizeof(bool));
+    struct mmsghdr* messages = malloc(sizeof(struct mmsghdr) * request_amount);
+    struct iovec* iovecs = malloc(sizeof(struct iovec) * request_amount);
+    scrape_response_t* res = malloc(sizeof(scrape_response_t) + sizeof(scraped_data_t)*torrent_amount);
+
+    const uint64_t connection_id_be = htobe64(connection_id);
+    const uint32_t action = htobe32(2);
+    for (uint32_t i = 0; i < request_amount; ++i) {
+        char* buffer = buffers + (size_t) i * (SCRAPE_REQUEST_SIZE + 20*MAX_SCRAPE_TORRENTS);
+        const uint32_t first = i * MAX_SCRAPE_TORRENTS;
+        const uint32_t amount = torrent_amount - first < MAX_SCRAPE_TORRENTS ? torrent_amount - first : MAX_SCRAPE_TORRENTS;
+        transaction_ids[i] = htobe32(arc4random());
+        memcpy(buffer, &connection_id_be, 8);
+        memcpy(buffer+8, &action, 4);
+        memcpy(buffer+12, &transaction_ids[i], 4);
+        memcpy(buffer+SCRAPE_REQUEST_SIZE, info_hash + (size_t) first*20, (size_t) amount*20);
+        iovecs[i].iov_base = buffer;
+        iovecs[i].iov_len = SCRAPE_REQUEST_SIZE + 20*amount;
     }
-    free(scrape_res_socket);
-    free(buffer);
+    log_printf(log_code, LOG_SUMM, "Scrape request for %u torrents in %u datagrams\n", torrent_amount, request_amount);
+
+    uint32_t pending = request_amount;
+    bool failed = false;
+    for (int32_t attempt = 0; attempt < MAX_ATTEMPTS && pending > 0 && !failed; ++attempt) {
+        // (Re)sending every unanswered request at once
+        uint32_t batch = 0;
+        memset(messages, 0, sizeof(struct mmsghdr) * request_amount);
+        for (uint32_t i = 0; i < request_amount; ++i) {
+            if (answered[i]) continue;
+            messages[batch].msg_hdr.msg_iov = &iovecs[i];
+            messages[batch].msg_hdr.msg_iovlen = 1;
+            messages[batch].msg_hdr.msg_name = (void*) server_addr;
+            messages[batch].msg_hdr.msg_namelen = addr_len;
+            batch++;
+        }
+        if (sendmmsg(sockfd, messages, batch, 0) < 0) {
+            log_printf(log_code, LOG_ERR, "Can't send scrape request: %s (errno: %d)\n", strerror(errno), errno);
+            failed = true;
+            break;
+        }
 
-    const unsigned int res_size = sizeof(scrape_response_t)+sizeof(scraped_data_t)*(torrent_amount-1);
-    scrape_response_t* res = malloc(res_size);
-    const ssize_t recv_bytes = recvfrom(sockfd, res, res_size, 0, nullptr, &socklen);
-    if (((error_response*) res)->action == 3) {
-        // 3 means error
-        if (log_code >= LOG_ERR) fprintf(stderr, "Server returned error:\n");
-        if (log_code >= LOG_ERR) fprintf(stderr, "Transaction id: %d\n", ((error_response*) res)->transaction_id);
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error message from the server: %s\n", ((error_response*) res)->message);
-        free(res);
-        return nullptr;
-    }
+        const int64_t deadline = monotonic_ms() + (int64_t) (15*pow(2, attempt)*1000);
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        while (pending > 0 && !failed) {
+            const int64_t remaining = deadline - monotonic_ms();
+            if (remaining <= 0 || poll(&pfd, 1, (int) remaining) <= 0) break;
+
+            unsigned char responses[UDP_SCRAPE_BATCH][MAX_RESPONSE_SIZE];
+            struct iovec response_iovecs[UDP_SCRAPE_BATCH];
+            struct mmsghdr response_messages[UDP_SCRAPE_BATCH];
+            memset(response_messages, 0, sizeof(response_messages));
+            for (int32_t i = 0; i < UDP_SCRAPE_BATCH; ++i) {
+                response_iovecs[i].iov_base = responses[i];
+                response_iovecs[i].iov_len = MAX_RESPONSE_SIZE;
+                response_messages[i].msg_hdr.msg_iov = &response_iovecs[i];
+                response_messages[i].msg_hdr.msg_iovlen = 1;
+            }
+            const int32_t received = recvmmsg(sockfd, response_messages, UDP_SCRAPE_BATCH, MSG_DONTWAIT, nullptr);
+            if (received < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    log_printf(log_code, LOG_ERR, "Error while receiving scrape response: %s (errno: %d)\n", strerror(errno), errno);
+                    failed = true;
+                }
+                continue;
+            }
 
-    if (recv_bytes < 0) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Error while receiving scrape response: %s (errno: %d)\n", strerror(errno), errno);
-        free(res);
-        return nullptr;
-    }
-    if (recv_bytes < 8) {
-        if (log_code >= LOG_ERR) fprintf(stderr, "Invalid scrape response\n");
-        free(res);
-        return nullptr;
+            for (int32_t i = 0; i < received; ++i) {
+                const uint32_t length = response_messages[i].msg_len;
+                if (length < 8) continue;
+                uint32_t response_action, response_transaction_id;
+                memcpy(&response_action, responses[i], 4);
+                memcpy(&response_transaction_id, responses[i]+4, 4);
+                // Finding which request this answers
+                uint32_t request = 0;
+                while (request < request_amount && transaction_ids[request] != response_transaction_id) request++;
+                if (request == request_amount || answered[request]) continue;
+
+                if (be32toh(response_action) == 3) {
+                    // 3 means error
+                    log_printf(log_code, LOG_ERR, "Server returned error: %.*s\n", (int) length-8, responses[i]+8);
+                    failed = true;
+                    break;
+                }
+                if (response_action != action) continue;
+
+                const uint32_t first = request * MAX_SCRAPE_TORRENTS;
+                const uint32_t amount = torrent_amount - first < MAX_SCRAPE_TORRENTS ? torrent_amount - first : MAX_SCRAPE_TORRENTS;
+                if (length < 8 + 12*amount) {
+                    log_printf(log_code, LOG_ERR, "Invalid scrape response\n");
+                    failed = true;
+                    break;
+                }
+                for (uint32_t j = 0; j < amount; ++j) {
+                    scraped_data_t* data = &res->scraped_data_array[first + j];
+                    memcpy(data, responses[i] + 8 + 12*j, sizeof(scraped_data_t));
+                    // Convert back to host endianness
+                    data->seeders = be32toh(data->seeders);
+                    data->completed = be32toh(data->completed);
+                    data->leechers = be32toh(data->leechers);
+                }
+                answered[request] = true;
+                pending--;
+            }
+        }
+        if (pending > 0 && !failed && LOG_ENABLED(log_code, LOG_ERR)) {
+            log_write(LOG_ERR, "Timeout #%d, %u scrape requests unanswered\n", attempt+1, pending);
+        }
     }
 
-    if (req.transaction_id == res->transaction_id && req.action == res->action) {
-        // Convert back to host endianness
-        res->action = htobe32(res->action);
-        res->transaction_id = htobe32(res->transaction_id);
-        for (int i = 0; i < torrent_amount; ++i) {
-            res->scraped_data_array[i].seeders = htobe32(res->scraped_data_array[i].seeders);
-            res->scraped_data_array[i].completed = htobe32(res->scraped_data_array[i].completed);
-            res->scraped_data_array[i].leechers = htobe32(res->scraped_data_array[i].leechers);
-        }
-    } else {
-        // Wrong server response
+    res->action = 2;
+    res->transaction_id = be32toh(transaction_ids[0]);
+    free(buffers);
+    free(transaction_ids);
+    free(answered);
+    free(messages);
+    free(iovecs);
+    if (pending > 0 || failed) {
         free(res);
         return nullptr;
     }
 
-    if (log_code >= LOG_SUMM) fprintf(stdout, "Server response:\n");
-    if (log_code >= LOG_SUMM) fprintf(stdout, "action: %u\n", res->action);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "transaction_id: %u\n", res->transaction_id);
-    if (log_code >= LOG_SUMM) fprintf(stdout, "scraped_data_array:\n");
+    log_printf(log_code, LOG_SUMM, "scraped_data_array:\n");
     for (int i = 0; i < torrent_amount; ++i) {
-        if (log_code >= LOG_SUMM) fprintf(stdout, "torrent #%d:\n", i+1);
-        if (log_code >= LOG_SUMM) fprintf(stdout, "seeders: %d\n", res->scraped_data_array[i].seeders);
-        if (log_code >= LOG_SUMM) fprintf(stdout, "completed: %d\n", res->scraped_data_array[i].completed);
-        if (log_code >= LOG_SUMM) fprintf(stdout, "leechers: %d\n", res->scraped_data_array[i].leechers);
+        log_printf(log_code, LOG_SUMM, "torrent #%d:\n", i+1);
+        log_printf(log_code, LOG_SUMM, "seeders: %d\n", res->scraped_data_array[i].seeders);
+        log_printf(log_code, LOG_SUMM, "completed: %d\n", res->scraped_data_array[i].completed);
+        log_printf(log_code, LOG_SUMM, "leechers: %d\n", res->scraped_data_array[i].leechers);
     }
     return res;
-}
\ No newline at end of file
+}
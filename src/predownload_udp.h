@@ -12,6 +12,10 @@
 #define ANNOUNCE_REQUEST_SIZE 98
 #define SCRAPE_REQUEST_SIZE 16
 #define MAX_RESPONSE_SIZE 1500
+/// Most info hashes a single scrape request can ask about, so that both request and response fit in one datagram
+#define MAX_SCRAPE_TORRENTS 74
+/// Amount of scrape responses read by a single recvmmsg() call
+#define UDP_SCRAPE_BATCH 16
 
 typedef enum {
     HTTP,
@@ -19,6 +23,14 @@ typedef enum {
     UDP
 } Protocols;
 
+/// @brief Announce events, as sent in UDP and HTTP announce requests
+typedef enum {
+    ANNOUNCE_EVENT_NONE = 0,
+    ANNOUNCE_EVENT_COMPLETED = 1,
+    ANNOUNCE_EVENT_STARTED = 2,
+    ANNOUNCE_EVENT_STOPPED = 3
+} ANNOUNCE_EVENT;
+
 typedef struct {
     char* host;
     char* port;
@@ -251,16 +263,18 @@ announce_response_t *announce_request_udp(
 );
 
 /**
- * Requests torrent scrape data to tracker
+ * Requests torrent scrape data to tracker. Any amount of info hashes can be asked about: they're split into
+ * requests of up to MAX_SCRAPE_TORRENTS, all sent with a single sendmmsg() call and retransmitted together
  * @param server_addr Server address
  * @param sockfd Socket file descriptor
  * @param connection_id Returned from connect response of the tracker
- * @param info_hash Info hash of all the torrents
+ * @param info_hash Info hash of all the torrents, 20 bytes each, one after the other
  * @param torrent_amount The amount of torrents to ask about
  * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
  *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
  *                 LOG_FULL (detailed logging).
- * @return The data returned or nullptr if there's an error
+ * @return The data returned, in the same order as info_hash, or nullptr if there's an error or
+ *         any of the requests went unanswered
  */
 scrape_response_t* scrape_request_udp(const struct sockaddr *server_addr, int32_t sockfd, uint64_t connection_id, const char info_hash[], uint32_t
                                       torrent_amount, LOG_CODE log_code);
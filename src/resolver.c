@@ -0,0 +1,278 @@
+#include "resolver.h"
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "logger.h"
+
+static void free_job(resolve_job_t* job) {
+    free(job->host);
+    free(job->port);
+    free(job);
+}
+
+/**
+ * Wakes up the event loop. Called with the mutex held
+ */
+static void notify_loop(const resolver_t* resolver) {
+    const uint64_t one = 1;
+    if (write(resolver->event_fd, &one, sizeof(one)) < 0) {
+        // The counter only overflows after 2^64-1 unread writes
+    }
+}
+
+/**
+ * Resolves the job's hostname, picking the first IPv4 address or, if there's none, the first IPv6 one
+ */
+static void run_job(resolve_job_t* job) {
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = job->socktype;
+    const uint64_t start = monotonic_us();
+    const int err = getaddrinfo(job->host, job->port, &hints, &res);
+    job->latency_us = monotonic_us() - start;
+    if (err != 0) {
+        job->failed = true;
+        return;
+    }
+
+    const struct addrinfo* chosen = nullptr;
+    for (const struct addrinfo* rp = res; rp != nullptr; rp = rp->ai_next) {
+        if (rp->ai_family == AF_INET) {
+            chosen = rp;
+            break;
+        }
+        // IPv6 only as a fallback, since WSL doesn't support IPv6 connections
+        if (rp->ai_family == AF_INET6 && chosen == nullptr) chosen = rp;
+    }
+    if (chosen && chosen->ai_addrlen <= sizeof(job->addr)) {
+        memcpy(&job->addr, chosen->ai_addr, chosen->ai_addrlen);
+        job->addr_len = chosen->ai_addrlen;
+    } else job->failed = true;
+    freeaddrinfo(res);
+}
+
+static void* worker(void* arg) {
+    resolver_t* resolver = arg;
+    pthread_mutex_lock(&resolver->mutex);
+    while (true) {
+        resolve_job_t* job = nullptr;
+        while (!resolver->shutdown) {
+            for (job = resolver->jobs; job != nullptr && job->state != RESOLVE_PENDING; job = job->next) {}
+            if (job) break;
+            pthread_cond_wait(&resolver->cond, &resolver->mutex);
+        }
+        if (resolver->shutdown) break;
+
+        // Running jobs are never freed by the loop, so they can be used without the lock
+        job->state = RESOLVE_RUNNING;
+        pthread_mutex_unlock(&resolver->mutex);
+        run_job(job);
+        pthread_mutex_lock(&resolver->mutex);
+        job->state = RESOLVE_DONE;
+        notify_loop(resolver);
+    }
+    pthread_mutex_unlock(&resolver->mutex);
+    return nullptr;
+}
+
+/**
+ * Finds a valid cache entry, dropping it if it expired
+ */
+static resolver_cache_entry_t* cache_lookup(resolver_t* resolver, const char* host, const char* port,
+                                            const time_t now) {
+    for (uint32_t i = 0; i < RESOLVER_CACHE_SIZE; ++i) {
+        resolver_cache_entry_t* entry = &resolver->cache[i];
+        if (entry->host == nullptr || strcmp(entry->host, host) != 0 || strcmp(entry->port, port) != 0) continue;
+        if (entry->expires > now) return entry;
+        free(entry->host);
+        free(entry->port);
+        entry->host = nullptr;
+        entry->port = nullptr;
+        return nullptr;
+    }
+    return nullptr;
+}
+
+static void cache_store(resolver_t* resolver, const resolve_job_t* job, const time_t now) {
+    // Replacing the same hostname, a free entry, or the one closest to expiring
+    resolver_cache_entry_t* slot = &resolver->cache[0];
+    for (uint32_t i = 0; i < RESOLVER_CACHE_SIZE; ++i) {
+        resolver_cache_entry_t* entry = &resolver->cache[i];
+        if (entry->host == nullptr || (strcmp(entry->host, job->host) == 0 && strcmp(entry->port, job->port) == 0)) {
+            slot = entry;
+            break;
+        }
+        if (entry->expires < slot->expires) slot = entry;
+    }
+    free(slot->host);
+    free(slot->port);
+    slot->host = strdup(job->host);
+    slot->port = strdup(job->port);
+    slot->failed = job->failed;
+    slot->addr = job->addr;
+    slot->addr_len = job->addr_len;
+    slot->expires = now + (job->failed ? RESOLVER_NEGATIVE_TTL : RESOLVER_POSITIVE_TTL);
+}
+
+/**
+ * Delivers every finished job, from the event loop
+ */
+static void deliver(void* ctx, const uint32_t events) {
+    (void) events;
+    resolver_t* resolver = ctx;
+    uint64_t counter;
+    if (read(resolver->event_fd, &counter, sizeof(counter)) < 0) {
+        // Already read by a previous call
+    }
+
+    // Taking finished jobs out, so callbacks run without the lock
+    resolve_job_t* done = nullptr;
+    resolve_job_t** done_tail = &done;
+    pthread_mutex_lock(&resolver->mutex);
+    resolve_job_t** current = &resolver->jobs;
+    resolver->last_job = nullptr;
+    while (*current != nullptr) {
+        resolve_job_t* job = *current;
+        if (job->state == RESOLVE_DONE) {
+            *current = job->next;
+            job->next = nullptr;
+            *done_tail = job;
+            done_tail = &job->next;
+        } else {
+            resolver->last_job = job;
+            current = &job->next;
+        }
+    }
+    pthread_mutex_unlock(&resolver->mutex);
+
+    const time_t now = time(nullptr);
+    while (done != nullptr) {
+        resolve_job_t* job = done;
+        done = job->next;
+        if (!job->cached) {
+            cache_store(resolver, job, now);
+            resolver->stats.resolutions++;
+            resolver->stats.total_latency_us += job->latency_us;
+            if (job->latency_us > resolver->stats.max_latency_us) resolver->stats.max_latency_us = job->latency_us;
+            if (job->failed) {
+                resolver->stats.failures++;
+                log_printf(resolver->log_code, LOG_ERR, "Couldn't resolve %s\n", job->host);
+            } else if (LOG_ENABLED(resolver->log_code, LOG_FULL)) {
+                log_write(LOG_FULL, "Resolved %s in %lu us\n", job->host, (unsigned long) job->latency_us);
+            }
+        }
+        if (job->callback) {
+            job->callback(job->ctx, job->failed ? nullptr : (struct sockaddr*) &job->addr,
+                          job->failed ? 0 : job->addr_len);
+        }
+        free_job(job);
+    }
+}
+
+resolver_t* resolver_create(event_loop_t* loop, const LOG_CODE log_code) {
+    if (!loop) return nullptr;
+    resolver_t* resolver = calloc(1, sizeof(resolver_t));
+    if (!resolver) return nullptr;
+    resolver->loop = loop;
+    resolver->log_code = log_code;
+    resolver->next_id = 1;
+    resolver->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (resolver->event_fd < 0) {
+        free(resolver);
+        return nullptr;
+    }
+    resolver->loop_slot = loop_add_source(loop, resolver->event_fd, EPOLLIN, deliver, resolver);
+    if (resolver->loop_slot < 0) {
+        close(resolver->event_fd);
+        free(resolver);
+        return nullptr;
+    }
+    pthread_mutex_init(&resolver->mutex, nullptr);
+    pthread_cond_init(&resolver->cond, nullptr);
+    for (uint32_t i = 0; i < RESOLVER_THREADS; ++i) {
+        pthread_create(&resolver->threads[i], nullptr, worker, resolver);
+    }
+    return resolver;
+}
+
+void resolver_free(resolver_t* resolver) {
+    if (resolver == nullptr) return;
+    pthread_mutex_lock(&resolver->mutex);
+    resolver->shutdown = true;
+    pthread_cond_broadcast(&resolver->cond);
+    pthread_mutex_unlock(&resolver->mutex);
+    for (uint32_t i = 0; i < RESOLVER_THREADS; ++i) {
+        pthread_join(resolver->threads[i], nullptr);
+    }
+
+    while (resolver->jobs != nullptr) {
+        resolve_job_t* job = resolver->jobs;
+        resolver->jobs = job->next;
+        free_job(job);
+    }
+    for (uint32_t i = 0; i < RESOLVER_CACHE_SIZE; ++i) {
+        free(resolver->cache[i].host);
+        free(resolver->cache[i].port);
+    }
+    loop_remove_source(resolver->loop, resolver->loop_slot);
+    close(resolver->event_fd);
+    pthread_cond_destroy(&resolver->cond);
+    pthread_mutex_destroy(&resolver->mutex);
+    free(resolver);
+}
+
+uint32_t resolver_resolve(resolver_t* resolver, const char* host, const char* port, const int32_t socktype,
+                          const resolve_callback_t callback, void* ctx) {
+    if (!resolver || !host || !port || !callback) return 0;
+    resolve_job_t* job = calloc(1, sizeof(resolve_job_t));
+    if (!job) return 0;
+    job->host = strdup(host);
+    job->port = strdup(port);
+    job->socktype = socktype;
+    job->callback = callback;
+    job->ctx = ctx;
+    resolver->stats.lookups++;
+
+    const resolver_cache_entry_t* entry = cache_lookup(resolver, host, port, time(nullptr));
+    if (entry) {
+        // Still delivered from the loop, so callers never see their callback run before this returns
+        job->state = RESOLVE_DONE;
+        job->cached = true;
+        job->failed = entry->failed;
+        job->addr = entry->addr;
+        job->addr_len = entry->addr_len;
+        if (entry->failed) resolver->stats.negative_hits++;
+        else resolver->stats.cache_hits++;
+    }
+
+    pthread_mutex_lock(&resolver->mutex);
+    job->id = resolver->next_id++;
+    // 0 means failure
+    if (resolver->next_id == 0) resolver->next_id = 1;
+    if (resolver->last_job) resolver->last_job->next = job;
+    else resolver->jobs = job;
+    resolver->last_job = job;
+    if (entry) notify_loop(resolver);
+    else pthread_cond_signal(&resolver->cond);
+    const uint32_t id = job->id;
+    pthread_mutex_unlock(&resolver->mutex);
+    return id;
+}
+
+void resolver_cancel(resolver_t* resolver, const uint32_t id) {
+    if (resolver == nullptr || id == 0) return;
+    pthread_mutex_lock(&resolver->mutex);
+    for (resolve_job_t* job = resolver->jobs; job != nullptr; job = job->next) {
+        if (job->id == id) {
+            // Still resolved, so the result ends up cached for the next lookup
+            job->callback = nullptr;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&resolver->mutex);
+}
@@ -0,0 +1,134 @@
+#ifndef BITTORRENT_CLIENT_RESOLVER_H
+#define BITTORRENT_CLIENT_RESOLVER_H
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+#include "util.h"
+
+/// @brief Amount of worker threads calling getaddrinfo()
+#define RESOLVER_THREADS 2
+/// @brief Seconds a successful resolution is reused. getaddrinfo() doesn't report the record's own TTL
+#define RESOLVER_POSITIVE_TTL 300
+/// @brief Seconds a failed resolution is remembered, so a dead hostname isn't looked up on every retry
+#define RESOLVER_NEGATIVE_TTL 30
+/// @brief Most hostnames kept in the cache. The one closest to expiring is evicted first
+#define RESOLVER_CACHE_SIZE 64
+
+/**
+ * Function called, from the event loop, once a hostname is resolved.
+ *
+ * @param ctx The context pointer given to resolver_resolve().
+ * @param addr The resolved address, with the port already set, or nullptr if resolution failed.
+ *             Only valid during the call.
+ * @param addr_len Length of addr, or 0 if resolution failed.
+ */
+typedef void (*resolve_callback_t)(void *ctx, const struct sockaddr *addr, socklen_t addr_len);
+
+/// @brief States of a resolution job
+typedef enum {
+    RESOLVE_PENDING, /**< Waiting for a worker */
+    RESOLVE_RUNNING, /**< A worker is calling getaddrinfo() */
+    RESOLVE_DONE /**< Waiting to be delivered by the event loop */
+} RESOLVE_STATE;
+
+/// @brief A hostname to resolve, shared between the event loop and the workers
+typedef struct resolve_job_t {
+    uint32_t id; /**< Id returned by resolver_resolve() */
+    char *host; /**< Hostname to resolve */
+    char *port; /**< Port, as a string */
+    int32_t socktype; /**< SOCK_DGRAM or SOCK_STREAM */
+    RESOLVE_STATE state; /**< Current state */
+    bool cached; /**< Whether the result came from the cache, so there's nothing to store */
+    bool failed; /**< Whether resolution failed */
+    struct sockaddr_storage addr; /**< Resolved address */
+    socklen_t addr_len; /**< Length of addr */
+    uint64_t latency_us; /**< Microseconds getaddrinfo() took */
+    resolve_callback_t callback; /**< Function called with the result, or nullptr if cancelled */
+    void *ctx; /**< Passed as is to callback */
+    struct resolve_job_t *next; /**< Next job, in submission order */
+} resolve_job_t;
+
+/// @brief A cached resolution, positive or negative
+typedef struct {
+    char *host; /**< Hostname, or nullptr if the entry is free */
+    char *port; /**< Port, as a string */
+    bool failed; /**< Whether this is a negative entry */
+    struct sockaddr_storage addr; /**< Resolved address, for positive entries */
+    socklen_t addr_len; /**< Length of addr */
+    time_t expires; /**< When the entry stops being valid */
+} resolver_cache_entry_t;
+
+/// @brief Counters to observe how the resolver behaves
+typedef struct {
+    uint64_t lookups; /**< Calls to resolver_resolve() */
+    uint64_t cache_hits; /**< Lookups answered by a positive cache entry */
+    uint64_t negative_hits; /**< Lookups answered by a negative cache entry */
+    uint64_t resolutions; /**< Calls to getaddrinfo() made by the workers */
+    uint64_t failures; /**< Calls to getaddrinfo() that failed */
+    uint64_t total_latency_us; /**< Microseconds spent in getaddrinfo(), added up */
+    uint64_t max_latency_us; /**< Slowest getaddrinfo() call, in microseconds */
+} resolver_stats_t;
+
+/// @brief Resolves hostnames on worker threads, so the event loop never blocks on DNS
+typedef struct {
+    event_loop_t *loop; /**< Loop completions are delivered to */
+    int32_t event_fd; /**< Eventfd written by workers whenever a job is done */
+    int32_t loop_slot; /**< Slot of event_fd in the loop */
+    pthread_t threads[RESOLVER_THREADS]; /**< Worker threads */
+    pthread_mutex_t mutex; /**< Protects jobs and shutdown */
+    pthread_cond_t cond; /**< Signalled when a job is submitted or on shutdown */
+    resolve_job_t *jobs; /**< Jobs not delivered yet, oldest first */
+    resolve_job_t *last_job; /**< Last job in jobs, where new ones are appended */
+    bool shutdown; /**< Whether the workers must exit */
+    uint32_t next_id; /**< Id of the next job */
+    resolver_cache_entry_t cache[RESOLVER_CACHE_SIZE]; /**< Cached resolutions. Only touched by the loop thread */
+    resolver_stats_t stats; /**< Counters. Only touched by the loop thread */
+    LOG_CODE log_code; /**< Logging level */
+} resolver_t;
+
+/**
+ * Creates a resolver and starts its worker threads.
+ *
+ * @param loop The event loop completions are delivered to.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to the resolver, or nullptr on failure.
+ */
+resolver_t *resolver_create(event_loop_t *loop, LOG_CODE log_code);
+
+/**
+ * Stops the workers, waiting for resolutions in progress, and frees the resolver.
+ * Callbacks of jobs not delivered yet are never called.
+ *
+ * @param resolver The resolver to free. If nullptr, nothing is done.
+ */
+void resolver_free(resolver_t *resolver);
+
+/**
+ * Resolves a hostname without blocking. IPv4 addresses are preferred over IPv6 ones, like url_to_ip() does.
+ * The callback is always called from the event loop, never from inside this function, even for cache hits.
+ *
+ * @param resolver The resolver.
+ * @param host The hostname, or an IP address.
+ * @param port The port, as a string.
+ * @param socktype SOCK_DGRAM or SOCK_STREAM.
+ * @param callback Function called with the result.
+ * @param ctx Passed as is to callback.
+ * @return The id of the job, needed only to cancel it, or 0 on failure.
+ */
+uint32_t resolver_resolve(resolver_t *resolver, const char *host, const char *port, int32_t socktype,
+                          resolve_callback_t callback, void *ctx);
+
+/**
+ * Stops waiting for a resolution. Its callback won't be called.
+ *
+ * @param resolver The resolver.
+ * @param id Id returned by resolver_resolve(). 0 is ignored.
+ */
+void resolver_cancel(resolver_t *resolver, uint32_t id);
+
+#endif //BITTORRENT_CLIENT_RESOLVER_H
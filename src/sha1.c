@@ -0,0 +1,440 @@
+#include "sha1.h"
+
+#include <string.h>
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+/// @brief Set when the x86 engines are built, everywhere else only OpenSSL's is there
+#define SHA1_X86
+#endif
+
+/// @brief Bytes of a SHA1 block
+#define SHA1_BLOCK_SIZE 64
+/// @brief Fewest buffers a batch goes through lanes with, fewer go one at a time as idle lanes would waste more
+#define SHA1_MIN_LANE_FILL 6
+
+/// @brief Words of the state before the first block
+static const uint32_t initial_state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+static const char *const engine_names[SHA1_ENGINE_COUNT] = {"auto", "openssl", "sha_ni", "avx2", "avx512"};
+
+/// @brief Bitfield of the supported engines, by their value, or 0 until they're checked
+static uint32_t supported_engines;
+/// @brief Engine every hash goes through, SHA1_ENGINE_AUTO to pick them
+static SHA1_ENGINE forced_engine = SHA1_ENGINE_AUTO;
+
+/**
+ * Pads the end of a message: its last partial block, a one bit, zeros and its length in bits
+ * @return Blocks written into tail, 1 or 2
+ */
+static uint32_t pad_tail(const unsigned char* data, const uint64_t length, unsigned char* tail) {
+    const uint32_t rest = length % SHA1_BLOCK_SIZE;
+    const uint32_t blocks = rest < SHA1_BLOCK_SIZE - 8 ? 1 : 2;
+    memset(tail, 0, blocks * SHA1_BLOCK_SIZE);
+    if (rest > 0) memcpy(tail, data + length - rest, rest);
+    tail[rest] = 0x80;
+    const uint64_t bits = length * 8;
+    for (uint32_t i = 0; i < 8; ++i) tail[blocks * SHA1_BLOCK_SIZE - 1 - i] = (unsigned char) (bits >> 8 * i);
+    return blocks;
+}
+
+/**
+ * Writes state words big-endian, every stride words apart, as multi-buffer engines lay out their lanes
+ */
+static void write_hash(const uint32_t* state, const uint32_t stride, unsigned char* hash) {
+    for (uint32_t i = 0; i < 5; ++i) {
+        const uint32_t word = state[i * stride];
+        hash[4 * i] = (unsigned char) (word >> 24);
+        hash[4 * i + 1] = (unsigned char) (word >> 16);
+        hash[4 * i + 2] = (unsigned char) (word >> 8);
+        hash[4 * i + 3] = (unsigned char) word;
+    }
+}
+
+#ifdef SHA1_X86
+
+/*
+ * SHA extensions: four rounds per instruction, with the message schedule in hardware too
+ */
+
+/**
+ * Four rounds of a block, groups 0 to 19. A group hashes the four words in its message register while the other
+ * registers are scheduled for the groups ahead, and the two E registers swap between rounds and the next group's
+ * input, so which register does what follows from the group's number
+ */
+#define SHA_NI_GROUP(group, function) \
+    do { \
+        if ((group) < 4) { \
+            message[(group) % 4] = _mm_shuffle_epi8( \
+                _mm_loadu_si128((const __m128i*) (data + 16 * ((group) % 4))), byte_order); \
+        } \
+        if ((group) == 0) e[0] = _mm_add_epi32(e[0], message[0]); \
+        else e[(group) % 2] = _mm_sha1nexte_epu32(e[(group) % 2], message[(group) % 4]); \
+        e[((group) + 1) % 2] = abcd; \
+        if ((group) >= 3 && (group) <= 18) { \
+            message[((group) + 1) % 4] = _mm_sha1msg2_epu32(message[((group) + 1) % 4], message[(group) % 4]); \
+        } \
+        abcd = _mm_sha1rnds4_epu32(abcd, e[(group) % 2], function); \
+        if ((group) >= 1 && (group) <= 16) { \
+            message[((group) + 3) % 4] = _mm_sha1msg1_epu32(message[((group) + 3) % 4], message[(group) % 4]); \
+        } \
+        if ((group) >= 2 && (group) <= 17) { \
+            message[((group) + 2) % 4] = _mm_xor_si128(message[((group) + 2) % 4], message[(group) % 4]); \
+        } \
+    } while (0)
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha_ni_blocks(uint32_t* state, const unsigned char* data, uint64_t blocks) {
+    const __m128i byte_order = _mm_set_epi64x(0x0001020304050607ll, 0x08090a0b0c0d0e0fll);
+    // The instructions want A in the highest word and E on its own
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) state), 0x1B);
+    __m128i e_saved = _mm_set_epi32((int) state[4], 0, 0, 0);
+    for (; blocks > 0; --blocks, data += SHA1_BLOCK_SIZE) {
+        const __m128i abcd_saved = abcd;
+        __m128i e[2] = {e_saved, e_saved};
+        __m128i message[4];
+        SHA_NI_GROUP(0, 0); SHA_NI_GROUP(1, 0); SHA_NI_GROUP(2, 0); SHA_NI_GROUP(3, 0); SHA_NI_GROUP(4, 0);
+        SHA_NI_GROUP(5, 1); SHA_NI_GROUP(6, 1); SHA_NI_GROUP(7, 1); SHA_NI_GROUP(8, 1); SHA_NI_GROUP(9, 1);
+        SHA_NI_GROUP(10, 2); SHA_NI_GROUP(11, 2); SHA_NI_GROUP(12, 2); SHA_NI_GROUP(13, 2); SHA_NI_GROUP(14, 2);
+        SHA_NI_GROUP(15, 3); SHA_NI_GROUP(16, 3); SHA_NI_GROUP(17, 3); SHA_NI_GROUP(18, 3); SHA_NI_GROUP(19, 3);
+        // The last group left the E before it in e[0]
+        e_saved = _mm_sha1nexte_epu32(e[0], e_saved);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+    }
+    _mm_storeu_si128((__m128i*) state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t) _mm_extract_epi32(e_saved, 3);
+}
+
+static void sha_ni_hash(const unsigned char* data, const uint64_t length, unsigned char* hash) {
+    uint32_t state[5];
+    memcpy(state, initial_state, sizeof(state));
+    sha_ni_blocks(state, data, length / SHA1_BLOCK_SIZE);
+    unsigned char tail[2 * SHA1_BLOCK_SIZE];
+    sha_ni_blocks(state, tail, pad_tail(data, length, tail));
+    write_hash(state, 1, hash);
+}
+
+/*
+ * Multi-buffer: the rounds of 8 or 16 messages side by side, a 32-bit lane of a vector each. Lanes hash blocks in
+ * lockstep, each from its own row of blocks
+ */
+
+/**
+ * Runs blocks through the lanes of a multi-buffer engine. Lanes not in active read blocks like any other, but
+ * their state is left as it was.
+ *
+ * @param state Words of the lanes' states, the first word of every lane, then the second and so on.
+ * @param rows Blocks of each lane, at least blocks of them in a row.
+ * @param blocks Blocks each lane hashes.
+ * @param active Bitfield of the lanes whose state is updated.
+ */
+typedef void (*lanes_blocks_t)(uint32_t* state, const unsigned char* const* rows, uint64_t blocks, uint32_t active);
+
+/**
+ * Loads 8 big-endian words, at offset in each of 8 rows, as 8 vectors holding a word of every row
+ */
+__attribute__((target("avx2")))
+static inline void load_words_avx2(const unsigned char* const* rows, const uint64_t offset, __m256i* words) {
+    const __m256i byte_order = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                               12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m256i row[8];
+    for (uint32_t i = 0; i < 8; ++i) row[i] = _mm256_loadu_si256((const __m256i*) (rows[i] + offset));
+    // Transposed by pairs of words, then of double words, then of halves
+    __m256i pairs[8];
+    for (uint32_t i = 0; i < 8; i += 2) {
+        pairs[i] = _mm256_unpacklo_epi32(row[i], row[i + 1]);
+        pairs[i + 1] = _mm256_unpackhi_epi32(row[i], row[i + 1]);
+    }
+    __m256i quads[8];
+    for (uint32_t i = 0; i < 8; i += 4) {
+        quads[i] = _mm256_unpacklo_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 1] = _mm256_unpackhi_epi64(pairs[i], pairs[i + 2]);
+        quads[i + 2] = _mm256_unpacklo_epi64(pairs[i + 1], pairs[i + 3]);
+        quads[i + 3] = _mm256_unpackhi_epi64(pairs[i + 1], pairs[i + 3]);
+    }
+    for (uint32_t i = 0; i < 4; ++i) {
+        words[i] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(quads[i], quads[i + 4], 0x20), byte_order);
+        words[i + 4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(quads[i], quads[i + 4], 0x31), byte_order);
+    }
+}
+
+/// @brief Word t of the message schedule, kept in a window of the last 16
+#define SCHEDULE(t, xor4, rol) \
+    ((t) < 16 ? w[(t) & 15] \
+              : (w[(t) & 15] = rol(xor4(w[((t) - 3) & 15], w[((t) - 8) & 15], w[((t) - 14) & 15], w[(t) & 15]), 1)))
+
+/**
+ * A round, with the variables named by their role in it. The next round's roles are the same variables shifted by
+ * one, so five rounds bring them back where they started
+ */
+#define ROUND(a, b, c, d, e, t, function, constant, add, rol, xor4) \
+    do { \
+        e = add(add(e, rol(a, 5)), add(add(function(b, c, d), constant), SCHEDULE(t, xor4, rol))); \
+        b = rol(b, 30); \
+    } while (0)
+
+#define FIVE_ROUNDS(t, function, constant, add, rol, xor4) \
+    do { \
+        ROUND(a, b, c, d, e, (t), function, constant, add, rol, xor4); \
+        ROUND(e, a, b, c, d, (t) + 1, function, constant, add, rol, xor4); \
+        ROUND(d, e, a, b, c, (t) + 2, function, constant, add, rol, xor4); \
+        ROUND(c, d, e, a, b, (t) + 3, function, constant, add, rol, xor4); \
+        ROUND(b, c, d, e, a, (t) + 4, function, constant, add, rol, xor4); \
+    } while (0)
+
+#define TWENTY_ROUNDS(t, function, constant, add, rol, xor4) \
+    do { \
+        FIVE_ROUNDS((t), function, constant, add, rol, xor4); \
+        FIVE_ROUNDS((t) + 5, function, constant, add, rol, xor4); \
+        FIVE_ROUNDS((t) + 10, function, constant, add, rol, xor4); \
+        FIVE_ROUNDS((t) + 15, function, constant, add, rol, xor4); \
+    } while (0)
+
+#define ROL_AVX2(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+#define XOR4_AVX2(x, y, z, v) _mm256_xor_si256(_mm256_xor_si256((x), (y)), _mm256_xor_si256((z), (v)))
+#define CHOOSE_AVX2(b, c, d) _mm256_xor_si256((d), _mm256_and_si256((b), _mm256_xor_si256((c), (d))))
+#define PARITY_AVX2(b, c, d) _mm256_xor_si256(_mm256_xor_si256((b), (c)), (d))
+#define MAJORITY_AVX2(b, c, d) \
+    _mm256_or_si256(_mm256_and_si256((b), (c)), _mm256_and_si256((d), _mm256_or_si256((b), (c))))
+
+__attribute__((target("avx2")))
+static void avx2_blocks(uint32_t* state, const unsigned char* const* rows, const uint64_t blocks,
+                        const uint32_t active) {
+    const __m256i lane_bits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    const __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32((int) active), lane_bits),
+                                            lane_bits);
+    __m256i saved[5];
+    for (uint32_t i = 0; i < 5; ++i) saved[i] = _mm256_loadu_si256((const __m256i*) (state + 8 * i));
+    for (uint64_t block = 0; block < blocks; ++block) {
+        __m256i w[16];
+        load_words_avx2(rows, block * SHA1_BLOCK_SIZE, w);
+        load_words_avx2(rows, block * SHA1_BLOCK_SIZE + 32, w + 8);
+        __m256i a = saved[0], b = saved[1], c = saved[2], d = saved[3], e = saved[4];
+        TWENTY_ROUNDS(0, CHOOSE_AVX2, _mm256_set1_epi32(0x5A827999), _mm256_add_epi32, ROL_AVX2, XOR4_AVX2);
+        TWENTY_ROUNDS(20, PARITY_AVX2, _mm256_set1_epi32(0x6ED9EBA1), _mm256_add_epi32, ROL_AVX2, XOR4_AVX2);
+        TWENTY_ROUNDS(40, MAJORITY_AVX2, _mm256_set1_epi32((int) 0x8F1BBCDC), _mm256_add_epi32, ROL_AVX2,
+                      XOR4_AVX2);
+        TWENTY_ROUNDS(60, PARITY_AVX2, _mm256_set1_epi32((int) 0xCA62C1D6), _mm256_add_epi32, ROL_AVX2, XOR4_AVX2);
+        // Idle lanes keep their state
+        const __m256i sums[5] = {a, b, c, d, e};
+        for (uint32_t i = 0; i < 5; ++i) {
+            saved[i] = _mm256_blendv_epi8(saved[i], _mm256_add_epi32(saved[i], sums[i]), mask);
+        }
+    }
+    for (uint32_t i = 0; i < 5; ++i) _mm256_storeu_si256((__m256i*) (state + 8 * i), saved[i]);
+}
+
+#define ROL_AVX512(x, n) _mm512_rol_epi32((x), (n))
+#define XOR4_AVX512(x, y, z, v) _mm512_xor_si512(_mm512_ternarylogic_epi32((x), (y), (z), 0x96), (v))
+#define CHOOSE_AVX512(b, c, d) _mm512_ternarylogic_epi32((b), (c), (d), 0xCA)
+#define PARITY_AVX512(b, c, d) _mm512_ternarylogic_epi32((b), (c), (d), 0x96)
+#define MAJORITY_AVX512(b, c, d) _mm512_ternarylogic_epi32((b), (c), (d), 0xE8)
+
+__attribute__((target("avx2,avx512f")))
+static void avx512_blocks(uint32_t* state, const unsigned char* const* rows, const uint64_t blocks,
+                          const uint32_t active) {
+    __m512i saved[5];
+    for (uint32_t i = 0; i < 5; ++i) saved[i] = _mm512_loadu_si512(state + 16 * i);
+    for (uint64_t block = 0; block < blocks; ++block) {
+        // Each half of the lanes is transposed on its own, then they're put together
+        __m256i low[16], high[16];
+        load_words_avx2(rows, block * SHA1_BLOCK_SIZE, low);
+        load_words_avx2(rows, block * SHA1_BLOCK_SIZE + 32, low + 8);
+        load_words_avx2(rows + 8, block * SHA1_BLOCK_SIZE, high);
+        load_words_avx2(rows + 8, block * SHA1_BLOCK_SIZE + 32, high + 8);
+        __m512i w[16];
+        for (uint32_t i = 0; i < 16; ++i) w[i] = _mm512_inserti64x4(_mm512_castsi256_si512(low[i]), high[i], 1);
+        __m512i a = saved[0], b = saved[1], c = saved[2], d = saved[3], e = saved[4];
+        TWENTY_ROUNDS(0, CHOOSE_AVX512, _mm512_set1_epi32(0x5A827999), _mm512_add_epi32, ROL_AVX512, XOR4_AVX512);
+        TWENTY_ROUNDS(20, PARITY_AVX512, _mm512_set1_epi32(0x6ED9EBA1), _mm512_add_epi32, ROL_AVX512,
+                      XOR4_AVX512);
+        TWENTY_ROUNDS(40, MAJORITY_AVX512, _mm512_set1_epi32((int) 0x8F1BBCDC), _mm512_add_epi32, ROL_AVX512,
+                      XOR4_AVX512);
+        TWENTY_ROUNDS(60, PARITY_AVX512, _mm512_set1_epi32((int) 0xCA62C1D6), _mm512_add_epi32, ROL_AVX512,
+                      XOR4_AVX512);
+        // Idle lanes keep their state
+        const __m512i sums[5] = {a, b, c, d, e};
+        for (uint32_t i = 0; i < 5; ++i) {
+            saved[i] = _mm512_mask_add_epi32(saved[i], (__mmask16) active, saved[i], sums[i]);
+        }
+    }
+    for (uint32_t i = 0; i < 5; ++i) _mm512_storeu_si512(state + 16 * i, saved[i]);
+}
+
+/**
+ * Hashes a batch through the lanes of a multi-buffer engine. A lane's blocks come in two runs, the message's whole
+ * blocks in place, then its padded tail. Every step runs as many blocks as the shortest run left in a busy lane,
+ * after which lanes move on to their tail, or hand their hash over and take the next buffer
+ */
+static void lanes_hash(const lanes_blocks_t run, const uint32_t lanes, const unsigned char* const* data,
+                       const uint64_t* lengths, const uint32_t amount, unsigned char* hashes) {
+    uint32_t state[5 * SHA1_MAX_LANES];
+    const unsigned char* rows[SHA1_MAX_LANES];
+    unsigned char tails[SHA1_MAX_LANES][2 * SHA1_BLOCK_SIZE];
+    uint64_t left[SHA1_MAX_LANES]; // Blocks left in the lane's current run
+    uint32_t buffer[SHA1_MAX_LANES]; // Index of the buffer the lane hashes
+    uint32_t in_tail = 0; // Bitfield of the lanes on their tail
+    uint32_t active = 0;
+    uint32_t next = 0;
+    while (true) {
+        for (uint32_t lane = 0; lane < lanes && next < amount; ++lane) {
+            if (active & 1u << lane) continue;
+            buffer[lane] = next++;
+            for (uint32_t i = 0; i < 5; ++i) state[i * lanes + lane] = initial_state[i];
+            rows[lane] = data[buffer[lane]];
+            left[lane] = lengths[buffer[lane]] / SHA1_BLOCK_SIZE;
+            active |= 1u << lane;
+            in_tail &= ~(1u << lane);
+            if (left[lane] == 0) {
+                left[lane] = pad_tail(data[buffer[lane]], lengths[buffer[lane]], tails[lane]);
+                rows[lane] = tails[lane];
+                in_tail |= 1u << lane;
+            }
+        }
+        if (active == 0) return;
+
+        uint64_t blocks = UINT64_MAX;
+        for (uint32_t lane = 0; lane < lanes; ++lane) {
+            if (active & 1u << lane && left[lane] < blocks) blocks = left[lane];
+        }
+        // Idle lanes read a busy one's blocks, and throw their result away
+        const unsigned char* busy_row = rows[__builtin_ctz(active)];
+        for (uint32_t lane = 0; lane < lanes; ++lane) {
+            if (!(active & 1u << lane)) rows[lane] = busy_row;
+        }
+        run(state, rows, blocks, active);
+
+        for (uint32_t lane = 0; lane < lanes; ++lane) {
+            if (!(active & 1u << lane)) continue;
+            rows[lane] += blocks * SHA1_BLOCK_SIZE;
+            left[lane] -= blocks;
+            if (left[lane] > 0) continue;
+            if (!(in_tail & 1u << lane)) {
+                left[lane] = pad_tail(data[buffer[lane]], lengths[buffer[lane]], tails[lane]);
+                rows[lane] = tails[lane];
+                in_tail |= 1u << lane;
+            } else {
+                write_hash(state + lane, lanes, hashes + (uint64_t) buffer[lane] * SHA1_HASH_SIZE);
+                active &= ~(1u << lane);
+            }
+        }
+    }
+}
+
+/**
+ * Reads the extended control register telling which register states the OS saves
+ */
+__attribute__((target("xsave")))
+static uint64_t saved_registers(void) {
+    return _xgetbv(0);
+}
+
+#endif
+
+/**
+ * Checks which engines the CPU supports, and whether the OS saves the vector registers they use
+ * @return Bitfield of the engines, by their value
+ */
+static uint32_t detect_engines(void) {
+    uint32_t engines = 1u << SHA1_ENGINE_AUTO | 1u << SHA1_ENGINE_OPENSSL;
+#ifdef SHA1_X86
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return engines;
+    const bool sse = ecx & bit_SSSE3 && ecx & bit_SSE4_1;
+    const uint64_t registers = ecx & bit_OSXSAVE ? saved_registers() : 0;
+    // SSE and AVX state for ymm registers, then opmask and both upper halves of zmm registers
+    const bool ymm = (registers & 0x06) == 0x06 && ecx & bit_AVX;
+    const bool zmm = ymm && (registers & 0xE0) == 0xE0;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return engines;
+    if (sse && ebx & bit_SHA) engines |= 1u << SHA1_ENGINE_SHA_NI;
+    if (ymm && ebx & bit_AVX2) engines |= 1u << SHA1_ENGINE_AVX2;
+    if (zmm && ebx & bit_AVX2 && ebx & bit_AVX512F) engines |= 1u << SHA1_ENGINE_AVX512;
+#endif
+    return engines;
+}
+
+bool sha1_engine_supported(const SHA1_ENGINE engine) {
+    if (engine >= SHA1_ENGINE_COUNT) return false;
+    uint32_t engines = __atomic_load_n(&supported_engines, __ATOMIC_RELAXED);
+    if (engines == 0) {
+        // Threads racing here detect the same thing
+        engines = detect_engines();
+        __atomic_store_n(&supported_engines, engines, __ATOMIC_RELAXED);
+    }
+    return (engines & 1u << engine) != 0;
+}
+
+bool sha1_set_engine(const SHA1_ENGINE engine) {
+    if (!sha1_engine_supported(engine)) return false;
+    __atomic_store_n(&forced_engine, engine, __ATOMIC_RELAXED);
+    return true;
+}
+
+const char *sha1_engine_name(const SHA1_ENGINE engine) {
+    return engine < SHA1_ENGINE_COUNT ? engine_names[engine] : "unknown";
+}
+
+/**
+ * Engine a single buffer goes through. SHA extensions hash as fast as OpenSSL, which uses them too, but skip the
+ * digest lookup OpenSSL 3 does on every call, taking a tenth of the time on short buffers like DHT tokens
+ */
+static SHA1_ENGINE single_engine(void) {
+    const SHA1_ENGINE forced = __atomic_load_n(&forced_engine, __ATOMIC_RELAXED);
+    if (forced != SHA1_ENGINE_AUTO) return forced;
+    return sha1_engine_supported(SHA1_ENGINE_SHA_NI) ? SHA1_ENGINE_SHA_NI : SHA1_ENGINE_OPENSSL;
+}
+
+SHA1_ENGINE sha1_batch_engine(const uint32_t amount) {
+    const SHA1_ENGINE forced = __atomic_load_n(&forced_engine, __ATOMIC_RELAXED);
+    if (forced != SHA1_ENGINE_AUTO) return forced;
+    // Full lanes outrun SHA extensions, about 1.2 times as fast with 8 of them and 2.4 with 16 in bench_micro
+    if (amount >= SHA1_MIN_LANE_FILL) {
+        if (sha1_engine_supported(SHA1_ENGINE_AVX512)) return SHA1_ENGINE_AVX512;
+        if (sha1_engine_supported(SHA1_ENGINE_AVX2)) return SHA1_ENGINE_AVX2;
+    }
+    return single_engine();
+}
+
+/**
+ * Hashes a buffer with an engine. Multi-buffer ones only do it when forced, with a single busy lane
+ */
+static void engine_hash(const SHA1_ENGINE engine, const unsigned char* data, const uint64_t length,
+                        unsigned char* hash) {
+#ifdef SHA1_X86
+    if (engine == SHA1_ENGINE_SHA_NI) {
+        sha_ni_hash(data, length, hash);
+        return;
+    }
+    if (engine == SHA1_ENGINE_AVX2 || engine == SHA1_ENGINE_AVX512) {
+        lanes_hash(engine == SHA1_ENGINE_AVX2 ? avx2_blocks : avx512_blocks, engine == SHA1_ENGINE_AVX2 ? 8 : 16,
+                   &data, &length, 1, hash);
+        return;
+    }
+#endif
+    // An empty buffer may not be there at all
+    static const unsigned char empty = 0;
+    SHA1(length > 0 ? data : &empty, length, hash);
+}
+
+void sha1_hash(const unsigned char* data, const uint64_t length, unsigned char* hash) {
+    if (!hash || (!data && length > 0)) return;
+    engine_hash(single_engine(), data, length, hash);
+}
+
+void sha1_hash_batch(const unsigned char* const* data, const uint64_t* lengths, const uint32_t amount,
+                     unsigned char* hashes) {
+    if (!data || !lengths || !hashes) return;
+    const SHA1_ENGINE engine = sha1_batch_engine(amount);
+#ifdef SHA1_X86
+    if (engine == SHA1_ENGINE_AVX2 || engine == SHA1_ENGINE_AVX512) {
+        lanes_hash(engine == SHA1_ENGINE_AVX2 ? avx2_blocks : avx512_blocks, engine == SHA1_ENGINE_AVX2 ? 8 : 16,
+                   data, lengths, amount, hashes);
+        return;
+    }
+#endif
+    for (uint32_t i = 0; i < amount; ++i) {
+        engine_hash(engine, data[i], lengths[i], hashes + (uint64_t) i * SHA1_HASH_SIZE);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef BITTORRENT_CLIENT_SHA1_H
+#define BITTORRENT_CLIENT_SHA1_H
+
+#include <stdint.h>
+
+/// @brief Bytes of a SHA1 hash
+#define SHA1_HASH_SIZE 20
+/// @brief Most buffers a multi-buffer engine hashes at once, one per lane
+#define SHA1_MAX_LANES 16
+
+/// @brief Implementations SHA1 hashes can be computed with
+typedef enum {
+    SHA1_ENGINE_AUTO, /**< The fastest engine the CPU supports, picked apart for single buffers and batches */
+    SHA1_ENGINE_OPENSSL, /**< OpenSSL's SHA1(), one buffer at a time. Always supported */
+    SHA1_ENGINE_SHA_NI, /**< x86 SHA extensions, one buffer at a time */
+    SHA1_ENGINE_AVX2, /**< AVX2, 8 buffers at a time in parallel lanes */
+    SHA1_ENGINE_AVX512, /**< AVX-512, 16 buffers at a time in parallel lanes */
+    SHA1_ENGINE_COUNT /**< Amount of engines, not an engine */
+} SHA1_ENGINE;
+
+/**
+ * Tells whether the CPU, and the OS for the registers it saves, can run an engine. Checked once, then cached.
+ *
+ * @param engine The engine.
+ * @return true if it can be used.
+ */
+bool sha1_engine_supported(SHA1_ENGINE engine);
+
+/**
+ * Makes every hash go through an engine, for tests and benchmarks. SHA1_ENGINE_AUTO goes back to picking them.
+ *
+ * @param engine The engine.
+ * @return false if the engine isn't supported, leaving the current one in place.
+ */
+bool sha1_set_engine(SHA1_ENGINE engine);
+
+/**
+ * Engine a batch of buffers would be hashed with right now.
+ *
+ * @param amount Buffers in the batch.
+ * @return The engine, never SHA1_ENGINE_AUTO.
+ */
+SHA1_ENGINE sha1_batch_engine(uint32_t amount);
+
+/**
+ * Name of an engine, for logs and benchmark output.
+ *
+ * @param engine The engine.
+ * @return A static string, "unknown" for values out of range.
+ */
+const char *sha1_engine_name(SHA1_ENGINE engine);
+
+/**
+ * Hashes a buffer.
+ *
+ * @param data The bytes, may be nullptr if length is 0.
+ * @param length Bytes in data.
+ * @param hash Where the SHA1_HASH_SIZE bytes of the hash are written.
+ */
+void sha1_hash(const unsigned char *data, uint64_t length, unsigned char *hash);
+
+/**
+ * Hashes several buffers at once. Multi-buffer engines hash one per lane, a lane taking the next buffer as soon as
+ * it's done with one, so buffers of the same length, like pieces, keep every lane busy.
+ *
+ * @param data The buffers, each may be nullptr if its length is 0.
+ * @param lengths Bytes in each buffer.
+ * @param amount Buffers in data.
+ * @param hashes Where the hashes are written, SHA1_HASH_SIZE bytes each, in the order of data.
+ */
+void sha1_hash_batch(const unsigned char *const *data, const uint64_t *lengths, uint32_t amount,
+                     unsigned char *hashes);
+
+#endif //BITTORRENT_CLIENT_SHA1_H
@@ -9,6 +9,7 @@ void *disk_runner(void *arg) {
 
 void *torrent_runner(void *arg) {
     const torrent_args_t* torrent_args = arg;
-    torrent(*torrent_args->metainfo, torrent_args->peer_id, torrent_args->log_code);
+    torrent(*torrent_args->metainfo, torrent_args->peer_id, torrent_args->listener, torrent_args->reactors,
+            torrent_args->log_code);
     return nullptr;
 }
\ No newline at end of file
@@ -1,10 +1,13 @@
 #ifndef BITTORRENT_CLIENT_THREAD_RUNNERS_H
 #define BITTORRENT_CLIENT_THREAD_RUNNERS_H
 #include "file.h"
+#include "listener.h"
 
 typedef struct {
     metainfo_t* metainfo;
     const unsigned char* peer_id;
+    listener_t* listener;
+    uint32_t reactors;
     LOG_CODE log_code;
 } torrent_args_t;
 
@@ -0,0 +1,168 @@
+#include "timer_wheel.h"
+
+#include <stdlib.h>
+
+/// @brief Words of the occupied bitmap
+#define TIMER_WORDS (TIMER_SLOTS / 64)
+
+timer_wheel_t* timer_wheel_create(const uint64_t now_ms) {
+    timer_wheel_t* wheel = calloc(1, sizeof(timer_wheel_t));
+    if (!wheel) return nullptr;
+    wheel->timers = malloc(sizeof(wheel_timer_t) * TIMER_INITIAL_CAPACITY);
+    if (!wheel->timers) {
+        free(wheel);
+        return nullptr;
+    }
+    wheel->capacity = TIMER_INITIAL_CAPACITY;
+    // Every timer starts deleted, in the free list
+    for (uint32_t i = 0; i < wheel->capacity; ++i) {
+        wheel->timers[i].callback = nullptr;
+        wheel->timers[i].armed = false;
+        wheel->timers[i].next = i + 1 < wheel->capacity ? i + 1 : TIMER_NONE;
+    }
+    wheel->free_list = 0;
+    for (uint32_t i = 0; i < TIMER_SLOTS; ++i) wheel->slots[i] = TIMER_NONE;
+    wheel->now_ms = now_ms;
+    wheel->tick = now_ms / TIMER_TICK_MS;
+    wheel->cursor = TIMER_NONE;
+    return wheel;
+}
+
+void timer_wheel_free(timer_wheel_t* wheel) {
+    if (wheel == nullptr) return;
+    free(wheel->timers);
+    free(wheel);
+}
+
+uint32_t wheel_timer_new(timer_wheel_t* wheel, const timer_callback_t callback, void* ctx, const uint32_t data) {
+    if (!wheel || !callback) return TIMER_NONE;
+    if (wheel->free_list == TIMER_NONE) {
+        // Ids stay valid, only the storage moves
+        const uint32_t capacity = wheel->capacity * 2;
+        wheel_timer_t* timers = realloc(wheel->timers, sizeof(wheel_timer_t) * capacity);
+        if (!timers) return TIMER_NONE;
+        wheel->timers = timers;
+        for (uint32_t i = wheel->capacity; i < capacity; ++i) {
+            wheel->timers[i].callback = nullptr;
+            wheel->timers[i].armed = false;
+            wheel->timers[i].next = i + 1 < capacity ? i + 1 : TIMER_NONE;
+        }
+        wheel->free_list = wheel->capacity;
+        wheel->capacity = capacity;
+    }
+
+    const uint32_t id = wheel->free_list;
+    wheel_timer_t* timer = &wheel->timers[id];
+    wheel->free_list = timer->next;
+    timer->callback = callback;
+    timer->ctx = ctx;
+    timer->data = data;
+    timer->armed = false;
+    timer->next = TIMER_NONE;
+    timer->prev = TIMER_NONE;
+    return id;
+}
+
+/**
+ * Takes an armed timer out of its slot
+ */
+static void unlink_timer(timer_wheel_t* wheel, const uint32_t id) {
+    wheel_timer_t* timer = &wheel->timers[id];
+    const uint32_t slot = timer->expires & (TIMER_SLOTS - 1);
+    // Advancing goes on with whatever followed it
+    if (wheel->cursor == id) wheel->cursor = timer->next;
+    if (timer->prev != TIMER_NONE) wheel->timers[timer->prev].next = timer->next;
+    else wheel->slots[slot] = timer->next;
+    if (timer->next != TIMER_NONE) wheel->timers[timer->next].prev = timer->prev;
+    if (wheel->slots[slot] == TIMER_NONE) wheel->occupied[slot / 64] &= ~(1ull << (slot % 64));
+    timer->armed = false;
+    wheel->armed--;
+}
+
+void wheel_timer_delete(timer_wheel_t* wheel, const uint32_t id) {
+    if (!wheel || id >= wheel->capacity || !wheel->timers[id].callback) return;
+    if (wheel->timers[id].armed) unlink_timer(wheel, id);
+    wheel->timers[id].callback = nullptr;
+    wheel->timers[id].next = wheel->free_list;
+    wheel->free_list = id;
+}
+
+bool wheel_timer_arm(timer_wheel_t* wheel, const uint32_t id, const uint64_t delay_ms) {
+    if (!wheel || id >= wheel->capacity || !wheel->timers[id].callback) return false;
+    wheel_timer_t* timer = &wheel->timers[id];
+    if (timer->armed) unlink_timer(wheel, id);
+
+    // Rounded up, so timers never expire early
+    uint64_t expires = (wheel->now_ms + delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (expires <= wheel->tick) expires = wheel->tick + 1;
+    const uint32_t slot = expires & (TIMER_SLOTS - 1);
+    timer->expires = expires;
+    // At the front, so a timer armed by a callback isn't visited again in the same advance
+    timer->prev = TIMER_NONE;
+    timer->next = wheel->slots[slot];
+    if (timer->next != TIMER_NONE) wheel->timers[timer->next].prev = id;
+    wheel->slots[slot] = id;
+    wheel->occupied[slot / 64] |= 1ull << (slot % 64);
+    timer->armed = true;
+    wheel->armed++;
+    return true;
+}
+
+void wheel_timer_disarm(timer_wheel_t* wheel, const uint32_t id) {
+    if (!wheel || id >= wheel->capacity || !wheel->timers[id].armed) return;
+    unlink_timer(wheel, id);
+}
+
+bool wheel_timer_armed(const timer_wheel_t* wheel, const uint32_t id) {
+    return wheel && id < wheel->capacity && wheel->timers[id].armed;
+}
+
+uint32_t timer_wheel_advance(timer_wheel_t* wheel, const uint64_t now_ms) {
+    if (!wheel) return 0;
+    if (now_ms > wheel->now_ms) wheel->now_ms = now_ms;
+    const uint64_t target = wheel->now_ms / TIMER_TICK_MS;
+    if (target <= wheel->tick) return 0;
+
+    // After a long pause every slot is due, visiting each once is enough
+    uint64_t first = wheel->tick + 1;
+    if (target - wheel->tick > TIMER_SLOTS) first = target - TIMER_SLOTS + 1;
+    uint32_t fired = 0;
+    for (uint64_t tick = first; tick <= target; ++tick) {
+        wheel->tick = tick;
+        uint32_t id = wheel->slots[tick & (TIMER_SLOTS - 1)];
+        while (id != TIMER_NONE) {
+            wheel->cursor = wheel->timers[id].next;
+            // Timers of later turns share the slot
+            if (wheel->timers[id].expires <= target) {
+                const timer_callback_t callback = wheel->timers[id].callback;
+                void* ctx = wheel->timers[id].ctx;
+                const uint32_t data = wheel->timers[id].data;
+                unlink_timer(wheel, id);
+                fired++;
+                callback(ctx, data);
+            }
+            id = wheel->cursor;
+        }
+    }
+    wheel->cursor = TIMER_NONE;
+    return fired;
+}
+
+int32_t timer_wheel_timeout(const timer_wheel_t* wheel, const int32_t max_ms) {
+    if (!wheel || wheel->armed == 0) return max_ms;
+    const uint32_t from = (wheel->tick + 1) & (TIMER_SLOTS - 1);
+    // The first word is looked at twice: from the starting slot on, and at last for the slots before it
+    for (uint32_t i = 0; i <= TIMER_WORDS; ++i) {
+        const uint32_t word = (from / 64 + i) % TIMER_WORDS;
+        uint64_t bits = wheel->occupied[word];
+        if (i == 0) bits &= ~0ull << (from % 64);
+        else if (i == TIMER_WORDS) bits &= (1ull << (from % 64)) - 1;
+        if (bits == 0) continue;
+
+        const uint32_t slot = word * 64 + __builtin_ctzll(bits);
+        const uint64_t due_ms = (wheel->tick + 1 + ((slot - from) & (TIMER_SLOTS - 1))) * TIMER_TICK_MS;
+        if (due_ms <= wheel->now_ms) return 0;
+        return due_ms - wheel->now_ms < (uint64_t) max_ms ? (int32_t) (due_ms - wheel->now_ms) : max_ms;
+    }
+    return max_ms;
+}
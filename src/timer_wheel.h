@@ -0,0 +1,133 @@
+#ifndef BITTORRENT_CLIENT_TIMER_WHEEL_H
+#define BITTORRENT_CLIENT_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/// @brief Milliseconds each slot of the wheel covers, the resolution of every timer
+#define TIMER_TICK_MS 100
+/// @brief Slots of the wheel, a full turn is TIMER_SLOTS * TIMER_TICK_MS. Must be a power of two and a multiple of 64
+#define TIMER_SLOTS 512
+/// @brief Id of no timer, also ends the lists of each slot
+#define TIMER_NONE UINT32_MAX
+/// @brief Timers allocated when the wheel is created. They double whenever they run out
+#define TIMER_INITIAL_CAPACITY 64
+
+/**
+ * Function called when a timer expires. It may arm, disarm or delete any timer, itself included.
+ *
+ * @param ctx The context pointer given when the timer was created.
+ * @param data The value given when the timer was created, such as the index of a peer.
+ */
+typedef void (*timer_callback_t)(void *ctx, uint32_t data);
+
+/// @brief A timer of the wheel. Timers are referred to by id, so their storage can grow
+typedef struct {
+    uint64_t expires; /**< Tick the timer expires at */
+    uint32_t next; /**< Next timer in the same slot, or TIMER_NONE */
+    uint32_t prev; /**< Previous timer in the same slot, or TIMER_NONE if it's the first one */
+    timer_callback_t callback; /**< Function called on expiry, nullptr for deleted timers */
+    void *ctx; /**< Passed as is to callback */
+    uint32_t data; /**< Passed as is to callback */
+    bool armed; /**< Whether the timer is in a slot */
+} wheel_timer_t;
+
+/**
+ * Hashed timer wheel: each armed timer sits in the slot of the tick it expires at, modulo TIMER_SLOTS,
+ * so arming and disarming are O(1) and advancing only looks at the slots of elapsed ticks.
+ * Timers further than a full turn away stay in their slot until their own turn comes.
+ */
+typedef struct {
+    wheel_timer_t *timers; /**< Every timer, indexed by id */
+    uint32_t capacity; /**< Amount of allocated timers */
+    uint32_t free_list; /**< First deleted timer, linked through next, or TIMER_NONE */
+    uint32_t slots[TIMER_SLOTS]; /**< First timer of each slot, or TIMER_NONE */
+    uint64_t occupied[TIMER_SLOTS / 64]; /**< Bit set for each slot with timers */
+    uint64_t tick; /**< Last tick processed */
+    uint64_t now_ms; /**< Clock given to the last timer_wheel_advance(), cached for everything in the same iteration */
+    uint32_t armed; /**< Amount of armed timers */
+    uint32_t cursor; /**< Next timer to visit while advancing, kept valid when timers are disarmed */
+} timer_wheel_t;
+
+/**
+ * Creates an empty timer wheel.
+ *
+ * @param now_ms Current time, from monotonic_coarse_ms().
+ * @return A pointer to the new wheel, or nullptr if it couldn't be allocated.
+ */
+timer_wheel_t *timer_wheel_create(uint64_t now_ms);
+
+/**
+ * Frees the wheel and all of its timers. Callbacks aren't called.
+ *
+ * @param wheel The wheel to free. If nullptr, nothing is done.
+ */
+void timer_wheel_free(timer_wheel_t *wheel);
+
+/**
+ * Creates a disarmed timer.
+ *
+ * @param wheel The wheel.
+ * @param callback Function called when the timer expires.
+ * @param ctx Passed to callback.
+ * @param data Passed to callback.
+ * @return The id of the timer, or TIMER_NONE if it couldn't be allocated.
+ */
+uint32_t wheel_timer_new(timer_wheel_t *wheel, timer_callback_t callback, void *ctx, uint32_t data);
+
+/**
+ * Disarms and deletes a timer. Its id may be given to the next timer created.
+ *
+ * @param wheel The wheel.
+ * @param id The timer. TIMER_NONE is ignored.
+ */
+void wheel_timer_delete(timer_wheel_t *wheel, uint32_t id);
+
+/**
+ * Arms a timer to expire after delay_ms, counted from the wheel's cached clock.
+ * Arming an armed timer moves it.
+ *
+ * @param wheel The wheel.
+ * @param id The timer.
+ * @param delay_ms Milliseconds until it expires, rounded up to whole ticks.
+ * @return true on success, false if id isn't a timer.
+ */
+bool wheel_timer_arm(timer_wheel_t *wheel, uint32_t id, uint64_t delay_ms);
+
+/**
+ * Disarms a timer, so it doesn't expire. Disarmed timers are ignored.
+ *
+ * @param wheel The wheel.
+ * @param id The timer. TIMER_NONE is ignored.
+ */
+void wheel_timer_disarm(timer_wheel_t *wheel, uint32_t id);
+
+/**
+ * Whether a timer is armed.
+ *
+ * @param wheel The wheel.
+ * @param id The timer.
+ * @return true if it's armed, false otherwise.
+ */
+bool wheel_timer_armed(const timer_wheel_t *wheel, uint32_t id);
+
+/**
+ * Moves the wheel to now_ms, calling the callback of every timer expired by then. Each expired timer is disarmed
+ * before its callback runs. Should be called once per loop iteration, right after epoll_wait().
+ *
+ * @param wheel The wheel.
+ * @param now_ms Current time, from monotonic_coarse_ms(). Times before the last one given are ignored.
+ * @return The amount of timers that expired.
+ */
+uint32_t timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms);
+
+/**
+ * Milliseconds until the next slot with armed timers is due, to be used as the epoll_wait() timeout.
+ * Found through the occupied bitmap, so it doesn't depend on the amount of timers.
+ *
+ * @param wheel The wheel.
+ * @param max_ms Value returned if no timer is due sooner.
+ * @return Milliseconds to wait, at most max_ms.
+ */
+int32_t timer_wheel_timeout(const timer_wheel_t *wheel, int32_t max_ms);
+
+#endif //BITTORRENT_CLIENT_TIMER_WHEEL_H
@@ -0,0 +1,227 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+bool trace_enabled = false;
+
+/// @brief Every registered buffer
+static trace_buffer_t* buffers = nullptr;
+/// @brief Protects buffers and next_thread
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t next_thread = 1;
+/// @brief Bumped by trace_start(), so threads notice their buffer was freed
+static uint32_t generation = 0;
+/// @brief Monotonic time trace_start() was called at, exported timestamps are relative to it
+static uint64_t trace_origin_us = 0;
+static _Thread_local trace_buffer_t* local_buffer = nullptr;
+static _Thread_local uint32_t local_generation = 0;
+
+static const char* event_names[TRACE_EVENT_TYPES] = {
+    [TRACE_LOOP_ITERATION] = "handle events",
+    [TRACE_BLOCK_REQUESTED] = "block requested",
+    [TRACE_BLOCK_RECEIVED] = "block received",
+    [TRACE_PIECE_COMPLETE] = "complete",
+    [TRACE_PIECE_HASHED] = "hash check",
+    [TRACE_PIECE_FLUSHED] = "flush",
+};
+
+/**
+ * Returns the calling thread's buffer, registering a new one if there's none since the last trace_start()
+ */
+static trace_buffer_t* get_buffer(void) {
+    pthread_mutex_lock(&buffers_mutex);
+    if (local_buffer == nullptr || local_generation != generation) {
+        local_buffer = calloc(1, sizeof(trace_buffer_t));
+        if (local_buffer) {
+            local_buffer->thread = next_thread++;
+            local_buffer->next = buffers;
+            buffers = local_buffer;
+        }
+        local_generation = generation;
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+    return local_buffer;
+}
+
+void trace_record(const TRACE_EVENT type, const uint32_t piece, const uint32_t block, const int32_t peer,
+                  const uint64_t start_us) {
+    // The lock is only taken the first time, generation can't change while threads are traced
+    trace_buffer_t* buffer = local_buffer && local_generation == generation ? local_buffer : get_buffer();
+    if (!buffer) return;
+    if (buffer->amount == buffer->capacity) {
+        if (buffer->capacity >= TRACE_MAX_EVENTS) {
+            buffer->dropped++;
+            return;
+        }
+        const uint32_t capacity = buffer->capacity ? buffer->capacity * 2 : TRACE_INITIAL_EVENTS;
+        trace_event_t* events = realloc(buffer->events, capacity * sizeof(trace_event_t));
+        if (!events) {
+            buffer->dropped++;
+            return;
+        }
+        buffer->events = events;
+        buffer->capacity = capacity;
+    }
+
+    const uint64_t now = monotonic_us();
+    trace_event_t* event = &buffer->events[buffer->amount++];
+    event->ts_us = start_us ? start_us : now;
+    event->dur_us = start_us ? (uint32_t) (now - start_us) : 0;
+    event->piece = piece;
+    event->block = block;
+    event->peer = peer;
+    event->type = type;
+}
+
+void trace_start(void) {
+    pthread_mutex_lock(&buffers_mutex);
+    while (buffers) {
+        trace_buffer_t* buffer = buffers;
+        buffers = buffer->next;
+        free(buffer->events);
+        free(buffer);
+    }
+    next_thread = 1;
+    generation++;
+    trace_origin_us = monotonic_us();
+    pthread_mutex_unlock(&buffers_mutex);
+    trace_enabled = true;
+}
+
+void trace_stop(void) {
+    trace_enabled = false;
+}
+
+uint64_t trace_event_count(void) {
+    uint64_t total = 0;
+    pthread_mutex_lock(&buffers_mutex);
+    for (const trace_buffer_t* buffer = buffers; buffer; buffer = buffer->next) total += buffer->amount;
+    pthread_mutex_unlock(&buffers_mutex);
+    return total;
+}
+
+/**
+ * Microseconds since trace_start(), as Chrome trace timestamps
+ */
+static uint64_t relative_ts(const uint64_t ts_us) {
+    return ts_us > trace_origin_us ? ts_us - trace_origin_us : 0;
+}
+
+/**
+ * Writes a single event, after the comma separating it from the previous one
+ */
+static void write_event(FILE* file, const trace_event_t* event, const uint32_t thread) {
+    const char* name = event_names[event->type];
+    const uint64_t ts = relative_ts(event->ts_us);
+    switch (event->type) {
+        case TRACE_LOOP_ITERATION: {
+            // Recorded as one event to save clock reads, split back into the wait and the work after it
+            const uint32_t wait = event->block < event->dur_us ? event->block : event->dur_us;
+            fprintf(file, ",\n{\"name\":\"epoll_wait\",\"cat\":\"loop\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%u,\"pid\":1,"
+                          "\"tid\":%u,\"args\":{\"ready\":%u}}", (unsigned long) ts, wait, thread, event->piece);
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"loop\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%u,\"pid\":1,\"tid\":%u}",
+                    name, (unsigned long) (ts + wait), event->dur_us - wait, thread);
+            break;
+        }
+        case TRACE_BLOCK_REQUESTED:
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"block\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%lu,\"pid\":1,"
+                          "\"tid\":%u,\"args\":{\"piece\":%u,\"block\":%u,\"peer\":%d}}", name, (unsigned long) ts,
+                    thread, event->piece, event->block, event->peer);
+            break;
+        case TRACE_BLOCK_RECEIVED:
+            // Shown both on the thread, as the write it took, and on the piece
+            fprintf(file, ",\n{\"name\":\"write block\",\"cat\":\"disk\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%u,\"pid\":1,"
+                          "\"tid\":%u,\"args\":{\"piece\":%u,\"block\":%u,\"peer\":%d}}", (unsigned long) ts,
+                    event->dur_us, thread, event->piece, event->block, event->peer);
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"piece\",\"ph\":\"n\",\"id\":%u,\"ts\":%lu,\"pid\":1,"
+                          "\"tid\":%u,\"args\":{\"block\":%u,\"peer\":%d}}", name, event->piece, (unsigned long) ts,
+                    thread, event->block, event->peer);
+            break;
+        case TRACE_PIECE_COMPLETE:
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"piece\",\"ph\":\"n\",\"id\":%u,\"ts\":%lu,\"pid\":1,"
+                          "\"tid\":%u}", name, event->piece, (unsigned long) ts, thread);
+            break;
+        case TRACE_PIECE_HASHED:
+        case TRACE_PIECE_FLUSHED:
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%u,\"pid\":1,\"tid\":%u,"
+                          "\"args\":{\"piece\":%u", name, event->type == TRACE_PIECE_HASHED ? "hash" : "disk",
+                    (unsigned long) ts, event->dur_us, thread, event->piece);
+            if (event->type == TRACE_PIECE_HASHED) fprintf(file, ",\"matched\":%s", event->block ? "true" : "false");
+            fprintf(file, "}}");
+            break;
+        default: ;
+    }
+}
+
+bool trace_export(const char* path, const LOG_CODE log_code) {
+    if (!path) return false;
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        log_printf(log_code, LOG_ERR, "Couldn't open trace file %s\n", path);
+        return false;
+    }
+
+    pthread_mutex_lock(&buffers_mutex);
+    // Each piece spans from its first request to its last flush, since failed pieces are downloaded again
+    uint32_t piece_amount = 0;
+    for (const trace_buffer_t* buffer = buffers; buffer; buffer = buffer->next) {
+        for (uint32_t i = 0; i < buffer->amount; ++i) {
+            const trace_event_t* event = &buffer->events[i];
+            if (event->type >= TRACE_BLOCK_REQUESTED && event->piece >= piece_amount) piece_amount = event->piece + 1;
+        }
+    }
+    uint64_t* first_request = calloc(piece_amount ? piece_amount : 1, sizeof(uint64_t));
+    uint64_t* last_flush = calloc(piece_amount ? piece_amount : 1, sizeof(uint64_t));
+    if (!first_request || !last_flush) {
+        pthread_mutex_unlock(&buffers_mutex);
+        free(first_request);
+        free(last_flush);
+        fclose(file);
+        return false;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"bittorrent\"}}");
+    uint64_t dropped = 0;
+    for (const trace_buffer_t* buffer = buffers; buffer; buffer = buffer->next) {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                buffer->thread, buffer->thread);
+        for (uint32_t i = 0; i < buffer->amount; ++i) {
+            const trace_event_t* event = &buffer->events[i];
+            write_event(file, event, buffer->thread);
+            if (event->type == TRACE_BLOCK_REQUESTED && (first_request[event->piece] == 0 ||
+                                                         event->ts_us < first_request[event->piece])) {
+                first_request[event->piece] = event->ts_us;
+            }
+            if (event->type == TRACE_PIECE_FLUSHED && event->ts_us + event->dur_us > last_flush[event->piece]) {
+                last_flush[event->piece] = event->ts_us + event->dur_us;
+            }
+        }
+        dropped += buffer->dropped;
+    }
+    pthread_mutex_unlock(&buffers_mutex);
+
+    for (uint32_t i = 0; i < piece_amount; ++i) {
+        if (first_request[i] == 0 || last_flush[i] == 0) continue;
+        fprintf(file, ",\n{\"name\":\"piece %u\",\"cat\":\"piece\",\"ph\":\"b\",\"id\":%u,\"ts\":%lu,\"pid\":1,\"tid\":0}"
+                      ",\n{\"name\":\"piece %u\",\"cat\":\"piece\",\"ph\":\"e\",\"id\":%u,\"ts\":%lu,\"pid\":1,\"tid\":0}",
+                i, i, (unsigned long) relative_ts(first_request[i]), i, i, (unsigned long) relative_ts(last_flush[i]));
+    }
+    fprintf(file, "\n]}\n");
+    free(first_request);
+    free(last_flush);
+
+    const bool written = ferror(file) == 0;
+    if (fclose(file) != 0 || !written) {
+        log_printf(log_code, LOG_ERR, "Couldn't write trace file %s\n", path);
+        return false;
+    }
+    if (dropped > 0) log_printf(log_code, LOG_ERR, "Trace buffers were full, %lu events dropped\n", (unsigned long) dropped);
+    log_printf(log_code, LOG_SUMM, "Trace written to %s\n", path);
+    return true;
+}
@@ -0,0 +1,117 @@
+#ifndef BITTORRENT_CLIENT_TRACE_H
+#define BITTORRENT_CLIENT_TRACE_H
+
+#include <stdint.h>
+
+#include "util.h"
+
+/// @brief Events kept per thread before new ones are dropped, 32 bytes each
+#define TRACE_MAX_EVENTS (1u << 20)
+/// @brief Events the first buffer of a thread holds. It doubles whenever it's full
+#define TRACE_INITIAL_EVENTS 4096
+
+/// @brief What a trace event records
+typedef enum {
+    TRACE_LOOP_ITERATION, /**< An iteration of the peer loop. block holds the microseconds blocked in epoll_wait(),
+                           * the rest went to handling the piece amount of ready events */
+    TRACE_BLOCK_REQUESTED, /**< A block was requested from peer. The piece starts with its first request */
+    TRACE_BLOCK_RECEIVED, /**< A block from peer was written to its files, lasting as long as the write */
+    TRACE_PIECE_COMPLETE, /**< Every block of the piece is there */
+    TRACE_PIECE_HASHED, /**< Hash check of the piece. block is 1 if it matched, 0 if it didn't */
+    TRACE_PIECE_FLUSHED, /**< Files the piece touched were flushed and closed. The piece ends here */
+    TRACE_EVENT_TYPES
+} TRACE_EVENT;
+
+/// @brief A recorded event. Durations are 0 for instant ones
+typedef struct {
+    uint64_t ts_us; /**< When the event started, from monotonic_us() */
+    uint32_t dur_us; /**< How long it lasted */
+    uint32_t piece; /**< Piece index, if it applies */
+    uint32_t block; /**< Block index inside the piece, or an event specific value */
+    int32_t peer; /**< Socket of the peer involved, or -1 */
+    uint8_t type; /**< TRACE_EVENT */
+} trace_event_t;
+
+/// @brief Events recorded by a single thread, only written by that thread
+typedef struct trace_buffer_t {
+    trace_event_t *events; /**< Recorded events, oldest first */
+    uint32_t amount; /**< Events in use */
+    uint32_t capacity; /**< Events allocated */
+    uint64_t dropped; /**< Events not recorded because the buffer reached TRACE_MAX_EVENTS */
+    uint32_t thread; /**< Small number identifying the thread in the exported trace */
+    struct trace_buffer_t *next; /**< Next registered buffer */
+} trace_buffer_t;
+
+/**
+ * Whether events are being recorded. Only changed by trace_start() and trace_stop(),
+ * before traced threads start and after they finish.
+ */
+extern bool trace_enabled;
+
+/**
+ * Reads the clock for the start of a span, only if tracing is enabled.
+ *
+ * @return monotonic_us(), or 0 if tracing is disabled.
+ */
+static inline uint64_t trace_now(void) {
+    return trace_enabled ? monotonic_us() : 0;
+}
+
+/**
+ * Records an event lasting from start_us until now, if tracing is enabled.
+ *
+ * @param type TRACE_EVENT.
+ * @param piece Piece index.
+ * @param block Block index inside the piece, or an event specific value.
+ * @param peer Socket of the peer involved, or -1.
+ * @param start_us When the event started, from trace_now(). 0 makes it an instant event.
+ */
+#define trace_event(type, piece, block, peer, start_us) do { \
+        if (trace_enabled) trace_record(type, piece, block, peer, start_us); \
+    } while (0)
+
+/**
+ * Records an event in the calling thread's buffer. Use trace_event() instead, so nothing is done while
+ * tracing is disabled.
+ *
+ * @param type TRACE_EVENT.
+ * @param piece Piece index.
+ * @param block Block index inside the piece, or an event specific value.
+ * @param peer Socket of the peer involved, or -1.
+ * @param start_us When the event started. 0 makes it an instant event.
+ */
+void trace_record(TRACE_EVENT type, uint32_t piece, uint32_t block, int32_t peer, uint64_t start_us);
+
+/**
+ * Starts recording, discarding whatever was recorded before.
+ * Must be called before the traced threads start.
+ */
+void trace_start(void);
+
+/**
+ * Stops recording. Recorded events are kept until exported or the next trace_start().
+ */
+void trace_stop(void);
+
+/**
+ * Amount of events recorded across every thread.
+ * Must be called once the traced threads stopped recording.
+ *
+ * @return The amount of events.
+ */
+uint64_t trace_event_count(void);
+
+/**
+ * Writes recorded events in the Chrome trace event format, which Perfetto and chrome://tracing open.
+ * Each piece becomes an async span from its first request until it's flushed, with its blocks,
+ * completion and hash check inside. Must be called once the traced threads stopped recording.
+ *
+ * @param path Where to write the JSON file.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return true on success, false if the file couldn't be written.
+ */
+bool trace_export(const char *path, LOG_CODE log_code);
+
+#endif //BITTORRENT_CLIENT_TRACE_H
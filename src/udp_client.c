@@ -0,0 +1,376 @@
+#include "udp_client.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "logger.h"
+
+/**
+ * Index of an address family in udp_client_t's socket arrays
+ */
+static int32_t family_index(const sa_family_t family) {
+    return family == AF_INET6 ? 1 : 0;
+}
+
+/**
+ * Compares family, address and port of two tracker addresses
+ */
+static bool same_address(const struct sockaddr* a, const struct sockaddr* b) {
+    if (a->sa_family != b->sa_family) return false;
+    if (a->sa_family == AF_INET6) {
+        const struct sockaddr_in6* a6 = (const struct sockaddr_in6*) a;
+        const struct sockaddr_in6* b6 = (const struct sockaddr_in6*) b;
+        return a6->sin6_port == b6->sin6_port && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0;
+    }
+    const struct sockaddr_in* a4 = (const struct sockaddr_in*) a;
+    const struct sockaddr_in* b4 = (const struct sockaddr_in*) b;
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+static uint32_t transaction_slot(const udp_client_t* client, const uint32_t transaction_id) {
+    // Fibonacci hashing. Transaction ids are random already, this just spreads sequential ones
+    return (transaction_id * 2654435761u) & (client->transaction_capacity - 1);
+}
+
+static udp_transaction_t* find_transaction(const udp_client_t* client, const uint32_t transaction_id) {
+    uint32_t slot = transaction_slot(client, transaction_id);
+    while (client->transactions[slot].transaction_id != 0) {
+        if (client->transactions[slot].transaction_id == transaction_id) return &client->transactions[slot];
+        slot = (slot + 1) & (client->transaction_capacity - 1);
+    }
+    return nullptr;
+}
+
+static void insert_transaction(udp_client_t* client, const udp_transaction_t* transaction) {
+    uint32_t slot = transaction_slot(client, transaction->transaction_id);
+    while (client->transactions[slot].transaction_id != 0) {
+        slot = (slot + 1) & (client->transaction_capacity - 1);
+    }
+    client->transactions[slot] = *transaction;
+    client->transaction_amount++;
+}
+
+/**
+ * Doubles the transaction table, keeping the load factor under 1/2
+ */
+static bool grow_transactions(udp_client_t* client) {
+    udp_transaction_t* old = client->transactions;
+    const uint32_t old_capacity = client->transaction_capacity;
+    udp_transaction_t* transactions = calloc(old_capacity * 2, sizeof(udp_transaction_t));
+    if (!transactions) return false;
+    client->transactions = transactions;
+    client->transaction_capacity = old_capacity * 2;
+    client->transaction_amount = 0;
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (old[i].transaction_id != 0) insert_transaction(client, &old[i]);
+    }
+    free(old);
+    return true;
+}
+
+/**
+ * Removes a transaction by shifting back the entries after it, so lookups never need tombstones
+ */
+static void remove_transaction(udp_client_t* client, udp_transaction_t* transaction) {
+    const uint32_t mask = client->transaction_capacity - 1;
+    uint32_t hole = transaction - client->transactions;
+    uint32_t next = hole;
+    while (true) {
+        next = (next + 1) & mask;
+        if (client->transactions[next].transaction_id == 0) break;
+        const uint32_t home = transaction_slot(client, client->transactions[next].transaction_id);
+        // Entries whose home slot is cyclically in (hole, next] are already as close to it as they can be
+        const bool stays = hole <= next ? home > hole && home <= next : home > hole || home <= next;
+        if (!stays) {
+            client->transactions[hole] = client->transactions[next];
+            hole = next;
+        }
+    }
+    client->transactions[hole].transaction_id = 0;
+    client->transaction_amount--;
+}
+
+/**
+ * Reads every datagram waiting in a socket, in batches, and hands each one to the callback of its transaction
+ */
+static void receive_responses(udp_client_t* client, const int32_t sockfd) {
+    unsigned char buffers[UDP_BATCH_SIZE][MAX_RESPONSE_SIZE];
+    struct sockaddr_storage sources[UDP_BATCH_SIZE];
+    struct iovec iovecs[UDP_BATCH_SIZE];
+    struct mmsghdr messages[UDP_BATCH_SIZE];
+
+    int32_t received;
+    do {
+        memset(messages, 0, sizeof(messages));
+        for (int32_t i = 0; i < UDP_BATCH_SIZE; ++i) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = MAX_RESPONSE_SIZE;
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &sources[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        }
+        received = recvmmsg(sockfd, messages, UDP_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && LOG_ENABLED(client->log_code, LOG_ERR)) {
+                log_write(LOG_ERR, "Error while receiving tracker responses: %s (errno: %d)\n", strerror(errno), errno);
+            }
+            break;
+        }
+        client->stats.receive_calls++;
+        client->stats.datagrams_received += received;
+
+        for (int32_t i = 0; i < received; ++i) {
+            const uint32_t length = messages[i].msg_len;
+            if (length < 8) continue;
+            uint32_t transaction_id;
+            memcpy(&transaction_id, buffers[i] + RESPONSE_TRANSACTION_OFFSET, 4);
+            udp_transaction_t* transaction = find_transaction(client, transaction_id);
+            // Late answer to a cancelled request, or from someone who isn't the tracker
+            if (transaction == nullptr ||
+                !same_address((struct sockaddr*) &sources[i], (struct sockaddr*) &transaction->server_addr)) {
+                log_printf(client->log_code, LOG_FULL, "Dropped UDP datagram with unknown transaction id\n");
+                continue;
+            }
+            // The callback may send new requests, which can move entries around
+            const udp_response_callback_t callback = transaction->callback;
+            void* ctx = transaction->ctx;
+            remove_transaction(client, transaction);
+            callback(ctx, buffers[i], length);
+        }
+    } while (received == UDP_BATCH_SIZE);
+
+    // Sending whatever the callbacks queued in a single go
+    udp_client_flush(client);
+}
+
+static void udp_client_readable_v4(void* ctx, const uint32_t events) {
+    (void) events;
+    udp_client_t* client = ctx;
+    receive_responses(client, client->sockfd[0]);
+}
+
+static void udp_client_readable_v6(void* ctx, const uint32_t events) {
+    (void) events;
+    udp_client_t* client = ctx;
+    receive_responses(client, client->sockfd[1]);
+}
+
+/**
+ * Creates the socket for an address family, if it doesn't exist yet
+ */
+static int32_t get_socket(udp_client_t* client, const sa_family_t family) {
+    const int32_t index = family_index(family);
+    if (client->sockfd[index] >= 0) return client->sockfd[index];
+
+    const int32_t sockfd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (sockfd < 0) {
+        log_printf(client->log_code, LOG_ERR, "Couldn't create UDP socket: %s (errno: %d)\n", strerror(errno), errno);
+        return -1;
+    }
+    client->loop_slot[index] = loop_add_source(client->loop, sockfd, EPOLLIN,
+                                               index == 0 ? udp_client_readable_v4 : udp_client_readable_v6, client);
+    client->sockfd[index] = sockfd;
+    return sockfd;
+}
+
+udp_client_t* udp_client_create(event_loop_t* loop, const LOG_CODE log_code) {
+    if (!loop) return nullptr;
+    udp_client_t* client = calloc(1, sizeof(udp_client_t));
+    if (!client) return nullptr;
+    client->loop = loop;
+    client->log_code = log_code;
+    client->sockfd[0] = client->sockfd[1] = -1;
+    client->loop_slot[0] = client->loop_slot[1] = -1;
+    client->transaction_capacity = UDP_INITIAL_TRANSACTIONS;
+    client->transactions = calloc(client->transaction_capacity, sizeof(udp_transaction_t));
+    if (!client->transactions) {
+        free(client);
+        return nullptr;
+    }
+    return client;
+}
+
+void udp_client_free(udp_client_t* client) {
+    if (client == nullptr) return;
+    for (int32_t i = 0; i < 2; ++i) {
+        if (client->sockfd[i] >= 0) {
+            loop_remove_source(client->loop, client->loop_slot[i]);
+            close(client->sockfd[i]);
+        }
+    }
+    free(client->transactions);
+    free(client->connections);
+    free(client->queue);
+    free(client);
+}
+
+uint32_t udp_client_send(udp_client_t* client, const struct sockaddr* server_addr, const socklen_t server_addr_len,
+                         const unsigned char* request, const uint32_t length, const udp_response_callback_t callback,
+                         void* ctx) {
+    if (!client || !server_addr || !request || length < REQUEST_TRANSACTION_OFFSET + 4 || length > MAX_REQUEST_SIZE ||
+        server_addr_len > sizeof(struct sockaddr_storage)) return 0;
+    if (get_socket(client, server_addr->sa_family) < 0) return 0;
+
+    if (client->queue_amount == client->queue_capacity) {
+        const uint32_t new_capacity = client->queue_capacity > 0 ? client->queue_capacity * 2 : UDP_BATCH_SIZE;
+        udp_datagram_t* queue = realloc(client->queue, sizeof(udp_datagram_t) * new_capacity);
+        if (!queue) return 0;
+        client->queue = queue;
+        client->queue_capacity = new_capacity;
+    }
+    if (callback != nullptr && (client->transaction_amount + 1) * 2 > client->transaction_capacity) {
+        if (!grow_transactions(client)) return 0;
+    }
+
+    // Unique among requests in flight, and never 0, which marks free slots
+    uint32_t transaction_id;
+    do {
+        transaction_id = arc4random();
+    } while (transaction_id == 0 || find_transaction(client, transaction_id) != nullptr);
+
+    udp_datagram_t* datagram = &client->queue[client->queue_amount++];
+    memcpy(datagram->data, request, length);
+    memcpy(datagram->data + REQUEST_TRANSACTION_OFFSET, &transaction_id, 4);
+    datagram->length = length;
+    memset(&datagram->server_addr, 0, sizeof(struct sockaddr_storage));
+    memcpy(&datagram->server_addr, server_addr, server_addr_len);
+    datagram->server_addr_len = server_addr_len;
+
+    if (callback != nullptr) {
+        udp_transaction_t transaction;
+        transaction.transaction_id = transaction_id;
+        transaction.server_addr = datagram->server_addr;
+        transaction.callback = callback;
+        transaction.ctx = ctx;
+        insert_transaction(client, &transaction);
+    }
+    return transaction_id;
+}
+
+void udp_client_cancel(udp_client_t* client, const uint32_t transaction_id) {
+    if (!client || transaction_id == 0) return;
+    udp_transaction_t* transaction = find_transaction(client, transaction_id);
+    if (transaction != nullptr) remove_transaction(client, transaction);
+}
+
+uint32_t udp_client_flush(udp_client_t* client) {
+    if (!client || client->queue_amount == 0) return 0;
+
+    uint32_t sent_total = 0;
+    struct iovec iovecs[UDP_BATCH_SIZE];
+    struct mmsghdr messages[UDP_BATCH_SIZE];
+    uint32_t batch_indexes[UDP_BATCH_SIZE];
+
+    for (int32_t family = 0; family < 2; ++family) {
+        uint32_t i = 0;
+        bool socket_full = false;
+        while (i < client->queue_amount && !socket_full) {
+            uint32_t batch = 0;
+            memset(messages, 0, sizeof(messages));
+            for (; i < client->queue_amount && batch < UDP_BATCH_SIZE; ++i) {
+                udp_datagram_t* datagram = &client->queue[i];
+                if (family_index(datagram->server_addr.ss_family) != family) continue;
+                iovecs[batch].iov_base = datagram->data;
+                iovecs[batch].iov_len = datagram->length;
+                messages[batch].msg_hdr.msg_iov = &iovecs[batch];
+                messages[batch].msg_hdr.msg_iovlen = 1;
+                messages[batch].msg_hdr.msg_name = &datagram->server_addr;
+                messages[batch].msg_hdr.msg_namelen = datagram->server_addr_len;
+                batch_indexes[batch] = i;
+                batch++;
+            }
+            if (batch == 0) break;
+
+            int32_t sent = sendmmsg(client->sockfd[family], messages, batch, 0);
+            client->stats.send_calls++;
+            if (sent < 0) {
+                // Keeping them for the next flush only if the socket was just full. Otherwise, trackers time out
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    sent = 0;
+                } else {
+                    if (LOG_ENABLED(client->log_code, LOG_ERR)) {
+                        log_write(LOG_ERR, "Error while sending tracker requests: %s (errno: %d)\n", strerror(errno), errno);
+                    }
+                    sent = (int32_t) batch;
+                }
+            } else {
+                client->stats.datagrams_sent += sent;
+                sent_total += sent;
+            }
+            socket_full = (uint32_t) sent < batch;
+            // Sent or dropped
+            for (int32_t j = 0; j < sent; ++j) {
+                client->queue[batch_indexes[j]].length = 0;
+            }
+        }
+    }
+
+    // Moving what couldn't be sent to the front of the queue
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < client->queue_amount; ++i) {
+        if (client->queue[i].length == 0) continue;
+        if (kept != i) client->queue[kept] = client->queue[i];
+        kept++;
+    }
+    client->queue_amount = kept;
+    return sent_total;
+}
+
+bool udp_client_get_connection(udp_client_t* client, const struct sockaddr* server_addr, const time_t now,
+                               uint64_t* connection_id) {
+    if (!client || !server_addr || !connection_id) return false;
+    for (uint32_t i = 0; i < client->connection_amount; ++i) {
+        udp_connection_t* connection = &client->connections[i];
+        if (!same_address((struct sockaddr*) &connection->server_addr, server_addr)) continue;
+        if (connection->expires <= now) {
+            // Expired, swapping with the last one
+            *connection = client->connections[--client->connection_amount];
+            return false;
+        }
+        *connection_id = connection->connection_id;
+        client->stats.connection_hits++;
+        return true;
+    }
+    return false;
+}
+
+void udp_client_set_connection(udp_client_t* client, const struct sockaddr* server_addr, const uint64_t connection_id,
+                               const time_t now) {
+    if (!client || !server_addr) return;
+    udp_connection_t* connection = nullptr;
+    for (uint32_t i = 0; i < client->connection_amount && connection == nullptr; ++i) {
+        if (same_address((struct sockaddr*) &client->connections[i].server_addr, server_addr)) {
+            connection = &client->connections[i];
+        }
+    }
+    if (connection == nullptr) {
+        if (client->connection_amount == client->connection_capacity) {
+            const uint32_t new_capacity = client->connection_capacity > 0 ? client->connection_capacity * 2 : 16;
+            udp_connection_t* connections = realloc(client->connections, sizeof(udp_connection_t) * new_capacity);
+            if (!connections) return;
+            client->connections = connections;
+            client->connection_capacity = new_capacity;
+        }
+        connection = &client->connections[client->connection_amount++];
+        memset(&connection->server_addr, 0, sizeof(struct sockaddr_storage));
+        memcpy(&connection->server_addr, server_addr,
+               server_addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    }
+    connection->connection_id = connection_id;
+    connection->expires = now + CONNECTION_ID_TTL;
+}
+
+void udp_client_forget_connection(udp_client_t* client, const struct sockaddr* server_addr) {
+    if (!client || !server_addr) return;
+    for (uint32_t i = 0; i < client->connection_amount; ++i) {
+        if (same_address((struct sockaddr*) &client->connections[i].server_addr, server_addr)) {
+            client->connections[i] = client->connections[--client->connection_amount];
+            return;
+        }
+    }
+}
@@ -0,0 +1,164 @@
+#ifndef BITTORRENT_CLIENT_UDP_CLIENT_H
+#define BITTORRENT_CLIENT_UDP_CLIENT_H
+
+#include <time.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+#include "predownload_udp.h"
+
+/// @brief Amount of datagrams sent or received by a single sendmmsg()/recvmmsg() call
+#define UDP_BATCH_SIZE 32
+/// @brief Initial amount of slots in the transaction table. Must be a power of 2
+#define UDP_INITIAL_TRANSACTIONS 64
+/// @brief Seconds a connection id can be used by the client after receiving it, as per BEP 15
+#define CONNECTION_ID_TTL 60
+/// @brief Largest request sent to a tracker: a scrape with as many info hashes as fit in a 1500 byte datagram
+#define MAX_REQUEST_SIZE (SCRAPE_REQUEST_SIZE + 20 * MAX_SCRAPE_TORRENTS)
+/// @brief Offset of the transaction id in every tracker request
+#define REQUEST_TRANSACTION_OFFSET 12
+/// @brief Offset of the transaction id in every tracker response
+#define RESPONSE_TRANSACTION_OFFSET 4
+
+/**
+ * Function called with the response to a request sent with udp_client_send().
+ *
+ * @param ctx The context pointer given to udp_client_send().
+ * @param response The whole response datagram, starting with action. Only valid during the call.
+ * @param length Length of response in bytes. Always at least 8.
+ */
+typedef void (*udp_response_callback_t)(void *ctx, const unsigned char *response, uint32_t length);
+
+/// @brief A request waiting for its response, in the transaction table
+typedef struct {
+    uint32_t transaction_id; /**< Transaction id of the request. 0 means the slot is free */
+    struct sockaddr_storage server_addr; /**< Tracker the request was sent to. Responses from elsewhere are ignored */
+    udp_response_callback_t callback; /**< Function called with the response */
+    void *ctx; /**< Passed as is to callback */
+} udp_transaction_t;
+
+/// @brief Connection id received from a tracker, reusable until it expires
+typedef struct {
+    struct sockaddr_storage server_addr; /**< Tracker that issued the connection id */
+    uint64_t connection_id; /**< Connection id, in network endianness */
+    time_t expires; /**< When the connection id stops being valid */
+} udp_connection_t;
+
+/// @brief A request queued until the next udp_client_flush()
+typedef struct {
+    unsigned char data[MAX_REQUEST_SIZE]; /**< Request, with its transaction id already set */
+    uint32_t length; /**< Length of data in bytes */
+    struct sockaddr_storage server_addr; /**< Destination tracker */
+    socklen_t server_addr_len; /**< Length of server_addr */
+} udp_datagram_t;
+
+/// @brief Counters for the syscalls the client made
+typedef struct {
+    uint64_t datagrams_sent; /**< Datagrams sent */
+    uint64_t send_calls; /**< sendmmsg() calls made to send them */
+    uint64_t datagrams_received; /**< Datagrams received */
+    uint64_t receive_calls; /**< recvmmsg() calls made to receive them */
+    uint64_t connection_hits; /**< Connection ids found in the cache */
+} udp_client_stats_t;
+
+/// @brief One non-blocking UDP socket per address family, shared by every tracker of every torrent
+typedef struct {
+    event_loop_t *loop; /**< Loop the sockets are registered in */
+    int32_t sockfd[2]; /**< IPv4 and IPv6 sockets, created on first use. -1 if not created yet */
+    int32_t loop_slot[2]; /**< Slots of the sockets in the loop */
+    udp_transaction_t *transactions; /**< Open addressing hash table of requests in flight, keyed by transaction id */
+    uint32_t transaction_capacity; /**< Amount of slots in transactions, always a power of 2 */
+    uint32_t transaction_amount; /**< Amount of used slots in transactions */
+    udp_connection_t *connections; /**< Cached connection ids */
+    uint32_t connection_amount; /**< Amount of cached connection ids */
+    uint32_t connection_capacity; /**< Amount of allocated entries in connections */
+    udp_datagram_t *queue; /**< Requests waiting to be sent */
+    uint32_t queue_amount; /**< Amount of requests in queue */
+    uint32_t queue_capacity; /**< Amount of allocated entries in queue */
+    udp_client_stats_t stats; /**< Syscall counters */
+    LOG_CODE log_code; /**< Logging level */
+} udp_client_t;
+
+/**
+ * Creates a UDP tracker client. Sockets are created and registered in the loop when first needed.
+ *
+ * @param loop The event loop responses are received from.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to the client, or nullptr if loop is nullptr.
+ */
+udp_client_t *udp_client_create(event_loop_t *loop, LOG_CODE log_code);
+
+/**
+ * Closes the sockets and frees the client. Callbacks of requests in flight are never called.
+ *
+ * @param client The client to free. If nullptr, nothing is done.
+ */
+void udp_client_free(udp_client_t *client);
+
+/**
+ * Queues a request to a tracker. A unique transaction id is written at offset 12 of the request,
+ * and, if callback isn't nullptr, registered so the response is routed to callback.
+ * Nothing is sent until udp_client_flush().
+ *
+ * @param client The client.
+ * @param server_addr The tracker's address.
+ * @param server_addr_len Length of server_addr.
+ * @param request The request. At least 16 bytes and at most MAX_REQUEST_SIZE.
+ * @param length Length of request in bytes.
+ * @param callback Function called with the response, or nullptr if no response is expected.
+ * @param ctx Passed as is to callback.
+ * @return The transaction id of the request, or 0 on failure.
+ */
+uint32_t udp_client_send(udp_client_t *client, const struct sockaddr *server_addr, socklen_t server_addr_len,
+                         const unsigned char *request, uint32_t length, udp_response_callback_t callback, void *ctx);
+
+/**
+ * Stops waiting for the response to a request. Its callback won't be called, even if the response arrives.
+ *
+ * @param client The client.
+ * @param transaction_id Transaction id returned by udp_client_send(). 0 is ignored.
+ */
+void udp_client_cancel(udp_client_t *client, uint32_t transaction_id);
+
+/**
+ * Sends every queued request, with one sendmmsg() call per UDP_BATCH_SIZE requests of the same address family.
+ *
+ * @param client The client.
+ * @return The amount of requests sent.
+ */
+uint32_t udp_client_flush(udp_client_t *client);
+
+/**
+ * Looks up a cached connection id for a tracker.
+ *
+ * @param client The client.
+ * @param server_addr The tracker's address.
+ * @param now Current time. Expired connection ids are dropped.
+ * @param connection_id Where to store the connection id, in network endianness. Only written on success.
+ * @return true if a valid connection id was found, false otherwise.
+ */
+bool udp_client_get_connection(udp_client_t *client, const struct sockaddr *server_addr, time_t now,
+                               uint64_t *connection_id);
+
+/**
+ * Caches the connection id a tracker returned for CONNECTION_ID_TTL seconds, replacing any previous one.
+ *
+ * @param client The client.
+ * @param server_addr The tracker's address.
+ * @param connection_id The connection id, in network endianness.
+ * @param now Time the connection id was received.
+ */
+void udp_client_set_connection(udp_client_t *client, const struct sockaddr *server_addr, uint64_t connection_id,
+                               time_t now);
+
+/**
+ * Drops the cached connection id of a tracker, after it returned an error.
+ *
+ * @param client The client.
+ * @param server_addr The tracker's address.
+ */
+void udp_client_forget_connection(udp_client_t *client, const struct sockaddr *server_addr);
+
+#endif //BITTORRENT_CLIENT_UDP_CLIENT_H
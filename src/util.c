@@ -1,5 +1,19 @@
 #include "util.h"
 
+#include <time.h>
+
 bool is_digit(const char c) {
     return c >= '0' && c <= '9';
-}
\ No newline at end of file
+}
+
+uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t monotonic_coarse_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
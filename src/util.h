@@ -57,4 +57,19 @@ typedef struct {
  * @return true if the character is a digit (0-9), false otherwise.
  */
 bool is_digit(char c);
+
+/**
+ * Reads the monotonic clock, which isn't affected by changes to the system time.
+ *
+ * @return Microseconds since an unspecified starting point.
+ */
+uint64_t monotonic_us(void);
+
+/**
+ * Reads the coarse monotonic clock, which is as cheap as it gets but only advances every few milliseconds.
+ * Good enough for timeouts, meant to be read once per loop iteration.
+ *
+ * @return Milliseconds since an unspecified starting point.
+ */
+uint64_t monotonic_coarse_ms(void);
 #endif //STRUCTS_H
@@ -0,0 +1,918 @@
+#include "utp.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+/// @brief Entry of the per-connection rings holding packet nr
+#define SLOT(nr) ((uint16_t) (nr) & (UTP_WINDOW_PACKETS - 1))
+
+static void put16(unsigned char* out, const uint16_t value) {
+    const uint16_t network = htons(value);
+    memcpy(out, &network, 2);
+}
+
+static void put32(unsigned char* out, const uint32_t value) {
+    const uint32_t network = htonl(value);
+    memcpy(out, &network, 4);
+}
+
+static uint16_t get16(const unsigned char* in) {
+    uint16_t network;
+    memcpy(&network, in, 2);
+    return ntohs(network);
+}
+
+static uint32_t get32(const unsigned char* in) {
+    uint32_t network;
+    memcpy(&network, in, 4);
+    return ntohl(network);
+}
+
+uint32_t utp_write_header(unsigned char* buffer, const utp_header_t* header) {
+    const bool sack = header->sack && header->sack_length > 0;
+    buffer[0] = (unsigned char) (header->type << 4 | UTP_VERSION);
+    buffer[1] = sack ? UTP_EXTENSION_SACK : 0;
+    put16(buffer + 2, header->connection_id);
+    put32(buffer + 4, header->timestamp_us);
+    put32(buffer + 8, header->timestamp_difference_us);
+    put32(buffer + 12, header->window);
+    put16(buffer + 16, header->seq_nr);
+    put16(buffer + 18, header->ack_nr);
+    if (!sack) return UTP_HEADER_SIZE;
+    // No further extension
+    buffer[UTP_HEADER_SIZE] = 0;
+    buffer[UTP_HEADER_SIZE + 1] = header->sack_length;
+    memcpy(buffer + UTP_HEADER_SIZE + 2, header->sack, header->sack_length);
+    return UTP_HEADER_SIZE + 2 + header->sack_length;
+}
+
+uint32_t utp_read_header(const unsigned char* packet, const uint32_t length, utp_header_t* header) {
+    if (!packet || !header || length < UTP_HEADER_SIZE) return 0;
+    if ((packet[0] & 0x0F) != UTP_VERSION || packet[0] >> 4 >= UTP_TYPE_COUNT) return 0;
+    header->type = packet[0] >> 4;
+    header->connection_id = get16(packet + 2);
+    header->timestamp_us = get32(packet + 4);
+    header->timestamp_difference_us = get32(packet + 8);
+    header->window = get32(packet + 12);
+    header->seq_nr = get16(packet + 16);
+    header->ack_nr = get16(packet + 18);
+    header->sack = nullptr;
+    header->sack_length = 0;
+
+    // Extensions are chained, each one naming the type of the next
+    uint8_t extension = packet[1];
+    uint32_t offset = UTP_HEADER_SIZE;
+    while (extension != 0) {
+        if (offset + 2 > length) return 0;
+        const uint8_t next = packet[offset];
+        const uint8_t extension_length = packet[offset + 1];
+        offset += 2;
+        if (offset + extension_length > length) return 0;
+        if (extension == UTP_EXTENSION_SACK) {
+            header->sack = packet + offset;
+            header->sack_length = extension_length;
+        }
+        offset += extension_length;
+        extension = next;
+    }
+    return offset;
+}
+
+uint32_t utp_ledbat_window(const uint32_t cwnd, const uint32_t bytes_acked, const uint32_t queuing_delay_us,
+                           const bool slow_start) {
+    int64_t window = cwnd > 0 ? cwnd : UTP_MIN_WINDOW;
+    if (slow_start) {
+        window += bytes_acked;
+    } else {
+        // Positive below the target, negative above it, and never further from 0 than the target itself
+        int64_t off_target = (int64_t) UTP_TARGET_DELAY_US - queuing_delay_us;
+        if (off_target < -UTP_TARGET_DELAY_US) off_target = -UTP_TARGET_DELAY_US;
+        // A whole window acked with no queuing delay grows it by UTP_GAIN packets
+        window += (int64_t) UTP_GAIN * off_target * bytes_acked * UTP_PAYLOAD_MAX /
+                  ((int64_t) UTP_TARGET_DELAY_US * window);
+    }
+    if (window < UTP_MIN_WINDOW) return UTP_MIN_WINDOW;
+    if (window > UTP_MAX_WINDOW) return UTP_MAX_WINDOW;
+    return window;
+}
+
+/**
+ * Whether a wrapping 32-bit delay is below another one
+ */
+static bool delay_below(const uint32_t a, const uint32_t b) {
+    return (int32_t) (a - b) < 0;
+}
+
+/**
+ * Bytes we can still take in, for the window field of what we send
+ */
+static uint32_t receive_window(const utp_connection_t* connection) {
+    const uint16_t held = connection->ack_nr + 1 - connection->deliver_nr;
+    if (held >= UTP_WINDOW_PACKETS) return 0;
+    return (UTP_WINDOW_PACKETS - held) * UTP_PAYLOAD_MAX;
+}
+
+/**
+ * Sends packets of the send ring, first time or not, in a single sendmmsg(). Each one carries the latest ack
+ */
+static void transmit(utp_connection_t* connection, const uint16_t first, const uint32_t count) {
+    utp_context_t* utp = connection->utp;
+    unsigned char headers[UTP_BATCH_SIZE][UTP_HEADER_SIZE];
+    struct iovec iovecs[UTP_BATCH_SIZE][2];
+    struct mmsghdr messages[UTP_BATCH_SIZE];
+    memset(messages, 0, sizeof(messages[0]) * count);
+    const uint32_t now = monotonic_us();
+    const uint32_t window = receive_window(connection);
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint16_t nr = first + i;
+        const uint16_t slot = SLOT(nr);
+        const utp_header_t header = {
+            .type = connection->send_types[slot],
+            // A SYN tells the other side the id it has to send to
+            .connection_id = connection->send_types[slot] == UTP_SYN ? connection->recv_id : connection->send_id,
+            .timestamp_us = now,
+            .timestamp_difference_us = connection->reply_micro,
+            .window = window,
+            .seq_nr = nr,
+            .ack_nr = connection->ack_nr
+        };
+        utp_write_header(headers[i], &header);
+        iovecs[i][0].iov_base = headers[i];
+        iovecs[i][0].iov_len = UTP_HEADER_SIZE;
+        iovecs[i][1].iov_base = connection->send_payloads[slot];
+        iovecs[i][1].iov_len = connection->send_lengths[slot];
+        messages[i].msg_hdr.msg_iov = iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 2;
+        messages[i].msg_hdr.msg_name = &connection->address;
+        messages[i].msg_hdr.msg_namelen = sizeof(connection->address);
+        connection->send_times_us[slot] = now;
+        if (connection->transmissions[slot] < UINT8_MAX) connection->transmissions[slot]++;
+        if (!connection->send_in_flight[slot]) {
+            connection->send_in_flight[slot] = true;
+            connection->flight += connection->send_lengths[slot];
+        }
+    }
+    // Datagrams the socket couldn't take are lost like any other, and sent again
+    if (sendmmsg(utp->sockfd, messages, count, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_printf(utp->log_code, LOG_FULL, "Couldn't send uTP packets: %s\n", strerror(errno));
+    }
+    connection->ack_pending = false;
+    connection->window_sent = window;
+    if (connection->rto_deadline_ms == 0) connection->rto_deadline_ms = utp->timers->now_ms + connection->rto_ms;
+}
+
+/**
+ * Sends a packet that takes no sequence number, a STATE acking what was received, selectively too, or a RESET
+ */
+static void send_control(utp_connection_t* connection, const UTP_TYPE type) {
+    unsigned char sack[UTP_SACK_MAX] = {0};
+    uint8_t sack_length = 0;
+    if (type == UTP_STATE) {
+        // Bit i acks ack_nr + 2 + i, as far as packets may have been received
+        for (uint32_t i = 0; i < UTP_SACK_MAX * 8; ++i) {
+            const uint16_t nr = connection->ack_nr + 2 + i;
+            if ((uint16_t) (nr - connection->deliver_nr) >= UTP_WINDOW_PACKETS) break;
+            if (!connection->recv_present[SLOT(nr)]) continue;
+            sack[i / 8] |= 1 << i % 8;
+            sack_length = (i / 32 + 1) * 4;
+        }
+    }
+    const uint32_t window = receive_window(connection);
+    const utp_header_t header = {
+        .type = type,
+        .connection_id = connection->send_id,
+        .timestamp_us = monotonic_us(),
+        .timestamp_difference_us = connection->reply_micro,
+        .window = window,
+        .seq_nr = connection->seq_nr,
+        .ack_nr = connection->ack_nr,
+        .sack = sack_length > 0 ? sack : nullptr,
+        .sack_length = sack_length
+    };
+    unsigned char packet[UTP_HEADER_SIZE + 2 + UTP_SACK_MAX];
+    const uint32_t length = utp_write_header(packet, &header);
+    if (sendto(connection->utp->sockfd, packet, length, 0, (const struct sockaddr*) &connection->address,
+               sizeof(connection->address)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_printf(connection->utp->log_code, LOG_FULL, "Couldn't send uTP packet: %s\n", strerror(errno));
+    }
+    connection->ack_pending = false;
+    connection->window_sent = window;
+}
+
+/**
+ * Closes our end of a connection and frees it, letting the other side know unless it closed first
+ */
+static void destroy_connection(utp_connection_t* connection, const bool reset) {
+    utp_context_t* utp = connection->utp;
+    if (reset) send_control(connection, UTP_RESET);
+    loop_remove_source(utp->loop, connection->slot);
+    if (connection->fd >= 0) close(connection->fd);
+    for (uint32_t i = 0; i < utp->connection_amount; ++i) {
+        if (utp->connections[i] != connection) continue;
+        utp->connections[i] = utp->connections[--utp->connection_amount];
+        break;
+    }
+    free(connection->send_payloads);
+    free(connection->recv_payloads);
+    free(connection);
+}
+
+static utp_connection_t* find_connection(const utp_context_t* utp, const struct sockaddr_in* address,
+                                         const uint16_t recv_id) {
+    for (uint32_t i = 0; i < utp->connection_amount; ++i) {
+        utp_connection_t* connection = utp->connections[i];
+        if (connection->recv_id == recv_id && connection->address.sin_addr.s_addr == address->sin_addr.s_addr &&
+            connection->address.sin_port == address->sin_port) {
+            return connection;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Sends unacked packets taken as lost and whatever the peer layer wrote, as far as the windows allow
+ * @return false if the connection had to be destroyed
+ */
+static bool fill_window(utp_connection_t* connection) {
+    if (connection->state == UTP_SYN_SENT) return true;
+    const uint32_t window = connection->cwnd < connection->peer_window ? connection->cwnd : connection->peer_window;
+
+    // Timeouts leave every unacked packet out of flight, to be sent again
+    if ((uint16_t) (connection->resend_nr - connection->oldest_nr) >
+        (uint16_t) (connection->seq_nr - connection->oldest_nr)) {
+        connection->resend_nr = connection->oldest_nr;
+    }
+    while (connection->resend_nr != connection->seq_nr) {
+        const uint16_t slot = SLOT(connection->resend_nr);
+        if (connection->send_acked[slot] || connection->send_in_flight[slot]) {
+            connection->resend_nr++;
+            continue;
+        }
+        if (connection->flight > 0 && connection->flight + connection->send_lengths[slot] > window) return true;
+        transmit(connection, connection->resend_nr++, 1);
+        metrics_add(METRIC_UTP_RETRANSMITS, 1);
+    }
+
+    while (connection->state == UTP_CONNECTED) {
+        uint32_t room = UTP_WINDOW_PACKETS - (uint16_t) (connection->seq_nr - connection->oldest_nr);
+        const uint32_t window_room = connection->flight < window ? (window - connection->flight) / UTP_PAYLOAD_MAX : 0;
+        if (room > window_room) room = window_room;
+        // A window smaller than a packet still lets one through at a time
+        if (room == 0 && connection->flight == 0 && connection->seq_nr - connection->oldest_nr < UTP_WINDOW_PACKETS) {
+            room = 1;
+        }
+        if (room > UTP_BATCH_SIZE) room = UTP_BATCH_SIZE;
+        if (room == 0) return true;
+
+        struct iovec iovecs[UTP_BATCH_SIZE];
+        for (uint32_t i = 0; i < room; ++i) {
+            iovecs[i].iov_base = connection->send_payloads[SLOT(connection->seq_nr + i)];
+            iovecs[i].iov_len = UTP_PAYLOAD_MAX;
+        }
+        const ssize_t received = readv(connection->fd, iovecs, (int) room);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            destroy_connection(connection, true);
+            return false;
+        }
+        const uint16_t first = connection->seq_nr;
+        if (received == 0) {
+            // The peer layer closed its end, the FIN is queued like data so it arrives after everything else
+            const uint16_t slot = SLOT(connection->seq_nr++);
+            connection->send_types[slot] = UTP_FIN;
+            connection->send_lengths[slot] = 0;
+            connection->send_acked[slot] = false;
+            connection->send_in_flight[slot] = false;
+            connection->transmissions[slot] = 0;
+            connection->state = UTP_FIN_SENT;
+            transmit(connection, first, 1);
+            return true;
+        }
+        const uint32_t packets = (received + UTP_PAYLOAD_MAX - 1) / UTP_PAYLOAD_MAX;
+        for (uint32_t i = 0; i < packets; ++i) {
+            const uint16_t slot = SLOT(connection->seq_nr++);
+            connection->send_types[slot] = UTP_DATA;
+            connection->send_lengths[slot] = i + 1 < packets ? UTP_PAYLOAD_MAX : received - i * UTP_PAYLOAD_MAX;
+            connection->send_acked[slot] = false;
+            connection->send_in_flight[slot] = false;
+            connection->transmissions[slot] = 0;
+        }
+        connection->resend_nr = connection->seq_nr;
+        transmit(connection, first, packets);
+        // Drained
+        if ((size_t) received < room * UTP_PAYLOAD_MAX) return true;
+    }
+    return true;
+}
+
+/**
+ * Writes payloads received in order to the peer layer, as much as it takes. Closes the connection once the
+ * remote FIN is reached
+ * @return false if the connection had to be destroyed
+ */
+static bool deliver(utp_connection_t* connection) {
+    const uint16_t end = connection->ack_nr + 1;
+    while (connection->deliver_nr != end) {
+        // Nobody is reading anymore, our FIN is on its way
+        if (connection->state == UTP_FIN_SENT) {
+            connection->recv_present[SLOT(connection->deliver_nr++)] = false;
+            connection->deliver_offset = 0;
+            continue;
+        }
+        struct iovec iovecs[UTP_BATCH_SIZE];
+        uint32_t count = 0;
+        for (uint16_t nr = connection->deliver_nr; nr != end && count < UTP_BATCH_SIZE; ++nr, ++count) {
+            const uint16_t slot = SLOT(nr);
+            const uint32_t skip = count == 0 ? connection->deliver_offset : 0;
+            iovecs[count].iov_base = connection->recv_payloads[slot] + skip;
+            iovecs[count].iov_len = connection->recv_lengths[slot] - skip;
+        }
+        const struct msghdr message = {.msg_iov = iovecs, .msg_iovlen = count};
+        ssize_t written = sendmsg(connection->fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            destroy_connection(connection, true);
+            return false;
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if ((size_t) written < iovecs[i].iov_len) {
+                connection->deliver_offset += written;
+                // Writability comes back once the peer layer reads
+                return true;
+            }
+            written -= iovecs[i].iov_len;
+            connection->recv_present[SLOT(connection->deliver_nr++)] = false;
+            connection->deliver_offset = 0;
+        }
+    }
+    if (connection->fin_received && connection->deliver_nr == (uint16_t) (connection->fin_nr + 1)) {
+        // Acking the FIN, the peer layer reads what's left and then sees the socket closed
+        send_control(connection, UTP_STATE);
+        destroy_connection(connection, false);
+        return false;
+    }
+    // A window that had closed reopening, the other side waits for it
+    if (connection->window_sent < 4 * UTP_PAYLOAD_MAX && receive_window(connection) > connection->window_sent) {
+        send_control(connection, UTP_STATE);
+    }
+    return true;
+}
+
+/**
+ * Ready events of the engine end of a connection, registered edge-triggered: the peer layer wrote something
+ * or closed, or read enough for deliveries to go on
+ */
+static void on_connection_ready(void* ctx, const uint32_t events) {
+    utp_connection_t* connection = ctx;
+    if (connection->state == UTP_SYN_SENT) {
+        // Given up on before the connection was even established
+        if (events & (EPOLLHUP | EPOLLERR)) destroy_connection(connection, true);
+        return;
+    }
+    if (events & EPOLLOUT && !deliver(connection)) return;
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) fill_window(connection);
+}
+
+static utp_connection_t* create_connection(utp_context_t* utp, const int32_t fd, const struct sockaddr_in* address) {
+    if (utp->connection_amount == utp->connection_capacity) {
+        const uint32_t capacity = utp->connection_capacity > 0 ? utp->connection_capacity * 2 : 16;
+        utp_connection_t** connections = realloc(utp->connections, sizeof(utp_connection_t*) * capacity);
+        if (!connections) return nullptr;
+        utp->connections = connections;
+        utp->connection_capacity = capacity;
+    }
+    utp_connection_t* connection = calloc(1, sizeof(utp_connection_t));
+    if (!connection) return nullptr;
+    // Only touched as the windows fill up
+    connection->send_payloads = malloc(UTP_WINDOW_PACKETS * UTP_PAYLOAD_MAX);
+    connection->recv_payloads = malloc(UTP_WINDOW_PACKETS * UTP_PAYLOAD_MAX);
+    connection->utp = utp;
+    connection->fd = fd;
+    connection->address = *address;
+    connection->slot = -1;
+    if (connection->send_payloads && connection->recv_payloads) {
+        connection->slot = loop_add_source(utp->loop, fd, EPOLLIN | EPOLLOUT | EPOLLET, on_connection_ready, connection);
+    }
+    if (connection->slot < 0) {
+        free(connection->send_payloads);
+        free(connection->recv_payloads);
+        free(connection);
+        return nullptr;
+    }
+    connection->cwnd = UTP_MIN_WINDOW;
+    connection->ssthresh = UTP_MAX_WINDOW;
+    connection->peer_window = UTP_PAYLOAD_MAX;
+    connection->rto_ms = UTP_INITIAL_RTO_MS;
+    utp->connections[utp->connection_amount++] = connection;
+    if (!wheel_timer_armed(utp->timers, utp->tick_timer)) wheel_timer_arm(utp->timers, utp->tick_timer, UTP_TICK_MS);
+    return connection;
+}
+
+/**
+ * Sends a SYN for a connection asked for through utp_connect()
+ */
+static void start_connection(utp_context_t* utp, const utp_pending_t* pending) {
+    utp_connection_t* connection = create_connection(utp, pending->fd, &pending->address);
+    if (!connection) {
+        close(pending->fd);
+        return;
+    }
+    connection->state = UTP_SYN_SENT;
+    // We receive on a random id and send on the next one, the other side does it the other way around
+    connection->recv_id = arc4random();
+    connection->send_id = connection->recv_id + 1;
+    connection->seq_nr = 1;
+    connection->oldest_nr = 1;
+    const uint16_t slot = SLOT(connection->seq_nr++);
+    connection->send_types[slot] = UTP_SYN;
+    connection->resend_nr = connection->seq_nr;
+    transmit(connection, 1, 1);
+}
+
+/**
+ * Takes a SYN, either answering one already taken or opening a connection to hand over to on_accept
+ */
+static void accept_connection(utp_context_t* utp, const utp_header_t* header, const struct sockaddr_in* address,
+                              const uint32_t now) {
+    utp_connection_t* connection = find_connection(utp, address, header->connection_id + 1);
+    if (connection) {
+        // Our STATE was lost
+        connection->ack_pending = true;
+        send_control(connection, UTP_STATE);
+        return;
+    }
+    if (!utp->on_accept) return;
+    int32_t pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0) return;
+    connection = create_connection(utp, pair[1], address);
+    if (!connection) {
+        close(pair[0]);
+        close(pair[1]);
+        return;
+    }
+    connection->state = UTP_CONNECTED;
+    connection->recv_id = header->connection_id + 1;
+    connection->send_id = header->connection_id;
+    connection->seq_nr = arc4random();
+    connection->oldest_nr = connection->seq_nr;
+    connection->resend_nr = connection->seq_nr;
+    connection->loss_nr = connection->seq_nr;
+    connection->ack_nr = header->seq_nr;
+    connection->deliver_nr = header->seq_nr + 1;
+    connection->peer_window = header->window;
+    connection->reply_micro = now - header->timestamp_us;
+    send_control(connection, UTP_STATE);
+    log_printf(utp->log_code, LOG_FULL, "uTP connection from port %u\n", ntohs(address->sin_port));
+    utp->on_accept(utp->accept_ctx, pair[0], address);
+}
+
+/**
+ * Counts one round trip measurement in, as RFC 6298 does
+ */
+static void update_rtt(utp_connection_t* connection, const uint32_t rtt_us) {
+    if (connection->srtt_us == 0) {
+        connection->srtt_us = rtt_us;
+        connection->rttvar_us = rtt_us / 2;
+    } else {
+        const uint32_t deviation = rtt_us > connection->srtt_us ? rtt_us - connection->srtt_us
+                                                                : connection->srtt_us - rtt_us;
+        connection->rttvar_us = (3 * connection->rttvar_us + deviation) / 4;
+        connection->srtt_us = (7 * connection->srtt_us + rtt_us) / 8;
+    }
+    connection->rto_ms = (connection->srtt_us + 4 * connection->rttvar_us) / 1000;
+    if (connection->rto_ms < UTP_MIN_RTO_MS) connection->rto_ms = UTP_MIN_RTO_MS;
+}
+
+/**
+ * Marks a packet in flight as acked, keeping the send time of the latest one sent among those acked
+ * @return Its payload bytes, 0 if it was acked already
+ */
+static uint32_t ack_packet(utp_connection_t* connection, const uint16_t nr, const uint16_t acking_nr,
+                           const uint32_t now, uint32_t* latest_sent_us) {
+    const uint16_t slot = SLOT(nr);
+    if (connection->send_acked[slot]) return 0;
+    connection->send_acked[slot] = true;
+    if (connection->send_in_flight[slot]) {
+        connection->send_in_flight[slot] = false;
+        connection->flight -= connection->send_lengths[slot];
+    }
+    // Acks of packets sent more than once can't tell which copy arrived, and older packets acked along with the
+    // one that triggered the ack may have had theirs lost
+    if (nr == acking_nr && connection->transmissions[slot] == 1) {
+        update_rtt(connection, now - connection->send_times_us[slot]);
+    }
+    if (delay_below(*latest_sent_us, connection->send_times_us[slot])) *latest_sent_us = connection->send_times_us[slot];
+    return connection->send_lengths[slot];
+}
+
+/**
+ * Cuts the window for a lost packet, once per window of data, and sends it again
+ */
+static void packet_lost(utp_connection_t* connection, const uint16_t nr) {
+    if ((int16_t) (nr - connection->loss_nr) >= 0) {
+        connection->cwnd /= 2;
+        if (connection->cwnd < UTP_MIN_WINDOW) connection->cwnd = UTP_MIN_WINDOW;
+        connection->ssthresh = connection->cwnd;
+        connection->loss_nr = connection->seq_nr;
+    }
+    const uint16_t slot = SLOT(nr);
+    if (connection->send_in_flight[slot]) {
+        connection->send_in_flight[slot] = false;
+        connection->flight -= connection->send_lengths[slot];
+    }
+    transmit(connection, nr, 1);
+    metrics_add(METRIC_UTP_RETRANSMITS, 1);
+}
+
+/**
+ * Tracks the lowest one-way delay of our packets, a wrapping minimum over the last UTP_DELAY_HISTORY minutes
+ * @return How far above that minimum this measurement is, which is how long our packets are queued
+ */
+static uint32_t queuing_delay(utp_connection_t* connection, const uint32_t delay_us, const uint64_t now_ms) {
+    if (connection->bucket_ms == 0) {
+        for (uint32_t i = 0; i < UTP_DELAY_HISTORY; ++i) connection->base_delays[i] = delay_us;
+        connection->bucket_ms = now_ms;
+    } else if (now_ms >= connection->bucket_ms + UTP_DELAY_BUCKET_MS) {
+        connection->delay_bucket = (connection->delay_bucket + 1) % UTP_DELAY_HISTORY;
+        connection->base_delays[connection->delay_bucket] = delay_us;
+        connection->bucket_ms = now_ms;
+    } else if (delay_below(delay_us, connection->base_delays[connection->delay_bucket])) {
+        connection->base_delays[connection->delay_bucket] = delay_us;
+    }
+    uint32_t base = connection->base_delays[0];
+    for (uint32_t i = 1; i < UTP_DELAY_HISTORY; ++i) {
+        if (delay_below(connection->base_delays[i], base)) base = connection->base_delays[i];
+    }
+    return delay_below(delay_us, base) ? 0 : delay_us - base;
+}
+
+/**
+ * Takes the cumulative and selective acks of a packet out of flight, grows or cuts the window, and sends
+ * again packets acked past often enough
+ */
+static void process_ack(utp_connection_t* connection, const utp_header_t* header, const uint32_t now) {
+    const uint16_t outstanding = connection->seq_nr - connection->oldest_nr;
+    uint32_t acked = 0;
+    // Anything sent before this and still unacked may be lost
+    uint32_t latest_sent = now - INT32_MAX;
+    bool advanced = false;
+    if ((uint16_t) (header->ack_nr - connection->oldest_nr) < outstanding) {
+        const uint16_t end = header->ack_nr + 1;
+        for (uint16_t nr = connection->oldest_nr; nr != end; ++nr) {
+            acked += ack_packet(connection, nr, header->ack_nr, now, &latest_sent);
+        }
+        advanced = true;
+    }
+    for (uint32_t i = 0; header->sack && i < header->sack_length * 8u; ++i) {
+        if (!(header->sack[i / 8] & 1 << i % 8)) continue;
+        const uint16_t nr = header->ack_nr + 2 + i;
+        if ((uint16_t) (nr - connection->oldest_nr) < outstanding) {
+            acked += ack_packet(connection, nr, nr, now, &latest_sent);
+        }
+    }
+    while (connection->oldest_nr != connection->seq_nr && connection->send_acked[SLOT(connection->oldest_nr)]) {
+        connection->send_acked[SLOT(connection->oldest_nr++)] = false;
+    }
+    if (advanced) {
+        connection->rto_deadline_ms = connection->oldest_nr != connection->seq_nr
+                                          ? connection->utp->timers->now_ms + connection->rto_ms : 0;
+    }
+
+    if (header->timestamp_difference_us != 0 && acked > 0) {
+        const uint32_t delay = queuing_delay(connection, header->timestamp_difference_us,
+                                             connection->utp->timers->now_ms);
+        // Slow start ends before the queue it builds gets anywhere near the target
+        if (connection->cwnd < connection->ssthresh && delay > UTP_TARGET_DELAY_US / 2) {
+            connection->ssthresh = connection->cwnd;
+        }
+        connection->cwnd = utp_ledbat_window(connection->cwnd, acked, delay,
+                                             connection->cwnd < connection->ssthresh);
+    }
+
+    // Packets acked past one sent before them mean it was lost, not just delayed. Small windows can't get
+    // UTP_DUPLICATE_ACKS of them, so they need fewer
+    if (!header->sack) return;
+    const uint16_t in_flight = connection->seq_nr - connection->oldest_nr;
+    const uint32_t threshold = in_flight > UTP_DUPLICATE_ACKS ? UTP_DUPLICATE_ACKS : in_flight > 1 ? in_flight - 1 : 1;
+    uint32_t acked_after = 0;
+    for (uint16_t nr = connection->seq_nr; nr != connection->oldest_nr;) {
+        const uint16_t slot = SLOT(--nr);
+        if (connection->send_acked[slot]) acked_after++;
+        else if (acked_after >= threshold && connection->send_in_flight[slot] &&
+                 delay_below(connection->send_times_us[slot], latest_sent)) {
+            packet_lost(connection, nr);
+        }
+    }
+}
+
+/**
+ * Stores the payload of a DATA or FIN packet, moving ack_nr over whatever is now received in order
+ */
+static void receive_payload(utp_connection_t* connection, const utp_header_t* header, const unsigned char* payload,
+                            const uint32_t length) {
+    connection->ack_pending = true;
+    const uint16_t nr = header->seq_nr;
+    // Received already, or too far ahead to fit
+    if ((uint16_t) (nr - connection->ack_nr - 1) >= UTP_WINDOW_PACKETS ||
+        (uint16_t) (nr - connection->deliver_nr) >= UTP_WINDOW_PACKETS) {
+        return;
+    }
+    if (connection->fin_received && (int16_t) (nr - connection->fin_nr) > 0) return;
+    const uint16_t slot = SLOT(nr);
+    if (connection->recv_present[slot]) return;
+    if (header->type == UTP_FIN) {
+        connection->fin_received = true;
+        connection->fin_nr = nr;
+    }
+    const uint32_t kept = header->type == UTP_FIN ? 0 : length < UTP_PAYLOAD_MAX ? length : UTP_PAYLOAD_MAX;
+    memcpy(connection->recv_payloads[slot], payload, kept);
+    connection->recv_lengths[slot] = kept;
+    connection->recv_present[slot] = true;
+    while (connection->recv_present[SLOT(connection->ack_nr + 1)] &&
+           (uint16_t) (connection->ack_nr + 1 - connection->deliver_nr) < UTP_WINDOW_PACKETS) {
+        connection->ack_nr++;
+    }
+}
+
+/**
+ * Handles a datagram of the socket
+ * @return The connection it belongs to, which has acks or payloads to act on, or nullptr
+ */
+static utp_connection_t* handle_packet(utp_context_t* utp, const unsigned char* packet, const uint32_t length,
+                                       const struct sockaddr_in* source) {
+    utp_header_t header;
+    const uint32_t offset = utp_read_header(packet, length, &header);
+    if (offset == 0) return nullptr;
+    const uint32_t now = monotonic_us();
+    if (header.type == UTP_SYN) {
+        accept_connection(utp, &header, source, now);
+        return nullptr;
+    }
+    utp_connection_t* connection = find_connection(utp, source, header.connection_id);
+    if (!connection) return nullptr;
+    if (header.type == UTP_RESET) {
+        log_printf(utp->log_code, LOG_FULL, "uTP connection to port %u reset\n", ntohs(source->sin_port));
+        destroy_connection(connection, false);
+        return nullptr;
+    }
+    connection->reply_micro = now - header.timestamp_us;
+    if (connection->state == UTP_SYN_SENT) {
+        if (header.type != UTP_STATE) return nullptr;
+        // Their first packet will carry the seq_nr of this STATE
+        connection->state = UTP_CONNECTED;
+        connection->ack_nr = header.seq_nr - 1;
+        connection->deliver_nr = header.seq_nr;
+        connection->loss_nr = connection->seq_nr;
+    }
+    connection->peer_window = header.window;
+    process_ack(connection, &header, now);
+    if (connection->state == UTP_FIN_SENT && connection->oldest_nr == connection->seq_nr) {
+        // Our FIN was acked
+        destroy_connection(connection, false);
+        return nullptr;
+    }
+    if (header.type == UTP_DATA || header.type == UTP_FIN) {
+        receive_payload(connection, &header, packet + offset, length - offset);
+    }
+    return connection;
+}
+
+/**
+ * Takes connections whose SYN got an ICMP error back out of the error queue, instead of waiting for them to time out
+ */
+static void read_errors(utp_context_t* utp) {
+    for (;;) {
+        struct sockaddr_in destination;
+        char control[512];
+        char data[UTP_HEADER_SIZE];
+        struct iovec iovec = {data, sizeof(data)};
+        struct msghdr message = {0};
+        message.msg_name = &destination;
+        message.msg_namelen = sizeof(destination);
+        message.msg_iov = &iovec;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(utp->sockfd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_RECVERR) continue;
+            const struct sock_extended_err* error = (const struct sock_extended_err*) CMSG_DATA(cmsg);
+            // Destination unreachable, whatever the reason
+            if (error->ee_origin != SO_EE_ORIGIN_ICMP || error->ee_type != 3) continue;
+            for (uint32_t i = utp->connection_amount; i-- > 0;) {
+                utp_connection_t* connection = utp->connections[i];
+                if (connection->state != UTP_SYN_SENT ||
+                    connection->address.sin_addr.s_addr != destination.sin_addr.s_addr ||
+                    connection->address.sin_port != destination.sin_port) {
+                    continue;
+                }
+                log_printf(utp->log_code, LOG_FULL, "uTP port %u unreachable\n", ntohs(destination.sin_port));
+                destroy_connection(connection, false);
+            }
+        }
+    }
+}
+
+static void on_readable(void* ctx, const uint32_t events) {
+    utp_context_t* utp = ctx;
+    if (events & EPOLLERR) read_errors(utp);
+    unsigned char buffers[UTP_BATCH_SIZE][UTP_PACKET_MAX + 64];
+    struct sockaddr_in sources[UTP_BATCH_SIZE];
+    struct iovec iovecs[UTP_BATCH_SIZE];
+    struct mmsghdr messages[UTP_BATCH_SIZE];
+    utp_connection_t* touched[UTP_BATCH_SIZE];
+
+    int32_t received;
+    do {
+        memset(messages, 0, sizeof(messages));
+        for (int32_t i = 0; i < UTP_BATCH_SIZE; ++i) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = sizeof(buffers[i]);
+            messages[i].msg_hdr.msg_iov = &iovecs[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+            messages[i].msg_hdr.msg_name = &sources[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        received = recvmmsg(utp->sockfd, messages, UTP_BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && LOG_ENABLED(utp->log_code, LOG_ERR)) {
+                log_write(LOG_ERR, "Error while receiving uTP packets: %s (errno: %d)\n", strerror(errno), errno);
+            }
+            break;
+        }
+        uint32_t touched_amount = 0;
+        for (int32_t i = 0; i < received; ++i) {
+            if (sources[i].sin_family != AF_INET || messages[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+            utp_connection_t* connection = handle_packet(utp, buffers[i], messages[i].msg_len, &sources[i]);
+            if (!connection) continue;
+            bool seen = false;
+            for (uint32_t j = 0; j < touched_amount && !seen; ++j) seen = touched[j] == connection;
+            if (!seen) touched[touched_amount++] = connection;
+        }
+        // Once per batch: payloads go to the peer layer, acks open the window, and one ack answers them all
+        for (uint32_t i = 0; i < touched_amount; ++i) {
+            utp_connection_t* connection = touched[i];
+            // Destroyed by a later packet of the same batch
+            bool alive = false;
+            for (uint32_t j = 0; j < utp->connection_amount && !alive; ++j) alive = utp->connections[j] == connection;
+            if (!alive || !deliver(connection) || !fill_window(connection)) continue;
+            if (connection->ack_pending) send_control(connection, UTP_STATE);
+        }
+    } while (received == UTP_BATCH_SIZE);
+}
+
+/**
+ * Starts connections other threads asked for
+ */
+static void on_wake(void* ctx, const uint32_t events) {
+    (void) events;
+    utp_context_t* utp = ctx;
+    uint64_t count;
+    if (read(utp->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_printf(utp->log_code, LOG_ERR, "Couldn't read uTP wakeup\n");
+    }
+    pthread_mutex_lock(&utp->pending_mutex);
+    for (uint32_t i = 0; i < utp->pending_amount; ++i) start_connection(utp, &utp->pending[i]);
+    utp->pending_amount = 0;
+    pthread_mutex_unlock(&utp->pending_mutex);
+}
+
+/**
+ * Sends again packets whose acks are overdue, gives up on connections that stopped answering, and probes
+ * windows that closed. Rearms itself while there are connections
+ */
+static void on_tick(void* ctx, const uint32_t data) {
+    (void) data;
+    utp_context_t* utp = ctx;
+    const uint64_t now = utp->timers->now_ms;
+    for (uint32_t i = utp->connection_amount; i-- > 0;) {
+        utp_connection_t* connection = utp->connections[i];
+        if (connection->oldest_nr == connection->seq_nr) {
+            // Nothing in flight will bring a window update
+            if (connection->state == UTP_CONNECTED && connection->peer_window < UTP_PAYLOAD_MAX) {
+                connection->peer_window = UTP_PAYLOAD_MAX;
+                fill_window(connection);
+            }
+            continue;
+        }
+        if (connection->rto_deadline_ms == 0 || now < connection->rto_deadline_ms) continue;
+        const uint16_t slot = SLOT(connection->oldest_nr);
+        const uint8_t limit = connection->send_types[slot] == UTP_SYN ? UTP_SYN_TRANSMISSIONS : UTP_MAX_TRANSMISSIONS;
+        if (connection->transmissions[slot] >= limit) {
+            log_printf(utp->log_code, LOG_FULL, "uTP connection to port %u timed out\n",
+                       ntohs(connection->address.sin_port));
+            destroy_connection(connection, connection->state != UTP_SYN_SENT);
+            continue;
+        }
+        // Everything in flight is taken as lost, and sent again from the oldest on as the window allows
+        connection->ssthresh = connection->cwnd / 2 > UTP_MIN_WINDOW ? connection->cwnd / 2 : UTP_MIN_WINDOW;
+        connection->cwnd = UTP_MIN_WINDOW;
+        connection->loss_nr = connection->seq_nr;
+        for (uint16_t nr = connection->oldest_nr; nr != connection->seq_nr; ++nr) {
+            connection->send_in_flight[SLOT(nr)] = false;
+        }
+        connection->flight = 0;
+        connection->rto_ms = connection->rto_ms * 2 < UTP_MAX_RTO_MS ? connection->rto_ms * 2 : UTP_MAX_RTO_MS;
+        connection->rto_deadline_ms = 0;
+        transmit(connection, connection->oldest_nr, 1);
+        metrics_add(METRIC_UTP_RETRANSMITS, 1);
+        connection->resend_nr = connection->oldest_nr + 1;
+    }
+    if (utp->connection_amount > 0) wheel_timer_arm(utp->timers, utp->tick_timer, UTP_TICK_MS);
+}
+
+utp_context_t* utp_create(event_loop_t* loop, timer_wheel_t* timers, const uint16_t port,
+                          const utp_accept_callback_t on_accept, void* ctx, const LOG_CODE log_code) {
+    if (!loop || !timers) return nullptr;
+    utp_context_t* utp = calloc(1, sizeof(utp_context_t));
+    if (!utp) return nullptr;
+    utp->loop = loop;
+    utp->timers = timers;
+    utp->slot = -1;
+    utp->wake_slot = -1;
+    utp->tick_timer = TIMER_NONE;
+    utp->on_accept = on_accept;
+    utp->accept_ctx = ctx;
+    utp->log_code = log_code;
+    pthread_mutex_init(&utp->pending_mutex, nullptr);
+    utp->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    utp->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    socklen_t address_length = sizeof(address);
+    if (utp->wake_fd < 0 || utp->sockfd < 0 || bind(utp->sockfd, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+        getsockname(utp->sockfd, (struct sockaddr*) &address, &address_length) < 0) {
+        log_printf(log_code, LOG_ERR, "Couldn't open uTP socket on port %u: %s\n", port, strerror(errno));
+        utp_free(utp);
+        return nullptr;
+    }
+    utp->port = ntohs(address.sin_port);
+    // Unreachable ports are reported through the error queue, so peers without uTP fall back to TCP right away
+    const int32_t enable = 1;
+    setsockopt(utp->sockfd, IPPROTO_IP, IP_RECVERR, &enable, sizeof(enable));
+
+    utp->slot = loop_add_source(loop, utp->sockfd, EPOLLIN, on_readable, utp);
+    utp->wake_slot = loop_add_source(loop, utp->wake_fd, EPOLLIN, on_wake, utp);
+    utp->tick_timer = wheel_timer_new(timers, on_tick, utp, 0);
+    if (utp->slot < 0 || utp->wake_slot < 0 || utp->tick_timer == TIMER_NONE) {
+        utp_free(utp);
+        return nullptr;
+    }
+    log_printf(log_code, LOG_SUMM, "uTP listening on UDP port %u\n", utp->port);
+    return utp;
+}
+
+void utp_free(utp_context_t* utp) {
+    if (utp == nullptr) return;
+    while (utp->connection_amount > 0) destroy_connection(utp->connections[utp->connection_amount - 1], true);
+    for (uint32_t i = 0; i < utp->pending_amount; ++i) close(utp->pending[i].fd);
+    wheel_timer_delete(utp->timers, utp->tick_timer);
+    loop_remove_source(utp->loop, utp->slot);
+    loop_remove_source(utp->loop, utp->wake_slot);
+    if (utp->sockfd >= 0) close(utp->sockfd);
+    if (utp->wake_fd >= 0) close(utp->wake_fd);
+    pthread_mutex_destroy(&utp->pending_mutex);
+    free(utp->pending);
+    free(utp->connections);
+    free(utp);
+}
+
+int32_t utp_connect(utp_context_t* utp, const struct sockaddr_in* address) {
+    if (!utp || !address || address->sin_family != AF_INET) return -1;
+    int32_t pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0) return -1;
+    pthread_mutex_lock(&utp->pending_mutex);
+    bool queued = true;
+    if (utp->pending_amount == utp->pending_capacity) {
+        const uint32_t capacity = utp->pending_capacity > 0 ? utp->pending_capacity * 2 : 16;
+        utp_pending_t* pending = realloc(utp->pending, sizeof(utp_pending_t) * capacity);
+        if (pending) {
+            utp->pending = pending;
+            utp->pending_capacity = capacity;
+        } else queued = false;
+    }
+    if (queued) utp->pending[utp->pending_amount++] = (utp_pending_t) {pair[1], *address};
+    pthread_mutex_unlock(&utp->pending_mutex);
+    if (!queued) {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    const uint64_t one = 1;
+    if (write(utp->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_printf(utp->log_code, LOG_ERR, "Couldn't wake the uTP context up\n");
+    }
+    return pair[0];
+}
@@ -0,0 +1,244 @@
+#ifndef BITTORRENT_CLIENT_UTP_H
+#define BITTORRENT_CLIENT_UTP_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "util.h"
+
+/// @brief Version of the uTP protocol (BEP 29), in the lower nibble of the first byte of every packet
+#define UTP_VERSION 1
+/// @brief Bytes of the fixed header every packet starts with
+#define UTP_HEADER_SIZE 20
+/// @brief Extension id of selective acks
+#define UTP_EXTENSION_SACK 1
+/// @brief Most bytes of the selective ack bitmask sent, each bit acking one packet past ack_nr + 1
+#define UTP_SACK_MAX 8
+/// @brief Largest datagram sent, small enough to go unfragmented over most paths
+#define UTP_PACKET_MAX 1400
+/// @brief Payload of a full DATA packet
+#define UTP_PAYLOAD_MAX (UTP_PACKET_MAX - UTP_HEADER_SIZE)
+/// @brief Packets each direction of a connection can have in flight or waiting to be delivered. Must be a power of two
+#define UTP_WINDOW_PACKETS 512
+/// @brief Queuing delay LEDBAT aims for, in microseconds. Above it the window shrinks, below it grows
+#define UTP_TARGET_DELAY_US 100000
+/// @brief How much of a full window LEDBAT adds per round trip when there's no queuing delay at all
+#define UTP_GAIN 1
+/// @brief Smallest congestion window, in bytes. Timeouts bring the window back to it
+#define UTP_MIN_WINDOW (2 * UTP_PAYLOAD_MAX)
+/// @brief Largest congestion window, in bytes, no more than the sender can keep in flight
+#define UTP_MAX_WINDOW (UTP_WINDOW_PACKETS * UTP_PAYLOAD_MAX)
+/// @brief Minutes of one-way delay measurements the base delay is the minimum of. Older ones are forgotten,
+/// so route changes are picked up
+#define UTP_DELAY_HISTORY 10
+/// @brief Milliseconds each base delay measurement covers
+#define UTP_DELAY_BUCKET_MS 60000
+/// @brief Retransmission timeout before any round trip is measured, in milliseconds
+#define UTP_INITIAL_RTO_MS 1000
+/// @brief Smallest retransmission timeout, in milliseconds
+#define UTP_MIN_RTO_MS 500
+/// @brief Largest retransmission timeout once backed off, in milliseconds
+#define UTP_MAX_RTO_MS 16000
+/// @brief Times a SYN is sent before the connection attempt fails, so TCP is tried instead soon enough
+#define UTP_SYN_TRANSMISSIONS 3
+/// @brief Times any other packet is sent before the connection is given up on
+#define UTP_MAX_TRANSMISSIONS 8
+/// @brief Packets acked past an unacked one before it's taken as lost and sent again
+#define UTP_DUPLICATE_ACKS 3
+/// @brief Milliseconds between checks of retransmission timeouts
+#define UTP_TICK_MS TIMER_TICK_MS
+/// @brief Datagrams read from the socket at once, and most packets read from or delivered to a connection at once
+#define UTP_BATCH_SIZE 32
+
+/// @brief Types of packet, in the upper nibble of the first byte
+typedef enum {
+    UTP_DATA, /**< Carries payload */
+    UTP_FIN, /**< Last packet of the sender */
+    UTP_STATE, /**< Carries no payload, only acks */
+    UTP_RESET, /**< Closes the connection at once */
+    UTP_SYN, /**< Opens a connection */
+    UTP_TYPE_COUNT
+} UTP_TYPE;
+
+/// @brief The fixed header of a packet, in host endianness, and its selective ack if it has one
+typedef struct {
+    uint8_t type; /**< UTP_TYPE */
+    uint16_t connection_id; /**< Receive id of the connection, at the receiving end. A SYN carries the sender's one */
+    uint32_t timestamp_us; /**< Sender's clock when the packet was sent, lower 32 bits in microseconds */
+    uint32_t timestamp_difference_us; /**< Sender's clock minus timestamp_us of the last packet it received */
+    uint32_t window; /**< Bytes the sender can still take in */
+    uint16_t seq_nr; /**< Sequence number of the packet. STATE packets carry the next one without using it up */
+    uint16_t ack_nr; /**< Last sequence number received in order */
+    const unsigned char* sack; /**< Selective ack bitmask, bit i of byte j acking ack_nr + 2 + 8j + i, or nullptr */
+    uint8_t sack_length; /**< Bytes of sack, a multiple of 4 */
+} utp_header_t;
+
+/// @brief States of a connection
+typedef enum {
+    UTP_SYN_SENT, /**< Waiting for the STATE answering our SYN */
+    UTP_CONNECTED, /**< Moving data both ways */
+    UTP_FIN_SENT, /**< Our side was closed, waiting for the FIN to be acked */
+} UTP_CONNECTION_STATE;
+
+struct utp_context_t;
+
+/**
+ * A uTP connection. Its bytes go to and come from the engine end of a socket pair, whose other end is what
+ * the peer layer sees, so it reads and writes it as it would a TCP socket
+ */
+typedef struct {
+    struct utp_context_t* utp; /**< Context the connection belongs to */
+    struct sockaddr_in address; /**< Remote address */
+    int32_t fd; /**< Engine end of the socket pair */
+    int32_t slot; /**< Source slot of fd in the context's loop */
+    UTP_CONNECTION_STATE state; /**< Where the connection is at */
+    uint16_t recv_id; /**< Connection id of packets sent to us */
+    uint16_t send_id; /**< Connection id of packets we send */
+    uint16_t seq_nr; /**< Sequence number of the next packet sent */
+    uint16_t oldest_nr; /**< Oldest packet sent and not acked yet, seq_nr if there's none */
+    uint16_t resend_nr; /**< Next packet to send again after a timeout, seq_nr if there's none */
+    uint16_t ack_nr; /**< Last packet received in order */
+    uint16_t deliver_nr; /**< Next packet received whose payload is written to fd */
+    uint32_t deliver_offset; /**< Bytes of the payload of deliver_nr already written to fd */
+    uint16_t fin_nr; /**< Sequence number of the remote FIN, valid once fin_received is set */
+    bool fin_received; /**< Whether the remote side closed */
+    bool ack_pending; /**< Whether something arrived that wasn't acked yet */
+    unsigned char (*send_payloads)[UTP_PAYLOAD_MAX]; /**< Payload of packets in flight, by seq_nr modulo the window */
+    uint16_t send_lengths[UTP_WINDOW_PACKETS]; /**< Bytes of each payload in send_payloads */
+    uint8_t send_types[UTP_WINDOW_PACKETS]; /**< UTP_TYPE of each packet in flight */
+    bool send_acked[UTP_WINDOW_PACKETS]; /**< Packets between oldest_nr and seq_nr already acked selectively */
+    bool send_in_flight[UTP_WINDOW_PACKETS]; /**< Packets counted in flight, not acked nor taken as lost */
+    uint8_t transmissions[UTP_WINDOW_PACKETS]; /**< Times each packet in flight was sent */
+    uint32_t send_times_us[UTP_WINDOW_PACKETS]; /**< When each packet in flight was last sent, from monotonic_us() */
+    unsigned char (*recv_payloads)[UTP_PAYLOAD_MAX]; /**< Payload of packets received and not delivered yet */
+    uint16_t recv_lengths[UTP_WINDOW_PACKETS]; /**< Bytes of each payload in recv_payloads */
+    bool recv_present[UTP_WINDOW_PACKETS]; /**< Packets received past ack_nr, and up to it those not delivered */
+    uint32_t flight; /**< Payload bytes sent and not acked */
+    uint32_t cwnd; /**< Congestion window, in bytes */
+    uint32_t ssthresh; /**< The window grows exponentially up to this, and by LEDBAT past it */
+    uint32_t peer_window; /**< Bytes the remote side can still take in, as last advertised */
+    uint32_t window_sent; /**< Receive window last advertised */
+    uint32_t base_delays[UTP_DELAY_HISTORY]; /**< Lowest one-way delay of our packets measured each minute */
+    uint8_t delay_bucket; /**< Entry of base_delays being filled */
+    uint64_t bucket_ms; /**< When delay_bucket started being filled */
+    uint32_t reply_micro; /**< One-way delay of the last packet received, echoed in timestamp_difference_us */
+    uint16_t loss_nr; /**< The window isn't cut again for losses of packets sent before this one */
+    uint32_t srtt_us; /**< Smoothed round trip time, 0 until measured */
+    uint32_t rttvar_us; /**< Round trip time variation */
+    uint32_t rto_ms; /**< Retransmission timeout */
+    uint64_t rto_deadline_ms; /**< When the oldest packet in flight is taken as lost, from the timer wheel's clock */
+} utp_connection_t;
+
+/// @brief A connection asked for from any thread, waiting for the context's loop to start it
+typedef struct {
+    int32_t fd; /**< Engine end of the socket pair */
+    struct sockaddr_in address; /**< Where to connect */
+} utp_pending_t;
+
+/**
+ * Called for each connection someone else opened to us, on the thread running the context's loop.
+ *
+ * @param ctx The context pointer given to utp_create().
+ * @param socket Our end of the connection, a non-blocking stream socket now owned by the callee.
+ * @param address Address of the remote side.
+ */
+typedef void (*utp_accept_callback_t)(void *ctx, int32_t socket, const struct sockaddr_in *address);
+
+/**
+ * Every uTP connection of a torrent, over a single non-blocking UDP socket registered in an event loop and
+ * driven by its timer wheel. Congestion is controlled by LEDBAT, which backs off as soon as our packets
+ * start queuing anywhere along the path, so transfers make way for latency-sensitive traffic sharing the link
+ */
+typedef struct utp_context_t {
+    event_loop_t *loop; /**< Loop the socket and connections are registered in */
+    timer_wheel_t *timers; /**< Timers of the loop, and the clock cached for each iteration */
+    int32_t sockfd; /**< UDP socket */
+    int32_t slot; /**< Source slot of sockfd in loop */
+    uint16_t port; /**< Port sockfd is bound to, in host endianness */
+    uint32_t tick_timer; /**< Checks retransmission timeouts every UTP_TICK_MS */
+    int32_t wake_fd; /**< Eventfd written when a connection is asked for from another thread */
+    int32_t wake_slot; /**< Source slot of wake_fd in loop */
+    pthread_mutex_t pending_mutex; /**< Protects pending */
+    utp_pending_t *pending; /**< Connections asked for and not started yet */
+    uint32_t pending_amount; /**< Connections in pending */
+    uint32_t pending_capacity; /**< Connections allocated in pending */
+    utp_connection_t **connections; /**< Every open connection */
+    uint32_t connection_amount; /**< Connections in connections */
+    uint32_t connection_capacity; /**< Connections allocated in connections */
+    utp_accept_callback_t on_accept; /**< Takes connections opened to us, nullptr to refuse them */
+    void *accept_ctx; /**< Passed as is to on_accept */
+    LOG_CODE log_code; /**< Logging level */
+} utp_context_t;
+
+/**
+ * Writes the header of a packet, followed by its selective ack if it has one.
+ *
+ * @param buffer Where the header is written. At least UTP_HEADER_SIZE + 2 + UTP_SACK_MAX bytes.
+ * @param header The header. Its sack, if any, must be at most UTP_SACK_MAX bytes.
+ * @return Bytes written.
+ */
+uint32_t utp_write_header(unsigned char *buffer, const utp_header_t *header);
+
+/**
+ * Reads the header of a packet and its extensions, keeping the selective ack and skipping the rest.
+ *
+ * @param packet The datagram.
+ * @param length Bytes in packet.
+ * @param header Where the header is stored. Its sack points into packet.
+ * @return Offset of the payload, or 0 if the packet is truncated, of another version or of an unknown type.
+ */
+uint32_t utp_read_header(const unsigned char *packet, uint32_t length, utp_header_t *header);
+
+/**
+ * Updates a congestion window as LEDBAT (RFC 6817) does for each ack: the further the queuing delay is
+ * below the target, the more the window grows, and it shrinks just as much when the delay is above it.
+ * In slow start it grows by whatever was acked instead.
+ *
+ * @param cwnd The congestion window, in bytes.
+ * @param bytes_acked Payload bytes the ack took out of flight.
+ * @param queuing_delay_us One-way delay of our packets minus the base delay.
+ * @param slow_start Whether the window is still below the slow start threshold.
+ * @return The new window, between UTP_MIN_WINDOW and UTP_MAX_WINDOW.
+ */
+uint32_t utp_ledbat_window(uint32_t cwnd, uint32_t bytes_acked, uint32_t queuing_delay_us, bool slow_start);
+
+/**
+ * Creates a uTP context listening on a UDP port.
+ *
+ * @param loop The event loop the socket is registered in.
+ * @param timers The timer wheel advanced by whoever runs loop.
+ * @param port UDP port to listen on, in host endianness, or 0 for any free one.
+ * @param on_accept Called with each connection opened to us, or nullptr to refuse them.
+ * @param ctx Passed to on_accept.
+ * @param log_code Controls the verbosity of logging output. Can be LOG_NO (no logging),
+ *                 LOG_ERR (error logging), LOG_SUMM (summary logging), or
+ *                 LOG_FULL (detailed logging).
+ * @return A pointer to the context, or nullptr if the socket couldn't be created or bound.
+ */
+utp_context_t *utp_create(event_loop_t *loop, timer_wheel_t *timers, uint16_t port, utp_accept_callback_t on_accept,
+                          void *ctx, LOG_CODE log_code);
+
+/**
+ * Resets every connection, closing our end of them, closes the socket and frees the context.
+ * Sockets returned by utp_connect() or given to on_accept are left to their owners, which see them closed.
+ *
+ * @param utp The context to free. If nullptr, nothing is done.
+ */
+void utp_free(utp_context_t *utp);
+
+/**
+ * Starts connecting to a peer. Safe to call from any thread: the connection starts on the next iteration
+ * of the context's loop.
+ *
+ * @param utp The context.
+ * @param address Address of the peer.
+ * @return A non-blocking stream socket that carries the connection once it's established, whatever is written
+ *         to it before being sent then. It's closed by the other end if the connection fails or ends.
+ *         -1 if it couldn't be created.
+ */
+int32_t utp_connect(utp_context_t *utp, const struct sockaddr_in *address);
+
+#endif //BITTORRENT_CLIENT_UTP_H
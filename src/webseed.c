@@ -0,0 +1,217 @@
+#include "webseed.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+uint32_t webseed_ranges(const info_t* info, const uint64_t offset, const uint64_t length, webseed_range_t* ranges,
+                        const uint32_t max) {
+    if (!info || length == 0 || offset + length > (uint64_t) info->length) return 0;
+    uint32_t amount = 0;
+    for (const files_ll* file = info->files; file; file = file->next) {
+        const uint64_t start = file->byte_index;
+        const uint64_t end = start + file->length;
+        // Files before the range, after it, or empty, which have nothing to download, and padding, which is zeros
+        if (file->length == 0 || file->padding || end <= offset || start >= offset + length) continue;
+        const uint64_t first = offset > start ? offset : start;
+        const uint64_t last = offset + length < end ? offset + length : end;
+        if (ranges && amount < max) {
+            ranges[amount].file = file;
+            ranges[amount].offset = first - start;
+            ranges[amount].length = last - first;
+        }
+        amount++;
+    }
+    return amount;
+}
+
+char* webseed_file_url(const char* url, const info_t* info, const files_ll* file) {
+    if (!url || !info || !file || !info->name) return nullptr;
+    const uint64_t url_length = strlen(url);
+    const bool slash = url_length > 0 && url[url_length - 1] == '/';
+    // Single file torrents have no path of their own, only the name
+    const bool multiple = info->files && info->files->next;
+    if (!multiple && !slash) return strdup(url);
+
+    // Escaping makes each character at most three
+    uint64_t capacity = url_length + 2 + 3 * strlen(info->name);
+    if (multiple) {
+        for (const ll* component = file->path; component; component = component->next) {
+            capacity += 1 + 3 * strlen(component->val);
+        }
+    }
+    char* result = malloc(capacity + 1);
+    if (!result) return nullptr;
+    uint64_t written = 0;
+    memcpy(result, url, url_length);
+    written += url_length;
+    if (!slash) result[written++] = '/';
+    char* name = curl_easy_escape(nullptr, info->name, 0);
+    if (!name) {
+        free(result);
+        return nullptr;
+    }
+    written += sprintf(result + written, "%s", name);
+    curl_free(name);
+    for (const ll* component = multiple ? file->path : nullptr; component; component = component->next) {
+        char* escaped = curl_easy_escape(nullptr, component->val, 0);
+        if (!escaped) {
+            free(result);
+            return nullptr;
+        }
+        written += sprintf(result + written, "/%s", escaped);
+        curl_free(escaped);
+    }
+    return result;
+}
+
+webseed_t* webseed_create(http_client_t* client, const char* url, const info_t* info, const webseed_callback_t on_piece,
+                          void* ctx, const LOG_CODE log_code) {
+    if (!client || !url || !info || !on_piece) return nullptr;
+    webseed_t* seed = calloc(1, sizeof(webseed_t));
+    if (!seed) return nullptr;
+    seed->url = strdup(url);
+    if (!seed->url) {
+        free(seed);
+        return nullptr;
+    }
+    seed->client = client;
+    seed->info = info;
+    seed->on_piece = on_piece;
+    seed->ctx = ctx;
+    seed->log_code = log_code;
+    for (uint32_t i = 0; i < WEBSEED_MAX_PIECES; ++i) seed->pieces[i].seed = seed;
+    return seed;
+}
+
+bool webseed_ready(const webseed_t* seed, const uint64_t now_ms) {
+    return seed && !seed->disabled && seed->active < WEBSEED_MAX_PIECES && now_ms >= seed->retry_ms;
+}
+
+/**
+ * Frees a piece's buffers and requests still in flight, leaving its slot free
+ */
+static void release_piece(webseed_piece_t* piece) {
+    for (uint32_t i = 0; i < piece->part_amount; ++i) http_client_cancel(piece->parts[i].request);
+    free(piece->parts);
+    free(piece->data);
+    piece->parts = nullptr;
+    piece->data = nullptr;
+    piece->part_amount = 0;
+    piece->used = false;
+    piece->seed->active--;
+}
+
+/**
+ * Counts a piece that failed or succeeded, so failing web seeds rest longer each time and are eventually given up on
+ */
+static void count_result(webseed_t* seed, const bool failed) {
+    if (!failed) {
+        seed->failures = 0;
+        return;
+    }
+    seed->failures++;
+    seed->retry_ms = monotonic_coarse_ms() + ((uint64_t) WEBSEED_RETRY_MS << (seed->failures - 1));
+    if (seed->failures >= WEBSEED_MAX_FAILURES) {
+        seed->disabled = true;
+        log_printf(seed->log_code, LOG_ERR, "Web seed %s failed %u times in a row, giving up on it\n", seed->url,
+                   seed->failures);
+    }
+}
+
+static void on_range(void* ctx, const long status, const char* body, const uint64_t length) {
+    (void) body;
+    webseed_part_t* part = ctx;
+    webseed_piece_t* piece = part->piece;
+    webseed_t* seed = piece->seed;
+    // Freed by the client once this returns
+    part->request = nullptr;
+    // The body was written in place. A server ignoring the range sent more and was cut short
+    if (status == 0 || status >= 400 || length != part->length) {
+        if (!piece->failed) {
+            log_printf(seed->log_code, LOG_ERR, "Web seed %s failed piece %u: status %ld, %lu of %lu bytes\n",
+                       seed->url, piece->index, status, (unsigned long) length, (unsigned long) part->length);
+        }
+        piece->failed = true;
+    }
+    if (--piece->parts_left > 0) return;
+
+    // The slot is freed first, so the callback can ask for another piece right away
+    const bool failed = piece->failed;
+    const uint32_t index = piece->index;
+    const uint32_t piece_length = piece->length;
+    unsigned char* data = piece->data;
+    piece->data = nullptr;
+    release_piece(piece);
+    count_result(seed, failed);
+    seed->on_piece(seed->ctx, seed, index, failed ? nullptr : data, piece_length);
+    free(data);
+}
+
+bool webseed_fetch(webseed_t* seed, const uint32_t piece_index) {
+    if (!seed || seed->disabled || piece_index >= seed->info->piece_number) return false;
+    webseed_piece_t* piece = nullptr;
+    for (uint32_t i = 0; i < WEBSEED_MAX_PIECES && !piece; ++i) {
+        if (!seed->pieces[i].used) piece = &seed->pieces[i];
+    }
+    if (!piece) return false;
+
+    const info_t* info = seed->info;
+    const uint64_t offset = (uint64_t) piece_index * info->piece_length;
+    const uint64_t length = piece_size(info, piece_index);
+    const uint32_t part_amount = webseed_ranges(info, offset, length, nullptr, 0);
+    webseed_range_t* ranges = malloc(sizeof(webseed_range_t) * part_amount);
+    piece->parts = calloc(part_amount, sizeof(webseed_part_t));
+    // Zeroed, as padding in the piece isn't downloaded
+    piece->data = calloc(length, 1);
+    if (part_amount == 0 || !ranges || !piece->parts || !piece->data) {
+        free(ranges);
+        free(piece->parts);
+        free(piece->data);
+        piece->parts = nullptr;
+        piece->data = nullptr;
+        return false;
+    }
+    webseed_ranges(info, offset, length, ranges, part_amount);
+    piece->used = true;
+    piece->index = piece_index;
+    piece->length = length;
+    piece->part_amount = part_amount;
+    piece->parts_left = part_amount;
+    piece->failed = false;
+    seed->active++;
+
+    bool started = true;
+    for (uint32_t i = 0; i < part_amount && started; ++i) {
+        webseed_part_t* part = &piece->parts[i];
+        part->piece = piece;
+        part->length = ranges[i].length;
+        // Padding between ranges is left out, so each lands where it is in the piece
+        const uint64_t position = ranges[i].file->byte_index + ranges[i].offset - offset;
+        char* url = webseed_file_url(seed->url, info, ranges[i].file);
+        part->request = url ? http_client_get_range(seed->client, url, ranges[i].offset, ranges[i].length,
+                                                    (char*) piece->data + position, on_range, part) : nullptr;
+        started = part->request != nullptr;
+        free(url);
+    }
+    free(ranges);
+    // Nothing ran yet, so no callback came
+    if (!started) {
+        release_piece(piece);
+        return false;
+    }
+    log_printf(seed->log_code, LOG_FULL, "Asked web seed %s for piece %u in %u ranges\n", seed->url, piece_index,
+               part_amount);
+    return true;
+}
+
+void webseed_free(webseed_t* seed) {
+    if (seed == nullptr) return;
+    for (uint32_t i = 0; i < WEBSEED_MAX_PIECES; ++i) {
+        if (seed->pieces[i].used) release_piece(&seed->pieces[i]);
+    }
+    free(seed->url);
+    free(seed);
+}
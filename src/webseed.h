@@ -0,0 +1,141 @@
+#ifndef BITTORRENT_CLIENT_WEBSEED_H
+#define BITTORRENT_CLIENT_WEBSEED_H
+
+#include <stdint.h>
+
+#include "file.h"
+#include "http_client.h"
+#include "util.h"
+
+/// @brief Pieces each web seed downloads at once
+#define WEBSEED_MAX_PIECES 4
+/// @brief Milliseconds a web seed rests after a failed piece, doubled for each failure in a row
+#define WEBSEED_RETRY_MS 5000
+/// @brief Failures in a row after which a web seed is given up on
+#define WEBSEED_MAX_FAILURES 5
+/// @brief Milliseconds between checks for pieces web seeds could download, besides those done whenever one arrives
+#define WEBSEED_TICK_MS 1000
+
+/// @brief A byte range of one of the files of a torrent
+typedef struct {
+    const files_ll *file; /**< The file */
+    uint64_t offset; /**< First byte of the range in the file */
+    uint64_t length; /**< Bytes of the range */
+} webseed_range_t;
+
+struct webseed_t;
+
+/**
+ * Called once a piece a web seed was asked for arrives, or fails to.
+ *
+ * @param ctx The context pointer given to webseed_create().
+ * @param seed The web seed.
+ * @param piece Index of the piece.
+ * @param data The piece's bytes, not verified. Only valid during the call. nullptr if any range of it failed.
+ * @param length Bytes of the piece.
+ */
+typedef void (*webseed_callback_t)(void *ctx, struct webseed_t *seed, uint32_t piece, const unsigned char *data,
+                                   uint32_t length);
+
+/// @brief A range request of a piece, the context its HTTP callback gets
+typedef struct {
+    struct webseed_piece_t *piece; /**< Piece it belongs to */
+    http_request_t *request; /**< The request, nullptr once it's over */
+    uint64_t length; /**< Bytes asked for */
+} webseed_part_t;
+
+/// @brief A piece being downloaded from a web seed, one range request per file it spans
+typedef struct webseed_piece_t {
+    struct webseed_t *seed; /**< Web seed it's downloaded from */
+    bool used; /**< Whether the slot is used */
+    uint32_t index; /**< Index of the piece */
+    unsigned char *data; /**< Where every range is written in place */
+    uint32_t length; /**< Bytes of the piece */
+    webseed_part_t *parts; /**< Range requests, one per file */
+    uint32_t part_amount; /**< Entries in parts */
+    uint32_t parts_left; /**< Requests not over yet */
+    bool failed; /**< Whether any request failed */
+} webseed_piece_t;
+
+/**
+ * A web seed (BEP 19): an HTTP or FTP server holding the torrent's files, with the same layout. Pieces are
+ * downloaded with byte range requests of each file they span, running concurrently through an http_client_t.
+ */
+typedef struct webseed_t {
+    http_client_t *client; /**< Runs the requests */
+    char *url; /**< Base URL, as given in url-list */
+    const info_t *info; /**< Info of the torrent */
+    webseed_piece_t pieces[WEBSEED_MAX_PIECES]; /**< Pieces being downloaded */
+    uint32_t active; /**< Slots of pieces used */
+    uint32_t failures; /**< Pieces in a row that failed */
+    uint64_t retry_ms; /**< Monotonic time before which no piece is asked for, after a failure */
+    bool disabled; /**< Set once it failed too often or sent corrupt data, so it's never asked again */
+    webseed_callback_t on_piece; /**< Called as each piece arrives or fails */
+    void *ctx; /**< Passed as is to on_piece */
+    LOG_CODE log_code; /**< Logging level */
+} webseed_t;
+
+/**
+ * Splits a byte range of a torrent into the ranges of each file it spans. Empty files and padding are skipped.
+ *
+ * @param info Info of the torrent.
+ * @param offset First byte of the range in the torrent.
+ * @param length Bytes of the range.
+ * @param ranges Where the ranges are stored, nullptr to only count them.
+ * @param max Ranges ranges has room for.
+ * @return Ranges the byte range spans, which may be more than max. 0 if it goes past the torrent's end.
+ */
+uint32_t webseed_ranges(const info_t *info, uint64_t offset, uint64_t length, webseed_range_t *ranges, uint32_t max);
+
+/**
+ * Builds the URL of one of the files of a torrent on a web seed. Single file torrents are at url itself, or at
+ * url followed by their name if url ends with a slash. Files of multi-file torrents are at url, name and their path,
+ * each component escaped.
+ *
+ * @param url Base URL of the web seed.
+ * @param info Info of the torrent.
+ * @param file One of info's files.
+ * @return The URL, freed by the caller, or nullptr if it couldn't be allocated.
+ */
+char *webseed_file_url(const char *url, const info_t *info, const files_ll *file);
+
+/**
+ * Creates a web seed. Nothing is requested until webseed_fetch().
+ *
+ * @param client Runs the requests. Must outlive the web seed.
+ * @param url Base URL of the web seed, copied.
+ * @param info Info of the torrent. Must outlive the web seed.
+ * @param on_piece Called as each piece arrives or fails.
+ * @param ctx Passed as is to on_piece.
+ * @param log_code Logging level.
+ * @return The web seed, or nullptr on failure.
+ */
+webseed_t *webseed_create(http_client_t *client, const char *url, const info_t *info, webseed_callback_t on_piece,
+                          void *ctx, LOG_CODE log_code);
+
+/**
+ * Whether a web seed may be asked for another piece: it isn't disabled, resting after a failure, or full.
+ *
+ * @param seed The web seed.
+ * @param now_ms Monotonic time in milliseconds.
+ * @return true if webseed_fetch() may be called.
+ */
+bool webseed_ready(const webseed_t *seed, uint64_t now_ms);
+
+/**
+ * Starts downloading a piece, whose callback comes once every range of it is over.
+ *
+ * @param seed The web seed.
+ * @param piece Index of the piece.
+ * @return false if there's no free slot, or the requests couldn't be started.
+ */
+bool webseed_fetch(webseed_t *seed, uint32_t piece);
+
+/**
+ * Aborts the pieces in flight, without calling their callback, and frees the web seed.
+ *
+ * @param seed The web seed, may be nullptr.
+ */
+void webseed_free(webseed_t *seed);
+
+#endif //BITTORRENT_CLIENT_WEBSEED_H
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "unity.h"
+#include "../src/announcer.h"
+
+/// @brief Local UDP tracker answering connect and announce requests with fixed peers
+typedef struct {
+    int32_t sockfd;
+    uint16_t port;
+    unsigned char peers[12];
+    uint32_t peer_amount;
+    uint32_t connects;
+    uint32_t announces;
+    uint32_t last_event;
+} fake_tracker_t;
+
+typedef struct {
+    uint32_t calls;
+    uint32_t peers;
+    unsigned char last_peers[12];
+} peers_received_t;
+
+static void fake_tracker_readable(void* ctx, const uint32_t events) {
+    fake_tracker_t* tracker = ctx;
+    (void) events;
+    unsigned char buffer[MAX_RESPONSE_SIZE];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t received;
+    while ((received = recvfrom(tracker->sockfd, buffer, sizeof(buffer), 0, (struct sockaddr*) &from, &from_len)) > 0) {
+        unsigned char response[20 + sizeof(tracker->peers)];
+        if (received == 16) {
+            tracker->connects++;
+            const uint32_t action = htobe32(ACTION_CONNECT);
+            const uint64_t connection_id = htobe64(0x1122334455667788ULL);
+            memcpy(response, &action, 4);
+            memcpy(response+4, buffer+12, 4);
+            memcpy(response+8, &connection_id, 8);
+            sendto(tracker->sockfd, response, 16, 0, (struct sockaddr*) &from, from_len);
+        } else if (received == ANNOUNCE_REQUEST_SIZE) {
+            tracker->announces++;
+            uint32_t event;
+            memcpy(&event, buffer+80, 4);
+            tracker->last_event = be32toh(event);
+            const uint32_t action = htobe32(ACTION_ANNOUNCE);
+            const uint32_t interval = htobe32(120);
+            const uint32_t zero = 0;
+            memcpy(response, &action, 4);
+            memcpy(response+4, buffer+12, 4);
+            memcpy(response+8, &interval, 4);
+            memcpy(response+12, &zero, 4);
+            memcpy(response+16, &zero, 4);
+            memcpy(response+20, tracker->peers, tracker->peer_amount*COMPACT_PEER_V4_SIZE);
+            sendto(tracker->sockfd, response, 20 + tracker->peer_amount*COMPACT_PEER_V4_SIZE, 0,
+                   (struct sockaddr*) &from, from_len);
+        }
+        from_len = sizeof(from);
+    }
+}
+
+static void open_fake_tracker(fake_tracker_t* tracker) {
+    memset(tracker, 0, sizeof(fake_tracker_t));
+    tracker->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(tracker->sockfd, (struct sockaddr*) &addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(tracker->sockfd, (struct sockaddr*) &addr, &len);
+    tracker->port = ntohs(addr.sin_port);
+}
+
+static void on_peers(void* ctx, const unsigned char* compact_peers, const uint32_t peer_amount, const int32_t family) {
+    peers_received_t* received = ctx;
+    TEST_ASSERT_EQUAL_INT32(AF_INET, family);
+    received->calls++;
+    received->peers += peer_amount;
+    memcpy(received->last_peers, compact_peers, peer_amount*COMPACT_PEER_V4_SIZE);
+}
+
+static ll* url_node(const uint16_t port) {
+    ll* node = malloc(sizeof(ll));
+    node->next = nullptr;
+    node->val = malloc(48);
+    snprintf(node->val, 48, "udp://127.0.0.1:%u/announce", port);
+    return node;
+}
+
+/**
+ * Builds a metainfo whose announce-list has one tier per port, in order
+ */
+static metainfo_t* make_metainfo(const uint16_t ports[], const uint32_t tier_amount) {
+    metainfo_t* metainfo = calloc(1, sizeof(metainfo_t));
+    metainfo->info = calloc(1, sizeof(info_t));
+    memset(metainfo->info->hash, 0xAB, 20);
+    announce_list_ll** next = &metainfo->announce_list;
+    for (uint32_t i = 0; i < tier_amount; ++i) {
+        *next = calloc(1, sizeof(announce_list_ll));
+        (*next)->list = url_node(ports[i]);
+        next = &(*next)->next;
+    }
+    return metainfo;
+}
+
+/**
+ * Runs the loop until on_peers has been called expected_calls times, or until the timeout in milliseconds
+ */
+static void run_loop(event_loop_t* loop, announcer_t* announcer, const peers_received_t* received,
+                     const uint32_t expected_calls, const int32_t timeout) {
+    struct epoll_event events[8];
+    int32_t waited = 0;
+    while (received->calls < expected_calls && waited < timeout) {
+        announcer_tick(announcer, time(nullptr));
+        const int32_t nfds = epoll_wait(loop->epoll, events, 8, 50);
+        for (int32_t i = 0; i < nfds; ++i) {
+            TEST_ASSERT_TRUE(loop_dispatch(loop, &events[i]));
+        }
+        waited += 50;
+    }
+}
+
+static const unsigned char peer_id[20] = "-IT0001-123456789012";
+
+void test_announcer_start_null(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    const torrent_stats_t stats = {0};
+    metainfo_t metainfo = {0};
+    TEST_ASSERT_NULL(announcer_start(nullptr, nullptr, nullptr, &metainfo, peer_id, &stats, on_peers, nullptr, LOG_NO));
+    TEST_ASSERT_NULL(announcer_start(client, nullptr, nullptr, nullptr, peer_id, &stats, on_peers, nullptr, LOG_NO));
+    TEST_ASSERT_NULL(announcer_start(client, nullptr, nullptr, &metainfo, peer_id, &stats, on_peers, nullptr, LOG_NO));
+    announcer_stop(nullptr);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_announcer_start_no_udp_tracker(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    const torrent_stats_t stats = {0};
+    info_t info = {0};
+    metainfo_t metainfo = {0};
+    metainfo.info = &info;
+    metainfo.announce = "http://tracker.example.com:80/announce";
+    // HTTP trackers are skipped without an HTTP client
+    TEST_ASSERT_NULL(announcer_start(client, nullptr, nullptr, &metainfo, peer_id, &stats, on_peers, nullptr, LOG_NO));
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_announcer_first_responder_wins(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    // Dead tier first: its socket is bound but never read, so it never answers
+    fake_tracker_t dead, live;
+    open_fake_tracker(&dead);
+    open_fake_tracker(&live);
+    const unsigned char peers[6] = {127, 0, 0, 1, 0x1A, 0xE1};
+    memcpy(live.peers, peers, 6);
+    live.peer_amount = 1;
+    TEST_ASSERT_TRUE(loop_add_source(loop, live.sockfd, EPOLLIN, fake_tracker_readable, &live) >= 0);
+
+    const uint16_t ports[] = {dead.port, live.port};
+    metainfo_t* metainfo = make_metainfo(ports, 2);
+    const torrent_stats_t stats = {.left = 100, .key = 1};
+    peers_received_t received = {0};
+    const time_t start = time(nullptr);
+    announcer_t* announcer = announcer_start(client, nullptr, nullptr, metainfo, peer_id, &stats, on_peers, &received, LOG_NO);
+    TEST_ASSERT_NOT_NULL(announcer);
+    TEST_ASSERT_EQUAL_UINT32(2, announcer->tracker_amount);
+
+    run_loop(loop, announcer, &received, 1, 3000);
+    // Peers arrive long before the dead tier's first 15 second timeout
+    TEST_ASSERT_EQUAL_UINT32(1, received.calls);
+    TEST_ASSERT_EQUAL_UINT32(1, received.peers);
+    TEST_ASSERT_EQUAL_MEMORY(peers, received.last_peers, 6);
+    TEST_ASSERT_TRUE(time(nullptr) - start < TRACKER_BASE_TIMEOUT);
+    TEST_ASSERT_EQUAL_INT32(ANNOUNCE_EVENT_STARTED, live.last_event);
+
+    TEST_ASSERT_EQUAL_INT32(TRACKER_CONNECTING, announcer->trackers[0].status);
+    TEST_ASSERT_EQUAL_UINT32(0, announcer->trackers[0].tier);
+    TEST_ASSERT_EQUAL_INT32(TRACKER_WAITING, announcer->trackers[1].status);
+    TEST_ASSERT_EQUAL_UINT32(1, announcer->trackers[1].tier);
+    TEST_ASSERT_EQUAL_UINT32(120, announcer->trackers[1].interval);
+    TEST_ASSERT_EQUAL_UINT32(1, announcer->responses);
+
+    announcer_stop(announcer);
+    // Stopped event goes to the tracker that was announced to
+    fake_tracker_readable(&live, EPOLLIN);
+    TEST_ASSERT_EQUAL_INT32(ANNOUNCE_EVENT_STOPPED, live.last_event);
+    close(dead.sockfd);
+    close(live.sockfd);
+    free_metainfo(metainfo);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_announcer_merges_tiers(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    fake_tracker_t first, second;
+    open_fake_tracker(&first);
+    open_fake_tracker(&second);
+    const unsigned char peers[12] = {10, 0, 0, 1, 0x1A, 0xE1, 10, 0, 0, 2, 0x1A, 0xE1};
+    memcpy(first.peers, peers, 6);
+    first.peer_amount = 1;
+    memcpy(second.peers, peers, 12);
+    second.peer_amount = 2;
+    loop_add_source(loop, first.sockfd, EPOLLIN, fake_tracker_readable, &first);
+    loop_add_source(loop, second.sockfd, EPOLLIN, fake_tracker_readable, &second);
+
+    const uint16_t ports[] = {first.port, second.port};
+    metainfo_t* metainfo = make_metainfo(ports, 2);
+    const torrent_stats_t stats = {0};
+    peers_received_t received = {0};
+    announcer_t* announcer = announcer_start(client, nullptr, nullptr, metainfo, peer_id, &stats, on_peers, &received, LOG_NO);
+    TEST_ASSERT_NOT_NULL(announcer);
+
+    run_loop(loop, announcer, &received, 2, 3000);
+    // Both tiers answered, and both were handed to the callback
+    TEST_ASSERT_EQUAL_UINT32(2, received.calls);
+    TEST_ASSERT_EQUAL_UINT32(3, received.peers);
+    TEST_ASSERT_EQUAL_UINT32(1, first.connects);
+    TEST_ASSERT_EQUAL_UINT32(1, second.connects);
+
+    announcer_stop(announcer);
+    close(first.sockfd);
+    close(second.sockfd);
+    free_metainfo(metainfo);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_announcer_tick_retransmits(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    fake_tracker_t dead;
+    open_fake_tracker(&dead);
+    const uint16_t ports[] = {dead.port};
+    metainfo_t* metainfo = make_metainfo(ports, 1);
+    const torrent_stats_t stats = {0};
+    announcer_t* announcer = announcer_start(client, nullptr, nullptr, metainfo, peer_id, &stats, on_peers, nullptr, LOG_NO);
+    TEST_ASSERT_NOT_NULL(announcer);
+    tracker_t* tracker = &announcer->trackers[0];
+    const time_t now = time(nullptr);
+
+    // Nothing to do before the deadline, which is 15 seconds away
+    const int32_t timeout = announcer_tick(announcer, now);
+    TEST_ASSERT_TRUE(timeout > 0 && timeout <= EPOLL_TIMEOUT);
+    TEST_ASSERT_EQUAL_UINT32(0, tracker->attempts);
+
+    // Each missed deadline doubles the timeout
+    announcer_tick(announcer, tracker->deadline);
+    TEST_ASSERT_EQUAL_UINT32(1, tracker->attempts);
+    TEST_ASSERT_EQUAL_INT32(TRACKER_CONNECTING, tracker->status);
+    const time_t second_try = tracker->deadline;
+    announcer_tick(announcer, second_try);
+    TEST_ASSERT_EQUAL_UINT32(2, tracker->attempts);
+    TEST_ASSERT_EQUAL_INT64((int64_t)(second_try + (TRACKER_BASE_TIMEOUT << 2)), (int64_t)tracker->deadline);
+
+    // Out of attempts
+    announcer_tick(announcer, tracker->deadline);
+    TEST_ASSERT_EQUAL_INT32(TRACKER_FAILED, tracker->status);
+    // And given another chance later
+    announcer_tick(announcer, tracker->deadline);
+    TEST_ASSERT_EQUAL_INT32(TRACKER_CONNECTING, tracker->status);
+    TEST_ASSERT_EQUAL_UINT32(0, tracker->attempts);
+
+    announcer_stop(announcer);
+    close(dead.sockfd);
+    free_metainfo(metainfo);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_announcer_tick_reannounces(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    fake_tracker_t live;
+    open_fake_tracker(&live);
+    live.peer_amount = 0;
+    loop_add_source(loop, live.sockfd, EPOLLIN, fake_tracker_readable, &live);
+    const uint16_t ports[] = {live.port};
+    metainfo_t* metainfo = make_metainfo(ports, 1);
+    const torrent_stats_t stats = {0};
+    peers_received_t received = {0};
+    announcer_t* announcer = announcer_start(client, nullptr, nullptr, metainfo, peer_id, &stats, on_peers, &received, LOG_NO);
+    TEST_ASSERT_NOT_NULL(announcer);
+    tracker_t* tracker = &announcer->trackers[0];
+
+    run_loop(loop, announcer, &received, 1, 1000);
+    TEST_ASSERT_EQUAL_INT32(TRACKER_WAITING, tracker->status);
+    TEST_ASSERT_EQUAL_UINT32(1, announcer->responses);
+    // No peers, so no callback
+    TEST_ASSERT_EQUAL_UINT32(0, received.calls);
+
+    // Once the interval passes, the tracker is announced to again, without the started event
+    announcer_tick(announcer, tracker->deadline);
+    TEST_ASSERT_EQUAL_INT32(TRACKER_CONNECTING, tracker->status);
+    struct epoll_event events[8];
+    for (int32_t i = 0; i < 20 && announcer->responses < 2; ++i) {
+        const int32_t nfds = epoll_wait(loop->epoll, events, 8, 50);
+        for (int32_t j = 0; j < nfds; ++j) loop_dispatch(loop, &events[j]);
+    }
+    TEST_ASSERT_EQUAL_UINT32(2, announcer->responses);
+    TEST_ASSERT_EQUAL_UINT32(2, live.announces);
+    TEST_ASSERT_EQUAL_INT32(ANNOUNCE_EVENT_NONE, live.last_event);
+
+    announcer_stop(announcer);
+    close(live.sockfd);
+    free_metainfo(metainfo);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_announcer_reuses_connection_id(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    fake_tracker_t live;
+    open_fake_tracker(&live);
+    const unsigned char peers[6] = {10, 0, 0, 1, 0x1A, 0xE1};
+    memcpy(live.peers, peers, 6);
+    live.peer_amount = 1;
+    loop_add_source(loop, live.sockfd, EPOLLIN, fake_tracker_readable, &live);
+    const uint16_t ports[] = {live.port};
+    metainfo_t* metainfo = make_metainfo(ports, 1);
+    const torrent_stats_t stats = {0};
+
+    peers_received_t first_received = {0};
+    announcer_t* first = announcer_start(client, nullptr, nullptr, metainfo, peer_id, &stats, on_peers, &first_received, LOG_NO);
+    run_loop(loop, first, &first_received, 1, 1000);
+    TEST_ASSERT_EQUAL_UINT32(1, first_received.calls);
+
+    // A second torrent on the same tracker goes straight to announcing
+    peers_received_t second_received = {0};
+    announcer_t* second = announcer_start(client, nullptr, nullptr, metainfo, peer_id, &stats, on_peers, &second_received, LOG_NO);
+    TEST_ASSERT_EQUAL_INT32(TRACKER_ANNOUNCING, second->trackers[0].status);
+    run_loop(loop, second, &second_received, 1, 1000);
+    TEST_ASSERT_EQUAL_UINT32(1, second_received.calls);
+    TEST_ASSERT_EQUAL_UINT32(1, live.connects);
+    TEST_ASSERT_EQUAL_UINT32(2, live.announces);
+    TEST_ASSERT_EQUAL_UINT64(1, client->stats.connection_hits);
+
+    announcer_stop(first);
+    announcer_stop(second);
+    close(live.sockfd);
+    free_metainfo(metainfo);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_announcer_resolves_hostname(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    resolver_t* resolver = resolver_create(loop, LOG_NO);
+    fake_tracker_t live;
+    open_fake_tracker(&live);
+    const unsigned char peers[6] = {10, 0, 0, 1, 0x1A, 0xE1};
+    memcpy(live.peers, peers, 6);
+    live.peer_amount = 1;
+    loop_add_source(loop, live.sockfd, EPOLLIN, fake_tracker_readable, &live);
+    const uint16_t ports[] = {live.port};
+    metainfo_t* metainfo = make_metainfo(ports, 1);
+    snprintf(metainfo->announce_list->list->val, 48, "udp://localhost:%u/announce", live.port);
+    const torrent_stats_t stats = {0};
+
+    peers_received_t received = {0};
+    announcer_t* announcer = announcer_start(client, nullptr, resolver, metainfo, peer_id, &stats, on_peers,
+                                             &received, LOG_NO);
+    TEST_ASSERT_NOT_NULL(announcer);
+    // Nothing is sent before the resolver answers
+    TEST_ASSERT_EQUAL_INT32(TRACKER_RESOLVING, announcer->trackers[0].status);
+    run_loop(loop, announcer, &received, 1, 5000);
+    TEST_ASSERT_EQUAL_UINT32(1, received.calls);
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.resolutions);
+
+    // The re-announce resolves again, from the cache
+    announcer->trackers[0].deadline = 0;
+    announcer_tick(announcer, time(nullptr));
+    TEST_ASSERT_EQUAL_INT32(TRACKER_RESOLVING, announcer->trackers[0].status);
+    run_loop(loop, announcer, &received, 2, 5000);
+    TEST_ASSERT_EQUAL_UINT32(2, received.calls);
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.cache_hits);
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.resolutions);
+
+    announcer_stop(announcer);
+    resolver_free(resolver);
+    close(live.sockfd);
+    free_metainfo(metainfo);
+    udp_client_free(client);
+    loop_free(loop);
+}
@@ -0,0 +1,13 @@
+#ifndef BITTORRENT_CLIENT_TEST_ANNOUNCER_H
+#define BITTORRENT_CLIENT_TEST_ANNOUNCER_H
+
+void test_announcer_start_null(void);
+void test_announcer_start_no_udp_tracker(void);
+void test_announcer_first_responder_wins(void);
+void test_announcer_merges_tiers(void);
+void test_announcer_tick_retransmits(void);
+void test_announcer_tick_reannounces(void);
+void test_announcer_reuses_connection_id(void);
+void test_announcer_resolves_hostname(void);
+
+#endif //BITTORRENT_CLIENT_TEST_ANNOUNCER_H
@@ -280,6 +280,39 @@ void test_free_bencode_list_multiple_elements(void) {
     TEST_PASS();
 }
 
+// ============================================================================
+// skip_bencode_value tests
+// ============================================================================
+
+void test_skip_bencode_value_int(void) {
+    const char *value = "i-42etail";
+    TEST_ASSERT_EQUAL_PTR(value + 5, skip_bencode_value(value, value + strlen(value)));
+}
+
+void test_skip_bencode_value_string(void) {
+    // Binary content, including what looks like bencode, is skipped over
+    const char *value = "5:d1:eeX";
+    TEST_ASSERT_EQUAL_PTR(value + 7, skip_bencode_value(value, value + strlen(value)));
+}
+
+void test_skip_bencode_value_nested(void) {
+    const char *value = "d4:listli1e3:abcd1:ki0eee3:key5:valueeX";
+    TEST_ASSERT_EQUAL_PTR(value + strlen(value) - 1, skip_bencode_value(value, value + strlen(value)));
+}
+
+void test_skip_bencode_value_truncated(void) {
+    const char *value = "d3:key10:short";
+    TEST_ASSERT_NULL(skip_bencode_value(value, value + strlen(value)));
+    TEST_ASSERT_NULL(skip_bencode_value("li1e", "li1e" + 4));
+}
+
+void test_skip_bencode_value_invalid(void) {
+    TEST_ASSERT_NULL(skip_bencode_value("x", "x" + 1));
+    TEST_ASSERT_NULL(skip_bencode_value("ie", "ie" + 2));
+    TEST_ASSERT_NULL(skip_bencode_value("e", "e" + 1));
+    TEST_ASSERT_NULL(skip_bencode_value(nullptr, nullptr));
+}
+
 // ============================================================================
 // Integration tests
 // ============================================================================
@@ -319,4 +352,44 @@ void test_integration_logging_modes(void) {
     free(s2);
     free(s3);
     free(s4);
-}
\ No newline at end of file
+}
+
+// ============================================================================
+// In place reading tests
+// ============================================================================
+
+void test_read_bencode_string(void) {
+    const char *value = "5:hello3:abc";
+    const char *string;
+    uint64_t length;
+    TEST_ASSERT_TRUE(read_bencode_string(value, value + strlen(value), &string, &length));
+    TEST_ASSERT_EQUAL_PTR(value + 2, string);
+    TEST_ASSERT_EQUAL_UINT64(5, length);
+    TEST_ASSERT_FALSE(read_bencode_string("i5e", "i5e" + 3, &string, &length));
+    TEST_ASSERT_FALSE(read_bencode_string("5:hel", "5:hel" + 5, &string, &length));
+}
+
+void test_read_bencode_int(void) {
+    int64_t number;
+    TEST_ASSERT_TRUE(read_bencode_int("i1800e", "i1800e" + 6, &number));
+    TEST_ASSERT_EQUAL_INT64(1800, number);
+    TEST_ASSERT_TRUE(read_bencode_int("i-7e", "i-7e" + 4, &number));
+    TEST_ASSERT_EQUAL_INT64(-7, number);
+    TEST_ASSERT_FALSE(read_bencode_int("i12", "i12" + 3, &number));
+    TEST_ASSERT_FALSE(read_bencode_int("3:abc", "3:abc" + 5, &number));
+}
+
+void test_find_bencode_key(void) {
+    const char *dict = "d5:innerd8:intervali1ee8:intervali900e5:peers0:e";
+    const char *limit = dict + strlen(dict);
+    // Keys of nested dictionaries don't count
+    const char *value = find_bencode_key(dict, limit, "interval");
+    TEST_ASSERT_NOT_NULL(value);
+    int64_t interval;
+    TEST_ASSERT_TRUE(read_bencode_int(value, limit, &interval));
+    TEST_ASSERT_EQUAL_INT64(900, interval);
+    TEST_ASSERT_NOT_NULL(find_bencode_key(dict, limit, "peers"));
+    TEST_ASSERT_NULL(find_bencode_key(dict, limit, "peers6"));
+    TEST_ASSERT_NULL(find_bencode_key("l1:ae", "l1:ae" + 5, "a"));
+    TEST_ASSERT_NULL(find_bencode_key("d3:key", "d3:key" + 6, "key"));
+}
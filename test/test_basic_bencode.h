@@ -42,6 +42,18 @@ void test_free_bencode_list_multiple_elements(void);
 void test_free_bencode_list_null(void);
 void test_free_bencode_list_single_element(void);
 
+// skip_bencode_value tests
+void test_skip_bencode_value_int(void);
+void test_skip_bencode_value_string(void);
+void test_skip_bencode_value_nested(void);
+void test_skip_bencode_value_truncated(void);
+void test_skip_bencode_value_invalid(void);
+
+// In place reading tests
+void test_read_bencode_string(void);
+void test_read_bencode_int(void);
+void test_find_bencode_key(void);
+
 // Integration tests
 void test_integration_logging_modes(void);
 void test_integration_parse_complex_list(void);
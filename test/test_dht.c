@@ -0,0 +1,231 @@
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+#include "../src/dht.h"
+
+/// @brief Nodes of the loopback stand-in for the DHT
+#define STAND_IN_NODES 6
+
+/// @brief What peers_callback() got
+typedef struct {
+    uint32_t calls;
+    uint32_t peer_amount;
+    unsigned char first_peer[COMPACT_PEER_V4_SIZE];
+} dht_peers_record_t;
+
+static void peers_callback(void* ctx, const unsigned char* compact_peers, const uint32_t peer_amount,
+                           const int32_t family) {
+    dht_peers_record_t* record = ctx;
+    TEST_ASSERT_EQUAL_INT32(AF_INET, family);
+    record->calls++;
+    record->peer_amount += peer_amount;
+    memcpy(record->first_peer, compact_peers, COMPACT_PEER_V4_SIZE);
+}
+
+/**
+ * Runs the loop and its timers until done is set, or for at most max_ms
+ */
+static void run_nodes(const event_loop_t* loop, timer_wheel_t* timers, const bool* done, const uint64_t max_ms) {
+    struct epoll_event events[16];
+    const uint64_t deadline = monotonic_coarse_ms() + max_ms;
+    while ((!done || !*done) && monotonic_coarse_ms() < deadline) {
+        const int32_t nfds = epoll_wait(loop->epoll, events, 16, timer_wheel_timeout(timers, 50));
+        timer_wheel_advance(timers, monotonic_coarse_ms());
+        for (int32_t i = 0; i < nfds; ++i) loop_dispatch(loop, &events[i]);
+    }
+}
+
+static struct sockaddr_in loopback_address(const uint16_t port) {
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    return address;
+}
+
+void test_dht_common_prefix(void) {
+    unsigned char a[20] = {0};
+    unsigned char b[20] = {0};
+    TEST_ASSERT_EQUAL_UINT32(160, dht_common_prefix(a, b));
+    b[0] = 0x80;
+    TEST_ASSERT_EQUAL_UINT32(0, dht_common_prefix(a, b));
+    b[0] = 0x01;
+    TEST_ASSERT_EQUAL_UINT32(7, dht_common_prefix(a, b));
+    b[0] = 0;
+    b[19] = 0x01;
+    TEST_ASSERT_EQUAL_UINT32(159, dht_common_prefix(a, b));
+}
+
+void test_dht_closest_orders_by_distance(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    dht_t* dht = dht_create(loop, timers, 0, nullptr, LOG_NO);
+    TEST_ASSERT_NOT_NULL(dht);
+    memset(dht->id, 0, 20);
+
+    const uint8_t first_bytes[] = {0x80, 0x40, 0x20, 0x10, 0x08};
+    for (uint32_t i = 0; i < sizeof(first_bytes); ++i) {
+        unsigned char id[20] = {first_bytes[i]};
+        TEST_ASSERT_TRUE(dht_insert(dht, id, htonl(0x7F000001), htons(6881 + i)));
+    }
+    // Our own id never goes into the table
+    TEST_ASSERT_FALSE(dht_insert(dht, dht->id, htonl(0x7F000001), htons(7000)));
+    TEST_ASSERT_EQUAL_UINT32(5, dht->node_amount);
+
+    const unsigned char target[20] = {0x41};
+    dht_node_t closest[3];
+    TEST_ASSERT_EQUAL_UINT32(3, dht_closest(dht, target, closest, 3));
+    TEST_ASSERT_EQUAL_HEX8(0x40, closest[0].id[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x08, closest[1].id[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x10, closest[2].id[0]);
+
+    dht_free(dht);
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
+
+void test_dht_full_bucket_keeps_good_nodes(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    dht_t* dht = dht_create(loop, timers, 0, nullptr, LOG_NO);
+    TEST_ASSERT_NOT_NULL(dht);
+    memset(dht->id, 0, 20);
+
+    // Every id with the first bit set goes into bucket 0
+    for (uint32_t i = 0; i < DHT_K; ++i) {
+        unsigned char id[20] = {0x80, (unsigned char) i};
+        TEST_ASSERT_TRUE(dht_insert(dht, id, htonl(0x7F000001), htons(6881 + i)));
+    }
+    const unsigned char newcomer[20] = {0xFF};
+    TEST_ASSERT_FALSE(dht_insert(dht, newcomer, htonl(0x7F000001), htons(7000)));
+    TEST_ASSERT_EQUAL_UINT8(DHT_K, dht->bucket_amount[0]);
+
+    // Until one of them stops answering
+    dht->nodes[0][3].fails = DHT_MAX_FAILS;
+    TEST_ASSERT_TRUE(dht_insert(dht, newcomer, htonl(0x7F000001), htons(7000)));
+    TEST_ASSERT_EQUAL_MEMORY(newcomer, dht->nodes[0][3].id, 20);
+    TEST_ASSERT_EQUAL_UINT32(DHT_K, dht->node_amount);
+
+    dht_free(dht);
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
+
+void test_dht_routing_table_persists(void) {
+    char path[] = "/tmp/dht_testXXXXXX";
+    const int32_t fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    dht_t* dht = dht_create(loop, timers, 0, path, LOG_NO);
+    TEST_ASSERT_NOT_NULL(dht);
+    unsigned char id[20];
+    memcpy(id, dht->id, 20);
+    for (uint32_t i = 0; i < 3; ++i) {
+        unsigned char node[20];
+        memcpy(node, id, 20);
+        node[0] ^= 0x80 >> i;
+        TEST_ASSERT_TRUE(dht_insert(dht, node, htonl(0x7F000001), htons(6881 + i)));
+    }
+    dht_free(dht);
+
+    dht = dht_create(loop, timers, 0, path, LOG_NO);
+    TEST_ASSERT_NOT_NULL(dht);
+    TEST_ASSERT_EQUAL_MEMORY(id, dht->id, 20);
+    TEST_ASSERT_EQUAL_UINT32(3, dht->node_amount);
+    TEST_ASSERT_EQUAL_UINT8(1, dht->bucket_amount[2]);
+    TEST_ASSERT_EQUAL_UINT16(htons(6883), dht->nodes[2][0].port);
+    dht_free(dht);
+    unlink(path);
+
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
+
+void test_dht_answers_ping(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    dht_t* dht = dht_create(loop, timers, 0, nullptr, LOG_NO);
+    TEST_ASSERT_NOT_NULL(dht);
+
+    const int32_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+    const struct sockaddr_in address = loopback_address(dht->port);
+    const char ping[] = "d1:ad2:id20:abcdefghij0123456789e1:q4:ping1:t2:aa1:y1:qe";
+    TEST_ASSERT_EQUAL_INT64(sizeof(ping) - 1, sendto(fd, ping, sizeof(ping) - 1, 0, (const struct sockaddr*) &address,
+                                                     sizeof(address)));
+    run_nodes(loop, timers, nullptr, 200);
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    TEST_ASSERT_EQUAL_INT32(1, poll(&pfd, 1, 1000));
+    char response[DHT_MESSAGE_MAX];
+    const ssize_t length = recv(fd, response, sizeof(response), 0);
+    char expected[64] = "d1:rd2:id20:";
+    memcpy(expected + 12, dht->id, 20);
+    memcpy(expected + 32, "e1:t2:aa1:y1:re", 16);
+    TEST_ASSERT_EQUAL_INT64(47, length);
+    TEST_ASSERT_EQUAL_MEMORY(expected, response, 47);
+    // Whoever queries us goes into the routing table
+    TEST_ASSERT_EQUAL_UINT32(1, dht->node_amount);
+
+    // Unknown methods get an error back
+    const char unknown[] = "d1:ad2:id20:abcdefghij0123456789e1:q4:vote1:t2:bb1:y1:qe";
+    sendto(fd, unknown, sizeof(unknown) - 1, 0, (const struct sockaddr*) &address, sizeof(address));
+    run_nodes(loop, timers, nullptr, 200);
+    TEST_ASSERT_EQUAL_INT32(1, poll(&pfd, 1, 1000));
+    const ssize_t error_length = recv(fd, response, sizeof(response), 0);
+    const char error[] = "d1:eli204e14:Method Unknowne1:t2:bb1:y1:ee";
+    TEST_ASSERT_EQUAL_INT64(sizeof(error) - 1, error_length);
+    TEST_ASSERT_EQUAL_MEMORY(error, response, sizeof(error) - 1);
+
+    close(fd);
+    dht_free(dht);
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
+
+void test_dht_loopback_lookup(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    dht_t* nodes[STAND_IN_NODES];
+    for (uint32_t i = 0; i < STAND_IN_NODES; ++i) {
+        nodes[i] = dht_create(loop, timers, 0, nullptr, LOG_NO);
+        TEST_ASSERT_NOT_NULL(nodes[i]);
+    }
+    // Everyone bootstraps from the first node
+    const struct sockaddr_in bootstrap = loopback_address(nodes[0]->port);
+    for (uint32_t i = 1; i < STAND_IN_NODES; ++i) TEST_ASSERT_TRUE(dht_contact(nodes[i], &bootstrap));
+    run_nodes(loop, timers, nullptr, 1000);
+    TEST_ASSERT_EQUAL_UINT32(STAND_IN_NODES - 1, nodes[0]->node_amount);
+    for (uint32_t i = 1; i < STAND_IN_NODES; ++i) TEST_ASSERT_TRUE(nodes[i]->node_amount >= 1);
+
+    // One node announces it's downloading a torrent
+    unsigned char info_hash[20];
+    for (uint32_t i = 0; i < 20; ++i) info_hash[i] = (unsigned char) (i * 11);
+    TEST_ASSERT_TRUE(dht_get_peers(nodes[1], info_hash, 7000, nullptr, nullptr));
+    run_nodes(loop, timers, &nodes[1]->lookups[1].done, 3000);
+    TEST_ASSERT_TRUE(nodes[1]->lookups[1].done);
+
+    // And another one finds it
+    dht_peers_record_t record = {0};
+    TEST_ASSERT_TRUE(dht_get_peers(nodes[STAND_IN_NODES - 1], info_hash, 0, peers_callback, &record));
+    run_nodes(loop, timers, &nodes[STAND_IN_NODES - 1]->lookups[1].done, 3000);
+    TEST_ASSERT_TRUE(record.calls > 0);
+    uint32_t address;
+    uint16_t port;
+    memcpy(&address, record.first_peer, 4);
+    memcpy(&port, record.first_peer + 4, 2);
+    TEST_ASSERT_EQUAL_HEX32(INADDR_LOOPBACK, ntohl(address));
+    TEST_ASSERT_EQUAL_UINT16(7000, ntohs(port));
+
+    for (uint32_t i = 0; i < STAND_IN_NODES; ++i) dht_free(nodes[i]);
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
@@ -0,0 +1,11 @@
+#ifndef BITTORRENT_CLIENT_TEST_DHT_H
+#define BITTORRENT_CLIENT_TEST_DHT_H
+
+void test_dht_common_prefix(void);
+void test_dht_closest_orders_by_distance(void);
+void test_dht_full_bucket_keeps_good_nodes(void);
+void test_dht_routing_table_persists(void);
+void test_dht_answers_ping(void);
+void test_dht_loopback_lookup(void);
+
+#endif //BITTORRENT_CLIENT_TEST_DHT_H
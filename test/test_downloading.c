@@ -1,8 +1,14 @@
 #include "unity.h"
 #include "../src/downloading.h"
 #include "../src/downloading_types.h"
+#include "../src/messages_types.h"
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <openssl/sha.h>
 
 // Assumed BLOCK_SIZE constant - adjust if different in your implementation
 #ifndef BLOCK_SIZE
@@ -357,6 +363,109 @@ void test_closing_files_multiple_files(void) {
     TEST_IGNORE_MESSAGE("Requires file I/O mocking");
 }
 
+// ============================================================================
+// Tests for verify_piece
+// ============================================================================
+
+/**
+ * Writes length bytes, each the low byte of its offset in the torrent, into a new file named name
+ */
+static files_ll* verify_test_file(const char* name, const int64_t length, const int64_t byte_index) {
+    FILE* file = fopen(name, "wb");
+    for (int64_t i = 0; i < length; ++i) fputc((int)((byte_index + i) & 0xFF), file);
+    fclose(file);
+    files_ll* node = calloc(1, sizeof(files_ll));
+    node->path = calloc(1, sizeof(ll));
+    node->path->val = strdup(name);
+    node->length = length;
+    node->byte_index = byte_index;
+    return node;
+}
+
+static void free_verify_test_files(files_ll* files) {
+    while (files) {
+        files_ll* next = files->next;
+        if (files->file_ptr) fclose(files->file_ptr);
+        remove(files->path->val);
+        free(files->path->val);
+        free(files->path);
+        free(files);
+        files = next;
+    }
+}
+
+/**
+ * SHA1 of the piece as verify_test_file() lays bytes out
+ */
+static void verify_test_hash(const int64_t offset, const uint32_t length, unsigned char* hash) {
+    unsigned char* data = malloc(length);
+    for (uint32_t i = 0; i < length; ++i) data[i] = (unsigned char)((offset + i) & 0xFF);
+    SHA1(data, length, hash);
+    free(data);
+}
+
+void test_verify_piece_matching_hash(void) {
+    files_ll* files = verify_test_file("verify_piece_single.bin", 1000, 0);
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    // Last piece, shorter than the rest
+    verify_test_hash(512, 488, hash);
+    TEST_ASSERT_TRUE(verify_piece(files, hash, 1, 512, 488, LOG_NO));
+    // Open files are read through their own pointer
+    files->file_ptr = fopen("verify_piece_single.bin", "rb+");
+    TEST_ASSERT_TRUE(verify_piece(files, hash, 1, 512, 488, LOG_NO));
+    free_verify_test_files(files);
+}
+
+void test_verify_piece_across_files(void) {
+    files_ll* files = verify_test_file("verify_piece_a.bin", 300, 0);
+    files->next = verify_test_file("verify_piece_b.bin", 100, 300);
+    files->next->next = verify_test_file("verify_piece_c.bin", 600, 400);
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    // Starts in the first file and ends in the last one
+    verify_test_hash(256, 256, hash);
+    TEST_ASSERT_TRUE(verify_piece(files, hash, 1, 256, 256, LOG_NO));
+    free_verify_test_files(files);
+}
+
+void test_verify_piece_wrong_hash(void) {
+    files_ll* files = verify_test_file("verify_piece_wrong.bin", 1000, 0);
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    verify_test_hash(0, 512, hash);
+    hash[0] ^= 1;
+    TEST_ASSERT_FALSE(verify_piece(files, hash, 0, 512, 512, LOG_NO));
+    // Past the end of the data
+    verify_test_hash(0, 512, hash);
+    TEST_ASSERT_FALSE(verify_piece(files, hash, 3, 512, 512, LOG_NO));
+    TEST_ASSERT_FALSE(verify_piece(nullptr, hash, 0, 512, 512, LOG_NO));
+    free_verify_test_files(files);
+}
+
+void test_verify_pieces(void) {
+    // More pieces than a batch, across two files, the last one shorter
+    files_ll* files = verify_test_file("verify_pieces_a.bin", 1500, 0);
+    files->next = verify_test_file("verify_pieces_b.bin", 2550, 1500);
+    const uint32_t piece_size = 100;
+    const uint32_t piece_amount = 41;
+    unsigned char* pieces = malloc(piece_amount * SHA_DIGEST_LENGTH);
+    for (uint32_t i = 0; i < piece_amount; ++i) {
+        verify_test_hash(i * piece_size, i == piece_amount - 1 ? 50 : piece_size, pieces + i * SHA_DIGEST_LENGTH);
+    }
+    pieces[20 * SHA_DIGEST_LENGTH] ^= 1;
+    bool valid[45];
+    memset(valid, true, sizeof(valid));
+    TEST_ASSERT_EQUAL_UINT32(piece_amount - 1, verify_pieces(files, pieces, 0, piece_amount, piece_size, 4050, valid,
+                                                             LOG_NO));
+    for (uint32_t i = 0; i < piece_amount; ++i) TEST_ASSERT_EQUAL(i != 20, valid[i]);
+    // A run starting past the first piece, and ending past the end of the data
+    memset(valid, true, sizeof(valid));
+    TEST_ASSERT_EQUAL_UINT32(3, verify_pieces(files, pieces, 38, 5, piece_size, 4050, valid, LOG_NO));
+    TEST_ASSERT_TRUE(valid[0] && valid[1] && valid[2]);
+    TEST_ASSERT_FALSE(valid[3] || valid[4]);
+    TEST_ASSERT_EQUAL_UINT32(0, verify_pieces(nullptr, pieces, 0, 1, piece_size, 4050, valid, LOG_NO));
+    free(pieces);
+    free_verify_test_files(files);
+}
+
 // ============================================================================
 // Tests for handle_predownload_udp
 // ============================================================================
@@ -368,7 +477,7 @@ void test_handle_predownload_udp_valid_request(void) {
 
 void test_handle_predownload_udp_null_peer_id(void) {
     metainfo_t metainfo = {0};
-    torrent_stats_t stats = {0, 1024, 0, 0, 12345};
+    torrent_stats_t stats = {.left = 1024, .key = 12345};
 
     announce_response_t *result = handle_predownload_udp(metainfo, nullptr, &stats, LOG_NO);
 
@@ -424,6 +533,223 @@ void test_read_from_socket_partial_read(void) {
     TEST_IGNORE_MESSAGE("Requires socket mocking");
 }
 
+// ============================================================================
+// Tests for receive_messages
+// ============================================================================
+
+/// @brief What the receive_messages tests' callback saw
+typedef struct {
+    uint32_t amount;
+    uint8_t ids[16];
+    uint32_t lengths[16];
+    bool handshake;
+    bool payload_intact; /**< Whether every PIECE payload byte was the expected one */
+} received_t;
+
+static bool record_message(void *ctx, peer_t *peer, const peer_message_t *message) {
+    received_t *received = ctx;
+    if (message->handshake) {
+        received->handshake = true;
+        peer->status = PEER_HANDSHAKE_SUCCESS;
+        return true;
+    }
+    if (message->id == PIECE) {
+        received->payload_intact = true;
+        for (uint32_t i = 8; i < message->payload_length; ++i) {
+            if (message->payload[i] != (unsigned char) i) received->payload_intact = false;
+        }
+    }
+    if (received->amount < 16) {
+        received->ids[received->amount] = message->id;
+        received->lengths[received->amount] = message->payload_length;
+    }
+    received->amount++;
+    return true;
+}
+
+/// @brief Appends a message with the given payload length, filled with its offsets
+static uint32_t put_message(unsigned char *buffer, const uint8_t id, const uint32_t payload_length) {
+    const uint32_t length = htonl(payload_length + 1);
+    memcpy(buffer, &length, 4);
+    buffer[4] = id;
+    for (uint32_t i = 0; i < payload_length; ++i) buffer[5 + i] = (unsigned char) i;
+    return 5 + payload_length;
+}
+
+/// @brief Peer reading from sockets[0] of a fresh non-blocking socket pair
+static peer_t *socket_peer(int32_t sockets[2], const PEER_STATUS status) {
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets));
+    peer_t *peer = calloc(1, sizeof(peer_t));
+    TEST_ASSERT_NOT_NULL(peer);
+    peer->socket = sockets[0];
+    peer->status = status;
+    return peer;
+}
+
+void test_receive_messages_null_peer(void) {
+    received_t received = {0};
+
+    TEST_ASSERT_EQUAL_INT32(-1, receive_messages(nullptr, 1, record_message, &received, LOG_NO));
+}
+
+void test_receive_messages_many_per_read(void) {
+    int32_t sockets[2];
+    peer_t *peer = socket_peer(sockets, PEER_HANDSHAKE_SUCCESS);
+    const int32_t epoll = epoll_create1(0);
+    unsigned char stream[64] = {0};
+    // Keep-alive first, then messages without and with payload
+    uint32_t length = 4;
+    length += put_message(stream + length, UNCHOKE, 0);
+    length += put_message(stream + length, HAVE, 4);
+    length += put_message(stream + length, HAVE, 4);
+    length += put_message(stream + length, REQUEST, 12);
+    TEST_ASSERT_EQUAL_INT64(length, write(sockets[1], stream, length));
+
+    received_t received = {0};
+    TEST_ASSERT_EQUAL_INT32(4, receive_messages(peer, epoll, record_message, &received, LOG_NO));
+    TEST_ASSERT_EQUAL_UINT8(UNCHOKE, received.ids[0]);
+    TEST_ASSERT_EQUAL_UINT8(HAVE, received.ids[2]);
+    TEST_ASSERT_EQUAL_UINT32(4, received.lengths[2]);
+    TEST_ASSERT_EQUAL_UINT8(REQUEST, received.ids[3]);
+    TEST_ASSERT_EQUAL_UINT32(12, received.lengths[3]);
+    TEST_ASSERT_EQUAL_UINT32(peer->recv_start, peer->recv_end);
+
+    close(sockets[0]);
+    close(sockets[1]);
+    close(epoll);
+    free(peer);
+}
+
+void test_receive_messages_split_message(void) {
+    int32_t sockets[2];
+    peer_t *peer = socket_peer(sockets, PEER_HANDSHAKE_SUCCESS);
+    const int32_t epoll = epoll_create1(0);
+    unsigned char stream[16];
+    const uint32_t length = put_message(stream, HAVE, 4);
+    received_t received = {0};
+
+    // Half the length field, then the rest of the message
+    TEST_ASSERT_EQUAL_INT64(2, write(sockets[1], stream, 2));
+    TEST_ASSERT_EQUAL_INT32(0, receive_messages(peer, epoll, record_message, &received, LOG_NO));
+    TEST_ASSERT_EQUAL_INT64(length - 2, write(sockets[1], stream + 2, length - 2));
+    TEST_ASSERT_EQUAL_INT32(1, receive_messages(peer, epoll, record_message, &received, LOG_NO));
+    TEST_ASSERT_EQUAL_UINT8(HAVE, received.ids[0]);
+    TEST_ASSERT_EQUAL_INT(PEER_HANDSHAKE_SUCCESS, peer->status);
+
+    close(sockets[0]);
+    close(sockets[1]);
+    close(epoll);
+    free(peer);
+}
+
+void test_receive_messages_block(void) {
+    int32_t sockets[2];
+    peer_t *peer = socket_peer(sockets, PEER_HANDSHAKE_SENT);
+    const int32_t epoll = epoll_create1(0);
+    unsigned char *stream = calloc(1, 2 * MAX_TRANS_SIZE);
+    TEST_ASSERT_NOT_NULL(stream);
+    // Handshake, a HAVE, a whole block and a CHOKE right behind it
+    uint32_t length = HANDSHAKE_LEN;
+    length += put_message(stream + length, HAVE, 4);
+    length += put_message(stream + length, PIECE, 8 + BLOCK_SIZE);
+    length += put_message(stream + length, CHOKE, 0);
+    received_t received = {0};
+
+    // The block arrives in several reads, some of them ending in the middle of a message
+    const uint32_t cuts[] = {40, 100, 3000, 9000, length};
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); ++i) {
+        TEST_ASSERT_EQUAL_INT64(cuts[i] - written, write(sockets[1], stream + written, cuts[i] - written));
+        written = cuts[i];
+        TEST_ASSERT_TRUE(receive_messages(peer, epoll, record_message, &received, LOG_NO) >= 0);
+    }
+    TEST_ASSERT_TRUE(received.handshake);
+    TEST_ASSERT_EQUAL_UINT32(3, received.amount);
+    TEST_ASSERT_EQUAL_UINT8(PIECE, received.ids[1]);
+    TEST_ASSERT_EQUAL_UINT32(8 + BLOCK_SIZE, received.lengths[1]);
+    TEST_ASSERT_TRUE(received.payload_intact);
+    TEST_ASSERT_EQUAL_UINT8(CHOKE, received.ids[2]);
+
+    close(sockets[0]);
+    close(sockets[1]);
+    close(epoll);
+    free(stream);
+    free(peer);
+}
+
+void test_receive_messages_too_big(void) {
+    int32_t sockets[2];
+    peer_t *peer = socket_peer(sockets, PEER_HANDSHAKE_SUCCESS);
+    const int32_t epoll = epoll_create1(0);
+    const uint32_t length = htonl(MAX_TRANS_SIZE);
+    TEST_ASSERT_EQUAL_INT64(4, write(sockets[1], &length, 4));
+    received_t received = {0};
+
+    TEST_ASSERT_EQUAL_INT32(-1, receive_messages(peer, epoll, record_message, &received, LOG_NO));
+    TEST_ASSERT_EQUAL_INT(PEER_CLOSED, peer->status);
+    TEST_ASSERT_EQUAL_INT(-1, peer->socket);
+
+    close(sockets[1]);
+    close(epoll);
+    free(peer);
+}
+
+void test_receive_messages_connection_closed(void) {
+    int32_t sockets[2];
+    peer_t *peer = socket_peer(sockets, PEER_HANDSHAKE_SUCCESS);
+    const int32_t epoll = epoll_create1(0);
+    unsigned char stream[16];
+    const uint32_t length = put_message(stream, HAVE, 4);
+    TEST_ASSERT_EQUAL_INT64(length, write(sockets[1], stream, length));
+    close(sockets[1]);
+    received_t received = {0};
+
+    // Messages before the end of the stream are handed over first, the short read ends that call
+    TEST_ASSERT_EQUAL_INT32(1, receive_messages(peer, epoll, record_message, &received, LOG_NO));
+    TEST_ASSERT_EQUAL_INT32(-1, receive_messages(peer, epoll, record_message, &received, LOG_NO));
+    TEST_ASSERT_EQUAL_UINT32(1, received.amount);
+    TEST_ASSERT_EQUAL_INT(PEER_CLOSED, peer->status);
+
+    close(epoll);
+    free(peer);
+}
+
+// ============================================================================
+// Tests for update_interest
+// ============================================================================
+
+void test_update_interest_output_only_when_queued(void) {
+    int32_t sockets[2];
+    peer_t *peer = socket_peer(sockets, PEER_HANDSHAKE_SUCCESS);
+    const int32_t epoll = epoll_create1(0);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.u32 = 3};
+    TEST_ASSERT_EQUAL_INT(0, epoll_ctl(epoll, EPOLL_CTL_ADD, peer->socket, &ev));
+    peer->epoll_events = ev.events;
+    struct epoll_event ready[4];
+
+    // An idle connected peer doesn't wake epoll up, even though its socket is writable
+    TEST_ASSERT_TRUE(update_interest(peer, epoll, 3));
+    TEST_ASSERT_EQUAL_UINT32(EPOLLIN | PEER_EVENT_TRIGGER, peer->epoll_events);
+    TEST_ASSERT_EQUAL_INT(0, epoll_wait(epoll, ready, 4, 0));
+
+    // Queued output needs to know when it can be sent
+    peer->send_length = 1;
+    TEST_ASSERT_TRUE(update_interest(peer, epoll, 3));
+    TEST_ASSERT_EQUAL_INT(1, epoll_wait(epoll, ready, 4, 0));
+    TEST_ASSERT_TRUE(ready[0].events & EPOLLOUT);
+    TEST_ASSERT_EQUAL_UINT32(3, ready[0].data.u32);
+    peer->send_length = 0;
+
+    peer->status = PEER_CLOSED;
+    TEST_ASSERT_FALSE(update_interest(peer, epoll, 3));
+    TEST_ASSERT_FALSE(update_interest(nullptr, epoll, 3));
+
+    close(sockets[0]);
+    close(sockets[1]);
+    close(epoll);
+    free(peer);
+}
+
 // ============================================================================
 // Tests for reconnect
 // ============================================================================
@@ -460,6 +786,82 @@ void test_reconnect_some_closed_peers(void) {
     TEST_IGNORE_MESSAGE("Requires socket mocking");
 }
 
+// ============================================================================
+// Tests for add_peers
+// ============================================================================
+
+void test_add_peers_null(void) {
+    swarm_t swarm = {.epoll = -1, .log_code = LOG_NO};
+    const unsigned char peers[6] = {127, 0, 0, 1, 0x1A, 0xE1};
+
+    TEST_ASSERT_EQUAL_UINT32(0, add_peers(nullptr, peers, 1, AF_INET));
+    TEST_ASSERT_EQUAL_UINT32(0, add_peers(&swarm, nullptr, 1, AF_INET));
+    TEST_ASSERT_EQUAL_UINT32(0, add_peers(&swarm, peers, 1, AF_INET));
+}
+
+void test_add_peers_merges_duplicates(void) {
+    const int32_t epoll = epoll_create1(0);
+    swarm_t swarm = {.epoll = epoll, .log_code = LOG_NO};
+    const unsigned char first[12] = {127, 0, 0, 1, 0x1A, 0xE1, 127, 0, 0, 1, 0x1A, 0xE2};
+    const unsigned char second[12] = {127, 0, 0, 1, 0x1A, 0xE2, 127, 0, 0, 1, 0x1A, 0xE3};
+
+    TEST_ASSERT_EQUAL_UINT32(2, add_peers(&swarm, first, 2, AF_INET));
+    // Only the peer that the first tracker didn't return is added
+    TEST_ASSERT_EQUAL_UINT32(1, add_peers(&swarm, second, 2, AF_INET));
+    TEST_ASSERT_EQUAL_UINT32(3, swarm.peer_amount);
+    TEST_ASSERT_TRUE(swarm.peer_capacity >= 3);
+    TEST_ASSERT_EQUAL_UINT16(htons(6883), swarm.peer_array[2].address->sin_port);
+    TEST_ASSERT_EQUAL_INT(AF_INET, swarm.peer_array[2].address->sin_family);
+    TEST_ASSERT_TRUE(swarm.peer_array[0].am_choking && swarm.peer_array[0].peer_choking);
+
+    // IPv6 peers aren't supported yet
+    const unsigned char v6[18] = {0};
+    TEST_ASSERT_EQUAL_UINT32(0, add_peers(&swarm, v6, 1, AF_INET6));
+
+    for (uint32_t i = 0; i < swarm.peer_amount; ++i) {
+        if (swarm.peer_array[i].socket >= 0) close(swarm.peer_array[i].socket);
+        free(swarm.peer_array[i].address);
+    }
+    free(swarm.peer_array);
+    close(epoll);
+}
+
+void test_add_inbound_peer(void) {
+    const int32_t epoll = epoll_create1(0);
+    swarm_t swarm = {.epoll = epoll, .log_code = LOG_NO};
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(51413);
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+
+    TEST_ASSERT_EQUAL_INT32(-1, add_inbound_peer(nullptr, fds[0], &address));
+    TEST_ASSERT_EQUAL_INT32(-1, add_inbound_peer(&swarm, -1, &address));
+    TEST_ASSERT_EQUAL_INT32(0, add_inbound_peer(&swarm, fds[0], &address));
+    const peer_t* peer = &swarm.peer_array[0];
+    TEST_ASSERT_TRUE(peer->inbound);
+    TEST_ASSERT_EQUAL_INT(PEER_CONNECTION_SUCCESS, peer->status);
+    TEST_ASSERT_EQUAL_INT32(fds[0], peer->socket);
+    TEST_ASSERT_EQUAL_UINT16(htons(51413), peer->address->sin_port);
+    TEST_ASSERT_EQUAL_UINT32(EPOLLIN | PEER_EVENT_TRIGGER, peer->epoll_events);
+
+    // Watched for input right away
+    TEST_ASSERT_EQUAL_INT32(1, write(fds[1], "x", 1));
+    struct epoll_event event;
+    TEST_ASSERT_EQUAL_INT32(1, epoll_wait(epoll, &event, 1, 1000));
+    TEST_ASSERT_EQUAL_UINT32(0, event.data.u32);
+
+    // Never connected to again once closed
+    swarm.peer_array[0].status = PEER_CLOSED;
+    TEST_ASSERT_EQUAL_UINT32(0, reconnect(swarm.peer_array, swarm.peer_amount, 0, epoll, LOG_NO));
+
+    close(fds[0]);
+    close(fds[1]);
+    free(swarm.peer_array[0].address);
+    free(swarm.peer_array);
+    close(epoll);
+}
+
 // ============================================================================
 // Tests for write_state
 // ============================================================================
@@ -661,7 +1063,7 @@ void test_torrent_null_peer_id(void) {
     TEST_IGNORE_MESSAGE("torrent() unfinished");
     metainfo_t metainfo = {0};
 
-    int32_t result = torrent(metainfo, nullptr, LOG_NO);
+    int32_t result = torrent(metainfo, nullptr, nullptr, 1, LOG_NO);
 
     TEST_ASSERT_NOT_EQUAL_INT32(0, result);
 }
@@ -671,7 +1073,7 @@ void test_torrent_invalid_metainfo(void) {
     metainfo_t metainfo = {0};
     unsigned char peer_id[20] = {0};
 
-    int32_t result = torrent(metainfo, peer_id, LOG_NO);
+    int32_t result = torrent(metainfo, peer_id, nullptr, 1, LOG_NO);
 
     TEST_ASSERT_NOT_EQUAL_INT32(0, result);
 }
@@ -47,6 +47,12 @@ void test_closing_files_single_file_complete(void);
 void test_closing_files_single_file_incomplete(void);
 void test_closing_files_multiple_files(void);
 
+// verify_piece tests
+void test_verify_piece_matching_hash(void);
+void test_verify_piece_across_files(void);
+void test_verify_piece_wrong_hash(void);
+void test_verify_pieces(void);
+
 // handle_predownload_udp tests
 void test_handle_predownload_udp_valid_request(void);
 void test_handle_predownload_udp_null_peer_id(void);
@@ -60,6 +66,17 @@ void test_read_from_socket_valid_operation(void);
 void test_read_from_socket_connection_closed(void);
 void test_read_from_socket_partial_read(void);
 
+// receive_messages tests
+void test_receive_messages_null_peer(void);
+void test_receive_messages_many_per_read(void);
+void test_receive_messages_split_message(void);
+void test_receive_messages_block(void);
+void test_receive_messages_too_big(void);
+void test_receive_messages_connection_closed(void);
+
+// update_interest tests
+void test_update_interest_output_only_when_queued(void);
+
 // reconnect tests
 void test_reconnect_null_peer_list(void);
 void test_reconnect_zero_peer_amount(void);
@@ -67,6 +84,11 @@ void test_reconnect_invalid_epoll(void);
 void test_reconnect_no_closed_peers(void);
 void test_reconnect_some_closed_peers(void);
 
+// add_peers tests
+void test_add_peers_null(void);
+void test_add_peers_merges_duplicates(void);
+void test_add_inbound_peer(void);
+
 // write_state tests
 void test_write_state_null_filename(void);
 void test_write_state_null_state(void);
@@ -0,0 +1,113 @@
+#include <unistd.h>
+
+#include "unity.h"
+#include "../src/event_loop.h"
+
+static void count_callback(void* ctx, const uint32_t events) {
+    (void) events;
+    (*(int32_t*) ctx)++;
+}
+
+void test_loop_create_free(void) {
+    event_loop_t* loop = loop_create();
+    TEST_ASSERT_NOT_NULL(loop);
+    TEST_ASSERT_TRUE(loop->epoll >= 0);
+    TEST_ASSERT_EQUAL_UINT32(LOOP_INITIAL_SOURCES, loop->source_capacity);
+    for (uint32_t i = 0; i < loop->source_capacity; ++i) {
+        TEST_ASSERT_EQUAL_INT32(-1, loop->sources[i].fd);
+    }
+    loop_free(loop);
+    loop_free(nullptr);
+}
+
+void test_loop_add_source_invalid(void) {
+    event_loop_t* loop = loop_create();
+    int32_t counter = 0;
+    TEST_ASSERT_EQUAL_INT32(-1, loop_add_source(nullptr, 0, EPOLLIN, count_callback, &counter));
+    TEST_ASSERT_EQUAL_INT32(-1, loop_add_source(loop, -1, EPOLLIN, count_callback, &counter));
+    TEST_ASSERT_EQUAL_INT32(-1, loop_add_source(loop, 0, EPOLLIN, nullptr, &counter));
+    TEST_ASSERT_EQUAL_INT32(-1, loop_modify_source(loop, 3, EPOLLIN));
+    loop_free(loop);
+}
+
+void test_loop_dispatch_source(void) {
+    event_loop_t* loop = loop_create();
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, pipe(fds));
+    int32_t counter = 0;
+    const int32_t slot = loop_add_source(loop, fds[0], EPOLLIN, count_callback, &counter);
+    TEST_ASSERT_EQUAL_INT32(0, slot);
+
+    TEST_ASSERT_EQUAL_INT32(1, write(fds[1], "x", 1));
+    struct epoll_event events[4];
+    const int32_t nfds = epoll_wait(loop->epoll, events, 4, 1000);
+    TEST_ASSERT_EQUAL_INT32(1, nfds);
+    TEST_ASSERT_TRUE(events[0].data.u32 & LOOP_SOURCE_TAG);
+    TEST_ASSERT_TRUE(loop_dispatch(loop, &events[0]));
+    TEST_ASSERT_EQUAL_INT32(1, counter);
+
+    // Removed sources are ignored, even if their events were already returned
+    loop_remove_source(loop, slot);
+    TEST_ASSERT_TRUE(loop_dispatch(loop, &events[0]));
+    TEST_ASSERT_EQUAL_INT32(1, counter);
+    TEST_ASSERT_EQUAL_INT32(0, epoll_wait(loop->epoll, events, 4, 0));
+
+    close(fds[0]);
+    close(fds[1]);
+    loop_free(loop);
+}
+
+void test_loop_dispatch_peer_event(void) {
+    event_loop_t* loop = loop_create();
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u32 = 3;
+    TEST_ASSERT_FALSE(loop_dispatch(loop, &event));
+    loop_free(loop);
+}
+
+void test_loop_add_source_grows(void) {
+    event_loop_t* loop = loop_create();
+    const int32_t amount = LOOP_INITIAL_SOURCES + 4;
+    int32_t fds[LOOP_INITIAL_SOURCES + 4][2];
+    int32_t counter = 0;
+    for (int32_t i = 0; i < amount; ++i) {
+        TEST_ASSERT_EQUAL_INT32(0, pipe(fds[i]));
+        TEST_ASSERT_EQUAL_INT32(i, loop_add_source(loop, fds[i][0], EPOLLIN, count_callback, &counter));
+    }
+    TEST_ASSERT_EQUAL_UINT32(LOOP_INITIAL_SOURCES * 2, loop->source_capacity);
+
+    // The last source still dispatches after growing
+    TEST_ASSERT_EQUAL_INT32(1, write(fds[amount-1][1], "x", 1));
+    struct epoll_event event;
+    TEST_ASSERT_EQUAL_INT32(1, epoll_wait(loop->epoll, &event, 1, 1000));
+    TEST_ASSERT_EQUAL_UINT32(LOOP_SOURCE_TAG | (amount-1), event.data.u32);
+    TEST_ASSERT_TRUE(loop_dispatch(loop, &event));
+    TEST_ASSERT_EQUAL_INT32(1, counter);
+
+    for (int32_t i = 0; i < amount; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    loop_free(loop);
+}
+
+void test_loop_remove_source_reuses_slot(void) {
+    event_loop_t* loop = loop_create();
+    int32_t fds[2][2];
+    int32_t counter = 0;
+    TEST_ASSERT_EQUAL_INT32(0, pipe(fds[0]));
+    TEST_ASSERT_EQUAL_INT32(0, pipe(fds[1]));
+    TEST_ASSERT_EQUAL_INT32(0, loop_add_source(loop, fds[0][0], EPOLLIN, count_callback, &counter));
+    TEST_ASSERT_EQUAL_INT32(1, loop_add_source(loop, fds[1][0], EPOLLIN, count_callback, &counter));
+    loop_remove_source(loop, 0);
+    loop_remove_source(loop, -1);
+    TEST_ASSERT_EQUAL_INT32(-1, loop->sources[0].fd);
+    TEST_ASSERT_EQUAL_INT32(0, loop_add_source(loop, fds[0][0], EPOLLIN, count_callback, &counter));
+
+    for (int32_t i = 0; i < 2; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    loop_free(loop);
+}
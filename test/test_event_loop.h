@@ -0,0 +1,11 @@
+#ifndef BITTORRENT_CLIENT_TEST_EVENT_LOOP_H
+#define BITTORRENT_CLIENT_TEST_EVENT_LOOP_H
+
+void test_loop_create_free(void);
+void test_loop_add_source_invalid(void);
+void test_loop_dispatch_source(void);
+void test_loop_dispatch_peer_event(void);
+void test_loop_add_source_grows(void);
+void test_loop_remove_source_reuses_slot(void);
+
+#endif //BITTORRENT_CLIENT_TEST_EVENT_LOOP_H
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <openssl/sha.h>
 
 #include "unity.h"
 #include "../src/file.h"
@@ -223,4 +225,81 @@ void test_info_t_piece_zero(void) {
     info.piece_number = 0;
     TEST_ASSERT_EQUAL(0, info.piece_length);
     TEST_ASSERT_EQUAL(0, info.piece_number);
-}
\ No newline at end of file
+}
+
+void test_map_torrent_file_sample(void) {
+    mapped_file_t *file = map_torrent_file("test-files/sample.torrent", LOG_NO);
+    TEST_ASSERT_NOT_NULL(file);
+    TEST_ASSERT_EQUAL_UINT64(234, file->length);
+    TEST_ASSERT_EQUAL_CHAR('d', file->data[0]);
+    // Zero byte guaranteed right after the contents
+    TEST_ASSERT_EQUAL_CHAR('\0', file->data[file->length]);
+    unmap_torrent_file(file);
+}
+
+void test_map_torrent_file_nonexistent(void) {
+    TEST_ASSERT_NULL(map_torrent_file("test-files/does-not-exist.torrent", LOG_NO));
+}
+
+void test_map_torrent_file_null_path(void) {
+    TEST_ASSERT_NULL(map_torrent_file(nullptr, LOG_NO));
+    unmap_torrent_file(nullptr);
+    TEST_PASS(); // Should not crash
+}
+
+void test_parse_metainfo_pieces_view(void) {
+    mapped_file_t *file = map_torrent_file("test-files/sample.torrent", LOG_NO);
+    TEST_ASSERT_NOT_NULL(file);
+    metainfo_t *info = parse_metainfo(file->data, file->length, LOG_NO);
+    TEST_ASSERT_NOT_NULL(info);
+    TEST_ASSERT_EQUAL_UINT32(3, info->info->piece_number);
+    // Hashes aren't copied, they point straight into the mapping
+    const char *pieces_key = strstr(file->data, "6:pieces60:");
+    TEST_ASSERT_NOT_NULL(pieces_key);
+    TEST_ASSERT_EQUAL_PTR(pieces_key + 11, info->info->pieces);
+
+    free_metainfo(info);
+    unmap_torrent_file(file);
+}
+
+void test_parse_metainfo_info_dict_view(void) {
+    mapped_file_t *file = map_torrent_file("test-files/sample.torrent", LOG_NO);
+    TEST_ASSERT_NOT_NULL(file);
+    metainfo_t *info = parse_metainfo(file->data, file->length, LOG_NO);
+    TEST_ASSERT_NOT_NULL(info);
+
+    TEST_ASSERT_EQUAL_CHAR('d', info->info->info_dict[0]);
+    TEST_ASSERT_EQUAL_CHAR('e', info->info->info_dict[info->info->info_dict_length - 1]);
+    // The info dictionary is the last value of the outer dictionary
+    TEST_ASSERT_EQUAL_PTR(file->data + file->length - 1, info->info->info_dict + info->info->info_dict_length);
+
+    unsigned char hash[20];
+    SHA1((const unsigned char *)info->info->info_dict, info->info->info_dict_length, hash);
+    TEST_ASSERT_EQUAL_INT(0, memcmp(hash, info->info->hash, 20));
+    TEST_ASSERT_EQUAL_STRING("d69f91e6b2ae4c542468d1073a71d4ea13879a7f", info->info->human_hash);
+
+    free_metainfo(info);
+    unmap_torrent_file(file);
+}
+
+void test_parse_metainfo_all_test_files(void) {
+    DIR *dir = opendir("test-files");
+    TEST_ASSERT_NOT_NULL(dir);
+    const struct dirent *entry;
+    uint32_t parsed = 0;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (!strstr(entry->d_name, ".torrent")) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "test-files/%s", entry->d_name);
+        mapped_file_t *file = map_torrent_file(path, LOG_NO);
+        TEST_ASSERT_NOT_NULL(file);
+        metainfo_t *info = parse_metainfo(file->data, file->length, LOG_NO);
+        TEST_ASSERT_NOT_NULL(info);
+        TEST_ASSERT_NOT_EQUAL(0, info->info->piece_number);
+        free_metainfo(info);
+        unmap_torrent_file(file);
+        parsed++;
+    }
+    closedir(dir);
+    TEST_ASSERT_NOT_EQUAL(0, parsed);
+}
@@ -34,5 +34,12 @@ void test_free_metainfo_with_announce_list(void);
 void test_info_t_zero_lengths(void);
 void test_info_t_piece_zero(void);
 
+void test_map_torrent_file_sample(void);
+void test_map_torrent_file_nonexistent(void);
+void test_map_torrent_file_null_path(void);
+void test_parse_metainfo_pieces_view(void);
+void test_parse_metainfo_info_dict_view(void);
+void test_parse_metainfo_all_test_files(void);
+
 
 #endif //BITTORRENT_CLIENT_TEST_FILE_H
\ No newline at end of file
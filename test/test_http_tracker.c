@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "unity.h"
+#include "../src/announcer.h"
+#include "../src/http_tracker.h"
+
+/// @brief Local HTTP tracker answering every request with the same body, one connection at a time
+typedef struct {
+    event_loop_t *loop;
+    int32_t listen_fd;
+    int32_t listen_slot;
+    uint16_t port;
+    int32_t client_fd;
+    int32_t client_slot;
+    char request[2048];
+    uint32_t request_length;
+    const char *body;
+    uint64_t body_length;
+    uint32_t requests;
+    char last_target[1024];
+} fake_http_tracker_t;
+
+typedef struct {
+    uint32_t calls;
+    long status;
+    char body[256];
+    uint64_t length;
+} http_result_t;
+
+static void fake_http_client_readable(void* ctx, const uint32_t events) {
+    fake_http_tracker_t* tracker = ctx;
+    (void) events;
+    const ssize_t received = recv(tracker->client_fd, tracker->request + tracker->request_length,
+                                  sizeof(tracker->request) - 1 - tracker->request_length, 0);
+    if (received > 0) tracker->request_length += received;
+    tracker->request[tracker->request_length] = '\0';
+    if (received > 0 && strstr(tracker->request, "\r\n\r\n") == nullptr) return;
+
+    if (received > 0) {
+        // Request line is "GET <target> HTTP/1.1"
+        const char* target = tracker->request + 4;
+        const char* end = strchr(target, ' ');
+        snprintf(tracker->last_target, sizeof(tracker->last_target), "%.*s", (int) (end - target), target);
+        tracker->requests++;
+        char header[128];
+        const int header_length = snprintf(header, sizeof(header),
+                                           "HTTP/1.1 200 OK\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+                                           (unsigned long) tracker->body_length);
+        send(tracker->client_fd, header, header_length, MSG_NOSIGNAL);
+        send(tracker->client_fd, tracker->body, tracker->body_length, MSG_NOSIGNAL);
+    }
+    loop_remove_source(tracker->loop, tracker->client_slot);
+    close(tracker->client_fd);
+    tracker->client_fd = -1;
+    tracker->request_length = 0;
+}
+
+static void fake_http_listener_readable(void* ctx, const uint32_t events) {
+    fake_http_tracker_t* tracker = ctx;
+    (void) events;
+    const int32_t fd = accept4(tracker->listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0) return;
+    tracker->client_fd = fd;
+    tracker->client_slot = loop_add_source(tracker->loop, fd, EPOLLIN, fake_http_client_readable, tracker);
+}
+
+static void open_fake_http_tracker(fake_http_tracker_t* tracker, event_loop_t* loop, const char* body,
+                                   const uint64_t body_length) {
+    memset(tracker, 0, sizeof(fake_http_tracker_t));
+    tracker->loop = loop;
+    tracker->client_fd = -1;
+    tracker->body = body;
+    tracker->body_length = body_length;
+    tracker->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(tracker->listen_fd, (struct sockaddr*) &addr, sizeof(addr));
+    listen(tracker->listen_fd, 8);
+    socklen_t len = sizeof(addr);
+    getsockname(tracker->listen_fd, (struct sockaddr*) &addr, &len);
+    tracker->port = ntohs(addr.sin_port);
+    tracker->listen_slot = loop_add_source(loop, tracker->listen_fd, EPOLLIN, fake_http_listener_readable, tracker);
+}
+
+static void close_fake_http_tracker(fake_http_tracker_t* tracker) {
+    if (tracker->client_fd >= 0) {
+        loop_remove_source(tracker->loop, tracker->client_slot);
+        close(tracker->client_fd);
+    }
+    loop_remove_source(tracker->loop, tracker->listen_slot);
+    close(tracker->listen_fd);
+}
+
+/**
+ * Runs the loop until *calls reaches expected_calls, or until the timeout in milliseconds
+ */
+static void run_http_loop(event_loop_t* loop, announcer_t* announcer, const uint32_t* calls,
+                          const uint32_t expected_calls, const int32_t timeout) {
+    struct epoll_event events[8];
+    int32_t waited = 0;
+    while (*calls < expected_calls && waited < timeout) {
+        if (announcer) announcer_tick(announcer, time(nullptr));
+        const int32_t nfds = epoll_wait(loop->epoll, events, 8, 20);
+        for (int32_t i = 0; i < nfds; ++i) {
+            TEST_ASSERT_TRUE(loop_dispatch(loop, &events[i]));
+        }
+        waited += 20;
+    }
+}
+
+static void on_http_result(void* ctx, const long status, const char* body, const uint64_t length) {
+    http_result_t* result = ctx;
+    TEST_ASSERT_NOT_NULL(body);
+    result->calls++;
+    result->status = status;
+    result->length = length;
+    memcpy(result->body, body, length < sizeof(result->body) ? length : sizeof(result->body));
+}
+
+static const unsigned char info_hash[20] = "\x12\x34\x56\x78\x9a\xbc\xde\xf0 abcdefghijk";
+static const unsigned char peer_id[20] = "-IT0001-123456789012";
+
+// ============================================================================
+// URL building tests
+// ============================================================================
+
+void test_url_encode_bytes(void) {
+    char out[3*6+1];
+    const unsigned char data[6] = {'a', '-', '~', ' ', 0x00, 0xFF};
+    TEST_ASSERT_EQUAL_UINT32(12, url_encode_bytes(data, 6, out));
+    TEST_ASSERT_EQUAL_STRING("a-~%20%00%FF", out);
+}
+
+void test_build_http_announce_url(void) {
+    const torrent_stats_t stats = {.downloaded = 10, .left = 20, .uploaded = 30, .key = 0xBEEF};
+    char* url = build_http_announce_url("http://tracker.example.com/announce", info_hash, peer_id, &stats, 6881,
+                                        ANNOUNCE_EVENT_STARTED);
+    TEST_ASSERT_NOT_NULL(url);
+    TEST_ASSERT_EQUAL_STRING("http://tracker.example.com/announce?info_hash=%124Vx%9A%BC%DE%F0%20abcdefghijk"
+                             "&peer_id=-IT0001-123456789012&port=6881&uploaded=30&downloaded=10&left=20"
+                             "&compact=1&numwant=200&key=0000beef&event=started", url);
+    free(url);
+
+    // Passkeys already in the query are kept
+    url = build_http_announce_url("https://tracker.example.com/announce?passkey=abc", info_hash, peer_id, &stats,
+                                  6881, ANNOUNCE_EVENT_NONE);
+    TEST_ASSERT_NOT_NULL(url);
+    TEST_ASSERT_EQUAL_STRING_LEN("https://tracker.example.com/announce?passkey=abc&info_hash=", url, 59);
+    TEST_ASSERT_NULL(strstr(url, "event="));
+    free(url);
+
+    TEST_ASSERT_NULL(build_http_announce_url(nullptr, info_hash, peer_id, &stats, 6881, ANNOUNCE_EVENT_NONE));
+}
+
+void test_build_http_scrape_url(void) {
+    unsigned char hashes[40];
+    memset(hashes, 'a', 20);
+    memset(hashes+20, 'b', 20);
+    char* url = build_http_scrape_url("http://example.com:8080/x/announce.php?passkey=abc", hashes, 2);
+    TEST_ASSERT_NOT_NULL(url);
+    TEST_ASSERT_EQUAL_STRING("http://example.com:8080/x/scrape.php?passkey=abc"
+                             "&info_hash=aaaaaaaaaaaaaaaaaaaa&info_hash=bbbbbbbbbbbbbbbbbbbb", url);
+    free(url);
+
+    url = build_http_scrape_url("http://example.com/announce", hashes, 1);
+    TEST_ASSERT_EQUAL_STRING("http://example.com/scrape?info_hash=aaaaaaaaaaaaaaaaaaaa", url);
+    free(url);
+
+    // BEP 48: no "announce" in the last path component means no scrape support
+    TEST_ASSERT_NULL(build_http_scrape_url("http://example.com/a", hashes, 1));
+    TEST_ASSERT_NULL(build_http_scrape_url("http://example.com/announce/x", hashes, 1));
+    TEST_ASSERT_NULL(build_http_scrape_url("http://example.com/announce", hashes, 0));
+}
+
+// ============================================================================
+// Response parsing tests
+// ============================================================================
+
+void test_parse_http_announce_compact(void) {
+    const char body[] = "d8:completei5e10:incompletei3e8:intervali1800e12:min intervali60e"
+                        "5:peers12:\x7f\x00\x00\x01\x1a\xe1\x0a\x00\x00\x02\x1a\xe2"
+                        "6:peers618:\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x1a\xe3"
+                        "e";
+    http_announce_response_t response;
+    TEST_ASSERT_TRUE(parse_http_announce(body, sizeof(body)-1, &response));
+    TEST_ASSERT_NULL(response.failure_reason);
+    TEST_ASSERT_EQUAL_INT64(1800, response.interval);
+    TEST_ASSERT_EQUAL_INT64(60, response.min_interval);
+    TEST_ASSERT_EQUAL_INT64(5, response.complete);
+    TEST_ASSERT_EQUAL_INT64(3, response.incomplete);
+    TEST_ASSERT_EQUAL_UINT32(2, response.peer_amount);
+    // Peers are read in place
+    TEST_ASSERT_TRUE(response.peers > (const unsigned char*) body &&
+                     response.peers < (const unsigned char*) body + sizeof(body));
+    TEST_ASSERT_EQUAL_HEX8(0x7f, response.peers[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xe2, response.peers[11]);
+    TEST_ASSERT_EQUAL_UINT32(1, response.peer6_amount);
+    TEST_ASSERT_EQUAL_HEX8(0xe3, response.peers6[17]);
+}
+
+void test_parse_http_announce_failure(void) {
+    const char body[] = "d14:failure reason17:torrent not founde";
+    http_announce_response_t response;
+    TEST_ASSERT_TRUE(parse_http_announce(body, sizeof(body)-1, &response));
+    TEST_ASSERT_EQUAL_UINT64(17, response.failure_reason_length);
+    TEST_ASSERT_EQUAL_STRING_LEN("torrent not found", response.failure_reason, 17);
+
+    TEST_ASSERT_FALSE(parse_http_announce("d8:interval", 11, &response));
+    TEST_ASSERT_FALSE(parse_http_announce("<html>", 6, &response));
+    TEST_ASSERT_FALSE(parse_http_announce(nullptr, 0, &response));
+}
+
+void test_compact_peer_list(void) {
+    const char body[] = "d8:intervali900e5:peersl"
+                        "d2:ip9:127.0.0.17:peer id20:aaaaaaaaaaaaaaaaaaaa4:porti6881ee"
+                        "d2:ip3:::14:porti6882ee"
+                        "d2:ip8:10.0.0.24:porti80ee"
+                        "ee";
+    http_announce_response_t response;
+    TEST_ASSERT_TRUE(parse_http_announce(body, sizeof(body)-1, &response));
+    TEST_ASSERT_NULL(response.peers);
+    TEST_ASSERT_NOT_NULL(response.peer_list);
+
+    unsigned char compact[3 * COMPACT_PEER_V4_SIZE];
+    // The IPv6 peer is skipped
+    TEST_ASSERT_EQUAL_UINT32(2, compact_peer_list(response.peer_list, response.peer_list_end, compact, 3));
+    const unsigned char expected[] = {127, 0, 0, 1, 0x1a, 0xe1, 10, 0, 0, 2, 0, 80};
+    TEST_ASSERT_EQUAL_MEMORY(expected, compact, sizeof(expected));
+    // Never more than asked for
+    TEST_ASSERT_EQUAL_UINT32(1, compact_peer_list(response.peer_list, response.peer_list_end, compact, 1));
+}
+
+void test_parse_http_scrape(void) {
+    unsigned char hashes[40];
+    memset(hashes, 'a', 20);
+    memset(hashes+20, 'b', 20);
+    const char body[] = "d5:filesd20:aaaaaaaaaaaaaaaaaaaad8:completei7e10:downloadedi20e10:incompletei4eee"
+                        "5:flagsd20:min_request_intervali900eee";
+    scraped_data_t scraped_data[2];
+    TEST_ASSERT_TRUE(parse_http_scrape(body, sizeof(body)-1, hashes, 2, scraped_data));
+    TEST_ASSERT_EQUAL_UINT32(7, scraped_data[0].seeders);
+    TEST_ASSERT_EQUAL_UINT32(20, scraped_data[0].completed);
+    TEST_ASSERT_EQUAL_UINT32(4, scraped_data[0].leechers);
+    // Unknown to the tracker
+    TEST_ASSERT_EQUAL_UINT32(0, scraped_data[1].seeders);
+    TEST_ASSERT_FALSE(parse_http_scrape("d5:filesi1ee", 12, hashes, 2, scraped_data));
+}
+
+// ============================================================================
+// Event loop tests, against a local HTTP tracker
+// ============================================================================
+
+void test_http_client_get(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    event_loop_t* loop = loop_create();
+    http_client_t* client = http_client_create(loop, LOG_NO);
+    TEST_ASSERT_NOT_NULL(client);
+    fake_http_tracker_t tracker;
+    open_fake_http_tracker(&tracker, loop, "hello", 5);
+
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/path?x=1", tracker.port);
+    http_result_t result = {0};
+    TEST_ASSERT_NOT_NULL(http_client_get(client, url, on_http_result, &result));
+    // Nothing happens until the loop runs
+    TEST_ASSERT_EQUAL_UINT32(0, result.calls);
+    run_http_loop(loop, nullptr, &result.calls, 1, 3000);
+
+    TEST_ASSERT_EQUAL_UINT32(1, result.calls);
+    TEST_ASSERT_EQUAL_INT32(200, result.status);
+    TEST_ASSERT_EQUAL_UINT64(5, result.length);
+    TEST_ASSERT_EQUAL_STRING_LEN("hello", result.body, 5);
+    TEST_ASSERT_EQUAL_STRING("/path?x=1", tracker.last_target);
+    TEST_ASSERT_NULL(client->requests);
+
+    // An empty 200 still comes with a body to read
+    tracker.body = "";
+    tracker.body_length = 0;
+    result.calls = 0;
+    TEST_ASSERT_NOT_NULL(http_client_get(client, url, on_http_result, &result));
+    run_http_loop(loop, nullptr, &result.calls, 1, 3000);
+    TEST_ASSERT_EQUAL_UINT32(1, result.calls);
+    TEST_ASSERT_EQUAL_INT32(200, result.status);
+    TEST_ASSERT_EQUAL_UINT64(0, result.length);
+
+    close_fake_http_tracker(&tracker);
+    http_client_free(client);
+    loop_free(loop);
+    curl_global_cleanup();
+}
+
+void test_http_client_failure(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    event_loop_t* loop = loop_create();
+    http_client_t* client = http_client_create(loop, LOG_NO);
+    // Bound but not listening, so the connection is refused
+    fake_http_tracker_t tracker;
+    open_fake_http_tracker(&tracker, loop, "", 0);
+    close_fake_http_tracker(&tracker);
+
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/announce", tracker.port);
+    http_result_t result = {0};
+    TEST_ASSERT_NOT_NULL(http_client_get(client, url, on_http_result, &result));
+    run_http_loop(loop, nullptr, &result.calls, 1, 3000);
+    TEST_ASSERT_EQUAL_UINT32(1, result.calls);
+    TEST_ASSERT_EQUAL_INT32(0, result.status);
+
+    // Cancelled requests never call back
+    result.calls = 0;
+    http_client_cancel(http_client_get(client, url, on_http_result, &result));
+    TEST_ASSERT_NULL(client->requests);
+    run_http_loop(loop, nullptr, &result.calls, 1, 200);
+    TEST_ASSERT_EQUAL_UINT32(0, result.calls);
+
+    http_client_free(client);
+    loop_free(loop);
+    curl_global_cleanup();
+}
+
+typedef struct {
+    uint32_t calls;
+    bool failed;
+    scraped_data_t first;
+} scrape_result_t;
+
+static void on_scrape(void* ctx, const scraped_data_t* scraped_data, const uint32_t torrent_amount) {
+    scrape_result_t* result = ctx;
+    TEST_ASSERT_EQUAL_UINT32(1, torrent_amount);
+    result->calls++;
+    result->failed = scraped_data == nullptr;
+    if (scraped_data) result->first = scraped_data[0];
+}
+
+void test_http_tracker_scrape(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    event_loop_t* loop = loop_create();
+    http_client_t* client = http_client_create(loop, LOG_NO);
+    unsigned char hash[20];
+    memset(hash, 'a', 20);
+    const char body[] = "d5:filesd20:aaaaaaaaaaaaaaaaaaaad8:completei2e10:downloadedi9e10:incompletei1eeee";
+    fake_http_tracker_t tracker;
+    open_fake_http_tracker(&tracker, loop, body, sizeof(body)-1);
+
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/announce", tracker.port);
+    scrape_result_t result = {0};
+    TEST_ASSERT_TRUE(http_tracker_scrape(client, url, hash, 1, on_scrape, &result));
+    run_http_loop(loop, nullptr, &result.calls, 1, 3000);
+
+    TEST_ASSERT_EQUAL_UINT32(1, result.calls);
+    TEST_ASSERT_FALSE(result.failed);
+    TEST_ASSERT_EQUAL_UINT32(2, result.first.seeders);
+    TEST_ASSERT_EQUAL_UINT32(9, result.first.completed);
+    TEST_ASSERT_EQUAL_UINT32(1, result.first.leechers);
+    TEST_ASSERT_EQUAL_STRING("/scrape?info_hash=aaaaaaaaaaaaaaaaaaaa", tracker.last_target);
+
+    // Freeing the client fails the scrapes still in flight, so they free their state
+    result.calls = 0;
+    TEST_ASSERT_TRUE(http_tracker_scrape(client, url, hash, 1, on_scrape, &result));
+    close_fake_http_tracker(&tracker);
+    http_client_free(client);
+    TEST_ASSERT_EQUAL_UINT32(1, result.calls);
+    TEST_ASSERT_TRUE(result.failed);
+    loop_free(loop);
+    curl_global_cleanup();
+}
+
+typedef struct {
+    uint32_t calls;
+    uint32_t peers;
+    uint32_t peers6;
+} http_peers_received_t;
+
+static void on_http_peers(void* ctx, const unsigned char* compact_peers, const uint32_t peer_amount,
+                          const int32_t family) {
+    http_peers_received_t* received = ctx;
+    (void) compact_peers;
+    received->calls++;
+    if (family == AF_INET6) received->peers6 += peer_amount;
+    else received->peers += peer_amount;
+}
+
+void test_announcer_http_tracker(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    event_loop_t* loop = loop_create();
+    http_client_t* client = http_client_create(loop, LOG_NO);
+    const char body[] = "d8:intervali900e5:peers6:\x7f\x00\x00\x01\x1a\xe1"
+                        "6:peers618:\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x1a\xe3"
+                        "e";
+    fake_http_tracker_t tracker;
+    open_fake_http_tracker(&tracker, loop, body, sizeof(body)-1);
+
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/announce", tracker.port);
+    info_t info = {0};
+    memcpy(info.hash, info_hash, 20);
+    metainfo_t metainfo = {0};
+    metainfo.info = &info;
+    metainfo.announce = url;
+    const torrent_stats_t stats = {.left = 100};
+    http_peers_received_t received = {0};
+    // No UDP client at all: HTTP trackers don't need one
+    announcer_t* announcer = announcer_start(nullptr, client, nullptr, &metainfo, peer_id, &stats, on_http_peers,
+                                             &received, LOG_NO);
+    TEST_ASSERT_NOT_NULL(announcer);
+    run_http_loop(loop, announcer, &received.calls, 2, 3000);
+
+    TEST_ASSERT_EQUAL_UINT32(1, tracker.requests);
+    TEST_ASSERT_NOT_NULL(strstr(tracker.last_target, "event=started"));
+    TEST_ASSERT_NOT_NULL(strstr(tracker.last_target, "compact=1"));
+    TEST_ASSERT_EQUAL_UINT32(1, received.peers);
+    TEST_ASSERT_EQUAL_UINT32(1, received.peers6);
+    TEST_ASSERT_EQUAL(TRACKER_WAITING, announcer->trackers[0].status);
+    TEST_ASSERT_EQUAL_UINT32(900, announcer->trackers[0].interval);
+
+    // The stopped event goes out while the loop keeps running
+    announcer_stop(announcer);
+    const uint32_t expected_requests = 2;
+    run_http_loop(loop, nullptr, &tracker.requests, expected_requests, 3000);
+    TEST_ASSERT_EQUAL_UINT32(2, tracker.requests);
+    TEST_ASSERT_NOT_NULL(strstr(tracker.last_target, "event=stopped"));
+
+    close_fake_http_tracker(&tracker);
+    http_client_free(client);
+    loop_free(loop);
+    curl_global_cleanup();
+}
@@ -0,0 +1,16 @@
+#ifndef BITTORRENT_CLIENT_TEST_HTTP_TRACKER_H
+#define BITTORRENT_CLIENT_TEST_HTTP_TRACKER_H
+
+void test_url_encode_bytes(void);
+void test_build_http_announce_url(void);
+void test_build_http_scrape_url(void);
+void test_parse_http_announce_compact(void);
+void test_parse_http_announce_failure(void);
+void test_compact_peer_list(void);
+void test_parse_http_scrape(void);
+void test_http_client_get(void);
+void test_http_client_failure(void);
+void test_http_tracker_scrape(void);
+void test_announcer_http_tracker(void);
+
+#endif //BITTORRENT_CLIENT_TEST_HTTP_TRACKER_H
@@ -0,0 +1,171 @@
+#include <arpa/inet.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+#include "../src/listener.h"
+
+/// @brief What inbound_callback() got
+typedef struct {
+    uint32_t calls;
+    int32_t socket;
+    struct sockaddr_in address;
+    unsigned char handshake[HANDSHAKE_LEN];
+} inbound_record_t;
+
+static void inbound_callback(void* ctx, const int32_t socket, const struct sockaddr_in* address,
+                             const unsigned char* handshake) {
+    inbound_record_t* record = ctx;
+    record->calls++;
+    record->socket = socket;
+    record->address = *address;
+    memcpy(record->handshake, handshake, HANDSHAKE_LEN);
+}
+
+static int32_t connect_listener(const listener_t* listener) {
+    const int32_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(listener->port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void build_handshake(unsigned char* handshake, const unsigned char* info_hash) {
+    memset(handshake, 0, HANDSHAKE_LEN);
+    handshake[0] = 19;
+    memcpy(handshake + 1, "BitTorrent protocol", 19);
+    memcpy(handshake + 28, info_hash, 20);
+    memset(handshake + 48, 'p', 20);
+}
+
+/**
+ * Runs the torrent's loop until the callback was called, or a second passes
+ */
+static void run_loop(const event_loop_t* loop, const inbound_record_t* record) {
+    struct epoll_event events[4];
+    for (int32_t i = 0; i < 10 && record->calls == 0; ++i) {
+        const int32_t nfds = epoll_wait(loop->epoll, events, 4, 100);
+        for (int32_t j = 0; j < nfds; ++j) loop_dispatch(loop, &events[j]);
+    }
+}
+
+/**
+ * Whether the listener closed the connection within a second
+ */
+static bool closed_by_listener(const int32_t fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) <= 0) return false;
+    char byte;
+    return recv(fd, &byte, 1, 0) <= 0;
+}
+
+void test_listener_start_invalid(void) {
+    TEST_ASSERT_NULL(listener_start(0, 0, LOG_NO));
+    listener_stop(nullptr);
+    listener_unregister(nullptr);
+
+    listener_t* listener = listener_start(0, 2, LOG_NO);
+    TEST_ASSERT_NOT_NULL(listener);
+    TEST_ASSERT_NOT_EQUAL_UINT16(0, listener->port);
+    TEST_ASSERT_EQUAL_UINT32(2, listener->acceptor_amount);
+    listener_stop(listener);
+}
+
+void test_listener_register_twice(void) {
+    listener_t* listener = listener_start(0, 1, LOG_NO);
+    event_loop_t* loop = loop_create();
+    inbound_record_t record = {0};
+    const unsigned char info_hash[20] = {1, 2, 3};
+    TEST_ASSERT_NULL(listener_register(nullptr, info_hash, loop, inbound_callback, &record));
+    TEST_ASSERT_NULL(listener_register(listener, info_hash, loop, nullptr, &record));
+
+    listener_torrent_t* torrent = listener_register(listener, info_hash, loop, inbound_callback, &record);
+    TEST_ASSERT_NOT_NULL(torrent);
+    TEST_ASSERT_NULL(listener_register(listener, info_hash, loop, inbound_callback, &record));
+    listener_unregister(torrent);
+    // Free again once unregistered
+    torrent = listener_register(listener, info_hash, loop, inbound_callback, &record);
+    TEST_ASSERT_NOT_NULL(torrent);
+    listener_unregister(torrent);
+    loop_free(loop);
+    listener_stop(listener);
+}
+
+void test_listener_hands_over_peer(void) {
+    listener_t* listener = listener_start(0, 2, LOG_NO);
+    TEST_ASSERT_NOT_NULL(listener);
+    event_loop_t* loop = loop_create();
+    inbound_record_t record = {0};
+    const unsigned char info_hash[20] = {0xAB, 0xCD, 0xEF};
+    listener_torrent_t* torrent = listener_register(listener, info_hash, loop, inbound_callback, &record);
+
+    const int32_t fd = connect_listener(listener);
+    TEST_ASSERT_TRUE(fd >= 0);
+    unsigned char handshake[HANDSHAKE_LEN + 4];
+    build_handshake(handshake, info_hash);
+    // Whatever follows the handshake is left for the torrent to read
+    memcpy(handshake + HANDSHAKE_LEN, "\0\0\0\0", 4);
+    // Split, the rest arrives later
+    TEST_ASSERT_EQUAL_INT(10, send(fd, handshake, 10, 0));
+    usleep(20000);
+    TEST_ASSERT_EQUAL_INT(HANDSHAKE_LEN + 4 - 10, send(fd, handshake + 10, HANDSHAKE_LEN + 4 - 10, 0));
+
+    run_loop(loop, &record);
+    TEST_ASSERT_EQUAL_UINT32(1, record.calls);
+    TEST_ASSERT_EQUAL_MEMORY(handshake, record.handshake, HANDSHAKE_LEN);
+    TEST_ASSERT_EQUAL_UINT32(htonl(INADDR_LOOPBACK), record.address.sin_addr.s_addr);
+    unsigned char rest[4];
+    TEST_ASSERT_EQUAL_INT(4, recv(record.socket, rest, sizeof(rest), 0));
+
+    // The socket is the torrent's now, and talks to the peer
+    TEST_ASSERT_EQUAL_INT(1, send(record.socket, "x", 1, 0));
+    char byte;
+    TEST_ASSERT_EQUAL_INT(1, recv(fd, &byte, 1, 0));
+    close(record.socket);
+    close(fd);
+    listener_unregister(torrent);
+    loop_free(loop);
+    listener_stop(listener);
+}
+
+void test_listener_closes_unknown_torrent(void) {
+    listener_t* listener = listener_start(0, 1, LOG_NO);
+    const unsigned char info_hash[20] = {9, 9, 9};
+    unsigned char handshake[HANDSHAKE_LEN];
+
+    // Nobody registered it
+    int32_t fd = connect_listener(listener);
+    build_handshake(handshake, info_hash);
+    TEST_ASSERT_EQUAL_INT(HANDSHAKE_LEN, send(fd, handshake, HANDSHAKE_LEN, 0));
+    TEST_ASSERT_TRUE(closed_by_listener(fd));
+    close(fd);
+
+    // Not BitTorrent at all
+    fd = connect_listener(listener);
+    memset(handshake, 'G', HANDSHAKE_LEN);
+    TEST_ASSERT_EQUAL_INT(HANDSHAKE_LEN, send(fd, handshake, HANDSHAKE_LEN, 0));
+    TEST_ASSERT_TRUE(closed_by_listener(fd));
+    close(fd);
+    listener_stop(listener);
+}
+
+void test_listener_limits_per_address(void) {
+    listener_t* listener = listener_start(0, 1, LOG_NO);
+    int32_t fds[LISTENER_IP_MAX + 1];
+    for (uint32_t i = 0; i <= LISTENER_IP_MAX; ++i) {
+        fds[i] = connect_listener(listener);
+        TEST_ASSERT_TRUE(fds[i] >= 0);
+    }
+    // Only the one over the limit is closed, the rest wait for their handshake
+    TEST_ASSERT_TRUE(closed_by_listener(fds[LISTENER_IP_MAX]));
+    struct pollfd pfd = {fds[0], POLLIN, 0};
+    TEST_ASSERT_EQUAL_INT(0, poll(&pfd, 1, 0));
+    for (uint32_t i = 0; i <= LISTENER_IP_MAX; ++i) close(fds[i]);
+    listener_stop(listener);
+}
@@ -0,0 +1,10 @@
+#ifndef BITTORRENT_CLIENT_TEST_LISTENER_H
+#define BITTORRENT_CLIENT_TEST_LISTENER_H
+
+void test_listener_start_invalid(void);
+void test_listener_register_twice(void);
+void test_listener_hands_over_peer(void);
+void test_listener_closes_unknown_torrent(void);
+void test_listener_limits_per_address(void);
+
+#endif //BITTORRENT_CLIENT_TEST_LISTENER_H
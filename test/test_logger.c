@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "unity.h"
+#include "../src/logger.h"
+
+static int32_t saved_stdout = -1;
+static FILE* capture = nullptr;
+
+/**
+ * Sends stdout to a temporary file, so logged messages can be checked
+ */
+static void start_capture(void) {
+    fflush(stdout);
+    capture = tmpfile();
+    TEST_ASSERT_NOT_NULL(capture);
+    saved_stdout = dup(STDOUT_FILENO);
+    dup2(fileno(capture), STDOUT_FILENO);
+}
+
+/**
+ * Restores stdout and returns everything written since start_capture()
+ */
+static char* stop_capture(void) {
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    const long length = ftell(capture);
+    char* text = calloc(length + 1, 1);
+    rewind(capture);
+    TEST_ASSERT_EQUAL_UINT64(length, fread(text, 1, length, capture));
+    fclose(capture);
+    return text;
+}
+
+static uint32_t count_lines(const char* text, const char* prefix) {
+    uint32_t lines = 0;
+    for (const char* line = strstr(text, prefix); line; line = strstr(line + 1, prefix)) lines++;
+    return lines;
+}
+
+static void* log_lines(void* arg) {
+    const uintptr_t thread = (uintptr_t) arg;
+    for (uint32_t i = 0; i < 200; ++i) log_printf(LOG_FULL, LOG_FULL, "thread %lu line %u\n", thread, i);
+    return nullptr;
+}
+
+void test_logger_levels(void) {
+    TEST_ASSERT_TRUE(LOG_ENABLED(LOG_FULL, LOG_FULL));
+    TEST_ASSERT_TRUE(LOG_ENABLED(LOG_SUMM, LOG_ERR));
+    TEST_ASSERT_FALSE(LOG_ENABLED(LOG_SUMM, LOG_FULL));
+    TEST_ASSERT_FALSE(LOG_ENABLED(LOG_NO, LOG_ERR));
+
+    // Without the drain thread, messages are printed right away
+    start_capture();
+    log_printf(LOG_SUMM, LOG_SUMM, "shown %d\n", 1);
+    log_printf(LOG_SUMM, LOG_FULL, "hidden %d\n", 2);
+    char* text = stop_capture();
+    TEST_ASSERT_EQUAL_STRING("shown 1\n", text);
+    free(text);
+}
+
+void test_logger_threads(void) {
+    start_capture();
+    TEST_ASSERT_TRUE(logger_start());
+    // The drain thread sleeps until something is logged
+    log_printf(LOG_FULL, LOG_FULL, "wake up\n");
+    for (uint32_t i = 0; i < 100 && ftell(capture) == 0; ++i) {
+        const struct timespec wait = {0, 10000000};
+        nanosleep(&wait, nullptr);
+    }
+    TEST_ASSERT_EQUAL_INT64(sizeof("wake up\n") - 1, ftell(capture));
+    pthread_t threads[3];
+    for (uintptr_t i = 0; i < 3; ++i) pthread_create(&threads[i], nullptr, log_lines, (void*) i);
+    for (uint32_t i = 0; i < 3; ++i) pthread_join(threads[i], nullptr);
+    logger_stop();
+    char* text = stop_capture();
+
+    TEST_ASSERT_EQUAL_UINT32(600, count_lines(text, "thread "));
+    // Each thread's messages keep their order
+    const char* first = strstr(text, "thread 1 line 0\n");
+    const char* last = strstr(text, "thread 1 line 199\n");
+    TEST_ASSERT_NOT_NULL(first);
+    TEST_ASSERT_NOT_NULL(last);
+    TEST_ASSERT_TRUE(first < last);
+    free(text);
+}
+
+void test_logger_hex_rate_limit(void) {
+    const unsigned char payload[100] = {0x01, 0x23, 0x45, 0x67, 0x89};
+    // Starting right after a second begins, so every dump falls in the same second
+    while (monotonic_us() % 1000000 > 100000) {
+        const struct timespec wait = {0, 10000000};
+        nanosleep(&wait, nullptr);
+    }
+
+    start_capture();
+    TEST_ASSERT_TRUE(logger_start());
+    for (uint32_t i = 0; i < LOG_HEX_PER_SECOND + 5; ++i) log_hex(LOG_FULL, LOG_FULL, "dump", payload, 100);
+    logger_stop();
+    char* text = stop_capture();
+
+    TEST_ASSERT_EQUAL_UINT32(LOG_HEX_PER_SECOND, count_lines(text, "dump (100 bytes):"));
+    // Only the first LOG_HEX_MAX_BYTES are shown, grouped by 4 bytes
+    TEST_ASSERT_NOT_NULL(strstr(text, "dump (100 bytes): 01234567 89000000 "));
+    TEST_ASSERT_NOT_NULL(strstr(text, " ...\n"));
+    free(text);
+}
@@ -0,0 +1,8 @@
+#ifndef BITTORRENT_CLIENT_TEST_LOGGER_H
+#define BITTORRENT_CLIENT_TEST_LOGGER_H
+
+void test_logger_levels(void);
+void test_logger_threads(void);
+void test_logger_hex_rate_limit(void);
+
+#endif //BITTORRENT_CLIENT_TEST_LOGGER_H
@@ -0,0 +1,133 @@
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "unity.h"
+#include "../src/lsd.h"
+
+static const unsigned char info_hash[20] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10,
+    0xaa, 0xbb, 0xcc, 0xdd
+};
+
+void test_lsd_announce_round_trip(void) {
+    char buffer[LSD_MESSAGE_MAX];
+    const uint32_t length = lsd_build_announce(buffer, info_hash, 6881, "c00k1e");
+    const char expected[] = "BT-SEARCH * HTTP/1.1\r\nHost: 239.192.152.143:6771\r\nPort: 6881\r\n"
+                            "Infohash: 0123456789abcdeffedcba9876543210aabbccdd\r\ncookie: c00k1e\r\n\r\n\r\n";
+    TEST_ASSERT_EQUAL_UINT32(sizeof(expected) - 1, length);
+    TEST_ASSERT_EQUAL_MEMORY(expected, buffer, length);
+
+    uint16_t port;
+    const char* cookie;
+    uint32_t cookie_length;
+    TEST_ASSERT_TRUE(lsd_parse_announce(buffer, length, info_hash, &port, &cookie, &cookie_length));
+    TEST_ASSERT_EQUAL_UINT16(6881, port);
+    TEST_ASSERT_EQUAL_UINT32(6, cookie_length);
+    TEST_ASSERT_EQUAL_MEMORY("c00k1e", cookie, 6);
+
+    // Other clients use bare \n, upper case hex and several torrents per announce
+    const char other[] = "BT-SEARCH * HTTP/1.1\nHost: 239.192.152.143:6771\nport: 51413\n"
+                         "Infohash: 00000000000000000000000000000000000000FF\n"
+                         "Infohash: 0123456789ABCDEFFEDCBA9876543210AABBCCDD\n\n\n";
+    TEST_ASSERT_TRUE(lsd_parse_announce(other, sizeof(other) - 1, info_hash, &port, &cookie, &cookie_length));
+    TEST_ASSERT_EQUAL_UINT16(51413, port);
+    TEST_ASSERT_NULL(cookie);
+}
+
+void test_lsd_parse_announce_rejects(void) {
+    uint16_t port;
+    const char* cookie;
+    uint32_t cookie_length;
+    const unsigned char other_hash[20] = {0};
+    char buffer[LSD_MESSAGE_MAX];
+    const uint32_t length = lsd_build_announce(buffer, info_hash, 6881, "c00k1e");
+    TEST_ASSERT_FALSE(lsd_parse_announce(buffer, length, other_hash, &port, &cookie, &cookie_length));
+
+    const char* rejected[] = {
+        // Not an announce
+        "M-SEARCH * HTTP/1.1\r\nPort: 6881\r\nInfohash: 0123456789abcdeffedcba9876543210aabbccdd\r\n\r\n",
+        // No port, or a bad one
+        "BT-SEARCH * HTTP/1.1\r\nInfohash: 0123456789abcdeffedcba9876543210aabbccdd\r\n\r\n",
+        "BT-SEARCH * HTTP/1.1\r\nPort: 0\r\nInfohash: 0123456789abcdeffedcba9876543210aabbccdd\r\n\r\n",
+        "BT-SEARCH * HTTP/1.1\r\nPort: 70000\r\nInfohash: 0123456789abcdeffedcba9876543210aabbccdd\r\n\r\n",
+        "BT-SEARCH * HTTP/1.1\r\nPort: 68x1\r\nInfohash: 0123456789abcdeffedcba9876543210aabbccdd\r\n\r\n",
+        // Truncated or invalid info hash
+        "BT-SEARCH * HTTP/1.1\r\nPort: 6881\r\nInfohash: 0123456789abcdeffedcba9876543210aabbcc\r\n\r\n",
+        "BT-SEARCH * HTTP/1.1\r\nPort: 6881\r\nInfohash: 0123456789abcdeffedcba9876543210aabbccdg\r\n\r\n",
+    };
+    for (uint32_t i = 0; i < sizeof(rejected) / sizeof(rejected[0]); ++i) {
+        TEST_ASSERT_FALSE(lsd_parse_announce(rejected[i], strlen(rejected[i]), info_hash, &port, &cookie,
+                                             &cookie_length));
+    }
+    TEST_ASSERT_FALSE(lsd_parse_announce(nullptr, 0, info_hash, &port, &cookie, &cookie_length));
+}
+
+void test_lsd_is_local_address(void) {
+    local_network_t networks[1];
+    inet_pton(AF_INET, "192.168.1.20", &networks[0].address);
+    inet_pton(AF_INET, "255.255.255.0", &networks[0].mask);
+    uint32_t address;
+    inet_pton(AF_INET, "192.168.1.77", &address);
+    TEST_ASSERT_TRUE(is_local_address(networks, 1, address));
+    inet_pton(AF_INET, "192.168.2.77", &address);
+    TEST_ASSERT_FALSE(is_local_address(networks, 1, address));
+    inet_pton(AF_INET, "8.8.8.8", &address);
+    TEST_ASSERT_FALSE(is_local_address(networks, 1, address));
+    // Loopback is local without any network
+    inet_pton(AF_INET, "127.0.0.1", &address);
+    TEST_ASSERT_TRUE(is_local_address(nullptr, 0, address));
+}
+
+/// @brief Peers lsd_peers_callback() got
+typedef struct {
+    uint32_t amount;
+    unsigned char peer[COMPACT_PEER_V4_SIZE];
+} lsd_record_t;
+
+static void lsd_peers_callback(void* ctx, const unsigned char* compact_peers, const uint32_t peer_amount,
+                               const int32_t family) {
+    lsd_record_t* record = ctx;
+    TEST_ASSERT_EQUAL_INT32(AF_INET, family);
+    record->amount += peer_amount;
+    memcpy(record->peer, compact_peers, COMPACT_PEER_V4_SIZE);
+}
+
+void test_lsd_discovers_peer(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    TEST_ASSERT_NOT_NULL(loop);
+    TEST_ASSERT_NOT_NULL(timers);
+    lsd_record_t first_record = {0};
+    lsd_record_t second_record = {0};
+    // The first one only listens, so it hears nothing of its own
+    lsd_t* first = lsd_create(loop, timers, info_hash, 0, lsd_peers_callback, &first_record, LOG_NO);
+    if (!first) {
+        timer_wheel_free(timers);
+        loop_free(loop);
+        TEST_IGNORE_MESSAGE("Multicast isn't available");
+    }
+    lsd_t* second = lsd_create(loop, timers, info_hash, 6881, lsd_peers_callback, &second_record, LOG_NO);
+    TEST_ASSERT_NOT_NULL(second);
+
+    const uint64_t deadline = monotonic_coarse_ms() + 1000;
+    while (first_record.amount == 0 && monotonic_coarse_ms() < deadline) {
+        struct epoll_event events[4];
+        const int32_t nfds = epoll_wait(loop->epoll, events, 4, 10);
+        timer_wheel_advance(timers, monotonic_coarse_ms());
+        for (int32_t i = 0; i < nfds; ++i) loop_dispatch(loop, &events[i]);
+    }
+    const uint32_t heard = first_record.amount;
+    lsd_free(second);
+    lsd_free(first);
+    timer_wheel_free(timers);
+    loop_free(loop);
+    // Hosts without a multicast route can't send the announce
+    if (heard == 0) TEST_IGNORE_MESSAGE("Multicast announces don't loop back here");
+
+    TEST_ASSERT_EQUAL_UINT32(1, heard);
+    uint16_t port;
+    memcpy(&port, first_record.peer + 4, 2);
+    TEST_ASSERT_EQUAL_UINT16(6881, ntohs(port));
+    // Our own announce is told apart by its cookie
+    TEST_ASSERT_EQUAL_UINT32(0, second_record.amount);
+}
@@ -0,0 +1,9 @@
+#ifndef BITTORRENT_CLIENT_TEST_LSD_H
+#define BITTORRENT_CLIENT_TEST_LSD_H
+
+void test_lsd_announce_round_trip(void);
+void test_lsd_parse_announce_rejects(void);
+void test_lsd_is_local_address(void);
+void test_lsd_discovers_peer(void);
+
+#endif //BITTORRENT_CLIENT_TEST_LSD_H
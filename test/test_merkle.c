@@ -0,0 +1,340 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+
+#include "unity.h"
+#include "../src/downloading.h"
+#include "../src/merkle.h"
+#include "../src/messages.h"
+#include "../src/messages_types.h"
+
+/// @brief Piece length of the test torrents, two blocks
+#define V2_PIECE_LENGTH 32768
+/// @brief Bytes of the first file, three blocks spanning two pieces
+#define V2_A_LENGTH 40000
+/// @brief Bytes of the second file, a single block
+#define V2_B_LENGTH 10000
+
+/// @brief Contents and hashes of the files of the test torrents
+typedef struct {
+    unsigned char a[V2_A_LENGTH];
+    unsigned char b[V2_B_LENGTH];
+    unsigned char a_leaves[3 * MERKLE_HASH_SIZE];
+    unsigned char a_layer[2 * MERKLE_HASH_SIZE];
+    unsigned char a_root[MERKLE_HASH_SIZE];
+    unsigned char b_root[MERKLE_HASH_SIZE];
+} v2_files_t;
+
+static void v2_files(v2_files_t* files) {
+    for (uint32_t i = 0; i < V2_A_LENGTH; ++i) files->a[i] = (unsigned char) (i * 7);
+    for (uint32_t i = 0; i < V2_B_LENGTH; ++i) files->b[i] = (unsigned char) (i * 13 + 1);
+    for (uint32_t i = 0; i < 3; ++i) {
+        const uint32_t length = i == 2 ? V2_A_LENGTH - 2 * MERKLE_BLOCK_SIZE : MERKLE_BLOCK_SIZE;
+        merkle_hash_leaf(files->a + i * MERKLE_BLOCK_SIZE, length, files->a_leaves + i * MERKLE_HASH_SIZE);
+    }
+    // Each piece layer hash covers the two leaves of its piece, the last one padded with a zero leaf
+    merkle_root(files->a_leaves, 2, 0, 2, files->a_layer);
+    merkle_root(files->a_leaves + 2 * MERKLE_HASH_SIZE, 1, 0, 2, files->a_layer + MERKLE_HASH_SIZE);
+    merkle_root(files->a_layer, 2, 1, 2, files->a_root);
+    merkle_hash_leaf(files->b, V2_B_LENGTH, files->b_root);
+}
+
+static uint32_t put(char* buffer, const uint32_t at, const void* data, const uint32_t length) {
+    memcpy(buffer + at, data, length);
+    return at + length;
+}
+
+static uint32_t put_text(char* buffer, const uint32_t at, const char* text) {
+    return put(buffer, at, text, strlen(text));
+}
+
+/**
+ * Bencodes a torrent of the two files, v2 only or hybrid, optionally with a piece layer that doesn't match its root
+ */
+static uint32_t v2_torrent(const v2_files_t* files, char* buffer, const bool hybrid, const bool bad_layer) {
+    uint32_t at = put_text(buffer, 0, "d8:announce23:http://tracker/announce4:infod9:file treed1:ad0:d6:lengthi40000e"
+                                      "11:pieces root32:");
+    at = put(buffer, at, files->a_root, MERKLE_HASH_SIZE);
+    at = put_text(buffer, at, "ee1:bd0:d6:lengthi10000e11:pieces root32:");
+    at = put(buffer, at, files->b_root, MERKLE_HASH_SIZE);
+    at = put_text(buffer, at, "eee");
+    if (hybrid) {
+        at = put_text(buffer, at, "5:filesld6:lengthi40000e4:pathl1:aeed4:attr1:p6:lengthi25536e4:pathl4:.pad"
+                                  "5:25536eed6:lengthi10000e4:pathl1:beee");
+    }
+    at = put_text(buffer, at, "12:meta versioni2e4:name4:test12:piece lengthi32768e");
+    if (hybrid) {
+        unsigned char padded[V2_PIECE_LENGTH] = {0};
+        memcpy(padded, files->a + V2_PIECE_LENGTH, V2_A_LENGTH - V2_PIECE_LENGTH);
+        unsigned char pieces[60];
+        SHA1(files->a, V2_PIECE_LENGTH, pieces);
+        SHA1(padded, V2_PIECE_LENGTH, pieces + 20);
+        SHA1(files->b, V2_B_LENGTH, pieces + 40);
+        at = put_text(buffer, at, "6:pieces60:");
+        at = put(buffer, at, pieces, sizeof(pieces));
+    }
+    at = put_text(buffer, at, "e12:piece layersd32:");
+    at = put(buffer, at, files->a_root, MERKLE_HASH_SIZE);
+    at = put_text(buffer, at, "64:");
+    const uint32_t layer_at = at;
+    at = put(buffer, at, files->a_layer, sizeof(files->a_layer));
+    if (bad_layer) buffer[layer_at] ^= 1;
+    at = put_text(buffer, at, "ee");
+    buffer[at] = '\0';
+    return at;
+}
+
+void test_merkle_root(void) {
+    unsigned char leaves[3 * MERKLE_HASH_SIZE];
+    for (uint32_t i = 0; i < sizeof(leaves); ++i) leaves[i] = (unsigned char) i;
+    // Built by hand: the missing fourth leaf is all zeros
+    unsigned char pair[2 * MERKLE_HASH_SIZE];
+    unsigned char left[MERKLE_HASH_SIZE];
+    unsigned char right[MERKLE_HASH_SIZE];
+    unsigned char expected[MERKLE_HASH_SIZE];
+    SHA256(leaves, sizeof(pair), left);
+    memcpy(pair, leaves + 2 * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE);
+    memset(pair + MERKLE_HASH_SIZE, 0, MERKLE_HASH_SIZE);
+    SHA256(pair, sizeof(pair), right);
+    memcpy(pair, left, MERKLE_HASH_SIZE);
+    memcpy(pair + MERKLE_HASH_SIZE, right, MERKLE_HASH_SIZE);
+    SHA256(pair, sizeof(pair), expected);
+
+    unsigned char root[MERKLE_HASH_SIZE];
+    TEST_ASSERT_TRUE(merkle_root(leaves, 3, 0, 4, root));
+    TEST_ASSERT_EQUAL_MEMORY(expected, root, MERKLE_HASH_SIZE);
+    // Climbing from the third leaf with its uncles gets there too
+    unsigned char uncles[2 * MERKLE_HASH_SIZE] = {0};
+    memcpy(uncles + MERKLE_HASH_SIZE, left, MERKLE_HASH_SIZE);
+    memcpy(root, leaves + 2 * MERKLE_HASH_SIZE, MERKLE_HASH_SIZE);
+    merkle_climb(root, 2, uncles, 2);
+    TEST_ASSERT_EQUAL_MEMORY(expected, root, MERKLE_HASH_SIZE);
+
+    // A subtree of padding is the padding of its height
+    unsigned char pad[MERKLE_HASH_SIZE];
+    memcpy(pair, right, MERKLE_HASH_SIZE);
+    merkle_pad_hash(1, pad);
+    memcpy(pair + MERKLE_HASH_SIZE, pad, MERKLE_HASH_SIZE);
+    SHA256(pair, sizeof(pair), expected);
+    TEST_ASSERT_TRUE(merkle_root(right, 1, 1, 2, root));
+    TEST_ASSERT_EQUAL_MEMORY(expected, root, MERKLE_HASH_SIZE);
+
+    TEST_ASSERT_FALSE(merkle_root(leaves, 3, 0, 2, root));
+    TEST_ASSERT_FALSE(merkle_root(leaves, 0, 0, 2, root));
+    TEST_ASSERT_EQUAL_UINT32(0, merkle_height(1));
+    TEST_ASSERT_EQUAL_UINT32(2, merkle_height(3));
+    TEST_ASSERT_EQUAL_UINT32(2, merkle_height(4));
+}
+
+void test_parse_metainfo_v2(void) {
+    v2_files_t* files = malloc(sizeof(v2_files_t));
+    v2_files(files);
+    char buffer[1024];
+    const uint32_t length = v2_torrent(files, buffer, false, false);
+    metainfo_t* metainfo = parse_metainfo(buffer, length, LOG_NO);
+    TEST_ASSERT_NOT_NULL(metainfo);
+    const info_t* info = metainfo->info;
+    TEST_ASSERT_EQUAL_UINT8(2, info->meta_version);
+    TEST_ASSERT_NULL(info->pieces);
+    TEST_ASSERT_EQUAL_STRING("test", info->name);
+    TEST_ASSERT_EQUAL_UINT32(V2_PIECE_LENGTH, info->piece_length);
+    TEST_ASSERT_EQUAL_UINT32(3, info->piece_number);
+
+    // The second file starts the third piece, after padding
+    const files_ll* a = info->files;
+    TEST_ASSERT_EQUAL_STRING("a", a->path->val);
+    TEST_ASSERT_EQUAL_INT64(0, a->byte_index);
+    TEST_ASSERT_EQUAL_MEMORY(files->a_root, a->pieces_root, MERKLE_HASH_SIZE);
+    TEST_ASSERT_EQUAL_MEMORY(files->a_layer, a->piece_layer, sizeof(files->a_layer));
+    const files_ll* padding = a->next;
+    TEST_ASSERT_TRUE(padding->padding);
+    TEST_ASSERT_EQUAL_INT64(2 * V2_PIECE_LENGTH - V2_A_LENGTH, padding->length);
+    const files_ll* b = padding->next;
+    TEST_ASSERT_EQUAL_STRING("b", b->path->val);
+    TEST_ASSERT_EQUAL_INT64(2 * V2_PIECE_LENGTH, b->byte_index);
+    TEST_ASSERT_EQUAL_UINT32(2, b->first_piece);
+    TEST_ASSERT_NULL(b->piece_layer);
+    TEST_ASSERT_NULL(b->next);
+    TEST_ASSERT_EQUAL_INT64(2 * V2_PIECE_LENGTH + V2_B_LENGTH, info->length);
+    TEST_ASSERT_EQUAL_PTR(a, info->piece_files[1]);
+    TEST_ASSERT_EQUAL_PTR(b, info->piece_files[2]);
+
+    // Pieces stop at the end of their file, and padding isn't downloaded
+    TEST_ASSERT_EQUAL_UINT32(V2_PIECE_LENGTH, piece_size(info, 0));
+    TEST_ASSERT_EQUAL_UINT32(V2_A_LENGTH - V2_PIECE_LENGTH, piece_size(info, 1));
+    TEST_ASSERT_EQUAL_UINT32(V2_B_LENGTH, piece_size(info, 2));
+    TEST_ASSERT_EQUAL_UINT32(0, piece_size(info, 3));
+    TEST_ASSERT_EQUAL_UINT64(V2_A_LENGTH + V2_B_LENGTH, download_length(info));
+
+    // Known by the truncated SHA-256 of the info dictionary
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*) info->info_dict, info->info_dict_length, hash);
+    TEST_ASSERT_EQUAL_MEMORY(hash, info->hash_v2, SHA256_DIGEST_LENGTH);
+    TEST_ASSERT_EQUAL_MEMORY(hash, info->hash, 20);
+    free_metainfo(metainfo);
+
+    // A piece layer not leading to its root is refused
+    const uint32_t bad_length = v2_torrent(files, buffer, false, true);
+    TEST_ASSERT_NULL(parse_metainfo(buffer, bad_length, LOG_NO));
+    free(files);
+}
+
+void test_parse_metainfo_hybrid(void) {
+    v2_files_t* files = malloc(sizeof(v2_files_t));
+    v2_files(files);
+    char buffer[1024];
+    const uint32_t length = v2_torrent(files, buffer, true, false);
+    metainfo_t* metainfo = parse_metainfo(buffer, length, LOG_NO);
+    TEST_ASSERT_NOT_NULL(metainfo);
+    const info_t* info = metainfo->info;
+    TEST_ASSERT_EQUAL_UINT8(2, info->meta_version);
+    TEST_ASSERT_NOT_NULL(info->pieces);
+    TEST_ASSERT_EQUAL_UINT32(3, info->piece_number);
+    // Pieces keep their v1 size, padding included
+    TEST_ASSERT_EQUAL_UINT32(V2_PIECE_LENGTH, piece_size(info, 1));
+    TEST_ASSERT_EQUAL_UINT64(info->length, download_length(info));
+    // Known by the SHA1 of the info dictionary, so v1 peers find it too
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1((const unsigned char*) info->info_dict, info->info_dict_length, hash);
+    TEST_ASSERT_EQUAL_MEMORY(hash, info->hash, SHA_DIGEST_LENGTH);
+    free_metainfo(metainfo);
+    free(files);
+}
+
+void test_merkle_hashes(void) {
+    v2_files_t* files = malloc(sizeof(v2_files_t));
+    v2_files(files);
+    char buffer[1024];
+    metainfo_t* metainfo = parse_metainfo(buffer, v2_torrent(files, buffer, false, false), LOG_NO);
+    TEST_ASSERT_NOT_NULL(metainfo);
+    merkle_t* merkle = merkle_create(metainfo->info, V2_PIECE_LENGTH / BLOCK_SIZE);
+    TEST_ASSERT_NOT_NULL(merkle);
+
+    // The single block of the second file is its root, so it's known right away
+    TEST_ASSERT_EQUAL_INT(MERKLE_BLOCK_VALID, merkle_check_block(merkle, 2, 0, files->b, V2_B_LENGTH));
+    unsigned char payloads[MERKLE_MAX_REQUESTS * HASH_REQUEST_SIZE];
+    TEST_ASSERT_EQUAL_UINT32(0, merkle_hash_requests(merkle, 2, payloads));
+
+    // Both leaves of the first piece, proven by one uncle: the parent of the third leaf
+    TEST_ASSERT_EQUAL_INT(MERKLE_BLOCK_UNKNOWN, merkle_check_block(merkle, 0, 0, files->a, BLOCK_SIZE));
+    TEST_ASSERT_EQUAL_UINT32(1, merkle_hash_requests(merkle, 0, payloads));
+    TEST_ASSERT_EQUAL_MEMORY(files->a_root, payloads, MERKLE_HASH_SIZE);
+    const uint32_t expected_fields[4] = {htonl(0), htonl(0), htonl(2), htonl(1)};
+    TEST_ASSERT_EQUAL_MEMORY(expected_fields, payloads + MERKLE_HASH_SIZE, sizeof(expected_fields));
+    // Already asked
+    TEST_ASSERT_EQUAL_UINT32(0, merkle_hash_requests(merkle, 0, payloads));
+
+    unsigned char hashes[HASH_REQUEST_SIZE + 3 * MERKLE_HASH_SIZE];
+    memcpy(hashes, payloads, HASH_REQUEST_SIZE);
+    memcpy(hashes + HASH_REQUEST_SIZE, files->a_leaves, 2 * MERKLE_HASH_SIZE);
+    memcpy(hashes + HASH_REQUEST_SIZE + 2 * MERKLE_HASH_SIZE, files->a_layer + MERKLE_HASH_SIZE, MERKLE_HASH_SIZE);
+    hashes[HASH_REQUEST_SIZE] ^= 1;
+    TEST_ASSERT_EQUAL_INT(MERKLE_HASHES_INVALID, merkle_add_hashes(merkle, hashes, sizeof(hashes)));
+    TEST_ASSERT_EQUAL_INT(MERKLE_BLOCK_UNKNOWN, merkle_check_block(merkle, 0, 0, files->a, BLOCK_SIZE));
+    // Without the uncle they can't be proven
+    hashes[HASH_REQUEST_SIZE] ^= 1;
+    TEST_ASSERT_EQUAL_INT(MERKLE_HASHES_IGNORED, merkle_add_hashes(merkle, hashes, sizeof(hashes) - MERKLE_HASH_SIZE));
+    TEST_ASSERT_EQUAL_INT(MERKLE_HASHES_STORED, merkle_add_hashes(merkle, hashes, sizeof(hashes)));
+
+    // Blocks are now told apart as they arrive
+    TEST_ASSERT_EQUAL_INT(MERKLE_BLOCK_VALID, merkle_check_block(merkle, 0, BLOCK_SIZE, files->a + BLOCK_SIZE,
+                                                                 BLOCK_SIZE));
+    unsigned char* corrupt_block = malloc(BLOCK_SIZE);
+    memcpy(corrupt_block, files->a, BLOCK_SIZE);
+    corrupt_block[100] ^= 0xff;
+    TEST_ASSERT_EQUAL_INT(MERKLE_BLOCK_CORRUPT, merkle_check_block(merkle, 0, 0, corrupt_block, BLOCK_SIZE));
+    free(corrupt_block);
+
+    // Rejected requests are asked again
+    TEST_ASSERT_EQUAL_UINT32(1, merkle_hash_requests(merkle, 1, payloads));
+    TEST_ASSERT_EQUAL_UINT32(0, merkle_hash_requests(merkle, 1, payloads));
+    merkle_hashes_rejected(merkle, payloads, HASH_REQUEST_SIZE);
+    TEST_ASSERT_EQUAL_UINT32(1, merkle_hash_requests(merkle, 1, payloads));
+
+    merkle_free(merkle);
+    free_metainfo(metainfo);
+    free(files);
+}
+
+void test_merkle_check_piece(void) {
+    v2_files_t* files = malloc(sizeof(v2_files_t));
+    v2_files(files);
+    char buffer[1024];
+    metainfo_t* metainfo = parse_metainfo(buffer, v2_torrent(files, buffer, false, false), LOG_NO);
+    TEST_ASSERT_NOT_NULL(metainfo);
+    merkle_t* merkle = merkle_create(metainfo->info, V2_PIECE_LENGTH / BLOCK_SIZE);
+    bool corrupt[2] = {false};
+
+    // Checked against the piece layer, then its leaves are kept
+    TEST_ASSERT_EQUAL_INT32(0, merkle_check_piece(merkle, 0, files->a, V2_PIECE_LENGTH, corrupt));
+    TEST_ASSERT_EQUAL_INT(MERKLE_BLOCK_VALID, merkle_check_block(merkle, 0, 0, files->a, BLOCK_SIZE));
+    // With every leaf known, only the corrupt block is pointed at
+    unsigned char* piece = malloc(V2_PIECE_LENGTH);
+    memcpy(piece, files->a, V2_PIECE_LENGTH);
+    piece[BLOCK_SIZE + 5] ^= 1;
+    TEST_ASSERT_EQUAL_INT32(1, merkle_check_piece(merkle, 0, piece, V2_PIECE_LENGTH, corrupt));
+    TEST_ASSERT_FALSE(corrupt[0]);
+    TEST_ASSERT_TRUE(corrupt[1]);
+
+    // The last piece of a file only has its own bytes
+    const uint32_t last_length = V2_A_LENGTH - V2_PIECE_LENGTH;
+    memcpy(piece, files->a + V2_PIECE_LENGTH, last_length);
+    piece[0] ^= 1;
+    corrupt[0] = false;
+    TEST_ASSERT_EQUAL_INT32(1, merkle_check_piece(merkle, 1, piece, last_length, corrupt));
+    TEST_ASSERT_TRUE(corrupt[0]);
+    piece[0] ^= 1;
+    TEST_ASSERT_EQUAL_INT32(0, merkle_check_piece(merkle, 1, piece, last_length, corrupt));
+    TEST_ASSERT_EQUAL_INT32(0, merkle_check_piece(merkle, 2, files->b, V2_B_LENGTH, corrupt));
+    free(piece);
+    merkle_free(merkle);
+    free_metainfo(metainfo);
+
+    // Without piece layers, as built from a magnet link, there's nothing to check pieces of large files against
+    const uint32_t length = v2_torrent(files, buffer, false, false);
+    char* layers = memmem(buffer, length, "12:piece layers", 15);
+    strcpy(layers, "e");
+    metainfo = parse_metainfo(buffer, layers + 1 - buffer, LOG_NO);
+    TEST_ASSERT_NOT_NULL(metainfo);
+    merkle = merkle_create(metainfo->info, V2_PIECE_LENGTH / BLOCK_SIZE);
+    TEST_ASSERT_EQUAL_INT32(-1, merkle_check_piece(merkle, 0, files->a, V2_PIECE_LENGTH, corrupt));
+    merkle_free(merkle);
+    free_metainfo(metainfo);
+    free(files);
+}
+
+void test_padding_is_not_written(void) {
+    v2_files_t* files = malloc(sizeof(v2_files_t));
+    v2_files(files);
+    char buffer[1024];
+    metainfo_t* metainfo = parse_metainfo(buffer, v2_torrent(files, buffer, true, false), LOG_NO);
+    TEST_ASSERT_NOT_NULL(metainfo);
+    info_t* info = metainfo->info;
+
+    // The first block of the second piece is the end of the first file, then padding
+    unsigned char* block = calloc(BLOCK_SIZE, 1);
+    memcpy(block, files->a + V2_PIECE_LENGTH, V2_A_LENGTH - V2_PIECE_LENGTH);
+    const piece_t piece = {1, 0, block};
+    TEST_ASSERT_EQUAL_INT32(0, process_block(&piece, info->piece_length, piece_size(info, 1), info->files, LOG_NO));
+    for (files_ll* file = info->files; file; file = file->next) {
+        if (file->file_ptr) fclose(file->file_ptr);
+        file->file_ptr = nullptr;
+    }
+    FILE* file = fopen("a", "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    fseek(file, 0, SEEK_END);
+    TEST_ASSERT_EQUAL_INT64(V2_A_LENGTH, ftell(file));
+    fclose(file);
+    TEST_ASSERT_NULL(fopen(".pad", "rb"));
+
+    // It reads back as zeros
+    unsigned char* read = malloc(V2_PIECE_LENGTH);
+    TEST_ASSERT_TRUE(read_piece(info->files, read, 1, info->piece_length, V2_PIECE_LENGTH, LOG_NO));
+    TEST_ASSERT_EQUAL_MEMORY(block, read, BLOCK_SIZE);
+    remove("a");
+    free(read);
+    free(block);
+    free_metainfo(metainfo);
+    free(files);
+}
@@ -0,0 +1,11 @@
+#ifndef BITTORRENT_CLIENT_TEST_MERKLE_H
+#define BITTORRENT_CLIENT_TEST_MERKLE_H
+
+void test_merkle_root(void);
+void test_parse_metainfo_v2(void);
+void test_parse_metainfo_hybrid(void);
+void test_merkle_hashes(void);
+void test_merkle_check_piece(void);
+void test_padding_is_not_written(void);
+
+#endif //BITTORRENT_CLIENT_TEST_MERKLE_H
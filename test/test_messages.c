@@ -1,5 +1,10 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include "unity.h"
 #include "../src/messages.h"
@@ -234,6 +239,20 @@ void test_handle_bitfield_null_payload(void) {
     TEST_ASSERT_NOT_NULL(peer.bitfield);
 }
 
+// Whatever the peer's bitfield held before, the payload replaces it
+void test_handle_bitfield_copies_payload(void) {
+    peer_t peer = {0};
+    unsigned char client_bf[1] = {0x00};
+    peer.bitfield = calloc(1, 1);
+    unsigned char payload[1] = {0x40};
+
+    handle_bitfield(&peer, payload, client_bf, 1, LOG_NO);
+
+    TEST_ASSERT_EQUAL_HEX8(0x40, peer.bitfield[0]);
+    TEST_ASSERT_TRUE(peer.am_interested);
+    free(peer.bitfield);
+}
+
 // write_block()
 // TODO: This will be enabled once block writing is working
 void test_write_block_normal(void) {
@@ -259,4 +278,394 @@ void test_write_block_null_file(void) {
     unsigned char data[] = {1};
     TEST_IGNORE_MESSAGE("This will be enabled once block writing is working");
     //TEST_ASSERT_EQUAL(-1, write_block(data, 1, nullptr, LOG_NO));
-}
\ No newline at end of file
+}
+// send_message()
+
+void test_send_message_interested(void) {
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    peer_t peer = {0};
+    peer.socket = fds[0];
+    TEST_ASSERT_TRUE(send_message(&peer, INTERESTED, nullptr, 0, LOG_NO));
+    unsigned char buffer[HASH_REQUEST_SIZE + 1];
+    TEST_ASSERT_EQUAL_INT64(5, recv(fds[1], buffer, sizeof(buffer), 0));
+    const unsigned char expected[] = {0, 0, 0, 1, INTERESTED};
+    TEST_ASSERT_EQUAL_MEMORY(expected, buffer, 5);
+    // Too big for it
+    TEST_ASSERT_FALSE(send_message(&peer, BITFIELD, buffer, HASH_REQUEST_SIZE + 1, LOG_NO));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// peer_send() and flush_output()
+
+void test_peer_send_queues_when_full(void) {
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+    const int32_t size = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    peer_t peer = {0};
+    peer.socket = fds[0];
+    unsigned char *data = malloc(64 * 1024);
+    TEST_ASSERT_NOT_NULL(data);
+    for (uint32_t i = 0; i < 64 * 1024; ++i) data[i] = (unsigned char) (i * 7);
+
+    // The socket can't take it all, the rest waits in the queue instead of blocking
+    TEST_ASSERT_TRUE(peer_send(&peer, data, 64 * 1024, LOG_NO));
+    TEST_ASSERT_TRUE(peer.send_length > 0);
+    // Queued behind the rest, even if the socket had room by now
+    const unsigned char tail[] = {1, 2, 3};
+    TEST_ASSERT_TRUE(peer_send(&peer, tail, sizeof(tail), LOG_NO));
+
+    unsigned char *received = malloc(64 * 1024 + sizeof(tail));
+    TEST_ASSERT_NOT_NULL(received);
+    uint32_t total = 0;
+    while (total < 64 * 1024 + sizeof(tail)) {
+        TEST_ASSERT_TRUE(flush_output(&peer, LOG_NO) >= 0);
+        const ssize_t got = recv(fds[1], received + total, 64 * 1024 + sizeof(tail) - total, MSG_DONTWAIT);
+        if (got > 0) total += got;
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, peer.send_length);
+    TEST_ASSERT_EQUAL_MEMORY(data, received, 64 * 1024);
+    TEST_ASSERT_EQUAL_MEMORY(tail, received + 64 * 1024, sizeof(tail));
+
+    close(fds[0]);
+    close(fds[1]);
+    free(peer.send_buffer);
+    free(received);
+    free(data);
+}
+
+void test_peer_send_queue_limit(void) {
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds));
+    peer_t peer = {0};
+    peer.socket = fds[0];
+    unsigned char *data = calloc(1, SEND_QUEUE_MAX);
+    TEST_ASSERT_NOT_NULL(data);
+
+    // Nobody reads, so the queue eventually refuses more
+    bool accepted = true;
+    for (uint32_t i = 0; i < 16 && accepted; ++i) accepted = peer_send(&peer, data, SEND_QUEUE_MAX / 2, LOG_NO);
+    TEST_ASSERT_FALSE(accepted);
+    TEST_ASSERT_TRUE(peer.send_length <= SEND_QUEUE_MAX);
+    TEST_ASSERT_FALSE(peer_send(nullptr, data, 1, LOG_NO));
+
+    close(fds[0]);
+    close(fds[1]);
+    free(peer.send_buffer);
+    free(data);
+}
+
+// request_blocks(), block_received() and release_requests()
+
+/**
+ * Two pieces of two blocks each, the last one 100 bytes past its first block
+ */
+static info_t request_test_info(void) {
+    info_t info = {0};
+    info.piece_length = 2*BLOCK_SIZE;
+    info.piece_number = 2;
+    info.length = 3*BLOCK_SIZE + 100;
+    return info;
+}
+
+void test_request_blocks_fills_queue(void) {
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    const info_t info = request_test_info();
+    unsigned char peer_bitfield[1] = {0xC0};
+    peer_t peer = {0};
+    peer.socket = fds[0];
+    peer.bitfield = peer_bitfield;
+    peer.interest_sent = true;
+    const unsigned char client_bitfield[1] = {0};
+    // The first block is already downloaded
+    const unsigned char block_tracker[1] = {0x80};
+    unsigned char requested[1] = {0};
+
+    TEST_ASSERT_EQUAL_UINT32(3, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+    TEST_ASSERT_EQUAL_UINT32(3, peer.pending_amount);
+    TEST_ASSERT_EQUAL_HEX8(0x70, requested[0]);
+
+    unsigned char buffer[3*17];
+    TEST_ASSERT_EQUAL_INT64(sizeof(buffer), recv(fds[1], buffer, sizeof(buffer), MSG_WAITALL));
+    TEST_ASSERT_EQUAL_UINT8(REQUEST, buffer[4]);
+    request_t request;
+    memcpy(&request, buffer + 5, sizeof(request_t));
+    TEST_ASSERT_EQUAL_UINT32(0, ntohl(request.index));
+    TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, ntohl(request.begin));
+    TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, ntohl(request.length));
+    // The last block is shorter
+    memcpy(&request, buffer + 2*17 + 5, sizeof(request_t));
+    TEST_ASSERT_EQUAL_UINT32(1, ntohl(request.index));
+    TEST_ASSERT_EQUAL_UINT32(BLOCK_SIZE, ntohl(request.begin));
+    TEST_ASSERT_EQUAL_UINT32(100, ntohl(request.length));
+
+    // Nothing left to ask for
+    TEST_ASSERT_EQUAL_UINT32(0, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_request_blocks_local_peer_queue(void) {
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    // 16 pieces of 8 blocks, more than either queue takes
+    info_t info = {0};
+    info.piece_length = 8*BLOCK_SIZE;
+    info.piece_number = 16;
+    info.length = 128*BLOCK_SIZE;
+    unsigned char peer_bitfield[2] = {0xFF, 0xFF};
+    peer_t peer = {0};
+    peer.socket = fds[0];
+    peer.bitfield = peer_bitfield;
+    peer.interest_sent = true;
+    const unsigned char client_bitfield[2] = {0};
+    const unsigned char block_tracker[16] = {0};
+    unsigned char requested[16] = {0};
+
+    TEST_ASSERT_EQUAL_UINT32(QUEUE_SIZE, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 8,
+                                                        LOG_NO));
+    // Local peers get a deeper queue, on top of what's already pending
+    peer.local = true;
+    TEST_ASSERT_EQUAL_UINT32(LOCAL_QUEUE_SIZE - QUEUE_SIZE, request_blocks(&peer, &info, client_bitfield,
+                                                                           block_tracker, requested, 8, LOG_NO));
+    TEST_ASSERT_EQUAL_UINT32(LOCAL_QUEUE_SIZE, peer.pending_amount);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_request_blocks_choked(void) {
+    const info_t info = request_test_info();
+    unsigned char peer_bitfield[1] = {0xC0};
+    peer_t peer = {0};
+    peer.socket = -1;
+    peer.bitfield = peer_bitfield;
+    peer.interest_sent = true;
+    peer.peer_choking = true;
+    const unsigned char client_bitfield[1] = {0};
+    const unsigned char block_tracker[1] = {0};
+    unsigned char requested[1] = {0};
+    TEST_ASSERT_EQUAL_UINT32(0, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+    TEST_ASSERT_EQUAL_UINT32(0, request_blocks(nullptr, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+    TEST_ASSERT_EQUAL_HEX8(0, requested[0]);
+}
+
+void test_request_blocks_failed_send_releases_claim(void) {
+    const info_t info = request_test_info();
+    unsigned char peer_bitfield[1] = {0xC0};
+    peer_t peer = {0};
+    // Sending fails right away
+    peer.socket = -1;
+    peer.bitfield = peer_bitfield;
+    peer.interest_sent = true;
+    const unsigned char client_bitfield[1] = {0};
+    const unsigned char block_tracker[1] = {0};
+    unsigned char requested[1] = {0};
+    TEST_ASSERT_EQUAL_UINT32(0, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+    TEST_ASSERT_EQUAL_UINT32(0, peer.pending_amount);
+    // Other peers may still ask for the block
+    TEST_ASSERT_EQUAL_HEX8(0, requested[0]);
+}
+
+/// @brief A peer requesting blocks from its own thread, the way each reactor does
+typedef struct {
+    peer_t peer;
+    const info_t *info;
+    const unsigned char *client_bitfield;
+    const unsigned char *block_tracker;
+    unsigned char *requested;
+    pthread_barrier_t *barrier;
+} request_thread_t;
+
+static void *run_request_thread(void *arg) {
+    request_thread_t *thread = arg;
+    pthread_barrier_wait(thread->barrier);
+    request_blocks(&thread->peer, thread->info, thread->client_bitfield, thread->block_tracker, thread->requested, 2,
+                   LOG_NO);
+    return nullptr;
+}
+
+void test_request_blocks_concurrent_claims(void) {
+    // Sixteen pieces of two blocks, more than every thread asks for at once
+    info_t info = {0};
+    info.piece_length = 2*BLOCK_SIZE;
+    info.piece_number = 16;
+    info.length = 32*BLOCK_SIZE;
+    unsigned char peer_bitfield[2] = {0xFF, 0xFF};
+    const unsigned char client_bitfield[2] = {0};
+    const unsigned char block_tracker[4] = {0};
+    unsigned char requested[4] = {0};
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, nullptr, 4);
+
+    int32_t fds[4][2];
+    request_thread_t threads[4] = {0};
+    pthread_t ids[4];
+    for (int32_t i = 0; i < 4; ++i) {
+        TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]));
+        threads[i].peer.socket = fds[i][0];
+        threads[i].peer.bitfield = peer_bitfield;
+        threads[i].peer.interest_sent = true;
+        threads[i].info = &info;
+        threads[i].client_bitfield = client_bitfield;
+        threads[i].block_tracker = block_tracker;
+        threads[i].requested = requested;
+        threads[i].barrier = &barrier;
+        pthread_create(&ids[i], nullptr, run_request_thread, &threads[i]);
+    }
+    uint32_t owners[32] = {0};
+    for (int32_t i = 0; i < 4; ++i) {
+        pthread_join(ids[i], nullptr);
+        TEST_ASSERT_EQUAL_UINT32(QUEUE_SIZE, threads[i].peer.pending_amount);
+        for (uint32_t j = 0; j < threads[i].peer.pending_amount; ++j) owners[threads[i].peer.pending_blocks[j]]++;
+        close(fds[i][0]);
+        close(fds[i][1]);
+        free(threads[i].peer.send_buffer);
+    }
+    pthread_barrier_destroy(&barrier);
+
+    // No block was asked for twice, and every one asked for is claimed
+    uint32_t claimed = 0;
+    for (uint32_t block = 0; block < 32; ++block) {
+        TEST_ASSERT_LESS_OR_EQUAL_UINT32(1, owners[block]);
+        TEST_ASSERT_EQUAL(owners[block] == 1, (requested[block / 8] & (1u << (7 - block % 8))) != 0);
+        claimed += owners[block];
+    }
+    TEST_ASSERT_EQUAL_UINT32(4*QUEUE_SIZE, claimed);
+}
+
+void test_block_received_and_release_requests(void) {
+    peer_t peer = {0};
+    peer.pending_amount = 3;
+    peer.pending_blocks[0] = 1;
+    peer.pending_blocks[1] = 2;
+    peer.pending_blocks[2] = 3;
+    unsigned char requested[1] = {0x70};
+
+    block_received(&peer, requested, 2);
+    TEST_ASSERT_EQUAL_UINT32(2, peer.pending_amount);
+    TEST_ASSERT_EQUAL_HEX8(0x50, requested[0]);
+    // Blocks never requested from this peer are ignored
+    block_received(&peer, requested, 7);
+    TEST_ASSERT_EQUAL_UINT32(2, peer.pending_amount);
+
+    release_requests(&peer, requested);
+    TEST_ASSERT_EQUAL_UINT32(0, peer.pending_amount);
+    TEST_ASSERT_EQUAL_HEX8(0, requested[0]);
+}
+
+// Fast Extension
+
+void test_handle_have_all_and_none(void) {
+    peer_t peer = {0};
+    // Ten pieces, the client has the first eight
+    const unsigned char client_bitfield[2] = {0xFF, 0x00};
+    handle_have_all(&peer, true, client_bitfield, 10, LOG_NO);
+    TEST_ASSERT_NOT_NULL(peer.bitfield);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, peer.bitfield[0]);
+    // Spare bits stay clear
+    TEST_ASSERT_EQUAL_HEX8(0xC0, peer.bitfield[1]);
+    TEST_ASSERT_TRUE(peer.am_interested);
+    TEST_ASSERT_EQUAL_INT32(PEER_BITFIELD_RECEIVED, peer.status);
+
+    peer.am_interested = false;
+    handle_have_all(&peer, false, client_bitfield, 10, LOG_NO);
+    TEST_ASSERT_EQUAL_HEX8(0, peer.bitfield[0]);
+    TEST_ASSERT_EQUAL_HEX8(0, peer.bitfield[1]);
+    TEST_ASSERT_FALSE(peer.am_interested);
+    free(peer.bitfield);
+}
+
+void test_request_blocks_allowed_fast_while_choked(void) {
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    const info_t info = request_test_info();
+    unsigned char peer_bitfield[1] = {0xC0};
+    peer_t peer = {0};
+    peer.socket = fds[0];
+    peer.bitfield = peer_bitfield;
+    peer.interest_sent = true;
+    peer.peer_choking = true;
+    peer.fast = true;
+    const unsigned char client_bitfield[1] = {0};
+    const unsigned char block_tracker[1] = {0};
+    unsigned char requested[1] = {0};
+    // Nothing allowed yet
+    TEST_ASSERT_EQUAL_UINT32(0, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+
+    // Pieces past the last one are ignored, and so are repeated ones
+    const unsigned char past[4] = {0, 0, 0, 2};
+    const unsigned char second[4] = {0, 0, 0, 1};
+    handle_allowed_fast(&peer, past, info.piece_number);
+    handle_allowed_fast(&peer, second, info.piece_number);
+    handle_allowed_fast(&peer, second, info.piece_number);
+    TEST_ASSERT_EQUAL_UINT8(1, peer.allowed_fast_amount);
+
+    // Only the blocks of the allowed piece are asked for
+    TEST_ASSERT_EQUAL_UINT32(2, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+    TEST_ASSERT_EQUAL_HEX8(0x30, requested[0]);
+    unsigned char buffer[17];
+    TEST_ASSERT_EQUAL_INT64(sizeof(buffer), recv(fds[1], buffer, sizeof(buffer), MSG_WAITALL));
+    request_t request;
+    memcpy(&request, buffer + 5, sizeof(request_t));
+    TEST_ASSERT_EQUAL_UINT32(1, ntohl(request.index));
+
+    // An index wrapping around onto the pending block, or a begin past the piece, is ignored
+    unsigned char forged[sizeof(request_t)];
+    memcpy(forged, buffer + 5, sizeof(forged));
+    const uint32_t wrapped = htonl(1 + 0x80000000u);
+    memcpy(forged, &wrapped, 4);
+    TEST_ASSERT_FALSE(handle_reject(&peer, forged, requested, 2, info.piece_number));
+    memcpy(forged, buffer + 5, sizeof(forged));
+    const uint32_t past_piece = htonl(2 * BLOCK_SIZE);
+    memcpy(forged + 4, &past_piece, 4);
+    TEST_ASSERT_FALSE(handle_reject(&peer, forged, requested, 2, info.piece_number));
+    TEST_ASSERT_EQUAL_UINT32(2, peer.pending_amount);
+    TEST_ASSERT_EQUAL_UINT8(1, peer.allowed_fast_amount);
+
+    // Rejected while choked, the piece isn't allowed anymore
+    TEST_ASSERT_TRUE(handle_reject(&peer, buffer + 5, requested, 2, info.piece_number));
+    TEST_ASSERT_EQUAL_UINT32(1, peer.pending_amount);
+    TEST_ASSERT_EQUAL_UINT8(0, peer.allowed_fast_amount);
+    TEST_ASSERT_EQUAL_HEX8(0x10, requested[0]);
+    // Rejecting it twice changes nothing
+    TEST_ASSERT_FALSE(handle_reject(&peer, buffer + 5, requested, 2, info.piece_number));
+    TEST_ASSERT_EQUAL_UINT32(1, peer.pending_amount);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_request_blocks_suggested_first(void) {
+    int32_t fds[2];
+    TEST_ASSERT_EQUAL_INT32(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    const info_t info = request_test_info();
+    unsigned char peer_bitfield[1] = {0xC0};
+    peer_t peer = {0};
+    peer.socket = fds[0];
+    peer.bitfield = peer_bitfield;
+    peer.interest_sent = true;
+    peer.fast = true;
+    const unsigned char client_bitfield[1] = {0};
+    const unsigned char block_tracker[1] = {0};
+    unsigned char requested[1] = {0};
+    const unsigned char second[4] = {0, 0, 0, 1};
+    handle_suggest_piece(&peer, second, info.piece_number);
+
+    TEST_ASSERT_EQUAL_UINT32(4, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+    unsigned char buffer[4*17];
+    TEST_ASSERT_EQUAL_INT64(sizeof(buffer), recv(fds[1], buffer, sizeof(buffer), MSG_WAITALL));
+    request_t request;
+    memcpy(&request, buffer + 5, sizeof(request_t));
+    TEST_ASSERT_EQUAL_UINT32(1, ntohl(request.index));
+    memcpy(&request, buffer + 2*17 + 5, sizeof(request_t));
+    TEST_ASSERT_EQUAL_UINT32(0, ntohl(request.index));
+
+    // Rejected while unchoked, the piece isn't asked of this peer again
+    TEST_ASSERT_TRUE(handle_reject(&peer, buffer + 5, requested, 2, info.piece_number));
+    TEST_ASSERT_EQUAL_HEX8(0x80, peer_bitfield[0]);
+    TEST_ASSERT_EQUAL_UINT32(0, request_blocks(&peer, &info, client_bitfield, block_tracker, requested, 2, LOG_NO));
+    close(fds[0]);
+    close(fds[1]);
+}
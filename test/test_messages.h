@@ -38,12 +38,31 @@ void test_handle_have_invalid_index(void);
 
 // handle_bitfield()
 void test_handle_bitfield_null_payload(void);
+void test_handle_bitfield_copies_payload(void);
 
 // write_block()
 void test_write_block_normal(void);
 void test_write_block_zero(void);
 void test_write_block_null_file(void);
 
+// send_message(), peer_send() and flush_output()
+void test_send_message_interested(void);
+void test_peer_send_queues_when_full(void);
+void test_peer_send_queue_limit(void);
+
+// request_blocks(), block_received() and release_requests()
+void test_request_blocks_fills_queue(void);
+void test_request_blocks_local_peer_queue(void);
+void test_request_blocks_choked(void);
+void test_request_blocks_failed_send_releases_claim(void);
+void test_request_blocks_concurrent_claims(void);
+void test_block_received_and_release_requests(void);
+
+// Fast Extension
+void test_handle_have_all_and_none(void);
+void test_request_blocks_allowed_fast_while_choked(void);
+void test_request_blocks_suggested_first(void);
+
 /* TODO: Write tests for the following functions. They require mocking
  *
  * try_connect()
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <openssl/sha.h>
+
+#include "unity.h"
+#include "../src/file.h"
+#include "../src/magnet.h"
+#include "../src/messages_types.h"
+#include "../src/metadata.h"
+
+// magnet_info_hash()
+
+void test_magnet_info_hash_hex_and_base32(void) {
+    unsigned char expected[20];
+    for (int32_t i = 0; i < 20; ++i) expected[i] = (unsigned char) (i * 13 + 7);
+
+    unsigned char hash[20];
+    TEST_ASSERT_TRUE(magnet_info_hash("0714212e3b4855626f7c8996a3b0bdcad7e4f1fe", hash));
+    TEST_ASSERT_EQUAL_MEMORY(expected, hash, 20);
+    memset(hash, 0, 20);
+    // The same hash in base32, lower case accepted too
+    TEST_ASSERT_TRUE(magnet_info_hash("A4KCCLR3JBKWE334RGLKHMF5ZLL6J4P6", hash));
+    TEST_ASSERT_EQUAL_MEMORY(expected, hash, 20);
+    memset(hash, 0, 20);
+    TEST_ASSERT_TRUE(magnet_info_hash("a4kcclr3jbkwe334rglkhmf5zll6j4p6", hash));
+    TEST_ASSERT_EQUAL_MEMORY(expected, hash, 20);
+}
+
+void test_magnet_info_hash_invalid(void) {
+    unsigned char hash[20];
+    TEST_ASSERT_FALSE(magnet_info_hash(nullptr, hash));
+    TEST_ASSERT_FALSE(magnet_info_hash("070e1b28354f5c69768390aaaab7c4d1deebf8", hash));
+    TEST_ASSERT_FALSE(magnet_info_hash("070e1b28354f5c69768390aaaab7c4d1deebf8zz", hash));
+    TEST_ASSERT_FALSE(magnet_info_hash("A4HBWKBVJ5OGS5UDSCVKVN6E2HPOX6A1", hash));
+    // Multihashes of anything but SHA-256
+    TEST_ASSERT_FALSE(magnet_info_hash("1120caf1e1c30e81cb361b9ee167c4aa64228a7fa4fa9f6105232b28ad099f3a302e", hash));
+}
+
+void test_magnet_info_hash_multihash(void) {
+    unsigned char hash[20];
+    TEST_ASSERT_TRUE(magnet_info_hash("1220caf1e1c30e81cb361b9ee167c4aa64228a7fa4fa9f6105232b28ad099f3a302e", hash));
+    // Truncated to the first 20 bytes of the SHA-256 hash
+    const unsigned char expected[20] = {
+        0xca, 0xf1, 0xe1, 0xc3, 0x0e, 0x81, 0xcb, 0x36, 0x1b, 0x9e, 0xe1, 0x67, 0xc4, 0xaa, 0x64, 0x22,
+        0x8a, 0x7f, 0xa4, 0xfa
+    };
+    TEST_ASSERT_EQUAL_MEMORY(expected, hash, 20);
+    TEST_ASSERT_FALSE(magnet_info_hash("1220caf1e1c30e81cb361b9ee167c4aa64228a7fa4fa9f6105232b28ad099f3a30zz", hash));
+}
+
+// Extension handshake
+
+void test_extension_handshake_round_trip(void) {
+    unsigned char buffer[METADATA_MESSAGE_MAX];
+    const uint32_t length = build_extension_handshake(buffer);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(METADATA_MESSAGE_MAX, length);
+
+    uint32_t message_length;
+    memcpy(&message_length, buffer, 4);
+    TEST_ASSERT_EQUAL_UINT32(length - MESSAGE_LENGTH_SIZE, ntohl(message_length));
+    TEST_ASSERT_EQUAL_UINT8(EXTENDED, buffer[MESSAGE_LENGTH_SIZE]);
+    TEST_ASSERT_EQUAL_UINT8(EXTENSION_HANDSHAKE_ID, buffer[MESSAGE_LENGTH_AND_ID_SIZE]);
+
+    uint8_t ut_metadata;
+    int64_t metadata_size;
+    TEST_ASSERT_TRUE(parse_extension_handshake(buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1,
+                                               length - MESSAGE_LENGTH_AND_ID_SIZE - 1, &ut_metadata, &metadata_size));
+    TEST_ASSERT_EQUAL_UINT8(UT_METADATA_ID, ut_metadata);
+    TEST_ASSERT_EQUAL_INT64(-1, metadata_size);
+
+    // What a peer with the metadata sends
+    const char* peer = "d1:md6:ut_pexi1e11:ut_metadatai3ee13:metadata_sizei31235e1:v4:testee";
+    TEST_ASSERT_TRUE(parse_extension_handshake((const unsigned char*) peer, strlen(peer), &ut_metadata,
+                                               &metadata_size));
+    TEST_ASSERT_EQUAL_UINT8(3, ut_metadata);
+    TEST_ASSERT_EQUAL_INT64(31235, metadata_size);
+}
+
+void test_parse_extension_handshake_without_ut_metadata(void) {
+    uint8_t ut_metadata = 9;
+    int64_t metadata_size = 9;
+    const char* disabled = "d1:md11:ut_metadatai0eee";
+    TEST_ASSERT_TRUE(parse_extension_handshake((const unsigned char*) disabled, strlen(disabled), &ut_metadata,
+                                               &metadata_size));
+    TEST_ASSERT_EQUAL_UINT8(0, ut_metadata);
+    TEST_ASSERT_EQUAL_INT64(-1, metadata_size);
+
+    const char* truncated = "d1:md11:ut_metadatai1e";
+    TEST_ASSERT_FALSE(parse_extension_handshake((const unsigned char*) truncated, strlen(truncated), &ut_metadata,
+                                                &metadata_size));
+    TEST_ASSERT_FALSE(parse_extension_handshake((const unsigned char*) "i1e", 3, &ut_metadata, &metadata_size));
+}
+
+// ut_metadata messages
+
+void test_metadata_message_round_trip(void) {
+    unsigned char buffer[METADATA_MESSAGE_MAX];
+    const uint32_t length = build_metadata_message(buffer, 3, METADATA_REQUEST, 7);
+    TEST_ASSERT_EQUAL_UINT8(EXTENDED, buffer[MESSAGE_LENGTH_SIZE]);
+    TEST_ASSERT_EQUAL_UINT8(3, buffer[MESSAGE_LENGTH_AND_ID_SIZE]);
+
+    int64_t type, piece;
+    const unsigned char* data;
+    uint32_t data_length;
+    TEST_ASSERT_TRUE(parse_metadata_message(buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1,
+                                            length - MESSAGE_LENGTH_AND_ID_SIZE - 1, &type, &piece, &data,
+                                            &data_length));
+    TEST_ASSERT_EQUAL_INT64(METADATA_REQUEST, type);
+    TEST_ASSERT_EQUAL_INT64(7, piece);
+    TEST_ASSERT_NULL(data);
+    TEST_ASSERT_EQUAL_UINT32(0, data_length);
+}
+
+void test_parse_metadata_message_data(void) {
+    const char message[] = "d8:msg_typei1e5:piecei2e10:total_sizei40000eeabcdef";
+    int64_t type, piece;
+    const unsigned char* data;
+    uint32_t data_length;
+    TEST_ASSERT_TRUE(parse_metadata_message((const unsigned char*) message, sizeof(message) - 1, &type, &piece,
+                                            &data, &data_length));
+    TEST_ASSERT_EQUAL_INT64(METADATA_DATA, type);
+    TEST_ASSERT_EQUAL_INT64(2, piece);
+    TEST_ASSERT_EQUAL_UINT32(6, data_length);
+    TEST_ASSERT_EQUAL_MEMORY("abcdef", data, 6);
+
+    const char missing_piece[] = "d8:msg_typei1ee";
+    TEST_ASSERT_FALSE(parse_metadata_message((const unsigned char*) missing_piece, sizeof(missing_piece) - 1, &type,
+                                             &piece, &data, &data_length));
+}
+
+// metadata_t
+
+/**
+ * Fills an info dictionary of the given size with arbitrary bytes, and its hash
+ */
+static unsigned char* make_info(const uint32_t size, unsigned char* hash) {
+    unsigned char* info = malloc(size);
+    for (uint32_t i = 0; i < size; ++i) info[i] = (unsigned char) (i * 31 + 5);
+    SHA1(info, size, hash);
+    return info;
+}
+
+void test_metadata_assembles_out_of_order(void) {
+    unsigned char hash[20];
+    const uint32_t size = 2 * METADATA_PIECE_SIZE + 1000;
+    unsigned char* info = make_info(size, hash);
+    metadata_t* metadata = metadata_create(hash);
+    TEST_ASSERT_NOT_NULL(metadata);
+    // Nothing to request until the size is known
+    TEST_ASSERT_EQUAL_INT32(-1, metadata_next_piece(metadata, 1000));
+    TEST_ASSERT_TRUE(metadata_set_size(metadata, size));
+    TEST_ASSERT_EQUAL_UINT32(3, metadata->piece_amount);
+
+    TEST_ASSERT_EQUAL_INT32(0, metadata_next_piece(metadata, 1000));
+    TEST_ASSERT_EQUAL_INT32(1, metadata_next_piece(metadata, 1000));
+    TEST_ASSERT_EQUAL_INT32(2, metadata_next_piece(metadata, 1000));
+    TEST_ASSERT_EQUAL_INT32(-1, metadata_next_piece(metadata, 1000));
+
+    TEST_ASSERT_EQUAL(METADATA_PIECE_STORED, metadata_add_piece(metadata, 2, info + 2 * METADATA_PIECE_SIZE, 1000));
+    TEST_ASSERT_EQUAL(METADATA_PIECE_STORED, metadata_add_piece(metadata, 0, info, METADATA_PIECE_SIZE));
+    TEST_ASSERT_EQUAL(METADATA_COMPLETE, metadata_add_piece(metadata, 1, info + METADATA_PIECE_SIZE,
+                                                            METADATA_PIECE_SIZE));
+    TEST_ASSERT_EQUAL_MEMORY(info, metadata->data, size);
+
+    metadata_free(metadata);
+    free(info);
+}
+
+void test_metadata_hash_mismatch_resets(void) {
+    unsigned char hash[20];
+    const uint32_t size = METADATA_PIECE_SIZE + 10;
+    unsigned char* info = make_info(size, hash);
+    metadata_t* metadata = metadata_create(hash);
+    TEST_ASSERT_TRUE(metadata_set_size(metadata, size));
+
+    unsigned char* corrupt = malloc(METADATA_PIECE_SIZE);
+    memcpy(corrupt, info, METADATA_PIECE_SIZE);
+    corrupt[100] ^= 0xFF;
+    TEST_ASSERT_EQUAL(METADATA_PIECE_STORED, metadata_add_piece(metadata, 0, corrupt, METADATA_PIECE_SIZE));
+    TEST_ASSERT_EQUAL(METADATA_HASH_MISMATCH, metadata_add_piece(metadata, 1, info + METADATA_PIECE_SIZE, 10));
+
+    // Every piece is missing again
+    TEST_ASSERT_EQUAL_UINT32(0, metadata->received_amount);
+    TEST_ASSERT_EQUAL_INT32(0, metadata_next_piece(metadata, 1000));
+    TEST_ASSERT_EQUAL_INT32(1, metadata_next_piece(metadata, 1000));
+    TEST_ASSERT_EQUAL(METADATA_PIECE_STORED, metadata_add_piece(metadata, 1, info + METADATA_PIECE_SIZE, 10));
+    TEST_ASSERT_EQUAL(METADATA_COMPLETE, metadata_add_piece(metadata, 0, info, METADATA_PIECE_SIZE));
+
+    metadata_free(metadata);
+    free(corrupt);
+    free(info);
+}
+
+void test_metadata_rejects_bad_pieces(void) {
+    unsigned char hash[20];
+    const uint32_t size = METADATA_PIECE_SIZE + 10;
+    unsigned char* info = make_info(size, hash);
+    metadata_t* metadata = metadata_create(hash);
+    TEST_ASSERT_FALSE(metadata_set_size(metadata, 0));
+    TEST_ASSERT_FALSE(metadata_set_size(metadata, METADATA_MAX_SIZE + 1));
+    TEST_ASSERT_TRUE(metadata_set_size(metadata, size));
+    // Peers disagreeing with the first size are of no use
+    TEST_ASSERT_TRUE(metadata_set_size(metadata, size));
+    TEST_ASSERT_FALSE(metadata_set_size(metadata, size + 1));
+
+    TEST_ASSERT_EQUAL(METADATA_PIECE_INVALID, metadata_add_piece(metadata, 2, info, 10));
+    TEST_ASSERT_EQUAL(METADATA_PIECE_INVALID, metadata_add_piece(metadata, 1, info, 11));
+    TEST_ASSERT_EQUAL(METADATA_PIECE_INVALID, metadata_add_piece(metadata, 0, info, METADATA_PIECE_SIZE - 1));
+    TEST_ASSERT_EQUAL(METADATA_PIECE_STORED, metadata_add_piece(metadata, 0, info, METADATA_PIECE_SIZE));
+    TEST_ASSERT_EQUAL(METADATA_PIECE_INVALID, metadata_add_piece(metadata, 0, info, METADATA_PIECE_SIZE));
+    TEST_ASSERT_EQUAL_UINT32(1, metadata->received_amount);
+
+    metadata_free(metadata);
+    free(info);
+}
+
+void test_metadata_requests_expire(void) {
+    unsigned char hash[20] = {0};
+    metadata_t* metadata = metadata_create(hash);
+    TEST_ASSERT_TRUE(metadata_set_size(metadata, 100));
+    TEST_ASSERT_EQUAL_INT32(0, metadata_next_piece(metadata, 1000));
+    TEST_ASSERT_EQUAL_INT32(-1, metadata_next_piece(metadata, 1000 + METADATA_REQUEST_TIMEOUT_MS - 1));
+    // Unanswered for too long, so it's asked of someone else
+    TEST_ASSERT_EQUAL_INT32(0, metadata_next_piece(metadata, 1000 + METADATA_REQUEST_TIMEOUT_MS));
+    // Released requests are given out again right away
+    metadata_release_piece(metadata, 0);
+    TEST_ASSERT_EQUAL_INT32(0, metadata_next_piece(metadata, 1000 + METADATA_REQUEST_TIMEOUT_MS));
+    metadata_free(metadata);
+}
+
+// build_magnet_torrent()
+
+void test_build_magnet_torrent_parses(void) {
+    char info[128];
+    int32_t info_length = sprintf(info, "d6:lengthi20000e4:name4:test12:piece lengthi16384e6:pieces40:");
+    memset(info + info_length, 'h', 40);
+    info_length += 40;
+    info[info_length++] = 'e';
+    unsigned char hash[20];
+    SHA1((const unsigned char*) info, info_length, hash);
+
+    ll second = {.next = nullptr, .val = "http://tracker.example/announce"};
+    ll first = {.next = &second, .val = "udp://tracker.example:6969"};
+    uint64_t length = 0;
+    char* torrent = build_magnet_torrent(info, info_length, &first, "http://mirror.example/test", &length);
+    TEST_ASSERT_NOT_NULL(torrent);
+    TEST_ASSERT_EQUAL_UINT64(strlen(torrent), length);
+
+    metainfo_t* metainfo = parse_metainfo(torrent, length, LOG_NO);
+    TEST_ASSERT_NOT_NULL(metainfo);
+    TEST_ASSERT_EQUAL_STRING("udp://tracker.example:6969", metainfo->announce);
+    TEST_ASSERT_NOT_NULL(metainfo->announce_list);
+    TEST_ASSERT_NOT_NULL(metainfo->announce_list->next);
+    TEST_ASSERT_EQUAL_STRING("http://tracker.example/announce", metainfo->announce_list->next->list->val);
+    TEST_ASSERT_EQUAL_INT64(20000, metainfo->info->length);
+    TEST_ASSERT_EQUAL_MEMORY(hash, metainfo->info->hash, 20);
+    TEST_ASSERT_NOT_NULL(metainfo->url_list);
+    TEST_ASSERT_EQUAL_STRING("http://mirror.example/test", metainfo->url_list->val);
+    TEST_ASSERT_NULL(metainfo->url_list->next);
+    free_metainfo(metainfo);
+    free(torrent);
+
+    // Without trackers, only the info dictionary
+    ll empty = {.next = nullptr, .val = nullptr};
+    torrent = build_magnet_torrent(info, info_length, &empty, nullptr, &length);
+    TEST_ASSERT_EQUAL_UINT64(info_length + 8, length);
+    free(torrent);
+}
+
+// metadata_job_start()
+
+void test_metadata_job_start_without_trackers(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(0);
+    const unsigned char info_hash[20] = {1};
+    const unsigned char peer_id[20] = {2};
+    ll empty = {.next = nullptr, .val = nullptr};
+    TEST_ASSERT_NULL(metadata_job_start(loop, timers, nullptr, nullptr, nullptr, info_hash, &empty, 0, peer_id,
+                                        RESOLVE_PEERS_PER_LINK, RESOLVE_TIMEOUT_MS, LOG_NO));
+    TEST_ASSERT_NULL(metadata_job_start(loop, timers, nullptr, nullptr, nullptr, info_hash, nullptr, 0, peer_id,
+                                        RESOLVE_PEERS_PER_LINK, RESOLVE_TIMEOUT_MS, LOG_NO));
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
+
+// resolve_magnets()
+
+void test_resolve_magnets_counts_unusable_links(void) {
+    char directory[] = "/tmp/resolve_testXXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(directory));
+    const char input[] = "not a link\n"
+        "\n"
+        "magnet:?xt=urn:sha1:0714212e3b4855626f7c8996a3b0bdcad7e4f1fe\n"
+        "magnet:?xt=urn:btih:0714212e3b4855626f7c8996a3b0bdcad7e4f1fe&dn=no+trackers\r\n"
+        "magnet:?xt=urn:btih:tooshort&tr=udp%3A%2F%2F127.0.0.1%3A1\n";
+    FILE* links = fmemopen((void*) input, sizeof(input) - 1, "r");
+    TEST_ASSERT_NOT_NULL(links);
+
+    const unsigned char peer_id[20] = {2};
+    resolve_stats_t stats;
+    TEST_ASSERT_TRUE(resolve_magnets(links, directory, 2, peer_id, &stats, LOG_NO));
+    fclose(links);
+    TEST_ASSERT_EQUAL_UINT32(4, stats.links);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.resolved);
+    TEST_ASSERT_EQUAL_UINT32(4, stats.failed);
+    // Nothing was written
+    TEST_ASSERT_EQUAL_INT32(0, rmdir(directory));
+}
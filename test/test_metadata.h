@@ -0,0 +1,19 @@
+#ifndef BITTORRENT_CLIENT_TEST_METADATA_H
+#define BITTORRENT_CLIENT_TEST_METADATA_H
+
+void test_magnet_info_hash_hex_and_base32(void);
+void test_magnet_info_hash_invalid(void);
+void test_magnet_info_hash_multihash(void);
+void test_extension_handshake_round_trip(void);
+void test_parse_extension_handshake_without_ut_metadata(void);
+void test_metadata_message_round_trip(void);
+void test_parse_metadata_message_data(void);
+void test_metadata_assembles_out_of_order(void);
+void test_metadata_hash_mismatch_resets(void);
+void test_metadata_rejects_bad_pieces(void);
+void test_metadata_requests_expire(void);
+void test_build_magnet_torrent_parses(void);
+void test_metadata_job_start_without_trackers(void);
+void test_resolve_magnets_counts_unusable_links(void);
+
+#endif //BITTORRENT_CLIENT_TEST_METADATA_H
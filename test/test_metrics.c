@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#include "unity.h"
+#include "../src/metrics.h"
+
+static void* add_counters(void* arg) {
+    (void) arg;
+    for (uint32_t i = 0; i < 1000; ++i) metrics_add(METRIC_PIECES_VERIFIED, 1);
+    return nullptr;
+}
+
+/**
+ * Sends a scrape request through an already connected socket and returns the whole response
+ */
+static char* scrape(const int32_t fd) {
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    TEST_ASSERT_EQUAL_INT64(sizeof(request) - 1, send(fd, request, sizeof(request) - 1, 0));
+    size_t capacity = 4096, length = 0;
+    char* response = malloc(capacity);
+    ssize_t got;
+    while ((got = recv(fd, response + length, capacity - length - 1, 0)) > 0) {
+        length += got;
+        if (length + 1 == capacity) response = realloc(response, capacity *= 2);
+    }
+    response[length] = '\0';
+    close(fd);
+    return response;
+}
+
+void test_metrics_counters_across_threads(void) {
+    const uint64_t before = metrics_counter_value(METRIC_PIECES_VERIFIED);
+    pthread_t threads[4];
+    for (uint32_t i = 0; i < 4; ++i) pthread_create(&threads[i], nullptr, add_counters, nullptr);
+    for (uint32_t i = 0; i < 4; ++i) pthread_join(threads[i], nullptr);
+    // Finished threads still count
+    TEST_ASSERT_EQUAL_UINT64(before + 4000, metrics_counter_value(METRIC_PIECES_VERIFIED));
+    metrics_add(METRIC_PIECES_VERIFIED, 5);
+    TEST_ASSERT_EQUAL_UINT64(before + 4005, metrics_counter_value(METRIC_PIECES_VERIFIED));
+    TEST_ASSERT_EQUAL_UINT64(0, metrics_counter_value(METRIC_COUNTER_COUNT));
+}
+
+void test_metrics_render(void) {
+    const uint64_t observed = metrics_histogram_count(METRIC_TRACKER_ANNOUNCE_SECONDS);
+    metrics_observe(METRIC_TRACKER_ANNOUNCE_SECONDS, 30000);
+    metrics_observe(METRIC_TRACKER_ANNOUNCE_SECONDS, 60000000);
+    TEST_ASSERT_EQUAL_UINT64(observed + 2, metrics_histogram_count(METRIC_TRACKER_ANNOUNCE_SECONDS));
+    uint32_t peers[PEER_STATUS_COUNT] = {0};
+    peers[PEER_CLOSED] = 3;
+    peers[PEER_HANDSHAKE_SUCCESS] = 7;
+    metrics_set_peers(peers);
+    metrics_set_gauge(METRIC_REQUESTS_IN_FLIGHT, 42);
+
+    char* text = metrics_render();
+    TEST_ASSERT_NOT_NULL(text);
+    TEST_ASSERT_NOT_NULL(strstr(text, "# TYPE bittorrent_downloaded_bytes_total counter\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "bittorrent_peers{status=\"closed\"} 3\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "bittorrent_peers{status=\"handshake_success\"} 7\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "bittorrent_requests_in_flight 42\n"));
+    TEST_ASSERT_NOT_NULL(strstr(text, "# TYPE bittorrent_disk_write_seconds histogram\n"));
+    // Buckets are cumulative, and the one past every bound only shows up in +Inf
+    char expected[128];
+    snprintf(expected, sizeof(expected), "bittorrent_tracker_announce_seconds_bucket{le=\"0.05\"} %lu\n",
+             (unsigned long) observed + 1);
+    TEST_ASSERT_NOT_NULL(strstr(text, expected));
+    snprintf(expected, sizeof(expected), "bittorrent_tracker_announce_seconds_bucket{le=\"+Inf\"} %lu\n",
+             (unsigned long) observed + 2);
+    TEST_ASSERT_NOT_NULL(strstr(text, expected));
+    free(text);
+}
+
+void test_metrics_server_tcp(void) {
+    TEST_ASSERT_NULL(metrics_server_start(nullptr, LOG_NO));
+    TEST_ASSERT_NULL(metrics_server_start("no port", LOG_NO));
+    metrics_server_t* server = metrics_server_start(":0", LOG_NO);
+    TEST_ASSERT_NOT_NULL(server);
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    TEST_ASSERT_EQUAL_INT32(0, getsockname(server->listen_fd, (struct sockaddr*) &addr, &addr_len));
+    // Only reachable locally by default
+    TEST_ASSERT_EQUAL_UINT32(htonl(INADDR_LOOPBACK), addr.sin_addr.s_addr);
+    metrics_add(METRIC_EPOLL_WAKEUPS, 1);
+
+    const int32_t fd = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_EQUAL_INT32(0, connect(fd, (struct sockaddr*) &addr, addr_len));
+    char* response = scrape(fd);
+    TEST_ASSERT_EQUAL_INT32(0, strncmp(response, "HTTP/1.0 200 OK\r\n", 17));
+    TEST_ASSERT_NOT_NULL(strstr(response, "Content-Type: text/plain; version=0.0.4\r\n"));
+    TEST_ASSERT_NOT_NULL(strstr(response, "\r\n\r\n# HELP "));
+    TEST_ASSERT_NOT_NULL(strstr(response, "bittorrent_epoll_wakeups_total "));
+    free(response);
+    // Stopping frees this thread's shard, but not what it counted
+    const uint64_t wakeups = metrics_counter_value(METRIC_EPOLL_WAKEUPS);
+    metrics_server_stop(server);
+    metrics_server_stop(nullptr);
+    TEST_ASSERT_EQUAL_UINT64(wakeups, metrics_counter_value(METRIC_EPOLL_WAKEUPS));
+    metrics_add(METRIC_EPOLL_WAKEUPS, 1);
+    TEST_ASSERT_EQUAL_UINT64(wakeups + 1, metrics_counter_value(METRIC_EPOLL_WAKEUPS));
+}
+
+void test_metrics_server_unix(void) {
+    char dir[] = "/tmp/metrics_XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    char address[64], *path = address + 5;
+    snprintf(address, sizeof(address), "unix:%s/metrics.sock", dir);
+    metrics_server_t* server = metrics_server_start(address, LOG_NO);
+    TEST_ASSERT_NOT_NULL(server);
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    const int32_t fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    TEST_ASSERT_EQUAL_INT32(0, connect(fd, (struct sockaddr*) &addr, sizeof(addr)));
+    char* response = scrape(fd);
+    TEST_ASSERT_NOT_NULL(strstr(response, "bittorrent_pieces_failed_total "));
+    free(response);
+
+    metrics_server_stop(server);
+    // The socket file goes away with the server
+    TEST_ASSERT_NOT_EQUAL_INT32(0, access(path, F_OK));
+    rmdir(dir);
+}
@@ -0,0 +1,9 @@
+#ifndef BITTORRENT_CLIENT_TEST_METRICS_H
+#define BITTORRENT_CLIENT_TEST_METRICS_H
+
+void test_metrics_counters_across_threads(void);
+void test_metrics_render(void);
+void test_metrics_server_tcp(void);
+void test_metrics_server_unix(void);
+
+#endif //BITTORRENT_CLIENT_TEST_METRICS_H
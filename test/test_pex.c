@@ -0,0 +1,124 @@
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "unity.h"
+#include "../src/metadata.h"
+#include "../src/pex.h"
+
+/**
+ * Writes a compact peer at 10.0.0.last, port 6881
+ */
+static void compact_peer(unsigned char* out, const uint8_t last) {
+    const unsigned char peer[COMPACT_PEER_V4_SIZE] = {10, 0, 0, last, 0x1A, 0xE1};
+    memcpy(out, peer, COMPACT_PEER_V4_SIZE);
+}
+
+void test_pex_handshake_round_trip(void) {
+    unsigned char buffer[PEX_MESSAGE_MAX];
+    const uint32_t length = build_pex_handshake(buffer, 6881);
+    const char expected[] = "d1:md6:ut_pexi2ee1:pi6881e1:v8:-IT0001-e";
+    TEST_ASSERT_EQUAL_UINT32(MESSAGE_LENGTH_AND_ID_SIZE + 1 + sizeof(expected) - 1, length);
+    TEST_ASSERT_EQUAL_UINT8(EXTENDED, buffer[MESSAGE_LENGTH_SIZE]);
+    TEST_ASSERT_EQUAL_UINT8(EXTENSION_HANDSHAKE_ID, buffer[MESSAGE_LENGTH_AND_ID_SIZE]);
+    TEST_ASSERT_EQUAL_MEMORY(expected, buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1, sizeof(expected) - 1);
+
+    uint8_t ut_pex;
+    TEST_ASSERT_TRUE(parse_pex_handshake(buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1,
+                                         length - MESSAGE_LENGTH_AND_ID_SIZE - 1, &ut_pex));
+    TEST_ASSERT_EQUAL_UINT8(UT_PEX_ID, ut_pex);
+
+    // Peers that only offer ut_metadata, or disabled ut_pex
+    const char metadata_only[] = "d1:md11:ut_metadatai3eee";
+    TEST_ASSERT_TRUE(parse_pex_handshake((const unsigned char*) metadata_only, sizeof(metadata_only) - 1, &ut_pex));
+    TEST_ASSERT_EQUAL_UINT8(0, ut_pex);
+    const char disabled[] = "d1:md6:ut_pexi0eee";
+    TEST_ASSERT_TRUE(parse_pex_handshake((const unsigned char*) disabled, sizeof(disabled) - 1, &ut_pex));
+    TEST_ASSERT_EQUAL_UINT8(0, ut_pex);
+    const char truncated[] = "d1:md6:ut_pexi2e";
+    TEST_ASSERT_FALSE(parse_pex_handshake((const unsigned char*) truncated, sizeof(truncated) - 1, &ut_pex));
+}
+
+void test_pex_message_round_trip(void) {
+    unsigned char added[3 * COMPACT_PEER_V4_SIZE];
+    for (uint8_t i = 0; i < 3; ++i) compact_peer(added + i * COMPACT_PEER_V4_SIZE, i + 1);
+    unsigned char dropped[COMPACT_PEER_V4_SIZE];
+    compact_peer(dropped, 9);
+
+    unsigned char buffer[PEX_MESSAGE_MAX];
+    const uint32_t length = build_pex_message(buffer, 7, added, 3, dropped, 1);
+    TEST_ASSERT_EQUAL_UINT8(EXTENDED, buffer[MESSAGE_LENGTH_SIZE]);
+    TEST_ASSERT_EQUAL_UINT8(7, buffer[MESSAGE_LENGTH_AND_ID_SIZE]);
+    uint32_t declared;
+    memcpy(&declared, buffer, MESSAGE_LENGTH_SIZE);
+    TEST_ASSERT_EQUAL_UINT32(length - MESSAGE_LENGTH_SIZE, ntohl(declared));
+
+    const unsigned char *parsed_added, *parsed_dropped;
+    uint32_t added_amount, dropped_amount;
+    TEST_ASSERT_TRUE(parse_pex_message(buffer + MESSAGE_LENGTH_AND_ID_SIZE + 1, length - MESSAGE_LENGTH_AND_ID_SIZE - 1,
+                                       &parsed_added, &added_amount, &parsed_dropped, &dropped_amount));
+    TEST_ASSERT_EQUAL_UINT32(3, added_amount);
+    TEST_ASSERT_EQUAL_MEMORY(added, parsed_added, sizeof(added));
+    TEST_ASSERT_EQUAL_UINT32(1, dropped_amount);
+    TEST_ASSERT_EQUAL_MEMORY(dropped, parsed_dropped, sizeof(dropped));
+
+    // More than a single message may carry
+    unsigned char many[(PEX_MAX_PEERS + 1) * COMPACT_PEER_V4_SIZE] = {0};
+    TEST_ASSERT_EQUAL_UINT32(0, build_pex_message(buffer, 7, many, PEX_MAX_PEERS + 1, nullptr, 0));
+}
+
+void test_pex_message_missing_lists(void) {
+    // Other clients leave lists out, and IPv6 ones are ignored
+    const char payload[] = "d5:added12:\x0a\x00\x00\x01\x1a\xe1\x0a\x00\x00\x02\x1a\xe1"
+                           "6:added638:0123456789abcdef01234567890123456789abe";
+    const unsigned char *added, *dropped;
+    uint32_t added_amount, dropped_amount;
+    TEST_ASSERT_TRUE(parse_pex_message((const unsigned char*) payload, sizeof(payload) - 1, &added, &added_amount,
+                                       &dropped, &dropped_amount));
+    TEST_ASSERT_EQUAL_UINT32(2, added_amount);
+    TEST_ASSERT_EQUAL_HEX8(0x02, added[COMPACT_PEER_V4_SIZE + 3]);
+    TEST_ASSERT_EQUAL_UINT32(0, dropped_amount);
+    TEST_ASSERT_NULL(dropped);
+
+    const char not_string[] = "d5:addedi3ee";
+    TEST_ASSERT_FALSE(parse_pex_message((const unsigned char*) not_string, sizeof(not_string) - 1, &added,
+                                        &added_amount, &dropped, &dropped_amount));
+    const char list[] = "le";
+    TEST_ASSERT_FALSE(parse_pex_message((const unsigned char*) list, sizeof(list) - 1, &added, &added_amount,
+                                        &dropped, &dropped_amount));
+}
+
+void test_pex_diff_and_apply(void) {
+    // Sent last time: 1, 2, 3. Connected now: 2, 3, 4, 5
+    unsigned char previous[(3 + PEX_MAX_PEERS) * COMPACT_PEER_V4_SIZE];
+    for (uint8_t i = 0; i < 3; ++i) compact_peer(previous + i * COMPACT_PEER_V4_SIZE, i + 1);
+    unsigned char current[4 * COMPACT_PEER_V4_SIZE];
+    for (uint8_t i = 0; i < 4; ++i) compact_peer(current + i * COMPACT_PEER_V4_SIZE, i + 2);
+
+    unsigned char added[PEX_MAX_PEERS * COMPACT_PEER_V4_SIZE];
+    unsigned char dropped[PEX_MAX_PEERS * COMPACT_PEER_V4_SIZE];
+    uint32_t added_amount, dropped_amount;
+    pex_diff(previous, 3, current, 4, added, &added_amount, dropped, &dropped_amount);
+    TEST_ASSERT_EQUAL_UINT32(2, added_amount);
+    TEST_ASSERT_EQUAL_UINT8(4, added[3]);
+    TEST_ASSERT_EQUAL_UINT8(5, added[COMPACT_PEER_V4_SIZE + 3]);
+    TEST_ASSERT_EQUAL_UINT32(1, dropped_amount);
+    TEST_ASSERT_EQUAL_UINT8(1, dropped[3]);
+
+    const uint32_t amount = pex_apply(previous, 3, added, added_amount, dropped, dropped_amount);
+    TEST_ASSERT_EQUAL_UINT32(4, amount);
+    // Now the same peers as current, so nothing changed
+    pex_diff(previous, amount, current, 4, added, &added_amount, dropped, &dropped_amount);
+    TEST_ASSERT_EQUAL_UINT32(0, added_amount);
+    TEST_ASSERT_EQUAL_UINT32(0, dropped_amount);
+
+    // Lists are capped, the rest shows up in the next diff
+    unsigned char crowd[(PEX_MAX_PEERS + 10) * COMPACT_PEER_V4_SIZE];
+    for (uint8_t i = 0; i < PEX_MAX_PEERS + 10; ++i) compact_peer(crowd + i * COMPACT_PEER_V4_SIZE, 100 + i);
+    unsigned char sent[(PEX_MAX_PEERS * 2) * COMPACT_PEER_V4_SIZE];
+    pex_diff(sent, 0, crowd, PEX_MAX_PEERS + 10, added, &added_amount, dropped, &dropped_amount);
+    TEST_ASSERT_EQUAL_UINT32(PEX_MAX_PEERS, added_amount);
+    const uint32_t sent_amount = pex_apply(sent, 0, added, added_amount, dropped, dropped_amount);
+    pex_diff(sent, sent_amount, crowd, PEX_MAX_PEERS + 10, added, &added_amount, dropped, &dropped_amount);
+    TEST_ASSERT_EQUAL_UINT32(10, added_amount);
+    TEST_ASSERT_EQUAL_UINT8(100 + PEX_MAX_PEERS, added[3]);
+}
@@ -0,0 +1,9 @@
+#ifndef BITTORRENT_CLIENT_TEST_PEX_H
+#define BITTORRENT_CLIENT_TEST_PEX_H
+
+void test_pex_handshake_round_trip(void);
+void test_pex_message_round_trip(void);
+void test_pex_message_missing_lists(void);
+void test_pex_diff_and_apply(void);
+
+#endif //BITTORRENT_CLIENT_TEST_PEX_H
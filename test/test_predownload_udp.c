@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 // ============================================================================
 // Tests for split_address
@@ -450,7 +452,7 @@ void test_announce_request_udp_valid_request(void) {
 void test_announce_request_udp_null_server_addr(void) {
     unsigned char info_hash[20] = {0};
     unsigned char peer_id[20] = {0};
-    torrent_stats_t stats = {0, 1024, 0, 0, 12345};
+    torrent_stats_t stats = {.left = 1024, .key = 12345};
     
     announce_response_t *result = announce_request_udp(
         nullptr, 3, 123456789, info_hash, peer_id, &stats, 6881, LOG_NO
@@ -462,7 +464,7 @@ void test_announce_request_udp_null_server_addr(void) {
 void test_announce_request_udp_null_info_hash(void) {
     struct sockaddr_in server = {0};
     unsigned char peer_id[20] = {0};
-    torrent_stats_t stats = {0, 1024, 0, 0, 12345};
+    torrent_stats_t stats = {.left = 1024, .key = 12345};
     
     announce_response_t *result = announce_request_udp(
         (struct sockaddr *)&server, 3, 123456789, nullptr, peer_id, &stats, 6881, LOG_NO
@@ -474,7 +476,7 @@ void test_announce_request_udp_null_info_hash(void) {
 void test_announce_request_udp_null_peer_id(void) {
     struct sockaddr_in server = {0};
     unsigned char info_hash[20] = {0};
-    torrent_stats_t stats = {0, 1024, 0, 0, 12345};
+    torrent_stats_t stats = {.left = 1024, .key = 12345};
     
     announce_response_t *result = announce_request_udp(
         (struct sockaddr *)&server, 3, 123456789, info_hash, nullptr, &stats, 6881, LOG_NO
@@ -499,7 +501,7 @@ void test_announce_request_udp_invalid_sockfd(void) {
     struct sockaddr_in server = {0};
     unsigned char info_hash[20] = {0};
     unsigned char peer_id[20] = {0};
-    torrent_stats_t stats = {0, 1024, 0, 0, 12345};
+    torrent_stats_t stats = {.left = 1024, .key = 12345};
     
     announce_response_t *result = announce_request_udp(
         (struct sockaddr *)&server, -1, 123456789, info_hash, peer_id, &stats, 6881, LOG_NO
@@ -512,7 +514,7 @@ void test_announce_request_udp_zero_connection_id(void) {
     struct sockaddr_in server = {0};
     unsigned char info_hash[20] = {0};
     unsigned char peer_id[20] = {0};
-    torrent_stats_t stats = {0, 1024, 0, 0, 12345};
+    torrent_stats_t stats = {.left = 1024, .key = 12345};
     
     // Zero connection_id might be invalid depending on implementation
     // This test documents the expected behavior
@@ -523,14 +525,78 @@ void test_announce_request_udp_zero_connection_id(void) {
 // Tests for scrape_request_udp
 // ============================================================================
 
+/**
+ * Forks a tracker that answers request_amount scrape requests, reporting index i of each request as
+ * seeders = i, completed = 2*i, leechers = 3*i, where i counts from the first info hash of all requests
+ */
+static pid_t fork_scrape_tracker(struct sockaddr_in* addr, const uint32_t request_amount) {
+    const int32_t server = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(server, (struct sockaddr*) addr, sizeof(struct sockaddr_in));
+    socklen_t len = sizeof(struct sockaddr_in);
+    getsockname(server, (struct sockaddr*) addr, &len);
+
+    const pid_t pid = fork();
+    if (pid != 0) {
+        close(server);
+        return pid;
+    }
+    for (uint32_t answered = 0; answered < request_amount; ++answered) {
+        unsigned char request[SCRAPE_REQUEST_SIZE + 20*MAX_SCRAPE_TORRENTS];
+        unsigned char response[8 + 12*MAX_SCRAPE_TORRENTS];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        const ssize_t received = recvfrom(server, request, sizeof(request), 0, (struct sockaddr*) &from, &from_len);
+        if (received < SCRAPE_REQUEST_SIZE) _exit(1);
+        const uint32_t amount = (received - SCRAPE_REQUEST_SIZE) / 20;
+        memcpy(response, request+8, 8);
+        for (uint32_t i = 0; i < amount; ++i) {
+            // Test info hashes start with their index
+            uint32_t index;
+            memcpy(&index, request + SCRAPE_REQUEST_SIZE + 20*i, 4);
+            const uint32_t values[3] = {htobe32(index), htobe32(2*index), htobe32(3*index)};
+            memcpy(response + 8 + 12*i, values, 12);
+        }
+        sendto(server, response, 8 + 12*amount, 0, (struct sockaddr*) &from, from_len);
+    }
+    _exit(0);
+}
+
+static void check_scrape(const uint32_t torrent_amount) {
+    const uint32_t request_amount = (torrent_amount + MAX_SCRAPE_TORRENTS - 1) / MAX_SCRAPE_TORRENTS;
+    struct sockaddr_in server;
+    const pid_t pid = fork_scrape_tracker(&server, request_amount);
+    const int32_t sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    char* info_hash = calloc(torrent_amount, 20);
+    for (uint32_t i = 0; i < torrent_amount; ++i) {
+        memcpy(info_hash + 20*i, &i, 4);
+    }
+
+    scrape_response_t* result = scrape_request_udp((struct sockaddr*) &server, sockfd, 123456789, info_hash,
+                                                   torrent_amount, LOG_NO);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    TEST_ASSERT_NOT_NULL(result);
+    TEST_ASSERT_EQUAL_UINT32(2, result->action);
+    for (uint32_t i = 0; i < torrent_amount; ++i) {
+        TEST_ASSERT_EQUAL_UINT32(i, result->scraped_data_array[i].seeders);
+        TEST_ASSERT_EQUAL_UINT32(2*i, result->scraped_data_array[i].completed);
+        TEST_ASSERT_EQUAL_UINT32(3*i, result->scraped_data_array[i].leechers);
+    }
+    free(result);
+    free(info_hash);
+    close(sockfd);
+}
+
 void test_scrape_request_udp_valid_single_torrent(void) {
-    // This test would require mocking socket operations
-    TEST_IGNORE_MESSAGE("Requires socket mocking");
+    check_scrape(1);
 }
 
 void test_scrape_request_udp_valid_multiple_torrents(void) {
-    // This test would require mocking socket operations
-    TEST_IGNORE_MESSAGE("Requires socket mocking");
+    // More than fit in a single datagram, so split into 3 requests
+    check_scrape(2*MAX_SCRAPE_TORRENTS + 10);
 }
 
 void test_scrape_request_udp_null_server_addr(void) {
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "unity.h"
+#include "../src/resolver.h"
+
+typedef struct {
+    uint32_t calls;
+    bool failed;
+    struct sockaddr_storage addr;
+} resolved_t;
+
+static void on_resolved(void* ctx, const struct sockaddr* addr, const socklen_t addr_len) {
+    resolved_t* resolved = ctx;
+    resolved->calls++;
+    resolved->failed = addr == nullptr;
+    if (addr) memcpy(&resolved->addr, addr, addr_len);
+}
+
+/**
+ * Runs the loop until *calls reaches expected_calls, or until the timeout in milliseconds
+ */
+static void run_resolver_loop(event_loop_t* loop, const uint32_t* calls, const uint32_t expected_calls,
+                              const int32_t timeout) {
+    struct epoll_event events[4];
+    int32_t waited = 0;
+    while (*calls < expected_calls && waited < timeout) {
+        const int32_t nfds = epoll_wait(loop->epoll, events, 4, 20);
+        for (int32_t i = 0; i < nfds; ++i) {
+            TEST_ASSERT_TRUE(loop_dispatch(loop, &events[i]));
+        }
+        waited += 20;
+    }
+}
+
+void test_resolver_create_free(void) {
+    TEST_ASSERT_NULL(resolver_create(nullptr, LOG_NO));
+    event_loop_t* loop = loop_create();
+    resolver_t* resolver = resolver_create(loop, LOG_NO);
+    TEST_ASSERT_NOT_NULL(resolver);
+    TEST_ASSERT_EQUAL_UINT32(0, resolver_resolve(resolver, nullptr, "80", SOCK_DGRAM, on_resolved, nullptr));
+    TEST_ASSERT_EQUAL_UINT32(0, resolver_resolve(resolver, "localhost", "80", SOCK_DGRAM, nullptr, nullptr));
+    resolver_free(resolver);
+    resolver_free(nullptr);
+    loop_free(loop);
+}
+
+void test_resolver_resolves_from_loop(void) {
+    event_loop_t* loop = loop_create();
+    resolver_t* resolver = resolver_create(loop, LOG_NO);
+    resolved_t resolved = {0};
+    TEST_ASSERT_NOT_EQUAL_UINT32(0, resolver_resolve(resolver, "localhost", "6969", SOCK_DGRAM, on_resolved,
+                                                     &resolved));
+    // Never called from inside resolver_resolve()
+    TEST_ASSERT_EQUAL_UINT32(0, resolved.calls);
+    run_resolver_loop(loop, &resolved.calls, 1, 5000);
+
+    TEST_ASSERT_EQUAL_UINT32(1, resolved.calls);
+    TEST_ASSERT_FALSE(resolved.failed);
+    // IPv4 is preferred
+    TEST_ASSERT_EQUAL_INT32(AF_INET, resolved.addr.ss_family);
+    const struct sockaddr_in* addr = (struct sockaddr_in*) &resolved.addr;
+    TEST_ASSERT_EQUAL_UINT32(htonl(INADDR_LOOPBACK), addr->sin_addr.s_addr);
+    TEST_ASSERT_EQUAL_UINT32(6969, ntohs(addr->sin_port));
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.resolutions);
+    TEST_ASSERT_EQUAL_UINT64(0, resolver->stats.cache_hits);
+
+    resolver_free(resolver);
+    loop_free(loop);
+}
+
+void test_resolver_cache_hit(void) {
+    event_loop_t* loop = loop_create();
+    resolver_t* resolver = resolver_create(loop, LOG_NO);
+    resolved_t first = {0}, second = {0};
+    resolver_resolve(resolver, "localhost", "6969", SOCK_DGRAM, on_resolved, &first);
+    run_resolver_loop(loop, &first.calls, 1, 5000);
+
+    TEST_ASSERT_NOT_EQUAL_UINT32(0, resolver_resolve(resolver, "localhost", "6969", SOCK_DGRAM, on_resolved, &second));
+    // Cache hits go through the loop too
+    TEST_ASSERT_EQUAL_UINT32(0, second.calls);
+    run_resolver_loop(loop, &second.calls, 1, 1000);
+    TEST_ASSERT_EQUAL_UINT32(1, second.calls);
+    TEST_ASSERT_EQUAL_MEMORY(&first.addr, &second.addr, sizeof(struct sockaddr_in));
+    TEST_ASSERT_EQUAL_UINT64(2, resolver->stats.lookups);
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.cache_hits);
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.resolutions);
+
+    // Expired entries are resolved again
+    for (uint32_t i = 0; i < RESOLVER_CACHE_SIZE; ++i) {
+        if (resolver->cache[i].host) resolver->cache[i].expires = time(nullptr) - 1;
+    }
+    second.calls = 0;
+    resolver_resolve(resolver, "localhost", "6969", SOCK_DGRAM, on_resolved, &second);
+    run_resolver_loop(loop, &second.calls, 1, 5000);
+    TEST_ASSERT_EQUAL_UINT64(2, resolver->stats.resolutions);
+
+    resolver_free(resolver);
+    loop_free(loop);
+}
+
+void test_resolver_negative_cache(void) {
+    event_loop_t* loop = loop_create();
+    resolver_t* resolver = resolver_create(loop, LOG_NO);
+    resolved_t resolved = {0};
+    // Unknown service names fail without asking any DNS server
+    resolver_resolve(resolver, "127.0.0.1", "no-such-service", SOCK_DGRAM, on_resolved, &resolved);
+    run_resolver_loop(loop, &resolved.calls, 1, 5000);
+    TEST_ASSERT_EQUAL_UINT32(1, resolved.calls);
+    TEST_ASSERT_TRUE(resolved.failed);
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.failures);
+
+    resolved.calls = 0;
+    resolver_resolve(resolver, "127.0.0.1", "no-such-service", SOCK_DGRAM, on_resolved, &resolved);
+    run_resolver_loop(loop, &resolved.calls, 1, 1000);
+    TEST_ASSERT_TRUE(resolved.failed);
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.negative_hits);
+    TEST_ASSERT_EQUAL_UINT64(1, resolver->stats.resolutions);
+
+    resolver_free(resolver);
+    loop_free(loop);
+}
+
+void test_resolver_cancel(void) {
+    event_loop_t* loop = loop_create();
+    resolver_t* resolver = resolver_create(loop, LOG_NO);
+    resolved_t cancelled = {0}, kept = {0};
+    const uint32_t id = resolver_resolve(resolver, "localhost", "1", SOCK_DGRAM, on_resolved, &cancelled);
+    resolver_resolve(resolver, "localhost", "2", SOCK_DGRAM, on_resolved, &kept);
+    resolver_cancel(resolver, id);
+    resolver_cancel(resolver, 0);
+    run_resolver_loop(loop, &kept.calls, 1, 5000);
+    // Giving the cancelled one time to finish too
+    run_resolver_loop(loop, &cancelled.calls, 1, 200);
+
+    TEST_ASSERT_EQUAL_UINT32(0, cancelled.calls);
+    TEST_ASSERT_EQUAL_UINT32(1, kept.calls);
+    resolver_free(resolver);
+    loop_free(loop);
+}
@@ -0,0 +1,10 @@
+#ifndef BITTORRENT_CLIENT_TEST_RESOLVER_H
+#define BITTORRENT_CLIENT_TEST_RESOLVER_H
+
+void test_resolver_create_free(void);
+void test_resolver_resolves_from_loop(void);
+void test_resolver_cache_hit(void);
+void test_resolver_negative_cache(void);
+void test_resolver_cancel(void);
+
+#endif //BITTORRENT_CLIENT_TEST_RESOLVER_H
@@ -6,6 +6,24 @@
 #include "test_parsing.h"
 #include "test_predownload_udp.h"
 #include "test_downloading.h"
+#include "test_event_loop.h"
+#include "test_announcer.h"
+#include "test_udp_client.h"
+#include "test_http_tracker.h"
+#include "test_resolver.h"
+#include "test_metrics.h"
+#include "test_logger.h"
+#include "test_trace.h"
+#include "test_timer_wheel.h"
+#include "test_listener.h"
+#include "test_metadata.h"
+#include "test_dht.h"
+#include "test_pex.h"
+#include "test_utp.h"
+#include "test_lsd.h"
+#include "test_webseed.h"
+#include "test_merkle.h"
+#include "test_sha1.h"
 
 void setUp(void) {
     // set stuff up here
@@ -64,6 +82,14 @@ int main(void) {
     RUN_TEST(test_info_t_zero_lengths);
     RUN_TEST(test_info_t_piece_zero);
 
+    // map_torrent_file tests
+    RUN_TEST(test_map_torrent_file_sample);
+    RUN_TEST(test_map_torrent_file_nonexistent);
+    RUN_TEST(test_map_torrent_file_null_path);
+    RUN_TEST(test_parse_metainfo_pieces_view);
+    RUN_TEST(test_parse_metainfo_info_dict_view);
+    RUN_TEST(test_parse_metainfo_all_test_files);
+
     // messages tests
 
     // bitfield_to_hex tests
@@ -98,13 +124,41 @@ int main(void) {
 
     // handle_bitfield tests
     RUN_TEST(test_handle_bitfield_null_payload);
+    RUN_TEST(test_handle_bitfield_copies_payload);
 
     // write_block tests
     RUN_TEST(test_write_block_normal);
     RUN_TEST(test_write_block_zero);
     RUN_TEST(test_write_block_null_file);
+    // send_message, peer_send and flush_output tests
+    RUN_TEST(test_send_message_interested);
+    RUN_TEST(test_peer_send_queues_when_full);
+    RUN_TEST(test_peer_send_queue_limit);
+    // request_blocks, block_received and release_requests tests
+    RUN_TEST(test_request_blocks_fills_queue);
+    RUN_TEST(test_request_blocks_local_peer_queue);
+    RUN_TEST(test_request_blocks_choked);
+    RUN_TEST(test_request_blocks_failed_send_releases_claim);
+    RUN_TEST(test_request_blocks_concurrent_claims);
+    RUN_TEST(test_block_received_and_release_requests);
+    // Fast Extension tests
+    RUN_TEST(test_handle_have_all_and_none);
+    RUN_TEST(test_request_blocks_allowed_fast_while_choked);
+    RUN_TEST(test_request_blocks_suggested_first);
 
     /* basic_bencode.h */
+
+    // skip_bencode_value tests
+    RUN_TEST(test_skip_bencode_value_int);
+    RUN_TEST(test_skip_bencode_value_string);
+    RUN_TEST(test_skip_bencode_value_nested);
+    RUN_TEST(test_skip_bencode_value_truncated);
+    RUN_TEST(test_skip_bencode_value_invalid);
+
+    // In place reading tests
+    RUN_TEST(test_read_bencode_string);
+    RUN_TEST(test_read_bencode_int);
+    RUN_TEST(test_find_bencode_key);
     /*
     // String decoding tests
     RUN_TEST(test_decode_bencode_string_valid_simple);
@@ -319,6 +373,11 @@ int main(void) {
     RUN_TEST(test_closing_files_single_file_complete);
     RUN_TEST(test_closing_files_single_file_incomplete);
     RUN_TEST(test_closing_files_multiple_files);
+    // verify_piece tests
+    RUN_TEST(test_verify_piece_matching_hash);
+    RUN_TEST(test_verify_piece_across_files);
+    RUN_TEST(test_verify_piece_wrong_hash);
+    RUN_TEST(test_verify_pieces);
 
     // handle_predownload_udp tests
     RUN_TEST(test_handle_predownload_udp_valid_request);
@@ -333,6 +392,17 @@ int main(void) {
     RUN_TEST(test_read_from_socket_connection_closed);
     RUN_TEST(test_read_from_socket_partial_read);
 
+    // receive_messages tests
+    RUN_TEST(test_receive_messages_null_peer);
+    RUN_TEST(test_receive_messages_many_per_read);
+    RUN_TEST(test_receive_messages_split_message);
+    RUN_TEST(test_receive_messages_block);
+    RUN_TEST(test_receive_messages_too_big);
+    RUN_TEST(test_receive_messages_connection_closed);
+
+    // update_interest tests
+    RUN_TEST(test_update_interest_output_only_when_queued);
+
     // reconnect tests
     RUN_TEST(test_reconnect_null_peer_list);
     RUN_TEST(test_reconnect_zero_peer_amount);
@@ -340,6 +410,11 @@ int main(void) {
     RUN_TEST(test_reconnect_no_closed_peers);
     RUN_TEST(test_reconnect_some_closed_peers);
 
+    // add_peers tests
+    RUN_TEST(test_add_peers_null);
+    RUN_TEST(test_add_peers_merges_duplicates);
+    RUN_TEST(test_add_inbound_peer);
+
     // write_state tests
     RUN_TEST(test_write_state_null_filename);
     RUN_TEST(test_write_state_null_state);
@@ -364,5 +439,144 @@ int main(void) {
     RUN_TEST(test_torrent_invalid_metainfo);
     RUN_TEST(test_torrent_full_integration);
 
+    /* event_loop.h */
+    RUN_TEST(test_loop_create_free);
+    RUN_TEST(test_loop_add_source_invalid);
+    RUN_TEST(test_loop_dispatch_source);
+    RUN_TEST(test_loop_dispatch_peer_event);
+    RUN_TEST(test_loop_add_source_grows);
+    RUN_TEST(test_loop_remove_source_reuses_slot);
+
+    /* announcer.h */
+    RUN_TEST(test_announcer_start_null);
+    RUN_TEST(test_announcer_start_no_udp_tracker);
+    RUN_TEST(test_announcer_first_responder_wins);
+    RUN_TEST(test_announcer_merges_tiers);
+    RUN_TEST(test_announcer_tick_retransmits);
+    RUN_TEST(test_announcer_tick_reannounces);
+    RUN_TEST(test_announcer_reuses_connection_id);
+    RUN_TEST(test_announcer_resolves_hostname);
+
+    /* udp_client.h */
+    RUN_TEST(test_udp_client_create_free);
+    RUN_TEST(test_udp_client_send_invalid);
+    RUN_TEST(test_udp_client_routes_responses);
+    RUN_TEST(test_udp_client_cancel);
+    RUN_TEST(test_udp_client_ignores_other_sources);
+    RUN_TEST(test_udp_client_transaction_table_grows);
+    RUN_TEST(test_udp_client_connection_cache);
+
+    /* http_tracker.h */
+    RUN_TEST(test_url_encode_bytes);
+    RUN_TEST(test_build_http_announce_url);
+    RUN_TEST(test_build_http_scrape_url);
+    RUN_TEST(test_parse_http_announce_compact);
+    RUN_TEST(test_parse_http_announce_failure);
+    RUN_TEST(test_compact_peer_list);
+    RUN_TEST(test_parse_http_scrape);
+    RUN_TEST(test_http_client_get);
+    RUN_TEST(test_http_client_failure);
+    RUN_TEST(test_http_tracker_scrape);
+    RUN_TEST(test_announcer_http_tracker);
+
+    /* resolver.h */
+    RUN_TEST(test_resolver_create_free);
+    RUN_TEST(test_resolver_resolves_from_loop);
+    RUN_TEST(test_resolver_cache_hit);
+    RUN_TEST(test_resolver_negative_cache);
+    RUN_TEST(test_resolver_cancel);
+
+    /* metrics.h */
+    RUN_TEST(test_metrics_counters_across_threads);
+    RUN_TEST(test_metrics_render);
+    RUN_TEST(test_metrics_server_tcp);
+    RUN_TEST(test_metrics_server_unix);
+
+    /* logger.h */
+    RUN_TEST(test_logger_levels);
+    RUN_TEST(test_logger_threads);
+    RUN_TEST(test_logger_hex_rate_limit);
+
+    /* trace.h */
+    RUN_TEST(test_trace_disabled);
+    RUN_TEST(test_trace_export);
+    /* timer_wheel.h */
+    RUN_TEST(test_timer_wheel_expiry);
+    RUN_TEST(test_timer_wheel_disarm);
+    RUN_TEST(test_timer_wheel_rearm_in_callback);
+    RUN_TEST(test_timer_wheel_long_delay);
+    RUN_TEST(test_timer_wheel_timeout);
+    RUN_TEST(test_timer_wheel_delete_reuses_id);
+    RUN_TEST(test_timer_wheel_growth);
+    /* listener.h */
+    RUN_TEST(test_listener_start_invalid);
+    RUN_TEST(test_listener_register_twice);
+    RUN_TEST(test_listener_hands_over_peer);
+    RUN_TEST(test_listener_closes_unknown_torrent);
+    RUN_TEST(test_listener_limits_per_address);
+
+    /* metadata.h */
+    RUN_TEST(test_magnet_info_hash_hex_and_base32);
+    RUN_TEST(test_magnet_info_hash_invalid);
+    RUN_TEST(test_magnet_info_hash_multihash);
+    RUN_TEST(test_extension_handshake_round_trip);
+    RUN_TEST(test_parse_extension_handshake_without_ut_metadata);
+    RUN_TEST(test_metadata_message_round_trip);
+    RUN_TEST(test_parse_metadata_message_data);
+    RUN_TEST(test_metadata_assembles_out_of_order);
+    RUN_TEST(test_metadata_hash_mismatch_resets);
+    RUN_TEST(test_metadata_rejects_bad_pieces);
+    RUN_TEST(test_metadata_requests_expire);
+    RUN_TEST(test_build_magnet_torrent_parses);
+    RUN_TEST(test_metadata_job_start_without_trackers);
+    RUN_TEST(test_resolve_magnets_counts_unusable_links);
+
+    /* dht.h */
+    RUN_TEST(test_dht_common_prefix);
+    RUN_TEST(test_dht_closest_orders_by_distance);
+    RUN_TEST(test_dht_full_bucket_keeps_good_nodes);
+    RUN_TEST(test_dht_routing_table_persists);
+    RUN_TEST(test_dht_answers_ping);
+    RUN_TEST(test_dht_loopback_lookup);
+
+    /* pex.h */
+    RUN_TEST(test_pex_handshake_round_trip);
+    RUN_TEST(test_pex_message_round_trip);
+    RUN_TEST(test_pex_message_missing_lists);
+    RUN_TEST(test_pex_diff_and_apply);
+
+    /* utp.h */
+    RUN_TEST(test_utp_header_round_trip);
+    RUN_TEST(test_utp_read_header_rejects_malformed);
+    RUN_TEST(test_utp_ledbat_window);
+    RUN_TEST(test_utp_loopback_transfer);
+    RUN_TEST(test_utp_lossy_transfer);
+    RUN_TEST(test_utp_unreachable_port_closes);
+
+    /* lsd.h */
+    RUN_TEST(test_lsd_announce_round_trip);
+    RUN_TEST(test_lsd_parse_announce_rejects);
+    RUN_TEST(test_lsd_is_local_address);
+    RUN_TEST(test_lsd_discovers_peer);
+
+    /* webseed.h */
+    RUN_TEST(test_webseed_ranges);
+    RUN_TEST(test_webseed_file_url);
+    RUN_TEST(test_webseed_fetch);
+    RUN_TEST(test_webseed_missing_file);
+
+    /* merkle.h */
+    RUN_TEST(test_merkle_root);
+    RUN_TEST(test_parse_metainfo_v2);
+    RUN_TEST(test_parse_metainfo_hybrid);
+    RUN_TEST(test_merkle_hashes);
+    RUN_TEST(test_merkle_check_piece);
+    RUN_TEST(test_padding_is_not_written);
+
+    /* sha1.h */
+    RUN_TEST(test_sha1_hash_known);
+    RUN_TEST(test_sha1_engines_match_openssl);
+    RUN_TEST(test_sha1_batch_engine);
+
     return UNITY_END();
 }
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "unity.h"
+#include "../src/sha1.h"
+
+/// @brief Buffers hashed by the batch tests, more than a batch of 16 lanes with some left over
+#define TEST_BUFFERS 37
+
+void test_sha1_hash_known(void) {
+    const unsigned char empty[SHA1_HASH_SIZE] = {
+        0xda, 0x39, 0xa3, 0xee, 0x5e, 0x6b, 0x4b, 0x0d, 0x32, 0x55, 0xbf, 0xef, 0x95, 0x60, 0x18, 0x90, 0xaf, 0xd8,
+        0x07, 0x09
+    };
+    const unsigned char abc[SHA1_HASH_SIZE] = {
+        0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e, 0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0,
+        0xd8, 0x9d
+    };
+    unsigned char hash[SHA1_HASH_SIZE];
+    for (SHA1_ENGINE engine = SHA1_ENGINE_AUTO; engine < SHA1_ENGINE_COUNT; ++engine) {
+        if (!sha1_set_engine(engine)) continue;
+        sha1_hash(nullptr, 0, hash);
+        TEST_ASSERT_EQUAL_MEMORY(empty, hash, SHA1_HASH_SIZE);
+        sha1_hash((const unsigned char*) "abc", 3, hash);
+        TEST_ASSERT_EQUAL_MEMORY(abc, hash, SHA1_HASH_SIZE);
+    }
+    sha1_set_engine(SHA1_ENGINE_AUTO);
+    TEST_ASSERT_TRUE(sha1_engine_supported(SHA1_ENGINE_OPENSSL));
+    TEST_ASSERT_FALSE(sha1_set_engine(SHA1_ENGINE_COUNT));
+}
+
+void test_sha1_engines_match_openssl(void) {
+    // Lengths around the padding boundaries, then long ones of different lengths so lanes finish at different times
+    unsigned char* data[TEST_BUFFERS];
+    uint64_t lengths[TEST_BUFFERS];
+    const uint64_t short_lengths[] = {0, 1, 55, 56, 63, 64, 65, 119, 120, 127, 128, 129};
+    const uint32_t short_amount = sizeof(short_lengths) / sizeof(short_lengths[0]);
+    for (uint32_t i = 0; i < TEST_BUFFERS; ++i) {
+        lengths[i] = i < short_amount ? short_lengths[i] : 1000 + (uint64_t) i * 7919;
+        data[i] = malloc(lengths[i] + 1);
+        for (uint64_t j = 0; j < lengths[i]; ++j) data[i][j] = (unsigned char) (j * 31 + i);
+    }
+    unsigned char expected[TEST_BUFFERS * SHA1_HASH_SIZE];
+    for (uint32_t i = 0; i < TEST_BUFFERS; ++i) SHA1(data[i], lengths[i], expected + i * SHA1_HASH_SIZE);
+
+    unsigned char hashes[TEST_BUFFERS * SHA1_HASH_SIZE];
+    for (SHA1_ENGINE engine = SHA1_ENGINE_AUTO; engine < SHA1_ENGINE_COUNT; ++engine) {
+        if (!sha1_set_engine(engine)) continue;
+        memset(hashes, 0, sizeof(hashes));
+        sha1_hash_batch((const unsigned char* const*) data, lengths, TEST_BUFFERS, hashes);
+        TEST_ASSERT_EQUAL_MEMORY(expected, hashes, sizeof(hashes));
+        // Batches smaller than the lanes leave some of them idle
+        memset(hashes, 0, sizeof(hashes));
+        sha1_hash_batch((const unsigned char* const*) data + short_amount, lengths + short_amount, 3, hashes);
+        TEST_ASSERT_EQUAL_MEMORY(expected + short_amount * SHA1_HASH_SIZE, hashes, 3 * SHA1_HASH_SIZE);
+        sha1_hash(data[TEST_BUFFERS - 1], lengths[TEST_BUFFERS - 1], hashes);
+        TEST_ASSERT_EQUAL_MEMORY(expected + (TEST_BUFFERS - 1) * SHA1_HASH_SIZE, hashes, SHA1_HASH_SIZE);
+    }
+    sha1_set_engine(SHA1_ENGINE_AUTO);
+    for (uint32_t i = 0; i < TEST_BUFFERS; ++i) free(data[i]);
+}
+
+void test_sha1_batch_engine(void) {
+    TEST_ASSERT_NOT_EQUAL(SHA1_ENGINE_AUTO, sha1_batch_engine(1));
+    TEST_ASSERT_NOT_EQUAL(SHA1_ENGINE_AUTO, sha1_batch_engine(16));
+    TEST_ASSERT_TRUE(sha1_engine_supported(sha1_batch_engine(16)));
+    // A lone buffer never goes through lanes on its own
+    TEST_ASSERT_NOT_EQUAL(SHA1_ENGINE_AVX2, sha1_batch_engine(1));
+    TEST_ASSERT_NOT_EQUAL(SHA1_ENGINE_AVX512, sha1_batch_engine(1));
+    // Forcing an engine sends batches of any size through it
+    TEST_ASSERT_TRUE(sha1_set_engine(SHA1_ENGINE_OPENSSL));
+    TEST_ASSERT_EQUAL(SHA1_ENGINE_OPENSSL, sha1_batch_engine(16));
+    sha1_set_engine(SHA1_ENGINE_AUTO);
+    TEST_ASSERT_EQUAL_STRING("avx512", sha1_engine_name(SHA1_ENGINE_AVX512));
+    TEST_ASSERT_EQUAL_STRING("unknown", sha1_engine_name(SHA1_ENGINE_COUNT));
+}
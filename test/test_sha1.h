@@ -0,0 +1,8 @@
+#ifndef BITTORRENT_CLIENT_TEST_SHA1_H
+#define BITTORRENT_CLIENT_TEST_SHA1_H
+
+void test_sha1_hash_known(void);
+void test_sha1_engines_match_openssl(void);
+void test_sha1_batch_engine(void);
+
+#endif //BITTORRENT_CLIENT_TEST_SHA1_H
@@ -0,0 +1,169 @@
+#include "unity.h"
+#include "../src/timer_wheel.h"
+
+/// @brief What the test callbacks record
+typedef struct {
+    timer_wheel_t* wheel;
+    uint32_t fired[16];
+    uint32_t amount;
+    uint32_t rearm_id; /**< Timer re-armed by rearm_callback, TIMER_NONE for none */
+    uint32_t disarm_id; /**< Timer disarmed by disarm_callback */
+} timer_record_t;
+
+static void record_callback(void* ctx, const uint32_t data) {
+    timer_record_t* record = ctx;
+    if (record->amount < 16) record->fired[record->amount] = data;
+    record->amount++;
+}
+
+static void rearm_callback(void* ctx, const uint32_t data) {
+    timer_record_t* record = ctx;
+    record_callback(ctx, data);
+    wheel_timer_arm(record->wheel, record->rearm_id, 1000);
+}
+
+static void disarm_callback(void* ctx, const uint32_t data) {
+    timer_record_t* record = ctx;
+    record_callback(ctx, data);
+    wheel_timer_disarm(record->wheel, record->disarm_id);
+}
+
+void test_timer_wheel_expiry(void) {
+    timer_record_t record = {0};
+    timer_wheel_t* wheel = timer_wheel_create(10000);
+    TEST_ASSERT_NOT_NULL(wheel);
+    const uint32_t late = wheel_timer_new(wheel, record_callback, &record, 2);
+    const uint32_t early = wheel_timer_new(wheel, record_callback, &record, 1);
+    TEST_ASSERT_TRUE(wheel_timer_arm(wheel, late, 500));
+    TEST_ASSERT_TRUE(wheel_timer_arm(wheel, early, 250));
+    TEST_ASSERT_TRUE(wheel_timer_armed(wheel, early));
+
+    // Never before their delay
+    TEST_ASSERT_EQUAL_UINT32(0, timer_wheel_advance(wheel, 10200));
+    TEST_ASSERT_EQUAL_UINT32(1, timer_wheel_advance(wheel, 10300));
+    TEST_ASSERT_EQUAL_UINT32(1, record.fired[0]);
+    TEST_ASSERT_FALSE(wheel_timer_armed(wheel, early));
+    // Going back in time does nothing
+    TEST_ASSERT_EQUAL_UINT32(0, timer_wheel_advance(wheel, 9000));
+    TEST_ASSERT_EQUAL_UINT32(1, timer_wheel_advance(wheel, 10500));
+    TEST_ASSERT_EQUAL_UINT32(2, record.amount);
+    TEST_ASSERT_EQUAL_UINT32(2, record.fired[1]);
+    // Fired timers stay disarmed
+    TEST_ASSERT_EQUAL_UINT32(0, timer_wheel_advance(wheel, 20000));
+    TEST_ASSERT_FALSE(wheel_timer_arm(wheel, TIMER_NONE, 100));
+    timer_wheel_free(wheel);
+}
+
+void test_timer_wheel_disarm(void) {
+    timer_record_t record = {0};
+    timer_wheel_t* wheel = timer_wheel_create(0);
+    record.wheel = wheel;
+    const uint32_t first = wheel_timer_new(wheel, disarm_callback, &record, 1);
+    const uint32_t second = wheel_timer_new(wheel, record_callback, &record, 2);
+    const uint32_t third = wheel_timer_new(wheel, record_callback, &record, 3);
+    wheel_timer_arm(wheel, third, 100);
+    wheel_timer_arm(wheel, second, 100);
+    // The last one armed goes first
+    wheel_timer_arm(wheel, first, 100);
+    wheel_timer_disarm(wheel, third);
+    wheel_timer_disarm(wheel, TIMER_NONE);
+    // Disarmed by a callback of the same slot, right before its turn
+    record.disarm_id = second;
+    TEST_ASSERT_EQUAL_UINT32(1, timer_wheel_advance(wheel, 1000));
+    TEST_ASSERT_EQUAL_UINT32(1, record.amount);
+    TEST_ASSERT_EQUAL_UINT32(1, record.fired[0]);
+    TEST_ASSERT_EQUAL_INT32(5000, timer_wheel_timeout(wheel, 5000));
+    timer_wheel_free(wheel);
+}
+
+void test_timer_wheel_rearm_in_callback(void) {
+    timer_record_t record = {0};
+    timer_wheel_t* wheel = timer_wheel_create(0);
+    record.wheel = wheel;
+    const uint32_t id = wheel_timer_new(wheel, rearm_callback, &record, 7);
+    record.rearm_id = id;
+    wheel_timer_arm(wheel, id, 1000);
+    // Re-armed from its own callback, once per second
+    TEST_ASSERT_EQUAL_UINT32(1, timer_wheel_advance(wheel, 1000));
+    TEST_ASSERT_TRUE(wheel_timer_armed(wheel, id));
+    TEST_ASSERT_EQUAL_UINT32(0, timer_wheel_advance(wheel, 1900));
+    TEST_ASSERT_EQUAL_UINT32(1, timer_wheel_advance(wheel, 2000));
+    TEST_ASSERT_EQUAL_UINT32(2, record.amount);
+    timer_wheel_free(wheel);
+}
+
+void test_timer_wheel_long_delay(void) {
+    timer_record_t record = {0};
+    timer_wheel_t* wheel = timer_wheel_create(0);
+    const uint32_t full_turn = TIMER_SLOTS * TIMER_TICK_MS;
+    const uint32_t short_id = wheel_timer_new(wheel, record_callback, &record, 1);
+    const uint32_t long_id = wheel_timer_new(wheel, record_callback, &record, 2);
+    // Both in the same slot, a turn apart
+    wheel_timer_arm(wheel, short_id, 300);
+    wheel_timer_arm(wheel, long_id, full_turn + 300);
+    TEST_ASSERT_EQUAL_UINT32(1, timer_wheel_advance(wheel, 300));
+    TEST_ASSERT_EQUAL_UINT32(1, record.fired[0]);
+    TEST_ASSERT_TRUE(wheel_timer_armed(wheel, long_id));
+    TEST_ASSERT_EQUAL_UINT32(0, timer_wheel_advance(wheel, full_turn + 200));
+    TEST_ASSERT_EQUAL_UINT32(1, timer_wheel_advance(wheel, full_turn + 300));
+    TEST_ASSERT_EQUAL_UINT32(2, record.fired[1]);
+
+    // A jump of several turns fires everything due once
+    wheel_timer_arm(wheel, short_id, 100);
+    wheel_timer_arm(wheel, long_id, 3 * full_turn);
+    TEST_ASSERT_EQUAL_UINT32(2, timer_wheel_advance(wheel, 10 * full_turn));
+    TEST_ASSERT_EQUAL_UINT32(4, record.amount);
+    timer_wheel_free(wheel);
+}
+
+void test_timer_wheel_timeout(void) {
+    timer_record_t record = {0};
+    timer_wheel_t* wheel = timer_wheel_create(1050);
+    TEST_ASSERT_EQUAL_INT32(1000, timer_wheel_timeout(wheel, 1000));
+    const uint32_t id = wheel_timer_new(wheel, record_callback, &record, 0);
+    wheel_timer_arm(wheel, id, 350);
+    // Due at the end of its tick
+    TEST_ASSERT_EQUAL_INT32(350, timer_wheel_timeout(wheel, 1000));
+    TEST_ASSERT_EQUAL_INT32(200, timer_wheel_timeout(wheel, 200));
+    // Found past the end of the slot array, rounded up to its tick as well
+    wheel_timer_arm(wheel, id, (TIMER_SLOTS - 3) * TIMER_TICK_MS);
+    TEST_ASSERT_EQUAL_INT32((TIMER_SLOTS - 3) * TIMER_TICK_MS + 50, timer_wheel_timeout(wheel, INT32_MAX));
+    // Already due
+    timer_wheel_advance(wheel, 1099);
+    wheel_timer_arm(wheel, id, 0);
+    TEST_ASSERT_EQUAL_INT32(1, timer_wheel_timeout(wheel, 1000));
+    TEST_ASSERT_EQUAL_INT32(1000, timer_wheel_timeout(nullptr, 1000));
+    timer_wheel_free(wheel);
+}
+
+void test_timer_wheel_delete_reuses_id(void) {
+    timer_record_t record = {0};
+    timer_wheel_t* wheel = timer_wheel_create(0);
+    const uint32_t first = wheel_timer_new(wheel, record_callback, &record, 1);
+    wheel_timer_arm(wheel, first, 100);
+    wheel_timer_delete(wheel, first);
+    TEST_ASSERT_FALSE(wheel_timer_armed(wheel, first));
+    TEST_ASSERT_FALSE(wheel_timer_arm(wheel, first, 100));
+    TEST_ASSERT_EQUAL_UINT32(0, timer_wheel_advance(wheel, 1000));
+    // Deleted ids are handed out again
+    TEST_ASSERT_EQUAL_UINT32(first, wheel_timer_new(wheel, record_callback, &record, 2));
+    TEST_ASSERT_EQUAL_UINT32(TIMER_NONE, wheel_timer_new(wheel, nullptr, &record, 2));
+    timer_wheel_free(wheel);
+}
+
+void test_timer_wheel_growth(void) {
+    timer_record_t record = {0};
+    timer_wheel_t* wheel = timer_wheel_create(0);
+    const uint32_t amount = TIMER_INITIAL_CAPACITY * 3;
+    uint32_t ids[TIMER_INITIAL_CAPACITY * 3];
+    for (uint32_t i = 0; i < amount; ++i) {
+        ids[i] = wheel_timer_new(wheel, record_callback, &record, i);
+        TEST_ASSERT_NOT_EQUAL_UINT32(TIMER_NONE, ids[i]);
+        wheel_timer_arm(wheel, ids[i], 100 * (i % 7 + 1));
+    }
+    TEST_ASSERT_EQUAL_UINT32(amount, wheel->armed);
+    TEST_ASSERT_EQUAL_UINT32(amount, timer_wheel_advance(wheel, 700));
+    TEST_ASSERT_EQUAL_UINT32(amount, record.amount);
+    TEST_ASSERT_EQUAL_UINT32(0, wheel->armed);
+    timer_wheel_free(wheel);
+}
@@ -0,0 +1,12 @@
+#ifndef BITTORRENT_CLIENT_TEST_TIMER_WHEEL_H
+#define BITTORRENT_CLIENT_TEST_TIMER_WHEEL_H
+
+void test_timer_wheel_expiry(void);
+void test_timer_wheel_disarm(void);
+void test_timer_wheel_rearm_in_callback(void);
+void test_timer_wheel_long_delay(void);
+void test_timer_wheel_timeout(void);
+void test_timer_wheel_delete_reuses_id(void);
+void test_timer_wheel_growth(void);
+
+#endif //BITTORRENT_CLIENT_TEST_TIMER_WHEEL_H
@@ -0,0 +1,76 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+#include "../src/trace.h"
+
+static void* trace_other_thread(void* arg) {
+    (void) arg;
+    trace_event(TRACE_LOOP_ITERATION, 2, 0, -1, trace_now());
+    return nullptr;
+}
+
+void test_trace_disabled(void) {
+    trace_start();
+    trace_stop();
+    TEST_ASSERT_EQUAL_UINT64(0, trace_now());
+    trace_event(TRACE_PIECE_COMPLETE, 1, 0, 5, 0);
+    TEST_ASSERT_EQUAL_UINT64(0, trace_event_count());
+    TEST_ASSERT_FALSE(trace_export(nullptr, LOG_NO));
+    TEST_ASSERT_FALSE(trace_export("/nonexistent/trace.json", LOG_NO));
+}
+
+void test_trace_export(void) {
+    trace_start();
+    // A piece going through its whole lifecycle, with blocks from two peers
+    trace_event(TRACE_BLOCK_REQUESTED, 3, 0, 7, 0);
+    trace_event(TRACE_BLOCK_REQUESTED, 3, 1, 8, 0);
+    uint64_t start = trace_now();
+    TEST_ASSERT_NOT_EQUAL_UINT64(0, start);
+    trace_event(TRACE_BLOCK_RECEIVED, 3, 0, 7, start);
+    trace_event(TRACE_BLOCK_RECEIVED, 3, 1, 8, trace_now());
+    trace_event(TRACE_PIECE_COMPLETE, 3, 0, 8, 0);
+    trace_event(TRACE_PIECE_HASHED, 3, true, 8, trace_now());
+    trace_event(TRACE_PIECE_FLUSHED, 3, 0, 8, trace_now());
+    // Requested but never finished, so it gets no span
+    trace_event(TRACE_BLOCK_REQUESTED, 4, 0, 7, 0);
+    pthread_t thread;
+    pthread_create(&thread, nullptr, trace_other_thread, nullptr);
+    pthread_join(thread, nullptr);
+    trace_stop();
+    TEST_ASSERT_EQUAL_UINT64(9, trace_event_count());
+
+    char path[] = "/tmp/trace_XXXXXX";
+    const int32_t fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    TEST_ASSERT_TRUE(trace_export(path, LOG_NO));
+
+    FILE* file = fopen(path, "r");
+    char* json = calloc(65536, 1);
+    fread(json, 1, 65535, file);
+    fclose(file);
+    remove(path);
+
+    TEST_ASSERT_EQUAL_INT32(0, strncmp(json, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", 38));
+    TEST_ASSERT_NOT_NULL(strstr(json, "]}\n"));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"name\":\"piece 3\",\"cat\":\"piece\",\"ph\":\"b\",\"id\":3,"));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"name\":\"piece 3\",\"cat\":\"piece\",\"ph\":\"e\",\"id\":3,"));
+    TEST_ASSERT_NULL(strstr(json, "\"name\":\"piece 4\""));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"args\":{\"piece\":3,\"block\":1,\"peer\":8}"));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"matched\":true"));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"name\":\"epoll_wait\""));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"name\":\"handle events\""));
+    // One track per thread
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"args\":{\"name\":\"thread 1\"}"));
+    TEST_ASSERT_NOT_NULL(strstr(json, "\"args\":{\"name\":\"thread 2\"}"));
+    free(json);
+
+    // Starting again discards the previous events
+    trace_start();
+    trace_stop();
+    TEST_ASSERT_EQUAL_UINT64(0, trace_event_count());
+}
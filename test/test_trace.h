@@ -0,0 +1,7 @@
+#ifndef BITTORRENT_CLIENT_TEST_TRACE_H
+#define BITTORRENT_CLIENT_TEST_TRACE_H
+
+void test_trace_disabled(void);
+void test_trace_export(void);
+
+#endif //BITTORRENT_CLIENT_TEST_TRACE_H
@@ -0,0 +1,241 @@
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "unity.h"
+#include "../src/udp_client.h"
+
+typedef struct {
+    uint32_t calls;
+    uint32_t last_length;
+    uint32_t last_transaction_id;
+} response_counter_t;
+
+static void count_response(void* ctx, const unsigned char* response, const uint32_t length) {
+    response_counter_t* counter = ctx;
+    counter->calls++;
+    counter->last_length = length;
+    memcpy(&counter->last_transaction_id, response + RESPONSE_TRANSACTION_OFFSET, 4);
+}
+
+/**
+ * Binds a UDP socket to a random loopback port
+ */
+static int32_t open_server(struct sockaddr_in* addr) {
+    const int32_t sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(addr, 0, sizeof(struct sockaddr_in));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sockfd, (struct sockaddr*) addr, sizeof(struct sockaddr_in));
+    socklen_t len = sizeof(struct sockaddr_in);
+    getsockname(sockfd, (struct sockaddr*) addr, &len);
+    return sockfd;
+}
+
+/**
+ * Answers up to amount requests with an 8-byte response carrying their transaction id, from reply_fd
+ */
+static uint32_t answer_requests(const int32_t server_fd, const int32_t reply_fd, const uint32_t amount) {
+    uint32_t answered = 0;
+    unsigned char request[MAX_REQUEST_SIZE];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    while (answered < amount && recvfrom(server_fd, request, sizeof(request), 0, (struct sockaddr*) &from, &from_len) > 0) {
+        unsigned char response[8] = {0};
+        memcpy(response + RESPONSE_TRANSACTION_OFFSET, request + REQUEST_TRANSACTION_OFFSET, 4);
+        sendto(reply_fd, response, sizeof(response), 0, (struct sockaddr*) &from, from_len);
+        answered++;
+        from_len = sizeof(from);
+    }
+    return answered;
+}
+
+static void dispatch_for(event_loop_t* loop, const int32_t milliseconds) {
+    struct epoll_event events[8];
+    for (int32_t waited = 0; waited < milliseconds; waited += 20) {
+        const int32_t nfds = epoll_wait(loop->epoll, events, 8, 20);
+        for (int32_t i = 0; i < nfds; ++i) loop_dispatch(loop, &events[i]);
+    }
+}
+
+static const unsigned char request[16] = {0};
+
+void test_udp_client_create_free(void) {
+    TEST_ASSERT_NULL(udp_client_create(nullptr, LOG_NO));
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    TEST_ASSERT_NOT_NULL(client);
+    // Sockets are only created when needed
+    TEST_ASSERT_EQUAL_INT32(-1, client->sockfd[0]);
+    TEST_ASSERT_EQUAL_INT32(-1, client->sockfd[1]);
+    TEST_ASSERT_EQUAL_UINT32(0, udp_client_flush(client));
+    udp_client_free(client);
+    udp_client_free(nullptr);
+    loop_free(loop);
+}
+
+void test_udp_client_send_invalid(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    TEST_ASSERT_EQUAL_UINT32(0, udp_client_send(nullptr, (struct sockaddr*) &addr, sizeof(addr), request, 16, nullptr, nullptr));
+    TEST_ASSERT_EQUAL_UINT32(0, udp_client_send(client, nullptr, sizeof(addr), request, 16, nullptr, nullptr));
+    // Too short to hold a transaction id
+    TEST_ASSERT_EQUAL_UINT32(0, udp_client_send(client, (struct sockaddr*) &addr, sizeof(addr), request, 8, nullptr, nullptr));
+    TEST_ASSERT_EQUAL_UINT32(0, udp_client_send(client, (struct sockaddr*) &addr, sizeof(addr), request, MAX_REQUEST_SIZE+1, nullptr, nullptr));
+    TEST_ASSERT_EQUAL_UINT32(0, client->queue_amount);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_udp_client_routes_responses(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    struct sockaddr_in addr;
+    const int32_t server = open_server(&addr);
+
+    // More than one batch worth of requests, each with its own callback context
+    const uint32_t amount = UDP_BATCH_SIZE + 8;
+    response_counter_t counters[UDP_BATCH_SIZE + 8] = {0};
+    uint32_t transaction_ids[UDP_BATCH_SIZE + 8];
+    for (uint32_t i = 0; i < amount; ++i) {
+        transaction_ids[i] = udp_client_send(client, (struct sockaddr*) &addr, sizeof(addr), request, sizeof(request),
+                                             count_response, &counters[i]);
+        TEST_ASSERT_NOT_EQUAL_UINT32(0, transaction_ids[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT32(amount, client->transaction_amount);
+    TEST_ASSERT_EQUAL_UINT32(amount, udp_client_flush(client));
+    TEST_ASSERT_EQUAL_UINT32(0, client->queue_amount);
+    // Two sendmmsg() calls instead of one sendto() per request
+    TEST_ASSERT_EQUAL_UINT64(2, client->stats.send_calls);
+    TEST_ASSERT_EQUAL_UINT64(amount, client->stats.datagrams_sent);
+
+    TEST_ASSERT_EQUAL_UINT32(amount, answer_requests(server, server, amount));
+    dispatch_for(loop, 200);
+    for (uint32_t i = 0; i < amount; ++i) {
+        TEST_ASSERT_EQUAL_UINT32(1, counters[i].calls);
+        TEST_ASSERT_EQUAL_UINT32(transaction_ids[i], counters[i].last_transaction_id);
+        TEST_ASSERT_EQUAL_UINT32(8, counters[i].last_length);
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, client->transaction_amount);
+    TEST_ASSERT_EQUAL_UINT64(amount, client->stats.datagrams_received);
+    TEST_ASSERT_TRUE(client->stats.receive_calls < amount);
+
+    close(server);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_udp_client_cancel(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    struct sockaddr_in addr;
+    const int32_t server = open_server(&addr);
+    response_counter_t counter = {0};
+
+    const uint32_t transaction_id = udp_client_send(client, (struct sockaddr*) &addr, sizeof(addr), request,
+                                                    sizeof(request), count_response, &counter);
+    udp_client_flush(client);
+    udp_client_cancel(client, transaction_id);
+    udp_client_cancel(client, 0);
+    TEST_ASSERT_EQUAL_UINT32(0, client->transaction_amount);
+
+    TEST_ASSERT_EQUAL_UINT32(1, answer_requests(server, server, 1));
+    dispatch_for(loop, 100);
+    TEST_ASSERT_EQUAL_UINT32(0, counter.calls);
+    TEST_ASSERT_EQUAL_UINT64(1, client->stats.datagrams_received);
+
+    close(server);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_udp_client_ignores_other_sources(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    struct sockaddr_in addr, other_addr;
+    const int32_t server = open_server(&addr);
+    const int32_t other = open_server(&other_addr);
+    response_counter_t counter = {0};
+
+    udp_client_send(client, (struct sockaddr*) &addr, sizeof(addr), request, sizeof(request), count_response, &counter);
+    udp_client_flush(client);
+    // Right transaction id, wrong tracker
+    TEST_ASSERT_EQUAL_UINT32(1, answer_requests(server, other, 1));
+    dispatch_for(loop, 100);
+    TEST_ASSERT_EQUAL_UINT32(0, counter.calls);
+    TEST_ASSERT_EQUAL_UINT32(1, client->transaction_amount);
+
+    close(server);
+    close(other);
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_udp_client_transaction_table_grows(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(9);
+    response_counter_t counter = {0};
+
+    const uint32_t amount = UDP_INITIAL_TRANSACTIONS * 4;
+    uint32_t transaction_ids[UDP_INITIAL_TRANSACTIONS * 4];
+    for (uint32_t i = 0; i < amount; ++i) {
+        transaction_ids[i] = udp_client_send(client, (struct sockaddr*) &addr, sizeof(addr), request, sizeof(request),
+                                             count_response, &counter);
+    }
+    TEST_ASSERT_EQUAL_UINT32(amount, client->transaction_amount);
+    TEST_ASSERT_TRUE(client->transaction_capacity >= amount * 2);
+
+    // Removing every other one must not hide the rest
+    for (uint32_t i = 0; i < amount; i += 2) udp_client_cancel(client, transaction_ids[i]);
+    TEST_ASSERT_EQUAL_UINT32(amount / 2, client->transaction_amount);
+    for (uint32_t i = 0; i < amount; i += 2) udp_client_cancel(client, transaction_ids[i]);
+    TEST_ASSERT_EQUAL_UINT32(amount / 2, client->transaction_amount);
+    for (uint32_t i = 1; i < amount; i += 2) udp_client_cancel(client, transaction_ids[i]);
+    TEST_ASSERT_EQUAL_UINT32(0, client->transaction_amount);
+
+    udp_client_free(client);
+    loop_free(loop);
+}
+
+void test_udp_client_connection_cache(void) {
+    event_loop_t* loop = loop_create();
+    udp_client_t* client = udp_client_create(loop, LOG_NO);
+    struct sockaddr_in addr = {0}, other = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(6969);
+    other = addr;
+    other.sin_port = htons(6970);
+    uint64_t connection_id = 0;
+    const time_t now = 1000;
+
+    TEST_ASSERT_FALSE(udp_client_get_connection(client, (struct sockaddr*) &addr, now, &connection_id));
+    udp_client_set_connection(client, (struct sockaddr*) &addr, 0x1234, now);
+    TEST_ASSERT_TRUE(udp_client_get_connection(client, (struct sockaddr*) &addr, now + CONNECTION_ID_TTL - 1, &connection_id));
+    TEST_ASSERT_EQUAL_UINT64(0x1234, connection_id);
+    TEST_ASSERT_FALSE(udp_client_get_connection(client, (struct sockaddr*) &other, now, &connection_id));
+
+    // Replacing keeps a single entry
+    udp_client_set_connection(client, (struct sockaddr*) &addr, 0x5678, now);
+    TEST_ASSERT_EQUAL_UINT32(1, client->connection_amount);
+    TEST_ASSERT_TRUE(udp_client_get_connection(client, (struct sockaddr*) &addr, now, &connection_id));
+    TEST_ASSERT_EQUAL_UINT64(0x5678, connection_id);
+
+    // Expired
+    TEST_ASSERT_FALSE(udp_client_get_connection(client, (struct sockaddr*) &addr, now + CONNECTION_ID_TTL, &connection_id));
+    TEST_ASSERT_EQUAL_UINT32(0, client->connection_amount);
+
+    udp_client_set_connection(client, (struct sockaddr*) &addr, 0x1234, now);
+    udp_client_forget_connection(client, (struct sockaddr*) &addr);
+    TEST_ASSERT_FALSE(udp_client_get_connection(client, (struct sockaddr*) &addr, now, &connection_id));
+
+    udp_client_free(client);
+    loop_free(loop);
+}
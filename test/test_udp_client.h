@@ -0,0 +1,12 @@
+#ifndef BITTORRENT_CLIENT_TEST_UDP_CLIENT_H
+#define BITTORRENT_CLIENT_TEST_UDP_CLIENT_H
+
+void test_udp_client_create_free(void);
+void test_udp_client_send_invalid(void);
+void test_udp_client_routes_responses(void);
+void test_udp_client_cancel(void);
+void test_udp_client_ignores_other_sources(void);
+void test_udp_client_transaction_table_grows(void);
+void test_udp_client_connection_cache(void);
+
+#endif //BITTORRENT_CLIENT_TEST_UDP_CLIENT_H
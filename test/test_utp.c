@@ -0,0 +1,272 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+#include "../src/metrics.h"
+#include "../src/utp.h"
+
+/// @brief Bytes sent through the loopback connections
+#define TRANSFER_SIZE (512 * 1024)
+/// @brief The lossy relay drops one datagram out of this many
+#define RELAY_DROP_EVERY 7
+
+/// @brief Our end of the last connection accept_callback() got
+typedef struct {
+    int32_t socket;
+    struct sockaddr_in address;
+} utp_accept_record_t;
+
+static void accept_callback(void* ctx, const int32_t socket, const struct sockaddr_in* address) {
+    utp_accept_record_t* record = ctx;
+    record->socket = socket;
+    record->address = *address;
+}
+
+/// @brief Forwards datagrams between a client and a server, dropping some of them
+typedef struct {
+    int32_t socket;
+    struct sockaddr_in server;
+    struct sockaddr_in client;
+    uint32_t forwarded;
+} utp_relay_t;
+
+static void on_relay_readable(void* ctx, const uint32_t events) {
+    (void) events;
+    utp_relay_t* relay = ctx;
+    unsigned char packet[UTP_PACKET_MAX + 64];
+    struct sockaddr_in source;
+    socklen_t length = sizeof(source);
+    ssize_t received;
+    while ((received = recvfrom(relay->socket, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr*) &source,
+                                &length)) >= 0) {
+        const bool from_server = source.sin_port == relay->server.sin_port;
+        if (!from_server) relay->client = source;
+        if (++relay->forwarded % RELAY_DROP_EVERY == 0) continue;
+        const struct sockaddr_in* destination = from_server ? &relay->client : &relay->server;
+        sendto(relay->socket, packet, received, 0, (const struct sockaddr*) destination, sizeof(*destination));
+        length = sizeof(source);
+    }
+}
+
+static struct sockaddr_in loopback_address(const uint16_t port) {
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    return address;
+}
+
+/**
+ * Runs the loop and its timers once, for at most 10 milliseconds
+ */
+static void run_once(const event_loop_t* loop, timer_wheel_t* timers) {
+    struct epoll_event events[16];
+    const int32_t nfds = epoll_wait(loop->epoll, events, 16, timer_wheel_timeout(timers, 10));
+    timer_wheel_advance(timers, monotonic_coarse_ms());
+    for (int32_t i = 0; i < nfds; ++i) loop_dispatch(loop, &events[i]);
+}
+
+/**
+ * Connects to the given port and sends TRANSFER_SIZE bytes through the connection, checking they come out
+ * the accepted end in order, and that closing one end closes the other
+ */
+static void transfer(utp_context_t* client, const event_loop_t* loop, timer_wheel_t* timers, const uint16_t port,
+                     const utp_accept_record_t* record) {
+    unsigned char* sent = malloc(TRANSFER_SIZE);
+    unsigned char* received = malloc(TRANSFER_SIZE);
+    for (uint32_t i = 0; i < TRANSFER_SIZE; ++i) sent[i] = (unsigned char) (i * 31 + i / 4096);
+
+    const struct sockaddr_in address = loopback_address(port);
+    const int32_t socket = utp_connect(client, &address);
+    TEST_ASSERT_TRUE(socket >= 0);
+    uint32_t written = 0;
+    uint32_t read_amount = 0;
+    const uint64_t deadline = monotonic_coarse_ms() + 10000;
+    while (read_amount < TRANSFER_SIZE && monotonic_coarse_ms() < deadline) {
+        run_once(loop, timers);
+        if (written < TRANSFER_SIZE) {
+            const ssize_t result = write(socket, sent + written, TRANSFER_SIZE - written);
+            if (result > 0) written += result;
+        }
+        if (record->socket < 0) continue;
+        const ssize_t result = read(record->socket, received + read_amount, TRANSFER_SIZE - read_amount);
+        if (result > 0) read_amount += result;
+    }
+    TEST_ASSERT_EQUAL_UINT32(TRANSFER_SIZE, read_amount);
+    TEST_ASSERT_EQUAL_MEMORY(sent, received, TRANSFER_SIZE);
+
+    // The FIN reaches the other end once everything before it is acked
+    close(socket);
+    ssize_t result = -1;
+    const uint64_t close_deadline = monotonic_coarse_ms() + 5000;
+    while (result != 0 && monotonic_coarse_ms() < close_deadline) {
+        run_once(loop, timers);
+        unsigned char byte;
+        result = read(record->socket, &byte, 1);
+    }
+    TEST_ASSERT_EQUAL_INT64(0, result);
+    close(record->socket);
+    free(sent);
+    free(received);
+}
+
+void test_utp_header_round_trip(void) {
+    const unsigned char sack[4] = {0x05, 0x00, 0x00, 0x80};
+    const utp_header_t header = {UTP_STATE, 0xBEEF, 0x01020304, 0xA0B0C0D0, 65536, 0x1234, 0xFFFF, sack, 4};
+    unsigned char packet[UTP_HEADER_SIZE + 2 + UTP_SACK_MAX + 3];
+    const uint32_t length = utp_write_header(packet, &header);
+    TEST_ASSERT_EQUAL_UINT32(UTP_HEADER_SIZE + 6, length);
+    TEST_ASSERT_EQUAL_HEX8(UTP_STATE << 4 | UTP_VERSION, packet[0]);
+    TEST_ASSERT_EQUAL_HEX8(UTP_EXTENSION_SACK, packet[1]);
+    memcpy(packet + length, "abc", 3);
+
+    utp_header_t read;
+    TEST_ASSERT_EQUAL_UINT32(length, utp_read_header(packet, length + 3, &read));
+    TEST_ASSERT_EQUAL_UINT8(UTP_STATE, read.type);
+    TEST_ASSERT_EQUAL_HEX16(0xBEEF, read.connection_id);
+    TEST_ASSERT_EQUAL_HEX32(0x01020304, read.timestamp_us);
+    TEST_ASSERT_EQUAL_HEX32(0xA0B0C0D0, read.timestamp_difference_us);
+    TEST_ASSERT_EQUAL_UINT32(65536, read.window);
+    TEST_ASSERT_EQUAL_HEX16(0x1234, read.seq_nr);
+    TEST_ASSERT_EQUAL_HEX16(0xFFFF, read.ack_nr);
+    TEST_ASSERT_EQUAL_UINT8(4, read.sack_length);
+    TEST_ASSERT_EQUAL_MEMORY(sack, read.sack, 4);
+
+    // Without a selective ack, the payload follows the fixed header
+    const utp_header_t data = {UTP_DATA, 7, 1, 2, 3, 4, 5, nullptr, 0};
+    TEST_ASSERT_EQUAL_UINT32(UTP_HEADER_SIZE, utp_write_header(packet, &data));
+    TEST_ASSERT_EQUAL_UINT32(UTP_HEADER_SIZE, utp_read_header(packet, UTP_HEADER_SIZE + 10, &read));
+    TEST_ASSERT_NULL(read.sack);
+}
+
+void test_utp_read_header_rejects_malformed(void) {
+    unsigned char packet[UTP_HEADER_SIZE + 8] = {0};
+    utp_header_t header;
+    packet[0] = UTP_DATA << 4 | UTP_VERSION;
+    TEST_ASSERT_EQUAL_UINT32(0, utp_read_header(packet, UTP_HEADER_SIZE - 1, &header));
+    // Version 0 is the old uTP nobody speaks anymore
+    packet[0] = UTP_DATA << 4;
+    TEST_ASSERT_EQUAL_UINT32(0, utp_read_header(packet, UTP_HEADER_SIZE, &header));
+    packet[0] = UTP_TYPE_COUNT << 4 | UTP_VERSION;
+    TEST_ASSERT_EQUAL_UINT32(0, utp_read_header(packet, UTP_HEADER_SIZE, &header));
+    // An extension running past the end of the datagram
+    packet[0] = UTP_DATA << 4 | UTP_VERSION;
+    packet[1] = UTP_EXTENSION_SACK;
+    packet[UTP_HEADER_SIZE] = 0;
+    packet[UTP_HEADER_SIZE + 1] = 8;
+    TEST_ASSERT_EQUAL_UINT32(0, utp_read_header(packet, UTP_HEADER_SIZE + 6, &header));
+    TEST_ASSERT_EQUAL_UINT32(UTP_HEADER_SIZE + 10, utp_read_header(packet, UTP_HEADER_SIZE + 10, &header));
+    // Unknown extensions are skipped
+    packet[1] = 2;
+    TEST_ASSERT_EQUAL_UINT32(UTP_HEADER_SIZE + 10, utp_read_header(packet, UTP_HEADER_SIZE + 10, &header));
+    TEST_ASSERT_NULL(header.sack);
+}
+
+void test_utp_ledbat_window(void) {
+    const uint32_t cwnd = 100 * UTP_PAYLOAD_MAX;
+    // A whole window acked without queuing grows it by UTP_GAIN packets
+    TEST_ASSERT_EQUAL_UINT32(cwnd + UTP_GAIN * UTP_PAYLOAD_MAX, utp_ledbat_window(cwnd, cwnd, 0, false));
+    // Right on target it stays put, and above it shrinks
+    TEST_ASSERT_EQUAL_UINT32(cwnd, utp_ledbat_window(cwnd, cwnd, UTP_TARGET_DELAY_US, false));
+    TEST_ASSERT_EQUAL_UINT32(cwnd - UTP_GAIN * UTP_PAYLOAD_MAX / 2,
+                             utp_ledbat_window(cwnd, cwnd, UTP_TARGET_DELAY_US * 3 / 2, false));
+    // No faster than it grows, however long the queue
+    TEST_ASSERT_EQUAL_UINT32(cwnd - UTP_GAIN * UTP_PAYLOAD_MAX, utp_ledbat_window(cwnd, cwnd, 5000000, false));
+    // Slow start adds whatever was acked
+    TEST_ASSERT_EQUAL_UINT32(cwnd + 3000, utp_ledbat_window(cwnd, 3000, 0, true));
+    // And the window stays within bounds
+    TEST_ASSERT_EQUAL_UINT32(UTP_MIN_WINDOW, utp_ledbat_window(UTP_MIN_WINDOW, UTP_MIN_WINDOW, 5000000, false));
+    TEST_ASSERT_EQUAL_UINT32(UTP_MAX_WINDOW, utp_ledbat_window(UTP_MAX_WINDOW, UTP_MAX_WINDOW, 0, true));
+}
+
+void test_utp_loopback_transfer(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    utp_accept_record_t record = {.socket = -1};
+    utp_context_t* server = utp_create(loop, timers, 0, accept_callback, &record, LOG_NO);
+    utp_context_t* client = utp_create(loop, timers, 0, nullptr, nullptr, LOG_NO);
+    TEST_ASSERT_NOT_NULL(server);
+    TEST_ASSERT_NOT_NULL(client);
+
+    transfer(client, loop, timers, server->port, &record);
+    TEST_ASSERT_EQUAL_HEX32(INADDR_LOOPBACK, ntohl(record.address.sin_addr.s_addr));
+    TEST_ASSERT_EQUAL_UINT16(client->port, ntohs(record.address.sin_port));
+    // Both sides forget the connection once it's closed
+    const uint64_t deadline = monotonic_coarse_ms() + 2000;
+    while ((client->connection_amount > 0 || server->connection_amount > 0) && monotonic_coarse_ms() < deadline) {
+        run_once(loop, timers);
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, client->connection_amount);
+    TEST_ASSERT_EQUAL_UINT32(0, server->connection_amount);
+
+    utp_free(client);
+    utp_free(server);
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
+
+void test_utp_lossy_transfer(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    utp_accept_record_t record = {.socket = -1};
+    utp_context_t* server = utp_create(loop, timers, 0, accept_callback, &record, LOG_NO);
+    utp_context_t* client = utp_create(loop, timers, 0, nullptr, nullptr, LOG_NO);
+    TEST_ASSERT_NOT_NULL(server);
+    TEST_ASSERT_NOT_NULL(client);
+
+    utp_relay_t relay = {0};
+    relay.socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    relay.server = loopback_address(server->port);
+    struct sockaddr_in relay_address = loopback_address(0);
+    socklen_t length = sizeof(relay_address);
+    TEST_ASSERT_EQUAL_INT32(0, bind(relay.socket, (struct sockaddr*) &relay_address, sizeof(relay_address)));
+    getsockname(relay.socket, (struct sockaddr*) &relay_address, &length);
+    const int32_t slot = loop_add_source(loop, relay.socket, EPOLLIN, on_relay_readable, &relay);
+    TEST_ASSERT_TRUE(slot >= 0);
+
+    const uint64_t retransmits = metrics_counter_value(METRIC_UTP_RETRANSMITS);
+    transfer(client, loop, timers, ntohs(relay_address.sin_port), &record);
+    TEST_ASSERT_TRUE(metrics_counter_value(METRIC_UTP_RETRANSMITS) > retransmits);
+
+    loop_remove_source(loop, slot);
+    close(relay.socket);
+    utp_free(client);
+    utp_free(server);
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
+
+void test_utp_unreachable_port_closes(void) {
+    event_loop_t* loop = loop_create();
+    timer_wheel_t* timers = timer_wheel_create(monotonic_coarse_ms());
+    utp_context_t* client = utp_create(loop, timers, 0, nullptr, nullptr, LOG_NO);
+    TEST_ASSERT_NOT_NULL(client);
+    // A port nobody listens on, which answers with an ICMP error
+    const int32_t probe = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in address = loopback_address(0);
+    socklen_t length = sizeof(address);
+    bind(probe, (struct sockaddr*) &address, sizeof(address));
+    getsockname(probe, (struct sockaddr*) &address, &length);
+    close(probe);
+
+    const int32_t socket = utp_connect(client, &address);
+    TEST_ASSERT_TRUE(socket >= 0);
+    // Well before the SYN would time out
+    ssize_t result = -1;
+    const uint64_t deadline = monotonic_coarse_ms() + UTP_INITIAL_RTO_MS / 2;
+    while (result < 0 && monotonic_coarse_ms() < deadline) {
+        run_once(loop, timers);
+        unsigned char byte;
+        result = read(socket, &byte, 1);
+    }
+    TEST_ASSERT_EQUAL_INT64(0, result);
+    TEST_ASSERT_EQUAL_UINT32(0, client->connection_amount);
+
+    close(socket);
+    utp_free(client);
+    timer_wheel_free(timers);
+    loop_free(loop);
+}
@@ -0,0 +1,11 @@
+#ifndef BITTORRENT_CLIENT_TEST_UTP_H
+#define BITTORRENT_CLIENT_TEST_UTP_H
+
+void test_utp_header_round_trip(void);
+void test_utp_read_header_rejects_malformed(void);
+void test_utp_ledbat_window(void);
+void test_utp_loopback_transfer(void);
+void test_utp_lossy_transfer(void);
+void test_utp_unreachable_port_closes(void);
+
+#endif //BITTORRENT_CLIENT_TEST_UTP_H
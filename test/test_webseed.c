@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "unity.h"
+#include "../src/webseed.h"
+
+/*
+ * A torrent named "name" with pieces of 8 bytes and three files: "a.bin" (5 bytes), "empty" (0 bytes) and
+ * "sub dir/b.bin" (7 bytes). Piece 0 spans a.bin and the start of b.bin, piece 1 is the rest of b.bin
+ */
+static const char a_content[] = "abcde";
+static const char b_content[] = "fghijkl";
+static ll b_path_file = {nullptr, "b.bin"};
+static ll b_path = {&b_path_file, "sub dir"};
+static ll empty_path = {nullptr, "empty"};
+static ll a_path = {nullptr, "a.bin"};
+static files_ll b_file = {.length = 7, .path = &b_path, .byte_index = 5};
+static files_ll empty_file = {.next = &b_file, .path = &empty_path, .byte_index = 5};
+static files_ll a_file = {.next = &empty_file, .length = 5, .path = &a_path};
+
+static info_t webseed_info(void) {
+    info_t info = {0};
+    info.files = &a_file;
+    info.length = 12;
+    info.name = "name";
+    info.piece_length = 8;
+    info.piece_number = 2;
+    return info;
+}
+
+void test_webseed_ranges(void) {
+    const info_t info = webseed_info();
+    webseed_range_t ranges[4];
+    TEST_ASSERT_EQUAL_UINT32(2, webseed_ranges(&info, 0, 8, ranges, 4));
+    TEST_ASSERT_EQUAL_PTR(&a_file, ranges[0].file);
+    TEST_ASSERT_EQUAL_UINT64(0, ranges[0].offset);
+    TEST_ASSERT_EQUAL_UINT64(5, ranges[0].length);
+    // The empty file in between is skipped
+    TEST_ASSERT_EQUAL_PTR(&b_file, ranges[1].file);
+    TEST_ASSERT_EQUAL_UINT64(0, ranges[1].offset);
+    TEST_ASSERT_EQUAL_UINT64(3, ranges[1].length);
+
+    TEST_ASSERT_EQUAL_UINT32(1, webseed_ranges(&info, 8, 4, ranges, 4));
+    TEST_ASSERT_EQUAL_PTR(&b_file, ranges[0].file);
+    TEST_ASSERT_EQUAL_UINT64(3, ranges[0].offset);
+    TEST_ASSERT_EQUAL_UINT64(4, ranges[0].length);
+
+    // Counting only, and past the end
+    TEST_ASSERT_EQUAL_UINT32(2, webseed_ranges(&info, 0, 12, nullptr, 0));
+    TEST_ASSERT_EQUAL_UINT32(0, webseed_ranges(&info, 8, 5, ranges, 4));
+}
+
+void test_webseed_file_url(void) {
+    info_t info = webseed_info();
+    char* url = webseed_file_url("http://mirror.example/files", &info, &b_file);
+    TEST_ASSERT_EQUAL_STRING("http://mirror.example/files/name/sub%20dir/b.bin", url);
+    free(url);
+    url = webseed_file_url("http://mirror.example/files/", &info, &a_file);
+    TEST_ASSERT_EQUAL_STRING("http://mirror.example/files/name/a.bin", url);
+    free(url);
+
+    // A single file is the URL itself, unless it names a directory
+    files_ll single = {.length = 12};
+    info.files = &single;
+    url = webseed_file_url("http://mirror.example/file.iso", &info, &single);
+    TEST_ASSERT_EQUAL_STRING("http://mirror.example/file.iso", url);
+    free(url);
+    url = webseed_file_url("http://mirror.example/", &info, &single);
+    TEST_ASSERT_EQUAL_STRING("http://mirror.example/name", url);
+    free(url);
+}
+
+/// @brief Connections the fake web seed serves at once
+#define FAKE_WEBSEED_CONNECTIONS 8
+
+/// @brief A connection to the fake web seed
+typedef struct {
+    int32_t fd;
+    int32_t slot;
+    char request[2048];
+    uint32_t request_length;
+    struct fake_webseed_t *server;
+} fake_webseed_connection_t;
+
+/// @brief Local HTTP server holding the files of webseed_info(), answering range requests
+typedef struct fake_webseed_t {
+    event_loop_t *loop;
+    int32_t listen_fd;
+    int32_t listen_slot;
+    uint16_t port;
+    fake_webseed_connection_t connections[FAKE_WEBSEED_CONNECTIONS];
+    uint32_t requests;
+    bool ignore_range; /**< Whether whole files are sent, as servers without range support do */
+} fake_webseed_t;
+
+static void close_fake_connection(fake_webseed_connection_t* connection) {
+    if (connection->fd < 0) return;
+    loop_remove_source(connection->server->loop, connection->slot);
+    close(connection->fd);
+    connection->fd = -1;
+    connection->request_length = 0;
+}
+
+static void fake_webseed_readable(void* ctx, const uint32_t events) {
+    (void) events;
+    fake_webseed_connection_t* connection = ctx;
+    fake_webseed_t* server = connection->server;
+    const ssize_t received = recv(connection->fd, connection->request + connection->request_length,
+                                  sizeof(connection->request) - 1 - connection->request_length, 0);
+    if (received > 0) connection->request_length += received;
+    connection->request[connection->request_length] = '\0';
+    if (received > 0 && strstr(connection->request, "\r\n\r\n") == nullptr) return;
+
+    if (received > 0) {
+        server->requests++;
+        const char* content = nullptr;
+        if (strncmp(connection->request, "GET /name/a.bin ", 16) == 0) content = a_content;
+        if (strncmp(connection->request, "GET /name/sub%20dir/b.bin ", 26) == 0) content = b_content;
+        unsigned long first = 0;
+        unsigned long last = content ? strlen(content) - 1 : 0;
+        const char* range = strstr(connection->request, "Range: bytes=");
+        const bool partial = range && !server->ignore_range && sscanf(range, "Range: bytes=%lu-%lu", &first, &last) == 2;
+        char header[160];
+        int header_length;
+        if (!content) {
+            header_length = snprintf(header, sizeof(header),
+                                     "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        } else {
+            header_length = snprintf(header, sizeof(header),
+                                     "HTTP/1.1 %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+                                     partial ? "206 Partial Content" : "200 OK", last - first + 1);
+        }
+        send(connection->fd, header, header_length, MSG_NOSIGNAL);
+        if (content) send(connection->fd, content + first, last - first + 1, MSG_NOSIGNAL);
+    }
+    close_fake_connection(connection);
+}
+
+static void fake_webseed_acceptable(void* ctx, const uint32_t events) {
+    (void) events;
+    fake_webseed_t* server = ctx;
+    int32_t fd;
+    while ((fd = accept4(server->listen_fd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+        fake_webseed_connection_t* connection = nullptr;
+        for (uint32_t i = 0; i < FAKE_WEBSEED_CONNECTIONS && !connection; ++i) {
+            if (server->connections[i].fd < 0) connection = &server->connections[i];
+        }
+        if (!connection) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->slot = loop_add_source(server->loop, fd, EPOLLIN, fake_webseed_readable, connection);
+    }
+}
+
+static void open_fake_webseed(fake_webseed_t* server, event_loop_t* loop) {
+    memset(server, 0, sizeof(fake_webseed_t));
+    server->loop = loop;
+    for (uint32_t i = 0; i < FAKE_WEBSEED_CONNECTIONS; ++i) {
+        server->connections[i].fd = -1;
+        server->connections[i].server = server;
+    }
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(server->listen_fd, (struct sockaddr*) &addr, sizeof(addr));
+    listen(server->listen_fd, 8);
+    socklen_t len = sizeof(addr);
+    getsockname(server->listen_fd, (struct sockaddr*) &addr, &len);
+    server->port = ntohs(addr.sin_port);
+    server->listen_slot = loop_add_source(loop, server->listen_fd, EPOLLIN, fake_webseed_acceptable, server);
+}
+
+static void close_fake_webseed(fake_webseed_t* server) {
+    for (uint32_t i = 0; i < FAKE_WEBSEED_CONNECTIONS; ++i) close_fake_connection(&server->connections[i]);
+    loop_remove_source(server->loop, server->listen_slot);
+    close(server->listen_fd);
+}
+
+/// @brief Pieces webseed_piece_callback() got
+typedef struct {
+    uint32_t calls;
+    uint32_t failed;
+    unsigned char pieces[2][8];
+    uint32_t lengths[2];
+} webseed_record_t;
+
+static void webseed_piece_callback(void* ctx, webseed_t* seed, const uint32_t piece, const unsigned char* data,
+                                   const uint32_t length) {
+    (void) seed;
+    webseed_record_t* record = ctx;
+    record->calls++;
+    if (!data) {
+        record->failed++;
+        return;
+    }
+    TEST_ASSERT_TRUE(piece < 2 && length <= 8);
+    memcpy(record->pieces[piece], data, length);
+    record->lengths[piece] = length;
+}
+
+static void run_webseed_loop(event_loop_t* loop, const uint32_t* calls, const uint32_t expected_calls) {
+    struct epoll_event events[8];
+    const uint64_t deadline = monotonic_coarse_ms() + 3000;
+    while (*calls < expected_calls && monotonic_coarse_ms() < deadline) {
+        const int32_t nfds = epoll_wait(loop->epoll, events, 8, 20);
+        for (int32_t i = 0; i < nfds; ++i) TEST_ASSERT_TRUE(loop_dispatch(loop, &events[i]));
+    }
+}
+
+void test_webseed_fetch(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    event_loop_t* loop = loop_create();
+    http_client_t* client = http_client_create(loop, LOG_NO);
+    TEST_ASSERT_NOT_NULL(client);
+    fake_webseed_t server;
+    open_fake_webseed(&server, loop);
+    const info_t info = webseed_info();
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/", server.port);
+    webseed_record_t record = {0};
+    webseed_t* seed = webseed_create(client, url, &info, webseed_piece_callback, &record, LOG_NO);
+    TEST_ASSERT_NOT_NULL(seed);
+
+    // Both pieces at once, the first one from two files
+    TEST_ASSERT_TRUE(webseed_fetch(seed, 0));
+    TEST_ASSERT_TRUE(webseed_fetch(seed, 1));
+    TEST_ASSERT_EQUAL_UINT32(2, seed->active);
+    TEST_ASSERT_FALSE(webseed_fetch(seed, 2));
+    run_webseed_loop(loop, &record.calls, 2);
+    TEST_ASSERT_EQUAL_UINT32(2, record.calls);
+    TEST_ASSERT_EQUAL_UINT32(0, record.failed);
+    TEST_ASSERT_EQUAL_UINT32(3, server.requests);
+    TEST_ASSERT_EQUAL_UINT32(8, record.lengths[0]);
+    TEST_ASSERT_EQUAL_MEMORY("abcdefgh", record.pieces[0], 8);
+    TEST_ASSERT_EQUAL_UINT32(4, record.lengths[1]);
+    TEST_ASSERT_EQUAL_MEMORY("ijkl", record.pieces[1], 4);
+    TEST_ASSERT_EQUAL_UINT32(0, seed->active);
+    TEST_ASSERT_TRUE(webseed_ready(seed, monotonic_coarse_ms()));
+
+    // Servers ignoring the range send whole files, too long for the piece
+    server.ignore_range = true;
+    record.calls = 0;
+    TEST_ASSERT_TRUE(webseed_fetch(seed, 1));
+    run_webseed_loop(loop, &record.calls, 1);
+    TEST_ASSERT_EQUAL_UINT32(1, record.calls);
+    TEST_ASSERT_EQUAL_UINT32(1, record.failed);
+    TEST_ASSERT_EQUAL_UINT32(1, seed->failures);
+    // Resting after the failure
+    TEST_ASSERT_FALSE(webseed_ready(seed, monotonic_coarse_ms()));
+
+    webseed_free(seed);
+    close_fake_webseed(&server);
+    http_client_free(client);
+    loop_free(loop);
+    curl_global_cleanup();
+}
+
+void test_webseed_missing_file(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    event_loop_t* loop = loop_create();
+    http_client_t* client = http_client_create(loop, LOG_NO);
+    fake_webseed_t server;
+    open_fake_webseed(&server, loop);
+    const info_t info = webseed_info();
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%u/elsewhere/", server.port);
+    webseed_record_t record = {0};
+    webseed_t* seed = webseed_create(client, url, &info, webseed_piece_callback, &record, LOG_NO);
+
+    TEST_ASSERT_TRUE(webseed_fetch(seed, 0));
+    run_webseed_loop(loop, &record.calls, 1);
+    TEST_ASSERT_EQUAL_UINT32(1, record.calls);
+    TEST_ASSERT_EQUAL_UINT32(1, record.failed);
+
+    // Freeing a web seed with pieces in flight never calls back
+    seed->retry_ms = 0;
+    TEST_ASSERT_TRUE(webseed_fetch(seed, 1));
+    webseed_free(seed);
+    TEST_ASSERT_NULL(client->requests);
+
+    close_fake_webseed(&server);
+    http_client_free(client);
+    loop_free(loop);
+    curl_global_cleanup();
+}
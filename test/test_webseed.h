@@ -0,0 +1,9 @@
+#ifndef BITTORRENT_CLIENT_TEST_WEBSEED_H
+#define BITTORRENT_CLIENT_TEST_WEBSEED_H
+
+void test_webseed_ranges(void);
+void test_webseed_file_url(void);
+void test_webseed_fetch(void);
+void test_webseed_missing_file(void);
+
+#endif //BITTORRENT_CLIENT_TEST_WEBSEED_H